@@ -0,0 +1,21 @@
+#!/usr/bin/env bash
+# Copyright 2024, Collabora, Ltd.
+#
+# SPDX-License-Identifier: BSL-1.0
+
+# Run the client benchmarks on the device, after ./gradlew assembleDebug built them.
+# Any arguments are passed on to the Catch2 binary.
+
+set -e
+
+BIN=$(find app/.cxx -type f -name bench_hot_paths -path "*arm64-v8a*" | head -n 1)
+STL=$(find app/build -type f -name libc++_shared.so -path "*arm64-v8a*" | head -n 1)
+if [ -z "$BIN" ] || [ -z "$STL" ]; then
+	echo "bench_hot_paths or libc++_shared.so not found, run ./gradlew assembleDebug first"
+	exit 1
+fi
+
+DIR=/data/local/tmp/electricmaple_bench
+adb shell mkdir -p "$DIR"
+adb push "$BIN" "$STL" "$DIR/"
+adb shell "cd $DIR && LD_LIBRARY_PATH=. ./bench_hot_paths $*"
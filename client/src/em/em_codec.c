@@ -0,0 +1,145 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Codecs the client can receive and how to pick a decoder for them.
+ * @ingroup em_client
+ */
+
+#include "em_codec.h"
+#include "em_app_log.h"
+
+#include <gst/gst.h>
+
+#include <string.h>
+
+
+static const struct em_codec_descriptor codecs[] = {
+    [EM_CODEC_H264] =
+        {
+            .codec = EM_CODEC_H264,
+            .encoding_name = "H264",
+            .depayloader = "rtph264depay",
+            .parser = "h264parse",
+            .parsed_caps = "video/x-h264,stream-format=(string)byte-stream,alignment=(string)au,parsed=(boolean)true",
+            .slice_caps = "video/x-h264,stream-format=(string)byte-stream,alignment=(string)nal,parsed=(boolean)true",
+            .mime = "video/avc",
+        },
+    [EM_CODEC_H265] =
+        {
+            .codec = EM_CODEC_H265,
+            .encoding_name = "H265",
+            .depayloader = "rtph265depay",
+            .parser = "h265parse",
+            .parsed_caps = "video/x-h265,stream-format=(string)byte-stream,alignment=(string)au,parsed=(boolean)true",
+            .slice_caps = "video/x-h265,stream-format=(string)byte-stream,alignment=(string)nal,parsed=(boolean)true",
+            .mime = "video/hevc",
+        },
+    [EM_CODEC_AV1] =
+        {
+            .codec = EM_CODEC_AV1,
+            .encoding_name = "AV1",
+            .depayloader = "rtpav1depay",
+            .parser = "av1parse",
+            .parsed_caps = "video/x-av1,stream-format=(string)obu-stream,alignment=(string)tu,parsed=(boolean)true",
+            .slice_caps = NULL,
+            .mime = "video/av01",
+        },
+};
+
+/*!
+ * Software decoders of the platform, they work but a frame takes several milliseconds longer.
+ */
+static const char *software_decoder_patterns[] = {
+    "google",
+    "c2android",
+    "avdec",
+    "dav1d",
+};
+
+static gint
+decoder_score(GstElementFactory *factory)
+{
+	const gchar *name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory));
+
+	// Secure decoders only output into protected buffers, and hold more frames for it.
+	if (strstr(name, "secure") != NULL) {
+		return -1;
+	}
+
+	gint score = (gint)gst_plugin_feature_get_rank(GST_PLUGIN_FEATURE(factory));
+
+	const gchar *klass = gst_element_factory_get_metadata(factory, GST_ELEMENT_METADATA_KLASS);
+	if (klass != NULL && strstr(klass, "Hardware") != NULL) {
+		score += 1000;
+	}
+
+	for (size_t i = 0; i < G_N_ELEMENTS(software_decoder_patterns); i++) {
+		if (strstr(name, software_decoder_patterns[i]) != NULL) {
+			score -= 1000;
+			break;
+		}
+	}
+
+	// Never drop below the secure ones.
+	return MAX(score, 0);
+}
+
+
+/*
+ *
+ * Exported functions.
+ *
+ */
+
+const struct em_codec_descriptor *
+em_codec_from_encoding_name(const char *encoding_name)
+{
+	if (encoding_name == NULL) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < G_N_ELEMENTS(codecs); i++) {
+		if (g_ascii_strcasecmp(codecs[i].encoding_name, encoding_name) == 0) {
+			return &codecs[i];
+		}
+	}
+	return NULL;
+}
+
+gchar *
+em_codec_find_decoder(const struct em_codec_descriptor *codec)
+{
+	g_autoptr(GstCaps) caps = gst_caps_from_string(codec->parsed_caps);
+
+	GList *decoders = gst_element_factory_list_get_elements(
+	    GST_ELEMENT_FACTORY_TYPE_DECODER | GST_ELEMENT_FACTORY_TYPE_MEDIA_VIDEO, GST_RANK_NONE);
+	GList *matching = gst_element_factory_list_filter(decoders, caps, GST_PAD_SINK, FALSE);
+	gst_plugin_feature_list_free(decoders);
+
+	GstElementFactory *best = NULL;
+	gint best_score = -1;
+	for (GList *l = matching; l != NULL; l = l->next) {
+		GstElementFactory *factory = GST_ELEMENT_FACTORY(l->data);
+		gint score = decoder_score(factory);
+		ALOGI("%s: %s decoder %s, score %d", __FUNCTION__, codec->encoding_name,
+		      gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)), score);
+		if (score > best_score) {
+			best = factory;
+			best_score = score;
+		}
+	}
+
+	gchar *ret = NULL;
+	if (best != NULL) {
+		ret = g_strdup(gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(best)));
+		ALOGI("%s: Using %s for %s", __FUNCTION__, ret, codec->encoding_name);
+	} else {
+		ALOGE("%s: No decoder for %s", __FUNCTION__, codec->encoding_name);
+	}
+
+	gst_plugin_feature_list_free(matching);
+	return ret;
+}
@@ -0,0 +1,69 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Codecs the client can receive and how to pick a decoder for them.
+ * @ingroup em_client
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+	EM_CODEC_H264,
+	EM_CODEC_H265,
+	EM_CODEC_AV1,
+} EmCodec;
+
+/*!
+ * Everything between webrtcbin and the decoder that depends on the codec.
+ */
+struct em_codec_descriptor
+{
+	EmCodec codec;
+
+	//! The SDP encoding name, as on the webrtcbin src pad caps.
+	const char *encoding_name;
+
+	//! Depayloader element.
+	const char *depayloader;
+
+	//! Parser element.
+	const char *parser;
+
+	//! Parsed caps, whole access units the way MediaCodec wants them.
+	const char *parsed_caps;
+
+	//! Parsed caps with one NAL unit per buffer, for handing MediaCodec the slices as they arrive. NULL if the
+	//! codec has no such alignment.
+	const char *slice_caps;
+
+	//! MediaCodec mime type.
+	const char *mime;
+};
+
+/*!
+ * Look up a codec by the encoding name the server negotiated.
+ *
+ * @return NULL if we can't decode it
+ */
+const struct em_codec_descriptor *
+em_codec_from_encoding_name(const char *encoding_name);
+
+/*!
+ * Find the decoder element factory with the lowest expected latency for @p codec.
+ *
+ * Prefers hardware over software decoders, and skips secure decoders, which add buffering for the protected path.
+ *
+ * @return factory name to free with g_free, or NULL if there is no decoder
+ */
+gchar *
+em_codec_find_decoder(const struct em_codec_descriptor *codec);
+
+G_END_DECLS
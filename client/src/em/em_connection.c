@@ -16,7 +16,10 @@
 
 #include "em_status.h"
 #include "em_app_log.h"
+#include "em_compact.h"
 
+#include <gio/gio.h>
+#include <gst/gst.h>
 #include <gst/gstelement.h>
 #include <gst/gstobject.h>
 #include <stdbool.h>
@@ -46,8 +49,51 @@ struct _EmConnection
 	GstPipeline *pipeline;
 	GstElement *webrtcbin;
 	GstWebRTCDataChannel *datachannel;
+	//! Unordered and without retransmits, for tracking. NULL if the server did not open one.
+	GstWebRTCDataChannel *tracking_datachannel;
 
 	enum em_status status;
+
+	//! Time base offered for compact UpMessages, 0 to stay with protobuf.
+	int64_t compact_epoch;
+	//! Compact version we answered with, 0 for protobuf. Read from the render thread.
+	gint compact_version;
+	//! Version the server offered, answered once the answer is created.
+	gint offered_compact_version;
+
+	//! Sent with every answer, so the server knows us again when we reconnect.
+	gchar *identity;
+
+	//! Display refresh rates we can switch to, as gfloat. Sent with the answer, empty if we can't switch.
+	GArray *refresh_rates;
+	//! Rate the server streams at in hundredths of Hz, 0 until it told us. Read from the render thread.
+	gint refresh_rate_centihz;
+
+	//! What the server asks the jitterbuffer to wait for FEC or retransmissions, in ms.
+	guint loss_latency_ms;
+	//! What the jitter of the stream asks for, in ms. Set from the streaming thread.
+	guint jitter_latency_ms;
+
+	/*!
+	 * Plain RTP or SRT from the server instead of WebRTC, see @ref em_connection_new_direct. The UpMessages go to
+	 * the server over @ref socket either way.
+	 */
+	struct
+	{
+		//! NULL to negotiate WebRTC.
+		gchar *uri;
+		bool srt;
+		gchar *host;
+		gint port;
+		gchar *encoding_name;
+
+		//! Connected to the server's port, the RTP arrives on it too.
+		GSocket *socket;
+		guint keepalive_src_id;
+
+		//! In the source, takes the latency the webrtcbin would otherwise get.
+		GstElement *jitterbuffer;
+	} direct;
 };
 
 
@@ -74,6 +120,7 @@ static guint signals[N_SIGNALS];
 typedef enum
 {
 	PROP_WEBSOCKET_URI = 1,
+	PROP_DIRECT_URI,
 	// PROP_STATUS,
 	N_PROPERTIES
 } EmConnectionProperty;
@@ -84,6 +131,14 @@ static GParamSpec *properties[N_PROPERTIES] = {
 
 #define DEFAULT_WEBSOCKET_URI "ws://127.0.0.1:8080/ws"
 
+//! Must match the default of --direct-port on the server.
+#define DEFAULT_DIRECT_PORT 61990
+
+//! How often we tell the server we're still there in direct mode, it only learns about us from our datagrams.
+#define DIRECT_KEEPALIVE_INTERVAL_S 1
+//! What the keepalives say, the server only streams to a sender of these. Must match DIRECT_HELLO in the server.
+#define DIRECT_HELLO "EMHELLO1"
+
 
 /* GObject method implementations */
 
@@ -98,6 +153,10 @@ em_connection_set_property(GObject *object, guint property_id, const GValue *val
 		self->websocket_uri = g_value_dup_string(value);
 		ALOGI("RYLIE: websocket URI assigned; %s", self->websocket_uri);
 		break;
+	case PROP_DIRECT_URI:
+		g_free(self->direct.uri);
+		self->direct.uri = g_value_dup_string(value);
+		break;
 
 
 	default: G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec); break;
@@ -111,6 +170,7 @@ em_connection_get_property(GObject *object, guint property_id, GValue *value, GP
 
 	switch ((EmConnectionProperty)property_id) {
 	case PROP_WEBSOCKET_URI: g_value_set_string(value, self->websocket_uri); break;
+	case PROP_DIRECT_URI: g_value_set_string(value, self->direct.uri); break;
 
 	default: G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec); break;
 	}
@@ -122,6 +182,8 @@ em_connection_init(EmConnection *emconn)
 	emconn->ws_cancel = g_cancellable_new();
 	emconn->soup_session = soup_session_new();
 	emconn->websocket_uri = g_strdup(DEFAULT_WEBSOCKET_URI);
+	emconn->identity = g_uuid_string_random();
+	emconn->refresh_rates = g_array_new(FALSE, FALSE, sizeof(gfloat));
 }
 
 static void
@@ -141,6 +203,11 @@ em_connection_finalize(GObject *object)
 	EmConnection *self = EM_CONNECTION(object);
 
 	g_free(self->websocket_uri);
+	g_free(self->identity);
+	g_array_unref(self->refresh_rates);
+	g_free(self->direct.uri);
+	g_free(self->direct.host);
+	g_free(self->direct.encoding_name);
 }
 
 static void
@@ -166,6 +233,17 @@ em_connection_class_init(EmConnectionClass *klass)
 	                        DEFAULT_WEBSOCKET_URI /* default value */,
 	                        G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+	/**
+	 * EmConnection:direct-uri:
+	 *
+	 * rtp://host:port or srt://host:port to skip WebRTC, NULL to negotiate it
+	 */
+	g_object_class_install_property(
+	    gobject_class, PROP_DIRECT_URI,
+	    g_param_spec_string("direct-uri", "Direct URI", "Server to receive plain RTP or SRT from, without WebRTC.",
+	                        NULL /* default value */,
+	                        G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
 	/**
 	 * EmConnection::connect
 	 * @object: the #EmConnection
@@ -304,9 +382,22 @@ emconn_disconnect_internal(EmConnection *emconn, enum em_status status)
 	}
 	g_clear_object(&emconn->ws);
 
+	g_clear_handle_id(&emconn->direct.keepalive_src_id, g_source_remove);
+	if (emconn->direct.socket != NULL) {
+		g_socket_close(emconn->direct.socket, NULL);
+		g_clear_object(&emconn->direct.socket);
+	}
+	gst_clear_object(&emconn->direct.jitterbuffer);
+
 	gst_clear_object(&emconn->webrtcbin);
 	gst_clear_object(&emconn->datachannel);
+	gst_clear_object(&emconn->tracking_datachannel);
 	gst_clear_object(&emconn->pipeline);
+	g_atomic_int_set(&emconn->compact_version, 0);
+	emconn->offered_compact_version = 0;
+	g_atomic_int_set(&emconn->refresh_rate_centihz, 0);
+	emconn->loss_latency_ms = 0;
+	g_atomic_int_set(&emconn->jitter_latency_ms, 0);
 	emconn_update_status(emconn, status);
 }
 
@@ -358,11 +449,53 @@ emconn_webrtc_prepare_data_channel_cb(GstElement *webrtc,
 	g_signal_connect(data_channel, "on-message-string", G_CALLBACK(emconn_data_channel_message_string_cb), emconn);
 }
 
+/*!
+ * The jitterbuffer waits for whichever is longer, the recovery the server set up or the jitter of the link.
+ */
+static void
+emconn_apply_latency(EmConnection *emconn)
+{
+	GstElement *element = emconn->webrtcbin != NULL ? emconn->webrtcbin : emconn->direct.jitterbuffer;
+	if (element == NULL) {
+		return;
+	}
+	guint latency_ms = MAX(emconn->loss_latency_ms, (guint)g_atomic_int_get(&emconn->jitter_latency_ms));
+	guint current_ms = 0;
+	g_object_get(element, "latency", &current_ms, NULL);
+	if (latency_ms != current_ms) {
+		g_object_set(element, "latency", latency_ms, NULL);
+	}
+}
+
+static gboolean
+emconn_apply_latency_cb(gpointer user_data)
+{
+	emconn_apply_latency(EM_CONNECTION(user_data));
+	return G_SOURCE_REMOVE;
+}
+
+static void
+emconn_webrtc_on_new_transceiver_cb(GstElement *webrtcbin, GstWebRTCRTPTransceiver *transceiver, EmConnection *emconn)
+{
+	// Ask for what is lost, the server only retransmits if it offered to.
+	g_object_set(transceiver, "do-nack", TRUE, NULL);
+}
+
 static void
 emconn_webrtc_on_data_channel_cb(GstElement *webrtcbin, GstWebRTCDataChannel *data_channel, EmConnection *emconn)
 {
 
-	ALOGI("Successfully created datachannel");
+	gchar *label = NULL;
+	g_object_get(data_channel, "label", &label, NULL);
+	ALOGI("Successfully created datachannel %s", label);
+
+	if (g_strcmp0(label, EM_TRACKING_DATA_CHANNEL_LABEL) == 0) {
+		g_assert_null(emconn->tracking_datachannel);
+		emconn->tracking_datachannel = GST_WEBRTC_DATA_CHANNEL(data_channel);
+		g_free(label);
+		return;
+	}
+	g_free(label);
 
 	g_assert_null(emconn->datachannel);
 
@@ -388,12 +521,36 @@ emconn_send_sdp_answer(EmConnection *emconn, const gchar *sdp)
 
 	json_builder_set_member_name(builder, "sdp");
 	json_builder_add_string_value(builder, sdp);
+
+	json_builder_set_member_name(builder, "client-identity");
+	json_builder_add_string_value(builder, emconn->identity);
+
+	// We only write the first version, any server offering one reads it too.
+	gint compact_version = emconn->offered_compact_version >= 1 && emconn->compact_epoch != 0 ? 1 : 0;
+	if (compact_version != 0) {
+		json_builder_set_member_name(builder, "compact-version");
+		json_builder_add_int_value(builder, compact_version);
+		json_builder_set_member_name(builder, "compact-epoch");
+		json_builder_add_int_value(builder, emconn->compact_epoch);
+	}
+
+	// The server picks the stream's frame rate from these and tells us which one.
+	if (emconn->refresh_rates->len > 0) {
+		json_builder_set_member_name(builder, "refresh-rates");
+		json_builder_begin_array(builder);
+		for (guint i = 0; i < emconn->refresh_rates->len; i++) {
+			json_builder_add_double_value(builder, g_array_index(emconn->refresh_rates, gfloat, i));
+		}
+		json_builder_end_array(builder);
+	}
 	json_builder_end_object(builder);
 
 	root = json_builder_get_root(builder);
 
 	msg_str = json_to_string(root, TRUE);
 	soup_websocket_connection_send_text(emconn->ws, msg_str);
+	// The data channels only open after the answer, the server knows the format by then.
+	g_atomic_int_set(&emconn->compact_version, compact_version);
 	g_clear_pointer(&msg_str, g_free);
 
 	json_node_unref(root);
@@ -531,6 +688,9 @@ emconn_on_ws_message_cb(SoupWebsocketConnection *connection, gint type, GBytes *
 
 		if (g_str_equal(msg_type, "offer")) {
 			const gchar *offer_sdp = json_object_get_string_member(msg, "sdp");
+			emconn->offered_compact_version = json_object_has_member(msg, "compact-version")
+			                                      ? (gint)json_object_get_int_member(msg, "compact-version")
+			                                      : 0;
 			emconn_webrtc_process_sdp_offer(emconn, offer_sdp);
 		} else if (g_str_equal(msg_type, "candidate")) {
 			JsonObject *candidate;
@@ -539,6 +699,16 @@ emconn_on_ws_message_cb(SoupWebsocketConnection *connection, gint type, GBytes *
 
 			emconn_webrtc_process_candidate(emconn, json_object_get_int_member(candidate, "sdpMLineIndex"),
 			                                json_object_get_string_member(candidate, "candidate"));
+		} else if (g_str_equal(msg_type, "refresh-rate")) {
+			gdouble rate = json_object_get_double_member(msg, "refresh-rate");
+			ALOGI("Server streams at %.2f Hz", rate);
+			g_atomic_int_set(&emconn->refresh_rate_centihz, (gint)(rate * 100.0 + 0.5));
+		} else if (g_str_equal(msg_type, "loss-protection")) {
+			// Zero unless the link is lossy, then long enough for the FEC or a retransmission to arrive.
+			guint latency_ms = (guint)MAX(json_object_get_int_member(msg, "latency"), 0);
+			ALOGI("Server protects against loss, waiting %u ms for lost packets", latency_ms);
+			emconn->loss_latency_ms = latency_ms;
+			emconn_apply_latency(emconn);
 		}
 	} else {
 		g_debug("Error parsing message: %s", error->message);
@@ -601,6 +771,11 @@ em_connection_set_pipeline(EmConnection *emconn, GstPipeline *pipeline)
 	gst_clear_object(&emconn->pipeline);
 	emconn->pipeline = gst_object_ref_sink(pipeline);
 
+	// Nothing to negotiate.
+	if (emconn->direct.uri != NULL) {
+		return;
+	}
+
 	emconn_update_status(emconn, EM_STATUS_NEGOTIATING);
 
 	ALOGI("RYLIE: getting webrtcbin");
@@ -611,14 +786,129 @@ em_connection_set_pipeline(EmConnection *emconn, GstPipeline *pipeline)
 	g_signal_connect(emconn->webrtcbin, "prepare-data-channel", G_CALLBACK(emconn_webrtc_prepare_data_channel_cb),
 	                 emconn);
 	g_signal_connect(emconn->webrtcbin, "on-data-channel", G_CALLBACK(emconn_webrtc_on_data_channel_cb), emconn);
+	g_signal_connect(emconn->webrtcbin, "on-new-transceiver", G_CALLBACK(emconn_webrtc_on_new_transceiver_cb),
+	                 emconn);
 	g_signal_connect(emconn->webrtcbin, "deep-notify::connection-state",
 	                 G_CALLBACK(emconn_webrtc_deep_notify_callback), emconn);
 }
 
+static gboolean
+emconn_direct_keepalive_cb(gpointer user_data)
+{
+	EmConnection *emconn = EM_CONNECTION(user_data);
+
+	// No UpMessage, the server only takes note of where it came from.
+	GError *error = NULL;
+	if (g_socket_send(emconn->direct.socket, DIRECT_HELLO, strlen(DIRECT_HELLO), NULL, &error) < 0) {
+		ALOGW("%s: %s", __FUNCTION__, error->message);
+		g_clear_error(&error);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+static bool
+emconn_direct_parse_uri(EmConnection *emconn)
+{
+	GError *error = NULL;
+	g_autoptr(GUri) uri = g_uri_parse(emconn->direct.uri, G_URI_FLAGS_NONE, &error);
+	if (uri == NULL) {
+		ALOGE("%s: Bad direct URI %s: %s", __FUNCTION__, emconn->direct.uri, error->message);
+		g_clear_error(&error);
+		return false;
+	}
+
+	const gchar *scheme = g_uri_get_scheme(uri);
+	if (g_strcmp0(scheme, "rtp") != 0 && g_strcmp0(scheme, "srt") != 0) {
+		ALOGE("%s: Direct URI %s is neither rtp:// nor srt://", __FUNCTION__, emconn->direct.uri);
+		return false;
+	}
+	if (g_uri_get_host(uri) == NULL) {
+		ALOGE("%s: Direct URI %s has no host", __FUNCTION__, emconn->direct.uri);
+		return false;
+	}
+
+	// Nothing tells us the codec without signaling, so the URI does, for example rtp://host:61990?codec=H265.
+	const gchar *encoding_name = "H264";
+	g_autoptr(GHashTable) params = NULL;
+	if (g_uri_get_query(uri) != NULL) {
+		params = g_uri_parse_params(g_uri_get_query(uri), -1, "&", G_URI_PARAMS_NONE, NULL);
+		if (params != NULL && g_hash_table_contains(params, "codec")) {
+			encoding_name = g_hash_table_lookup(params, "codec");
+		}
+	}
+
+	emconn->direct.srt = g_str_equal(scheme, "srt");
+	g_free(emconn->direct.host);
+	emconn->direct.host = g_strdup(g_uri_get_host(uri));
+	emconn->direct.port = g_uri_get_port(uri) > 0 ? g_uri_get_port(uri) : DEFAULT_DIRECT_PORT;
+	g_free(emconn->direct.encoding_name);
+	emconn->direct.encoding_name = g_ascii_strup(encoding_name, -1);
+	return true;
+}
+
+/*!
+ * Direct mode has no handshake: the pipeline starts listening and we are connected as soon as the socket is.
+ */
+static void
+emconn_direct_connect(EmConnection *emconn)
+{
+	if (!emconn_direct_parse_uri(emconn)) {
+		emconn_update_status(emconn, EM_STATUS_DISCONNECTED_ERROR);
+		return;
+	}
+
+	GError *error = NULL;
+	GList *addresses = g_resolver_lookup_by_name(g_resolver_get_default(), emconn->direct.host, NULL, &error);
+	if (addresses == NULL) {
+		ALOGE("%s: Could not resolve %s: %s", __FUNCTION__, emconn->direct.host, error->message);
+		g_clear_error(&error);
+		emconn_update_status(emconn, EM_STATUS_DISCONNECTED_ERROR);
+		return;
+	}
+	GInetAddress *inet_address = G_INET_ADDRESS(addresses->data);
+	g_autoptr(GSocketAddress) server = g_inet_socket_address_new(inet_address, (guint16)emconn->direct.port);
+
+	emconn->direct.socket = g_socket_new(g_inet_address_get_family(inet_address), G_SOCKET_TYPE_DATAGRAM,
+	                                     G_SOCKET_PROTOCOL_UDP, &error);
+	g_resolver_free_addresses(addresses);
+	// Connected, so it only takes datagrams from the server.
+	if (emconn->direct.socket == NULL || !g_socket_connect(emconn->direct.socket, server, NULL, &error)) {
+		ALOGE("%s: Could not open a socket to %s: %s", __FUNCTION__, emconn->direct.uri, error->message);
+		g_clear_error(&error);
+		g_clear_object(&emconn->direct.socket);
+		emconn_update_status(emconn, EM_STATUS_DISCONNECTED_ERROR);
+		return;
+	}
+
+	ALOGI("%s: Receiving %s %s from %s", __FUNCTION__, emconn->direct.srt ? "SRT" : "RTP",
+	      emconn->direct.encoding_name, emconn->direct.uri);
+
+	g_assert_null(emconn->pipeline);
+	g_signal_emit(emconn, signals[SIGNAL_ON_NEED_PIPELINE], 0);
+	if (emconn->pipeline == NULL) {
+		ALOGE("on-need-pipeline signal did not return a pipeline!");
+		em_connection_disconnect(emconn);
+		return;
+	}
+	gst_element_set_state(GST_ELEMENT(emconn->pipeline), GST_STATE_PLAYING);
+
+	emconn_direct_keepalive_cb(emconn);
+	emconn->direct.keepalive_src_id =
+	    g_timeout_add_seconds(DIRECT_KEEPALIVE_INTERVAL_S, emconn_direct_keepalive_cb, emconn);
+
+	emconn_update_status(emconn, EM_STATUS_CONNECTED);
+	g_signal_emit(emconn, signals[SIGNAL_CONNECTED], 0);
+}
+
 static void
 emconn_connect_internal(EmConnection *emconn, enum em_status status)
 {
 	em_connection_disconnect(emconn);
+	if (emconn->direct.uri != NULL) {
+		emconn_update_status(emconn, status);
+		emconn_direct_connect(emconn);
+		return;
+	}
 	if (!emconn->ws_cancel) {
 		emconn->ws_cancel = g_cancellable_new();
 	}
@@ -662,6 +952,65 @@ em_connection_new_localhost()
 	return EM_CONNECTION(g_object_new(EM_TYPE_CONNECTION, NULL));
 }
 
+EmConnection *
+em_connection_new_direct(const gchar *direct_uri)
+{
+	return EM_CONNECTION(g_object_new(EM_TYPE_CONNECTION, "direct-uri", direct_uri, NULL));
+}
+
+GstElement *
+em_connection_create_direct_source(EmConnection *emconn)
+{
+	if (emconn->direct.socket == NULL) {
+		return NULL;
+	}
+
+	g_autofree gchar *caps_str = g_strdup_printf(
+	    "application/x-rtp,media=video,clock-rate=90000,payload=96,encoding-name=%s", emconn->direct.encoding_name);
+	g_autoptr(GstCaps) caps = gst_caps_from_string(caps_str);
+
+	GstElement *src = NULL;
+	if (emconn->direct.srt) {
+		// The server listens one port up, ours is taken by the UpMessages.
+		g_autofree gchar *uri =
+		    g_strdup_printf("srt://%s:%d?mode=caller", emconn->direct.host, emconn->direct.port + 1);
+		src = gst_element_factory_make("srtsrc", NULL);
+		if (src != NULL) {
+			g_object_set(src, "uri", uri, "caps", caps, NULL);
+		}
+	} else {
+		src = gst_element_factory_make("udpsrc", NULL);
+		if (src != NULL) {
+			g_object_set(src, "socket", emconn->direct.socket, "close-socket", FALSE, "caps", caps, NULL);
+		}
+	}
+
+	if (src == NULL) {
+		ALOGE("%s: No %s element", __FUNCTION__, emconn->direct.srt ? "srtsrc" : "udpsrc");
+		return NULL;
+	}
+
+	// Puts the packets back in order and drops what comes too late, as the rtpbin in the webrtcbin does.
+	GstElement *jitterbuffer = gst_element_factory_make("rtpjitterbuffer", NULL);
+	if (jitterbuffer == NULL) {
+		ALOGE("%s: No rtpjitterbuffer element", __FUNCTION__);
+		gst_object_unref(gst_object_ref_sink(src));
+		return NULL;
+	}
+	g_object_set(jitterbuffer, "latency", 0, "drop-on-latency", TRUE, NULL);
+
+	GstElement *bin = gst_bin_new("directsrc");
+	gst_bin_add_many(GST_BIN(bin), src, jitterbuffer, NULL);
+	gst_element_link(src, jitterbuffer);
+	g_autoptr(GstPad) jitterbuffer_src = gst_element_get_static_pad(jitterbuffer, "src");
+	gst_element_add_pad(bin, gst_ghost_pad_new("src", jitterbuffer_src));
+
+	gst_clear_object(&emconn->direct.jitterbuffer);
+	emconn->direct.jitterbuffer = gst_object_ref(jitterbuffer);
+	emconn_apply_latency(emconn);
+	return bin;
+}
+
 void
 em_connection_connect(EmConnection *emconn)
 {
@@ -674,6 +1023,58 @@ em_connection_disconnect(EmConnection *emconn)
 	emconn_disconnect_internal(emconn, EM_STATUS_IDLE_NOT_CONNECTED);
 }
 
+void
+em_connection_set_compact_epoch(EmConnection *emconn, int64_t epoch)
+{
+	emconn->compact_epoch = epoch;
+}
+
+bool
+em_connection_get_compact_epoch(EmConnection *emconn, int64_t *out_epoch)
+{
+	if (g_atomic_int_get(&emconn->compact_version) == 0) {
+		return false;
+	}
+	*out_epoch = emconn->compact_epoch;
+	return true;
+}
+
+void
+em_connection_set_refresh_rates(EmConnection *emconn, const float *rates, uint32_t count)
+{
+	g_array_set_size(emconn->refresh_rates, 0);
+	g_array_append_vals(emconn->refresh_rates, rates, count);
+}
+
+float
+em_connection_get_refresh_rate(EmConnection *emconn)
+{
+	return (float)g_atomic_int_get(&emconn->refresh_rate_centihz) / 100.0f;
+}
+
+void
+em_connection_set_jitter_latency(EmConnection *emconn, guint latency_ms)
+{
+	g_atomic_int_set(&emconn->jitter_latency_ms, latency_ms);
+	// Not from the streaming thread, setting it takes the locks of the rtpbin and its jitterbuffers.
+	g_idle_add_full(G_PRIORITY_DEFAULT, emconn_apply_latency_cb, g_object_ref(emconn), g_object_unref);
+}
+
+static bool
+emconn_direct_send_bytes(EmConnection *emconn, GBytes *bytes)
+{
+	gsize size = 0;
+	const gchar *data = g_bytes_get_data(bytes, &size);
+
+	GError *error = NULL;
+	if (g_socket_send(emconn->direct.socket, data, size, NULL, &error) < 0) {
+		ALOGW("%s: %s", __FUNCTION__, error->message);
+		g_clear_error(&error);
+		return false;
+	}
+	return true;
+}
+
 bool
 em_connection_send_bytes(EmConnection *emconn, GBytes *bytes)
 {
@@ -682,7 +1083,32 @@ em_connection_send_bytes(EmConnection *emconn, GBytes *bytes)
 		return false;
 	}
 
+	if (emconn->direct.socket != NULL) {
+		return emconn_direct_send_bytes(emconn, bytes);
+	}
+
 	gboolean success = gst_webrtc_data_channel_send_data_full(emconn->datachannel, bytes, NULL);
 
 	return success == TRUE;
 }
+
+bool
+em_connection_send_bytes_unreliable(EmConnection *emconn, GBytes *bytes)
+{
+	if (emconn->status != EM_STATUS_CONNECTED) {
+		ALOGW("Cannot send bytes when status is %s", em_status_to_string(emconn->status));
+		return false;
+	}
+
+	if (emconn->direct.socket != NULL) {
+		return emconn_direct_send_bytes(emconn, bytes);
+	}
+
+	// Older servers only have the reliable channel.
+	GstWebRTCDataChannel *channel =
+	    emconn->tracking_datachannel != NULL ? emconn->tracking_datachannel : emconn->datachannel;
+
+	gboolean success = gst_webrtc_data_channel_send_data_full(channel, bytes, NULL);
+
+	return success == TRUE;
+}
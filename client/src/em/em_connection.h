@@ -14,6 +14,7 @@
 #include <glib-object.h>
 #include <gst/gstpipeline.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 G_BEGIN_DECLS
 
@@ -34,6 +35,32 @@ em_connection_new(const gchar *websocket_uri);
 EmConnection *
 em_connection_new_localhost();
 
+/*!
+ * Create a connection that receives plain RTP or SRT instead of negotiating WebRTC, for tethered and wired setups.
+ *
+ * The UpMessages go to the server's port as UDP datagrams, unordered and without retransmits. Over rtp:// the RTP
+ * comes back on the same socket, over srt:// from an SRT listener one port up. There is no signaling to learn the
+ * codec from, so it is given with the URI's codec parameter.
+ *
+ * @param direct_uri rtp://host[:port][?codec=H264|H265|AV1] or srt://..., port 61990 if not given.
+ *
+ * @memberof EmConnection
+ */
+EmConnection *
+em_connection_new_direct(const gchar *direct_uri);
+
+/*!
+ * Create the element the stream arrives from, with RTP caps, for a connection made with
+ * @ref em_connection_new_direct. Call from the on-need-pipeline handler. It has a jitterbuffer, which gets the
+ * latency the webrtcbin would.
+ *
+ * @return A floating reference, NULL if this connection negotiates WebRTC
+ *
+ * @memberof EmConnection
+ */
+GstElement *
+em_connection_create_direct_source(EmConnection *emconn);
+
 /*!
  * Actually start connecting to the server
  *
@@ -55,11 +82,87 @@ em_connection_disconnect(EmConnection *emconn);
 /*!
  * Send a message to the server
  *
+ * In direct mode this is no more reliable than @ref em_connection_send_bytes_unreliable.
+ *
  * @memberof EmConnection
  */
 bool
 em_connection_send_bytes(EmConnection *emconn, GBytes *bytes);
 
+/*!
+ * Label of the data channel for tracking, the server opens it next to the
+ * reliable one.
+ */
+#define EM_TRACKING_DATA_CHANNEL_LABEL "tracking"
+
+/*!
+ * Send a message to the server on the unordered channel without retransmits,
+ * so a lost message does not hold back the ones after it. Falls back to the
+ * reliable channel if the server did not open one.
+ *
+ * @memberof EmConnection
+ */
+bool
+em_connection_send_bytes_unreliable(EmConnection *emconn, GBytes *bytes);
+
+/*!
+ * Offer the server to send UpMessages in the compact encoding, with times relative to @p epoch.
+ *
+ * Must be set before connecting, the server learns it with the answer.
+ *
+ * @param epoch An OpenXR time near the start of the session, 0 to stay with protobuf.
+ *
+ * @memberof EmConnection
+ */
+void
+em_connection_set_compact_epoch(EmConnection *emconn, int64_t epoch);
+
+/*!
+ * Whether the server agreed to compact UpMessages on this connection, see em_compact.h.
+ *
+ * @param[out] out_epoch The time base to encode them with.
+ *
+ * @memberof EmConnection
+ */
+bool
+em_connection_get_compact_epoch(EmConnection *emconn, int64_t *out_epoch);
+
+/*!
+ * Offer the server the display refresh rates we can switch to, it streams at one of them.
+ *
+ * Must be set before connecting, the server learns it with the answer.
+ *
+ * @param rates As given by xrEnumerateDisplayRefreshRatesFB.
+ * @param count Number of rates, 0 to leave the frame rate to the server.
+ *
+ * @memberof EmConnection
+ */
+void
+em_connection_set_refresh_rates(EmConnection *emconn, const float *rates, uint32_t count);
+
+/*!
+ * The refresh rate the server picked for the stream, in Hz. Safe to call from any thread.
+ *
+ * @return 0 until the server told us, servers that don't negotiate never do.
+ *
+ * @memberof EmConnection
+ */
+float
+em_connection_get_refresh_rate(EmConnection *emconn);
+
+/*!
+ * How long the jitterbuffer should wait for late packets, for the jitter of the link. Safe to call from any thread.
+ *
+ * It waits for the longer of this and what the server asks for to recover lost packets, the change is applied on
+ * the main loop.
+ *
+ * @param latency_ms Up to @ref EM_JITTER_LATENCY_MAX_MS, 0 for a clean link.
+ *
+ * @memberof EmConnection
+ */
+void
+em_connection_set_jitter_latency(EmConnection *emconn, guint latency_ms);
+
 /*!
  * Assign a pipeline for use.
  *
@@ -0,0 +1,487 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Samples the Touch controllers through OpenXR actions for the ControllerMessage.
+ * @ingroup em_client
+ */
+
+#include "em_controllers.h"
+
+#include "em_app_log.h"
+
+#include "electricmaple.pb.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+
+static_assert(sizeof(em_proto_ControllerMessage::left) / sizeof(em_proto_ControllerSample) ==
+                  EM_CONTROLLER_SAMPLES_PER_MESSAGE,
+              "Update electricmaple.options");
+
+namespace {
+
+enum Hand
+{
+	kLeft,
+	kRight,
+	kHandCount,
+};
+
+struct HandState
+{
+	XrPath path;
+	XrSpace gripSpace;
+	XrSpace aimSpace;
+
+	//! Ring of the newest samples, the oldest is overwritten first.
+	em_proto_ControllerSample samples[EM_CONTROLLER_SAMPLES_PER_MESSAGE];
+	uint32_t sampleCount;
+	uint32_t nextSample;
+};
+
+} // namespace
+
+struct em_controllers
+{
+	XrInstance instance;
+	XrSession session;
+
+	XrActionSet actionSet;
+
+	XrAction gripPose;
+	XrAction aimPose;
+	XrAction squeezeValue;
+	XrAction triggerValue;
+	XrAction triggerTouch;
+	XrAction thumbstick;
+	XrAction thumbstickClick;
+	XrAction thumbstickTouch;
+	XrAction thumbrestTouch;
+	//! X on the left, A on the right.
+	XrAction lowerClick;
+	XrAction lowerTouch;
+	//! Y on the left, B on the right.
+	XrAction upperClick;
+	XrAction upperTouch;
+	//! Only on the left, the runtime keeps the system button to itself.
+	XrAction menuClick;
+
+	HandState hands[kHandCount];
+};
+
+static bool
+create_action(
+    struct em_controllers *ec, XrActionType type, const char *name, const char *localizedName, XrAction *out_action)
+{
+	XrPath subactionPaths[kHandCount] = {ec->hands[kLeft].path, ec->hands[kRight].path};
+
+	XrActionCreateInfo info = {XR_TYPE_ACTION_CREATE_INFO};
+	info.actionType = type;
+	strncpy(info.actionName, name, XR_MAX_ACTION_NAME_SIZE - 1);
+	strncpy(info.localizedActionName, localizedName, XR_MAX_LOCALIZED_ACTION_NAME_SIZE - 1);
+	info.countSubactionPaths = kHandCount;
+	info.subactionPaths = subactionPaths;
+
+	XrResult result = xrCreateAction(ec->actionSet, &info, out_action);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to create action %s (%d)", __FUNCTION__, name, result);
+		return false;
+	}
+	return true;
+}
+
+static bool
+create_actions(struct em_controllers *ec)
+{
+	XrActionSetCreateInfo setInfo = {XR_TYPE_ACTION_SET_CREATE_INFO};
+	strncpy(setInfo.actionSetName, "controllers", XR_MAX_ACTION_SET_NAME_SIZE - 1);
+	strncpy(setInfo.localizedActionSetName, "Controllers", XR_MAX_LOCALIZED_ACTION_SET_NAME_SIZE - 1);
+
+	XrResult result = xrCreateActionSet(ec->instance, &setInfo, &ec->actionSet);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to create action set (%d)", __FUNCTION__, result);
+		return false;
+	}
+
+	return create_action(ec, XR_ACTION_TYPE_POSE_INPUT, "grip_pose", "Grip Pose", &ec->gripPose) &&
+	       create_action(ec, XR_ACTION_TYPE_POSE_INPUT, "aim_pose", "Aim Pose", &ec->aimPose) &&
+	       create_action(ec, XR_ACTION_TYPE_FLOAT_INPUT, "squeeze_value", "Squeeze", &ec->squeezeValue) &&
+	       create_action(ec, XR_ACTION_TYPE_FLOAT_INPUT, "trigger_value", "Trigger", &ec->triggerValue) &&
+	       create_action(ec, XR_ACTION_TYPE_BOOLEAN_INPUT, "trigger_touch", "Trigger Touch", &ec->triggerTouch) &&
+	       create_action(ec, XR_ACTION_TYPE_VECTOR2F_INPUT, "thumbstick", "Thumbstick", &ec->thumbstick) &&
+	       create_action(ec, XR_ACTION_TYPE_BOOLEAN_INPUT, "thumbstick_click", "Thumbstick Click",
+	                     &ec->thumbstickClick) &&
+	       create_action(ec, XR_ACTION_TYPE_BOOLEAN_INPUT, "thumbstick_touch", "Thumbstick Touch",
+	                     &ec->thumbstickTouch) &&
+	       create_action(ec, XR_ACTION_TYPE_BOOLEAN_INPUT, "thumbrest_touch", "Thumbrest Touch",
+	                     &ec->thumbrestTouch) &&
+	       create_action(ec, XR_ACTION_TYPE_BOOLEAN_INPUT, "lower_click", "X or A", &ec->lowerClick) &&
+	       create_action(ec, XR_ACTION_TYPE_BOOLEAN_INPUT, "lower_touch", "X or A Touch", &ec->lowerTouch) &&
+	       create_action(ec, XR_ACTION_TYPE_BOOLEAN_INPUT, "upper_click", "Y or B", &ec->upperClick) &&
+	       create_action(ec, XR_ACTION_TYPE_BOOLEAN_INPUT, "upper_touch", "Y or B Touch", &ec->upperTouch) &&
+	       create_action(ec, XR_ACTION_TYPE_BOOLEAN_INPUT, "menu_click", "Menu", &ec->menuClick);
+}
+
+static bool
+suggest_bindings(struct em_controllers *ec)
+{
+	struct
+	{
+		XrAction action;
+		const char *path;
+	} bindings[] = {
+	    {ec->gripPose, "/user/hand/left/input/grip/pose"},
+	    {ec->gripPose, "/user/hand/right/input/grip/pose"},
+	    {ec->aimPose, "/user/hand/left/input/aim/pose"},
+	    {ec->aimPose, "/user/hand/right/input/aim/pose"},
+	    {ec->squeezeValue, "/user/hand/left/input/squeeze/value"},
+	    {ec->squeezeValue, "/user/hand/right/input/squeeze/value"},
+	    {ec->triggerValue, "/user/hand/left/input/trigger/value"},
+	    {ec->triggerValue, "/user/hand/right/input/trigger/value"},
+	    {ec->triggerTouch, "/user/hand/left/input/trigger/touch"},
+	    {ec->triggerTouch, "/user/hand/right/input/trigger/touch"},
+	    {ec->thumbstick, "/user/hand/left/input/thumbstick"},
+	    {ec->thumbstick, "/user/hand/right/input/thumbstick"},
+	    {ec->thumbstickClick, "/user/hand/left/input/thumbstick/click"},
+	    {ec->thumbstickClick, "/user/hand/right/input/thumbstick/click"},
+	    {ec->thumbstickTouch, "/user/hand/left/input/thumbstick/touch"},
+	    {ec->thumbstickTouch, "/user/hand/right/input/thumbstick/touch"},
+	    {ec->thumbrestTouch, "/user/hand/left/input/thumbrest/touch"},
+	    {ec->thumbrestTouch, "/user/hand/right/input/thumbrest/touch"},
+	    {ec->lowerClick, "/user/hand/left/input/x/click"},
+	    {ec->lowerClick, "/user/hand/right/input/a/click"},
+	    {ec->lowerTouch, "/user/hand/left/input/x/touch"},
+	    {ec->lowerTouch, "/user/hand/right/input/a/touch"},
+	    {ec->upperClick, "/user/hand/left/input/y/click"},
+	    {ec->upperClick, "/user/hand/right/input/b/click"},
+	    {ec->upperTouch, "/user/hand/left/input/y/touch"},
+	    {ec->upperTouch, "/user/hand/right/input/b/touch"},
+	    {ec->menuClick, "/user/hand/left/input/menu/click"},
+	};
+
+	XrActionSuggestedBinding suggested[std::size(bindings)];
+	for (size_t i = 0; i < std::size(bindings); i++) {
+		suggested[i].action = bindings[i].action;
+		XrResult result = xrStringToPath(ec->instance, bindings[i].path, &suggested[i].binding);
+		if (XR_FAILED(result)) {
+			ALOGE("%s: Failed to get path %s (%d)", __FUNCTION__, bindings[i].path, result);
+			return false;
+		}
+	}
+
+	XrInteractionProfileSuggestedBinding profile = {XR_TYPE_INTERACTION_PROFILE_SUGGESTED_BINDING};
+	XrResult result =
+	    xrStringToPath(ec->instance, "/interaction_profiles/oculus/touch_controller", &profile.interactionProfile);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to get the interaction profile path (%d)", __FUNCTION__, result);
+		return false;
+	}
+	profile.countSuggestedBindings = std::size(suggested);
+	profile.suggestedBindings = suggested;
+
+	result = xrSuggestInteractionProfileBindings(ec->instance, &profile);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to suggest bindings (%d)", __FUNCTION__, result);
+		return false;
+	}
+	return true;
+}
+
+static bool
+create_spaces(struct em_controllers *ec)
+{
+	for (HandState &hand : ec->hands) {
+		XrActionSpaceCreateInfo info = {XR_TYPE_ACTION_SPACE_CREATE_INFO};
+		info.subactionPath = hand.path;
+		info.poseInActionSpace = {{0.f, 0.f, 0.f, 1.f}, {0.f, 0.f, 0.f}};
+
+		info.action = ec->gripPose;
+		XrResult result = xrCreateActionSpace(ec->session, &info, &hand.gripSpace);
+		if (XR_FAILED(result)) {
+			ALOGE("%s: Failed to create grip space (%d)", __FUNCTION__, result);
+			return false;
+		}
+
+		info.action = ec->aimPose;
+		result = xrCreateActionSpace(ec->session, &info, &hand.aimSpace);
+		if (XR_FAILED(result)) {
+			ALOGE("%s: Failed to create aim space (%d)", __FUNCTION__, result);
+			return false;
+		}
+	}
+	return true;
+}
+
+static em_proto_Pose
+to_proto(const XrPosef &pose)
+{
+	em_proto_Pose ret = em_proto_Pose_init_default;
+	ret.has_position = true;
+	ret.position.x = pose.position.x;
+	ret.position.y = pose.position.y;
+	ret.position.z = pose.position.z;
+	ret.has_orientation = true;
+	ret.orientation.w = pose.orientation.w;
+	ret.orientation.x = pose.orientation.x;
+	ret.orientation.y = pose.orientation.y;
+	ret.orientation.z = pose.orientation.z;
+	return ret;
+}
+
+static em_proto_Vec3
+to_proto(const XrVector3f &v)
+{
+	em_proto_Vec3 ret = em_proto_Vec3_init_default;
+	ret.x = v.x;
+	ret.y = v.y;
+	ret.z = v.z;
+	return ret;
+}
+
+/*!
+ * Adds a sample of @p hand to its ring, or empties the ring if the hand is not
+ * tracked, so the server stops predicting from old samples.
+ */
+static void
+sample_hand(HandState &hand, XrSpace space, XrTime time)
+{
+	constexpr XrSpaceLocationFlags kValid = XR_SPACE_LOCATION_POSITION_VALID_BIT | XR_SPACE_LOCATION_ORIENTATION_VALID_BIT;
+	constexpr XrSpaceVelocityFlags kVelocityValid =
+	    XR_SPACE_VELOCITY_LINEAR_VALID_BIT | XR_SPACE_VELOCITY_ANGULAR_VALID_BIT;
+
+	XrSpaceVelocity velocity = {XR_TYPE_SPACE_VELOCITY};
+	XrSpaceLocation grip = {XR_TYPE_SPACE_LOCATION, &velocity};
+	XrSpaceLocation aim = {XR_TYPE_SPACE_LOCATION};
+
+	if (XR_FAILED(xrLocateSpace(hand.gripSpace, space, time, &grip)) ||
+	    XR_FAILED(xrLocateSpace(hand.aimSpace, space, time, &aim)) || (grip.locationFlags & kValid) != kValid ||
+	    (aim.locationFlags & kValid) != kValid) {
+		hand.sampleCount = 0;
+		hand.nextSample = 0;
+		return;
+	}
+
+	em_proto_ControllerSample &sample = hand.samples[hand.nextSample];
+	sample = em_proto_ControllerSample_init_default;
+	sample.timestamp = time;
+	sample.has_grip = true;
+	sample.grip = to_proto(grip.pose);
+	sample.has_aim = true;
+	sample.aim = to_proto(aim.pose);
+	if ((velocity.velocityFlags & kVelocityValid) == kVelocityValid) {
+		sample.has_linear_velocity = true;
+		sample.linear_velocity = to_proto(velocity.linearVelocity);
+		sample.has_angular_velocity = true;
+		sample.angular_velocity = to_proto(velocity.angularVelocity);
+	}
+
+	hand.nextSample = (hand.nextSample + 1) % EM_CONTROLLER_SAMPLES_PER_MESSAGE;
+	hand.sampleCount = std::min<uint32_t>(hand.sampleCount + 1, EM_CONTROLLER_SAMPLES_PER_MESSAGE);
+}
+
+//! Copies the ring of @p hand out oldest first.
+static pb_size_t
+copy_samples(const HandState &hand, em_proto_ControllerSample *out_samples)
+{
+	uint32_t first = (hand.nextSample + EM_CONTROLLER_SAMPLES_PER_MESSAGE - hand.sampleCount) %
+	                 EM_CONTROLLER_SAMPLES_PER_MESSAGE;
+	for (uint32_t i = 0; i < hand.sampleCount; i++) {
+		out_samples[i] = hand.samples[(first + i) % EM_CONTROLLER_SAMPLES_PER_MESSAGE];
+	}
+	return (pb_size_t)hand.sampleCount;
+}
+
+static bool
+get_bool(struct em_controllers *ec, XrAction action, XrPath hand)
+{
+	XrActionStateGetInfo info = {XR_TYPE_ACTION_STATE_GET_INFO};
+	info.action = action;
+	info.subactionPath = hand;
+
+	XrActionStateBoolean state = {XR_TYPE_ACTION_STATE_BOOLEAN};
+	return XR_SUCCEEDED(xrGetActionStateBoolean(ec->session, &info, &state)) && state.isActive &&
+	       state.currentState;
+}
+
+static float
+get_float(struct em_controllers *ec, XrAction action, XrPath hand)
+{
+	XrActionStateGetInfo info = {XR_TYPE_ACTION_STATE_GET_INFO};
+	info.action = action;
+	info.subactionPath = hand;
+
+	XrActionStateFloat state = {XR_TYPE_ACTION_STATE_FLOAT};
+	if (XR_FAILED(xrGetActionStateFloat(ec->session, &info, &state)) || !state.isActive) {
+		return 0.f;
+	}
+	return state.currentState;
+}
+
+static XrVector2f
+get_vec2(struct em_controllers *ec, XrAction action, XrPath hand)
+{
+	XrActionStateGetInfo info = {XR_TYPE_ACTION_STATE_GET_INFO};
+	info.action = action;
+	info.subactionPath = hand;
+
+	XrActionStateVector2f state = {XR_TYPE_ACTION_STATE_VECTOR2F};
+	if (XR_FAILED(xrGetActionStateVector2f(ec->session, &info, &state)) || !state.isActive) {
+		return {0.f, 0.f};
+	}
+	return state.currentState;
+}
+
+static em_proto_TouchControllerCommon
+read_common(struct em_controllers *ec, XrPath hand)
+{
+	em_proto_TouchControllerCommon common = em_proto_TouchControllerCommon_init_default;
+
+	XrVector2f xy = get_vec2(ec, ec->thumbstick, hand);
+	common.has_thumbstick = true;
+	common.thumbstick.has_xy = true;
+	common.thumbstick.xy.x = xy.x;
+	common.thumbstick.xy.y = xy.y;
+	common.thumbstick.click = get_bool(ec, ec->thumbstickClick, hand);
+	common.thumbstick.touch = get_bool(ec, ec->thumbstickTouch, hand);
+
+	common.has_trigger = true;
+	common.trigger.value = get_float(ec, ec->triggerValue, hand);
+	common.trigger.touch = get_bool(ec, ec->triggerTouch, hand);
+
+	common.has_squeeze = true;
+	common.squeeze.value = get_float(ec, ec->squeezeValue, hand);
+
+	common.thumbrest_touch = get_bool(ec, ec->thumbrestTouch, hand);
+	return common;
+}
+
+static em_proto_InputClickTouch
+read_click_touch(struct em_controllers *ec, XrAction click, XrAction touch, XrPath hand)
+{
+	em_proto_InputClickTouch ret = em_proto_InputClickTouch_init_default;
+	ret.click = get_bool(ec, click, hand);
+	ret.touch = touch != XR_NULL_HANDLE && get_bool(ec, touch, hand);
+	return ret;
+}
+
+
+/*
+ *
+ * Exported functions.
+ *
+ */
+
+struct em_controllers *
+em_controllers_create(XrInstance instance, XrSession session)
+{
+	struct em_controllers *ec = new em_controllers{};
+	ec->instance = instance;
+	ec->session = session;
+
+	if (XR_FAILED(xrStringToPath(instance, "/user/hand/left", &ec->hands[kLeft].path)) ||
+	    XR_FAILED(xrStringToPath(instance, "/user/hand/right", &ec->hands[kRight].path))) {
+		ALOGE("%s: Failed to get the hand paths", __FUNCTION__);
+		em_controllers_destroy(&ec);
+		return nullptr;
+	}
+
+	if (!create_actions(ec) || !suggest_bindings(ec)) {
+		em_controllers_destroy(&ec);
+		return nullptr;
+	}
+
+	XrSessionActionSetsAttachInfo attachInfo = {XR_TYPE_SESSION_ACTION_SETS_ATTACH_INFO};
+	attachInfo.countActionSets = 1;
+	attachInfo.actionSets = &ec->actionSet;
+	XrResult result = xrAttachSessionActionSets(session, &attachInfo);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to attach the action set (%d)", __FUNCTION__, result);
+		em_controllers_destroy(&ec);
+		return nullptr;
+	}
+
+	if (!create_spaces(ec)) {
+		em_controllers_destroy(&ec);
+		return nullptr;
+	}
+
+	return ec;
+}
+
+void
+em_controllers_destroy(struct em_controllers **ptr_ec)
+{
+	if (ptr_ec == nullptr || *ptr_ec == nullptr) {
+		return;
+	}
+	struct em_controllers *ec = *ptr_ec;
+
+	for (HandState &hand : ec->hands) {
+		if (hand.gripSpace != XR_NULL_HANDLE) {
+			xrDestroySpace(hand.gripSpace);
+		}
+		if (hand.aimSpace != XR_NULL_HANDLE) {
+			xrDestroySpace(hand.aimSpace);
+		}
+	}
+
+	// Takes the actions with it.
+	if (ec->actionSet != XR_NULL_HANDLE) {
+		xrDestroyActionSet(ec->actionSet);
+	}
+
+	delete ec;
+	*ptr_ec = nullptr;
+}
+
+bool
+em_controllers_sample(struct em_controllers *ec, XrSpace space, XrTime time, em_proto_ControllerMessage *out_message)
+{
+	XrActiveActionSet activeSet = {ec->actionSet, XR_NULL_PATH};
+	XrActionsSyncInfo syncInfo = {XR_TYPE_ACTIONS_SYNC_INFO};
+	syncInfo.countActiveActionSets = 1;
+	syncInfo.activeActionSets = &activeSet;
+
+	// Unfocused is no failure, the controllers just read as untracked and idle.
+	XrResult result = xrSyncActions(ec->session, &syncInfo);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to sync actions (%d)", __FUNCTION__, result);
+		return false;
+	}
+
+	for (HandState &hand : ec->hands) {
+		sample_hand(hand, space, time);
+	}
+
+	*out_message = em_proto_ControllerMessage_init_default;
+	out_message->left_count = copy_samples(ec->hands[kLeft], out_message->left);
+	out_message->right_count = copy_samples(ec->hands[kRight], out_message->right);
+	out_message->input_time = time;
+
+	XrPath left = ec->hands[kLeft].path;
+	out_message->has_left_input = true;
+	out_message->left_input.has_x = true;
+	out_message->left_input.x = read_click_touch(ec, ec->lowerClick, ec->lowerTouch, left);
+	out_message->left_input.has_y = true;
+	out_message->left_input.y = read_click_touch(ec, ec->upperClick, ec->upperTouch, left);
+	out_message->left_input.has_menu = true;
+	out_message->left_input.menu = read_click_touch(ec, ec->menuClick, XR_NULL_HANDLE, left);
+	out_message->left_input.has_common = true;
+	out_message->left_input.common = read_common(ec, left);
+
+	XrPath right = ec->hands[kRight].path;
+	out_message->has_right_input = true;
+	out_message->right_input.has_a = true;
+	out_message->right_input.a = read_click_touch(ec, ec->lowerClick, ec->lowerTouch, right);
+	out_message->right_input.has_b = true;
+	out_message->right_input.b = read_click_touch(ec, ec->upperClick, ec->upperTouch, right);
+	out_message->right_input.has_common = true;
+	out_message->right_input.common = read_common(ec, right);
+
+	return true;
+}
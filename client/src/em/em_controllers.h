@@ -0,0 +1,59 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Samples the Touch controllers through OpenXR actions for the ControllerMessage.
+ * @ingroup em_client
+ */
+
+#pragma once
+
+#include <openxr/openxr.h>
+#include <stdbool.h>
+
+typedef struct _em_proto_ControllerMessage em_proto_ControllerMessage;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * Samples per controller in a ControllerMessage, the newest ones. Must match
+ * the max_count in electricmaple.options.
+ */
+#define EM_CONTROLLER_SAMPLES_PER_MESSAGE 4
+
+struct em_controllers;
+
+/*!
+ * Create the actions for both Touch controllers and attach them to @p session.
+ *
+ * A session takes only one attach, so the app can not have action sets of its own.
+ *
+ * @return NULL in case of error
+ */
+struct em_controllers *
+em_controllers_create(XrInstance instance, XrSession session);
+
+/*!
+ * Clear a pointer and free the controllers, if any.
+ */
+void
+em_controllers_destroy(struct em_controllers **ptr_ec);
+
+/*!
+ * Sync the actions and sample both controllers at @p time in @p space.
+ *
+ * @p out_message gets the newest samples of each controller, this one included, and the state of their inputs. A
+ * controller that is not tracked has no samples.
+ *
+ * @return false if the actions could not be synced
+ */
+bool
+em_controllers_sample(struct em_controllers *ec, XrSpace space, XrTime time, em_proto_ControllerMessage *out_message);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -10,7 +10,7 @@
  */
 
 #include "em_frame_data.hpp"
-#include "em/em_id_data_accumulator.hpp"
+#include "em/em_ring_id_data_accumulator.hpp"
 #include "electricmaple.pb.h"
 #include <mutex>
 
@@ -11,9 +11,7 @@
 
 #pragma once
 
-#include "em/em_id_data_accumulator.hpp"
-
-#include <glib-object.h>
+#include "em/em_ring_id_data_accumulator.hpp"
 
 #include <cstddef>
 #include <cstdint>
@@ -46,9 +44,9 @@ public:
 	emitCompleteRecords(PfnEmitUpMessage pfn, void *userdata);
 
 private:
-	/// basically arbitrary
-	static constexpr std::size_t kMaxFrameData = 5;
-	IdDataAccumulator<FrameData, kMaxFrameData> m_accum;
+	/// Frames from decode to display, with room for a long pipeline of them on a high latency link
+	static constexpr std::size_t kMaxFrameData = 128;
+	RingIdDataAccumulator<FrameData, kMaxFrameData> m_accum;
 	std::mutex m_mutex;
 };
 } // namespace em
@@ -0,0 +1,107 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Picks how long the jitterbuffer waits for late packets from how unevenly the frames arrive.
+ * @ingroup em_client
+ */
+
+#include "em_jitter_latency.h"
+
+#include <math.h>
+
+#define RTP_CLOCK_RATE 90000
+#define NS_PER_MS 1000000
+
+//! RFC 3550 smoothing, the jitter follows over about 16 frames.
+#define JITTER_GAIN (1.0 / 16.0)
+//! Most late packets arrive within a few times the jitter.
+#define JITTER_PER_LATENCY 3.0
+//! Below this the packets only wobble with the pacing, nothing arrives out of order.
+#define JITTER_QUIET_NS (0.5 * NS_PER_MS)
+
+//! A gap this long in either clock is a pause or a new stream, not jitter.
+#define MAX_FRAME_GAP_NS (1000 * (int64_t)NS_PER_MS)
+
+//! How much and how often the latency goes up, every step adds to what the user sees.
+#define STEP_UP_MS 2
+#define STEP_INTERVAL_NS (100 * (int64_t)NS_PER_MS)
+//! Setting the latency back is free, only wait long enough to not keep raising it again.
+#define QUIET_HOLD_NS (1000 * (int64_t)NS_PER_MS)
+
+
+static uint32_t
+target_latency_ms(const struct em_jitter_latency *jl)
+{
+	if (jl->jitter_ns < JITTER_QUIET_NS) {
+		return 0;
+	}
+	double ms = ceil(jl->jitter_ns * JITTER_PER_LATENCY / NS_PER_MS);
+	return ms < EM_JITTER_LATENCY_MAX_MS ? (uint32_t)ms : EM_JITTER_LATENCY_MAX_MS;
+}
+
+void
+em_jitter_latency_reset(struct em_jitter_latency *jl)
+{
+	jl->started = false;
+	jl->last_arrival_ns = 0;
+	jl->last_rtp_time = 0;
+	jl->jitter_ns = 0.0;
+	jl->latency_ms = 0;
+	jl->last_change_ns = 0;
+	jl->quiet_since_ns = 0;
+}
+
+bool
+em_jitter_latency_add_frame(struct em_jitter_latency *jl, int64_t arrival_ns, uint32_t rtp_time)
+{
+	if (!jl->started) {
+		jl->started = true;
+		jl->last_arrival_ns = arrival_ns;
+		jl->last_rtp_time = rtp_time;
+		jl->last_change_ns = arrival_ns;
+		jl->quiet_since_ns = arrival_ns;
+		return false;
+	}
+
+	// Wraps around like the timestamps, an older frame is reordered and tells us nothing new.
+	int32_t rtp_delta = (int32_t)(rtp_time - jl->last_rtp_time);
+	if (rtp_delta <= 0) {
+		return false;
+	}
+
+	int64_t arrival_delta_ns = arrival_ns - jl->last_arrival_ns;
+	int64_t rtp_delta_ns = (int64_t)rtp_delta * 1000000000 / RTP_CLOCK_RATE;
+	jl->last_arrival_ns = arrival_ns;
+	jl->last_rtp_time = rtp_time;
+
+	if (arrival_delta_ns > MAX_FRAME_GAP_NS || rtp_delta_ns > MAX_FRAME_GAP_NS) {
+		return false;
+	}
+
+	double deviation_ns = fabs((double)(arrival_delta_ns - rtp_delta_ns));
+	jl->jitter_ns += JITTER_GAIN * (deviation_ns - jl->jitter_ns);
+
+	uint32_t target = target_latency_ms(jl);
+	if (target >= jl->latency_ms) {
+		jl->quiet_since_ns = arrival_ns;
+	}
+
+	uint32_t latency_ms = jl->latency_ms;
+	if (target > latency_ms && arrival_ns - jl->last_change_ns >= STEP_INTERVAL_NS) {
+		latency_ms = target < latency_ms + STEP_UP_MS ? target : latency_ms + STEP_UP_MS;
+	} else if (target < latency_ms && arrival_ns - jl->quiet_since_ns >= QUIET_HOLD_NS) {
+		latency_ms = target;
+	}
+
+	if (latency_ms == jl->latency_ms) {
+		return false;
+	}
+
+	jl->latency_ms = latency_ms;
+	jl->last_change_ns = arrival_ns;
+	jl->quiet_since_ns = arrival_ns;
+	return true;
+}
@@ -0,0 +1,68 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Picks how long the jitterbuffer waits for late packets from how unevenly the frames arrive.
+ * @ingroup em_client
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+//! More than this and the frame is better shown late than the stream held back for it.
+#define EM_JITTER_LATENCY_MAX_MS 15
+
+/*!
+ * Interarrival jitter of the frames as in RFC 3550, and the jitterbuffer latency that follows from it.
+ *
+ * The appsink does not sync, so the jitterbuffer only holds packets back behind a gap: the latency is how late a
+ * reordered packet may come and still make its frame. A clean link gets none, the latency goes up in small steps
+ * while the jitter grows and straight back down once it has been quiet for a while.
+ *
+ * Adding a frame is a few operations and never allocates. Not thread safe, feed it from one streaming thread.
+ */
+struct em_jitter_latency
+{
+	bool started;
+	int64_t last_arrival_ns;
+	//! 90 kHz, as for all video over RTP.
+	uint32_t last_rtp_time;
+
+	//! Smoothed deviation of the arrival times from the RTP timestamps.
+	double jitter_ns;
+
+	uint32_t latency_ms;
+	int64_t last_change_ns;
+	//! Since when the jitter asks for less than @ref latency_ms.
+	int64_t quiet_since_ns;
+};
+
+/*!
+ * Forget the stream, back to no latency.
+ */
+void
+em_jitter_latency_reset(struct em_jitter_latency *jl);
+
+/*!
+ * Account for a frame arriving in full, with the last packet of it.
+ *
+ * @param arrival_ns Monotonic time of the arrival.
+ * @param rtp_time RTP timestamp of the frame.
+ *
+ * @return true if @ref em_jitter_latency::latency_ms changed.
+ */
+bool
+em_jitter_latency_add_frame(struct em_jitter_latency *jl, int64_t arrival_ns, uint32_t rtp_time);
+
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
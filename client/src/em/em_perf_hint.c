@@ -0,0 +1,118 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Tells Android how long the render loop has per frame, so it clocks the threads of a frame up in time.
+ * @ingroup em_client
+ */
+
+#include "em_perf_hint.h"
+
+#include "em_app_log.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+
+// Opaque in the NDK, declared here so we build against headers older than API level 33.
+typedef struct APerformanceHintManager APerformanceHintManager;
+typedef struct APerformanceHintSession APerformanceHintSession;
+
+/*!
+ * APerformanceHintManager came with API level 33, after our minimum, so it is looked up at runtime.
+ */
+static struct
+{
+	pthread_once_t once;
+	APerformanceHintManager *(*get_manager)(void);
+	APerformanceHintSession *(*create_session)(APerformanceHintManager *manager,
+	                                           const int32_t *thread_ids,
+	                                           size_t size,
+	                                           int64_t initial_target_work_duration_nanos);
+	int (*update_target_work_duration)(APerformanceHintSession *session, int64_t target_duration_nanos);
+	int (*report_actual_work_duration)(APerformanceHintSession *session, int64_t actual_duration_nanos);
+	void (*close_session)(APerformanceHintSession *session);
+} hint = {.once = PTHREAD_ONCE_INIT};
+
+struct em_perf_hint
+{
+	APerformanceHintSession *session;
+	int64_t target_ns;
+};
+
+static void
+load_functions(void)
+{
+	hint.get_manager = dlsym(RTLD_DEFAULT, "APerformanceHint_getManager");
+	hint.create_session = dlsym(RTLD_DEFAULT, "APerformanceHint_createSession");
+	hint.update_target_work_duration = dlsym(RTLD_DEFAULT, "APerformanceHint_updateTargetWorkDuration");
+	hint.report_actual_work_duration = dlsym(RTLD_DEFAULT, "APerformanceHint_reportActualWorkDuration");
+	hint.close_session = dlsym(RTLD_DEFAULT, "APerformanceHint_closeSession");
+}
+
+
+/*
+ *
+ * Exported functions.
+ *
+ */
+
+struct em_perf_hint *
+em_perf_hint_create(const int32_t *threads, size_t thread_count, int64_t target_ns)
+{
+	pthread_once(&hint.once, load_functions);
+	if (hint.get_manager == NULL || hint.create_session == NULL || hint.update_target_work_duration == NULL ||
+	    hint.report_actual_work_duration == NULL || hint.close_session == NULL) {
+		ALOGI("%s: No APerformanceHintManager before API level 33", __FUNCTION__);
+		return NULL;
+	}
+
+	APerformanceHintManager *manager = hint.get_manager();
+	APerformanceHintSession *session =
+	    manager != NULL ? hint.create_session(manager, threads, thread_count, target_ns) : NULL;
+	if (session == NULL) {
+		ALOGW("%s: The system gave us no performance hint session", __FUNCTION__);
+		return NULL;
+	}
+
+	struct em_perf_hint *ph = calloc(1, sizeof(struct em_perf_hint));
+	ph->session = session;
+	ph->target_ns = target_ns;
+	ALOGI("%s: Hinting %zu threads at %.2f ms per frame", __FUNCTION__, thread_count, (double)target_ns / 1e6);
+	return ph;
+}
+
+void
+em_perf_hint_update_target(struct em_perf_hint *ph, int64_t target_ns)
+{
+	if (target_ns <= 0 || target_ns == ph->target_ns) {
+		return;
+	}
+	ph->target_ns = target_ns;
+	hint.update_target_work_duration(ph->session, target_ns);
+}
+
+void
+em_perf_hint_report(struct em_perf_hint *ph, int64_t actual_ns)
+{
+	// Zero or negative is rejected, a frame never takes no time.
+	if (actual_ns > 0) {
+		hint.report_actual_work_duration(ph->session, actual_ns);
+	}
+}
+
+void
+em_perf_hint_destroy(struct em_perf_hint **ptr_hint)
+{
+	struct em_perf_hint *ph = *ptr_hint;
+	if (ph == NULL) {
+		return;
+	}
+	*ptr_hint = NULL;
+
+	hint.close_session(ph->session);
+	free(ph);
+}
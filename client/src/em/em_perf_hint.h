@@ -0,0 +1,53 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Tells Android how long the render loop has per frame, so it clocks the threads of a frame up in time.
+ * @ingroup em_client
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+
+/*!
+ * A performance hint session of APerformanceHintManager, over the threads that have to finish a frame in time.
+ */
+struct em_perf_hint;
+
+/*!
+ * Open a session for @p threads, kernel thread ids.
+ *
+ * @param target_ns How long the work of a frame may take.
+ *
+ * @return NULL before API level 33, or if the system has no hint sessions.
+ */
+struct em_perf_hint *
+em_perf_hint_create(const int32_t *threads, size_t thread_count, int64_t target_ns);
+
+/*!
+ * Change the target, after the display rate changed. Cheap when it is the same.
+ */
+void
+em_perf_hint_update_target(struct em_perf_hint *ph, int64_t target_ns);
+
+/*!
+ * How long the work of the last frame took, once per frame.
+ */
+void
+em_perf_hint_report(struct em_perf_hint *ph, int64_t actual_ns);
+
+void
+em_perf_hint_destroy(struct em_perf_hint **ptr_hint);
+
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
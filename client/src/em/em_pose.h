@@ -0,0 +1,53 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Conversion of the poses in the DownMessage to OpenXR types.
+ * @ingroup em_client
+ */
+
+#pragma once
+
+#include "electricmaple.pb.h"
+
+#include <openxr/openxr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline XrQuaternionf
+quat_to_openxr(const em_proto_Quaternion *q)
+{
+	XrQuaternionf ret = {q->x, q->y, q->z, q->w};
+	return ret;
+}
+
+static inline XrVector3f
+vec3_to_openxr(const em_proto_Vec3 *v)
+{
+	XrVector3f ret = {v->x, v->y, v->z};
+	return ret;
+}
+
+/*!
+ * A missing orientation is the identity and a missing position the origin.
+ */
+static inline XrPosef
+pose_to_openxr(const em_proto_Pose *p)
+{
+	XrPosef ret = {{0, 0, 0, 1}, {0, 0, 0}};
+	if (p->has_orientation) {
+		ret.orientation = quat_to_openxr(&p->orientation);
+	}
+	if (p->has_position) {
+		ret.position = vec3_to_openxr(&p->position);
+	}
+	return ret;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -14,22 +14,37 @@
 
 #include "em_app_log.h"
 #include "em_connection.h"
+#include "em_controllers.h"
+#include "em_perf_hint.h"
 #include "em_stream_client.h"
+#include "em_sequence_tracker.h"
+#include "em_thread_sched.h"
+#include "em_trace.h"
 #include "gst_common.h"
 #include "render/GLSwapchain.h"
 #include "render/render.hpp"
 
 #include "pb_encode.h"
 #include "electricmaple.pb.h"
+#include "em_compact.h"
 
 #include "render/xr_platform_deps.h"
 
+#include "os/os_threading.h"
+#include "os/os_time.h"
+#include "util/u_time.h"
+
+#include <android/native_window_jni.h>
+
 #include <GLES3/gl3.h>
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <exception>
 #include <linux/time.h>
@@ -37,6 +52,11 @@
 #include <openxr/openxr.h>
 #include <openxr/openxr_platform.h>
 
+//! Quest has four, 72, 80, 90 and 120 Hz.
+#define EM_MAX_REFRESH_RATES (16)
+
+//! Beyond this a late frame is held where it got to, the motion of one frame says little about the ones after.
+#define EM_MAX_EXTRAPOLATED_FRAMES (3)
 
 struct _EmRemoteExperience
 {
@@ -44,12 +64,27 @@ struct _EmRemoteExperience
 	EmStreamClient *stream_client;
 	std::unique_ptr<Renderer> renderer;
 	struct em_sample *prev_sample;
+	//! Frames @ref prev_sample was moved on with its motion field, since it was new.
+	uint32_t extrapolatedFrames;
 
 	XrExtent2Di eye_extents;
 
+	//! Views are layers of array swapchains drawn with GL_OVR_multiview2, else side by side.
+	bool multiview;
+
+	//! MediaCodec decodes into xr_owned.surfaceSwapchain, we draw nothing ourselves.
+	bool surface;
+
 
 	PFN_xrConvertTimespecTimeToTimeKHR convertTimespecTimeToTime;
 
+	//! Null without XR_FB_display_refresh_rate, the display then stays at its default rate.
+	PFN_xrRequestDisplayRefreshRateFB requestDisplayRefreshRate;
+	float refreshRates[EM_MAX_REFRESH_RATES];
+	uint32_t refreshRateCount;
+	//! The rate we last asked the display for, 0 before the server picked one.
+	float refreshRate;
+
 	struct
 	{
 		XrInstance instance{XR_NULL_HANDLE};
@@ -63,33 +98,81 @@ struct _EmRemoteExperience
 		XrSpace worldSpace;
 		XrSpace viewSpace;
 		XrSwapchain swapchain;
+		//! Null if the runtime would not give us one, depth is then not submitted.
+		XrSwapchain depthSwapchain;
+		//! Only in surface mode, see @ref em_remote_experience_use_surface_swapchain.
+		XrSwapchain surfaceSwapchain;
 	} xr_owned;
 
+	//! Null if the actions could not be set up, the server then sees no controllers.
+	struct em_controllers *controllers;
+
 	GLSwapchain swapchainBuffers;
+	GLSwapchain depthSwapchainImages;
+
+	//! Chained onto the projection views, must live until xrEndFrame.
+	XrCompositionLayerDepthInfoKHR depthInfos[2];
 
 	std::atomic_int64_t nextUpMessage{1};
+
+	//! For TrackingMessage::sequence_idx, lets the server drop poses that arrive late.
+	std::atomic_int64_t nextTrackingSequence{1};
+
+	//! Samples and sends the HMD pose at its own rate, see @ref em_remote_experience_start_pose_thread.
+	struct os_thread_helper poseThread;
+	uint64_t posePeriodNs;
+	//! The pose thread is running, the render thread then sends no poses.
+	std::atomic_bool poseThreadStarted;
+	//! How far ahead of its render time the server displays frames, 0 until a frame told us.
+	std::atomic_int64_t serverLeadNs;
+	//! Of the last xrWaitFrame, the pose thread predicts to it until it knows the lead.
+	std::atomic_int64_t nextDisplayTime;
+
+	//! Display time of the last StreamStats we sent, they go up about once a second.
+	XrTime lastStreamStatsTime{0};
+
+	//! Over the render and decoder threads, opened once both ran, null if Android has no hint sessions.
+	struct em_perf_hint *perfHint;
+	//! The threads the session was last opened for, it is opened again when one of them changes.
+	int32_t perfHintThreads[2];
 };
 
-static constexpr size_t kUpBufferSize = em_proto_UpMessage_size + 10;
+static constexpr size_t kUpBufferSize = std::max<size_t>(em_proto_UpMessage_size, EM_COMPACT_UP_MESSAGE_MAX_SIZE) + 10;
 
-bool
-em_remote_experience_emit_upmessage(EmRemoteExperience *exp, em_proto_UpMessage *upMessage)
+static bool
+emit_upmessage(EmRemoteExperience *exp, em_proto_UpMessage *upMessage, bool reliable)
 {
 	int64_t message_id = exp->nextUpMessage++;
 	upMessage->up_message_id = message_id;
 
 	uint8_t buffer[kUpBufferSize];
-	pb_ostream_t os = pb_ostream_from_buffer(buffer, sizeof(buffer));
+	size_t size = 0;
 
-	pb_encode(&os, &em_proto_UpMessage_msg, upMessage);
+	// Anything the compact encoding does not carry still goes as protobuf.
+	int64_t epoch = 0;
+	if (em_connection_get_compact_epoch(exp->connection, &epoch)) {
+		size = em_compact_encode_up_message(upMessage, epoch, buffer, sizeof(buffer));
+	}
+	if (size == 0) {
+		pb_ostream_t os = pb_ostream_from_buffer(buffer, sizeof(buffer));
+		pb_encode(&os, &em_proto_UpMessage_msg, upMessage);
+		size = os.bytes_written;
+	}
 
 	ALOGD("Sending UpMessage #%ld for Frame #%ld", message_id, upMessage->frame.frame_sequence_id);
-	GBytes *bytes = g_bytes_new(buffer, os.bytes_written);
-	bool bResult = em_connection_send_bytes(exp->connection, bytes);
+	GBytes *bytes = g_bytes_new(buffer, size);
+	bool bResult = reliable ? em_connection_send_bytes(exp->connection, bytes)
+	                        : em_connection_send_bytes_unreliable(exp->connection, bytes);
 	g_bytes_unref(bytes);
 	return bResult;
 }
 
+bool
+em_remote_experience_emit_upmessage(EmRemoteExperience *exp, em_proto_UpMessage *upMessage)
+{
+	return emit_upmessage(exp, upMessage, true);
+}
+
 static void
 em_remote_experience_report_pose(EmRemoteExperience *exp, XrTime predictedDisplayTime)
 {
@@ -122,18 +205,93 @@ em_remote_experience_report_pose(EmRemoteExperience *exp, XrTime predictedDispla
 	tracking.P_localSpace_viewSpace.orientation.y = hmdLocalPose.orientation.y;
 	tracking.P_localSpace_viewSpace.orientation.z = hmdLocalPose.orientation.z;
 
+	tracking.sequence_idx = exp->nextTrackingSequence.fetch_add(1);
+	// The pose is predicted for this time, the server maps it to its own clock.
+	tracking.timestamp = predictedDisplayTime;
+
 	em_proto_UpMessage upMessage = em_proto_UpMessage_init_default;
 	upMessage.has_tracking = true;
 	upMessage.tracking = tracking;
 
-	if (!em_remote_experience_emit_upmessage(exp, &upMessage)) {
+	// Only the newest pose matters, a retransmit would just delay it.
+	if (!emit_upmessage(exp, &upMessage, false)) {
 		ALOGE("RYLIE: Could not queue HMD pose message!");
 	}
 }
 
+/*!
+ * Send poses until stopped, each predicted to when the server will show the frame it renders with it.
+ */
+static void *
+pose_thread_func(void *ptr)
+{
+	EmRemoteExperience *exp = reinterpret_cast<EmRemoteExperience *>(ptr);
+
+	int sched_ret = em_thread_sched_apply(EM_THREAD_ROLE_TRACKING);
+	if (sched_ret != 0) {
+		ALOGW("%s: Could not schedule the pose thread: %s", __FUNCTION__, strerror(sched_ret));
+	}
+
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	os_thread_helper_lock(&exp->poseThread);
+	while (os_thread_helper_is_running_locked(&exp->poseThread)) {
+		os_thread_helper_unlock(&exp->poseThread);
+
+		XrTime now = 0;
+		if (XR_SUCCEEDED(exp->convertTimespecTimeToTime(exp->xr_not_owned.instance, &next, &now))) {
+			int64_t lead = exp->serverLeadNs.load();
+			XrTime target = lead > 0 ? now + lead : std::max<XrTime>(now, exp->nextDisplayTime.load());
+			em_remote_experience_report_pose(exp, target);
+		}
+
+		// Absolute, so the rate does not drift with the time the sample took. Start over if we fell behind.
+		uint64_t next_ns = (uint64_t)next.tv_sec * U_TIME_1S_IN_NS + (uint64_t)next.tv_nsec + exp->posePeriodNs;
+		struct timespec now_ts;
+		clock_gettime(CLOCK_MONOTONIC, &now_ts);
+		if (next_ns < (uint64_t)now_ts.tv_sec * U_TIME_1S_IN_NS + (uint64_t)now_ts.tv_nsec) {
+			next = now_ts;
+		} else {
+			next.tv_sec = (time_t)(next_ns / U_TIME_1S_IN_NS);
+			next.tv_nsec = (long)(next_ns % U_TIME_1S_IN_NS);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+
+		os_thread_helper_lock(&exp->poseThread);
+	}
+	os_thread_helper_unlock(&exp->poseThread);
+
+	return NULL;
+}
+
+static void
+report_controllers(EmRemoteExperience *exp, XrTime predictedDisplayTime)
+{
+	if (exp->controllers == nullptr) {
+		return;
+	}
+
+	em_proto_UpMessage upMessage = em_proto_UpMessage_init_default;
+	upMessage.has_controllers = true;
+	if (!em_controllers_sample(exp->controllers, exp->xr_owned.worldSpace, predictedDisplayTime,
+	                           &upMessage.controllers)) {
+		return;
+	}
+
+	// Like the pose, and the next message repeats these samples anyway.
+	if (!emit_upmessage(exp, &upMessage, false)) {
+		ALOGE("%s: Could not queue controller message!", __FUNCTION__);
+	}
+}
+
 static void
 em_remote_experience_dispose(EmRemoteExperience *exp)
 {
+	// Before the spaces it locates go away.
+	os_thread_helper_stop_and_wait(&exp->poseThread);
+	exp->poseThreadStarted = false;
+
 	if (exp->stream_client) {
 		em_stream_client_stop(exp->stream_client);
 		if (exp->renderer) {
@@ -154,6 +312,7 @@ em_remote_experience_dispose(EmRemoteExperience *exp)
 	em_stream_client_destroy(&exp->stream_client);
 	g_clear_object(&exp->connection);
 	exp->swapchainBuffers.reset();
+	exp->depthSwapchainImages.reset();
 
 	if (exp->renderer) {
 		ALOGW(
@@ -167,11 +326,25 @@ em_remote_experience_dispose(EmRemoteExperience *exp)
 static void
 em_remote_experience_finalize(EmRemoteExperience *exp)
 {
+	em_controllers_destroy(&exp->controllers);
+	os_thread_helper_destroy(&exp->poseThread);
+	em_perf_hint_destroy(&exp->perfHint);
+
 	if (exp->xr_owned.swapchain != XR_NULL_HANDLE) {
 		xrDestroySwapchain(exp->xr_owned.swapchain);
 		exp->xr_owned.swapchain = XR_NULL_HANDLE;
 	}
 
+	if (exp->xr_owned.depthSwapchain != XR_NULL_HANDLE) {
+		xrDestroySwapchain(exp->xr_owned.depthSwapchain);
+		exp->xr_owned.depthSwapchain = XR_NULL_HANDLE;
+	}
+
+	if (exp->xr_owned.surfaceSwapchain != XR_NULL_HANDLE) {
+		xrDestroySwapchain(exp->xr_owned.surfaceSwapchain);
+		exp->xr_owned.surfaceSwapchain = XR_NULL_HANDLE;
+	}
+
 	if (exp->xr_owned.viewSpace != XR_NULL_HANDLE) {
 		xrDestroySpace(exp->xr_owned.viewSpace);
 		exp->xr_owned.viewSpace = XR_NULL_HANDLE;
@@ -188,9 +361,11 @@ em_remote_experience_new(EmConnection *connection,
                          EmStreamClient *stream_client,
                          XrInstance instance,
                          XrSession session,
-                         const XrExtent2Di *eye_extents)
+                         const XrExtent2Di *eye_extents,
+                         const char *cache_dir)
 {
 	EmRemoteExperience *self = reinterpret_cast<EmRemoteExperience *>(calloc(1, sizeof(EmRemoteExperience)));
+	os_thread_helper_init(&self->poseThread);
 	self->connection = g_object_ref_sink(connection);
 	// self->stream_client = g_object_ref_sink(stream_client);
 	self->stream_client = stream_client;
@@ -212,9 +387,47 @@ em_remote_experience_new(EmConnection *connection,
 		}
 	}
 
+	// Now as the time base of compact UpMessages, all the times we send come after it.
+	{
+		struct timespec now;
+		XrTime epoch = 0;
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == 0 &&
+		    XR_SUCCEEDED(self->convertTimespecTimeToTime(instance, &now, &epoch))) {
+			em_connection_set_compact_epoch(self->connection, epoch);
+		}
+	}
+
+	// The server streams at the display rate closest to what it prefers, we switch the display to it.
+	{
+		PFN_xrEnumerateDisplayRefreshRatesFB enumerateDisplayRefreshRates = nullptr;
+		xrGetInstanceProcAddr(instance, "xrEnumerateDisplayRefreshRatesFB",
+		                      reinterpret_cast<PFN_xrVoidFunction *>(&enumerateDisplayRefreshRates));
+		xrGetInstanceProcAddr(instance, "xrRequestDisplayRefreshRateFB",
+		                      reinterpret_cast<PFN_xrVoidFunction *>(&self->requestDisplayRefreshRate));
+
+		uint32_t count = 0;
+		if (enumerateDisplayRefreshRates != nullptr && self->requestDisplayRefreshRate != nullptr &&
+		    XR_SUCCEEDED(enumerateDisplayRefreshRates(session, EM_MAX_REFRESH_RATES, &count, self->refreshRates))) {
+			self->refreshRateCount = count;
+			em_connection_set_refresh_rates(self->connection, self->refreshRates, count);
+			ALOGI("%s: Display has %u refresh rates, up to %.0f Hz", __FUNCTION__, count,
+			      count > 0 ? self->refreshRates[count - 1] : 0.0f);
+		} else {
+			ALOGW("%s: Can't switch the display refresh rate, the stream may not match it.", __FUNCTION__);
+			self->requestDisplayRefreshRate = nullptr;
+		}
+	}
+
 	// Quest requires the EGL context to be current when calling xrCreateSwapchain
 	em_stream_client_egl_begin_pbuffer(stream_client);
 
+	// The layout Quest prefers, its compositor samples layers rather than a double wide image.
+	self->multiview = Renderer::supportsMultiview();
+	ALOGI("%s: Rendering views %s", __FUNCTION__, self->multiview ? "with multiview" : "side by side");
+
+	uint32_t swapchainWidth = self->multiview ? self->eye_extents.width : self->eye_extents.width * 2;
+	uint32_t swapchainLayers = self->multiview ? 2 : 1;
+
 	{
 		ALOGI("%s: Creating OpenXR Swapchain...", __FUNCTION__);
 		// OpenXR swapchain
@@ -222,11 +435,11 @@ em_remote_experience_new(EmConnection *connection,
 		swapchainInfo.type = XR_TYPE_SWAPCHAIN_CREATE_INFO;
 		swapchainInfo.usageFlags = XR_SWAPCHAIN_USAGE_COLOR_ATTACHMENT_BIT;
 		swapchainInfo.format = GL_SRGB8_ALPHA8;
-		swapchainInfo.width = self->eye_extents.width * 2;
+		swapchainInfo.width = swapchainWidth;
 		swapchainInfo.height = self->eye_extents.height;
 		swapchainInfo.sampleCount = 1;
 		swapchainInfo.faceCount = 1;
-		swapchainInfo.arraySize = 1;
+		swapchainInfo.arraySize = swapchainLayers;
 		swapchainInfo.mipCount = 1;
 
 		XrResult result = xrCreateSwapchain(session, &swapchainInfo, &self->xr_owned.swapchain);
@@ -239,7 +452,7 @@ em_remote_experience_new(EmConnection *connection,
 		}
 	}
 
-	if (!self->swapchainBuffers.enumerateAndGenerateFramebuffers(self->xr_owned.swapchain)) {
+	if (!self->swapchainBuffers.enumerateAndGenerateFramebuffers(self->xr_owned.swapchain, swapchainLayers)) {
 		ALOGE("%s: Failed to enumerate swapchain images or associate them with framebuffer object names.",
 		      __FUNCTION__);
 		em_stream_client_egl_end(stream_client);
@@ -247,11 +460,35 @@ em_remote_experience_new(EmConnection *connection,
 		return nullptr;
 	}
 
+	// Only used if the server streams depth, so not fatal.
+	{
+		XrSwapchainCreateInfo swapchainInfo = {};
+		swapchainInfo.type = XR_TYPE_SWAPCHAIN_CREATE_INFO;
+		swapchainInfo.usageFlags = XR_SWAPCHAIN_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+		swapchainInfo.format = GL_DEPTH_COMPONENT24;
+		swapchainInfo.width = swapchainWidth;
+		swapchainInfo.height = self->eye_extents.height;
+		swapchainInfo.sampleCount = 1;
+		swapchainInfo.faceCount = 1;
+		swapchainInfo.arraySize = swapchainLayers;
+		swapchainInfo.mipCount = 1;
+
+		XrResult result = xrCreateSwapchain(session, &swapchainInfo, &self->xr_owned.depthSwapchain);
+		if (XR_FAILED(result)) {
+			ALOGW("%s: Failed to create depth swapchain (%d), not submitting depth", __FUNCTION__, result);
+			self->xr_owned.depthSwapchain = XR_NULL_HANDLE;
+		} else if (!self->depthSwapchainImages.enumerateImages(self->xr_owned.depthSwapchain)) {
+			ALOGW("%s: Failed to enumerate depth swapchain images, not submitting depth", __FUNCTION__);
+			xrDestroySwapchain(self->xr_owned.depthSwapchain);
+			self->xr_owned.depthSwapchain = XR_NULL_HANDLE;
+		}
+	}
+
 
 	try {
 		ALOGI("%s: Setup renderer...", __FUNCTION__);
 		self->renderer = std::make_unique<Renderer>();
-		self->renderer->setupRender();
+		self->renderer->setupRender(self->multiview, cache_dir);
 	} catch (std::exception const &e) {
 		ALOGE("%s: Caught exception setting up renderer: %s", __FUNCTION__, e.what());
 		self->renderer->reset();
@@ -292,10 +529,83 @@ em_remote_experience_new(EmConnection *connection,
 		}
 	}
 
+	self->controllers = em_controllers_create(instance, session);
+	if (self->controllers == nullptr) {
+		ALOGW("%s: Failed to set up the controllers, not sending them", __FUNCTION__);
+	}
+
 	ALOGI("%s: done", __FUNCTION__);
 	return self;
 }
 
+bool
+em_remote_experience_start_pose_thread(EmRemoteExperience *exp, uint32_t rate_hz)
+{
+	if (rate_hz == 0 || exp->poseThreadStarted) {
+		return false;
+	}
+
+	exp->posePeriodNs = U_TIME_1S_IN_NS / rate_hz;
+	if (os_thread_helper_start(&exp->poseThread, pose_thread_func, exp) != 0) {
+		ALOGE("%s: Failed to start the pose thread", __FUNCTION__);
+		return false;
+	}
+	exp->poseThreadStarted = true;
+
+	ALOGI("%s: Sending poses at %u Hz", __FUNCTION__, rate_hz);
+	return true;
+}
+
+bool
+em_remote_experience_use_surface_swapchain(EmRemoteExperience *exp, JNIEnv *env)
+{
+	PFN_xrCreateSwapchainAndroidSurfaceKHR createSwapchainAndroidSurface = nullptr;
+	XrResult result =
+	    xrGetInstanceProcAddr(exp->xr_not_owned.instance, "xrCreateSwapchainAndroidSurfaceKHR",
+	                          reinterpret_cast<PFN_xrVoidFunction *>(&createSwapchainAndroidSurface));
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to get extension function xrCreateSwapchainAndroidSurfaceKHR (%d)", __FUNCTION__,
+		      result);
+		return false;
+	}
+
+	// The runtime samples the surface with whatever size MediaCodec gives its buffers, this is the double wide
+	// layout the server encodes.
+	XrSwapchainCreateInfo swapchainInfo = {};
+	swapchainInfo.type = XR_TYPE_SWAPCHAIN_CREATE_INFO;
+	swapchainInfo.width = exp->eye_extents.width * 2;
+	swapchainInfo.height = exp->eye_extents.height;
+	swapchainInfo.sampleCount = 1;
+	swapchainInfo.faceCount = 1;
+	swapchainInfo.arraySize = 1;
+	swapchainInfo.mipCount = 1;
+
+	jobject surface = nullptr;
+	result = createSwapchainAndroidSurface(exp->xr_not_owned.session, &swapchainInfo,
+	                                       &exp->xr_owned.surfaceSwapchain, &surface);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to create surface swapchain (%d)", __FUNCTION__, result);
+		exp->xr_owned.surfaceSwapchain = XR_NULL_HANDLE;
+		return false;
+	}
+
+	ANativeWindow *window = ANativeWindow_fromSurface(env, surface);
+	if (window == nullptr) {
+		ALOGE("%s: No native window for the swapchain surface", __FUNCTION__);
+		xrDestroySwapchain(exp->xr_owned.surfaceSwapchain);
+		exp->xr_owned.surfaceSwapchain = XR_NULL_HANDLE;
+		return false;
+	}
+
+	// The stream client takes its own reference.
+	em_stream_client_set_surface(exp->stream_client, window);
+	ANativeWindow_release(window);
+
+	exp->surface = true;
+	ALOGI("%s: Decoding into a surface swapchain", __FUNCTION__);
+	return true;
+}
+
 void
 em_remote_experience_destroy(EmRemoteExperience **ptr_exp)
 {
@@ -313,9 +623,92 @@ em_remote_experience_destroy(EmRemoteExperience **ptr_exp)
 	*ptr_exp = NULL;
 }
 
+static void
+report_stream_stats(EmRemoteExperience *exp, XrTime predictedDisplayTime)
+{
+	if (predictedDisplayTime - exp->lastStreamStatsTime < 1000000000) {
+		return;
+	}
+
+	struct em_sequence_stats stats = {};
+	if (!em_stream_client_get_frame_stats(exp->stream_client, &stats)) {
+		return;
+	}
+	exp->lastStreamStatsTime = predictedDisplayTime;
+
+	em_proto_UpMessage upMsg = em_proto_UpMessage_init_default;
+	upMsg.has_stream_stats = true;
+	upMsg.stream_stats.frames_received = stats.received;
+	upMsg.stream_stats.frames_lost = stats.lost;
+	upMsg.stream_stats.frames_late = stats.late;
+	upMsg.stream_stats.frames_duplicated = stats.duplicates;
+	upMsg.stream_stats.max_reorder_depth = stats.max_reorder_depth;
+	upMsg.stream_stats.max_loss_burst = stats.max_loss_burst;
+	em_remote_experience_emit_upmessage(exp, &upMsg);
+}
+
+//! Switch the display to the rate the server streams at, once it told us.
+static void
+em_remote_experience_update_refresh_rate(EmRemoteExperience *exp)
+{
+	float streamRate = em_connection_get_refresh_rate(exp->connection);
+	if (exp->requestDisplayRefreshRate == nullptr || streamRate <= 0.0f) {
+		return;
+	}
+
+	// The server echoes one of our rates, rounded on the way.
+	float rate = exp->refreshRates[0];
+	for (uint32_t i = 1; i < exp->refreshRateCount; i++) {
+		if (std::fabs(exp->refreshRates[i] - streamRate) < std::fabs(rate - streamRate)) {
+			rate = exp->refreshRates[i];
+		}
+	}
+	if (rate == exp->refreshRate) {
+		return;
+	}
+
+	exp->refreshRate = rate;
+	XrResult result = exp->requestDisplayRefreshRate(exp->xr_not_owned.session, rate);
+	if (XR_FAILED(result)) {
+		ALOGW("%s: xrRequestDisplayRefreshRateFB(%.2f) failed (%d)", __FUNCTION__, rate, result);
+	} else {
+		ALOGI("%s: Display refresh rate set to %.2f Hz", __FUNCTION__, rate);
+	}
+}
+
+/*!
+ * Open the hint session once the decoder ran, a session covers the threads it was opened with. So it is opened
+ * again for the new decoder thread after a reconnect.
+ */
+static void
+update_perf_hint(EmRemoteExperience *exp, XrDuration displayPeriod, int64_t workNs)
+{
+	int32_t threads[2] = {
+	    em_thread_sched_get_thread(EM_THREAD_ROLE_RENDER),
+	    em_stream_client_get_decode_thread(exp->stream_client),
+	};
+	if (threads[0] == 0 || threads[1] == 0 || displayPeriod <= 0) {
+		return;
+	}
+	if (threads[0] != exp->perfHintThreads[0] || threads[1] != exp->perfHintThreads[1]) {
+		// Also tried only once per set of threads if Android has no hint sessions.
+		em_perf_hint_destroy(&exp->perfHint);
+		exp->perfHintThreads[0] = threads[0];
+		exp->perfHintThreads[1] = threads[1];
+		exp->perfHint = em_perf_hint_create(threads, 2, displayPeriod);
+	}
+	if (exp->perfHint == nullptr) {
+		return;
+	}
+
+	em_perf_hint_update_target(exp->perfHint, displayPeriod);
+	em_perf_hint_report(exp->perfHint, workNs);
+}
+
 EmPollRenderResult
 em_remote_experience_poll_and_render_frame(EmRemoteExperience *exp)
 {
+	em_remote_experience_update_refresh_rate(exp);
 
 	XrFrameState frameState = {.type = XR_TYPE_FRAME_STATE};
 	XrSession session = exp->xr_not_owned.session;
@@ -325,6 +718,8 @@ em_remote_experience_poll_and_render_frame(EmRemoteExperience *exp)
 		ALOGE("xrWaitFrame failed");
 		return EM_POLL_RENDER_RESULT_ERROR_WAITFRAME;
 	}
+	// The time waiting for the display is not work.
+	int64_t workStartNs = (int64_t)os_monotonic_get_ns();
 
 	XrFrameBeginInfo beginfo = {.type = XR_TYPE_FRAME_BEGIN_INFO};
 
@@ -367,7 +762,6 @@ em_remote_experience_poll_and_render_frame(EmRemoteExperience *exp)
 	layer.type = XR_TYPE_COMPOSITION_LAYER_PROJECTION;
 	layer.viewCount = 2;
 
-	// TODO use multiview/array swapchain instead of two draw calls for side by side?
 	XrCompositionLayerProjectionView projectionViews[2] = {};
 	projectionViews[0].type = XR_TYPE_COMPOSITION_LAYER_PROJECTION_VIEW;
 
@@ -377,7 +771,8 @@ em_remote_experience_poll_and_render_frame(EmRemoteExperience *exp)
 
 	// Render
 
-	if (!em_stream_client_egl_begin_pbuffer(exp->stream_client)) {
+	// Nothing to draw in surface mode.
+	if (!exp->surface && !em_stream_client_egl_begin_pbuffer(exp->stream_client)) {
 		ALOGE("FRED: mainloop_one: Failed make egl context current");
 		return EM_POLL_RENDER_RESULT_ERROR_EGL;
 	}
@@ -396,11 +791,22 @@ em_remote_experience_poll_and_render_frame(EmRemoteExperience *exp)
 	endInfo.layerCount = em_poll_render_result_include_layer(prResult) ? 1 : 0;
 	endInfo.layers = (const XrCompositionLayerBaseHeader *[1]){(XrCompositionLayerBaseHeader *)&layer};
 
+	update_perf_hint(exp, frameState.predictedDisplayPeriod, (int64_t)os_monotonic_get_ns() - workStartNs);
+
+	em_trace_begin("em xrEndFrame");
 	xrEndFrame(session, &endInfo);
+	em_trace_end();
 
-	em_stream_client_egl_end(exp->stream_client);
+	if (!exp->surface) {
+		em_stream_client_egl_end(exp->stream_client);
+	}
 
-	em_remote_experience_report_pose(exp, frameState.predictedDisplayTime);
+	exp->nextDisplayTime = frameState.predictedDisplayTime;
+	if (!exp->poseThreadStarted) {
+		em_remote_experience_report_pose(exp, frameState.predictedDisplayTime);
+	}
+	report_controllers(exp, frameState.predictedDisplayTime);
+	report_stream_stats(exp, frameState.predictedDisplayTime);
 	return prResult;
 }
 
@@ -409,7 +815,7 @@ report_frame_timing(EmRemoteExperience *exp,
                     const struct timespec *beginFrameTime,
                     const struct timespec *decodeEndTime,
                     XrTime predictedDisplayTime,
-                    int64_t frame_sequence_id)
+                    const struct em_sample *sample)
 {
 	XrTime xrTimeDecodeEnd = 0;
 	XrTime xrTimeBeginFrame = 0;
@@ -423,17 +829,123 @@ report_frame_timing(EmRemoteExperience *exp,
 		ALOGE("%s: Failed to convert begin-frame time (%d)", __FUNCTION__, result);
 		return;
 	}
+	// Optional, the server then just has no network stage for this frame.
+	XrTime xrTimeDepay = 0;
+	if (sample->depay_time_ns != 0) {
+		struct timespec depayTime = {
+		    .tv_sec = static_cast<time_t>(sample->depay_time_ns / 1000000000),
+		    .tv_nsec = static_cast<long>(sample->depay_time_ns % 1000000000),
+		};
+		if (XR_FAILED(exp->convertTimespecTimeToTime(exp->xr_not_owned.instance, &depayTime, &xrTimeDepay))) {
+			xrTimeDepay = 0;
+		}
+	}
 	em_proto_UpFrameMessage msg = em_proto_UpFrameMessage_init_default;
-	msg.frame_sequence_id = frame_sequence_id;
+	msg.frame_sequence_id = sample->frame_sequence_id;
 	msg.decode_complete_time = xrTimeDecodeEnd;
 	msg.begin_frame_time = xrTimeBeginFrame;
 	msg.display_time = predictedDisplayTime;
+	msg.depay_time = xrTimeDepay;
 	em_proto_UpMessage upMsg = em_proto_UpMessage_init_default;
 	upMsg.frame = msg;
 	upMsg.has_frame = true;
 	em_remote_experience_emit_upmessage(exp, &upMsg);
 }
 
+static struct em_sample *
+pull_sample(EmRemoteExperience *exp, XrTime predictedDisplayTime, struct timespec *out_decode_end)
+{
+	em_trace_begin("em pull");
+	struct em_sample *sample = em_stream_client_try_pull_sample(exp->stream_client, predictedDisplayTime, out_decode_end);
+	em_trace_end();
+
+	if (sample != nullptr) {
+		em_trace_counter(EM_TRACE_FRAME_COUNTER, sample->frame_sequence_id);
+		if (sample->render_time != 0 && sample->display_time > sample->render_time) {
+			exp->serverLeadNs = sample->display_time - sample->render_time;
+		}
+	}
+	return sample;
+}
+
+static bool
+acquire_depth_image(EmRemoteExperience *exp, uint32_t *out_index)
+{
+	XrResult result = xrAcquireSwapchainImage(exp->xr_owned.depthSwapchain, NULL, out_index);
+	if (XR_FAILED(result)) {
+		ALOGE("Failed to acquire depth swapchain image (%d)", result);
+		return false;
+	}
+
+	XrSwapchainImageWaitInfo waitInfo = {.type = XR_TYPE_SWAPCHAIN_IMAGE_WAIT_INFO,
+	                                     .timeout = XR_INFINITE_DURATION};
+	result = xrWaitSwapchainImage(exp->xr_owned.depthSwapchain, &waitInfo);
+	if (XR_FAILED(result)) {
+		ALOGE("Failed to wait for depth swapchain image (%d)", result);
+		xrReleaseSwapchainImage(exp->xr_owned.depthSwapchain, NULL);
+		return false;
+	}
+
+	return true;
+}
+
+/*!
+ * The frame is already in the surface swapchain when we get its sample, so this only points the layer at it.
+ */
+static EmPollRenderResult
+poll_surface_frame(EmRemoteExperience *exp,
+                   const struct timespec *beginFrameTime,
+                   XrTime predictedDisplayTime,
+                   XrView *views,
+                   XrCompositionLayerProjectionView *projectionViews)
+{
+	struct timespec decodeEndTime;
+	struct em_sample *sample = pull_sample(exp, predictedDisplayTime, &decodeEndTime);
+	if (sample == nullptr) {
+		sample = exp->prev_sample;
+		if (sample == nullptr) {
+			return EM_POLL_RENDER_RESULT_NO_SAMPLE_AVAILABLE;
+		}
+	}
+
+	// No shader pass, so the depth band below the color is cropped instead of dropped.
+	int32_t width = exp->eye_extents.width;
+	int32_t height = exp->eye_extents.height;
+	if (sample->have_depth && sample->depth.color_fraction > 0.f) {
+		height = static_cast<int32_t>(static_cast<float>(height) * sample->depth.color_fraction);
+	}
+
+	// Each view sits at the top left of its half, so its rect only gets smaller.
+	int32_t activeWidth = width;
+	int32_t activeHeight = height;
+	if (sample->have_active_size) {
+		activeWidth = std::max(static_cast<int32_t>(static_cast<float>(width) * sample->active_size.x), 1);
+		activeHeight = std::max(static_cast<int32_t>(static_cast<float>(height) * sample->active_size.y), 1);
+	}
+
+	for (uint32_t eye = 0; eye < 2; eye++) {
+		projectionViews[eye].subImage.swapchain = exp->xr_owned.surfaceSwapchain;
+		projectionViews[eye].subImage.imageArrayIndex = 0;
+		projectionViews[eye].subImage.imageRect.offset = {static_cast<int32_t>(width * eye), 0};
+		projectionViews[eye].subImage.imageRect.extent = {activeWidth, activeHeight};
+		projectionViews[eye].fov = views[eye].fov;
+		projectionViews[eye].pose = sample->poses[eye];
+	}
+
+	if (sample == exp->prev_sample) {
+		return EM_POLL_RENDER_RESULT_REUSED_SAMPLE;
+	}
+
+	if (exp->prev_sample != NULL) {
+		em_stream_client_release_sample(exp->stream_client, exp->prev_sample);
+	}
+	exp->prev_sample = sample;
+
+	report_frame_timing(exp, beginFrameTime, &decodeEndTime, predictedDisplayTime, sample);
+
+	return EM_POLL_RENDER_RESULT_NEW_SAMPLE;
+}
+
 EmPollRenderResult
 em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
                                                  const struct timespec *beginFrameTime,
@@ -464,23 +976,35 @@ em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
 
 	projectionLayer->space = exp->xr_owned.worldSpace;
 
-	projectionViews[0].subImage.swapchain = exp->xr_owned.swapchain;
-	projectionViews[0].fov = views[0].fov;
-	projectionViews[0].subImage.imageRect.offset = {0, 0};
-	projectionViews[0].subImage.imageRect.extent = {static_cast<int32_t>(width), static_cast<int32_t>(height)};
-	projectionViews[1].subImage.swapchain = exp->xr_owned.swapchain;
-	projectionViews[1].fov = views[1].fov;
-	projectionViews[1].subImage.imageRect.offset = {static_cast<int32_t>(width), 0};
-	projectionViews[1].subImage.imageRect.extent = {static_cast<int32_t>(width), static_cast<int32_t>(height)};
+	if (exp->surface) {
+		return poll_surface_frame(exp, beginFrameTime, predictedDisplayTime, views, projectionViews);
+	}
+
+	for (uint32_t eye = 0; eye < 2; eye++) {
+		// Either a layer each or side by side.
+		int32_t offset = exp->multiview ? 0 : static_cast<int32_t>(width * eye);
+		projectionViews[eye].subImage.swapchain = exp->xr_owned.swapchain;
+		projectionViews[eye].subImage.imageArrayIndex = exp->multiview ? eye : 0;
+		projectionViews[eye].fov = views[eye].fov;
+		projectionViews[eye].subImage.imageRect.offset = {offset, 0};
+		projectionViews[eye].subImage.imageRect.extent = {static_cast<int32_t>(width),
+		                                                  static_cast<int32_t>(height)};
+	}
 
 	struct timespec decodeEndTime;
-	struct em_sample *sample = em_stream_client_try_pull_sample(exp->stream_client, &decodeEndTime);
+	struct em_sample *sample = pull_sample(exp, predictedDisplayTime, &decodeEndTime);
 
+	// A late frame moves on with the motion of the last one, rather than standing still.
+	float extrapolation = 0.0f;
 	if (sample == nullptr) {
-		if (exp->prev_sample) {
+		if (exp->prev_sample == nullptr) {
+			return EM_POLL_RENDER_RESULT_NO_SAMPLE_AVAILABLE;
+		}
+		if (!exp->prev_sample->have_motion || exp->extrapolatedFrames >= EM_MAX_EXTRAPOLATED_FRAMES) {
 			return EM_POLL_RENDER_RESULT_REUSED_SAMPLE;
 		}
-		return EM_POLL_RENDER_RESULT_NO_SAMPLE_AVAILABLE;
+		sample = exp->prev_sample;
+		extrapolation = static_cast<float>(++exp->extrapolatedFrames);
 	}
 
 	projectionViews[0].pose = sample->poses[0];
@@ -513,31 +1037,74 @@ em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
 	}
 	glBindFramebuffer(GL_FRAMEBUFFER, exp->swapchainBuffers.framebufferNameAtSwapchainIndex(imageIndex));
 
-	glViewport(0, 0, width * 2, height);
+	// Lets the runtime reproject positionally rather than only rotate.
+	uint32_t depthImageIndex = 0;
+	bool submitDepth = sample->have_depth && sample->depth.valid &&
+	                   exp->xr_owned.depthSwapchain != XR_NULL_HANDLE && acquire_depth_image(exp, &depthImageIndex);
+	uint32_t viewCount = exp->multiview ? 2 : 1;
+	if (submitDepth) {
+		attachSwapchainTexture(GL_DEPTH_ATTACHMENT,
+		                       exp->depthSwapchainImages.textureNameAtSwapchainIndex(depthImageIndex), viewCount);
+	}
+
+	// One draw for both views either way, multiview replicates it to the layers.
+	glViewport(0, 0, exp->multiview ? width : width * 2, height);
 	glClearColor(0.0f, 1.0f, 0.0f, 1.0f);
 
 	// for (uint32_t eye = 0; eye < 2; eye++) {
 	// 	glViewport(eye * width, 0, width, height);
-	exp->renderer->draw(sample->frame_texture_id, sample->frame_texture_target);
+	em_trace_begin("em draw");
+	exp->renderer->draw(sample->frame_texture_id, sample->frame_texture_target,
+	                    sample->have_foveation ? &sample->foveation : NULL,
+	                    sample->have_depth ? &sample->depth : NULL,
+	                    sample->have_active_size ? &sample->active_size : NULL,
+	                    sample->have_motion ? &sample->motion : NULL, extrapolation);
+	em_trace_end();
 	// }
 
 	// Release
 
+	if (submitDepth) {
+		attachSwapchainTexture(GL_DEPTH_ATTACHMENT, 0, viewCount);
+	}
+
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	xrReleaseSwapchainImage(exp->xr_owned.swapchain, NULL);
 
+	if (submitDepth) {
+		xrReleaseSwapchainImage(exp->xr_owned.depthSwapchain, NULL);
+
+		for (uint32_t eye = 0; eye < 2; eye++) {
+			XrCompositionLayerDepthInfoKHR *depthInfo = &exp->depthInfos[eye];
+			*depthInfo = {};
+			depthInfo->type = XR_TYPE_COMPOSITION_LAYER_DEPTH_INFO_KHR;
+			depthInfo->subImage.swapchain = exp->xr_owned.depthSwapchain;
+			depthInfo->subImage.imageRect = projectionViews[eye].subImage.imageRect;
+			depthInfo->subImage.imageArrayIndex = projectionViews[eye].subImage.imageArrayIndex;
+			depthInfo->minDepth = sample->depth.min_depth;
+			depthInfo->maxDepth = sample->depth.max_depth;
+			depthInfo->nearZ = sample->depth.near_z;
+			depthInfo->farZ = sample->depth.far_z;
+			projectionViews[eye].next = depthInfo;
+		}
+	}
+
 	// TODO check here to see if we already overshot the predicted display time, maybe?
 
+	if (sample == exp->prev_sample) {
+		return EM_POLL_RENDER_RESULT_EXTRAPOLATED_SAMPLE;
+	}
 
 	if (exp->prev_sample != NULL) {
 		em_stream_client_release_sample(exp->stream_client, exp->prev_sample);
 		exp->prev_sample = NULL;
 	}
 	exp->prev_sample = sample;
+	exp->extrapolatedFrames = 0;
 
 	// Send frame report
-	report_frame_timing(exp, beginFrameTime, &decodeEndTime, predictedDisplayTime, sample->frame_sequence_id);
+	report_frame_timing(exp, beginFrameTime, &decodeEndTime, predictedDisplayTime, sample);
 
 	return EM_POLL_RENDER_RESULT_NEW_SAMPLE;
 }
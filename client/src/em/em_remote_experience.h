@@ -13,6 +13,7 @@
 
 #include "em_connection.h"
 #include "em_stream_client.h"
+#include <jni.h>
 #include <openxr/openxr.h>
 
 typedef struct _EmRemoteExperience EmRemoteExperience;
@@ -31,6 +32,8 @@ typedef enum EmPollRenderResult
 	EM_POLL_RENDER_RESULT_NO_SAMPLE_AVAILABLE = 0,
 	EM_POLL_RENDER_RESULT_SHOULD_NOT_RENDER,
 	EM_POLL_RENDER_RESULT_REUSED_SAMPLE,
+	//! The last sample again, moved on with its motion field while the next one is late.
+	EM_POLL_RENDER_RESULT_EXTRAPOLATED_SAMPLE,
 	EM_POLL_RENDER_RESULT_NEW_SAMPLE,
 } EmPollRenderResult;
 
@@ -57,6 +60,7 @@ em_poll_render_result_to_string(EmPollRenderResult res)
 		MAKE_CASE(EM_POLL_RENDER_RESULT_NO_SAMPLE_AVAILABLE);
 		MAKE_CASE(EM_POLL_RENDER_RESULT_SHOULD_NOT_RENDER);
 		MAKE_CASE(EM_POLL_RENDER_RESULT_REUSED_SAMPLE);
+		MAKE_CASE(EM_POLL_RENDER_RESULT_EXTRAPOLATED_SAMPLE);
 		MAKE_CASE(EM_POLL_RENDER_RESULT_NEW_SAMPLE);
 	default: return "EM_POLL_RENDER_RESULT_unknown";
 	}
@@ -71,8 +75,11 @@ em_poll_render_result_to_string(EmPollRenderResult res)
  * @param connection Your connection: we sink a ref. Used to send reports upstream.
  * @param stream_client Your stream client: we take ownership.
  * @param instance Your OpenXR instance: we only observe, do not take ownership.
- * @param session Your OpenXR session: we only observe, do not take ownership.
+ * @param session Your OpenXR session: we only observe, do not take ownership. We attach an action set to it for the
+ *                controllers, so it must not have one attached yet.
  * @param eye_extents Dimensions of the eye swapchain (max)
+ * @param cache_dir Where to keep what is slow to make and may be lost, like the linked shader program. NULL for
+ *                  nowhere.
  *
  * @return EmRemoteExperience* or NULL in case of error
  */
@@ -81,9 +88,39 @@ em_remote_experience_new(EmConnection *connection,
                          EmStreamClient *stream_client,
                          XrInstance instance,
                          XrSession session,
-                         const XrExtent2Di *eye_extents);
+                         const XrExtent2Di *eye_extents,
+                         const char *cache_dir);
 
 
+/*!
+ * Let MediaCodec decode straight into an XR_KHR_android_surface_swapchain instead of rendering the frames ourselves.
+ *
+ * Saves the copy into our swapchain, but the frame is submitted as decoded: foveated frames are not undistorted.
+ * You must have enabled the XR_KHR_android_surface_swapchain extension, and call this before the stream client
+ * creates its pipeline.
+ *
+ * @param exp Self
+ * @param env The JNI environment of the calling thread, to get at the swapchain's Surface.
+ *
+ * @return false if the swapchain could not be created, the normal path is then used.
+ */
+bool
+em_remote_experience_use_surface_swapchain(EmRemoteExperience *exp, JNIEnv *env);
+
+/*!
+ * Sample and send the HMD pose on a thread of its own at @p rate_hz instead of once per frame after xrEndFrame.
+ *
+ * Each pose is predicted as far ahead as the server shows the frames it renders, taken from the frames it sent.
+ * Until the first frame, poses are predicted to the next display time of this session.
+ *
+ * @param exp Self
+ * @param rate_hz Poses per second, for example 500.
+ *
+ * @return false if the thread could not be started or already runs, poses are then sent once per frame.
+ */
+bool
+em_remote_experience_start_pose_thread(EmRemoteExperience *exp, uint32_t rate_hz);
+
 /*!
  * Clear a pointer and free the associate remote experience object, if any.
  *
@@ -0,0 +1,226 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Internal header for a ring indexed variant of the IdDataAccumulator
+ * @ingroup em_client
+ */
+#pragma once
+
+#include "em/em_id_data_accumulator.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+namespace em {
+
+namespace id_data_accum {
+
+	/*!
+	 * Collecting data for increasing key values, in the slot at `id % Capacity`.
+	 *
+	 * Works like @ref IdDataAccumulator, but finding and adding an ID does not scan the other entries, so it can
+	 * hold everything in flight of a deep pipeline. Each slot keeps the full ID as its tag, an ID that shares the
+	 * slot of a newer one is never mistaken for it.
+	 *
+	 * An ID evicts an older one in its slot, and is not added if the slot holds a newer one. So the entries kept are
+	 * at most @p Capacity IDs apart, while the IdDataAccumulator evicts the oldest one of all.
+	 *
+	 * @tparam ValueType the data structure associated with each key
+	 * @tparam Capacity the number of slots, a power of two.
+	 */
+	template <typename ValueType, std::size_t Capacity> class RingIdDataAccumulator
+	{
+		static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+	public:
+		/// Constructor
+		RingIdDataAccumulator()
+		{
+			clear();
+		}
+
+		/// Clear all entries.
+		void
+		clear()
+		{
+			for (auto &p : m_data) {
+				markPairUnpopulated(p);
+			}
+			m_size = 0;
+		}
+
+		/// Get a pointer to the value corresponding to that ID, or nullptr if not found.
+		ValueType *
+		getForId(IdType id)
+		{
+			PairType &p = slotFor(id);
+			return (id != kSentinel && p.first == id) ? &p.second : nullptr;
+		}
+
+		/// Get a pointer to the const value corresponding to that ID, or nullptr if not found.
+		ValueType const *
+		getConstForId(IdType id) const
+		{
+			PairType const &p = m_data[indexFor(id)];
+			return (id != kSentinel && p.first == id) ? &p.second : nullptr;
+		}
+
+		/// Get a pointer to the const value corresponding to that ID, or nullptr if not found.
+		ValueType const *
+		getForId(IdType id) const
+		{
+			return getConstForId(id);
+		}
+
+		/// Get the number of entries in progress
+		size_t
+		size() const
+		{
+			return m_size;
+		}
+
+		/*!
+		 * Add a data structure with the given ID.
+		 *
+		 * @param id ID of data
+		 * @param value The structure you'd like to add
+		 * @return true if the data was actually added, false if its slot holds a newer ID
+		 *
+		 * @throws if the ID already exists or is the sentinel
+		 */
+		bool
+		addDataFor(IdType id, ValueType &&value)
+		{
+			if (id == kSentinel) {
+				throw std::logic_error("Sentinel ID passed to addDataFor");
+			}
+			PairType &p = slotFor(id);
+			if (isPairPopulated(p)) {
+				if (p.first == id) {
+					throw std::logic_error("ID already present in accumulator");
+				}
+				if (id < p.first) {
+					// Do not insert over a newer entry
+					return false;
+				}
+				// TODO do we notify about forgetting this?
+			} else {
+				m_size++;
+			}
+
+			p.first = id;
+			p.second = std::move(value);
+			return true;
+		}
+
+		/*!
+		 * Look for a data structure with the given ID. If it exists, call the functor on it.
+		 *
+		 * @param id ID of data
+		 * @param dataUpdater A functor taking ValueType& that will update the data for that key, if found
+		 * @return true if the ID was found and functor was called.
+		 */
+		template <typename F>
+		bool
+		updateDataFor(IdType id, F &&dataUpdater)
+		{
+			ValueType *ptr = getForId(id);
+			if (ptr) {
+				dataUpdater(*ptr);
+				return true;
+			}
+			// we didn't find it
+			return false;
+		}
+
+		/*!
+		 * Call your functor on all populated entries, so you can emit them if they're ready to go.
+		 *
+		 * This one does visit every slot, it returns early once it has seen all entries though.
+		 *
+		 * @param dataHandler A functor taking IdType and ValueType& that will do stuff with the data and return
+		 * @ref Command
+		 *
+		 * @return true if any in-progress structures remain
+		 */
+		template <typename F>
+		bool
+		visitAll(F &&dataHandler)
+		{
+			size_t remaining = m_size;
+			for (auto it = m_data.begin(); remaining > 0 && it != m_data.end(); ++it) {
+				if (isPairPopulated(*it)) {
+					remaining--;
+					Command cmd = dataHandler(it->first, it->second);
+					if (cmd == Command::Drop) {
+						markPairUnpopulated(*it);
+						m_size--;
+					}
+				}
+			}
+			return m_size > 0;
+		}
+
+		/*!
+		 * Call your functor on all populated entries, as const.
+		 *
+		 * @param dataHandler A functor taking IdType and const ValueType& that will do stuff with the data
+		 *
+		 * @return true if any entries exist and were visited
+		 */
+		template <typename F>
+		bool
+		constVisitAll(F &&dataHandler) const
+		{
+			size_t remaining = m_size;
+			for (auto it = m_data.begin(); remaining > 0 && it != m_data.end(); ++it) {
+				if (isPairPopulated(*it)) {
+					remaining--;
+					dataHandler(it->first, it->second);
+				}
+			}
+			return m_size > 0;
+		}
+
+	private:
+		using PairType = std::pair<IdType, ValueType>;
+
+		static std::size_t
+		indexFor(IdType id)
+		{
+			// Two's complement, so negative IDs get slots too.
+			return static_cast<std::size_t>(static_cast<std::uint64_t>(id) & (Capacity - 1));
+		}
+		PairType &
+		slotFor(IdType id)
+		{
+			return m_data[indexFor(id)];
+		}
+
+		static bool
+		isPairPopulated(PairType const &p)
+		{
+			return p.first != kSentinel;
+		}
+		static void
+		markPairUnpopulated(PairType &p)
+		{
+			p.first = kSentinel;
+			p.second = {};
+		}
+
+		std::array<PairType, Capacity> m_data;
+		std::size_t m_size = 0;
+	};
+
+}; // namespace id_data_accum
+
+using id_data_accum::RingIdDataAccumulator;
+
+} // namespace em
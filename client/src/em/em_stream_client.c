@@ -14,12 +14,21 @@
 #include "em_connection.h"
 #include "gst_common.h" // for em_sample
 #include "em/em_egl.h"
+#include "em_codec.h"
+#include "em_surface_decoder.h"
+#include "em_trace.h"
+#include "em_sequence_tracker.h"
+#include "em_thread_sched.h"
+#include "em_jitter_latency.h"
+#include "em_pose.h"
 
 #include "electricmaple.pb.h"
 
 #include <openxr/openxr.h>
 
 #include "os/os_threading.h"
+#include "os/os_time.h"
+#include "util/u_time.h"
 
 #include <gst/app/gstappsink.h>
 #include <gst/gl/gl.h>
@@ -32,10 +41,10 @@
 #include <gst/gstsample.h>
 #include <gst/gstutils.h>
 #include <gst/rtp/gstrtpbuffer.h>
-#include <gst/video/video-frame.h>
 #include <pb_decode.h>
 
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <GLES2/gl2ext.h>
 
 #include <linux/time.h>
@@ -45,9 +54,20 @@
 #include <string.h>
 
 
-// Thresholds for reusing last DownMsg when we received too many frames without DownMsgs in a row.
-#define EM_NO_DOWN_MSG_FALLBACK_TIMEOUT_SECS 1
-#define EM_NO_DOWN_MSG_FALLBACK_SKIPPED_FRAME_THRESHOLD 10
+// Decoded samples waiting for their display time, enough to absorb jitter without adding a fixed delay.
+#define EM_SAMPLE_QUEUE_LENGTH 3
+
+// Samples pulled and not released yet, the renderer keeps the last one until it has the next.
+#define EM_SAMPLE_HELD_COUNT 2
+
+// Every sample lives in one of these from the time it is decoded until it is released.
+#define EM_SAMPLE_SLOT_COUNT (EM_SAMPLE_QUEUE_LENGTH + EM_SAMPLE_HELD_COUNT)
+
+// Frame interval until two samples tell us the real one, 90 Hz.
+#define EM_DEFAULT_FRAME_INTERVAL_NS (U_TIME_1S_IN_NS / 90)
+
+// DownMessages of access units in the surface decoder, more than it ever holds at once.
+#define EM_SURFACE_DOWN_MSG_COUNT 16
 
 
 void
@@ -62,6 +82,19 @@ struct em_sc_sample
 {
 	struct em_sample base;
 	GstSample *sample;
+
+	//! Taken from @ref _EmStreamClient::sample_slots, protected by the sample mutex.
+	bool in_use;
+};
+
+struct em_queued_sample
+{
+	//! Filled in on arrival, so pulling it is only taking it off the queue.
+	struct em_sc_sample *slot;
+	struct timespec decode_end;
+
+	//! What we schedule by, 0 to show it as soon as possible.
+	int64_t display_time;
 };
 
 struct _EmStreamClient
@@ -83,6 +116,18 @@ struct _EmStreamClient
 
 	GstElement *appsink;
 
+	//! Kernel thread id the decoded frames last came out on, 0 before the first. Read with g_atomic_int_get.
+	gint decode_thread;
+
+	//! Of the last sample, the size and texture target are only read again when they change.
+	GstCaps *sample_caps;
+
+	//! Negotiated by the server, known once webrtcbin added its src pad.
+	const struct em_codec_descriptor *codec;
+
+	//! Decoder element factory from @ref em_stream_client_set_decoder, NULL to pick one.
+	gchar *decoder_override;
+
 	GLenum frame_texture_target;
 	GLenum texture_target;
 	GLuint texture_id;
@@ -96,6 +141,17 @@ struct _EmStreamClient
 		EGLContext android_main_context;
 		// 16x16 pbuffer surface
 		EGLSurface surface;
+
+		//! Shared with the main context, for GL the stream thread needs so it never takes @ref egl_mutex.
+		EGLContext stream_context;
+		EGLSurface stream_surface;
+
+		//! From EGL_KHR_fence_sync, NULL if missing.
+		PFNEGLCREATESYNCKHRPROC create_sync;
+		PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+		PFNEGLCLIENTWAITSYNCKHRPROC client_wait_sync;
+		//! From EGL_KHR_wait_sync, NULL if missing: then the render thread waits on the CPU.
+		PFNEGLWAITSYNCKHRPROC wait_sync;
 	} egl;
 
 	bool own_egl_mutex;
@@ -106,13 +162,50 @@ struct _EmStreamClient
 	bool pipeline_is_running;
 	bool received_first_frame;
 
+	//! Protects the sample queue, oldest first, and which slots are in use.
 	GMutex sample_mutex;
-	GstSample *sample;
-	struct timespec sample_decode_end_ts;
+	struct em_queued_sample sample_queue[EM_SAMPLE_QUEUE_LENGTH];
+	uint32_t sample_queue_count;
+	struct em_sc_sample sample_slots[EM_SAMPLE_SLOT_COUNT];
 
-	GMutex skipped_frames_mutex;
-	uint32_t skipped_frames;
 	em_proto_DownMessage last_down_msg;
+
+	//! Frame ids of the DownMessages seen at the depayloader, read from the render thread.
+	struct
+	{
+		GMutex mutex;
+		struct em_sequence_tracker tracker;
+	} frames;
+
+	//! Fed with the last packet of each frame at the depayloader, only touched from its streaming thread.
+	struct em_jitter_latency jitter_latency;
+
+	/*!
+	 * Decoding into a surface instead of GL memory, see @ref em_stream_client_set_surface.
+	 * The mutex protects the decoder and the DownMessages waiting for their frames.
+	 */
+	struct
+	{
+		ANativeWindow *window;
+
+		GMutex mutex;
+		struct em_surface_decoder *decoder;
+
+		//! Hand MediaCodec each slice as it arrives, see @ref em_stream_client_set_slice_input.
+		bool slice_input;
+		//! Part of an access unit was pushed, the rest comes with the same pts.
+		bool in_access_unit;
+
+		//! Also the number of access units pushed.
+		int64_t next_pts_us;
+		struct
+		{
+			int64_t pts_us;
+			bool valid;
+			em_proto_DownMessage msg;
+			int64_t depay_time_ns;
+		} down_msgs[EM_SURFACE_DOWN_MSG_COUNT];
+	} surface;
 };
 
 #if 0
@@ -146,7 +239,7 @@ typedef enum
 } EmStreamClientProperty;
 #endif
 
-#define RTP_TWOBYTES_HDR_EXT_ID 1 // Must be in the [1,15] range
+#define RTP_DOWN_MESSAGE_HDR_EXT_ID 1 // Must be in the [1,14] range
 
 // clang-format off
 #define SINK_CAPS \
@@ -182,6 +275,21 @@ em_stream_client_set_connection(EmStreamClient *sc, EmConnection *connection);
 static void
 em_stream_client_free_egl_mutex(EmStreamClient *sc);
 
+static void
+stream_context_destroy(EmStreamClient *sc);
+
+static bool
+read_down_message_from_custom_meta(GstBuffer *buffer, em_proto_DownMessage *msg);
+
+static int64_t
+read_depay_time_from_custom_meta(GstBuffer *buffer);
+
+static void
+fill_sample_from_down_message(EmStreamClient *sc, const em_proto_DownMessage *msg, struct em_sample *ems);
+
+static void
+sample_queue_clear(EmStreamClient *sc);
+
 /* GObject method implementations */
 
 #if 0
@@ -228,8 +336,10 @@ em_stream_client_init(EmStreamClient *sc)
 		ALOGE("Failed to register custom meta 'down-message'.");
 	}
 
-	g_mutex_init(&sc->skipped_frames_mutex);
-	sc->skipped_frames = 0;
+	g_mutex_init(&sc->surface.mutex);
+	g_mutex_init(&sc->frames.mutex);
+	em_sequence_tracker_reset(&sc->frames.tracker);
+	em_jitter_latency_reset(&sc->jitter_latency);
 
 	ALOGI("%s: done creating stuff", __FUNCTION__);
 }
@@ -242,7 +352,7 @@ em_stream_client_dispose(EmStreamClient *self)
 	em_stream_client_stop(self);
 	g_clear_object(&self->loop);
 	g_clear_object(&self->connection);
-	gst_clear_object(&self->sample);
+	sample_queue_clear(self);
 	gst_clear_object(&self->pipeline);
 	gst_clear_object(&self->gst_gl_display);
 	gst_clear_object(&self->gst_gl_context);
@@ -250,6 +360,7 @@ em_stream_client_dispose(EmStreamClient *self)
 	gst_clear_object(&self->display);
 	gst_clear_object(&self->context);
 	gst_clear_object(&self->appsink);
+	gst_clear_caps(&self->sample_caps);
 }
 
 static void
@@ -258,7 +369,16 @@ em_stream_client_finalize(EmStreamClient *self)
 	// only called once, after dispose
 	// EmStreamClient *self = EM_STREAM_CLIENT(object);
 	os_thread_helper_destroy(&self->play_thread);
+	stream_context_destroy(self);
 	em_stream_client_free_egl_mutex(self);
+
+	if (self->surface.window != NULL) {
+		ANativeWindow_release(self->surface.window);
+		self->surface.window = NULL;
+	}
+	g_mutex_clear(&self->surface.mutex);
+	g_mutex_clear(&self->frames.mutex);
+	g_clear_pointer(&self->decoder_override, g_free);
 }
 
 #if 0
@@ -290,35 +410,46 @@ em_stream_client_class_init(EmStreamClientClass *klass)
 
 #endif
 
-static inline XrQuaternionf
-quat_to_openxr(const em_proto_Quaternion *q)
-{
-	return (XrQuaternionf){q->x, q->y, q->z, q->w};
-}
-static inline XrVector3f
-vec3_to_openxr(const em_proto_Vec3 *v)
-{
-	return (XrVector3f){v->x, v->y, v->z};
-}
-
-static inline XrPosef
-pose_to_openxr(const em_proto_Pose *p)
-{
-	return (XrPosef){
-	    p->has_orientation ? quat_to_openxr(&p->orientation) : (XrQuaternionf){0, 0, 0, 1},
-	    p->has_position ? vec3_to_openxr(&p->position) : (XrVector3f){0, 0, 0},
-	};
-}
-
 /*
  * callbacks
  */
 
+//! On each streaming thread as it starts, those of webrtcbin receive, every other one depayloads and decodes.
+static void
+schedule_streaming_thread(GstMessage *msg)
+{
+	GstStreamStatusType type;
+	GstElement *owner;
+	gst_message_parse_stream_status(msg, &type, &owner);
+	if (type != GST_STREAM_STATUS_TYPE_ENTER) {
+		return;
+	}
+
+	enum em_thread_role role = EM_THREAD_ROLE_CODEC;
+	for (GstObject *o = GST_OBJECT(owner); o != NULL; o = GST_OBJECT_PARENT(o)) {
+		if (GST_IS_BIN(o) && g_str_equal(GST_OBJECT_NAME(o), "webrtc")) {
+			role = EM_THREAD_ROLE_NETWORK;
+			break;
+		}
+	}
+
+	int ret = em_thread_sched_apply(role);
+	if (ret != 0) {
+		ALOGW("%s: Could not schedule the thread of %s: %s", __FUNCTION__, GST_OBJECT_NAME(owner),
+		      strerror(ret));
+	}
+}
+
 static GstBusSyncReply
 bus_sync_handler_cb(GstBus *bus, GstMessage *msg, EmStreamClient *sc)
 {
 	// LOG_MSG(msg);
 
+	if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_STREAM_STATUS) {
+		schedule_streaming_thread(msg);
+		return GST_BUS_PASS;
+	}
+
 	/* Do not let GstGL retrieve the display handle on its own
 	 * because then it believes it owns it and calls eglTerminate()
 	 * when disposed */
@@ -392,71 +523,346 @@ gst_bus_cb(GstBus *bus, GstMessage *message, gpointer data)
 	return TRUE;
 }
 
+/*!
+ * Take a free slot, NULL if the renderer holds more samples than it should.
+ */
+static struct em_sc_sample *
+sample_slot_alloc_locked(EmStreamClient *sc)
+{
+	for (uint32_t i = 0; i < EM_SAMPLE_SLOT_COUNT; i++) {
+		if (!sc->sample_slots[i].in_use) {
+			sc->sample_slots[i].in_use = true;
+			return &sc->sample_slots[i];
+		}
+	}
+	return NULL;
+}
+
+/*!
+ * Hand @p slot back, returns its GstSample to unref once the lock is dropped.
+ */
+static GstSample *
+sample_slot_free_locked(struct em_sc_sample *slot)
+{
+	GstSample *sample = slot->sample;
+	slot->sample = NULL;
+	slot->in_use = false;
+	return sample;
+}
+
+/*!
+ * On the streaming thread, read the size and texture target of the samples when their caps change.
+ *
+ * @return false if we can't render samples with these caps
+ */
+static bool
+sample_format_update(EmStreamClient *sc, GstCaps *caps)
+{
+	if (caps == sc->sample_caps) {
+		return true;
+	}
+
+	GstStructure *s = gst_caps_get_structure(caps, 0);
+	const gchar *texture_target_str = gst_structure_get_string(s, "texture-target");
+	if (g_strcmp0(texture_target_str, GST_GL_TEXTURE_TARGET_EXTERNAL_OES_STR) == 0) {
+		sc->frame_texture_target = GL_TEXTURE_EXTERNAL_OES;
+	} else if (g_strcmp0(texture_target_str, GST_GL_TEXTURE_TARGET_2D_STR) == 0) {
+		sc->frame_texture_target = GL_TEXTURE_2D;
+		ALOGE("RYLIE: Got GL_TEXTURE_2D instead of expected GL_TEXTURE_EXTERNAL_OES");
+	} else {
+		ALOGE("%s: Can't render texture target %s", __FUNCTION__,
+		      texture_target_str != NULL ? texture_target_str : "(none)");
+		return false;
+	}
+
+	// The server picks the size, the renderer samples the texture whatever its size is.
+	gint width = 0;
+	gint height = 0;
+	gst_structure_get_int(s, "width", &width);
+	gst_structure_get_int(s, "height", &height);
+	if (width != sc->width || height != sc->height) {
+		ALOGI("%s: Stream size changed from %dx%d to %dx%d", __FUNCTION__, sc->width, sc->height, width, height);
+		sc->width = width;
+		sc->height = height;
+	}
+
+	if (sc->context == NULL) {
+		ALOGI("%s: Retrieving the GStreamer EGL context", __FUNCTION__);
+		/* Get GStreamer's gl context. */
+		gst_gl_query_local_gl_context(sc->appsink, GST_PAD_SINK, &sc->context);
+	}
+
+	gst_caps_replace(&sc->sample_caps, caps);
+	return true;
+}
+
 static GstFlowReturn
 on_new_sample_cb(GstAppSink *appsink, gpointer user_data)
 {
 	EmStreamClient *sc = (EmStreamClient *)user_data;
-	// TODO record the frame ID, get frame pose
 	struct timespec ts;
 	int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
 	if (ret != 0) {
 		ALOGE("%s: clock_gettime failed, which is very bizarre.", __FUNCTION__);
 		return GST_FLOW_ERROR;
 	}
-	GstSample *prevSample = NULL;
 	GstSample *sample = gst_app_sink_pull_sample(appsink);
 	g_assert_nonnull(sample);
-
-	// drop it like it's hot
-	bool drop_frame = false;
+	g_atomic_int_set(&sc->decode_thread, em_thread_sched_current_thread());
 
 	GstBuffer *buffer = gst_sample_get_buffer(sample);
-	GstCustomMeta *custom_meta = gst_buffer_get_custom_meta(buffer, "down-message");
-	if (!custom_meta) {
-		ALOGW("sample_cb: Dropping buffer without down-message.");
-		drop_frame = true;
+	GstMemory *mem = gst_buffer_peek_memory(buffer, 0);
+	if (!sample_format_update(sc, gst_sample_get_caps(sample)) || !gst_is_gl_memory(mem)) {
+		ALOGE("%s: Discarding a sample we can't render", __FUNCTION__);
+		gst_sample_unref(sample);
+		return GST_FLOW_OK;
 	}
 
+	// Everything the renderer needs, so pulling the sample is only taking it off the queue.
+	struct em_sc_sample filled = {.sample = sample, .in_use = true};
+	filled.base.frame_texture_id = gst_gl_memory_get_texture_id((GstGLMemory *)mem);
+	filled.base.frame_texture_target = sc->frame_texture_target;
+	filled.base.depay_time_ns = read_depay_time_from_custom_meta(buffer);
 
-	long last_frame_diff_sec = ts.tv_sec - sc->sample_decode_end_ts.tv_sec;
-	if (last_frame_diff_sec >= EM_NO_DOWN_MSG_FALLBACK_TIMEOUT_SECS) {
-		ALOGW("sample_cb: Not dropping frame, since we haven't had one since a second.");
-		drop_frame = false;
+	struct em_queued_sample queued = {.decode_end = ts};
+	em_proto_DownMessage msg = em_proto_DownMessage_init_default;
+	if (read_down_message_from_custom_meta(buffer, &msg)) {
+		em_trace_frame_end(EM_TRACE_DECODE, msg.frame_data.frame_sequence_id);
+		fill_sample_from_down_message(sc, &msg, &filled.base);
+		queued.display_time = msg.has_frame_data ? msg.frame_data.display_time : 0;
+	} else {
+		// Shown as soon as possible, with the last poses.
+		ALOGE("Reading DownMessage from GstCustomMeta failed. Reusing last one");
+		fill_sample_from_down_message(sc, &sc->last_down_msg, &filled.base);
 	}
 
-	bool skipped_frames_threshold_reached = false;
+	GstSample *dropped = NULL;
+	GstSample *rejected = NULL;
 	{
-		g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->skipped_frames_mutex);
-		if (sc->skipped_frames >= EM_NO_DOWN_MSG_FALLBACK_SKIPPED_FRAME_THRESHOLD) {
-			skipped_frames_threshold_reached = true;
+		g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->sample_mutex);
+		if (sc->sample_queue_count == EM_SAMPLE_QUEUE_LENGTH) {
+			// The renderer fell behind, the oldest one is the least useful.
+			dropped = sample_slot_free_locked(sc->sample_queue[0].slot);
+			memmove(&sc->sample_queue[0], &sc->sample_queue[1],
+			        sizeof(struct em_queued_sample) * (EM_SAMPLE_QUEUE_LENGTH - 1));
+			sc->sample_queue_count--;
+		}
+		queued.slot = sample_slot_alloc_locked(sc);
+		if (queued.slot != NULL) {
+			*queued.slot = filled;
+			sc->sample_queue[sc->sample_queue_count++] = queued;
+			sc->received_first_frame = true;
+		} else {
+			rejected = sample;
 		}
 	}
-
-	if (skipped_frames_threshold_reached) {
-		ALOGW("sample_cb: Not dropping frame, since we already skipped 10 frames.");
-		drop_frame = false;
+	if (dropped) {
+		ALOGD("Discarding unused sample, queue full");
+		gst_sample_unref(dropped);
 	}
+	if (rejected) {
+		ALOGW("%s: Discarding new sample, the renderer holds more than %d", __FUNCTION__, EM_SAMPLE_HELD_COUNT);
+		gst_sample_unref(rejected);
+	}
+	return GST_FLOW_OK;
+}
 
-	if (drop_frame) {
-		return GST_FLOW_OK;
+static void
+sample_queue_clear(EmStreamClient *sc)
+{
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->sample_mutex);
+	for (uint32_t i = 0; i < sc->sample_queue_count; i++) {
+		gst_sample_unref(sample_slot_free_locked(sc->sample_queue[i].slot));
 	}
+	sc->sample_queue_count = 0;
+}
 
+/*!
+ * Take the newest sample due by the middle of the frame displayed at @p display_time, dropping the older ones.
+ *
+ * Samples meant for a later frame stay queued, unless the queue is full: then the clocks disagree and waiting would
+ * never end.
+ */
+static bool
+sample_queue_pop_for_display_time(EmStreamClient *sc, XrTime display_time, struct em_queued_sample *out_queued)
+{
+	GstSample *dropped[EM_SAMPLE_QUEUE_LENGTH];
+	uint32_t dropped_count = 0;
 	{
 		g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->sample_mutex);
-		prevSample = sc->sample;
-		sc->sample = sample;
-		sc->sample_decode_end_ts = ts;
-		sc->received_first_frame = true;
+		uint32_t count = sc->sample_queue_count;
+		if (count == 0) {
+			return false;
+		}
+
+		int64_t interval_ns = EM_DEFAULT_FRAME_INTERVAL_NS;
+		if (count >= 2) {
+			int64_t diff_ns =
+			    sc->sample_queue[count - 1].display_time - sc->sample_queue[count - 2].display_time;
+			if (diff_ns > 0 && diff_ns < U_TIME_1S_IN_NS) {
+				interval_ns = diff_ns;
+			}
+		}
+
+		int32_t pick = -1;
+		for (uint32_t i = 0; i < count; i++) {
+			int64_t t = sc->sample_queue[i].display_time;
+			if (t == 0 || t <= display_time + interval_ns / 2) {
+				pick = (int32_t)i;
+			}
+		}
+		if (pick < 0) {
+			if (count < EM_SAMPLE_QUEUE_LENGTH) {
+				return false;
+			}
+			pick = 0;
+		}
+
+		for (int32_t i = 0; i < pick; i++) {
+			dropped[dropped_count++] = sample_slot_free_locked(sc->sample_queue[i].slot);
+		}
+		*out_queued = sc->sample_queue[pick];
+
+		uint32_t remaining = count - (uint32_t)pick - 1;
+		memmove(&sc->sample_queue[0], &sc->sample_queue[pick + 1], sizeof(struct em_queued_sample) * remaining);
+		sc->sample_queue_count = remaining;
+	}
+
+	for (uint32_t i = 0; i < dropped_count; i++) {
+		ALOGD("Discarding sample superseded by a newer one due for the same frame");
+		gst_sample_unref(dropped[i]);
+	}
+	return true;
+}
+
+static void
+surface_decoder_clear(EmStreamClient *sc)
+{
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->surface.mutex);
+	em_surface_decoder_destroy(&sc->surface.decoder);
+	sc->surface.in_access_unit = false;
+	for (uint32_t i = 0; i < EM_SURFACE_DOWN_MSG_COUNT; i++) {
+		sc->surface.down_msgs[i].valid = false;
+	}
+}
+
+/*!
+ * Surface mode: the access units go to MediaCodec ourselves, their DownMessage
+ * is kept by pts until the frame comes out.
+ *
+ * With slice input the buffers are single NAL units, the one carrying the RTP
+ * marker ends the access unit and has its DownMessage.
+ */
+static GstFlowReturn
+on_new_access_unit_cb(GstAppSink *appsink, gpointer user_data)
+{
+	EmStreamClient *sc = (EmStreamClient *)user_data;
+
+	g_autoptr(GstSample) sample = gst_app_sink_pull_sample(appsink);
+	if (sample == NULL) {
+		return GST_FLOW_OK;
+	}
+	// MediaCodec decodes out of process, feeding it is the decoder work of ours.
+	g_atomic_int_set(&sc->decode_thread, em_thread_sched_current_thread());
+
+	GstBuffer *buffer = gst_sample_get_buffer(sample);
+
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->surface.mutex);
+
+	bool slice_input = sc->surface.slice_input && sc->codec->slice_caps != NULL;
+	bool first = !sc->surface.in_access_unit;
+	bool last = !slice_input || GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_MARKER);
+	sc->surface.in_access_unit = !last;
+
+	if (sc->surface.decoder == NULL) {
+		// The decoder can only start from a keyframe, which carries SPS and PPS.
+		if (!first || GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+			return GST_FLOW_OK;
+		}
+
+		gint width = 0;
+		gint height = 0;
+		GstStructure *structure = gst_caps_get_structure(gst_sample_get_caps(sample), 0);
+		if (!gst_structure_get_int(structure, "width", &width) ||
+		    !gst_structure_get_int(structure, "height", &height)) {
+			ALOGW("%s: No size in the caps yet", __FUNCTION__);
+			return GST_FLOW_OK;
+		}
+
+		sc->surface.decoder = em_surface_decoder_create(sc->surface.window, sc->codec->mime, width, height);
+		if (sc->surface.decoder == NULL) {
+			return GST_FLOW_ERROR;
+		}
+		sc->width = width;
+		sc->height = height;
 	}
-	if (prevSample) {
-		ALOGD("Discarding unused, replaced sample");
-		gst_sample_unref(prevSample);
+
+	int64_t pts_us = first ? sc->surface.next_pts_us++ : sc->surface.next_pts_us - 1;
+	uint32_t slot = (uint32_t)(pts_us % EM_SURFACE_DOWN_MSG_COUNT);
+	if (first) {
+		if (sc->surface.down_msgs[slot].valid) {
+			// Never rendered, the decoder skipped it for a newer one.
+			em_trace_frame_end(EM_TRACE_DECODE,
+			                   sc->surface.down_msgs[slot].msg.frame_data.frame_sequence_id);
+		}
+		sc->surface.down_msgs[slot].pts_us = pts_us;
+		sc->surface.down_msgs[slot].valid = false;
+	}
+	if (last) {
+		sc->surface.down_msgs[slot].msg = (em_proto_DownMessage)em_proto_DownMessage_init_default;
+		sc->surface.down_msgs[slot].valid =
+		    read_down_message_from_custom_meta(buffer, &sc->surface.down_msgs[slot].msg);
+		sc->surface.down_msgs[slot].depay_time_ns = read_depay_time_from_custom_meta(buffer);
+	}
+
+	GstMapInfo info;
+	if (!gst_buffer_map(buffer, &info, GST_MAP_READ)) {
+		ALOGE("%s: Failed to map access unit", __FUNCTION__);
+		return GST_FLOW_OK;
 	}
+	em_surface_decoder_push(sc->surface.decoder, info.data, info.size, pts_us, !last);
+	gst_buffer_unmap(buffer, &info);
+
 	return GST_FLOW_OK;
 }
 
+/*!
+ * Put the DownMessage back together, the server splits it over several extension elements with the same id.
+ *
+ * @return NULL if the packet has none
+ */
+static GstBuffer *
+read_down_message(GstRTPBuffer *rtp_buffer)
+{
+	gsize total = 0;
+	guint count = 0;
+	gpointer data;
+	guint size;
+	while (
+	    gst_rtp_buffer_get_extension_onebyte_header(rtp_buffer, RTP_DOWN_MESSAGE_HDR_EXT_ID, count, &data, &size)) {
+		total += size;
+		count++;
+	}
+	if (count == 0) {
+		return NULL;
+	}
+
+	GstBuffer *struct_buf = gst_buffer_new_allocate(NULL, total, NULL);
+	if (struct_buf == NULL) {
+		return NULL;
+	}
+
+	gsize offset = 0;
+	for (guint i = 0; i < count; i++) {
+		gst_rtp_buffer_get_extension_onebyte_header(rtp_buffer, RTP_DOWN_MESSAGE_HDR_EXT_ID, i, &data, &size);
+		gst_buffer_fill(struct_buf, offset, data, size);
+		offset += size;
+	}
+	return struct_buf;
+}
+
 static GstPadProbeReturn
-rtp_h264_depay_sink_pad_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+rtp_depay_sink_pad_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 {
 	EmStreamClient *sc = (EmStreamClient *)user_data;
 	(void)user_data;
@@ -472,6 +878,14 @@ rtp_h264_depay_sink_pad_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_
 		return GST_PAD_PROBE_OK;
 	}
 
+	// The jitterbuffer passes packets in order straight through, so this is close to when the frame arrived.
+	if (gst_rtp_buffer_get_marker(&rtp_buffer) &&
+	    em_jitter_latency_add_frame(&sc->jitter_latency, os_monotonic_get_ns(),
+	                                gst_rtp_buffer_get_timestamp(&rtp_buffer)) &&
+	    sc->connection != NULL) {
+		em_connection_set_jitter_latency(sc->connection, sc->jitter_latency.latency_ms);
+	}
+
 	// Not all buffers has extension data attached, check.
 	if (!gst_rtp_buffer_get_extension(&rtp_buffer)) {
 		// TODO: This happens for most RTP buffers we receive as they are not ours.
@@ -480,20 +894,26 @@ rtp_h264_depay_sink_pad_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_
 		goto no_buf;
 	}
 
-	guint size = 0;
-	gpointer payload_ptr;
-	if (!gst_rtp_buffer_get_extension_twobytes_header(&rtp_buffer, NULL, RTP_TWOBYTES_HDR_EXT_ID,
-	                                                  0 /* NOTE: We do not support multi-extension-elements.*/,
-	                                                  &payload_ptr, &size)) {
-		ALOGE("Could not retrieve twobyte rtp extension on buffer!");
+	// Repack the protobuf into a GstBuffer, the other packets only carry the server's TWCC sequence numbers.
+	GstBuffer *struct_buf = read_down_message(&rtp_buffer);
+	if (!struct_buf) {
 		goto no_buf;
 	}
 
-	// Repack the protobuf into a GstBuffer
-	GstBuffer *struct_buf = gst_buffer_new_memdup(payload_ptr, size);
-	if (!struct_buf) {
-		ALOGE("Failed to allocate GstBuffer with payload.");
-		goto no_buf;
+	GstMapInfo map_info;
+	if (gst_buffer_map(struct_buf, &map_info, GST_MAP_READ)) {
+		pb_istream_t istream = pb_istream_from_buffer(map_info.data, map_info.size);
+		em_proto_DownMessage msg = em_proto_DownMessage_init_default;
+		if (pb_decode_ex(&istream, em_proto_DownMessage_fields, &msg, PB_DECODE_NULLTERMINATED)) {
+			g_mutex_lock(&sc->frames.mutex);
+			em_sequence_tracker_add(&sc->frames.tracker, msg.frame_data.frame_sequence_id);
+			g_mutex_unlock(&sc->frames.mutex);
+
+			if (em_trace_is_enabled()) {
+				em_trace_frame_begin(EM_TRACE_DECODE, msg.frame_data.frame_sequence_id);
+			}
+		}
+		gst_buffer_unmap(struct_buf, &map_info);
 	}
 
 	gst_rtp_buffer_unmap(&rtp_buffer);
@@ -506,7 +926,9 @@ rtp_h264_depay_sink_pad_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_
 		return GST_PAD_PROBE_OK;
 	}
 	GstStructure *custom_structure = gst_custom_meta_get_structure(custom_meta);
-	gst_structure_set(custom_structure, "protobuf", GST_TYPE_BUFFER, struct_buf, NULL);
+	// The DownMessage comes with the last packet of the frame, so this is when it was received in full.
+	gst_structure_set(custom_structure, "protobuf", GST_TYPE_BUFFER, struct_buf, "depay-time", G_TYPE_UINT64,
+	                  os_monotonic_get_ns(), NULL);
 
 	gst_buffer_unref(struct_buf);
 
@@ -517,6 +939,166 @@ no_buf:
 	return GST_PAD_PROBE_OK;
 }
 
+/*!
+ * Everything after webrtcbin depends on the codec, which we only know once the offer came in and webrtcbin added its
+ * src pad. Decoded into GL memory, or parsed access units for the surface decoder.
+ */
+static gchar *
+decode_bin_description(EmStreamClient *sc, const struct em_codec_descriptor *codec)
+{
+	if (sc->surface.window != NULL) {
+		// MediaCodec is fed by on_new_access_unit_cb, the appsink is linked after.
+		bool slice_input = sc->surface.slice_input && codec->slice_caps != NULL;
+		if (sc->surface.slice_input && !slice_input) {
+			ALOGW("%s: No slice input for %s, pushing access units", __FUNCTION__, codec->encoding_name);
+		}
+		return g_strdup_printf(
+		    "%s name=depay request-keyframe=true ! "
+		    "%s ! "
+		    "%s",
+		    codec->depayloader, codec->parser, slice_input ? codec->slice_caps : codec->parsed_caps);
+	}
+
+	g_autofree gchar *decoder = sc->decoder_override != NULL ? g_strdup(sc->decoder_override)
+	                                                         : em_codec_find_decoder(codec);
+	if (decoder == NULL) {
+		return NULL;
+	}
+
+	// No fixed framerate, the server picks it from our display rates.
+	return g_strdup_printf(
+	    "%s name=depay request-keyframe=true ! "
+	    "%s ! "
+	    "%s ! "
+	    "%s name=decoder ! "
+	    "video/x-raw(memory:GLMemory) ! "
+	    "glsinkbin name=glsink",
+	    codec->depayloader, codec->parser, codec->parsed_caps, decoder);
+}
+
+/*!
+ * Make the stream context current on this thread, or lock the main one if we could not make our own.
+ */
+static bool
+stream_context_begin(EmStreamClient *sc, EmEglState *out_old_state)
+{
+	if (sc->egl.stream_context == EGL_NO_CONTEXT) {
+		return em_stream_client_egl_begin_pbuffer(sc);
+	}
+
+	em_egl_state_save(out_old_state);
+	if (eglMakeCurrent(sc->egl.display, sc->egl.stream_surface, sc->egl.stream_surface, sc->egl.stream_context) ==
+	    EGL_FALSE) {
+		ALOGE("%s: Failed make the stream EGL context current", __FUNCTION__);
+		return false;
+	}
+	return true;
+}
+
+static void
+stream_context_end(EmStreamClient *sc, const EmEglState *old_state)
+{
+	if (sc->egl.stream_context == EGL_NO_CONTEXT) {
+		em_stream_client_egl_end(sc);
+		return;
+	}
+	em_egl_state_restore(old_state, sc->egl.display);
+}
+
+/*!
+ * Build the decode bin for the RTP coming out of @p pad and link it, from webrtcbin or the direct source.
+ */
+static void
+add_decode_bin_for_pad(EmStreamClient *sc, GstPad *pad)
+{
+	g_autoptr(GstCaps) caps = gst_pad_query_caps(pad, NULL);
+	const gchar *encoding_name = NULL;
+	if (!gst_caps_is_empty(caps)) {
+		encoding_name = gst_structure_get_string(gst_caps_get_structure(caps, 0), "encoding-name");
+	}
+
+	const struct em_codec_descriptor *codec = em_codec_from_encoding_name(encoding_name);
+	if (codec == NULL) {
+		ALOGE("%s: Can't decode %s", __FUNCTION__, encoding_name != NULL ? encoding_name : "(no encoding-name)");
+		return;
+	}
+	sc->codec = codec;
+
+	g_autofree gchar *description = decode_bin_description(sc, codec);
+	if (description == NULL) {
+		return;
+	}
+	ALOGI("%s: %s", __FUNCTION__, description);
+
+	// We'll need an active egl context below before setting up gstgl (as explained previously). Our own, the
+	// render thread holds the main one for whole frames.
+	bool gl = sc->surface.window == NULL;
+	EmEglState old_state;
+	if (gl && !stream_context_begin(sc, &old_state)) {
+		ALOGE("%s: Failed to make EGL context current, cannot create decoder!", __FUNCTION__);
+		return;
+	}
+
+	GError *error = NULL;
+	GstElement *bin = gst_parse_bin_from_description(description, TRUE, &error);
+
+	if (gl) {
+		// Un-current the EGL context
+		stream_context_end(sc, &old_state);
+	}
+
+	if (bin == NULL) {
+		ALOGE("%s: Failed creating decode bin: %s", __FUNCTION__, error->message);
+		g_clear_error(&error);
+		return;
+	}
+
+	gst_bin_add(GST_BIN(sc->pipeline), bin);
+
+	if (gl) {
+		g_autoptr(GstElement) glsinkbin = gst_bin_get_by_name(GST_BIN(bin), "glsink");
+		g_object_set(glsinkbin, "sink", sc->appsink, NULL);
+
+		// A few decoders have a switch for what MediaCodec calls KEY_LOW_LATENCY.
+		g_autoptr(GstElement) decoder = gst_bin_get_by_name(GST_BIN(bin), "decoder");
+		if (g_object_class_find_property(G_OBJECT_GET_CLASS(decoder), "low-latency") != NULL) {
+			g_object_set(decoder, "low-latency", TRUE, NULL);
+		}
+	} else {
+		gst_bin_add(GST_BIN(sc->pipeline), sc->appsink);
+		gst_element_link(bin, sc->appsink);
+		gst_element_sync_state_with_parent(sc->appsink);
+	}
+
+	g_autoptr(GstElement) depay = gst_bin_get_by_name(GST_BIN(bin), "depay");
+	g_autoptr(GstPad) depay_sink = gst_element_get_static_pad(depay, "sink");
+	if (depay_sink != NULL) {
+		gst_pad_add_probe(depay_sink, GST_PAD_PROBE_TYPE_BUFFER, rtp_depay_sink_pad_probe, sc, NULL);
+	} else {
+		ALOGE("Could not find static sink pad in depay.");
+	}
+
+	gst_element_sync_state_with_parent(bin);
+
+	g_autoptr(GstPad) bin_sink = gst_element_get_static_pad(bin, "sink");
+	GstPadLinkReturn link = gst_pad_link(pad, bin_sink);
+	if (link != GST_PAD_LINK_OK) {
+		ALOGE("%s: Failed to link the source to the decode bin (%d)", __FUNCTION__, link);
+	}
+
+	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(sc->pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "pipeline-decode-bin");
+}
+
+static void
+on_webrtc_pad_added_cb(GstElement *webrtcbin, GstPad *pad, EmStreamClient *sc)
+{
+	if (GST_PAD_DIRECTION(pad) != GST_PAD_SRC) {
+		return;
+	}
+
+	add_decode_bin_for_pad(sc, pad);
+}
+
 static void
 on_need_pipeline_cb(EmConnection *emconn, EmStreamClient *sc)
 {
@@ -524,88 +1106,91 @@ on_need_pipeline_cb(EmConnection *emconn, EmStreamClient *sc)
 	g_assert_nonnull(emconn);
 	GError *error = NULL;
 
+	// The size comes with the caps, see sample_format_update.
+	sc->width = 0;
+	sc->height = 0;
+	gst_clear_caps(&sc->sample_caps);
+	sc->codec = NULL;
+	sc->received_first_frame = false;
 
-	// decodebin3 seems to .. hang?
-	// omxh264dec doesn't seem to exist
-
-	uint32_t width = 1280;
-	uint32_t height = 1024;
+	sample_queue_clear(sc);
+	surface_decoder_clear(sc);
+
+	// A new session numbers its frames from scratch.
+	g_mutex_lock(&sc->frames.mutex);
+	em_sequence_tracker_reset(&sc->frames.tracker);
+	g_mutex_unlock(&sc->frames.mutex);
+	// The streaming thread of the old pipeline is gone, the new one has not started.
+	em_jitter_latency_reset(&sc->jitter_latency);
+
+	// Without WebRTC the codec is known up front, so the decode bin is added right away below.
+	g_autoptr(GstElement) direct_src = em_connection_create_direct_source(emconn);
+	if (direct_src != NULL) {
+		gst_object_ref_sink(direct_src);
+		sc->pipeline = gst_object_ref_sink(gst_pipeline_new(NULL));
+		gst_bin_add(GST_BIN(sc->pipeline), direct_src);
+	} else {
+		// The rest is added in on_webrtc_pad_added_cb once we know the codec. decodebin3 would do the same, but
+		// seems to hang, and picks decoders by rank rather than latency.
+		sc->pipeline = gst_object_ref_sink(
+		    gst_parse_launch("webrtcbin name=webrtc bundle-policy=max-bundle latency=0", &error));
+		if (sc->pipeline == NULL) {
+			ALOGE("FRED: Failed creating pipeline : Bad source: %s", error->message);
+			abort();
+		}
 
-	// We'll need an active egl context below before setting up gstgl (as explained previously)
-	if (!em_stream_client_egl_begin_pbuffer(sc)) {
-		ALOGE("%s: Failed to make EGL context current, cannot create pipeline!", __FUNCTION__);
-		return;
+		g_autoptr(GstElement) webrtcbin = gst_bin_get_by_name(GST_BIN(sc->pipeline), "webrtc");
+		g_signal_connect(webrtcbin, "pad-added", G_CALLBACK(on_webrtc_pad_added_cb), sc);
 	}
 
-	gchar *pipeline_string = g_strdup_printf(
-	    "webrtcbin name=webrtc bundle-policy=max-bundle latency=0 ! "
-	    "rtph264depay name=depay ! "
-	    "h264parse ! "
-	    "video/x-h264,stream-format=(string)byte-stream, alignment=(string)au,parsed=(boolean)true !"
-	    "amcviddec-omxqcomvideodecoderavc ! "
-	    "video/x-raw(memory:GLMemory), framerate=90/1 ! "
-	    "glsinkbin name=glsink");
-
-	sc->pipeline = gst_object_ref_sink(gst_parse_launch(pipeline_string, &error));
-	if (sc->pipeline == NULL) {
-		ALOGE("FRED: Failed creating pipeline : Bad source: %s", error->message);
-		abort();
-	}
-
-	// Un-current the EGL context
-	em_stream_client_egl_end(sc);
-
-	// We convert the string SINK_CAPS above into a GstCaps that elements below can understand.
-	// the "video/x-raw(" GST_CAPS_FEATURE_MEMORY_GL_MEMORY ")," part of the caps is read :
-	// video/x-raw(memory:GLMemory) and is really important for getting zero-copy gl textures.
-	// It tells the pipeline (especially the decoder) that an internal android:Surface should
-	// get created internally (using the provided gstgl contexts above) so that the appsink
-	// can basically pull the samples out using an GLConsumer (this is just for context, as
-	// all of those constructs will be hidden from you, but are turned on by that CAPS).
-	g_autoptr(GstCaps) caps = gst_caps_from_string(SINK_CAPS);
-
-	// FRED: We create the appsink 'manually' here because glsink's ALREADY a sink and so if we stick
-	//       glsinkbin ! appsink in our pipeline_string for automatic linking, gst_parse will NOT like this,
-	//       as glsinkbin (a sink) cannot link to anything upstream (appsink being 'another' sink). So we
-	//       manually link them below using glsinkbin's 'sink' pad -> appsink.
-	sc->appsink = gst_element_factory_make("appsink", NULL);
-	g_object_set(sc->appsink,
-	             // Set caps
-	             "caps", caps,
-	             // Fixed size buffer
-	             "max-buffers", 1,
-	             // drop old buffers when queue is filled
-	             "drop", true,
-	             // terminator
-	             NULL);
-	// Lower overhead than new-sample signal.
+	sc->appsink = gst_object_ref_sink(gst_element_factory_make("appsink", NULL));
 	GstAppSinkCallbacks callbacks = {0};
-	callbacks.new_sample = on_new_sample_cb;
+
+	if (sc->surface.window != NULL) {
+		g_object_set(sc->appsink, "sync", FALSE, "max-buffers", 4, "drop", FALSE, NULL);
+		callbacks.new_sample = on_new_access_unit_cb;
+	} else {
+		// We convert the string SINK_CAPS above into a GstCaps that elements below can understand.
+		// the "video/x-raw(" GST_CAPS_FEATURE_MEMORY_GL_MEMORY ")," part of the caps is read :
+		// video/x-raw(memory:GLMemory) and is really important for getting zero-copy gl textures.
+		// It tells the pipeline (especially the decoder) that an internal android:Surface should
+		// get created internally (using the provided gstgl contexts above) so that the appsink
+		// can basically pull the samples out using an GLConsumer (this is just for context, as
+		// all of those constructs will be hidden from you, but are turned on by that CAPS).
+		g_autoptr(GstCaps) caps = gst_caps_from_string(SINK_CAPS);
+
+		// FRED: The appsink becomes the sink of glsinkbin, because glsinkbin's ALREADY a sink and
+		//       glsinkbin ! appsink would not link.
+		g_object_set(sc->appsink,
+		             // Set caps
+		             "caps", caps,
+		             // Fixed size buffer
+		             "max-buffers", 1,
+		             // drop old buffers when queue is filled
+		             "drop", true,
+		             // terminator
+		             NULL);
+		// Lower overhead than new-sample signal.
+		callbacks.new_sample = on_new_sample_cb;
+	}
 	gst_app_sink_set_callbacks(GST_APP_SINK(sc->appsink), &callbacks, sc, NULL);
-	sc->received_first_frame = false;
 
-	g_autoptr(GstElement) glsinkbin = gst_bin_get_by_name(GST_BIN(sc->pipeline), "glsink");
-	g_object_set(glsinkbin, "sink", sc->appsink, NULL);
+	if (direct_src != NULL) {
+		g_autoptr(GstPad) src_pad = gst_element_get_static_pad(direct_src, "src");
+		add_decode_bin_for_pad(sc, src_pad);
+	}
 
 	g_autoptr(GstBus) bus = gst_element_get_bus(sc->pipeline);
-	// We set this up to inject the EGL context
+
+	// We set this up to inject the EGL context, and to schedule the streaming threads. Surface mode has no GL
+	// elements asking for a context.
 	gst_bus_set_sync_handler(bus, (GstBusSyncHandler)bus_sync_handler_cb, sc, NULL);
 
 	// This just watches for errors and such
 	gst_bus_add_watch(bus, gst_bus_cb, sc->pipeline);
-	g_object_unref(bus);
 
 	sc->pipeline_is_running = TRUE;
 
-	GstElement *depay = gst_bin_get_by_name(GST_BIN(sc->pipeline), "depay");
-	GstPad *pad = gst_element_get_static_pad(depay, "sink");
-	if (pad != NULL) {
-		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, rtp_h264_depay_sink_pad_probe, sc, NULL);
-		gst_object_unref(pad);
-	} else {
-		ALOGE("Could not find static sink pad in depay.");
-	}
-
 	// This actually hands over the pipeline. Once our own handler returns, the pipeline will be started by the
 	// connection.
 	g_signal_emit_by_name(emconn, "set-pipeline", GST_PIPELINE(sc->pipeline), NULL);
@@ -621,6 +1206,8 @@ on_drop_pipeline_cb(EmConnection *emconn, EmStreamClient *sc)
 	}
 	gst_clear_object(&sc->pipeline);
 	gst_clear_object(&sc->appsink);
+	sample_queue_clear(sc);
+	surface_decoder_clear(sc);
 }
 
 static void *
@@ -629,6 +1216,12 @@ em_stream_client_thread_func(void *ptr)
 
 	EmStreamClient *sc = (EmStreamClient *)ptr;
 
+	// Signaling runs here.
+	int ret = em_thread_sched_apply(EM_THREAD_ROLE_NETWORK);
+	if (ret != 0) {
+		ALOGW("%s: Could not schedule the main loop thread: %s", __FUNCTION__, strerror(ret));
+	}
+
 	ALOGI("%s: running GMainLoop", __FUNCTION__);
 	g_main_loop_run(sc->loop);
 	ALOGI("%s: g_main_loop_run returned", __FUNCTION__);
@@ -674,6 +1267,101 @@ em_stream_client_destroy(EmStreamClient **ptr_sc)
 	*ptr_sc = NULL;
 }
 
+static bool
+has_egl_extension(EGLDisplay display, const char *name)
+{
+	const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+	size_t len = strlen(name);
+	for (const char *p = extensions; p != NULL && (p = strstr(p, name)) != NULL; p += len) {
+		if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+load_fence_functions(EmStreamClient *sc)
+{
+	sc->egl.create_sync = NULL;
+	sc->egl.destroy_sync = NULL;
+	sc->egl.client_wait_sync = NULL;
+	sc->egl.wait_sync = NULL;
+
+	if (!has_egl_extension(sc->egl.display, "EGL_KHR_fence_sync")) {
+		ALOGW("%s: No EGL_KHR_fence_sync, frames are handed over without fences", __FUNCTION__);
+		return;
+	}
+	sc->egl.create_sync = (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
+	sc->egl.destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR");
+	sc->egl.client_wait_sync = (PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress("eglClientWaitSyncKHR");
+	if (sc->egl.create_sync == NULL || sc->egl.destroy_sync == NULL || sc->egl.client_wait_sync == NULL) {
+		ALOGW("%s: EGL_KHR_fence_sync without its functions, frames are handed over without fences",
+		      __FUNCTION__);
+		sc->egl.create_sync = NULL;
+		return;
+	}
+
+	if (has_egl_extension(sc->egl.display, "EGL_KHR_wait_sync")) {
+		sc->egl.wait_sync = (PFNEGLWAITSYNCKHRPROC)eglGetProcAddress("eglWaitSyncKHR");
+	}
+}
+
+/*!
+ * Create the stream context, shared with the main one, call with the main one current.
+ */
+static bool
+stream_context_create(EmStreamClient *sc)
+{
+	EGLint config_id = 0;
+	EGLint client_version = 3;
+	if (!eglQueryContext(sc->egl.display, sc->egl.android_main_context, EGL_CONFIG_ID, &config_id) ||
+	    !eglQueryContext(sc->egl.display, sc->egl.android_main_context, EGL_CONTEXT_CLIENT_VERSION,
+	                     &client_version)) {
+		ALOGE("%s: Failed to query the main EGL context", __FUNCTION__);
+		return false;
+	}
+
+	const EGLint config_attributes[] = {EGL_CONFIG_ID, config_id, EGL_NONE};
+	EGLConfig config;
+	EGLint num_configs = 0;
+	if (!eglChooseConfig(sc->egl.display, config_attributes, &config, 1, &num_configs) || num_configs == 0) {
+		ALOGE("%s: Failed to find the config of the main EGL context", __FUNCTION__);
+		return false;
+	}
+
+	const EGLint context_attributes[] = {EGL_CONTEXT_CLIENT_VERSION, client_version, EGL_NONE};
+	sc->egl.stream_context =
+	    eglCreateContext(sc->egl.display, config, sc->egl.android_main_context, context_attributes);
+	if (sc->egl.stream_context == EGL_NO_CONTEXT) {
+		ALOGE("%s: Failed to create the stream EGL context", __FUNCTION__);
+		return false;
+	}
+
+	// A surface can only be current in one context, so not the one we were given.
+	const EGLint surface_attributes[] = {EGL_WIDTH, 16, EGL_HEIGHT, 16, EGL_NONE};
+	sc->egl.stream_surface = eglCreatePbufferSurface(sc->egl.display, config, surface_attributes);
+	if (sc->egl.stream_surface == EGL_NO_SURFACE) {
+		ALOGE("%s: Failed to create the stream EGL surface", __FUNCTION__);
+		stream_context_destroy(sc);
+		return false;
+	}
+	return true;
+}
+
+static void
+stream_context_destroy(EmStreamClient *sc)
+{
+	if (sc->egl.stream_surface != EGL_NO_SURFACE) {
+		eglDestroySurface(sc->egl.display, sc->egl.stream_surface);
+		sc->egl.stream_surface = EGL_NO_SURFACE;
+	}
+	if (sc->egl.stream_context != EGL_NO_CONTEXT) {
+		eglDestroyContext(sc->egl.display, sc->egl.stream_context);
+		sc->egl.stream_context = EGL_NO_CONTEXT;
+	}
+}
+
 void
 em_stream_client_set_egl_context(EmStreamClient *sc,
                                  EmEglMutexIface *egl_mutex,
@@ -701,6 +1389,12 @@ em_stream_client_set_egl_context(EmStreamClient *sc,
 	sc->android_main_context = g_object_ref_sink(
 	    gst_gl_context_new_wrapped(sc->gst_gl_display, android_main_egl_context_handle, egl_platform, gl_api));
 
+	stream_context_destroy(sc);
+	if (!stream_context_create(sc)) {
+		ALOGW("%s: No EGL context of our own, the stream thread will lock the main one", __FUNCTION__);
+	}
+	load_fence_functions(sc);
+
 	ALOGV("RYLIE: eglMakeCurrent un-make-current");
 	em_egl_mutex_end(sc->egl_mutex);
 }
@@ -749,10 +1443,34 @@ em_stream_client_stop(EmStreamClient *sc)
 	gst_clear_object(&sc->pipeline);
 	gst_clear_object(&sc->appsink);
 	gst_clear_object(&sc->context);
+	surface_decoder_clear(sc);
 
 	sc->pipeline_is_running = false;
 }
 
+void
+em_stream_client_set_decoder(EmStreamClient *sc, const char *factory_name)
+{
+	g_assert(sc->pipeline == NULL);
+	g_free(sc->decoder_override);
+	sc->decoder_override = g_strdup(factory_name);
+}
+
+void
+em_stream_client_set_surface(EmStreamClient *sc, ANativeWindow *window)
+{
+	g_assert(sc->pipeline == NULL);
+	ANativeWindow_acquire(window);
+	sc->surface.window = window;
+}
+
+void
+em_stream_client_set_slice_input(EmStreamClient *sc, bool slice_input)
+{
+	g_assert(sc->pipeline == NULL);
+	sc->surface.slice_input = slice_input;
+}
+
 static bool
 read_down_message_from_custom_meta(GstBuffer *buffer, em_proto_DownMessage *msg)
 {
@@ -764,8 +1482,10 @@ read_down_message_from_custom_meta(GstBuffer *buffer, em_proto_DownMessage *msg)
 
 	GstStructure *custom_structure = gst_custom_meta_get_structure(custom_meta);
 
-	GstBuffer *struct_buf;
-	if (!gst_structure_get(custom_structure, "protobuf", GST_TYPE_BUFFER, &struct_buf, NULL)) {
+	// Borrowed, gst_structure_get would hand out a reference per frame.
+	const GValue *value = gst_structure_get_value(custom_structure, "protobuf");
+	GstBuffer *struct_buf = value != NULL && GST_VALUE_HOLDS_BUFFER(value) ? gst_value_get_buffer(value) : NULL;
+	if (struct_buf == NULL) {
 		ALOGE("Could not read protobuf from struct");
 		return false;
 	}
@@ -789,133 +1509,248 @@ read_down_message_from_custom_meta(GstBuffer *buffer, em_proto_DownMessage *msg)
 	return true;
 }
 
-struct em_sample *
-em_stream_client_try_pull_sample(EmStreamClient *sc, struct timespec *out_decode_end)
+static void
+fill_sample_from_down_message(EmStreamClient *sc, const em_proto_DownMessage *msg, struct em_sample *ems)
 {
-	if (!sc->appsink) {
-		// not setup yet.
-		return NULL;
-	}
+	if (msg->has_frame_data && msg->frame_data.has_P_localSpace_view0 && msg->frame_data.has_P_localSpace_view1) {
+		ALOGD("Got DownMessage: Frame #%ld V0 (%.2f %.2f %.2f) V1 (%.2f %.2f %.2f) display_time %ld",
+		      msg->frame_data.frame_sequence_id, msg->frame_data.P_localSpace_view0.position.x,
+		      msg->frame_data.P_localSpace_view0.position.y, msg->frame_data.P_localSpace_view0.position.z,
+		      msg->frame_data.P_localSpace_view1.position.x, msg->frame_data.P_localSpace_view1.position.y,
+		      msg->frame_data.P_localSpace_view1.position.z, msg->frame_data.display_time);
+
+		ems->have_poses = true;
+		ems->poses[0] = pose_to_openxr(&msg->frame_data.P_localSpace_view0);
+		ems->poses[1] = pose_to_openxr(&msg->frame_data.P_localSpace_view1);
+
+		ems->frame_sequence_id = msg->frame_data.frame_sequence_id;
+		ems->display_time = msg->frame_data.display_time;
+		ems->render_time = msg->frame_data.render_time;
+
+		if (msg->frame_data.has_foveation) {
+			const em_proto_Foveation *foveation = &msg->frame_data.foveation;
+			ems->have_foveation = true;
+			ems->foveation.source_min = (XrVector2f){foveation->source_min.x, foveation->source_min.y};
+			ems->foveation.source_max = (XrVector2f){foveation->source_max.x, foveation->source_max.y};
+			ems->foveation.encoded_min = (XrVector2f){foveation->encoded_min.x, foveation->encoded_min.y};
+			ems->foveation.encoded_max = (XrVector2f){foveation->encoded_max.x, foveation->encoded_max.y};
+		}
 
-	// We actually pull the sample in the new-sample signal handler, so here we're just receiving the sample already
-	// pulled.
-	GstSample *sample = NULL;
-	struct timespec decode_end;
-	{
-		g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->sample_mutex);
-		sample = sc->sample;
-		sc->sample = NULL;
-		decode_end = sc->sample_decode_end_ts;
-	}
+		if (msg->frame_data.has_depth) {
+			const em_proto_DepthInfo *depth = &msg->frame_data.depth;
+			ems->have_depth = true;
+			ems->depth.color_fraction = depth->color_fraction;
+			ems->depth.valid = depth->valid;
+			ems->depth.min_depth = depth->min_depth;
+			ems->depth.max_depth = depth->max_depth;
+			ems->depth.near_z = depth->near_z;
+			ems->depth.far_z = depth->far_z;
+		}
 
-	if (sample == NULL) {
-		if (gst_app_sink_is_eos(GST_APP_SINK(sc->appsink))) {
-			ALOGW("%s: EOS", __FUNCTION__);
-			// TODO trigger teardown?
+		if (msg->frame_data.has_active_size) {
+			ems->have_active_size = true;
+			ems->active_size = (XrVector2f){msg->frame_data.active_size.x, msg->frame_data.active_size.y};
 		}
-		{
-			g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->skipped_frames_mutex);
-			sc->skipped_frames += 1;
-			ALOGW("pull_sample: The latest sample is NULL. Skipped %d frames.", sc->skipped_frames);
+
+		const em_proto_MotionField *motion = &msg->frame_data.motion;
+		if (msg->frame_data.has_motion && motion->width > 0 && motion->height > 0 &&
+		    motion->vectors.size <= EM_MOTION_FIELD_MAX_SIZE &&
+		    motion->vectors.size == 2 * 2 * motion->width * motion->height) {
+			ems->have_motion = true;
+			ems->motion.width = motion->width;
+			ems->motion.height = motion->height;
+			ems->motion.scale = (XrVector2f){motion->scale.x, motion->scale.y};
+			memcpy(ems->motion.vectors, motion->vectors.bytes, motion->vectors.size);
 		}
+
+		sc->last_down_msg = *msg;
+	}
+}
+
+/*!
+ * Surface mode counterpart of the GL path, the frame is already in the surface
+ * once MediaCodec released it, so the sample only carries its DownMessage.
+ */
+static struct em_sample *
+try_pull_surface_sample(EmStreamClient *sc, struct timespec *out_decode_end)
+{
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->surface.mutex);
+	if (sc->surface.decoder == NULL) {
 		return NULL;
 	}
 
-	{
-		g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->skipped_frames_mutex);
-		sc->skipped_frames = 0;
+	int64_t pts_us = 0;
+	if (!em_surface_decoder_render_latest(sc->surface.decoder, &pts_us, out_decode_end)) {
+		return NULL;
 	}
 
-	*out_decode_end = decode_end;
+	struct em_sc_sample filled = {.in_use = true};
 
-	struct em_sc_sample *ret = calloc(1, sizeof(struct em_sc_sample));
+	uint32_t slot = (uint32_t)(pts_us % EM_SURFACE_DOWN_MSG_COUNT);
+	if (sc->surface.down_msgs[slot].valid && sc->surface.down_msgs[slot].pts_us == pts_us) {
+		em_trace_frame_end(EM_TRACE_DECODE, sc->surface.down_msgs[slot].msg.frame_data.frame_sequence_id);
+		fill_sample_from_down_message(sc, &sc->surface.down_msgs[slot].msg, &filled.base);
+		filled.base.depay_time_ns = sc->surface.down_msgs[slot].depay_time_ns;
+	} else {
+		ALOGE("No DownMessage for surface frame %ld. Reusing last one", pts_us);
+		fill_sample_from_down_message(sc, &sc->last_down_msg, &filled.base);
+	}
+	sc->surface.down_msgs[slot].valid = false;
 
-	GstBuffer *buffer = gst_sample_get_buffer(sample);
-	GstCaps *caps = gst_sample_get_caps(sample);
+	g_autoptr(GMutexLocker) sample_locker = g_mutex_locker_new(&sc->sample_mutex);
+	struct em_sc_sample *ret = sample_slot_alloc_locked(sc);
+	if (ret == NULL) {
+		ALOGW("%s: No free sample slot, the renderer holds more than %d", __FUNCTION__, EM_SAMPLE_HELD_COUNT);
+		return NULL;
+	}
+	*ret = filled;
+	return &(ret->base);
+}
 
-	// Get DownMsg from GstCustomMeta
-	em_proto_DownMessage msg = em_proto_DownMessage_init_default;
-	if (!read_down_message_from_custom_meta(buffer, &msg)) {
-		ALOGE("Reading DownMessage from GstCustomMeta failed. Reusing last one");
-		msg = sc->last_down_msg;
+static int64_t
+read_depay_time_from_custom_meta(GstBuffer *buffer)
+{
+	GstCustomMeta *custom_meta = gst_buffer_get_custom_meta(buffer, "down-message");
+	if (!custom_meta) {
+		return 0;
 	}
 
-	if (msg.has_frame_data && msg.frame_data.has_P_localSpace_view0 && msg.frame_data.has_P_localSpace_view1) {
-		ALOGD("Got DownMessage: Frame #%ld V0 (%.2f %.2f %.2f) V1 (%.2f %.2f %.2f) display_time %ld",
-		      msg.frame_data.frame_sequence_id, msg.frame_data.P_localSpace_view0.position.x,
-		      msg.frame_data.P_localSpace_view0.position.y, msg.frame_data.P_localSpace_view0.position.z,
-		      msg.frame_data.P_localSpace_view1.position.x, msg.frame_data.P_localSpace_view1.position.y,
-		      msg.frame_data.P_localSpace_view1.position.z, msg.frame_data.display_time);
+	guint64 depay_time_ns = 0;
+	GstStructure *custom_structure = gst_custom_meta_get_structure(custom_meta);
+	if (!gst_structure_get_uint64(custom_structure, "depay-time", &depay_time_ns)) {
+		return 0;
+	}
+	return (int64_t)depay_time_ns;
+}
 
-		ret->base.have_poses = true;
-		ret->base.poses[0] = pose_to_openxr(&msg.frame_data.P_localSpace_view0);
-		ret->base.poses[1] = pose_to_openxr(&msg.frame_data.P_localSpace_view1);
+struct em_frame_latch
+{
+	EmStreamClient *sc;
+	GstGLSyncMeta *sync_meta;
+	EGLSyncKHR fence;
+};
 
-		ret->base.frame_sequence_id = msg.frame_data.frame_sequence_id;
-		ret->base.display_time = msg.frame_data.display_time;
+/*!
+ * On GStreamer's GL thread: have the decoder put the frame in its texture, then fence what that queued so the
+ * render context waits for it on the GPU.
+ *
+ * Decoders like amcviddec render every frame into the same texture when its sync meta is waited on, so this has to
+ * happen for the sample picked, not when it arrives.
+ */
+static void
+latch_frame_on_gl_thread(GstGLContext *context, gpointer user_data)
+{
+	struct em_frame_latch *latch = (struct em_frame_latch *)user_data;
+	EmStreamClient *sc = latch->sc;
 
-		sc->last_down_msg = msg;
+	if (latch->sync_meta != NULL) {
+		/* MOSHI: the set_sync() seems to be needed for resizing */
+		gst_gl_sync_meta_set_sync_point(latch->sync_meta, context);
+		gst_gl_sync_meta_wait(latch->sync_meta, context);
 	}
 
-	GstVideoInfo info;
-	gst_video_info_from_caps(&info, caps);
-	gint width = GST_VIDEO_INFO_WIDTH(&info);
-	gint height = GST_VIDEO_INFO_HEIGHT(&info);
-	// ALOGD("%s: frame %d (w) x %d (h)", __FUNCTION__, width, height);
+	latch->fence = sc->egl.create_sync(sc->egl.display, EGL_SYNC_FENCE_KHR, NULL);
+	if (latch->fence == EGL_NO_SYNC_KHR) {
+		ALOGW("%s: Failed to create a fence for the frame", __FUNCTION__);
+		return;
+	}
+	// Another context waits for it, which only works once it is flushed.
+	context->gl_vtable->Flush();
+}
 
-	// TODO: Handle resize?
-#if 0
-	if (width != sc->width || height != sc->height) {
-		sc->width = width;
-		sc->height = height;
+/*!
+ * Make the render context, current on this thread, wait for @p fence and destroy it.
+ */
+static void
+wait_for_frame_fence(EmStreamClient *sc, EGLSyncKHR fence)
+{
+	if (fence == EGL_NO_SYNC_KHR) {
+		return;
 	}
-#endif
 
-	GstVideoFrame frame;
-	GstMapFlags flags = (GstMapFlags)(GST_MAP_READ | GST_MAP_GL);
-	gst_video_frame_map(&frame, &info, buffer, flags);
-	ret->base.frame_texture_id = *(GLuint *)frame.data[0];
+	if (sc->egl.wait_sync != NULL) {
+		sc->egl.wait_sync(sc->egl.display, fence, 0);
+	} else {
+		sc->egl.client_wait_sync(sc->egl.display, fence, 0, EGL_FOREVER_KHR);
+	}
 
-	if (sc->context == NULL) {
-		ALOGI("%s: Retrieving the GStreamer EGL context", __FUNCTION__);
-		/* Get GStreamer's gl context. */
-		gst_gl_query_local_gl_context(sc->appsink, GST_PAD_SINK, &sc->context);
+	// Pending waits keep it alive.
+	sc->egl.destroy_sync(sc->egl.display, fence);
+}
 
-		/* Check if we have 2D or OES textures */
-		GstStructure *s = gst_caps_get_structure(caps, 0);
-		const gchar *texture_target_str = gst_structure_get_string(s, "texture-target");
-		if (g_str_equal(texture_target_str, GST_GL_TEXTURE_TARGET_EXTERNAL_OES_STR)) {
-			sc->frame_texture_target = GL_TEXTURE_EXTERNAL_OES;
-		} else if (g_str_equal(texture_target_str, GST_GL_TEXTURE_TARGET_2D_STR)) {
-			sc->frame_texture_target = GL_TEXTURE_2D;
-			ALOGE("RYLIE: Got GL_TEXTURE_2D instead of expected GL_TEXTURE_EXTERNAL_OES");
-		} else {
-			g_assert_not_reached();
+struct em_sample *
+em_stream_client_try_pull_sample(EmStreamClient *sc, XrTime display_time, struct timespec *out_decode_end)
+{
+	if (!sc->appsink) {
+		// not setup yet.
+		return NULL;
+	}
+
+	if (sc->surface.window != NULL) {
+		return try_pull_surface_sample(sc, out_decode_end);
+	}
+
+	// We actually pull the sample in the new-sample signal handler, so here we're just picking from the samples
+	// already pulled.
+	struct em_queued_sample queued;
+	if (!sample_queue_pop_for_display_time(sc, display_time, &queued)) {
+		if (gst_app_sink_is_eos(GST_APP_SINK(sc->appsink))) {
+			ALOGW("%s: EOS", __FUNCTION__);
+			// TODO trigger teardown?
 		}
+		return NULL;
 	}
-	ret->base.frame_texture_target = sc->frame_texture_target;
 
+	struct em_sc_sample *ret = queued.slot;
+	*out_decode_end = queued.decode_end;
+
+	GstBuffer *buffer = gst_sample_get_buffer(ret->sample);
 	GstGLSyncMeta *sync_meta = gst_buffer_get_gl_sync_meta(buffer);
-	if (sync_meta) {
+	if (sc->egl.create_sync != NULL) {
+		struct em_frame_latch latch = {.sc = sc, .sync_meta = sync_meta, .fence = EGL_NO_SYNC_KHR};
+		gst_gl_context_thread_add(sc->context, latch_frame_on_gl_thread, &latch);
+		wait_for_frame_fence(sc, latch.fence);
+	} else if (sync_meta) {
 		/* MOSHI: the set_sync() seems to be needed for resizing */
 		gst_gl_sync_meta_set_sync_point(sync_meta, sc->context);
 		gst_gl_sync_meta_wait(sync_meta, sc->context);
 	}
 
-	gst_video_frame_unmap(&frame);
-	// move sample ownership into the return value
-	ret->sample = sample;
 	return &(ret->base);
 }
 
+bool
+em_stream_client_get_frame_stats(EmStreamClient *sc, struct em_sequence_stats *out_stats)
+{
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->frames.mutex);
+	if (!sc->frames.tracker.started) {
+		return false;
+	}
+	em_sequence_tracker_get_stats(&sc->frames.tracker, out_stats);
+	return true;
+}
+
+int32_t
+em_stream_client_get_decode_thread(EmStreamClient *sc)
+{
+	return (int32_t)g_atomic_int_get(&sc->decode_thread);
+}
+
 void
 em_stream_client_release_sample(EmStreamClient *sc, struct em_sample *ems)
 {
 
 	struct em_sc_sample *impl = (struct em_sc_sample *)ems;
 	// ALOGD("Releasing sample with texture ID %d", ems->frame_texture_id);
-	gst_sample_unref(impl->sample);
-	free(impl);
+	GstSample *sample = NULL;
+	{
+		g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->sample_mutex);
+		sample = sample_slot_free_locked(impl);
+	}
+	// Surface samples have no GstSample, their frame lives in the surface.
+	if (sample != NULL) {
+		gst_sample_unref(sample);
+	}
 }
 
 
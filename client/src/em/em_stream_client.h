@@ -13,7 +13,9 @@
 #include "em_connection.h"
 
 #include <EGL/egl.h>
+#include <android/native_window.h>
 #include <glib-object.h>
+#include <openxr/openxr.h>
 
 #include <stdbool.h>
 
@@ -23,6 +25,7 @@ extern "C" {
 
 
 struct em_sample;
+struct em_sequence_stats;
 
 typedef struct EmEglMutexIface EmEglMutexIface;
 
@@ -59,7 +62,9 @@ em_stream_client_destroy(EmStreamClient **ptr_sc);
  * @param egl_mutex An implementation of the EGL mutex interface, which carries an EGLDisplay and EGLContext
  * @param adopt_mutex_interface True if the stream client takes ownership of the EGL mutex interface.
  * @param pbuffer_surface An EGL pbuffer surface created for the @p context
- * TODO not sure what the surface is actually used for...
+ *
+ * The stream thread gets an EGL context of its own shared with this one, so only the render thread locks the mutex.
+ * Each frame pulled comes with an EGL fence the render context waits for, see @ref em_stream_client_try_pull_sample.
  */
 void
 em_stream_client_set_egl_context(EmStreamClient *sc,
@@ -96,6 +101,40 @@ em_stream_client_egl_begin_pbuffer(EmStreamClient *sc);
 void
 em_stream_client_egl_end(EmStreamClient *sc);
 
+/*!
+ * Use the decoder element @p factory_name instead of picking one, see @ref em_codec_find_decoder.
+ *
+ * Must be called before @ref em_stream_client_spawn_thread.
+ *
+ * @param sc self
+ * @param factory_name For example amcviddec-c2qtiavcdecoder, has to handle the codec the server sends.
+ */
+void
+em_stream_client_set_decoder(EmStreamClient *sc, const char *factory_name);
+
+/*!
+ * Decode with MediaCodec straight into @p window instead of into GL textures.
+ *
+ * The samples then only carry the frame metadata, the frame itself is already in the surface, for example the one of
+ * an XR_KHR_android_surface_swapchain. Must be called before @ref em_stream_client_spawn_thread.
+ *
+ * @param sc self
+ * @param window The surface to render into, we take a reference on it.
+ */
+void
+em_stream_client_set_surface(EmStreamClient *sc, ANativeWindow *window);
+
+/*!
+ * Push every slice to MediaCodec as soon as it arrived, as a partial frame, instead of waiting for the whole access
+ * unit. Only used when decoding into a surface, and needs a decoder that takes partial frames, like the Qualcomm
+ * ones. Must be called before @ref em_stream_client_spawn_thread.
+ *
+ * @param sc self
+ * @param slice_input Whether to push slices.
+ */
+void
+em_stream_client_set_slice_input(EmStreamClient *sc, bool slice_input);
+
 /*!
  * Start the GMainLoop embedded in this object in a new thread
  *
@@ -111,15 +150,23 @@ void
 em_stream_client_stop(EmStreamClient *sc);
 
 /*!
- * Attempt to retrieve a sample, if one has been decoded.
+ * Attempt to retrieve the sample to display at @p display_time, if one has been decoded.
  *
- * Non-null return values need to be released with @ref em_stream_client_release_sample.
-
-* @param sc self
-* @param[out] out_decode_end struct to populate with decode-end time.
+ * Picks the newest of the queued samples the server meant for this frame or an earlier one. Older ones are dropped,
+ * ones meant for a later frame are kept for it. In surface mode the newest frame is always taken.
+ *
+ * Non-null return values need to be released with @ref em_stream_client_release_sample. They come from a fixed set
+ * filled in as the samples are decoded, with room for two held at once: the one rendered and the one before it.
+ *
+ * Call with the main EGL context current, see @ref em_stream_client_egl_begin. Where EGL_KHR_wait_sync is supported
+ * that context waits for the decoder's GL work on the GPU, otherwise this call waits for it.
+ *
+ * @param sc self
+ * @param display_time The predicted display time of the frame about to be rendered.
+ * @param[out] out_decode_end struct to populate with decode-end time.
  */
 struct em_sample *
-em_stream_client_try_pull_sample(EmStreamClient *sc, struct timespec *out_decode_end);
+em_stream_client_try_pull_sample(EmStreamClient *sc, XrTime display_time, struct timespec *out_decode_end);
 
 /*!
  * Release a sample returned from @ref em_stream_client_try_pull_sample
@@ -127,6 +174,23 @@ em_stream_client_try_pull_sample(EmStreamClient *sc, struct timespec *out_decode
 void
 em_stream_client_release_sample(EmStreamClient *sc, struct em_sample *ems);
 
+/*!
+ * The loss and reordering of the frames received so far, by the ids the server gave them.
+ *
+ * @return false before the first frame of the stream
+ */
+bool
+em_stream_client_get_frame_stats(EmStreamClient *sc, struct em_sequence_stats *out_stats);
+
+/*!
+ * Kernel thread id of the streaming thread the last frame was decoded on, or handed to MediaCodec on in surface
+ * mode. It is a new thread after a reconnect rebuilt the decode bin.
+ *
+ * @return 0 before the first frame
+ */
+int32_t
+em_stream_client_get_decode_thread(EmStreamClient *sc);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif // __cplusplus
@@ -0,0 +1,188 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  H.264 decoding straight into an Android Surface with MediaCodec
+ * @ingroup em_client
+ */
+
+#include "em_surface_decoder.h"
+#include "em_app_log.h"
+
+#include <media/NdkMediaCodec.h>
+#include <media/NdkMediaFormat.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+//! Don't block the streaming thread for long if the decoder is backed up.
+#define EM_SURFACE_DECODER_INPUT_TIMEOUT_US 2000
+
+//! MediaFormat.KEY_LOW_LATENCY, only in the NDK headers from API level 30 on.
+#define EM_MEDIAFORMAT_KEY_LOW_LATENCY "low-latency"
+
+//! MediaCodec.BUFFER_FLAG_PARTIAL_FRAME, only in the NDK headers from API level 26 on.
+#define EM_MEDIACODEC_BUFFER_FLAG_PARTIAL_FRAME 8
+
+/*!
+ * Vendor keys with the same intent for decoders predating KEY_LOW_LATENCY, unknown keys are ignored. Outputting in
+ * decode order is fine, we never send B frames.
+ */
+static const char *vendor_low_latency_keys[] = {
+    "vendor.qti-ext-dec-low-latency.enable",
+    "vendor.qti-ext-dec-picture-order.enable",
+    "vendor.rtc-ext-dec-low-latency.enable",
+};
+
+struct em_surface_decoder
+{
+	AMediaCodec *codec;
+	ANativeWindow *window;
+};
+
+void
+em_surface_decoder_destroy(struct em_surface_decoder **ptr_dec)
+{
+	if (ptr_dec == NULL) {
+		return;
+	}
+	struct em_surface_decoder *dec = *ptr_dec;
+	if (dec == NULL) {
+		return;
+	}
+
+	if (dec->codec != NULL) {
+		AMediaCodec_stop(dec->codec);
+		AMediaCodec_delete(dec->codec);
+	}
+	if (dec->window != NULL) {
+		ANativeWindow_release(dec->window);
+	}
+
+	free(dec);
+	*ptr_dec = NULL;
+}
+
+struct em_surface_decoder *
+em_surface_decoder_create(ANativeWindow *window, const char *mime, int32_t width, int32_t height)
+{
+	struct em_surface_decoder *dec = calloc(1, sizeof(struct em_surface_decoder));
+
+	ANativeWindow_acquire(window);
+	dec->window = window;
+
+	dec->codec = AMediaCodec_createDecoderByType(mime);
+	if (dec->codec == NULL) {
+		ALOGE("%s: No %s decoder", __FUNCTION__, mime);
+		em_surface_decoder_destroy(&dec);
+		return NULL;
+	}
+
+	// Parameter sets come in band with the keyframes.
+	AMediaFormat *format = AMediaFormat_new();
+	AMediaFormat_setString(format, AMEDIAFORMAT_KEY_MIME, mime);
+	AMediaFormat_setInt32(format, AMEDIAFORMAT_KEY_WIDTH, width);
+	AMediaFormat_setInt32(format, AMEDIAFORMAT_KEY_HEIGHT, height);
+
+	// Every frame the decoder holds on to is another display refresh of latency.
+	AMediaFormat_setInt32(format, EM_MEDIAFORMAT_KEY_LOW_LATENCY, 1);
+	for (size_t i = 0; i < sizeof(vendor_low_latency_keys) / sizeof(vendor_low_latency_keys[0]); i++) {
+		AMediaFormat_setInt32(format, vendor_low_latency_keys[i], 1);
+	}
+	// Realtime priority
+	AMediaFormat_setInt32(format, "priority", 0);
+
+	media_status_t status = AMediaCodec_configure(dec->codec, format, window, NULL, 0);
+	AMediaFormat_delete(format);
+	if (status != AMEDIA_OK) {
+		ALOGE("%s: AMediaCodec_configure failed (%d)", __FUNCTION__, status);
+		em_surface_decoder_destroy(&dec);
+		return NULL;
+	}
+
+	status = AMediaCodec_start(dec->codec);
+	if (status != AMEDIA_OK) {
+		ALOGE("%s: AMediaCodec_start failed (%d)", __FUNCTION__, status);
+		em_surface_decoder_destroy(&dec);
+		return NULL;
+	}
+
+	ALOGI("%s: Decoding %s %dx%d into a surface", __FUNCTION__, mime, width, height);
+	return dec;
+}
+
+bool
+em_surface_decoder_push(struct em_surface_decoder *dec,
+                        const uint8_t *data,
+                        size_t size,
+                        int64_t pts_us,
+                        bool partial_frame)
+{
+	ssize_t index = AMediaCodec_dequeueInputBuffer(dec->codec, EM_SURFACE_DECODER_INPUT_TIMEOUT_US);
+	if (index < 0) {
+		ALOGW("%s: No input buffer free, dropping access unit", __FUNCTION__);
+		return false;
+	}
+
+	size_t capacity = 0;
+	uint8_t *buffer = AMediaCodec_getInputBuffer(dec->codec, (size_t)index, &capacity);
+	if (buffer == NULL || capacity < size) {
+		ALOGE("%s: Access unit of %zu bytes does not fit in %zu", __FUNCTION__, size, capacity);
+		AMediaCodec_queueInputBuffer(dec->codec, (size_t)index, 0, 0, pts_us, 0);
+		return false;
+	}
+
+	memcpy(buffer, data, size);
+
+	uint32_t flags = partial_frame ? EM_MEDIACODEC_BUFFER_FLAG_PARTIAL_FRAME : 0;
+	media_status_t status =
+	    AMediaCodec_queueInputBuffer(dec->codec, (size_t)index, 0, size, (uint64_t)pts_us, flags);
+	if (status != AMEDIA_OK) {
+		ALOGE("%s: AMediaCodec_queueInputBuffer failed (%d)", __FUNCTION__, status);
+		return false;
+	}
+
+	return true;
+}
+
+bool
+em_surface_decoder_render_latest(struct em_surface_decoder *dec, int64_t *out_pts_us, struct timespec *out_decode_end)
+{
+	ssize_t latest = -1;
+	int64_t latest_pts_us = 0;
+
+	while (true) {
+		AMediaCodecBufferInfo info;
+		ssize_t index = AMediaCodec_dequeueOutputBuffer(dec->codec, &info, 0);
+		if (index == AMEDIACODEC_INFO_OUTPUT_FORMAT_CHANGED || index == AMEDIACODEC_INFO_OUTPUT_BUFFERS_CHANGED) {
+			continue;
+		}
+		if (index < 0) {
+			break;
+		}
+
+		// Only the newest frame gets shown, an older one would just add latency.
+		if (latest >= 0) {
+			AMediaCodec_releaseOutputBuffer(dec->codec, (size_t)latest, false);
+		}
+		latest = index;
+		latest_pts_us = info.presentationTimeUs;
+	}
+
+	if (latest < 0) {
+		return false;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, out_decode_end);
+
+	media_status_t status = AMediaCodec_releaseOutputBuffer(dec->codec, (size_t)latest, true);
+	if (status != AMEDIA_OK) {
+		ALOGE("%s: AMediaCodec_releaseOutputBuffer failed (%d)", __FUNCTION__, status);
+		return false;
+	}
+
+	*out_pts_us = latest_pts_us;
+	return true;
+}
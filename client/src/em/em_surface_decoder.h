@@ -0,0 +1,75 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  H.264 decoding straight into an Android Surface with MediaCodec
+ * @ingroup em_client
+ */
+#pragma once
+
+#include <android/native_window.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+
+/*!
+ * A MediaCodec decoder whose output buffers are rendered into a Surface, like
+ * one of an XR_KHR_android_surface_swapchain, rather than into GL memory.
+ *
+ * Access units are pushed from one thread and frames released from another.
+ */
+struct em_surface_decoder;
+
+/*!
+ * Create and start a low latency decoder for @p mime rendering into @p window, which we take a reference on.
+ *
+ * @return NULL on failure
+ */
+struct em_surface_decoder *
+em_surface_decoder_create(ANativeWindow *window, const char *mime, int32_t width, int32_t height);
+
+/*!
+ * Stop the decoder and free it, handles null checking for you.
+ */
+void
+em_surface_decoder_destroy(struct em_surface_decoder **ptr_dec);
+
+/*!
+ * Queue one access unit, @p pts_us comes back out with its frame.
+ *
+ * With @p partial_frame set it is only part of one, the rest follows with the same @p pts_us and the last part
+ * without the flag. Decoders with partial frame support start on the first slices before the rest arrived.
+ *
+ * @return false if the decoder had no input buffer free or failed
+ */
+bool
+em_surface_decoder_push(struct em_surface_decoder *dec,
+                        const uint8_t *data,
+                        size_t size,
+                        int64_t pts_us,
+                        bool partial_frame);
+
+/*!
+ * Render the newest decoded frame to the surface, older ones are dropped.
+ *
+ * @param[out] out_pts_us the pts the frame was pushed with
+ * @param[out] out_decode_end CLOCK_MONOTONIC time the frame was dequeued
+ *
+ * @return false if no new frame was decoded since the last call
+ */
+bool
+em_surface_decoder_render_latest(struct em_surface_decoder *dec, int64_t *out_pts_us, struct timespec *out_decode_end);
+
+
+#ifdef __cplusplus
+} // extern "C"
+#endif // __cplusplus
@@ -0,0 +1,88 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Android trace events, for following frames through the client in Perfetto.
+ * @ingroup em_client
+ */
+
+#include "em_trace.h"
+
+#include <android/trace.h>
+
+#include <dlfcn.h>
+#include <pthread.h>
+
+
+/*!
+ * The async and counter functions came with API level 29, after our minimum, so they are looked up at runtime.
+ */
+static struct
+{
+	pthread_once_t once;
+	void (*begin_async_section)(const char *name, int32_t cookie);
+	void (*end_async_section)(const char *name, int32_t cookie);
+	void (*set_counter)(const char *name, int64_t value);
+} trace = {.once = PTHREAD_ONCE_INIT};
+
+static void
+load_functions(void)
+{
+	trace.begin_async_section = dlsym(RTLD_DEFAULT, "ATrace_beginAsyncSection");
+	trace.end_async_section = dlsym(RTLD_DEFAULT, "ATrace_endAsyncSection");
+	trace.set_counter = dlsym(RTLD_DEFAULT, "ATrace_setCounter");
+}
+
+
+/*
+ *
+ * Exported functions.
+ *
+ */
+
+bool
+em_trace_is_enabled(void)
+{
+	return ATrace_isEnabled();
+}
+
+void
+em_trace_begin(const char *name)
+{
+	ATrace_beginSection(name);
+}
+
+void
+em_trace_end(void)
+{
+	ATrace_endSection();
+}
+
+void
+em_trace_frame_begin(const char *name, int64_t frame_sequence_id)
+{
+	pthread_once(&trace.once, load_functions);
+	if (trace.begin_async_section != NULL) {
+		trace.begin_async_section(name, (int32_t)frame_sequence_id);
+	}
+}
+
+void
+em_trace_frame_end(const char *name, int64_t frame_sequence_id)
+{
+	pthread_once(&trace.once, load_functions);
+	if (trace.end_async_section != NULL) {
+		trace.end_async_section(name, (int32_t)frame_sequence_id);
+	}
+}
+
+void
+em_trace_counter(const char *name, int64_t value)
+{
+	pthread_once(&trace.once, load_functions);
+	if (trace.set_counter != NULL) {
+		trace.set_counter(name, value);
+	}
+}
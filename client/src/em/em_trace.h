@@ -0,0 +1,62 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Android trace events, for following frames through the client in Perfetto.
+ * @ingroup em_client
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+
+//! From depayloading a frame until it comes out of the decoder, one slice per frame_sequence_id.
+#define EM_TRACE_DECODE "em decode"
+
+//! The frame_sequence_id being pulled and drawn.
+#define EM_TRACE_FRAME_COUNTER "em frame"
+
+/*!
+ * Whether a capture is recording app events. Checked before doing any work only tracing needs.
+ */
+bool
+em_trace_is_enabled(void);
+
+/*!
+ * Begin a slice on the calling thread, ended by em_trace_end() on the same thread.
+ */
+void
+em_trace_begin(const char *name);
+
+void
+em_trace_end(void);
+
+/*!
+ * Begin a slice of the frame @p frame_sequence_id, which may end on another thread.
+ *
+ * Slices with the same @p name and frame go together, so a capture shows where each frame spent its time.
+ * A no-op before API level 29.
+ */
+void
+em_trace_frame_begin(const char *name, int64_t frame_sequence_id);
+
+void
+em_trace_frame_end(const char *name, int64_t frame_sequence_id);
+
+/*!
+ * Set the counter track @p name, a no-op before API level 29.
+ */
+void
+em_trace_counter(const char *name, int64_t value);
+
+
+#ifdef __cplusplus
+} // extern "C"
+#endif // __cplusplus
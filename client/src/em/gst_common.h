@@ -32,6 +32,52 @@
 #include <string.h>
 #include <stdbool.h>
 
+/*!
+ * Foveation warp of a frame, per view in normalized coordinates: the source
+ * area between source_min and source_max is stored between encoded_min and
+ * encoded_max.
+ */
+struct em_foveation
+{
+	XrVector2f source_min;
+	XrVector2f source_max;
+	XrVector2f encoded_min;
+	XrVector2f encoded_max;
+};
+
+/*!
+ * Depth band of a frame, the rows below @p color_fraction of the height hold
+ * the depth of both views side by side, not foveated. If not @p valid the
+ * layer had no depth and only the color part is of use.
+ */
+struct em_depth
+{
+	float color_fraction;
+	bool valid;
+	float min_depth;
+	float max_depth;
+	float near_z;
+	float far_z;
+};
+
+//! Must hold the MotionField vectors the server sends, see electricmaple.options.
+#define EM_MOTION_FIELD_MAX_SIZE (512)
+
+/*!
+ * Where the content of each block of the views moves in one frame, per view in
+ * the coordinates of the frame through the foveation warp and before the
+ * active size. Each block has a signed x and y byte, the @p height rows of the
+ * left view then those of the right.
+ */
+struct em_motion_field
+{
+	uint32_t width;
+	uint32_t height;
+	//! Fraction of a view per vector unit.
+	XrVector2f scale;
+	int8_t vectors[EM_MOTION_FIELD_MAX_SIZE];
+};
+
 struct em_sample
 {
 	GLuint frame_texture_id;
@@ -42,4 +88,23 @@ struct em_sample
 
 	int64_t frame_sequence_id;
 	int64_t display_time;
+	//! When the server pushed the frame to its encoder, in client time, 0 if unknown.
+	int64_t render_time;
+
+	//! CLOCK_MONOTONIC when the last packet of the frame was depayloaded, 0 if unknown.
+	int64_t depay_time_ns;
+
+	bool have_foveation;
+	struct em_foveation foveation;
+
+	bool have_depth;
+	struct em_depth depth;
+
+	//! Per view fraction of its color area the server shrunk it into, from the top left.
+	bool have_active_size;
+	XrVector2f active_size;
+
+	//! For extrapolating the frame while the next one is late.
+	bool have_motion;
+	struct em_motion_field motion;
 };
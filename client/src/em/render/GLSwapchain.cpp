@@ -11,22 +11,44 @@
 
 #include "GLSwapchain.h"
 #include "../em_app_log.h"
+#include <EGL/egl.h>
 #include <GLES3/gl3.h>
+#include <GLES2/gl2ext.h>
 #include <openxr/openxr.h>
 
 #include <cassert>
 
 
+bool
+attachSwapchainTexture(GLenum attachment, GLuint texture, uint32_t viewCount)
+{
+	if (viewCount <= 1) {
+		glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, attachment, GL_TEXTURE_2D, texture, 0);
+		return true;
+	}
+
+	static PFNGLFRAMEBUFFERTEXTUREMULTIVIEWOVRPROC framebufferTextureMultiview =
+	    reinterpret_cast<PFNGLFRAMEBUFFERTEXTUREMULTIVIEWOVRPROC>(
+	        eglGetProcAddress("glFramebufferTextureMultiviewOVR"));
+	if (framebufferTextureMultiview == nullptr) {
+		ALOGE("%s: glFramebufferTextureMultiviewOVR not available", __FUNCTION__);
+		return false;
+	}
+
+	framebufferTextureMultiview(GL_DRAW_FRAMEBUFFER, attachment, texture, 0, 0, static_cast<GLsizei>(viewCount));
+	return true;
+}
+
+
 GLSwapchain::~GLSwapchain()
 {
 	reset();
 }
 
 bool
-GLSwapchain::enumerateAndGenerateFramebuffers(XrSwapchain swapchain)
+GLSwapchain::enumerateImages(XrSwapchain swapchain)
 {
 	assert(swapchainImages_.empty());
-	assert(framebuffers_.empty());
 	uint32_t countOutput = 0;
 	if (!XR_UNQUALIFIED_SUCCESS(xrEnumerateSwapchainImages(swapchain, 0, &countOutput, nullptr))) {
 		ALOGE("%s: Failed initial call to xrEnumerateSwapchainImages", __FUNCTION__);
@@ -43,8 +65,18 @@ GLSwapchain::enumerateAndGenerateFramebuffers(XrSwapchain swapchain)
 	// defensive coding: the array size should not have changed between the two calls but safest to truncate here
 	// just in case.
 	swapchainImages_.resize(countOutput);
+	return true;
+}
 
-	const GLsizei n = static_cast<GLsizei>(countOutput);
+bool
+GLSwapchain::enumerateAndGenerateFramebuffers(XrSwapchain swapchain, uint32_t viewCount)
+{
+	assert(framebuffers_.empty());
+	if (!enumerateImages(swapchain)) {
+		return false;
+	}
+
+	const GLsizei n = static_cast<GLsizei>(swapchainImages_.size());
 
 	ALOGI("%s: Generating framebuffers", __FUNCTION__);
 	framebuffers_.resize(n);
@@ -57,8 +89,10 @@ GLSwapchain::enumerateAndGenerateFramebuffers(XrSwapchain swapchain)
 		// bind this name as the active framebuffer
 		glBindFramebuffer(GL_FRAMEBUFFER, framebuffers_[i]);
 		// associate a swapchain image as the texture object/image for this framebuffer
-		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, swapchainImages_[i].image,
-		                       0);
+		if (!attachSwapchainTexture(GL_COLOR_ATTACHMENT0, swapchainImages_[i].image, viewCount)) {
+			success = false;
+			break;
+		}
 		// check to make sure we can actually render to this.
 		GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
 
@@ -80,10 +114,9 @@ GLSwapchain::enumerateAndGenerateFramebuffers(XrSwapchain swapchain)
 void
 GLSwapchain::reset()
 {
-	if (framebuffers_.empty()) {
-		return;
+	if (!framebuffers_.empty()) {
+		glDeleteFramebuffers(static_cast<GLsizei>(framebuffers_.size()), framebuffers_.data());
+		framebuffers_.clear();
 	}
-	glDeleteFramebuffers(static_cast<GLsizei>(framebuffers_.size()), framebuffers_.data());
-	framebuffers_.clear();
 	swapchainImages_.clear();
 }
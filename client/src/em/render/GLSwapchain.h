@@ -25,6 +25,13 @@ static constexpr XrStructureType kGLSwapchainImageType = XR_TYPE_SWAPCHAIN_IMAGE
 
 #endif
 
+/**
+ * Attach @p texture to @p attachment of the bound draw framebuffer. With more than one view all layers of the array
+ * texture are attached for GL_OVR_multiview rendering. A texture of 0 detaches.
+ */
+bool
+attachSwapchainTexture(GLenum attachment, GLuint texture, uint32_t viewCount);
+
 /**
  * Wraps the native OpenGL texture object names and associated framebuffers for an OpenXR swapchain.
  */
@@ -40,9 +47,14 @@ public:
 	// destructor calls reset
 	~GLSwapchain();
 
-	/// Enumerate the swapchain images and generate/associate framebuffer object names with each
+	/// Enumerate the swapchain images and generate/associate framebuffer object names with each, an array swapchain
+	/// with @p viewCount layers is attached for multiview rendering.
+	bool
+	enumerateAndGenerateFramebuffers(XrSwapchain swapchain, uint32_t viewCount = 1);
+
+	/// Only enumerate the swapchain images, for ones attached to other framebuffers like depth
 	bool
-	enumerateAndGenerateFramebuffers(XrSwapchain swapchain);
+	enumerateImages(XrSwapchain swapchain);
 
 	/// Get the number of images in the swapchain
 	uint32_t
@@ -63,6 +75,13 @@ public:
 		return framebuffers_.at(i);
 	}
 
+	/// Access the GL texture name of swapchain image @p i
+	GLuint
+	textureNameAtSwapchainIndex(uint32_t i) const
+	{
+		return swapchainImages_.at(i).image;
+	}
+
 private:
 	static constexpr XrStructureType kSwapchainImageType = XR_TYPE_SWAPCHAIN_IMAGE_OPENGL_ES_KHR;
 	std::vector<XrSwapchainImageOpenGLESKHR> swapchainImages_;
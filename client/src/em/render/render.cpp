@@ -12,42 +12,120 @@
 #include "render.hpp"
 
 #include "GLDebug.h"
+#include "../gst_common.h"
 #include "GLError.h"
 #include "../em_app_log.h"
 #include <EGL/egl.h>
 #include <GLES3/gl3.h>
+#include <cerrno>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <openxr/openxr.h>
 #include <stdexcept>
+#include <string>
+#include <vector>
+
+// Put in front of the shaders, #version has to come first.
+static constexpr const GLchar *shaderVersion = "#version 300 es\n";
+static constexpr const GLchar *multiviewDefine = "#define MULTIVIEW 1\n";
+static constexpr const GLchar *noDefine = "\n";
 
 // Vertex shader source code
 static constexpr const GLchar *vertexShaderSource = R"(
-    #version 300 es
+#ifdef MULTIVIEW
+    #extension GL_OVR_multiview2 : require
+    layout(num_views = 2) in;
+#endif
     in vec3 position;
     in vec2 uv;
     out vec2 frag_uv;
+    flat out float frag_view;
 
     void main() {
         gl_Position = vec4(position, 1.0);
         frag_uv = uv;
+#ifdef MULTIVIEW
+        frag_view = float(gl_ViewID_OVR);
+#else
+        frag_view = 0.0;
+#endif
     }
 )";
 
 // Fragment shader source code
 static constexpr const GLchar *fragmentShaderSource = R"(
-    #version 300 es
     #extension GL_OES_EGL_image_external : require
     #extension GL_OES_EGL_image_external_essl3 : require
     precision mediump float;
 
     in vec2 frag_uv;
+    flat in float frag_view;
     out vec4 frag_color;
     uniform samplerExternalOES textureSampler;
 
+    // Foveation warp of the server, xy is the min and zw the max, per view.
+    uniform highp vec4 foveationSource;
+    uniform highp vec4 foveationEncoded;
+
+    // Fraction of the frame height holding color, the depth band is below it.
+    uniform highp float colorFraction;
+    uniform bool depthValid;
+
+    // Fraction of each view's color area holding it, the server shrinks the views under load.
+    uniform highp vec2 activeSize;
+
+    // Where the content of the views moves, the left view above the right, scaled to how far to move it.
+    uniform highp sampler2D motionField;
+    uniform highp vec2 motionScale;
+    uniform bool motionValid;
+
+    // Where a point of the view ended up in the warped frame, per axis the
+    // area between the source min and max is stretched to the encoded one.
+    highp vec2 warp(highp vec2 local) {
+        highp vec2 src_min = foveationSource.xy;
+        highp vec2 src_max = foveationSource.zw;
+        highp vec2 enc_min = foveationEncoded.xy;
+        highp vec2 enc_max = foveationEncoded.zw;
+
+        highp vec2 low = local / max(src_min, vec2(1e-6)) * enc_min;
+        highp vec2 center = enc_min + (local - src_min) / max(src_max - src_min, vec2(1e-6)) * (enc_max - enc_min);
+        highp vec2 high = enc_max + (local - src_max) / max(vec2(1.0) - src_max, vec2(1e-6)) * (vec2(1.0) - enc_max);
+
+        highp vec2 result = mix(center, low, lessThan(local, src_min));
+        return mix(result, high, greaterThan(local, src_max));
+    }
+
     void main() {
-        frag_color = texture(textureSampler, frag_uv);
+#ifdef MULTIVIEW
+        // Each view is drawn into its own layer, over the whole of it.
+        highp float view = frag_view;
+        highp vec2 local = frag_uv;
+#else
+        // Views are side by side, warp each in its own half.
+        highp float view = frag_uv.x < 0.5 ? 0.0 : 1.0;
+        highp vec2 local = vec2(frag_uv.x * 2.0 - view, frag_uv.y);
+#endif
+        highp vec2 warped = warp(local);
+        if (motionValid) {
+            // Sampled where the content lands rather than where it was, the field is smooth enough for that.
+            highp float half_texel = 0.5 / float(textureSize(motionField, 0).y);
+            highp float motion_v = view * 0.5 + clamp(warped.y * 0.5, half_texel, 0.5 - half_texel);
+            highp vec2 motion = texture(motionField, vec2(warped.x, motion_v)).rg * motionScale;
+            warped = clamp(warped - motion, vec2(0.0), vec2(1.0));
+        }
+        highp vec2 encoded = warped * activeSize;
+        frag_color = texture(textureSampler, vec2((view + encoded.x) * 0.5, encoded.y * colorFraction));
+
+        // Depth is luma with neutral chroma, so any channel has it. Not warped.
+        if (depthValid) {
+            highp float depth_v = colorFraction + local.y * (1.0 - colorFraction);
+            gl_FragDepth = texture(textureSampler, vec2((view + local.x) * 0.5, depth_v)).r;
+        } else {
+            gl_FragDepth = gl_FragCoord.z;
+        }
     }
 )";
 
@@ -77,23 +155,141 @@ checkProgramLinking(GLuint program)
 	}
 }
 
+/// File of the program binary for these sources on this driver, a driver update or a changed shader gives another.
+static std::string
+programCachePath(const char *cacheDir, const GLchar *const *vertexSources, const GLchar *const *fragmentSources)
+{
+	std::string key;
+	for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+		const GLubyte *value = glGetString(name);
+		key += value != nullptr ? reinterpret_cast<const char *>(value) : "";
+		key += '\n';
+	}
+	for (int i = 0; i < 3; i++) {
+		key += vertexSources[i];
+		key += fragmentSources[i];
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "/program-%016zx.bin", std::hash<std::string>{}(key));
+	return std::string(cacheDir) + name;
+}
+
+/// The binary format, then the binary. False if there is none or the driver rejects it.
+static bool
+loadProgramBinary(GLuint program, const std::string &path)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if (file == nullptr) {
+		return false;
+	}
+
+	GLenum format = 0;
+	std::vector<uint8_t> binary;
+	bool read = fread(&format, sizeof(format), 1, file) == 1;
+	if (read && fseek(file, 0, SEEK_END) == 0) {
+		long end = ftell(file);
+		if (end > (long)sizeof(format) && fseek(file, sizeof(format), SEEK_SET) == 0) {
+			binary.resize((size_t)end - sizeof(format));
+			read = fread(binary.data(), binary.size(), 1, file) == 1;
+		}
+	}
+	fclose(file);
+	if (!read || binary.empty()) {
+		return false;
+	}
+
+	glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+	GLint linked = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	return linked == GL_TRUE;
+}
+
+static void
+saveProgramBinary(GLuint program, const std::string &path)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) {
+		return;
+	}
+
+	GLenum format = 0;
+	std::vector<uint8_t> binary((size_t)length);
+	glGetProgramBinary(program, length, &length, &format, binary.data());
+
+	// Renamed over once complete, a crash while writing leaves no half binary behind.
+	std::string tmpPath = path + ".tmp";
+	FILE *file = fopen(tmpPath.c_str(), "wb");
+	if (file == nullptr) {
+		ALOGW("Could not create %s: %s", tmpPath.c_str(), strerror(errno));
+		return;
+	}
+	bool written = fwrite(&format, sizeof(format), 1, file) == 1 && fwrite(binary.data(), length, 1, file) == 1;
+	written = fclose(file) == 0 && written;
+	if (!written || rename(tmpPath.c_str(), path.c_str()) != 0) {
+		ALOGW("Could not save the shader program to %s", path.c_str());
+		remove(tmpPath.c_str());
+	}
+}
+
+bool
+Renderer::supportsMultiview()
+{
+	const char *extensions = reinterpret_cast<const char *>(glGetString(GL_EXTENSIONS));
+	return extensions != nullptr && strstr(extensions, "GL_OVR_multiview2") != nullptr;
+}
+
 void
-Renderer::setupShaders()
+Renderer::setupShaders(const char *cacheDir)
+{
+	const GLchar *define = multiview_ ? multiviewDefine : noDefine;
+	const GLchar *vertexSources[] = {shaderVersion, define, vertexShaderSource};
+	const GLchar *fragmentSources[] = {shaderVersion, define, fragmentShaderSource};
+
+	// Compiling and linking takes a good part of the time to the first frame.
+	std::string cachePath = cacheDir != nullptr ? programCachePath(cacheDir, vertexSources, fragmentSources) : "";
+	program = glCreateProgram();
+	if (!cachePath.empty() && loadProgramBinary(program, cachePath)) {
+		ALOGI("Loaded the shader program from %s", cachePath.c_str());
+	} else {
+		// A program the binary failed on is not reused.
+		glDeleteProgram(program);
+		compileProgram(vertexSources, fragmentSources);
+		if (!cachePath.empty()) {
+			saveProgramBinary(program, cachePath);
+		}
+	}
+
+	textureSamplerLocation_ = glGetUniformLocation(program, "textureSampler");
+	foveationSourceLocation_ = glGetUniformLocation(program, "foveationSource");
+	foveationEncodedLocation_ = glGetUniformLocation(program, "foveationEncoded");
+	colorFractionLocation_ = glGetUniformLocation(program, "colorFraction");
+	depthValidLocation_ = glGetUniformLocation(program, "depthValid");
+	activeSizeLocation_ = glGetUniformLocation(program, "activeSize");
+	motionFieldLocation_ = glGetUniformLocation(program, "motionField");
+	motionScaleLocation_ = glGetUniformLocation(program, "motionScale");
+	motionValidLocation_ = glGetUniformLocation(program, "motionValid");
+}
+
+void
+Renderer::compileProgram(const GLchar *const *vertexSources, const GLchar *const *fragmentSources)
 {
 	// Compile the vertex shader
 	GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-	glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
+	glShaderSource(vertexShader, 3, vertexSources, NULL);
 	glCompileShader(vertexShader);
 	checkShaderCompilation(vertexShader);
 
 	// Compile the fragment shader
 	GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
+	glShaderSource(fragmentShader, 3, fragmentSources, NULL);
 	glCompileShader(fragmentShader);
 	checkShaderCompilation(fragmentShader);
 
 	// Create and link the shader program
 	program = glCreateProgram();
+	glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glAttachShader(program, vertexShader);
 	glAttachShader(program, fragmentShader);
 	glLinkProgram(program);
@@ -102,8 +298,6 @@ Renderer::setupShaders()
 	// Clean up the shaders as they're no longer needed
 	glDeleteShader(vertexShader);
 	glDeleteShader(fragmentShader);
-
-	textureSamplerLocation_ = glGetUniformLocation(program, "textureSampler");
 }
 
 struct TextureCoord
@@ -155,13 +349,22 @@ Renderer::~Renderer()
 }
 
 void
-Renderer::setupRender()
+Renderer::setupRender(bool multiview, const char *cacheDir)
 {
-
+	multiview_ = multiview;
 
 	registerGlDebugCallback();
-	setupShaders();
+	setupShaders(cacheDir);
 	setupQuadVertexData();
+
+	// A few hundred bytes uploaded per extrapolated frame, filtered between the blocks.
+	glGenTextures(1, &motionTexture_);
+	glBindTexture(GL_TEXTURE_2D, motionTexture_);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
 void
@@ -179,10 +382,20 @@ Renderer::reset()
 		glDeleteBuffers(1, &quadVBO);
 		quadVBO = 0;
 	}
+	if (motionTexture_ != 0) {
+		glDeleteTextures(1, &motionTexture_);
+		motionTexture_ = 0;
+	}
 }
 
 void
-Renderer::draw(GLuint texture, GLenum texture_target) const
+Renderer::draw(GLuint texture,
+               GLenum texture_target,
+               const struct em_foveation *foveation,
+               const struct em_depth *depth,
+               const XrVector2f *active_size,
+               const struct em_motion_field *motion,
+               float extrapolation) const
 {
 	//    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
 
@@ -195,11 +408,59 @@ Renderer::draw(GLuint texture, GLenum texture_target) const
 	glBindTexture(texture_target, texture);
 	glUniform1i(textureSamplerLocation_, 0);
 
+	// Without foveation both areas are the whole view, which makes the warp the identity.
+	if (foveation != nullptr) {
+		glUniform4f(foveationSourceLocation_, foveation->source_min.x, foveation->source_min.y,
+		            foveation->source_max.x, foveation->source_max.y);
+		glUniform4f(foveationEncodedLocation_, foveation->encoded_min.x, foveation->encoded_min.y,
+		            foveation->encoded_max.x, foveation->encoded_max.y);
+	} else {
+		glUniform4f(foveationSourceLocation_, 0.0f, 0.0f, 1.0f, 1.0f);
+		glUniform4f(foveationEncodedLocation_, 0.0f, 0.0f, 1.0f, 1.0f);
+	}
+
+	if (active_size != nullptr) {
+		glUniform2f(activeSizeLocation_, active_size->x, active_size->y);
+	} else {
+		glUniform2f(activeSizeLocation_, 1.0f, 1.0f);
+	}
+
+	// The field is signed bytes, which the texture gives back divided by 127.
+	bool extrapolate = motion != nullptr && extrapolation > 0.0f;
+	if (extrapolate) {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, motionTexture_);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8_SNORM, motion->width, motion->height * 2, 0, GL_RG, GL_BYTE,
+		             motion->vectors);
+		glUniform2f(motionScaleLocation_, motion->scale.x * 127.0f * extrapolation,
+		            motion->scale.y * 127.0f * extrapolation);
+		glActiveTexture(GL_TEXTURE0);
+	}
+	// Set either way, two sampler types must not share a unit.
+	glUniform1i(motionFieldLocation_, 1);
+	glUniform1i(motionValidLocation_, extrapolate ? 1 : 0);
+
+	bool writeDepth = depth != nullptr && depth->valid;
+	glUniform1f(colorFractionLocation_, depth != nullptr ? depth->color_fraction : 1.0f);
+	glUniform1i(depthValidLocation_, writeDepth ? 1 : 0);
+
+	// The shader writes every fragment's depth, the test must not throw any away.
+	if (writeDepth) {
+		glEnable(GL_DEPTH_TEST);
+		glDepthFunc(GL_ALWAYS);
+		glDepthMask(GL_TRUE);
+	}
+
 	// Draw the quad
 	glBindVertexArray(quadVAO);
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
 	glBindVertexArray(0);
 
+	if (writeDepth) {
+		glDisable(GL_DEPTH_TEST);
+	}
+
 	CHECK_GL_ERROR();
 #if 0
 	GLenum err;
@@ -14,6 +14,11 @@
 #include <EGL/egl.h>
 #include <GLES3/gl3.h>
 #include <memory>
+#include <openxr/openxr.h>
+
+struct em_foveation;
+struct em_depth;
+struct em_motion_field;
 
 class Renderer
 {
@@ -29,28 +34,57 @@ public:
 	Renderer &
 	operator=(Renderer &&) = delete;
 
-	/// Create resources. Must call with EGL Context current
+	/// Does the current context do GL_OVR_multiview2. Must call with EGL Context current
+	static bool
+	supportsMultiview();
+
+	/// Create resources, for drawing both views into a 2 layer framebuffer at once with @p multiview, else side
+	/// by side. The linked shader program is kept in @p cacheDir for the next start, null to always compile it.
+	/// Must call with EGL Context current
 	void
-	setupRender();
+	setupRender(bool multiview, const char *cacheDir);
 
 	/// Destroy resources. Must call with EGL context current.
 	void
 	reset();
 
-	/// Draw texture to framebuffer. Must call with EGL Context current.
+	/// Draw texture to framebuffer, undoing the foveation warp if not null. With a depth band only the color part
+	/// is drawn, and a valid depth is written to the depth attachment if there is one. A non-null @p active_size
+	/// samples only that fraction of each view's area, from its top left. A non-null @p motion moves the content
+	/// on by @p extrapolation frames, for showing a frame again while the next one is late. Must call with EGL
+	/// Context current.
 	void
-	draw(GLuint texture, GLenum texture_target) const;
+	draw(GLuint texture,
+	     GLenum texture_target,
+	     const struct em_foveation *foveation,
+	     const struct em_depth *depth,
+	     const XrVector2f *active_size,
+	     const struct em_motion_field *motion,
+	     float extrapolation) const;
 
 
 private:
 	void
-	setupShaders();
+	setupShaders(const char *cacheDir);
+	void
+	compileProgram(const GLchar *const *vertexSources, const GLchar *const *fragmentSources);
 	void
 	setupQuadVertexData();
 
+	bool multiview_ = false;
+
 	GLuint program = 0;
 	GLuint quadVAO = 0;
 	GLuint quadVBO = 0;
+	GLuint motionTexture_ = 0;
 
 	GLint textureSamplerLocation_ = 0;
+	GLint foveationSourceLocation_ = 0;
+	GLint foveationEncodedLocation_ = 0;
+	GLint colorFractionLocation_ = 0;
+	GLint depthValidLocation_ = 0;
+	GLint activeSizeLocation_ = 0;
+	GLint motionFieldLocation_ = 0;
+	GLint motionScaleLocation_ = 0;
+	GLint motionValidLocation_ = 0;
 };
@@ -22,6 +22,8 @@
 #include "em/gst_common.h"
 #include "em/render/render.hpp"
 
+#include "em_thread_sched.h"
+
 #include "os/os_time.h"
 #include "util/u_time.h"
 
@@ -54,6 +56,7 @@
 #include <ctime>
 
 #include <sys/system_properties.h>
+#include <vector>
 
 
 #define XR_LOAD(fn) xrGetInstanceProcAddr(state.instance, #fn, (PFN_xrVoidFunction *)&fn);
@@ -239,6 +242,107 @@ read_websocket_uri_property(uint32_t timeout_ms)
 	return "";
 }
 
+#define SURFACE_SWAPCHAIN_PROPERTY_NAME "debug.electric_maple.surface_swapchain"
+#define DECODER_PROPERTY_NAME "debug.electric_maple.decoder"
+#define POSE_RATE_PROPERTY_NAME "debug.electric_maple.pose_rate"
+#define DIRECT_URI_PROPERTY_NAME "debug.electric_maple.direct_uri"
+#define SLICE_INPUT_PROPERTY_NAME "debug.electric_maple.slice_input"
+#define THREAD_PRIORITY_PROPERTY_NAME "debug.electric_maple.thread_priority"
+#define CPU_AFFINITY_PROPERTY_NAME "debug.electric_maple.cpu_affinity"
+
+//! Opt in with `adb shell setprop debug.electric_maple.surface_swapchain 1`.
+static bool
+want_surface_swapchain()
+{
+	char value[PROP_VALUE_MAX] = {};
+	__system_property_get(SURFACE_SWAPCHAIN_PROPERTY_NAME, value);
+	return strcmp(value, "1") == 0;
+}
+
+//! Slices to MediaCodec as they arrive in surface mode, `adb shell setprop debug.electric_maple.slice_input 1`.
+static bool
+want_slice_input()
+{
+	char value[PROP_VALUE_MAX] = {};
+	__system_property_get(SLICE_INPUT_PROPERTY_NAME, value);
+	return strcmp(value, "1") == 0;
+}
+
+//! Decoder element override, for example `adb shell setprop debug.electric_maple.decoder amcviddec-c2qtiavcdecoder`.
+static std::string
+read_decoder_property()
+{
+	char value[PROP_VALUE_MAX] = {};
+	__system_property_get(DECODER_PROPERTY_NAME, value);
+	return value;
+}
+
+//! Poses per second from a thread of their own, for example `adb shell setprop debug.electric_maple.pose_rate 500`.
+static uint32_t
+read_pose_rate_property()
+{
+	char value[PROP_VALUE_MAX] = {};
+	__system_property_get(POSE_RATE_PROPERTY_NAME, value);
+	return (uint32_t)strtoul(value, NULL, 10);
+}
+
+//! Skip WebRTC, for example `adb shell setprop debug.electric_maple.direct_uri rtp://192.168.42.1:61990?codec=H265`.
+static std::string
+read_direct_uri_property()
+{
+	char value[PROP_VALUE_MAX] = {};
+	__system_property_get(DIRECT_URI_PROPERTY_NAME, value);
+	return value;
+}
+
+/*!
+ * Raise the threads on the path of a frame like Android's own display threads, opt out with `adb shell setprop
+ * debug.electric_maple.thread_priority 0`. Pin them with for example `adb shell setprop
+ * debug.electric_maple.cpu_affinity 4-7`, the big cores on most SoCs.
+ */
+static void
+setup_thread_policies()
+{
+	char value[PROP_VALUE_MAX] = {};
+	__system_property_get(THREAD_PRIORITY_PROPERTY_NAME, value);
+	bool priority = strcmp(value, "0") != 0;
+
+	uint64_t cpu_mask = 0;
+	char cpus[PROP_VALUE_MAX] = {};
+	__system_property_get(CPU_AFFINITY_PROPERTY_NAME, cpus);
+	if (cpus[0] != '\0' && !em_thread_sched_parse_cpus(cpus, &cpu_mask)) {
+		ALOGW("%s: Malformed %s %s, ignoring it", __FUNCTION__, CPU_AFFINITY_PROPERTY_NAME, cpus);
+	}
+
+	// THREAD_PRIORITY_URGENT_DISPLAY, THREAD_PRIORITY_DISPLAY and THREAD_PRIORITY_FOREGROUND.
+	struct em_thread_policy render = {.cpu_mask = cpu_mask, .nice = priority ? -8 : 0};
+	struct em_thread_policy codec = {.cpu_mask = cpu_mask, .nice = priority ? -4 : 0};
+	struct em_thread_policy network = {.cpu_mask = cpu_mask, .nice = priority ? -2 : 0};
+	em_thread_sched_set_policy(EM_THREAD_ROLE_RENDER, &render);
+	em_thread_sched_set_policy(EM_THREAD_ROLE_TRACKING, &render);
+	em_thread_sched_set_policy(EM_THREAD_ROLE_CODEC, &codec);
+	em_thread_sched_set_policy(EM_THREAD_ROLE_NETWORK, &network);
+}
+
+static bool
+instance_extension_available(const char *name)
+{
+	uint32_t count = 0;
+	if (XR_FAILED(xrEnumerateInstanceExtensionProperties(NULL, 0, &count, NULL))) {
+		return false;
+	}
+	std::vector<XrExtensionProperties> properties(count, {XR_TYPE_EXTENSION_PROPERTIES});
+	if (XR_FAILED(xrEnumerateInstanceExtensionProperties(NULL, count, &count, properties.data()))) {
+		return false;
+	}
+	for (const XrExtensionProperties &property : properties) {
+		if (strcmp(property.extensionName, name) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
 void
 android_main(struct android_app *app)
 {
@@ -285,9 +389,26 @@ android_main(struct android_app *app)
 
 	// Create OpenXR instance
 
-	const char *extensions[] = {XR_KHR_OPENGL_ES_ENABLE_EXTENSION_NAME,
-	                            XR_KHR_ANDROID_CREATE_INSTANCE_EXTENSION_NAME,
-	                            XR_KHR_CONVERT_TIMESPEC_TIME_EXTENSION_NAME};
+	std::vector<const char *> extensions = {XR_KHR_OPENGL_ES_ENABLE_EXTENSION_NAME,
+	                                        XR_KHR_ANDROID_CREATE_INSTANCE_EXTENSION_NAME,
+	                                        XR_KHR_CONVERT_TIMESPEC_TIME_EXTENSION_NAME,
+	                                        XR_KHR_COMPOSITION_LAYER_DEPTH_EXTENSION_NAME};
+
+	bool surface_swapchain = false;
+	if (want_surface_swapchain()) {
+		surface_swapchain = instance_extension_available(XR_KHR_ANDROID_SURFACE_SWAPCHAIN_EXTENSION_NAME);
+		if (surface_swapchain) {
+			extensions.push_back(XR_KHR_ANDROID_SURFACE_SWAPCHAIN_EXTENSION_NAME);
+		} else {
+			ALOGW("%s set, but the runtime lacks %s", SURFACE_SWAPCHAIN_PROPERTY_NAME,
+			      XR_KHR_ANDROID_SURFACE_SWAPCHAIN_EXTENSION_NAME);
+		}
+	}
+
+	// Lets the display follow the rate the server streams at.
+	if (instance_extension_available(XR_FB_DISPLAY_REFRESH_RATE_EXTENSION_NAME)) {
+		extensions.push_back(XR_FB_DISPLAY_REFRESH_RATE_EXTENSION_NAME);
+	}
 
 	XrInstanceCreateInfoAndroidKHR androidInfo = {};
 	androidInfo.type = XR_TYPE_INSTANCE_CREATE_INFO_ANDROID_KHR;
@@ -305,8 +426,8 @@ android_main(struct android_app *app)
 	instanceInfo.applicationInfo.applicationName[XR_MAX_APPLICATION_NAME_SIZE - 1] = '\0';
 
 	instanceInfo.applicationInfo.apiVersion = XR_API_VERSION_1_0;
-	instanceInfo.enabledExtensionCount = sizeof(extensions) / sizeof(extensions[0]);
-	instanceInfo.enabledExtensionNames = extensions;
+	instanceInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+	instanceInfo.enabledExtensionNames = extensions.data();
 
 
 	result = xrCreateInstance(&instanceInfo, &state.instance);
@@ -393,6 +514,9 @@ android_main(struct android_app *app)
 	// Does this need to be set after gst-init?
 	gst_debug_set_threshold_from_string(gst_debug_string, true);
 
+	// Before any of the threads it covers start.
+	setup_thread_policies();
+
 	// Set up our own objects
 	ALOGI("%s: creating stream client object", __FUNCTION__);
 	EmStreamClient *stream_client = em_stream_client_new();
@@ -401,11 +525,21 @@ android_main(struct android_app *app)
 	// retaining ownership
 	em_stream_client_set_egl_context(stream_client, egl_mutex, false, initialEglData->surface);
 
+	std::string decoder_property = read_decoder_property();
+	if (!decoder_property.empty()) {
+		ALOGI("%s: Using decoder %s from %s", __FUNCTION__, decoder_property.c_str(), DECODER_PROPERTY_NAME);
+		em_stream_client_set_decoder(stream_client, decoder_property.c_str());
+	}
+
 	// Read debug.electric_maple.websocket_uri
 	std::string websocket_uri_property = read_websocket_uri_property(5000);
+	std::string direct_uri_property = read_direct_uri_property();
 
 	ALOGI("%s: creating connection object", __FUNCTION__);
-	if (!websocket_uri_property.empty()) {
+	if (!direct_uri_property.empty()) {
+		ALOGI("%s: Receiving directly from %s", __FUNCTION__, direct_uri_property.c_str());
+		state.connection = g_object_ref_sink(em_connection_new_direct(direct_uri_property.c_str()));
+	} else if (!websocket_uri_property.empty()) {
 		state.connection = g_object_ref_sink(em_connection_new(websocket_uri_property.c_str()));
 	} else {
 		state.connection = g_object_ref_sink(em_connection_new_localhost());
@@ -413,26 +547,45 @@ android_main(struct android_app *app)
 
 	g_signal_connect(state.connection, "connected", G_CALLBACK(connected_cb), &state);
 
-	ALOGI("%s: starting connection", __FUNCTION__);
-	em_connection_connect(state.connection);
-
-	ALOGI("%s: starting stream client mainloop thread", __FUNCTION__);
-	em_stream_client_spawn_thread(stream_client, state.connection);
-
 	XrExtent2Di eye_extents{static_cast<int32_t>(state.width), static_cast<int32_t>(state.height)};
 	EmRemoteExperience *remote_experience =
-	    em_remote_experience_new(state.connection, stream_client, state.instance, state.session, &eye_extents);
+	    em_remote_experience_new(state.connection, stream_client, state.instance, state.session, &eye_extents,
+	                             app->activity->internalDataPath);
 	if (!remote_experience) {
 		ALOGE("%s: Failed during remote experience init.", __FUNCTION__);
 		return;
 	}
 
+	// Has to be decided before the stream client builds its pipeline.
+	if (surface_swapchain && !em_remote_experience_use_surface_swapchain(remote_experience, env)) {
+		ALOGW("%s: Falling back to rendering the decoded frames", __FUNCTION__);
+	}
+	if (want_slice_input()) {
+		em_stream_client_set_slice_input(stream_client, true);
+	}
+
+	// 0 or unset keeps sending one pose per frame.
+	uint32_t pose_rate = read_pose_rate_property();
+	if (pose_rate != 0 && !em_remote_experience_start_pose_thread(remote_experience, pose_rate)) {
+		ALOGW("%s: Sending one pose per frame instead", __FUNCTION__);
+	}
+
+	ALOGI("%s: starting connection", __FUNCTION__);
+	em_connection_connect(state.connection);
+
+	ALOGI("%s: starting stream client mainloop thread", __FUNCTION__);
+	em_stream_client_spawn_thread(stream_client, state.connection);
+
 	//
 	// End of remote-rendering-specific setup, into main loop
 	//
 
 	// Main rendering loop.
 	ALOGI("DEBUG: Starting main loop.\n");
+	int sched_ret = em_thread_sched_apply(EM_THREAD_ROLE_RENDER);
+	if (sched_ret != 0) {
+		ALOGW("%s: Could not schedule the render thread: %s", __FUNCTION__, strerror(sched_ret));
+	}
 	while (!app->destroyRequested) {
 		if (poll_events(app, state)) {
 			em_remote_experience_poll_and_render_frame(remote_experience);
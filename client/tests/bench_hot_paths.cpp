@@ -0,0 +1,273 @@
+// Copyright 2024, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief Benchmarks of the code the client runs for every frame.
+ *
+ * Run with --skip-benchmarks to only check the results, see the client README for a run on device.
+ */
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include "em/em_frame_data.hpp"
+#include "em/em_id_data_accumulator.hpp"
+#include "em/em_ring_id_data_accumulator.hpp"
+#include "em_compact.h"
+
+#ifdef EM_HAVE_OPENXR
+#include "em/em_pose.h"
+#endif
+
+#include "electricmaple.pb.h"
+#include <pb_decode.h>
+#include <pb_encode.h>
+
+#include <cstddef>
+#include <cstdint>
+
+using em::id_data_accum::IdType;
+
+namespace {
+
+constexpr int64_t kEpoch = 5000000000000;
+constexpr int64_t kFrameIntervalNs = 11111111;
+
+em_proto_Pose makePose(float x, float y, float z) {
+  em_proto_Pose pose = em_proto_Pose_init_default;
+  pose.has_position = true;
+  pose.position = {x, y, z};
+  pose.has_orientation = true;
+  pose.orientation = {0.9238795f, 0.0f, 0.3826834f, 0.0f};
+  return pose;
+}
+
+em_proto_DownMessage makeDownMessage(int64_t frameId) {
+  em_proto_DownMessage message = em_proto_DownMessage_init_default;
+  message.has_frame_data = true;
+  message.frame_data.frame_sequence_id = frameId;
+  message.frame_data.has_P_localSpace_view0 = true;
+  message.frame_data.P_localSpace_view0 = makePose(-0.032f, 1.6f, 0.1f);
+  message.frame_data.has_P_localSpace_view1 = true;
+  message.frame_data.P_localSpace_view1 = makePose(0.032f, 1.6f, 0.1f);
+  message.frame_data.display_time = kEpoch + frameId * kFrameIntervalNs;
+  message.frame_data.render_time =
+      message.frame_data.display_time - 2 * kFrameIntervalNs;
+  return message;
+}
+
+// What the client sends every frame, tracking of the next one and the times
+// of the last one.
+em_proto_UpMessage makeUpMessage(int64_t frameId) {
+  em_proto_UpMessage message = em_proto_UpMessage_init_default;
+  message.up_message_id = frameId;
+  message.has_tracking = true;
+  message.tracking.has_P_localSpace_viewSpace = true;
+  message.tracking.P_localSpace_viewSpace = makePose(0.0f, 1.6f, 0.1f);
+  message.tracking.has_P_viewSpace_view0 = true;
+  message.tracking.P_viewSpace_view0 = makePose(-0.032f, 0.0f, 0.0f);
+  message.tracking.has_P_viewSpace_view1 = true;
+  message.tracking.P_viewSpace_view1 = makePose(0.032f, 0.0f, 0.0f);
+  message.tracking.sequence_idx = frameId;
+  message.tracking.timestamp = kEpoch + frameId * kFrameIntervalNs;
+  message.has_frame = true;
+  message.frame.frame_sequence_id = frameId - 3;
+  message.frame.decode_complete_time = message.tracking.timestamp - 100000;
+  message.frame.display_time = message.tracking.timestamp;
+  return message;
+}
+
+template <typename T>
+size_t encodeProtobuf(const pb_msgdesc_t *fields, const T &message,
+                      uint8_t *buf, size_t size) {
+  pb_ostream_t os = pb_ostream_from_buffer(buf, size);
+  if (!pb_encode(&os, fields, &message)) {
+    return 0;
+  }
+  return os.bytes_written;
+}
+
+template <typename T>
+bool decodeProtobuf(const pb_msgdesc_t *fields, const uint8_t *buf,
+                    size_t size, T &out) {
+  pb_istream_t is = pb_istream_from_buffer(buf, size);
+  return pb_decode(&is, fields, &out);
+}
+
+void countMessage(em_proto_UpMessage *message, void *userdata) {
+  *static_cast<int64_t *>(userdata) += message->frame.frame_sequence_id;
+}
+
+} // namespace
+
+TEST_CASE("IdDataAccumulatorBench", "[benchmark]") {
+  struct Data {
+    int64_t decodeTime;
+    int64_t displayTime;
+  };
+  // The same size the FrameDataAccumulator uses.
+  em::IdDataAccumulator<Data, 5> accum{};
+
+  // Decoded frames get displayed a couple of frames later, keep that many in
+  // flight.
+  IdType next = 1;
+  for (; next < 3; ++next) {
+    REQUIRE(accum.addDataFor(next, {next, 0}));
+  }
+
+  BENCHMARK("add, update and drop one frame") {
+    accum.addDataFor(next, {next, 0});
+    accum.updateDataFor(next - 2, [&](Data &data) { data.displayTime = next; });
+    accum.visitAll([](IdType, Data const &data) {
+      return data.displayTime != 0 ? em::id_data_accum::Command::Drop
+                                   : em::id_data_accum::Command::Keep;
+    });
+    return ++next;
+  };
+
+  CHECK(accum.size() == 2);
+
+  BENCHMARK("lookup of a missing id") { return accum.getConstForId(-1); };
+}
+
+TEST_CASE("RingIdDataAccumulatorBench", "[benchmark]") {
+  struct Data {
+    int64_t decodeTime;
+    int64_t displayTime;
+  };
+  em::RingIdDataAccumulator<Data, 128> accum{};
+
+  // A deep pipeline, most of the ring in flight.
+  constexpr IdType kInFlight = 100;
+  IdType next = 1;
+  for (; next <= kInFlight; ++next) {
+    REQUIRE(accum.addDataFor(next, {next, 0}));
+  }
+
+  BENCHMARK("add, update and drop one frame") {
+    accum.addDataFor(next, {next, 0});
+    accum.updateDataFor(next - kInFlight,
+                        [&](Data &data) { data.displayTime = next; });
+    accum.visitAll([](IdType, Data const &data) {
+      return data.displayTime != 0 ? em::id_data_accum::Command::Drop
+                                   : em::id_data_accum::Command::Keep;
+    });
+    return ++next;
+  };
+
+  CHECK(accum.size() == kInFlight);
+
+  BENCHMARK("lookup of a missing id") { return accum.getConstForId(-1); };
+}
+
+TEST_CASE("FrameDataAccumulatorBench", "[benchmark]") {
+  em::FrameDataAccumulator accum;
+  int64_t emitted = 0;
+
+  int64_t frameId = 1;
+  for (; frameId < 3; ++frameId) {
+    accum.recordDecodeTime(frameId, kEpoch + frameId);
+  }
+  accum.recordDisplayTime(1, kEpoch + frameId);
+  accum.emitCompleteRecords(countMessage, &emitted);
+  CHECK(emitted == 1);
+
+  BENCHMARK("record and emit one frame") {
+    accum.recordDecodeTime(frameId, kEpoch + frameId);
+    accum.recordDisplayTime(frameId - 2, kEpoch + frameId);
+    accum.emitCompleteRecords(countMessage, &emitted);
+    return ++frameId;
+  };
+
+  BENCHMARK("emit with nothing complete") {
+    accum.emitCompleteRecords(countMessage, &emitted);
+    return emitted;
+  };
+}
+
+TEST_CASE("DownMessageBench", "[benchmark]") {
+  const em_proto_DownMessage message = makeDownMessage(1234);
+  uint8_t buf[em_proto_DownMessage_size];
+
+  size_t size =
+      encodeProtobuf(em_proto_DownMessage_fields, message, buf, sizeof(buf));
+  REQUIRE(size > 0);
+  em_proto_DownMessage out = em_proto_DownMessage_init_default;
+  REQUIRE(decodeProtobuf(em_proto_DownMessage_fields, buf, size, out));
+  CHECK(out.frame_data.frame_sequence_id == 1234);
+
+  BENCHMARK("protobuf encode") {
+    return encodeProtobuf(em_proto_DownMessage_fields, message, buf,
+                          sizeof(buf));
+  };
+
+  BENCHMARK("protobuf decode") {
+    em_proto_DownMessage decoded = em_proto_DownMessage_init_default;
+    decodeProtobuf(em_proto_DownMessage_fields, buf, size, decoded);
+    return decoded.frame_data.display_time;
+  };
+}
+
+TEST_CASE("UpMessageBench", "[benchmark]") {
+  const em_proto_UpMessage message = makeUpMessage(1234);
+
+  SECTION("Protobuf") {
+    uint8_t buf[em_proto_UpMessage_size];
+    size_t size =
+        encodeProtobuf(em_proto_UpMessage_fields, message, buf, sizeof(buf));
+    REQUIRE(size > 0);
+    em_proto_UpMessage out = em_proto_UpMessage_init_default;
+    REQUIRE(decodeProtobuf(em_proto_UpMessage_fields, buf, size, out));
+    CHECK(out.tracking.sequence_idx == 1234);
+
+    BENCHMARK("protobuf encode") {
+      return encodeProtobuf(em_proto_UpMessage_fields, message, buf,
+                            sizeof(buf));
+    };
+
+    BENCHMARK("protobuf decode") {
+      em_proto_UpMessage decoded = em_proto_UpMessage_init_default;
+      decodeProtobuf(em_proto_UpMessage_fields, buf, size, decoded);
+      return decoded.tracking.timestamp;
+    };
+  }
+
+  SECTION("Compact") {
+    uint8_t buf[EM_COMPACT_UP_MESSAGE_MAX_SIZE];
+    size_t size =
+        em_compact_encode_up_message(&message, kEpoch, buf, sizeof(buf));
+    REQUIRE(size > 0);
+    em_proto_UpMessage out = em_proto_UpMessage_init_default;
+    REQUIRE(em_compact_decode_up_message(buf, size, kEpoch, &out));
+    CHECK(out.tracking.sequence_idx == 1234);
+
+    BENCHMARK("compact encode") {
+      return em_compact_encode_up_message(&message, kEpoch, buf, sizeof(buf));
+    };
+
+    BENCHMARK("compact decode") {
+      em_proto_UpMessage decoded = em_proto_UpMessage_init_default;
+      em_compact_decode_up_message(buf, size, kEpoch, &decoded);
+      return decoded.tracking.timestamp;
+    };
+  }
+}
+
+#ifdef EM_HAVE_OPENXR
+TEST_CASE("PoseBench", "[benchmark]") {
+  const em_proto_DownMessage message = makeDownMessage(1234);
+
+  XrPosef pose = pose_to_openxr(&message.frame_data.P_localSpace_view1);
+  CHECK(pose.position.x == message.frame_data.P_localSpace_view1.position.x);
+  CHECK(pose.orientation.w ==
+        message.frame_data.P_localSpace_view1.orientation.w);
+
+  BENCHMARK("both views to openxr") {
+    XrPosef poses[2] = {
+        pose_to_openxr(&message.frame_data.P_localSpace_view0),
+        pose_to_openxr(&message.frame_data.P_localSpace_view1),
+    };
+    return poses[0].position.x + poses[1].position.x;
+  };
+}
+#endif
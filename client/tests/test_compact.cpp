@@ -0,0 +1,145 @@
+// Copyright 2024, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ */
+
+#include "catch2/catch_approx.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include "em_compact.h"
+#include <cmath>
+#include <cstdint>
+
+namespace {
+
+constexpr int64_t kEpoch = 5000000000000;
+
+em_proto_Pose makePose(float x, float y, float z, em_proto_Quaternion q) {
+  em_proto_Pose pose = em_proto_Pose_init_default;
+  pose.has_position = true;
+  pose.position.x = x;
+  pose.position.y = y;
+  pose.position.z = z;
+  pose.has_orientation = true;
+  float norm = std::sqrt(q.w * q.w + q.x * q.x + q.y * q.y + q.z * q.z);
+  pose.orientation = {q.w / norm, q.x / norm, q.y / norm, q.z / norm};
+  return pose;
+}
+
+em_proto_UpMessage roundTrip(const em_proto_UpMessage &message) {
+  uint8_t buf[EM_COMPACT_UP_MESSAGE_MAX_SIZE];
+  size_t size =
+      em_compact_encode_up_message(&message, kEpoch, buf, sizeof(buf));
+  REQUIRE(size > 0);
+  REQUIRE(em_compact_is_compact(buf, size));
+
+  em_proto_UpMessage out = em_proto_UpMessage_init_default;
+  REQUIRE(em_compact_decode_up_message(buf, size, kEpoch, &out));
+  return out;
+}
+
+} // namespace
+
+TEST_CASE("CompactUpMessage") {
+
+  em_proto_UpMessage message = em_proto_UpMessage_init_default;
+  message.up_message_id = 42;
+
+  SECTION("Tracking") {
+    message.has_tracking = true;
+    message.tracking.has_P_localSpace_viewSpace = true;
+    message.tracking.P_localSpace_viewSpace =
+        makePose(1.2345f, -0.5f, 3.0f, {-0.5f, 0.1f, -0.7f, 0.2f});
+    message.tracking.sequence_idx = 123456;
+    message.tracking.timestamp = kEpoch + 11111000;
+
+    em_proto_UpMessage out = roundTrip(message);
+    CHECK(out.up_message_id == 42);
+    REQUIRE(out.has_tracking);
+    CHECK_FALSE(out.has_frame);
+    CHECK(out.tracking.sequence_idx == 123456);
+    CHECK(out.tracking.timestamp == kEpoch + 11111000);
+    CHECK_FALSE(out.tracking.has_P_viewSpace_view0);
+
+    REQUIRE(out.tracking.has_P_localSpace_viewSpace);
+    const em_proto_Pose &in = message.tracking.P_localSpace_viewSpace;
+    const em_proto_Pose &pose = out.tracking.P_localSpace_viewSpace;
+    CHECK(pose.position.x == Catch::Approx(in.position.x).margin(0.0001));
+    CHECK(pose.position.y == Catch::Approx(in.position.y).margin(0.0001));
+    CHECK(pose.position.z == Catch::Approx(in.position.z).margin(0.0001));
+
+    // q and -q are the same rotation.
+    float dot = pose.orientation.w * in.orientation.w +
+                pose.orientation.x * in.orientation.x +
+                pose.orientation.y * in.orientation.y +
+                pose.orientation.z * in.orientation.z;
+    CHECK(std::fabs(dot) == Catch::Approx(1.0f).margin(0.00001));
+  }
+
+  SECTION("Frame times") {
+    message.has_frame = true;
+    message.frame.frame_sequence_id = 99;
+    message.frame.display_time = kEpoch + 1000000;
+    message.frame.depay_time = kEpoch - 1000000;
+
+    em_proto_UpMessage out = roundTrip(message);
+    REQUIRE(out.has_frame);
+    CHECK(out.frame.frame_sequence_id == 99);
+    CHECK(out.frame.display_time == kEpoch + 1000000);
+    CHECK(out.frame.depay_time == kEpoch - 1000000);
+    INFO("Unset times stay unset");
+    CHECK(out.frame.decode_complete_time == 0);
+  }
+
+  SECTION("Everything fits") {
+    message.has_tracking = true;
+    message.tracking.has_P_localSpace_viewSpace = true;
+    message.tracking.has_P_viewSpace_view0 = true;
+    message.tracking.has_P_viewSpace_view1 = true;
+    message.tracking.has_P_local_controller_grip_left = true;
+    message.tracking.has_controller_aim_left = true;
+    message.tracking.has_controller_grip_right = true;
+    message.tracking.has_controller_aim_right = true;
+    message.tracking.has_V_localSpace_viewSpace_linear = true;
+    message.tracking.has_V_localSpace_viewSpace_angular = true;
+    message.tracking.V_localSpace_viewSpace_angular.x = -2.5f;
+    message.tracking.timestamp = kEpoch;
+    message.has_frame = true;
+    message.frame.decode_complete_time = kEpoch;
+    message.frame.begin_frame_time = kEpoch;
+    message.frame.display_time = kEpoch;
+    message.frame.depay_time = kEpoch;
+
+    em_proto_UpMessage out = roundTrip(message);
+    CHECK(out.tracking.has_controller_aim_right);
+    CHECK(out.tracking.controller_aim_right.orientation.w == 1.0f);
+    CHECK(out.tracking.V_localSpace_viewSpace_angular.x ==
+          Catch::Approx(-2.5f));
+  }
+
+  SECTION("Protobuf only") {
+    message.has_stream_stats = true;
+    uint8_t buf[EM_COMPACT_UP_MESSAGE_MAX_SIZE];
+    CHECK(em_compact_encode_up_message(&message, kEpoch, buf, sizeof(buf)) ==
+          0);
+  }
+
+  SECTION("Controllers go as protobuf") {
+    message.has_controllers = true;
+    message.controllers.left_count = 1;
+    uint8_t buf[EM_COMPACT_UP_MESSAGE_MAX_SIZE];
+    CHECK(em_compact_encode_up_message(&message, kEpoch, buf, sizeof(buf)) ==
+          0);
+  }
+
+  SECTION("Truncated") {
+    message.has_frame = true;
+    uint8_t buf[EM_COMPACT_UP_MESSAGE_MAX_SIZE];
+    size_t size =
+        em_compact_encode_up_message(&message, kEpoch, buf, sizeof(buf));
+    REQUIRE(size > 0);
+    em_proto_UpMessage out;
+    CHECK_FALSE(em_compact_decode_up_message(buf, size - 1, kEpoch, &out));
+  }
+}
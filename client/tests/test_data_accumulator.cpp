@@ -10,6 +10,7 @@
 #include "catch2/matchers/catch_matchers_range_equals.hpp"
 
 #include "em/em_id_data_accumulator.hpp"
+#include "em/em_ring_id_data_accumulator.hpp"
 #include <cstddef>
 #include <cstdint>
 #include <initializer_list>
@@ -269,3 +270,89 @@ TEST_CASE("IdData") {
     }
   }
 }
+
+TEST_CASE("RingIdData") {
+  static constexpr std::size_t kCapacity = 4;
+  using Accum = em::RingIdDataAccumulator<MyData, kCapacity>;
+  Accum accum{};
+
+  auto ringIds = [](Accum const &accum) {
+    std::vector<IdType> ids;
+    accum.constVisitAll(
+        [&](IdType id, MyData const &) { ids.emplace_back(id); });
+    return ids;
+  };
+
+  CHECK(accum.size() == 0);
+  for (IdType id : kGoodId) {
+    INFO("Adding id " << id);
+    CHECK(accum.addDataFor(id, {}));
+  }
+  CHECK(accum.size() == 4);
+  CHECK_THAT(ringIds(accum),
+             Catch::Matchers::UnorderedRangeEquals(std::initializer_list<IdType>{
+                 kGoodId[0], kGoodId[1], kGoodId[2], kGoodId[3]}));
+
+  SECTION("Reject duplicate and sentinel IDs") {
+    CHECK_THROWS(accum.addDataFor(kGoodId[2], {}));
+    CHECK_THROWS(accum.addDataFor(em::id_data_accum::kSentinel, {}));
+    CHECK(accum.size() == 4);
+  }
+
+  SECTION("An ID in the slot of a newer one is not that one") {
+    IdType older = kGoodId[1] - kCapacity;
+    CHECK_FALSE(accum.getConstForId(older));
+    CHECK_FALSE(accum.addDataFor(older, {}));
+    CHECK(accum.size() == 4);
+    CHECK(accum.getConstForId(kGoodId[1]));
+  }
+
+  SECTION("A newer ID evicts the older one in its slot") {
+    IdType newer = kGoodId[1] + kCapacity;
+    CHECK(accum.addDataFor(newer, {}));
+    CHECK(accum.size() == 4);
+    CHECK_FALSE(accum.getConstForId(kGoodId[1]));
+    CHECK(accum.getConstForId(newer));
+    CHECK_THAT(ringIds(accum), Catch::Matchers::UnorderedRangeEquals(
+                                   std::initializer_list<IdType>{
+                                       kGoodId[0], newer, kGoodId[2],
+                                       kGoodId[3]}));
+  }
+
+  SECTION("Modify values") {
+    CHECK(accum.updateDataFor(kGoodId[2], [](MyData &data) { data.b = true; }));
+    CHECK_FALSE(accum.updateDataFor(kGoodId[2] + kCapacity,
+                                    [](MyData &data) { data.a = true; }));
+    accum.constVisitAll([](IdType id, MyData const &data) {
+      CAPTURE(id);
+      CHECK(data.a == false);
+      CHECK(data.b == (id == kGoodId[2]));
+    });
+  }
+
+  SECTION("Drop values") {
+    bool anyLeft = accum.visitAll([](IdType id, MyData &) {
+      return id == kGoodId[0] ? em::id_data_accum::Command::Drop
+                              : em::id_data_accum::Command::Keep;
+    });
+    CHECK(anyLeft);
+    CHECK(accum.size() == 3);
+    CHECK_FALSE(accum.getConstForId(kGoodId[0]));
+
+    INFO("An old ID fits in a free slot");
+    CHECK(accum.addDataFor(kGoodId[0] - kCapacity, {}));
+    CHECK(accum.size() == 4);
+
+    anyLeft = accum.visitAll(
+        [](IdType, MyData &) { return em::id_data_accum::Command::Drop; });
+    CHECK_FALSE(anyLeft);
+    CHECK(accum.size() == 0);
+  }
+
+  SECTION("Clear") {
+    accum.clear();
+    CHECK(accum.size() == 0);
+    CHECK(ringIds(accum).empty());
+    CHECK(accum.addDataFor(kOldId, {}));
+  }
+}
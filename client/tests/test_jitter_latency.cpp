@@ -0,0 +1,81 @@
+// Copyright 2024, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ */
+
+#include "catch2/catch_test_macros.hpp"
+
+#include "em/em_jitter_latency.h"
+#include <cstdint>
+
+namespace {
+
+constexpr int64_t kFrameIntervalNs = 11111111;
+constexpr uint32_t kFrameRtpTicks = 1000; // 90 kHz at 90 fps
+
+struct Stream {
+  int64_t frame = 0;
+  uint32_t rtpTime = 4000000000u; // wraps around soon
+
+  // Adds @p count frames each @p lateNs late, every other one.
+  uint32_t addFrames(em_jitter_latency &jl, int count, int64_t lateNs) {
+    uint32_t changes = 0;
+    for (int i = 0; i < count; i++, frame++) {
+      int64_t arrival = frame * kFrameIntervalNs + (frame % 2 ? lateNs : 0);
+      uint32_t before = jl.latency_ms;
+      if (em_jitter_latency_add_frame(&jl, arrival, rtpTime)) {
+        CHECK(jl.latency_ms != before);
+        CHECK((jl.latency_ms < before || jl.latency_ms - before <= 2));
+        changes++;
+      }
+      rtpTime += kFrameRtpTicks;
+    }
+    return changes;
+  }
+};
+
+} // namespace
+
+TEST_CASE("JitterLatency") {
+
+  em_jitter_latency jl;
+  em_jitter_latency_reset(&jl);
+  Stream stream;
+
+  SECTION("Clean link") {
+    CHECK(stream.addFrames(jl, 1000, 0) == 0);
+    CHECK(stream.addFrames(jl, 1000, 100000) == 0);
+    CHECK(jl.latency_ms == 0);
+  }
+
+  SECTION("Jitter raises it in steps") {
+    stream.addFrames(jl, 200, 2000000);
+    CHECK(jl.latency_ms > 2);
+    CHECK(jl.latency_ms < EM_JITTER_LATENCY_MAX_MS);
+
+    stream.addFrames(jl, 200, 30000000);
+    CHECK(jl.latency_ms == EM_JITTER_LATENCY_MAX_MS);
+
+    SECTION("and a quiet link clears it") {
+      stream.addFrames(jl, 300, 0);
+      CHECK(jl.latency_ms == 0);
+    }
+  }
+
+  SECTION("Pauses are not jitter") {
+    stream.addFrames(jl, 10, 0);
+    stream.frame += 200;
+    CHECK(stream.addFrames(jl, 10, 0) == 0);
+    stream.rtpTime += 500000;
+    CHECK(stream.addFrames(jl, 10, 0) == 0);
+    CHECK(jl.latency_ms == 0);
+  }
+
+  SECTION("Reordered frames are skipped") {
+    stream.addFrames(jl, 10, 0);
+    CHECK_FALSE(em_jitter_latency_add_frame(
+        &jl, stream.frame * kFrameIntervalNs, stream.rtpTime - 5 * kFrameRtpTicks));
+    CHECK(stream.addFrames(jl, 10, 0) == 0);
+  }
+}
@@ -0,0 +1,101 @@
+// Copyright 2024, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ */
+
+#include "catch2/catch_message.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include "em_sequence_tracker.h"
+#include <cstdint>
+#include <initializer_list>
+
+namespace {
+
+em_sequence_stats addAll(em_sequence_tracker &tracker,
+                         std::initializer_list<int64_t> sequences) {
+  for (int64_t sequence : sequences) {
+    em_sequence_tracker_add(&tracker, sequence);
+  }
+  em_sequence_stats stats;
+  em_sequence_tracker_get_stats(&tracker, &stats);
+  return stats;
+}
+
+} // namespace
+
+TEST_CASE("SequenceTracker") {
+
+  em_sequence_tracker tracker;
+  em_sequence_tracker_reset(&tracker);
+
+  SECTION("In order") {
+    for (int64_t i = 100; i < 1100; i++) {
+      CHECK(em_sequence_tracker_add(&tracker, i) == EM_SEQUENCE_NEW);
+    }
+    em_sequence_stats stats = addAll(tracker, {});
+    CHECK(stats.received == 1000);
+    CHECK(stats.lost == 0);
+    CHECK(stats.pending == 0);
+    CHECK(stats.late == 0);
+    CHECK(stats.duplicates == 0);
+  }
+
+  SECTION("Late and duplicate") {
+    CHECK(em_sequence_tracker_add(&tracker, 0) == EM_SEQUENCE_NEW);
+    CHECK(em_sequence_tracker_add(&tracker, 3) == EM_SEQUENCE_NEW);
+    CHECK(em_sequence_tracker_add(&tracker, 1) == EM_SEQUENCE_LATE);
+    CHECK(em_sequence_tracker_add(&tracker, 1) == EM_SEQUENCE_DUPLICATE);
+    CHECK(em_sequence_tracker_add(&tracker, 3) == EM_SEQUENCE_DUPLICATE);
+
+    em_sequence_stats stats = addAll(tracker, {});
+    CHECK(stats.received == 3);
+    CHECK(stats.late == 1);
+    CHECK(stats.duplicates == 2);
+    CHECK(stats.max_reorder_depth == 2);
+    INFO("2 is still missing, but may come");
+    CHECK(stats.pending == 1);
+    CHECK(stats.lost == 0);
+  }
+
+  SECTION("Loss once out of the window") {
+    addAll(tracker, {0, 1, 5, 6, 8});
+    for (int64_t i = 9; i < 9 + EM_SEQUENCE_TRACKER_WINDOW; i++) {
+      em_sequence_tracker_add(&tracker, i);
+    }
+    em_sequence_stats stats = addAll(tracker, {});
+    CHECK(stats.lost == 4);
+    CHECK(stats.pending == 0);
+    CHECK(stats.max_loss_burst == 3);
+  }
+
+  SECTION("Reorder across words of the window") {
+    for (int64_t i = 0; i < 100; i++) {
+      if (i != 30) {
+        em_sequence_tracker_add(&tracker, i);
+      }
+    }
+    CHECK(em_sequence_tracker_add(&tracker, 30) == EM_SEQUENCE_LATE);
+    em_sequence_stats stats = addAll(tracker, {});
+    CHECK(stats.max_reorder_depth == 69);
+    CHECK(stats.pending == 0);
+  }
+
+  SECTION("Jump ahead") {
+    em_sequence_stats stats = addAll(tracker, {0, 100000});
+    CHECK(stats.lost == 100000 - EM_SEQUENCE_TRACKER_WINDOW);
+    CHECK(stats.pending == EM_SEQUENCE_TRACKER_WINDOW - 1);
+    CHECK(stats.max_loss_burst == 100000 - EM_SEQUENCE_TRACKER_WINDOW);
+  }
+
+  SECTION("Restart") {
+    addAll(tracker, {1000, 1001});
+    CHECK(em_sequence_tracker_add(&tracker, 0) == EM_SEQUENCE_RESTART);
+    CHECK(em_sequence_tracker_add(&tracker, 1) == EM_SEQUENCE_NEW);
+    em_sequence_stats stats = addAll(tracker, {});
+    CHECK(stats.restarts == 1);
+    CHECK(stats.received == 4);
+    CHECK(stats.pending == 0);
+  }
+}
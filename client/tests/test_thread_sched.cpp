@@ -0,0 +1,45 @@
+// Copyright 2024, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ */
+
+#include "catch2/catch_test_macros.hpp"
+
+#include "em_thread_sched.h"
+#include <cstdint>
+
+TEST_CASE("ThreadSchedParseCpus") {
+
+  uint64_t mask = 0;
+
+  SECTION("Single CPUs and ranges") {
+    CHECK(em_thread_sched_parse_cpus("3", &mask));
+    CHECK(mask == 0x8);
+    CHECK(em_thread_sched_parse_cpus("0-3,6", &mask));
+    CHECK(mask == 0x4f);
+    CHECK(em_thread_sched_parse_cpus("63", &mask));
+    CHECK(mask == (uint64_t)1 << 63);
+  }
+
+  SECTION("Malformed lists leave the mask alone") {
+    mask = 42;
+    CHECK_FALSE(em_thread_sched_parse_cpus("", &mask));
+    CHECK_FALSE(em_thread_sched_parse_cpus("1,", &mask));
+    CHECK_FALSE(em_thread_sched_parse_cpus("4-2", &mask));
+    CHECK_FALSE(em_thread_sched_parse_cpus("64", &mask));
+    CHECK_FALSE(em_thread_sched_parse_cpus("1-", &mask));
+    CHECK_FALSE(em_thread_sched_parse_cpus("two", &mask));
+    CHECK(mask == 42);
+  }
+}
+
+TEST_CASE("ThreadSchedApply") {
+
+  // An empty policy changes nothing, so it always applies.
+  em_thread_policy policy = {};
+  em_thread_sched_set_policy(EM_THREAD_ROLE_NETWORK, &policy);
+  CHECK(em_thread_sched_apply(EM_THREAD_ROLE_NETWORK) == 0);
+  CHECK(em_thread_sched_get_thread(EM_THREAD_ROLE_NETWORK) != 0);
+  CHECK(em_thread_sched_get_thread(EM_THREAD_ROLE_CODEC) == 0);
+}
@@ -0,0 +1,161 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Loss, duplicate and reorder accounting for a stream of sequence numbers.
+ */
+
+#include "em_sequence_tracker.h"
+
+#include <string.h>
+
+#define WORD_COUNT (EM_SEQUENCE_TRACKER_WINDOW / 64)
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+
+static bool
+get_bit(const struct em_sequence_tracker *tracker, uint32_t i)
+{
+	return (tracker->window[i / 64] >> (i % 64)) & 1;
+}
+
+static void
+set_bit(struct em_sequence_tracker *tracker, uint32_t i)
+{
+	tracker->window[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static void
+count_dropped_out(struct em_sequence_tracker *tracker, bool arrived)
+{
+	if (arrived) {
+		tracker->loss_burst = 0;
+		return;
+	}
+
+	tracker->stats.lost++;
+	tracker->loss_burst++;
+	if (tracker->loss_burst > tracker->stats.max_loss_burst) {
+		tracker->stats.max_loss_burst = tracker->loss_burst;
+	}
+}
+
+//! Move the window @p distance sequence numbers ahead, counting what drops out of its old end.
+static void
+advance(struct em_sequence_tracker *tracker, uint64_t distance)
+{
+	// Oldest first, so bursts are counted in order.
+	uint32_t shifted = distance < EM_SEQUENCE_TRACKER_WINDOW ? (uint32_t)distance : EM_SEQUENCE_TRACKER_WINDOW;
+	for (uint32_t i = 0; i < shifted; i++) {
+		count_dropped_out(tracker, get_bit(tracker, EM_SEQUENCE_TRACKER_WINDOW - 1 - i));
+	}
+
+	// Never were in the window, a jump this far is one burst.
+	if (distance > shifted) {
+		uint64_t skipped = distance - shifted;
+		tracker->stats.lost += skipped;
+		tracker->loss_burst = (uint32_t)MIN(tracker->loss_burst + skipped, UINT32_MAX);
+		if (tracker->loss_burst > tracker->stats.max_loss_burst) {
+			tracker->stats.max_loss_burst = tracker->loss_burst;
+		}
+	}
+
+	if (shifted == EM_SEQUENCE_TRACKER_WINDOW) {
+		memset(tracker->window, 0, sizeof(tracker->window));
+		return;
+	}
+
+	uint32_t words = shifted / 64;
+	uint32_t bits = shifted % 64;
+	for (int32_t w = WORD_COUNT - 1; w >= 0; w--) {
+		uint64_t value = 0;
+		int32_t from = w - (int32_t)words;
+		if (from >= 0) {
+			value = tracker->window[from] << bits;
+			if (bits != 0 && from > 0) {
+				value |= tracker->window[from - 1] >> (64 - bits);
+			}
+		}
+		tracker->window[w] = value;
+	}
+}
+
+static void
+start(struct em_sequence_tracker *tracker, int64_t sequence)
+{
+	// Nothing before the first one is missing.
+	memset(tracker->window, 0xff, sizeof(tracker->window));
+	tracker->newest = sequence;
+	tracker->loss_burst = 0;
+	tracker->started = true;
+}
+
+
+/*
+ *
+ * Exported functions.
+ *
+ */
+
+void
+em_sequence_tracker_reset(struct em_sequence_tracker *tracker)
+{
+	memset(tracker, 0, sizeof(*tracker));
+}
+
+enum em_sequence_result
+em_sequence_tracker_add(struct em_sequence_tracker *tracker, int64_t sequence)
+{
+	if (!tracker->started) {
+		start(tracker, sequence);
+		tracker->stats.received++;
+		return EM_SEQUENCE_NEW;
+	}
+
+	if (sequence > tracker->newest) {
+		advance(tracker, (uint64_t)(sequence - tracker->newest));
+		tracker->newest = sequence;
+		set_bit(tracker, 0);
+		tracker->stats.received++;
+		return EM_SEQUENCE_NEW;
+	}
+
+	uint64_t behind = (uint64_t)(tracker->newest - sequence);
+	if (behind >= EM_SEQUENCE_TRACKER_WINDOW) {
+		// Nobody reorders by that much, the sender started over.
+		start(tracker, sequence);
+		tracker->stats.received++;
+		tracker->stats.restarts++;
+		return EM_SEQUENCE_RESTART;
+	}
+
+	if (get_bit(tracker, (uint32_t)behind)) {
+		tracker->stats.duplicates++;
+		return EM_SEQUENCE_DUPLICATE;
+	}
+
+	set_bit(tracker, (uint32_t)behind);
+	tracker->stats.received++;
+	tracker->stats.late++;
+	if (behind > tracker->stats.max_reorder_depth) {
+		tracker->stats.max_reorder_depth = (uint32_t)behind;
+	}
+	return EM_SEQUENCE_LATE;
+}
+
+void
+em_sequence_tracker_get_stats(const struct em_sequence_tracker *tracker, struct em_sequence_stats *out_stats)
+{
+	*out_stats = tracker->stats;
+
+	uint64_t pending = 0;
+	for (uint32_t w = 0; w < WORD_COUNT; w++) {
+		pending += (uint64_t)__builtin_popcountll(~tracker->window[w]);
+	}
+	out_stats->pending = tracker->started ? pending : 0;
+}
@@ -0,0 +1,93 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Loss, duplicate and reorder accounting for a stream of sequence numbers.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+//! How far behind the newest sequence number a late one still counts as reordered, in sequence numbers.
+#define EM_SEQUENCE_TRACKER_WINDOW 256
+
+//! What em_sequence_tracker_add() made of a sequence number.
+enum em_sequence_result
+{
+	//! Newer than anything before.
+	EM_SEQUENCE_NEW,
+	//! Missing until now, arrived after newer ones.
+	EM_SEQUENCE_LATE,
+	//! Seen before.
+	EM_SEQUENCE_DUPLICATE,
+	//! So far back that the stream must have restarted, counting begins again from it.
+	EM_SEQUENCE_RESTART,
+};
+
+/*!
+ * Totals since the tracker was reset.
+ *
+ * A sequence number only counts as lost once it left the window, until then it is pending and may still arrive late.
+ */
+struct em_sequence_stats
+{
+	uint64_t received;
+	uint64_t lost;
+	uint64_t pending;
+	uint64_t late;
+	uint64_t duplicates;
+	uint64_t restarts;
+	//! Most sequence numbers a late one arrived behind the newest.
+	uint32_t max_reorder_depth;
+	//! Most lost sequence numbers in a row.
+	uint32_t max_loss_burst;
+};
+
+/*!
+ * Tracks which of the last @ref EM_SEQUENCE_TRACKER_WINDOW sequence numbers arrived in a bitmap.
+ *
+ * Adding one is O(1) for streams in order and never allocates, so it can stay on in the streaming threads. Not
+ * thread safe, lock it if it is fed from several threads.
+ */
+struct em_sequence_tracker
+{
+	bool started;
+	int64_t newest;
+	//! Bit i says whether newest - i arrived.
+	uint64_t window[EM_SEQUENCE_TRACKER_WINDOW / 64];
+	//! Lost sequence numbers in a row at the old end of the window.
+	uint32_t loss_burst;
+
+	struct em_sequence_stats stats;
+};
+
+/*!
+ * Forget everything, the tracker starts from whichever sequence number comes next.
+ */
+void
+em_sequence_tracker_reset(struct em_sequence_tracker *tracker);
+
+/*!
+ * Account for the arrival of @p sequence.
+ */
+enum em_sequence_result
+em_sequence_tracker_add(struct em_sequence_tracker *tracker, int64_t sequence);
+
+/*!
+ * The totals so far, with the sequence numbers still missing in the window as pending.
+ */
+void
+em_sequence_tracker_get_stats(const struct em_sequence_tracker *tracker, struct em_sequence_stats *out_stats);
+
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
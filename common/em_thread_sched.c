@@ -0,0 +1,149 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  CPU affinity and scheduling of the threads on the path of a frame, set up in one place per process.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "em_thread_sched.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+static struct em_thread_policy policies[EM_THREAD_ROLE_COUNT];
+static atomic_int_least32_t threads[EM_THREAD_ROLE_COUNT];
+
+
+void
+em_thread_sched_set_policy(enum em_thread_role role, const struct em_thread_policy *policy)
+{
+	policies[role] = *policy;
+}
+
+int
+em_thread_sched_apply(enum em_thread_role role)
+{
+#ifdef __linux__
+	const struct em_thread_policy *policy = &policies[role];
+	// Per thread on Linux, setpriority with the process id would only reach the main thread.
+	pid_t tid = (pid_t)syscall(SYS_gettid);
+	int error = 0;
+
+	atomic_store(&threads[role], (int_least32_t)tid);
+
+	if (policy->cpu_mask != 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu = 0; cpu < 64; cpu++) {
+			if (policy->cpu_mask & ((uint64_t)1 << cpu)) {
+				CPU_SET(cpu, &set);
+			}
+		}
+		if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+			error = errno;
+		}
+	}
+
+	bool fifo = false;
+	if (policy->fifo_priority > 0) {
+		struct sched_param param = {.sched_priority = policy->fifo_priority};
+		int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		fifo = ret == 0;
+		if (ret != 0 && error == 0) {
+			error = ret;
+		}
+	}
+
+	if (!fifo && policy->nice != 0 && setpriority(PRIO_PROCESS, (id_t)tid, policy->nice) != 0 && error == 0) {
+		error = errno;
+	}
+
+	return error;
+#else
+	(void)role;
+	return ENOSYS;
+#endif
+}
+
+int32_t
+em_thread_sched_get_thread(enum em_thread_role role)
+{
+	return (int32_t)atomic_load(&threads[role]);
+}
+
+int32_t
+em_thread_sched_current_thread(void)
+{
+#ifdef __linux__
+	// Called per frame, the syscall only once per thread.
+	static _Thread_local int32_t tid;
+	if (tid == 0) {
+		tid = (int32_t)syscall(SYS_gettid);
+	}
+	return tid;
+#else
+	return 0;
+#endif
+}
+
+bool
+em_thread_sched_parse_cpus(const char *list, uint64_t *out_mask)
+{
+	uint64_t mask = 0;
+	const char *p = list;
+
+	while (*p != '\0') {
+		char *end;
+		long first = strtol(p, &end, 10);
+		if (end == p || first < 0 || first > 63) {
+			return false;
+		}
+		long last = first;
+		p = end;
+
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first || last > 63) {
+				return false;
+			}
+			p = end;
+		}
+
+		for (long cpu = first; cpu <= last; cpu++) {
+			mask |= (uint64_t)1 << cpu;
+		}
+
+		if (*p == ',') {
+			p++;
+			if (*p == '\0') {
+				return false;
+			}
+		} else if (*p != '\0') {
+			return false;
+		}
+	}
+
+	if (mask == 0) {
+		return false;
+	}
+
+	*out_mask = mask;
+	return true;
+}
@@ -0,0 +1,88 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  CPU affinity and scheduling of the threads on the path of a frame, set up in one place per process.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+//! What a thread does for the stream, the threads of a role share one policy.
+enum em_thread_role
+{
+	//! The compositor on the server, the render loop on the client.
+	EM_THREAD_ROLE_RENDER,
+	//! Readback, encoding and payloading on the server, depayloading and decoding on the client.
+	EM_THREAD_ROLE_CODEC,
+	//! Poses: the UpMessage thread on the server, the pose thread on the client.
+	EM_THREAD_ROLE_TRACKING,
+	//! Main loops, signaling and the WebRTC transport.
+	EM_THREAD_ROLE_NETWORK,
+
+	EM_THREAD_ROLE_COUNT,
+};
+
+/*!
+ * How to schedule the threads of a role. All zero leaves them as they were created.
+ */
+struct em_thread_policy
+{
+	//! Bit n allows CPU n, 0 for any.
+	uint64_t cpu_mask;
+	//! SCHED_FIFO priority, 0 for the normal scheduler.
+	int fifo_priority;
+	//! Nice level on the normal scheduler, also used when SCHED_FIFO is refused.
+	int nice;
+};
+
+/*!
+ * Set the policy of @p role, before any thread of it started. The threads
+ * read it without locking.
+ */
+void
+em_thread_sched_set_policy(enum em_thread_role role, const struct em_thread_policy *policy);
+
+/*!
+ * Apply the policy of @p role to the calling thread, and remember it as the
+ * latest thread of the role. What can be applied is, even if a part fails.
+ * SCHED_FIFO needs CAP_SYS_NICE or an rtprio limit, without it the thread
+ * gets the nice level instead.
+ *
+ * @return 0, or the errno of the first part that failed.
+ */
+int
+em_thread_sched_apply(enum em_thread_role role);
+
+/*!
+ * Kernel thread id of the thread that last applied @p role, 0 if none did.
+ */
+int32_t
+em_thread_sched_get_thread(enum em_thread_role role);
+
+/*!
+ * Kernel thread id of the calling thread, 0 where there are none.
+ */
+int32_t
+em_thread_sched_current_thread(void);
+
+/*!
+ * Parse a CPU list like "2-5,7" into a mask.
+ *
+ * @return false if it is malformed or names a CPU above 63.
+ */
+bool
+em_thread_sched_parse_cpus(const char *list, uint64_t *out_mask);
+
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
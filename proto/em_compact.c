@@ -0,0 +1,428 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Fixed layout encoding of the UpMessages sent every frame, next to their protobuf form.
+ *
+ * All fields are little endian, in this order, the flags say which are there:
+ *
+ *     magic u8, version u8, flags u16, up_message_id u32
+ *     tracking: sequence_idx u32, timestamp i48, poses 15 bytes each, velocities 6 bytes each
+ *     frame: frame_sequence_id u32, decode_complete, begin_frame, display and depay times i48 each
+ *
+ * A pose is the position as three i24 and the orientation as a smallest three quaternion: the index of the largest
+ * component in 2 bits, then the other three in 15 bits each, which leaves the top bit of the 48 unused.
+ */
+
+#include "em_compact.h"
+
+#include <math.h>
+#include <string.h>
+
+
+#define POSE_COUNT 7
+#define VELOCITY_COUNT 2
+#define FRAME_TIME_COUNT 4
+
+enum compact_flags
+{
+	FLAG_TRACKING = 1 << 0,
+	FLAG_FRAME = 1 << 1,
+	//! One bit per pose, in the order of tracking_poses().
+	FLAG_POSE_0 = 1 << 2,
+	//! One bit per velocity, linear then angular.
+	FLAG_VELOCITY_0 = FLAG_POSE_0 << POSE_COUNT,
+	FLAG_TIMESTAMP = FLAG_VELOCITY_0 << VELOCITY_COUNT,
+	//! One bit per time, in the order of frame_times().
+	FLAG_FRAME_TIME_0 = FLAG_TIMESTAMP << 1,
+};
+
+#define HEADER_SIZE 8
+#define POSE_SIZE 15
+#define VELOCITY_SIZE 6
+#define TIME_SIZE 6
+
+//! Tenths of a millimeter, about 840 meters either way in 24 bits.
+#define POSITION_SCALE 10000.0f
+#define POSITION_MAX ((1 << 23) - 1)
+
+//! Millimeters per second, or milliradians, 32 either way in 16 bits.
+#define VELOCITY_SCALE 1000.0f
+#define VELOCITY_MAX INT16_MAX
+
+//! The three smaller components of a unit quaternion are within plus minus one over the square root of two.
+#define QUAT_COMPONENT_MAX 0.70710678f
+#define QUAT_STEPS ((1 << 14) - 1)
+
+#define TIME_MIN (-((int64_t)1 << 47))
+#define TIME_MAX (((int64_t)1 << 47) - 1)
+
+
+struct pose_ref
+{
+	bool *has;
+	em_proto_Pose *pose;
+};
+
+struct velocity_ref
+{
+	bool *has;
+	em_proto_Vec3 *vec;
+};
+
+static void
+tracking_poses(em_proto_TrackingMessage *t, struct pose_ref out[POSE_COUNT])
+{
+	out[0] = (struct pose_ref){&t->has_P_localSpace_viewSpace, &t->P_localSpace_viewSpace};
+	out[1] = (struct pose_ref){&t->has_P_viewSpace_view0, &t->P_viewSpace_view0};
+	out[2] = (struct pose_ref){&t->has_P_viewSpace_view1, &t->P_viewSpace_view1};
+	out[3] = (struct pose_ref){&t->has_P_local_controller_grip_left, &t->P_local_controller_grip_left};
+	out[4] = (struct pose_ref){&t->has_controller_aim_left, &t->controller_aim_left};
+	out[5] = (struct pose_ref){&t->has_controller_grip_right, &t->controller_grip_right};
+	out[6] = (struct pose_ref){&t->has_controller_aim_right, &t->controller_aim_right};
+}
+
+static void
+tracking_velocities(em_proto_TrackingMessage *t, struct velocity_ref out[VELOCITY_COUNT])
+{
+	out[0] = (struct velocity_ref){&t->has_V_localSpace_viewSpace_linear, &t->V_localSpace_viewSpace_linear};
+	out[1] = (struct velocity_ref){&t->has_V_localSpace_viewSpace_angular, &t->V_localSpace_viewSpace_angular};
+}
+
+static void
+frame_times(em_proto_UpFrameMessage *f, int64_t *out[FRAME_TIME_COUNT])
+{
+	out[0] = &f->decode_complete_time;
+	out[1] = &f->begin_frame_time;
+	out[2] = &f->display_time;
+	out[3] = &f->depay_time;
+}
+
+
+/*
+ *
+ * Writing.
+ *
+ */
+
+struct writer
+{
+	uint8_t *buf;
+	size_t size;
+	size_t offset;
+	bool overflow;
+};
+
+static void
+put_uint(struct writer *w, uint64_t value, size_t bytes)
+{
+	if (w->offset + bytes > w->size) {
+		w->overflow = true;
+		return;
+	}
+	for (size_t i = 0; i < bytes; i++) {
+		w->buf[w->offset++] = (uint8_t)(value >> (8 * i));
+	}
+}
+
+static int32_t
+quantize(float value, float scale, int32_t max)
+{
+	float scaled = roundf(value * scale);
+	if (!(scaled > (float)-max)) {
+		// Also NaN.
+		return scaled < 0.0f ? -max : 0;
+	}
+	return scaled < (float)max ? (int32_t)scaled : max;
+}
+
+static void
+put_time(struct writer *w, int64_t time, int64_t epoch)
+{
+	int64_t us = (time - epoch) / 1000;
+	us = us < TIME_MIN ? TIME_MIN : us > TIME_MAX ? TIME_MAX : us;
+	put_uint(w, (uint64_t)us, TIME_SIZE);
+}
+
+static void
+put_quaternion(struct writer *w, const em_proto_Quaternion *q)
+{
+	float c[4] = {q->x, q->y, q->z, q->w};
+
+	float norm = sqrtf(c[0] * c[0] + c[1] * c[1] + c[2] * c[2] + c[3] * c[3]);
+	if (!(norm > 0.0f)) {
+		c[0] = c[1] = c[2] = 0.0f;
+		c[3] = norm = 1.0f;
+	}
+
+	uint32_t largest = 0;
+	for (uint32_t i = 1; i < 4; i++) {
+		if (fabsf(c[i]) > fabsf(c[largest])) {
+			largest = i;
+		}
+	}
+
+	// q and -q are the same rotation, flip so the dropped one is positive and can be recovered.
+	float sign = c[largest] < 0.0f ? -1.0f : 1.0f;
+
+	uint64_t packed = largest;
+	uint32_t shift = 2;
+	for (uint32_t i = 0; i < 4; i++) {
+		if (i == largest) {
+			continue;
+		}
+		float value = sign * c[i] / norm;
+		int32_t steps = quantize(value / QUAT_COMPONENT_MAX, (float)QUAT_STEPS, QUAT_STEPS);
+		packed |= (uint64_t)(steps + QUAT_STEPS) << shift;
+		shift += 15;
+	}
+	put_uint(w, packed, 6);
+}
+
+static void
+put_pose(struct writer *w, const em_proto_Pose *pose)
+{
+	put_uint(w, (uint32_t)quantize(pose->position.x, POSITION_SCALE, POSITION_MAX), 3);
+	put_uint(w, (uint32_t)quantize(pose->position.y, POSITION_SCALE, POSITION_MAX), 3);
+	put_uint(w, (uint32_t)quantize(pose->position.z, POSITION_SCALE, POSITION_MAX), 3);
+
+	if (pose->has_orientation) {
+		put_quaternion(w, &pose->orientation);
+	} else {
+		em_proto_Quaternion identity = {.w = 1.0f};
+		put_quaternion(w, &identity);
+	}
+}
+
+static void
+put_velocity(struct writer *w, const em_proto_Vec3 *vec)
+{
+	put_uint(w, (uint16_t)quantize(vec->x, VELOCITY_SCALE, VELOCITY_MAX), 2);
+	put_uint(w, (uint16_t)quantize(vec->y, VELOCITY_SCALE, VELOCITY_MAX), 2);
+	put_uint(w, (uint16_t)quantize(vec->z, VELOCITY_SCALE, VELOCITY_MAX), 2);
+}
+
+
+/*
+ *
+ * Reading.
+ *
+ */
+
+struct reader
+{
+	const uint8_t *buf;
+	size_t size;
+	size_t offset;
+	bool underflow;
+};
+
+static uint64_t
+get_uint(struct reader *r, size_t bytes)
+{
+	if (r->offset + bytes > r->size) {
+		r->underflow = true;
+		return 0;
+	}
+	uint64_t value = 0;
+	for (size_t i = 0; i < bytes; i++) {
+		value |= (uint64_t)r->buf[r->offset++] << (8 * i);
+	}
+	return value;
+}
+
+static int64_t
+get_int(struct reader *r, size_t bytes)
+{
+	uint64_t value = get_uint(r, bytes);
+	uint32_t unused = 64 - 8 * (uint32_t)bytes;
+	// Sign extend.
+	return (int64_t)(value << unused) >> unused;
+}
+
+static void
+get_quaternion(struct reader *r, em_proto_Quaternion *out_q)
+{
+	uint64_t packed = get_uint(r, 6);
+	uint32_t largest = (uint32_t)(packed & 3);
+
+	float c[4];
+	float sum = 0.0f;
+	uint32_t shift = 2;
+	for (uint32_t i = 0; i < 4; i++) {
+		if (i == largest) {
+			continue;
+		}
+		int32_t steps = (int32_t)((packed >> shift) & 0x7fff) - QUAT_STEPS;
+		c[i] = (float)steps / (float)QUAT_STEPS * QUAT_COMPONENT_MAX;
+		sum += c[i] * c[i];
+		shift += 15;
+	}
+	c[largest] = sum < 1.0f ? sqrtf(1.0f - sum) : 0.0f;
+
+	out_q->x = c[0];
+	out_q->y = c[1];
+	out_q->z = c[2];
+	out_q->w = c[3];
+}
+
+static void
+get_pose(struct reader *r, em_proto_Pose *out_pose)
+{
+	*out_pose = (em_proto_Pose)em_proto_Pose_init_default;
+	out_pose->has_position = true;
+	out_pose->position.x = (float)get_int(r, 3) / POSITION_SCALE;
+	out_pose->position.y = (float)get_int(r, 3) / POSITION_SCALE;
+	out_pose->position.z = (float)get_int(r, 3) / POSITION_SCALE;
+	out_pose->has_orientation = true;
+	get_quaternion(r, &out_pose->orientation);
+}
+
+static void
+get_velocity(struct reader *r, em_proto_Vec3 *out_vec)
+{
+	out_vec->x = (float)get_int(r, 2) / VELOCITY_SCALE;
+	out_vec->y = (float)get_int(r, 2) / VELOCITY_SCALE;
+	out_vec->z = (float)get_int(r, 2) / VELOCITY_SCALE;
+}
+
+
+/*
+ *
+ * Exported functions.
+ *
+ */
+
+size_t
+em_compact_encode_up_message(const em_proto_UpMessage *message, int64_t epoch, uint8_t *buf, size_t size)
+{
+	if (message->has_stream_stats || message->has_controllers || !(message->has_tracking || message->has_frame)) {
+		return 0;
+	}
+
+	// The refs point into a copy, the message itself stays const.
+	em_proto_UpMessage copy = *message;
+	uint32_t flags = 0;
+
+	struct pose_ref poses[POSE_COUNT];
+	struct velocity_ref velocities[VELOCITY_COUNT];
+	tracking_poses(&copy.tracking, poses);
+	tracking_velocities(&copy.tracking, velocities);
+	int64_t *times[FRAME_TIME_COUNT];
+	frame_times(&copy.frame, times);
+
+	if (copy.has_tracking) {
+		flags |= FLAG_TRACKING;
+		for (uint32_t i = 0; i < POSE_COUNT; i++) {
+			flags |= *poses[i].has ? (uint32_t)FLAG_POSE_0 << i : 0;
+		}
+		for (uint32_t i = 0; i < VELOCITY_COUNT; i++) {
+			flags |= *velocities[i].has ? (uint32_t)FLAG_VELOCITY_0 << i : 0;
+		}
+		flags |= copy.tracking.timestamp != 0 ? FLAG_TIMESTAMP : 0;
+	}
+	if (copy.has_frame) {
+		flags |= FLAG_FRAME;
+		for (uint32_t i = 0; i < FRAME_TIME_COUNT; i++) {
+			flags |= *times[i] != 0 ? (uint32_t)FLAG_FRAME_TIME_0 << i : 0;
+		}
+	}
+
+	struct writer w = {.buf = buf, .size = size};
+	put_uint(&w, EM_COMPACT_MAGIC, 1);
+	put_uint(&w, EM_COMPACT_VERSION, 1);
+	put_uint(&w, flags, 2);
+	put_uint(&w, (uint64_t)copy.up_message_id, 4);
+
+	if (flags & FLAG_TRACKING) {
+		put_uint(&w, (uint64_t)copy.tracking.sequence_idx, 4);
+		if (flags & FLAG_TIMESTAMP) {
+			put_time(&w, copy.tracking.timestamp, epoch);
+		}
+		for (uint32_t i = 0; i < POSE_COUNT; i++) {
+			if (flags & (FLAG_POSE_0 << i)) {
+				put_pose(&w, poses[i].pose);
+			}
+		}
+		for (uint32_t i = 0; i < VELOCITY_COUNT; i++) {
+			if (flags & (FLAG_VELOCITY_0 << i)) {
+				put_velocity(&w, velocities[i].vec);
+			}
+		}
+	}
+
+	if (flags & FLAG_FRAME) {
+		put_uint(&w, (uint64_t)copy.frame.frame_sequence_id, 4);
+		for (uint32_t i = 0; i < FRAME_TIME_COUNT; i++) {
+			if (flags & (FLAG_FRAME_TIME_0 << i)) {
+				put_time(&w, *times[i], epoch);
+			}
+		}
+	}
+
+	return w.overflow ? 0 : w.offset;
+}
+
+bool
+em_compact_is_compact(const uint8_t *buf, size_t size)
+{
+	return size > 0 && buf[0] == EM_COMPACT_MAGIC;
+}
+
+bool
+em_compact_decode_up_message(const uint8_t *buf, size_t size, int64_t epoch, em_proto_UpMessage *out_message)
+{
+	struct reader r = {.buf = buf, .size = size};
+	if (get_uint(&r, 1) != EM_COMPACT_MAGIC || get_uint(&r, 1) != EM_COMPACT_VERSION) {
+		return false;
+	}
+	uint32_t flags = (uint32_t)get_uint(&r, 2);
+
+	em_proto_UpMessage message = em_proto_UpMessage_init_default;
+	message.up_message_id = (int64_t)get_uint(&r, 4);
+
+	struct pose_ref poses[POSE_COUNT];
+	struct velocity_ref velocities[VELOCITY_COUNT];
+	tracking_poses(&message.tracking, poses);
+	tracking_velocities(&message.tracking, velocities);
+	int64_t *times[FRAME_TIME_COUNT];
+	frame_times(&message.frame, times);
+
+	if (flags & FLAG_TRACKING) {
+		message.has_tracking = true;
+		message.tracking.sequence_idx = (int64_t)get_uint(&r, 4);
+		if (flags & FLAG_TIMESTAMP) {
+			message.tracking.timestamp = epoch + get_int(&r, TIME_SIZE) * 1000;
+		}
+		for (uint32_t i = 0; i < POSE_COUNT; i++) {
+			if (flags & (FLAG_POSE_0 << i)) {
+				*poses[i].has = true;
+				get_pose(&r, poses[i].pose);
+			}
+		}
+		for (uint32_t i = 0; i < VELOCITY_COUNT; i++) {
+			if (flags & (FLAG_VELOCITY_0 << i)) {
+				*velocities[i].has = true;
+				get_velocity(&r, velocities[i].vec);
+			}
+		}
+	}
+
+	if (flags & FLAG_FRAME) {
+		message.has_frame = true;
+		message.frame.frame_sequence_id = (int64_t)get_uint(&r, 4);
+		for (uint32_t i = 0; i < FRAME_TIME_COUNT; i++) {
+			if (flags & (FLAG_FRAME_TIME_0 << i)) {
+				*times[i] = epoch + get_int(&r, TIME_SIZE) * 1000;
+			}
+		}
+	}
+
+	if (r.underflow) {
+		return false;
+	}
+	*out_message = message;
+	return true;
+}
@@ -0,0 +1,67 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Fixed layout encoding of the UpMessages sent every frame, next to their protobuf form.
+ */
+#pragma once
+
+#include "electricmaple.pb.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*!
+ * Version of the layout, the client uses it only once the server offered it.
+ *
+ * The server offers the newest version it reads in the "compact-version" member of its offer. The client answers
+ * with the version it will send and its epoch in "compact-epoch", or leaves both out to stay with protobuf.
+ */
+#define EM_COMPACT_VERSION 1
+
+/*!
+ * First byte of every compact message. A protobuf message can't start with it, wire type 7 does not exist, so both
+ * forms can share a data channel.
+ */
+#define EM_COMPACT_MAGIC 0x7f
+
+//! Enough for an UpMessage with every pose, velocity and time set.
+#define EM_COMPACT_UP_MESSAGE_MAX_SIZE 168
+
+/*!
+ * Encode the tracking and frame parts of @p message in @p buf.
+ *
+ * Poses are a smallest three quaternion in 48 bits and positions in tenths of a millimeter, times are in
+ * microseconds from @p epoch, the sequence numbers keep their lower 32 bits. Protobuf still carries anything else.
+ *
+ * @return bytes written, or 0 if the message has parts only protobuf carries or does not fit
+ */
+size_t
+em_compact_encode_up_message(const em_proto_UpMessage *message, int64_t epoch, uint8_t *buf, size_t size);
+
+/*!
+ * Whether @p buf holds a compact message rather than a protobuf one.
+ */
+bool
+em_compact_is_compact(const uint8_t *buf, size_t size);
+
+/*!
+ * Unpack a message written by em_compact_encode_up_message() with the same @p epoch.
+ *
+ * @return false if it is truncated or of a version we don't read
+ */
+bool
+em_compact_decode_up_message(const uint8_t *buf, size_t size, int64_t epoch, em_proto_UpMessage *out_message);
+
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
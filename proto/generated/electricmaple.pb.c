@@ -42,13 +42,31 @@ PB_BIND(em_proto_TouchControllerRight, em_proto_TouchControllerRight, AUTO)
 PB_BIND(em_proto_UpFrameMessage, em_proto_UpFrameMessage, AUTO)
 
 
+PB_BIND(em_proto_StreamStats, em_proto_StreamStats, AUTO)
+
+
+PB_BIND(em_proto_ControllerSample, em_proto_ControllerSample, AUTO)
+
+
+PB_BIND(em_proto_ControllerMessage, em_proto_ControllerMessage, 2)
+
+
 PB_BIND(em_proto_UpMessage, em_proto_UpMessage, 2)
 
 
-PB_BIND(em_proto_DownFrameDataMessage, em_proto_DownFrameDataMessage, AUTO)
+PB_BIND(em_proto_Foveation, em_proto_Foveation, AUTO)
+
+
+PB_BIND(em_proto_DepthInfo, em_proto_DepthInfo, AUTO)
+
+
+PB_BIND(em_proto_MotionField, em_proto_MotionField, 2)
+
+
+PB_BIND(em_proto_DownFrameDataMessage, em_proto_DownFrameDataMessage, 2)
 
 
-PB_BIND(em_proto_DownMessage, em_proto_DownMessage, AUTO)
+PB_BIND(em_proto_DownMessage, em_proto_DownMessage, 2)
 
 
 
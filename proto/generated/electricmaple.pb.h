@@ -119,16 +119,94 @@ typedef struct _em_proto_UpFrameMessage {
     int64_t decode_complete_time; /* nanoseconds, in client OpenXR time domain */
     int64_t begin_frame_time; /* nanoseconds, in client OpenXR time domain */
     int64_t display_time; /* nanoseconds, in client OpenXR time domain */
+    int64_t depay_time; /* nanoseconds, in client OpenXR time domain, last packet of the frame depayloaded */
 } em_proto_UpFrameMessage;
 
+/* Frames the client received, by frame_sequence_id, totals since the stream started. */
+typedef struct _em_proto_StreamStats {
+    uint64_t frames_received;
+    uint64_t frames_lost; /* Still missing after the next 256 frames arrived */
+    uint64_t frames_late;
+    uint64_t frames_duplicated;
+    uint32_t max_reorder_depth; /* In frames */
+    uint32_t max_loss_burst; /* In frames */
+} em_proto_StreamStats;
+
+/* A controller as sampled by the client, in the same space as P_localSpace_viewSpace. */
+typedef struct _em_proto_ControllerSample {
+    int64_t timestamp; /* nanoseconds, in client OpenXR time domain */
+    bool has_grip;
+    em_proto_Pose grip;
+    bool has_aim;
+    em_proto_Pose aim;
+    bool has_linear_velocity;
+    em_proto_Vec3 linear_velocity; /* Of the grip, not set if the runtime has none */
+    bool has_angular_velocity;
+    em_proto_Vec3 angular_velocity;
+} em_proto_ControllerSample;
+
+/* Newest samples of both controllers, oldest first, and the state of their inputs.
+ Sent unreliably, consecutive messages overlap in samples so losing one leaves no gap.
+ The sample counts are limited in electricmaple.options. */
+typedef struct _em_proto_ControllerMessage {
+    pb_size_t left_count;
+    em_proto_ControllerSample left[4]; /* Empty while the controller is not tracked */
+    pb_size_t right_count;
+    em_proto_ControllerSample right[4];
+    bool has_left_input;
+    em_proto_TouchControllerLeft left_input;
+    bool has_right_input;
+    em_proto_TouchControllerRight right_input;
+    int64_t input_time; /* nanoseconds, in client OpenXR time domain, when the inputs were synced */
+} em_proto_ControllerMessage;
+
 typedef struct _em_proto_UpMessage {
     int64_t up_message_id;
     bool has_tracking;
     em_proto_TrackingMessage tracking;
     bool has_frame;
     em_proto_UpFrameMessage frame;
+    bool has_stream_stats;
+    em_proto_StreamStats stream_stats; /* Sent about once a second */
+    bool has_controllers;
+    em_proto_ControllerMessage controllers;
 } em_proto_UpMessage;
 
+/* Axis aligned foveation warp, normalized per view and the same for both views.
+ Per axis the source area between source_min and source_max keeps the most
+ pixels and lands between encoded_min and encoded_max, the rest is squeezed. */
+typedef struct _em_proto_Foveation {
+    bool has_source_min;
+    em_proto_Vec2 source_min;
+    bool has_source_max;
+    em_proto_Vec2 source_max;
+    bool has_encoded_min;
+    em_proto_Vec2 encoded_min;
+    bool has_encoded_max;
+    em_proto_Vec2 encoded_max;
+} em_proto_Foveation;
+
+/* Depth of the views for positional reprojection, sent as luma in a band below the color.
+ The values are as rendered, the ranges are those of XrCompositionLayerDepthInfoKHR. */
+typedef struct _em_proto_DepthInfo {
+    float min_depth;
+    float max_depth;
+    float near_z;
+    float far_z;
+    float color_fraction; /* Fraction of the frame height holding color, depth is below */
+    bool valid; /* False if the layer had no depth, the band is there but holds nothing useful */
+} em_proto_DepthInfo;
+
+typedef PB_BYTES_ARRAY_T(512) em_proto_MotionField_vectors_t;
+/* Where the content of each block of the views moves in one frame, for extrapolating a late frame. */
+typedef struct _em_proto_MotionField {
+    uint32_t width; /* Blocks per view */
+    uint32_t height;
+    bool has_scale;
+    em_proto_Vec2 scale; /* Fraction of a view per vector unit, in the coordinates of the frame */
+    em_proto_MotionField_vectors_t vectors; /* Signed x and y byte per block, the rows of the left view then the right */
+} em_proto_MotionField;
+
 typedef struct _em_proto_DownFrameDataMessage {
     int64_t frame_sequence_id;
     bool has_P_localSpace_view0;
@@ -136,6 +214,15 @@ typedef struct _em_proto_DownFrameDataMessage {
     bool has_P_localSpace_view1;
     em_proto_Pose P_localSpace_view1; /* Right view */
     int64_t display_time; /* TODO fovs here */
+    bool has_foveation;
+    em_proto_Foveation foveation; /* Not set if the frame is not warped */
+    bool has_depth;
+    em_proto_DepthInfo depth; /* Not set if the frame has no depth band */
+    int64_t render_time; /* nanoseconds, in client OpenXR time domain, when the frame went to the encoder. 0 if unknown */
+    bool has_active_size;
+    em_proto_Vec2 active_size; /* Per view fraction of its color area holding it, from the top left. Not set if all of it */
+    bool has_motion;
+    em_proto_MotionField motion; /* Not set without a previous frame to compare with, or unless asked for */
 } em_proto_DownFrameDataMessage;
 
 typedef struct _em_proto_DownMessage {
@@ -181,9 +268,15 @@ extern "C" {
 #define em_proto_TouchControllerCommon_init_default {false, em_proto_InputThumbstick_init_default, false, em_proto_InputValueTouch_init_default, false, em_proto_InputValueTouch_init_default, 0}
 #define em_proto_TouchControllerLeft_init_default {false, em_proto_InputClickTouch_init_default, false, em_proto_InputClickTouch_init_default, false, em_proto_InputClickTouch_init_default, false, em_proto_TouchControllerCommon_init_default}
 #define em_proto_TouchControllerRight_init_default {false, em_proto_InputClickTouch_init_default, false, em_proto_InputClickTouch_init_default, false, em_proto_InputClickTouch_init_default, false, em_proto_TouchControllerCommon_init_default}
-#define em_proto_UpFrameMessage_init_default     {0, 0, 0, 0}
-#define em_proto_UpMessage_init_default          {0, false, em_proto_TrackingMessage_init_default, false, em_proto_UpFrameMessage_init_default}
-#define em_proto_DownFrameDataMessage_init_default {0, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, 0}
+#define em_proto_UpFrameMessage_init_default     {0, 0, 0, 0, 0}
+#define em_proto_StreamStats_init_default        {0, 0, 0, 0, 0, 0}
+#define em_proto_ControllerSample_init_default   {0, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Vec3_init_default, false, em_proto_Vec3_init_default}
+#define em_proto_ControllerMessage_init_default  {0, {em_proto_ControllerSample_init_default, em_proto_ControllerSample_init_default, em_proto_ControllerSample_init_default, em_proto_ControllerSample_init_default}, 0, {em_proto_ControllerSample_init_default, em_proto_ControllerSample_init_default, em_proto_ControllerSample_init_default, em_proto_ControllerSample_init_default}, false, em_proto_TouchControllerLeft_init_default, false, em_proto_TouchControllerRight_init_default, 0}
+#define em_proto_UpMessage_init_default          {0, false, em_proto_TrackingMessage_init_default, false, em_proto_UpFrameMessage_init_default, false, em_proto_StreamStats_init_default, false, em_proto_ControllerMessage_init_default}
+#define em_proto_Foveation_init_default          {false, em_proto_Vec2_init_default, false, em_proto_Vec2_init_default, false, em_proto_Vec2_init_default, false, em_proto_Vec2_init_default}
+#define em_proto_DepthInfo_init_default          {0, 0, 0, 0, 0, 0}
+#define em_proto_MotionField_init_default       {0, 0, false, em_proto_Vec2_init_default, {0, {0}}}
+#define em_proto_DownFrameDataMessage_init_default {0, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, 0, false, em_proto_Foveation_init_default, false, em_proto_DepthInfo_init_default, 0, false, em_proto_Vec2_init_default, false, em_proto_MotionField_init_default}
 #define em_proto_DownMessage_init_default        {false, em_proto_DownFrameDataMessage_init_default}
 #define em_proto_Quaternion_init_zero            {0, 0, 0, 0}
 #define em_proto_Vec3_init_zero                  {0, 0, 0}
@@ -196,9 +289,15 @@ extern "C" {
 #define em_proto_TouchControllerCommon_init_zero {false, em_proto_InputThumbstick_init_zero, false, em_proto_InputValueTouch_init_zero, false, em_proto_InputValueTouch_init_zero, 0}
 #define em_proto_TouchControllerLeft_init_zero   {false, em_proto_InputClickTouch_init_zero, false, em_proto_InputClickTouch_init_zero, false, em_proto_InputClickTouch_init_zero, false, em_proto_TouchControllerCommon_init_zero}
 #define em_proto_TouchControllerRight_init_zero  {false, em_proto_InputClickTouch_init_zero, false, em_proto_InputClickTouch_init_zero, false, em_proto_InputClickTouch_init_zero, false, em_proto_TouchControllerCommon_init_zero}
-#define em_proto_UpFrameMessage_init_zero        {0, 0, 0, 0}
-#define em_proto_UpMessage_init_zero             {0, false, em_proto_TrackingMessage_init_zero, false, em_proto_UpFrameMessage_init_zero}
-#define em_proto_DownFrameDataMessage_init_zero  {0, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, 0}
+#define em_proto_UpFrameMessage_init_zero        {0, 0, 0, 0, 0}
+#define em_proto_StreamStats_init_zero           {0, 0, 0, 0, 0, 0}
+#define em_proto_ControllerSample_init_zero      {0, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Vec3_init_zero, false, em_proto_Vec3_init_zero}
+#define em_proto_ControllerMessage_init_zero     {0, {em_proto_ControllerSample_init_zero, em_proto_ControllerSample_init_zero, em_proto_ControllerSample_init_zero, em_proto_ControllerSample_init_zero}, 0, {em_proto_ControllerSample_init_zero, em_proto_ControllerSample_init_zero, em_proto_ControllerSample_init_zero, em_proto_ControllerSample_init_zero}, false, em_proto_TouchControllerLeft_init_zero, false, em_proto_TouchControllerRight_init_zero, 0}
+#define em_proto_UpMessage_init_zero             {0, false, em_proto_TrackingMessage_init_zero, false, em_proto_UpFrameMessage_init_zero, false, em_proto_StreamStats_init_zero, false, em_proto_ControllerMessage_init_zero}
+#define em_proto_Foveation_init_zero             {false, em_proto_Vec2_init_zero, false, em_proto_Vec2_init_zero, false, em_proto_Vec2_init_zero, false, em_proto_Vec2_init_zero}
+#define em_proto_DepthInfo_init_zero             {0, 0, 0, 0, 0, 0}
+#define em_proto_MotionField_init_zero          {0, 0, false, em_proto_Vec2_init_zero, {0, {0}}}
+#define em_proto_DownFrameDataMessage_init_zero  {0, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, 0, false, em_proto_Foveation_init_zero, false, em_proto_DepthInfo_init_zero, 0, false, em_proto_Vec2_init_zero, false, em_proto_MotionField_init_zero}
 #define em_proto_DownMessage_init_zero           {false, em_proto_DownFrameDataMessage_init_zero}
 
 /* Field tags (for use in manual encoding/decoding) */
@@ -247,13 +346,51 @@ extern "C" {
 #define em_proto_UpFrameMessage_decode_complete_time_tag 2
 #define em_proto_UpFrameMessage_begin_frame_time_tag 3
 #define em_proto_UpFrameMessage_display_time_tag 4
+#define em_proto_UpFrameMessage_depay_time_tag   5
+#define em_proto_StreamStats_frames_received_tag 1
+#define em_proto_StreamStats_frames_lost_tag     2
+#define em_proto_StreamStats_frames_late_tag     3
+#define em_proto_StreamStats_frames_duplicated_tag 4
+#define em_proto_StreamStats_max_reorder_depth_tag 5
+#define em_proto_StreamStats_max_loss_burst_tag  6
+#define em_proto_ControllerSample_timestamp_tag  1
+#define em_proto_ControllerSample_grip_tag       2
+#define em_proto_ControllerSample_aim_tag        3
+#define em_proto_ControllerSample_linear_velocity_tag 4
+#define em_proto_ControllerSample_angular_velocity_tag 5
+#define em_proto_ControllerMessage_left_tag      1
+#define em_proto_ControllerMessage_right_tag     2
+#define em_proto_ControllerMessage_left_input_tag 3
+#define em_proto_ControllerMessage_right_input_tag 4
+#define em_proto_ControllerMessage_input_time_tag 5
 #define em_proto_UpMessage_up_message_id_tag     1
 #define em_proto_UpMessage_tracking_tag          2
 #define em_proto_UpMessage_frame_tag             3
+#define em_proto_UpMessage_stream_stats_tag      4
+#define em_proto_UpMessage_controllers_tag       5
+#define em_proto_Foveation_source_min_tag        1
+#define em_proto_Foveation_source_max_tag        2
+#define em_proto_Foveation_encoded_min_tag       3
+#define em_proto_Foveation_encoded_max_tag       4
+#define em_proto_DepthInfo_min_depth_tag         1
+#define em_proto_DepthInfo_max_depth_tag         2
+#define em_proto_DepthInfo_near_z_tag            3
+#define em_proto_DepthInfo_far_z_tag             4
+#define em_proto_DepthInfo_color_fraction_tag    5
+#define em_proto_DepthInfo_valid_tag             6
+#define em_proto_MotionField_width_tag           1
+#define em_proto_MotionField_height_tag          2
+#define em_proto_MotionField_scale_tag           3
+#define em_proto_MotionField_vectors_tag         4
 #define em_proto_DownFrameDataMessage_frame_sequence_id_tag 1
 #define em_proto_DownFrameDataMessage_P_localSpace_view0_tag 2
 #define em_proto_DownFrameDataMessage_P_localSpace_view1_tag 3
 #define em_proto_DownFrameDataMessage_display_time_tag 4
+#define em_proto_DownFrameDataMessage_foveation_tag 5
+#define em_proto_DownFrameDataMessage_depth_tag  6
+#define em_proto_DownFrameDataMessage_render_time_tag 7
+#define em_proto_DownFrameDataMessage_active_size_tag 8
+#define em_proto_DownFrameDataMessage_motion_tag 9
 #define em_proto_DownMessage_frame_data_tag      1
 
 /* Struct field encoding specification for nanopb */
@@ -369,28 +506,109 @@ X(a_, STATIC,   OPTIONAL, MESSAGE,  common,            4)
 X(a, STATIC,   SINGULAR, INT64,    frame_sequence_id,   1) \
 X(a, STATIC,   SINGULAR, INT64,    decode_complete_time,   2) \
 X(a, STATIC,   SINGULAR, INT64,    begin_frame_time,   3) \
-X(a, STATIC,   SINGULAR, INT64,    display_time,      4)
+X(a, STATIC,   SINGULAR, INT64,    display_time,      4) \
+X(a, STATIC,   SINGULAR, INT64,    depay_time,        5)
 #define em_proto_UpFrameMessage_CALLBACK NULL
 #define em_proto_UpFrameMessage_DEFAULT NULL
 
+#define em_proto_StreamStats_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, UINT64,   frames_received,   1) \
+X(a, STATIC,   SINGULAR, UINT64,   frames_lost,       2) \
+X(a, STATIC,   SINGULAR, UINT64,   frames_late,       3) \
+X(a, STATIC,   SINGULAR, UINT64,   frames_duplicated,   4) \
+X(a, STATIC,   SINGULAR, UINT32,   max_reorder_depth,   5) \
+X(a, STATIC,   SINGULAR, UINT32,   max_loss_burst,    6)
+#define em_proto_StreamStats_CALLBACK NULL
+#define em_proto_StreamStats_DEFAULT NULL
+
+#define em_proto_ControllerSample_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, INT64,    timestamp,         1) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  grip,              2) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  aim,               3) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  linear_velocity,   4) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  angular_velocity,   5)
+#define em_proto_ControllerSample_CALLBACK NULL
+#define em_proto_ControllerSample_DEFAULT NULL
+#define em_proto_ControllerSample_grip_MSGTYPE em_proto_Pose
+#define em_proto_ControllerSample_aim_MSGTYPE em_proto_Pose
+#define em_proto_ControllerSample_linear_velocity_MSGTYPE em_proto_Vec3
+#define em_proto_ControllerSample_angular_velocity_MSGTYPE em_proto_Vec3
+
+#define em_proto_ControllerMessage_FIELDLIST(X, a) \
+X(a, STATIC,   REPEATED, MESSAGE,  left,              1) \
+X(a, STATIC,   REPEATED, MESSAGE,  right,             2) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  left_input,        3) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  right_input,       4) \
+X(a, STATIC,   SINGULAR, INT64,    input_time,        5)
+#define em_proto_ControllerMessage_CALLBACK NULL
+#define em_proto_ControllerMessage_DEFAULT NULL
+#define em_proto_ControllerMessage_left_MSGTYPE em_proto_ControllerSample
+#define em_proto_ControllerMessage_right_MSGTYPE em_proto_ControllerSample
+#define em_proto_ControllerMessage_left_input_MSGTYPE em_proto_TouchControllerLeft
+#define em_proto_ControllerMessage_right_input_MSGTYPE em_proto_TouchControllerRight
+
 #define em_proto_UpMessage_FIELDLIST(X, a) \
 X(a, STATIC,   SINGULAR, INT64,    up_message_id,     1) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  tracking,          2) \
-X(a, STATIC,   OPTIONAL, MESSAGE,  frame,             3)
+X(a, STATIC,   OPTIONAL, MESSAGE,  frame,             3) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  stream_stats,      4) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  controllers,       5)
 #define em_proto_UpMessage_CALLBACK NULL
 #define em_proto_UpMessage_DEFAULT NULL
 #define em_proto_UpMessage_tracking_MSGTYPE em_proto_TrackingMessage
 #define em_proto_UpMessage_frame_MSGTYPE em_proto_UpFrameMessage
+#define em_proto_UpMessage_stream_stats_MSGTYPE em_proto_StreamStats
+#define em_proto_UpMessage_controllers_MSGTYPE em_proto_ControllerMessage
+
+#define em_proto_Foveation_FIELDLIST(X, a) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  source_min,        1) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  source_max,        2) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  encoded_min,       3) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  encoded_max,       4)
+#define em_proto_Foveation_CALLBACK NULL
+#define em_proto_Foveation_DEFAULT NULL
+#define em_proto_Foveation_source_min_MSGTYPE em_proto_Vec2
+#define em_proto_Foveation_source_max_MSGTYPE em_proto_Vec2
+#define em_proto_Foveation_encoded_min_MSGTYPE em_proto_Vec2
+#define em_proto_Foveation_encoded_max_MSGTYPE em_proto_Vec2
+
+#define em_proto_DepthInfo_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, FLOAT,    min_depth,         1) \
+X(a, STATIC,   SINGULAR, FLOAT,    max_depth,         2) \
+X(a, STATIC,   SINGULAR, FLOAT,    near_z,            3) \
+X(a, STATIC,   SINGULAR, FLOAT,    far_z,             4) \
+X(a, STATIC,   SINGULAR, FLOAT,    color_fraction,    5) \
+X(a, STATIC,   SINGULAR, BOOL,     valid,             6)
+#define em_proto_DepthInfo_CALLBACK NULL
+#define em_proto_DepthInfo_DEFAULT NULL
+
+#define em_proto_MotionField_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, UINT32,   width,             1) \
+X(a, STATIC,   SINGULAR, UINT32,   height,            2) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  scale,             3) \
+X(a, STATIC,   SINGULAR, BYTES,    vectors,           4)
+#define em_proto_MotionField_CALLBACK NULL
+#define em_proto_MotionField_DEFAULT NULL
+#define em_proto_MotionField_scale_MSGTYPE em_proto_Vec2
 
 #define em_proto_DownFrameDataMessage_FIELDLIST(X, a) \
 X(a, STATIC,   SINGULAR, INT64,    frame_sequence_id,   1) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  P_localSpace_view0,   2) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  P_localSpace_view1,   3) \
-X(a, STATIC,   SINGULAR, INT64,    display_time,      4)
+X(a, STATIC,   SINGULAR, INT64,    display_time,      4) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  foveation,         5) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  depth,             6) \
+X(a, STATIC,   SINGULAR, INT64,    render_time,       7) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  active_size,       8) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  motion,            9)
 #define em_proto_DownFrameDataMessage_CALLBACK NULL
 #define em_proto_DownFrameDataMessage_DEFAULT NULL
 #define em_proto_DownFrameDataMessage_P_localSpace_view0_MSGTYPE em_proto_Pose
 #define em_proto_DownFrameDataMessage_P_localSpace_view1_MSGTYPE em_proto_Pose
+#define em_proto_DownFrameDataMessage_foveation_MSGTYPE em_proto_Foveation
+#define em_proto_DownFrameDataMessage_depth_MSGTYPE em_proto_DepthInfo
+#define em_proto_DownFrameDataMessage_active_size_MSGTYPE em_proto_Vec2
+#define em_proto_DownFrameDataMessage_motion_MSGTYPE em_proto_MotionField
 
 #define em_proto_DownMessage_FIELDLIST(X, a) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  frame_data,        1)
@@ -410,7 +628,13 @@ extern const pb_msgdesc_t em_proto_TouchControllerCommon_msg;
 extern const pb_msgdesc_t em_proto_TouchControllerLeft_msg;
 extern const pb_msgdesc_t em_proto_TouchControllerRight_msg;
 extern const pb_msgdesc_t em_proto_UpFrameMessage_msg;
+extern const pb_msgdesc_t em_proto_StreamStats_msg;
+extern const pb_msgdesc_t em_proto_ControllerSample_msg;
+extern const pb_msgdesc_t em_proto_ControllerMessage_msg;
 extern const pb_msgdesc_t em_proto_UpMessage_msg;
+extern const pb_msgdesc_t em_proto_Foveation_msg;
+extern const pb_msgdesc_t em_proto_DepthInfo_msg;
+extern const pb_msgdesc_t em_proto_MotionField_msg;
 extern const pb_msgdesc_t em_proto_DownFrameDataMessage_msg;
 extern const pb_msgdesc_t em_proto_DownMessage_msg;
 
@@ -427,24 +651,36 @@ extern const pb_msgdesc_t em_proto_DownMessage_msg;
 #define em_proto_TouchControllerLeft_fields &em_proto_TouchControllerLeft_msg
 #define em_proto_TouchControllerRight_fields &em_proto_TouchControllerRight_msg
 #define em_proto_UpFrameMessage_fields &em_proto_UpFrameMessage_msg
+#define em_proto_StreamStats_fields &em_proto_StreamStats_msg
+#define em_proto_ControllerSample_fields &em_proto_ControllerSample_msg
+#define em_proto_ControllerMessage_fields &em_proto_ControllerMessage_msg
 #define em_proto_UpMessage_fields &em_proto_UpMessage_msg
+#define em_proto_Foveation_fields &em_proto_Foveation_msg
+#define em_proto_DepthInfo_fields &em_proto_DepthInfo_msg
+#define em_proto_MotionField_fields &em_proto_MotionField_msg
 #define em_proto_DownFrameDataMessage_fields &em_proto_DownFrameDataMessage_msg
 #define em_proto_DownMessage_fields &em_proto_DownMessage_msg
 
 /* Maximum encoded size of messages (where known) */
-#define em_proto_DownFrameDataMessage_size       104
-#define em_proto_DownMessage_size                106
+#define em_proto_ControllerMessage_size          1163
+#define em_proto_ControllerSample_size           127
+#define em_proto_DepthInfo_size                  27
+#define em_proto_DownFrameDataMessage_size       748
+#define em_proto_DownMessage_size                751
+#define em_proto_Foveation_size                  48
 #define em_proto_InputClickTouch_size            4
 #define em_proto_InputThumbstick_size            16
 #define em_proto_InputValueTouch_size            7
+#define em_proto_MotionField_size                539
 #define em_proto_Pose_size                       39
 #define em_proto_Quaternion_size                 20
+#define em_proto_StreamStats_size                56
 #define em_proto_TouchControllerCommon_size      38
 #define em_proto_TouchControllerLeft_size        58
 #define em_proto_TouchControllerRight_size       58
 #define em_proto_TrackingMessage_size            343
-#define em_proto_UpFrameMessage_size             44
-#define em_proto_UpMessage_size                  403
+#define em_proto_UpFrameMessage_size             55
+#define em_proto_UpMessage_size                  1638
 #define em_proto_Vec2_size                       10
 #define em_proto_Vec3_size                       15
 
@@ -10,66 +10,122 @@
  */
 
 #include "ems_callbacks.h"
-#include <cstddef>
-#include <type_traits>
-
-#include "util/u_generic_callbacks.hpp"
 
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Callback
+{
+	ems_callbacks_func_t func;
+	uint32_t event_mask;
+	void *userdata;
+};
+
+//! Never changed once published, add and reset publish a new one.
+using CallbackList = std::vector<Callback>;
+
+} // namespace
 
+/*!
+ * Callers only load the current list, writers swap it and wait out the calls
+ * that may still be using the old one before freeing it.
+ *
+ * The calls count themselves in one of two counters picked by the epoch. After
+ * swapping, a writer waits for each counter to drain in turn, flipping the
+ * epoch first so new calls count in the other one and a steady stream of them
+ * can not hold it up.
+ */
 struct ems_callbacks
 {
-	std::mutex mutex;
-	xrt::auxiliary::util::GenericCallbacks<ems_callbacks_func_t, enum ems_callbacks_event> callbacks_collection;
+	//! Serializes add and reset, @ref ems_callbacks_call never takes it.
+	std::mutex writer_mutex;
+
+	//! Null when there are no callbacks.
+	std::atomic<const CallbackList *> list{nullptr};
+
+	std::atomic<uint32_t> epoch{0};
+	std::atomic<uint32_t> calls[2]{{0}, {0}};
 };
 
+/*!
+ * Swap in @p next and free the old list once no call uses it. Needs the writer mutex.
+ */
+static void
+publish(struct ems_callbacks *callbacks, const CallbackList *next)
+{
+	const CallbackList *prev = callbacks->list.exchange(next);
+
+	// A call may have picked its counter before an earlier flip, so both have to drain.
+	for (int i = 0; i < 2; i++) {
+		uint32_t old_epoch = callbacks->epoch.fetch_add(1);
+		while (callbacks->calls[old_epoch & 1].load() != 0) {
+			std::this_thread::yield();
+		}
+	}
+
+	delete prev;
+}
+
 struct ems_callbacks *
 ems_callbacks_create()
 {
-	// auto ret = std::make_unique<ems_callbacks>();
-
-	// return ret.release();
 	return new ems_callbacks;
 }
 
 void
 ems_callbacks_destroy(struct ems_callbacks **ptr_callbacks)
 {
-	if (!ptr_callbacks) {
+	if (!ptr_callbacks || !*ptr_callbacks) {
 		return;
 	}
 	std::unique_ptr<ems_callbacks> callbacks(*ptr_callbacks);
-	// take the lock to wait for anybody else who might be in the lock.
-	std::unique_lock<std::mutex> lock(callbacks->mutex);
-	lock.unlock();
-
 	*ptr_callbacks = nullptr;
-	callbacks.reset();
+
+	// Waits for anybody still calling.
+	std::unique_lock<std::mutex> lock(callbacks->writer_mutex);
+	publish(callbacks.get(), nullptr);
 }
 
 void
 ems_callbacks_add(struct ems_callbacks *callbacks, uint32_t event_mask, ems_callbacks_func_t func, void *userdata)
 {
-	std::unique_lock<std::mutex> lock(callbacks->mutex);
-	callbacks->callbacks_collection.addCallback(func, event_mask, userdata);
+	std::unique_lock<std::mutex> lock(callbacks->writer_mutex);
+
+	const CallbackList *current = callbacks->list.load();
+	auto next = current ? std::make_unique<CallbackList>(*current) : std::make_unique<CallbackList>();
+	next->push_back(Callback{func, event_mask, userdata});
+
+	publish(callbacks, next.release());
 }
 
 void
 ems_callbacks_reset(struct ems_callbacks *callbacks)
 {
-	std::unique_lock<std::mutex> lock(callbacks->mutex);
-	callbacks->callbacks_collection = {};
+	std::unique_lock<std::mutex> lock(callbacks->writer_mutex);
+	publish(callbacks, nullptr);
 }
 
 void
 ems_callbacks_call(struct ems_callbacks *callbacks, enum ems_callbacks_event event, const em_proto_UpMessage *message)
 {
-	std::unique_lock<std::mutex> lock(callbacks->mutex);
-	auto invoker = [=](enum ems_callbacks_event ev, ems_callbacks_func_t callback, void *userdata) {
-		callback(ev, message, userdata);
-		return false; // do not remove
-	};
-	callbacks->callbacks_collection.invokeCallbacks(event, invoker);
+	// Counted before loading the list, so a writer that swapped it either sees us or we see its list.
+	std::atomic<uint32_t> &calls = callbacks->calls[callbacks->epoch.load() & 1];
+	calls.fetch_add(1);
+
+	const CallbackList *list = callbacks->list.load();
+	if (list != nullptr) {
+		for (const Callback &callback : *list) {
+			if ((callback.event_mask & event) != 0) {
+				callback.func(event, message, callback.userdata);
+			}
+		}
+	}
+
+	calls.fetch_sub(1);
 }
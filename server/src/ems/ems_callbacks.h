@@ -25,6 +25,7 @@ enum ems_callbacks_event
 {
 	EMS_CALLBACKS_EVENT_TRACKING = 1u << 0u,
 	EMS_CALLBACKS_EVENT_CONTROLLER = 1u << 1u,
+	EMS_CALLBACKS_EVENT_FRAME = 1u << 2u,
 };
 
 /// Callback function type
@@ -49,6 +50,8 @@ ems_callbacks_destroy(struct ems_callbacks **ptr_callbacks);
 
 /// Add a callback to the collection.
 ///
+/// Copies the collection, so keep it to setup. Must not be called from a callback.
+///
 /// @param callbacks self
 /// @param event_mask Bitmask of @ref ems_callbacks_event indicating which events to be called on.
 /// @param func Function to call
@@ -60,6 +63,8 @@ ems_callbacks_add(struct ems_callbacks *callbacks, uint32_t event_mask, ems_call
 
 /// Call all callbacks that are interested in @p event
 ///
+/// Takes no lock, so calls never wait for each other or for add and reset.
+///
 /// @param callbacks self
 /// @param event The enum @ref ems_callbacks_event describing this event
 /// @param message The decoded message. We pass yours, we do not copy it!
@@ -70,7 +75,8 @@ ems_callbacks_call(struct ems_callbacks *callbacks, enum ems_callbacks_event eve
 
 /// Clear all callbacks.
 ///
-/// For use prior to starting to destroy things that may have registered callbacks.
+/// For use prior to starting to destroy things that may have registered callbacks,
+/// returns once no call is still in them. Must not be called from a callback.
 ///
 /// @param callbacks self
 ///
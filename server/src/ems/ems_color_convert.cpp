@@ -0,0 +1,1027 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  GPU side RGBA to NV12 conversion for the remote rendering compositor.
+ * @ingroup comp_ems
+ */
+
+#include "ems_color_convert.h"
+#include "ems_pipeline_cache.h"
+
+#include "gst/ems_gstreamer_src.h"
+
+#include "os/os_threading.h"
+
+#include "math/m_api.h"
+
+#include "vk/vk_cmd_pool.h"
+
+#include "util/u_misc.h"
+#include "util/u_logging.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shaders/rgba_to_nv12.comp.h"
+
+
+/*
+ *
+ * Structs.
+ *
+ */
+
+/*!
+ * Must match the push constant block in rgba_to_nv12.comp.
+ */
+struct ems_color_convert_params
+{
+	float source_rect[2][4];
+	int32_t dst_size[2];
+	int32_t srgb[2];
+	float foveation_source[4];
+	float foveation_encoded[4];
+	float depth_rect[2][4];
+	int32_t color_height;
+	int32_t padding;
+	int32_t active_size[2];
+};
+
+// The smallest push constant limit there is.
+static_assert(sizeof(struct ems_color_convert_params) <= 128, "Push constants too large");
+
+/*!
+ * Must match the Layer struct in rgba_to_nv12.comp, std140.
+ */
+struct ems_color_convert_layer_data
+{
+	struct xrt_matrix_4x4 from_view[2];
+	float rect[4];
+	float shape[4];
+	int32_t info[4];
+};
+
+/*!
+ * Must match the Layers uniform block in rgba_to_nv12.comp, std140.
+ */
+struct ems_color_convert_layers
+{
+	float fov_tan[2][4];
+	int32_t count;
+	int32_t padding[3];
+	struct ems_color_convert_layer_data layers[EMS_COLOR_CONVERT_MAX_LAYERS];
+};
+
+/*!
+ * Everything a recording of the conversion depends on besides the frame, zeroed before it is filled in so two
+ * compare with memcmp.
+ */
+struct ems_color_convert_inputs
+{
+	VkDescriptorImageInfo images[2];
+	VkDescriptorImageInfo depths[2];
+	VkDescriptorImageInfo layers[EMS_COLOR_CONVERT_MAX_LAYERS];
+	struct ems_color_convert_params params;
+};
+
+/*!
+ * A command buffer converting into one frame from one set of inputs, kept to be submitted again.
+ */
+struct ems_color_convert_recording
+{
+	//! With the views of @ref inputs, bound by @ref cmd.
+	VkDescriptorSet descriptor_set;
+
+	//! VK_NULL_HANDLE until first recorded.
+	VkCommandBuffer cmd;
+
+	bool valid;
+	uint64_t generation;
+	uint64_t last_used;
+
+	struct ems_color_convert_inputs inputs;
+};
+
+// Flags in ems_color_convert_layer_data::info[2], must match rgba_to_nv12.comp.
+#define EMS_COLOR_CONVERT_LAYER_FLAG_BLEND_ALPHA (1)
+#define EMS_COLOR_CONVERT_LAYER_FLAG_UNPREMULTIPLIED (2)
+
+struct ems_color_convert_frame
+{
+	struct xrt_frame base;
+
+	struct ems_color_convert *cc;
+
+	VkBuffer buffer;
+	VkDeviceMemory memory;
+
+	//! Descriptor set writing into this frame's buffer.
+	VkDescriptorSet descriptor_set;
+
+	//! See @ref ems_color_convert_get_recording, each with a descriptor set of its own.
+	struct ems_color_convert_recording recordings[EMS_COLOR_CONVERT_RECORDINGS];
+
+	//! Host visible uniform buffer with the layers of this frame, always mapped.
+	VkBuffer layers_buffer;
+	VkDeviceMemory layers_memory;
+	struct ems_color_convert_layers *layers;
+
+	//! Exported memory, -1 when the frame is host visible.
+	int dmabuf_fd;
+
+	//! Protected by ems_color_convert::mutex.
+	bool in_use;
+};
+
+struct ems_color_convert
+{
+	struct vk_bundle *vk;
+
+	uint32_t width;
+	uint32_t height;
+	VkDeviceSize size;
+
+	//! Frames are exported device memory rather than mapped host memory.
+	bool export_dmabuf;
+
+	VkDescriptorSetLayout descriptor_set_layout;
+	VkPipelineLayout pipeline_layout;
+	VkPipeline pipeline;
+	VkDescriptorPool descriptor_pool;
+
+	//! The recordings are allocated from it and re-recorded in place.
+	struct vk_cmd_pool cmd_pool;
+	bool have_cmd_pool;
+	//! Ages the recordings, the least recently used one is recorded over.
+	uint64_t recording_uses;
+
+	struct os_mutex mutex;
+
+	struct ems_color_convert_frame frames[EMS_COLOR_CONVERT_FRAME_COUNT];
+};
+
+
+/*
+ *
+ * Helpers.
+ *
+ */
+
+static void
+frame_destroy(struct xrt_frame *xf)
+{
+	struct ems_color_convert_frame *f = container_of(xf, struct ems_color_convert_frame, base);
+
+	// Last reference dropped, the frame can be reused.
+	os_mutex_lock(&f->cc->mutex);
+	f->in_use = false;
+	os_mutex_unlock(&f->cc->mutex);
+}
+
+static VkResult
+create_pipeline(struct vk_bundle *vk, struct ems_color_convert *cc)
+{
+	VkResult ret;
+
+	VkDescriptorSetLayoutBinding bindings[5] = {};
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[0].descriptorCount = 2;
+	bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[1].binding = 1;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	bindings[1].descriptorCount = 1;
+	bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[2].binding = 2;
+	bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[2].descriptorCount = 2;
+	bindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[3].binding = 3;
+	bindings[3].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[3].descriptorCount = EMS_COLOR_CONVERT_MAX_LAYERS;
+	bindings[3].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[4].binding = 4;
+	bindings[4].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	bindings[4].descriptorCount = 1;
+	bindings[4].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+	VkDescriptorSetLayoutCreateInfo set_layout_info = {};
+	set_layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	set_layout_info.bindingCount = ARRAY_SIZE(bindings);
+	set_layout_info.pBindings = bindings;
+
+	ret = vk->vkCreateDescriptorSetLayout(vk->device, &set_layout_info, NULL, &cc->descriptor_set_layout);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreateDescriptorSetLayout: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkPushConstantRange push_range = {};
+	push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	push_range.offset = 0;
+	push_range.size = sizeof(struct ems_color_convert_params);
+
+	VkPipelineLayoutCreateInfo pipeline_layout_info = {};
+	pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipeline_layout_info.setLayoutCount = 1;
+	pipeline_layout_info.pSetLayouts = &cc->descriptor_set_layout;
+	pipeline_layout_info.pushConstantRangeCount = 1;
+	pipeline_layout_info.pPushConstantRanges = &push_range;
+
+	ret = vk->vkCreatePipelineLayout(vk->device, &pipeline_layout_info, NULL, &cc->pipeline_layout);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreatePipelineLayout: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkShaderModuleCreateInfo module_info = {};
+	module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	module_info.codeSize = sizeof(ems_shader_rgba_to_nv12_comp);
+	module_info.pCode = ems_shader_rgba_to_nv12_comp;
+
+	VkShaderModule shader_module = VK_NULL_HANDLE;
+	ret = vk->vkCreateShaderModule(vk->device, &module_info, NULL, &shader_module);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreateShaderModule: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkComputePipelineCreateInfo pipeline_info = {};
+	pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipeline_info.stage.module = shader_module;
+	pipeline_info.stage.pName = "main";
+	pipeline_info.layout = cc->pipeline_layout;
+
+	// Compiling the shader is most of the time the compositor takes to start.
+	VkPipelineCache cache = ems_pipeline_cache_load(vk, "rgba_to_nv12");
+	ret = vk->vkCreateComputePipelines(vk->device, cache, 1, &pipeline_info, NULL, &cc->pipeline);
+	ems_pipeline_cache_save_and_destroy(vk, "rgba_to_nv12", &cache);
+
+	// Not needed once the pipeline is created.
+	vk->vkDestroyShaderModule(vk->device, shader_module, NULL);
+
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreateComputePipelines: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	// One set for each frame and each of its recordings.
+	const uint32_t set_count = EMS_COLOR_CONVERT_FRAME_COUNT * (1 + EMS_COLOR_CONVERT_RECORDINGS);
+
+	VkDescriptorPoolSize pool_sizes[3] = {};
+	pool_sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	pool_sizes[0].descriptorCount = (4 + EMS_COLOR_CONVERT_MAX_LAYERS) * set_count;
+	pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	pool_sizes[1].descriptorCount = set_count;
+	pool_sizes[2].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	pool_sizes[2].descriptorCount = set_count;
+
+	VkDescriptorPoolCreateInfo pool_info = {};
+	pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	pool_info.maxSets = set_count;
+	pool_info.poolSizeCount = ARRAY_SIZE(pool_sizes);
+	pool_info.pPoolSizes = pool_sizes;
+
+	ret = vk->vkCreateDescriptorPool(vk->device, &pool_info, NULL, &cc->descriptor_pool);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreateDescriptorPool: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	return VK_SUCCESS;
+}
+
+static VkResult
+create_layers_buffer(struct vk_bundle *vk, struct ems_color_convert_frame *f)
+{
+	VkResult ret;
+
+	VkBufferCreateInfo buffer_info = {};
+	buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	buffer_info.size = sizeof(struct ems_color_convert_layers);
+	buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+	buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	ret = vk->vkCreateBuffer(vk->device, &buffer_info, NULL, &f->layers_buffer);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreateBuffer: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkMemoryRequirements requirements;
+	vk->vkGetBufferMemoryRequirements(vk->device, f->layers_buffer, &requirements);
+
+	uint32_t memory_type_index = 0;
+	if (!vk_get_memory_type(vk, requirements.memoryTypeBits,
+	                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	                        &memory_type_index)) {
+		VK_ERROR(vk, "No host visible memory type for the layers buffer");
+		return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+
+	VkMemoryAllocateInfo alloc_info = {};
+	alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	alloc_info.allocationSize = requirements.size;
+	alloc_info.memoryTypeIndex = memory_type_index;
+
+	ret = vk->vkAllocateMemory(vk->device, &alloc_info, NULL, &f->layers_memory);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkAllocateMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	ret = vk->vkBindBufferMemory(vk->device, f->layers_buffer, f->layers_memory, 0);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkBindBufferMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	void *mapped = NULL;
+	ret = vk->vkMapMemory(vk->device, f->layers_memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkMapMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	f->layers = (struct ems_color_convert_layers *)mapped;
+	memset(f->layers, 0, sizeof(*f->layers));
+
+	return VK_SUCCESS;
+}
+
+static VkResult
+create_frame(struct vk_bundle *vk, struct ems_color_convert *cc, struct ems_color_convert_frame *f)
+{
+	VkResult ret;
+
+	VkExternalMemoryBufferCreateInfo external_buffer_info = {};
+	external_buffer_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+	external_buffer_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+	VkBufferCreateInfo buffer_info = {};
+	buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	buffer_info.pNext = cc->export_dmabuf ? &external_buffer_info : NULL;
+	buffer_info.size = cc->size;
+	buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	ret = vk->vkCreateBuffer(vk->device, &buffer_info, NULL, &f->buffer);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreateBuffer: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkMemoryRequirements requirements;
+	vk->vkGetBufferMemoryRequirements(vk->device, f->buffer, &requirements);
+
+	uint32_t memory_type_index = 0;
+	if (cc->export_dmabuf) {
+		// The encoder imports this on the GPU, keep it in device memory.
+		if (!vk_get_memory_type(vk, requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		                        &memory_type_index)) {
+			VK_ERROR(vk, "No device local memory type for NV12 buffer");
+			return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+		}
+	} else if (!vk_get_memory_type(vk, requirements.memoryTypeBits,
+	                               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+	                                   VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+	                               &memory_type_index) &&
+	           !vk_get_memory_type(vk, requirements.memoryTypeBits,
+	                               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	                               &memory_type_index)) {
+		// The encoder reads this on the CPU, so cached memory is much preferred.
+		VK_ERROR(vk, "No host visible memory type for NV12 buffer");
+		return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+
+	VkMemoryDedicatedAllocateInfo dedicated_info = {};
+	dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+	dedicated_info.buffer = f->buffer;
+
+	VkExportMemoryAllocateInfo export_info = {};
+	export_info.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO;
+	export_info.pNext = &dedicated_info;
+	export_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+	VkMemoryAllocateInfo alloc_info = {};
+	alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	alloc_info.pNext = cc->export_dmabuf ? &export_info : NULL;
+	alloc_info.allocationSize = requirements.size;
+	alloc_info.memoryTypeIndex = memory_type_index;
+
+	ret = vk->vkAllocateMemory(vk->device, &alloc_info, NULL, &f->memory);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkAllocateMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	ret = vk->vkBindBufferMemory(vk->device, f->buffer, f->memory, 0);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkBindBufferMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	void *mapped = NULL;
+	if (cc->export_dmabuf) {
+		VkMemoryGetFdInfoKHR fd_info = {};
+		fd_info.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
+		fd_info.memory = f->memory;
+		fd_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+		ret = vk->vkGetMemoryFdKHR(vk->device, &fd_info, &f->dmabuf_fd);
+		if (ret != VK_SUCCESS) {
+			VK_ERROR(vk, "vkGetMemoryFdKHR: %s", vk_result_string(ret));
+			return ret;
+		}
+	} else {
+		ret = vk->vkMapMemory(vk->device, f->memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+		if (ret != VK_SUCCESS) {
+			VK_ERROR(vk, "vkMapMemory: %s", vk_result_string(ret));
+			return ret;
+		}
+	}
+
+	VkDescriptorSet sets[1 + EMS_COLOR_CONVERT_RECORDINGS];
+	VkDescriptorSetLayout set_layouts[ARRAY_SIZE(sets)];
+	for (uint32_t i = 0; i < ARRAY_SIZE(sets); i++) {
+		set_layouts[i] = cc->descriptor_set_layout;
+	}
+
+	VkDescriptorSetAllocateInfo set_info = {};
+	set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	set_info.descriptorPool = cc->descriptor_pool;
+	set_info.descriptorSetCount = ARRAY_SIZE(sets);
+	set_info.pSetLayouts = set_layouts;
+
+	ret = vk->vkAllocateDescriptorSets(vk->device, &set_info, sets);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkAllocateDescriptorSets: %s", vk_result_string(ret));
+		return ret;
+	}
+	f->descriptor_set = sets[0];
+	for (uint32_t i = 0; i < EMS_COLOR_CONVERT_RECORDINGS; i++) {
+		f->recordings[i].descriptor_set = sets[1 + i];
+	}
+
+	ret = create_layers_buffer(vk, f);
+	if (ret != VK_SUCCESS) {
+		return ret;
+	}
+
+	// The buffers never change, only the source views do.
+	VkDescriptorBufferInfo buffer_desc = {};
+	buffer_desc.buffer = f->buffer;
+	buffer_desc.offset = 0;
+	buffer_desc.range = cc->size;
+
+	VkDescriptorBufferInfo layers_desc = {};
+	layers_desc.buffer = f->layers_buffer;
+	layers_desc.offset = 0;
+	layers_desc.range = sizeof(struct ems_color_convert_layers);
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(sets); i++) {
+		VkWriteDescriptorSet writes[2] = {};
+		writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[0].dstSet = sets[i];
+		writes[0].dstBinding = 1;
+		writes[0].descriptorCount = 1;
+		writes[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		writes[0].pBufferInfo = &buffer_desc;
+		writes[1] = writes[0];
+		writes[1].dstBinding = 4;
+		writes[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		writes[1].pBufferInfo = &layers_desc;
+
+		vk->vkUpdateDescriptorSets(vk->device, ARRAY_SIZE(writes), writes, 0, NULL);
+	}
+
+	f->cc = cc;
+	f->base.destroy = frame_destroy;
+	f->base.width = cc->width;
+	f->base.height = cc->height;
+	f->base.stride = cc->width;
+	f->base.size = cc->size;
+	f->base.data = (uint8_t *)mapped;
+	f->base.format = EMS_XRT_FORMAT_NV12;
+	f->base.stereo_format = XRT_STEREO_FORMAT_SBS;
+
+	return VK_SUCCESS;
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+bool
+ems_color_convert_format_is_srgb(VkFormat format)
+{
+	switch (format) {
+	case VK_FORMAT_R8G8B8A8_SRGB:
+	case VK_FORMAT_B8G8R8A8_SRGB:
+	case VK_FORMAT_A8B8G8R8_SRGB_PACK32:
+	case VK_FORMAT_R8G8B8_SRGB:
+	case VK_FORMAT_B8G8R8_SRGB: return true;
+	default: return false;
+	}
+}
+
+void
+ems_color_convert_foveation_init(float center_size, float edge_ratio, struct ems_color_convert_foveation *out)
+{
+	float s = fminf(fmaxf(center_size, 0.01f), 1.0f);
+	float k = fminf(fmaxf(edge_ratio, 0.01f), 1.0f);
+
+	// The center keeps full resolution, the edges get k of it, scaled to fit.
+	float scale = 1.0f / (s + k * (1.0f - s));
+	float source_min = 0.5f - s * 0.5f;
+	float encoded_min = source_min * k * scale;
+
+	out->source_min = {source_min, source_min};
+	out->source_max = {1.0f - source_min, 1.0f - source_min};
+	out->encoded_min = {encoded_min, encoded_min};
+	out->encoded_max = {encoded_min + s * scale, encoded_min + s * scale};
+}
+
+bool
+ems_color_convert_can_export_dmabuf(struct vk_bundle *vk)
+{
+	uint32_t count = 0;
+	VkResult ret = vk->vkEnumerateDeviceExtensionProperties(vk->physical_device, NULL, &count, NULL);
+	if (ret != VK_SUCCESS || count == 0) {
+		return false;
+	}
+
+	// It is in the optional list, so it is enabled if the device has it.
+	VkExtensionProperties *props = U_TYPED_ARRAY_CALLOC(VkExtensionProperties, count);
+	ret = vk->vkEnumerateDeviceExtensionProperties(vk->physical_device, NULL, &count, props);
+
+	bool found = false;
+	for (uint32_t i = 0; ret == VK_SUCCESS && i < count; i++) {
+		if (strcmp(props[i].extensionName, VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME) == 0) {
+			found = true;
+			break;
+		}
+	}
+
+	free(props);
+
+	return found;
+}
+
+int
+ems_color_convert_get_dmabuf_fd(struct ems_color_convert *cc, struct xrt_frame *frame)
+{
+	if (!cc->export_dmabuf) {
+		return -1;
+	}
+
+	struct ems_color_convert_frame *f = container_of(frame, struct ems_color_convert_frame, base);
+
+	return f->dmabuf_fd;
+}
+
+bool
+ems_color_convert_create(struct vk_bundle *vk,
+                         uint32_t width,
+                         uint32_t height,
+                         bool export_dmabuf,
+                         struct ems_color_convert **out_cc)
+{
+	if (width % 8 != 0 || height % 2 != 0) {
+		U_LOG_E("NV12 conversion needs a width divisible by 8 and an even height, got %ux%u", width, height);
+		return false;
+	}
+
+	struct ems_color_convert *cc = U_TYPED_CALLOC(struct ems_color_convert);
+	cc->vk = vk;
+	cc->width = width;
+	cc->height = height;
+	cc->size = (VkDeviceSize)width * height * 3 / 2;
+	cc->export_dmabuf = export_dmabuf;
+
+	os_mutex_init(&cc->mutex);
+
+	// So destroy doesn't close fds we never got.
+	for (uint32_t i = 0; i < EMS_COLOR_CONVERT_FRAME_COUNT; i++) {
+		cc->frames[i].dmabuf_fd = -1;
+	}
+
+	if (create_pipeline(vk, cc) != VK_SUCCESS) {
+		ems_color_convert_destroy(vk, &cc);
+		return false;
+	}
+
+	VkResult ret = vk_cmd_pool_init(vk, &cc->cmd_pool, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vk_cmd_pool_init: %s", vk_result_string(ret));
+		ems_color_convert_destroy(vk, &cc);
+		return false;
+	}
+	cc->have_cmd_pool = true;
+
+	for (uint32_t i = 0; i < EMS_COLOR_CONVERT_FRAME_COUNT; i++) {
+		if (create_frame(vk, cc, &cc->frames[i]) != VK_SUCCESS) {
+			ems_color_convert_destroy(vk, &cc);
+			return false;
+		}
+	}
+
+	*out_cc = cc;
+
+	return true;
+}
+
+void
+ems_color_convert_destroy(struct vk_bundle *vk, struct ems_color_convert **cc_ptr)
+{
+	struct ems_color_convert *cc = *cc_ptr;
+	if (cc == NULL) {
+		return;
+	}
+
+	for (uint32_t i = 0; i < EMS_COLOR_CONVERT_FRAME_COUNT; i++) {
+		struct ems_color_convert_frame *f = &cc->frames[i];
+
+		if (f->in_use) {
+			U_LOG_W("NV12 frame %u still in use on destroy", i);
+		}
+		if (f->dmabuf_fd >= 0) {
+			close(f->dmabuf_fd);
+		}
+		if (f->memory != VK_NULL_HANDLE) {
+			vk->vkFreeMemory(vk->device, f->memory, NULL);
+		}
+		if (f->buffer != VK_NULL_HANDLE) {
+			vk->vkDestroyBuffer(vk->device, f->buffer, NULL);
+		}
+		if (f->layers_memory != VK_NULL_HANDLE) {
+			vk->vkFreeMemory(vk->device, f->layers_memory, NULL);
+		}
+		if (f->layers_buffer != VK_NULL_HANDLE) {
+			vk->vkDestroyBuffer(vk->device, f->layers_buffer, NULL);
+		}
+	}
+
+	// Frees the recordings too.
+	if (cc->have_cmd_pool) {
+		vk_cmd_pool_destroy(vk, &cc->cmd_pool);
+	}
+	// Frees the descriptor sets too.
+	if (cc->descriptor_pool != VK_NULL_HANDLE) {
+		vk->vkDestroyDescriptorPool(vk->device, cc->descriptor_pool, NULL);
+	}
+	if (cc->pipeline != VK_NULL_HANDLE) {
+		vk->vkDestroyPipeline(vk->device, cc->pipeline, NULL);
+	}
+	if (cc->pipeline_layout != VK_NULL_HANDLE) {
+		vk->vkDestroyPipelineLayout(vk->device, cc->pipeline_layout, NULL);
+	}
+	if (cc->descriptor_set_layout != VK_NULL_HANDLE) {
+		vk->vkDestroyDescriptorSetLayout(vk->device, cc->descriptor_set_layout, NULL);
+	}
+
+	os_mutex_destroy(&cc->mutex);
+
+	free(cc);
+	*cc_ptr = NULL;
+}
+
+bool
+ems_color_convert_get_unused_frame(struct ems_color_convert *cc, struct xrt_frame **out_frame)
+{
+	struct ems_color_convert_frame *found = NULL;
+
+	os_mutex_lock(&cc->mutex);
+	for (uint32_t i = 0; i < EMS_COLOR_CONVERT_FRAME_COUNT; i++) {
+		if (!cc->frames[i].in_use) {
+			found = &cc->frames[i];
+			found->in_use = true;
+			break;
+		}
+	}
+	os_mutex_unlock(&cc->mutex);
+
+	if (found == NULL) {
+		return false;
+	}
+
+	// Reference count is zero when unused.
+	xrt_frame_reference(out_frame, &found->base);
+
+	return true;
+}
+
+static void
+gather_inputs(struct ems_color_convert *cc,
+              const struct ems_color_convert_view views[2],
+              const struct ems_color_convert_foveation *foveation,
+              uint32_t depth_height,
+              const struct ems_color_convert_layer *layers,
+              uint32_t layer_count,
+              const struct xrt_size *active_size,
+              struct ems_color_convert_inputs *out)
+{
+	memset(out, 0, sizeof(*out));
+
+	for (uint32_t i = 0; i < 2; i++) {
+		out->images[i].sampler = views[i].sampler;
+		out->images[i].imageView = views[i].image_view;
+		out->images[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+		// The binding needs something valid even when the shader never samples it.
+		out->depths[i] = out->images[i];
+		if (depth_height > 0) {
+			out->depths[i].sampler = views[i].depth_sampler;
+			out->depths[i].imageView = views[i].depth_image_view;
+		}
+	}
+
+	// Like the depth, unused layer bindings get the left view.
+	for (uint32_t i = 0; i < EMS_COLOR_CONVERT_MAX_LAYERS; i++) {
+		out->layers[i] = out->images[0];
+		if (i < layer_count) {
+			out->layers[i].sampler = layers[i].sampler;
+			out->layers[i].imageView = layers[i].image_view;
+		}
+	}
+
+	struct ems_color_convert_params *params = &out->params;
+	for (uint32_t i = 0; i < 2; i++) {
+		params->source_rect[i][0] = views[i].rect.x;
+		params->source_rect[i][1] = views[i].rect.y;
+		params->source_rect[i][2] = views[i].rect.w;
+		params->source_rect[i][3] = views[i].rect.h;
+		params->srgb[i] = views[i].srgb ? 1 : 0;
+		params->depth_rect[i][0] = views[i].depth_rect.x;
+		params->depth_rect[i][1] = views[i].depth_rect.y;
+		params->depth_rect[i][2] = views[i].depth_rect.w;
+		params->depth_rect[i][3] = views[i].depth_rect.h;
+	}
+	params->dst_size[0] = (int32_t)cc->width;
+	params->dst_size[1] = (int32_t)cc->height;
+	params->color_height = (int32_t)(cc->height - depth_height);
+	params->active_size[0] = active_size != NULL ? active_size->w : (int32_t)(cc->width / 2);
+	params->active_size[1] = active_size != NULL ? active_size->h : params->color_height;
+
+	struct ems_color_convert_foveation identity = {{0.0f, 0.0f}, {1.0f, 1.0f}, {0.0f, 0.0f}, {1.0f, 1.0f}};
+	if (foveation == NULL) {
+		foveation = &identity;
+	}
+	params->foveation_source[0] = foveation->source_min.x;
+	params->foveation_source[1] = foveation->source_min.y;
+	params->foveation_source[2] = foveation->source_max.x;
+	params->foveation_source[3] = foveation->source_max.y;
+	params->foveation_encoded[0] = foveation->encoded_min.x;
+	params->foveation_encoded[1] = foveation->encoded_min.y;
+	params->foveation_encoded[2] = foveation->encoded_max.x;
+	params->foveation_encoded[3] = foveation->encoded_max.y;
+}
+
+static void
+write_descriptor_set(struct vk_bundle *vk, VkDescriptorSet set, const struct ems_color_convert_inputs *inputs)
+{
+	VkWriteDescriptorSet writes[3] = {};
+	writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writes[0].dstSet = set;
+	writes[0].dstBinding = 0;
+	writes[0].descriptorCount = 2;
+	writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	writes[0].pImageInfo = inputs->images;
+	writes[1] = writes[0];
+	writes[1].dstBinding = 2;
+	writes[1].pImageInfo = inputs->depths;
+	writes[2] = writes[0];
+	writes[2].dstBinding = 3;
+	writes[2].descriptorCount = EMS_COLOR_CONVERT_MAX_LAYERS;
+	writes[2].pImageInfo = inputs->layers;
+
+	vk->vkUpdateDescriptorSets(vk->device, ARRAY_SIZE(writes), writes, 0, NULL);
+}
+
+/*!
+ * The layers change with every pose so they are data in the uniform buffer rather than in the commands.
+ */
+static void
+write_layers(struct ems_color_convert_frame *f,
+             const struct ems_color_convert_view views[2],
+             const struct ems_color_convert_layer *layers,
+             uint32_t layer_count)
+{
+	// Coherent and only read by the GPU while the frame is in use, the submit makes it visible.
+	struct ems_color_convert_layers *data = f->layers;
+	for (uint32_t i = 0; i < 2; i++) {
+		data->fov_tan[i][0] = tanf(views[i].fov.angle_left);
+		data->fov_tan[i][1] = tanf(views[i].fov.angle_right);
+		data->fov_tan[i][2] = tanf(views[i].fov.angle_up);
+		data->fov_tan[i][3] = tanf(views[i].fov.angle_down);
+	}
+	data->count = (int32_t)layer_count;
+	for (uint32_t i = 0; i < layer_count; i++) {
+		const struct ems_color_convert_layer *layer = &layers[i];
+		struct ems_color_convert_layer_data *d = &data->layers[i];
+
+		for (uint32_t view = 0; view < 2; view++) {
+			math_matrix_4x4_isometry_from_pose(&layer->from_view[view], &d->from_view[view]);
+		}
+		d->rect[0] = layer->rect.x;
+		d->rect[1] = layer->rect.y;
+		d->rect[2] = layer->rect.w;
+		d->rect[3] = layer->rect.h;
+		if (layer->type == EMS_COLOR_CONVERT_LAYER_QUAD) {
+			d->shape[0] = layer->size.x;
+			d->shape[1] = layer->size.y;
+			d->shape[2] = 0.0f;
+		} else {
+			d->shape[0] = layer->radius;
+			d->shape[1] = layer->central_angle;
+			d->shape[2] = layer->aspect_ratio;
+		}
+		d->shape[3] = 0.0f;
+		d->info[0] = (int32_t)layer->type;
+		d->info[1] = layer->srgb ? 1 : 0;
+		d->info[2] = (layer->blend_alpha ? EMS_COLOR_CONVERT_LAYER_FLAG_BLEND_ALPHA : 0) |
+		             (layer->unpremultiplied ? EMS_COLOR_CONVERT_LAYER_FLAG_UNPREMULTIPLIED : 0);
+		d->info[3] = (int32_t)layer->view_mask;
+	}
+}
+
+static void
+record_dispatch(struct vk_bundle *vk,
+                struct ems_color_convert *cc,
+                VkCommandBuffer cmd,
+                struct ems_color_convert_frame *f,
+                VkDescriptorSet set,
+                const struct ems_color_convert_params *params)
+{
+	vk->vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cc->pipeline);
+	vk->vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cc->pipeline_layout, 0, 1, &set, 0, NULL);
+	vk->vkCmdPushConstants(cmd, cc->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(*params), params);
+
+	// Each invocation writes 4x2 pixels, local size is 8x8.
+	uint32_t groups_x = (cc->width / 4 + 7) / 8;
+	uint32_t groups_y = (cc->height / 2 + 7) / 8;
+	vk->vkCmdDispatch(cmd, groups_x, groups_y, 1);
+
+	// Make the result visible to the host once the submit's fence has signalled.
+	VkBufferMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = f->buffer;
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+	VkPipelineStageFlags dst_stage = VK_PIPELINE_STAGE_HOST_BIT;
+
+	/*
+	 * Or release it to the encoder, which reads the dmabuf from outside of Vulkan. Nothing acquires it back, the
+	 * next conversion into the frame takes it like a new buffer and overwrites all of it.
+	 */
+	if (cc->export_dmabuf) {
+		barrier.dstAccessMask = 0;
+		barrier.srcQueueFamilyIndex = vk->queue_family_index;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL;
+		dst_stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	}
+
+	vk->vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, dst_stage, 0, 0, NULL, 1, &barrier, 0,
+	                         NULL);
+}
+
+static void
+check_inputs(struct ems_color_convert *cc, uint32_t *depth_height, uint32_t *layer_count)
+{
+	if (*depth_height >= cc->height || *depth_height % 2 != 0) {
+		U_LOG_W("Invalid depth band of %u rows, streaming without depth", *depth_height);
+		*depth_height = 0;
+	}
+
+	if (*layer_count > EMS_COLOR_CONVERT_MAX_LAYERS) {
+		U_LOG_W("Got %u layers, only blending the first %u", *layer_count, EMS_COLOR_CONVERT_MAX_LAYERS);
+		*layer_count = EMS_COLOR_CONVERT_MAX_LAYERS;
+	}
+}
+
+void
+ems_color_convert_record(struct vk_bundle *vk,
+                         struct ems_color_convert *cc,
+                         VkCommandBuffer cmd,
+                         struct xrt_frame *frame,
+                         const struct ems_color_convert_view views[2],
+                         const struct ems_color_convert_foveation *foveation,
+                         uint32_t depth_height,
+                         const struct ems_color_convert_layer *layers,
+                         uint32_t layer_count,
+                         const struct xrt_size *active_size)
+{
+	struct ems_color_convert_frame *f = container_of(frame, struct ems_color_convert_frame, base);
+
+	check_inputs(cc, &depth_height, &layer_count);
+
+	struct ems_color_convert_inputs inputs;
+	gather_inputs(cc, views, foveation, depth_height, layers, layer_count, active_size, &inputs);
+
+	// Safe to update, the set is only in use on the GPU while the frame is.
+	write_descriptor_set(vk, f->descriptor_set, &inputs);
+	write_layers(f, views, layers, layer_count);
+
+	record_dispatch(vk, cc, cmd, f, f->descriptor_set, &inputs.params);
+}
+
+static bool
+recording_is_current(const struct ems_color_convert_recording *r, uint64_t generation)
+{
+	return r->valid && r->generation == generation;
+}
+
+VkCommandBuffer
+ems_color_convert_get_recording(struct vk_bundle *vk,
+                                struct ems_color_convert *cc,
+                                struct xrt_frame *frame,
+                                const struct ems_color_convert_view views[2],
+                                const struct ems_color_convert_foveation *foveation,
+                                uint32_t depth_height,
+                                const struct ems_color_convert_layer *layers,
+                                uint32_t layer_count,
+                                const struct xrt_size *active_size,
+                                uint64_t generation)
+{
+	struct ems_color_convert_frame *f = container_of(frame, struct ems_color_convert_frame, base);
+
+	check_inputs(cc, &depth_height, &layer_count);
+
+	struct ems_color_convert_inputs inputs;
+	gather_inputs(cc, views, foveation, depth_height, layers, layer_count, active_size, &inputs);
+	write_layers(f, views, layers, layer_count);
+
+	uint64_t use = ++cc->recording_uses;
+
+	struct ems_color_convert_recording *r = NULL;
+	for (uint32_t i = 0; i < EMS_COLOR_CONVERT_RECORDINGS; i++) {
+		struct ems_color_convert_recording *it = &f->recordings[i];
+		bool current = recording_is_current(it, generation);
+
+		if (current && memcmp(&it->inputs, &inputs, sizeof(inputs)) == 0) {
+			it->last_used = use;
+			return it->cmd;
+		}
+		// Older generations may hold views that are gone and go first, then the least recently used.
+		if (r == NULL || (recording_is_current(r, generation) && (!current || it->last_used < r->last_used))) {
+			r = it;
+		}
+	}
+
+	// Nothing of this frame is in flight, so neither is the set nor the command buffer.
+	r->valid = false;
+	if (r->cmd == VK_NULL_HANDLE) {
+		VkCommandBufferAllocateInfo alloc_info = {};
+		alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		alloc_info.commandPool = cc->cmd_pool.pool;
+		alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		alloc_info.commandBufferCount = 1;
+
+		vk_cmd_pool_lock(&cc->cmd_pool);
+		VkResult ret = vk->vkAllocateCommandBuffers(vk->device, &alloc_info, &r->cmd);
+		vk_cmd_pool_unlock(&cc->cmd_pool);
+		if (ret != VK_SUCCESS) {
+			VK_ERROR(vk, "vkAllocateCommandBuffers: %s", vk_result_string(ret));
+			r->cmd = VK_NULL_HANDLE;
+			return VK_NULL_HANDLE;
+		}
+	}
+
+	write_descriptor_set(vk, r->descriptor_set, &inputs);
+
+	VkCommandBufferBeginInfo begin_info = {};
+	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+	// Only this thread records into the pool, the lock keeps it apart from destruction.
+	vk_cmd_pool_lock(&cc->cmd_pool);
+	VkResult ret = vk->vkBeginCommandBuffer(r->cmd, &begin_info);
+	if (ret == VK_SUCCESS) {
+		record_dispatch(vk, cc, r->cmd, f, r->descriptor_set, &inputs.params);
+		ret = vk->vkEndCommandBuffer(r->cmd);
+	}
+	vk_cmd_pool_unlock(&cc->cmd_pool);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "Recording the conversion: %s", vk_result_string(ret));
+		return VK_NULL_HANDLE;
+	}
+
+	r->inputs = inputs;
+	r->generation = generation;
+	r->last_used = use;
+	r->valid = true;
+	return r->cmd;
+}
@@ -0,0 +1,275 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  GPU side RGBA to NV12 conversion for the remote rendering compositor.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include "xrt/xrt_defines.h"
+#include "xrt/xrt_frame.h"
+
+#include "vk/vk_helpers.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*!
+ * Number of NV12 frames in the pool.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_COLOR_CONVERT_FRAME_COUNT (8)
+
+/*!
+ * Number of quad and cylinder layers blended over the views at most.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_COLOR_CONVERT_MAX_LAYERS (4)
+
+/*!
+ * Number of recorded conversions kept per frame, see @ref ems_color_convert_get_recording.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_COLOR_CONVERT_RECORDINGS (4)
+
+struct ems_color_convert;
+
+/*!
+ * One source view to be sampled by the conversion shader.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_color_convert_view
+{
+	//! Must be in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+	VkImageView image_view;
+
+	VkSampler sampler;
+
+	//! Area of the image to sample, in normalized coordinates.
+	struct xrt_normalized_rect rect;
+
+	//! The view linearizes on sampling, so the shader needs to sRGB encode again.
+	bool srgb;
+
+	//! Depth of the view, only used with a depth band, same layout requirement as @p image_view.
+	VkImageView depth_image_view;
+
+	VkSampler depth_sampler;
+
+	//! Area of the depth image to sample, in normalized coordinates.
+	struct xrt_normalized_rect depth_rect;
+
+	//! Field of view of the image, the layers are projected with it.
+	struct xrt_fov fov;
+};
+
+/*!
+ * Shape of a layer blended over the views.
+ *
+ * @ingroup comp_ems
+ */
+enum ems_color_convert_layer_type
+{
+	EMS_COLOR_CONVERT_LAYER_QUAD = 1,
+	EMS_COLOR_CONVERT_LAYER_CYLINDER = 2,
+};
+
+/*!
+ * A quad or cylinder layer, blended over the views by the conversion shader.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_color_convert_layer
+{
+	enum ems_color_convert_layer_type type;
+
+	//! Same layout requirement as @ref ems_color_convert_view::image_view.
+	VkImageView image_view;
+
+	VkSampler sampler;
+
+	//! Area of the image to sample, in normalized coordinates.
+	struct xrt_normalized_rect rect;
+
+	//! The view linearizes on sampling, so the shader needs to sRGB encode again.
+	bool srgb;
+
+	//! Blend with the alpha of the image, otherwise the layer is opaque.
+	bool blend_alpha;
+
+	//! The color is not premultiplied with the alpha yet.
+	bool unpremultiplied;
+
+	//! Visible in the views, bit 0 for the left and bit 1 for the right one.
+	uint32_t view_mask;
+
+	//! Per view, from the space of the view to the one of the layer.
+	struct xrt_pose from_view[2];
+
+	//! Size of a quad.
+	struct xrt_vec2 size;
+
+	//! Shape of a cylinder.
+	float radius;
+	float central_angle;
+	float aspect_ratio;
+};
+
+/*!
+ * Axis aligned foveation warp, the same for both views and in normalized per
+ * view coordinates. The source area between @p source_min and @p source_max
+ * is written between @p encoded_min and @p encoded_max, which covers more of
+ * the frame, the edges get squeezed into what is left.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_color_convert_foveation
+{
+	struct xrt_vec2 source_min;
+	struct xrt_vec2 source_max;
+	struct xrt_vec2 encoded_min;
+	struct xrt_vec2 encoded_max;
+};
+
+/*!
+ * Fills in a centered warp, @p center_size is the fraction of each axis kept
+ * at the highest resolution and @p edge_ratio the resolution of the edges
+ * relative to it, both in (0, 1].
+ *
+ * @ingroup comp_ems
+ */
+void
+ems_color_convert_foveation_init(float center_size, float edge_ratio, struct ems_color_convert_foveation *out);
+
+/*!
+ * Creates the conversion pipeline and a pool of NV12 frames of the given
+ * side-by-side size, width must be a multiple of 8 and height of 2.
+ *
+ * With @p export_dmabuf the frames live in device memory exported as dmabuf,
+ * they have no CPU mapping, see @ref ems_color_convert_get_dmabuf_fd.
+ * Otherwise they are host visible and mapped.
+ *
+ * @ingroup comp_ems
+ */
+bool
+ems_color_convert_create(struct vk_bundle *vk,
+                         uint32_t width,
+                         uint32_t height,
+                         bool export_dmabuf,
+                         struct ems_color_convert **out_cc);
+
+/*!
+ * Destroys the conversion pipeline, all frames must have been released.
+ *
+ * @ingroup comp_ems
+ */
+void
+ems_color_convert_destroy(struct vk_bundle *vk, struct ems_color_convert **cc_ptr);
+
+/*!
+ * Gets an unused NV12 frame, the caller owns the returned reference. The frame
+ * goes back into the pool when the last reference is dropped.
+ *
+ * @ingroup comp_ems
+ */
+bool
+ems_color_convert_get_unused_frame(struct ems_color_convert *cc, struct xrt_frame **out_frame);
+
+/*!
+ * Records the conversion of both views into the given frame, followed by a
+ * barrier making the result available to the host. A NULL @p foveation
+ * samples the views without warping.
+ *
+ * The bottom @p depth_height rows of the frame get the views' depth as luma,
+ * the color is squeezed into the rows above. Must be even, 0 for no depth.
+ *
+ * The @p layer_count layers, at most @ref EMS_COLOR_CONVERT_MAX_LAYERS, are
+ * blended over the color in order in the same pass. The depth band only has
+ * the views.
+ *
+ * A non-NULL @p active_size shrinks each view into that many pixels at the top
+ * left of its half of the color area, the rest of it is black.
+ *
+ * @ingroup comp_ems
+ */
+void
+ems_color_convert_record(struct vk_bundle *vk,
+                         struct ems_color_convert *cc,
+                         VkCommandBuffer cmd,
+                         struct xrt_frame *frame,
+                         const struct ems_color_convert_view views[2],
+                         const struct ems_color_convert_foveation *foveation,
+                         uint32_t depth_height,
+                         const struct ems_color_convert_layer *layers,
+                         uint32_t layer_count,
+                         const struct xrt_size *active_size);
+
+/*!
+ * Like @ref ems_color_convert_record, but into a command buffer of the pool's
+ * own that is kept and only recorded again when the views, their rects or the
+ * parameters change. With the app cycling through its swapchain images the
+ * same few recordings come back frame after frame. The layer poses and the
+ * view fovs are data in the frame and always up to date.
+ *
+ * Recordings are forgotten once @p generation changes, bump it whenever views
+ * may have been destroyed, as with swapchains being recreated.
+ *
+ * The returned command buffer has been ended and stays owned by the pool, do
+ * not free it. Submit it before getting another recording into the same
+ * frame. Must not be called from more than one thread at a time.
+ *
+ * @return VK_NULL_HANDLE if recording failed.
+ *
+ * @ingroup comp_ems
+ */
+VkCommandBuffer
+ems_color_convert_get_recording(struct vk_bundle *vk,
+                                struct ems_color_convert *cc,
+                                struct xrt_frame *frame,
+                                const struct ems_color_convert_view views[2],
+                                const struct ems_color_convert_foveation *foveation,
+                                uint32_t depth_height,
+                                const struct ems_color_convert_layer *layers,
+                                uint32_t layer_count,
+                                const struct xrt_size *active_size,
+                                uint64_t generation);
+
+/*!
+ * Returns the dmabuf fd backing a frame from this pool, or -1 if the pool was
+ * not created with export. Ownership stays with the pool, dup it to keep it.
+ *
+ * @ingroup comp_ems
+ */
+int
+ems_color_convert_get_dmabuf_fd(struct ems_color_convert *cc, struct xrt_frame *frame);
+
+/*!
+ * Does the device support exporting memory as dmabuf.
+ *
+ * @ingroup comp_ems
+ */
+bool
+ems_color_convert_can_export_dmabuf(struct vk_bundle *vk);
+
+/*!
+ * Is the given Vulkan format one that linearizes when sampled.
+ *
+ * @ingroup comp_ems
+ */
+bool
+ems_color_convert_format_is_srgb(VkFormat format);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -21,6 +21,14 @@
 #include "electricmaple.pb.h"
 
 #include "gst/ems_gstreamer.h"
+#include "gst/ems_pipeline_args.h"
+#include "ems_color_convert.h"
+#include "ems_latency.h"
+#include "ems_pacer.h"
+#include "ems_telemetry.h"
+#include "ems_trace.h"
+#include "ems_vk_video_encoder.h"
+#include "em_thread_sched.h"
 #include "os/os_time.h"
 
 #include "util/u_misc.h"
@@ -32,6 +40,8 @@
 
 #include "util/comp_vulkan.h"
 
+#include "math/m_api.h"
+
 #include "multi/comp_multi_interface.h"
 
 #include "vk/vk_image_readback_to_xf_pool.h"
@@ -41,6 +51,9 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
 
 // native quest resolution
 // #define APP_VIEW_W (1832)
@@ -50,17 +63,23 @@
 #define APP_VIEW_W (1920)
 #define APP_VIEW_H (1920)
 
-// TODO making this 1 causes readback failures
-// I assume this means there is some kind of buffer creation failing and we aren't handling the error right.
-#define READBACK_DIV_FACTOR (2)
-
-#define READBACK_W2 (APP_VIEW_W / READBACK_DIV_FACTOR)
-#define READBACK_W (READBACK_W2 * 2)
-#define READBACK_H (APP_VIEW_H / READBACK_DIV_FACTOR)
 
 
 DEBUG_GET_ONCE_LOG_OPTION(log, "XRT_COMPOSITOR_LOG", U_LOGGING_INFO)
 
+/*!
+ * The quad and cylinder layers of a frame, blended over its projection layer.
+ */
+struct ems_overlay_layers
+{
+	struct ems_color_convert_layer layers[EMS_COLOR_CONVERT_MAX_LAYERS];
+
+	//! Swapchain of each layer, the GPU reads from them until the frame is done.
+	struct comp_swapchain *scs[EMS_COLOR_CONVERT_MAX_LAYERS];
+
+	uint32_t count;
+};
+
 
 /*
  *
@@ -74,6 +93,23 @@ get_vk(struct ems_compositor *c)
 	return &c->base.vk;
 }
 
+static VkExtent2D
+get_stream_extent(const struct ems_arguments *args)
+{
+	uint32_t scale = MAX(args->readback_scale, 1u);
+
+	// Both views side by side.
+	uint32_t width = args->stream_width != 0 ? args->stream_width : APP_VIEW_W / scale * 2;
+	uint32_t height = args->stream_height != 0 ? args->stream_height : APP_VIEW_H / scale;
+
+	// NV12 and the encoders want even sizes.
+	VkExtent2D extent = {};
+	extent.width = MAX(width & ~1u, 2u);
+	extent.height = MAX(height & ~1u, 2u);
+
+	return extent;
+}
+
 
 /*
  *
@@ -157,6 +193,9 @@ static const char *optional_device_extensions[] = {
 #ifdef VK_EXT_robustness2
     VK_EXT_ROBUSTNESS_2_EXTENSION_NAME,
 #endif
+#ifdef VK_EXT_external_memory_dma_buf
+    VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME,
+#endif
 };
 
 static VkResult
@@ -199,7 +238,9 @@ compositor_init_vulkan(struct ems_compositor *c)
 	struct comp_vulkan_arguments vk_args = {};
 
 	vk_args.get_instance_proc_address = vkGetInstanceProcAddr;
-	vk_args.required_instance_version = VK_MAKE_VERSION(1, 0, 0);
+	// Vulkan Video and the synchronization2 it depends on are core in 1.3.
+	bool vk_video = ems_arguments_get()->encoder_type == EMS_ENCODER_TYPE_VULKAN_H264;
+	vk_args.required_instance_version = vk_video ? VK_MAKE_VERSION(1, 3, 0) : VK_MAKE_VERSION(1, 0, 0);
 	vk_args.required_instance_extensions = required_instance_ext_list;
 	vk_args.optional_instance_extensions = optional_instance_ext_list;
 	vk_args.required_device_extensions = required_device_extension_list;
@@ -266,15 +307,52 @@ compositor_init_vulkan(struct ems_compositor *c)
 static bool
 compositor_init_pacing(struct ems_compositor *c)
 {
-	xrt_result_t xret = u_pc_fake_create(c->settings.frame_interval_ns, os_monotonic_get_ns(), &c->upc);
+	struct ems_arguments *args = ems_arguments_get();
+	xrt_result_t xret;
+
+	if (args->fixed_pacing) {
+		xret = u_pc_fake_create(c->settings.frame_interval_ns, os_monotonic_get_ns(), &c->upc);
+	} else {
+		xret = ems_pacer_create(c->settings.frame_interval_ns, args->pacing_margin_ns, os_monotonic_get_ns(),
+		                        c->instance->latency, &c->upc);
+	}
 	if (xret != XRT_SUCCESS) {
-		EMS_COMP_ERROR(c, "Failed to create fake pacing helper!");
+		EMS_COMP_ERROR(c, "Failed to create pacing helper!");
 		return false;
 	}
 
 	return true;
 }
 
+/*!
+ * Switch pacer, appsrc caps and encoder over to the rate the clients negotiated, so the frames reach them at the
+ * cadence of their display instead of being reused or dropped.
+ */
+static void
+compositor_update_framerate(struct ems_compositor *c)
+{
+	uint32_t framerate = ems_gstreamer_pipeline_get_framerate(c->gstreamer_pipeline);
+	if (framerate == 0 || framerate == c->settings.framerate) {
+		return;
+	}
+
+	EMS_COMP_INFO(c, "Frame rate %u -> %u", c->settings.framerate, framerate);
+	c->settings.framerate = framerate;
+	c->settings.frame_interval_ns = U_TIME_1S_IN_NS / framerate;
+
+	// Only used on this thread, the new pacer predicts from the next frame on.
+	u_pc_destroy(&c->upc);
+	if (!compositor_init_pacing(c)) {
+		EMS_COMP_ERROR(c, "Failed to recreate the pacer at %u fps, falling back to fake pacing.", framerate);
+		u_pc_fake_create(c->settings.frame_interval_ns, os_monotonic_get_ns(), &c->upc);
+	}
+
+	ems_gstreamer_src_set_framerate(c->gstreamer_src, framerate);
+	if (c->vk_encoder != NULL) {
+		ems_vk_video_encoder_set_framerate(c->vk_encoder, framerate);
+	}
+}
+
 static bool
 compositor_init_info(struct ems_compositor *c)
 {
@@ -348,51 +426,445 @@ to_proto(const struct xrt_pose &pose)
 	return ret;
 }
 
+static inline em_proto_Vec2
+to_proto(const struct xrt_vec2 &vec)
+{
+	em_proto_Vec2 ret = em_proto_Vec2_init_default;
+	ret.x = vec.x;
+	ret.y = vec.y;
+	return ret;
+}
+
+static inline em_proto_Foveation
+to_proto(const struct ems_color_convert_foveation &foveation)
+{
+	em_proto_Foveation ret = em_proto_Foveation_init_default;
+	ret.has_source_min = true;
+	ret.source_min = to_proto(foveation.source_min);
+	ret.has_source_max = true;
+	ret.source_max = to_proto(foveation.source_max);
+	ret.has_encoded_min = true;
+	ret.encoded_min = to_proto(foveation.encoded_min);
+	ret.has_encoded_max = true;
+	ret.encoded_max = to_proto(foveation.encoded_max);
+	return ret;
+}
+
 /*
  *
- * Frame handling functions.
+ * Readback functions.
  *
  */
 
-void
-pack_blit_and_encode(struct ems_compositor *c,
-                     const struct xrt_layer_projection_view_data *lvd,
-                     const struct xrt_layer_projection_view_data *rvd,
-                     struct comp_swapchain *lsc,
-                     struct comp_swapchain *rsc)
+/*!
+ * Drops our reference to a frame, handing its buffer back to the pool if it
+ * never got pushed.
+ */
+static void
+release_frame(struct ems_compositor *c, struct xrt_frame **frame_ptr)
 {
-	if (c->offset_ns == 0) {
-		uint64_t now = os_monotonic_get_ns();
-		c->offset_ns = now;
-		c->gstreamer_src->offset_ns = now;
+	if (c->pooled_frames && *frame_ptr != NULL) {
+		ems_gstreamer_src_release_frame(c->gstreamer_src, *frame_ptr);
 	}
-	VkResult ret;
+	xrt_frame_reference(frame_ptr, NULL);
+}
 
-	struct vk_image_readback_to_xf *wrap = NULL;
-	struct vk_bundle *vk = &c->base.vk;
+/*!
+ * Matches the luma of the frame against that of the previous one and puts the
+ * motion of its content on the DownMessage, see @ref ems_motion_field.
+ */
+static void
+add_motion_field(struct ems_compositor *c,
+                 const struct xrt_frame *frame,
+                 em_proto_DownMessage *msg,
+                 const struct xrt_vec2 head_motion[2])
+{
+	COMP_TRACE_MARKER();
 
-	// Getting frame
-	if (!vk_image_readback_to_xf_pool_get_unused_frame(vk, c->pool, &wrap)) {
-		EMS_COMP_ERROR(c, "vk_image_readback_to_xf_pool_get_unused_frame: Failed!");
+	// The views are matched where they have content, so the vectors don't change with the scale of the views.
+	uint32_t half_width = c->stream_extent.width / 2;
+	uint32_t color_height = c->stream_extent.height - c->depth_height;
+	uint32_t view_width = half_width;
+	uint32_t view_height = color_height;
+	if (msg->frame_data.has_active_size) {
+		view_width = (uint32_t)lroundf(msg->frame_data.active_size.x * (float)half_width);
+		view_height = (uint32_t)lroundf(msg->frame_data.active_size.y * (float)color_height);
+	}
+
+	em_proto_MotionField *motion = &msg->frame_data.motion;
+	static_assert(sizeof(motion->vectors.bytes) == EMS_MOTION_FIELD_SIZE, "See electricmaple.options");
+	if (!ems_motion_field_add_frame(&c->motion, (uint32_t)msg->frame_data.frame_sequence_id, frame->data,
+	                                frame->stride, half_width, view_width, view_height, head_motion,
+	                                (int8_t *)motion->vectors.bytes)) {
 		return;
 	}
 
-	// Usefull.
-	xrt_frame *frame = &wrap->base_frame;
+	msg->frame_data.has_motion = true;
+	motion->width = EMS_MOTION_FIELD_WIDTH;
+	motion->height = EMS_MOTION_FIELD_HEIGHT;
+	motion->has_scale = true;
+	motion->scale.x = 1.0f / (EMS_MOTION_FIELD_THUMB_WIDTH * EMS_MOTION_FIELD_SUBPEL);
+	motion->scale.y = 1.0f / (EMS_MOTION_FIELD_THUMB_HEIGHT * EMS_MOTION_FIELD_SUBPEL);
+	motion->vectors.size = EMS_MOTION_FIELD_SIZE;
+}
 
-	const VkCommandBufferUsageFlags flags = 0;
-	VkCommandBuffer cmd = {};
+/*!
+ * Timestamps a finished readback and pushes it into the GStreamer pipeline,
+ * called once the GPU is done with the frame. The @p rois go on the frame,
+ * the @p head_motion is taken out of its motion field.
+ */
+static void
+push_readback_frame(struct ems_compositor *c,
+                    struct xrt_frame *frame,
+                    em_proto_DownMessage *msg,
+                    const struct ems_gstreamer_src_roi *rois,
+                    uint32_t roi_count,
+                    const struct xrt_vec2 head_motion[2])
+{
+	COMP_TRACE_MARKER();
+	EMS_TRACE_FRAME_FLOW("push", msg->frame_data.frame_sequence_id);
+
+	// HACK
+	frame->timestamp = os_monotonic_get_ns();
+	frame->source_timestamp = frame->timestamp;
+
+	// When the client should show it, until it reported a frame it is shown as soon as it is decoded.
+	int64_t display_time = 0;
+	uint64_t display_latency_ns = ems_latency_get_display_latency_ns(c->instance->latency, 0);
+	ems_latency_server_to_client_time(c->instance->latency, frame->timestamp + display_latency_ns, &display_time);
+	msg->frame_data.display_time = display_time;
+	// Lets the client predict the poses it sends as far ahead as we predict them, 0 until the clocks are synced.
+	int64_t render_time = 0;
+	ems_latency_server_to_client_time(c->instance->latency, frame->timestamp, &render_time);
+	msg->frame_data.render_time = render_time;
+	ems_latency_frame_pushed(c->instance->latency, msg->frame_data.frame_sequence_id, frame->timestamp);
+	ems_telemetry_stamp(c->instance->telemetry, msg->frame_data.frame_sequence_id,
+	                    EMS_TELEMETRY_STAGE_READBACK_COMPLETE, frame->timestamp);
+
+	if (!c->pipeline_playing) {
+		ems_gstreamer_pipeline_play(c->gstreamer_pipeline);
+		c->pipeline_playing = true;
+	}
+
+	ems_gstreamer_src_set_regions_of_interest(c->gstreamer_src, rois, roi_count);
+
+	// Exported frames have no CPU mapping, so nothing for the debug sink either.
+	int dmabuf_fd = c->color_convert != NULL ? ems_color_convert_get_dmabuf_fd(c->color_convert, frame) : -1;
+	if (c->motion_vectors && dmabuf_fd < 0) {
+		add_motion_field(c, frame, msg, head_motion);
+	}
+
+	if (c->vk_encoder != NULL) {
+		GBytes *au = NULL;
+		bool keyframe = false;
+		ems_vk_video_encoder_set_bitrate(c->vk_encoder, ems_gstreamer_pipeline_get_bitrate(c->gstreamer_pipeline));
+		if (ems_gstreamer_pipeline_take_keyframe_request(c->gstreamer_pipeline)) {
+			ems_vk_video_encoder_force_keyframe(c->vk_encoder);
+		}
+		bool encoded;
+		{
+			COMP_TRACE_IDENT(encode);
+			EMS_TRACE_FRAME_FLOW("encode", msg->frame_data.frame_sequence_id);
+
+			ems_telemetry_stamp(c->instance->telemetry, msg->frame_data.frame_sequence_id,
+			                    EMS_TELEMETRY_STAGE_ENCODE_IN, os_monotonic_get_ns());
+			encoded = ems_vk_video_encoder_encode(c->vk_encoder, frame, dmabuf_fd, &au, &keyframe);
+		}
+		if (encoded) {
+			ems_telemetry_stamp(c->instance->telemetry, msg->frame_data.frame_sequence_id,
+			                    EMS_TELEMETRY_STAGE_ENCODE_OUT, os_monotonic_get_ns());
+			ems_gstreamer_src_push_encoded(c->gstreamer_src, frame->timestamp, au, keyframe, msg);
+			g_bytes_unref(au);
+		}
+	} else if (c->pooled_frames) {
+		if (dmabuf_fd < 0) {
+			u_sink_debug_push_frame(&c->debug_sink, frame);
+		}
+		ems_gstreamer_src_push_pooled_frame(c->gstreamer_src, frame, msg);
+	} else if (dmabuf_fd >= 0) {
+		ems_gstreamer_src_push_frame_dmabuf(c->gstreamer_src, frame, dmabuf_fd, msg);
+	} else {
+		u_sink_debug_push_frame(&c->debug_sink, frame);
+		ems_gstreamer_src_push_frame(c->gstreamer_src, frame, msg);
+	}
+
+	// TODO send data channel message with pose and fov here?
+}
+
+/*!
+ * Waits for the fence of the slot, frees the command buffer and pushes the frame.
+ */
+static void
+readback_complete_slot(struct ems_compositor *c, struct ems_readback_in_flight *slot)
+{
+	COMP_TRACE_MARKER();
+	EMS_TRACE_FRAME_FLOW("readback", slot->msg.frame_data.frame_sequence_id);
+
+	struct vk_bundle *vk = get_vk(c);
+
+	VkResult ret = vk->vkWaitForFences(vk->device, 1, &slot->fence, VK_TRUE, UINT64_MAX);
+
+	if (!slot->recorded) {
+		vk_cmd_pool_lock(&c->cmd_pool);
+		vk->vkFreeCommandBuffers(vk->device, c->cmd_pool.pool, 1, &slot->cmd);
+		vk_cmd_pool_unlock(&c->cmd_pool);
+	}
+	slot->cmd = VK_NULL_HANDLE;
+
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vkWaitForFences: %s", vk_result_string(ret));
+	} else {
+		push_readback_frame(c, slot->frame, &slot->msg, slot->rois, slot->roi_count, slot->head_motion);
+	}
+
+	release_frame(c, &slot->frame);
+	for (uint32_t i = 0; i < ARRAY_SIZE(slot->xscs); i++) {
+		xrt_swapchain_reference(&slot->xscs[i], NULL);
+	}
+}
+
+/*!
+ * Completes readbacks in submission order, so frames reach the encoder in order.
+ */
+static void *
+readback_completion_thread(void *ptr)
+{
+	struct ems_compositor *c = (struct ems_compositor *)ptr;
 
-	// For submitting commands.
-	vk_cmd_pool_lock(&c->cmd_pool);
+	U_TRACE_SET_THREAD_NAME("EMS: Readback");
 
-	ret = vk_cmd_pool_create_and_begin_cmd_buffer_locked(vk, &c->cmd_pool, flags, &cmd);
+	int sched_ret = em_thread_sched_apply(EM_THREAD_ROLE_CODEC);
+	if (sched_ret != 0) {
+		EMS_COMP_WARN(c, "Could not schedule the readback thread: %s", strerror(sched_ret));
+	}
+
+	os_thread_helper_lock(&c->readback.oth);
+
+	while (os_thread_helper_is_running_locked(&c->readback.oth)) {
+		if (c->readback.completed == c->readback.submitted) {
+			os_thread_helper_wait_locked(&c->readback.oth);
+			continue;
+		}
+
+		struct ems_readback_in_flight *slot =
+		    &c->readback.slots[c->readback.completed % EMS_READBACK_MAX_IN_FLIGHT];
+
+		// Only we touch submitted slots, so no need to hold the lock while waiting.
+		os_thread_helper_unlock(&c->readback.oth);
+		readback_complete_slot(c, slot);
+		os_thread_helper_lock(&c->readback.oth);
+
+		c->readback.completed++;
+
+		// Wake up the compositor if it is waiting for a free slot.
+		os_thread_helper_signal_locked(&c->readback.oth);
+	}
+
+	os_thread_helper_unlock(&c->readback.oth);
+
+	return NULL;
+}
+
+/*!
+ * Waits for a free slot, this throttles us to max_in_flight frames. Must be called before
+ * locking the command pool, the completion thread locks it to free a command buffer before
+ * it frees the slot.
+ */
+static void
+readback_wait_for_slot(struct ems_compositor *c)
+{
+	os_thread_helper_lock(&c->readback.oth);
+	while (c->readback.submitted - c->readback.completed >= c->readback.max_in_flight &&
+	       os_thread_helper_is_running_locked(&c->readback.oth)) {
+		os_thread_helper_wait_locked(&c->readback.oth);
+	}
+	os_thread_helper_unlock(&c->readback.oth);
+}
+
+/*!
+ * Submits the recorded command buffer with a per slot fence and returns without waiting,
+ * the completion thread takes it from there. Must be called with the command pool locked,
+ * which this function unlocks, and after @ref readback_wait_for_slot. A @p recorded command
+ * buffer is one kept by the color conversion, already ended and never freed.
+ */
+static void
+readback_submit_locked(struct ems_compositor *c,
+                       VkCommandBuffer cmd,
+                       bool recorded,
+                       struct comp_swapchain *lsc,
+                       struct comp_swapchain *rsc,
+                       struct comp_swapchain *ldsc,
+                       struct comp_swapchain *rdsc,
+                       const struct ems_overlay_layers *overlays,
+                       struct xrt_frame **frame_ptr,
+                       const em_proto_DownMessage *msg,
+                       const struct ems_gstreamer_src_roi *rois,
+                       uint32_t roi_count,
+                       const struct xrt_vec2 head_motion[2])
+{
+	struct vk_bundle *vk = get_vk(c);
+	VkResult ret;
+
+	// Only we advance submitted, so the slot readback_wait_for_slot waited for stays free.
+	os_thread_helper_lock(&c->readback.oth);
+	struct ems_readback_in_flight *slot = &c->readback.slots[c->readback.submitted % EMS_READBACK_MAX_IN_FLIGHT];
+	os_thread_helper_unlock(&c->readback.oth);
+
+	if (!recorded) {
+		ret = vk->vkEndCommandBuffer(cmd);
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vkEndCommandBuffer: %s", vk_result_string(ret));
+			goto err_free;
+		}
+	}
+
+	ret = vk->vkResetFences(vk->device, 1, &slot->fence);
 	if (ret != VK_SUCCESS) {
-		EMS_COMP_ERROR(c, "vk_cmd_pool_create_and_begin_cmd_buffer_locked: %s", vk_result_string(ret));
-		xrt_frame_reference(&frame, NULL);
+		EMS_COMP_ERROR(c, "vkResetFences: %s", vk_result_string(ret));
+		goto err_free;
+	}
+
+	{
+		VkSubmitInfo submit_info = {};
+		submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submit_info.commandBufferCount = 1;
+		submit_info.pCommandBuffers = &cmd;
+
+		ret = vk_cmd_submit_locked(vk, 1, &submit_info, slot->fence);
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vk_cmd_submit_locked: %s", vk_result_string(ret));
+			goto err_free;
+		}
+	}
+
+	vk_cmd_pool_unlock(&c->cmd_pool);
+
+	slot->cmd = cmd;
+	slot->recorded = recorded;
+	slot->msg = *msg;
+	slot->roi_count = roi_count;
+	for (uint32_t i = 0; i < roi_count; i++) {
+		slot->rois[i] = rois[i];
+	}
+	slot->head_motion[0] = head_motion[0];
+	slot->head_motion[1] = head_motion[1];
+	slot->frame = *frame_ptr; // Transfer the reference.
+	*frame_ptr = NULL;
+
+	// The GPU reads from these until the fence signals, keep them alive.
+	xrt_swapchain_reference(&slot->xscs[0], &lsc->base.base);
+	xrt_swapchain_reference(&slot->xscs[1], &rsc->base.base);
+	xrt_swapchain_reference(&slot->xscs[2], ldsc != NULL ? &ldsc->base.base : NULL);
+	xrt_swapchain_reference(&slot->xscs[3], rdsc != NULL ? &rdsc->base.base : NULL);
+	for (uint32_t i = 0; i < EMS_COLOR_CONVERT_MAX_LAYERS; i++) {
+		struct comp_swapchain *sc = (overlays != NULL && i < overlays->count) ? overlays->scs[i] : NULL;
+		xrt_swapchain_reference(&slot->xscs[4 + i], sc != NULL ? &sc->base.base : NULL);
+	}
+
+	os_thread_helper_lock(&c->readback.oth);
+	c->readback.submitted++;
+	os_thread_helper_signal_locked(&c->readback.oth);
+	os_thread_helper_unlock(&c->readback.oth);
+
+	return;
+
+err_free:
+	if (!recorded) {
+		vk->vkFreeCommandBuffers(vk->device, c->cmd_pool.pool, 1, &cmd);
+	}
+	vk_cmd_pool_unlock(&c->cmd_pool);
+	release_frame(c, frame_ptr);
+}
+
+static bool
+compositor_init_readback(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	c->readback.max_in_flight = MIN(ems_arguments_get()->readback_frames_in_flight, EMS_READBACK_MAX_IN_FLIGHT);
+	if (c->readback.max_in_flight <= 1) {
+		c->readback.max_in_flight = 1;
+		EMS_COMP_INFO(c, "Using synchronous readback.");
+		return true;
+	}
+
+	int iret = os_thread_helper_init(&c->readback.oth);
+	if (iret != 0) {
+		EMS_COMP_ERROR(c, "os_thread_helper_init: %i", iret);
+		c->readback.max_in_flight = 1;
+		return false;
+	}
+
+	for (uint32_t i = 0; i < EMS_READBACK_MAX_IN_FLIGHT; i++) {
+		VkFenceCreateInfo fence_info = {};
+		fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+		VkResult ret = vk->vkCreateFence(vk->device, &fence_info, NULL, &c->readback.slots[i].fence);
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vkCreateFence: %s", vk_result_string(ret));
+			return false;
+		}
+	}
+
+	iret = os_thread_helper_start(&c->readback.oth, readback_completion_thread, c);
+	if (iret != 0) {
+		EMS_COMP_ERROR(c, "os_thread_helper_start: %i", iret);
+		return false;
+	}
+
+	EMS_COMP_INFO(c, "Using asynchronous readback with %u frames in flight.", c->readback.max_in_flight);
+
+	return true;
+}
+
+static void
+compositor_fini_readback(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (c->readback.max_in_flight <= 1) {
 		return;
 	}
 
+	// Stops and joins the completion thread.
+	os_thread_helper_destroy(&c->readback.oth);
+
+	// Drain anything the thread did not get to.
+	while (c->readback.completed < c->readback.submitted) {
+		readback_complete_slot(c, &c->readback.slots[c->readback.completed % EMS_READBACK_MAX_IN_FLIGHT]);
+		c->readback.completed++;
+	}
+
+	for (uint32_t i = 0; i < EMS_READBACK_MAX_IN_FLIGHT; i++) {
+		if (c->readback.slots[i].fence != VK_NULL_HANDLE) {
+			vk->vkDestroyFence(vk->device, c->readback.slots[i].fence, NULL);
+			c->readback.slots[i].fence = VK_NULL_HANDLE;
+		}
+	}
+}
+
+
+/*
+ *
+ * Frame handling functions.
+ *
+ */
+
+/*!
+ * Blits both views side-by-side into the bounce image and copies that into
+ * the host visible readback image, the old CPU color conversion path.
+ */
+static void
+record_blit_and_copy(struct ems_compositor *c,
+                     VkCommandBuffer cmd,
+                     struct vk_image_readback_to_xf *wrap,
+                     const struct xrt_layer_projection_view_data *lvd,
+                     const struct xrt_layer_projection_view_data *rvd,
+                     struct comp_swapchain *lsc,
+                     struct comp_swapchain *rsc)
+{
+	struct vk_bundle *vk = get_vk(c);
+
 	// Blit images side-by-side (does scaling).
 	{
 		struct vk_cmd_blit_images_side_by_side_info info = {};
@@ -416,7 +888,7 @@ pack_blit_and_encode(struct ems_compositor *c,
 		info.dst.old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
 		info.dst.src_access_mask = VK_ACCESS_TRANSFER_READ_BIT;
 		info.dst.src_stage_mask = VK_PIPELINE_STAGE_TRANSFER_BIT;
-		info.dst.size = (xrt_size){READBACK_W, READBACK_H};
+		info.dst.size = (xrt_size){(int)c->stream_extent.width, (int)c->stream_extent.height};
 		info.dst.fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
 		info.dst.fm_image.base_array_layer = 0;
 		info.dst.fm_image.image = c->bounce.image;
@@ -442,7 +914,7 @@ pack_blit_and_encode(struct ems_compositor *c,
 		info.dst.fm_image.base_array_layer = 0;
 		info.dst.fm_image.image = wrap->image;
 
-		info.size = (xrt_size){READBACK_W, READBACK_H};
+		info.size = (xrt_size){(int)c->stream_extent.width, (int)c->stream_extent.height};
 
 		vk_cmd_copy_image_locked(vk, cmd, &info);
 	}
@@ -501,9 +973,446 @@ pack_blit_and_encode(struct ems_compositor *c,
 		    VK_PIPELINE_STAGE_HOST_BIT,           // dstStageMask
 		    first_color_level_subresource_range); // subresourceRange
 	}
+}
+
+static struct xrt_normalized_rect
+to_normalized_rect(const struct xrt_sub_image *sub, const struct comp_swapchain *sc)
+{
+	float width = (float)sc->vkic.info.width;
+	float height = (float)sc->vkic.info.height;
+
+	struct xrt_normalized_rect rect;
+	rect.x = (float)sub->rect.offset.w / width;
+	rect.y = (float)sub->rect.offset.h / height;
+	rect.w = (float)sub->rect.extent.w / width;
+	rect.h = (float)sub->rect.extent.h / height;
+
+	return rect;
+}
+
+/*!
+ * What the color conversion samples for each view. With a depth band the
+ * depth swapchains, which may be null, are written into it.
+ */
+static void
+get_color_convert_views(const struct xrt_layer_projection_view_data *lvd,
+                        const struct xrt_layer_projection_view_data *rvd,
+                        struct comp_swapchain *lsc,
+                        struct comp_swapchain *rsc,
+                        const struct xrt_layer_depth_data *ldd,
+                        const struct xrt_layer_depth_data *rdd,
+                        struct comp_swapchain *ldsc,
+                        struct comp_swapchain *rdsc,
+                        struct ems_color_convert_view views[2])
+{
+	for (int view = 0; view < 2; view++) {
+		const xrt_layer_projection_view_data *data = (view == 0) ? lvd : rvd;
+		struct comp_swapchain *sc = (view == 0) ? lsc : rsc;
+		struct comp_swapchain_image *image = &sc->images[data->sub.image_index];
+
+		views[view].image_view = image->views.no_alpha[data->sub.array_index];
+		views[view].sampler = image->sampler;
+		views[view].rect = to_normalized_rect(&data->sub, sc);
+		views[view].srgb = ems_color_convert_format_is_srgb((VkFormat)sc->vkic.info.format);
+		views[view].fov = data->fov;
+
+		const struct xrt_layer_depth_data *depth = (view == 0) ? ldd : rdd;
+		struct comp_swapchain *dsc = (view == 0) ? ldsc : rdsc;
+		if (depth == NULL || dsc == NULL) {
+			continue;
+		}
+
+		// Swapchain views of depth formats only have the depth aspect.
+		struct comp_swapchain_image *depth_image = &dsc->images[depth->sub.image_index];
+		views[view].depth_image_view = depth_image->views.no_alpha[depth->sub.array_index];
+		views[view].depth_sampler = depth_image->sampler;
+		views[view].depth_rect = to_normalized_rect(&depth->sub, dsc);
+	}
+
+	// Without depth views the band still has to be filled, sample the color instead.
+	for (int view = 0; view < 2; view++) {
+		if (views[view].depth_image_view == VK_NULL_HANDLE) {
+			views[view].depth_image_view = views[view].image_view;
+			views[view].depth_sampler = views[view].sampler;
+			views[view].depth_rect = views[view].rect;
+		}
+	}
+}
+
+/*!
+ * Converts both views to NV12 in one compute dispatch, straight into the
+ * host visible frame, no bounce image or copy needed.
+ */
+static void
+record_color_convert(struct ems_compositor *c,
+                     VkCommandBuffer cmd,
+                     struct xrt_frame *frame,
+                     const struct xrt_layer_projection_view_data *lvd,
+                     const struct xrt_layer_projection_view_data *rvd,
+                     struct comp_swapchain *lsc,
+                     struct comp_swapchain *rsc,
+                     const struct xrt_layer_depth_data *ldd,
+                     const struct xrt_layer_depth_data *rdd,
+                     struct comp_swapchain *ldsc,
+                     struct comp_swapchain *rdsc,
+                     const struct ems_overlay_layers *overlays,
+                     const struct xrt_size *active_size)
+{
+	struct vk_bundle *vk = get_vk(c);
+	struct ems_color_convert_view views[2] = {};
+	get_color_convert_views(lvd, rvd, lsc, rsc, ldd, rdd, ldsc, rdsc, views);
+
+	ems_color_convert_record(vk, c->color_convert, cmd, frame, views, c->foveate ? &c->foveation : NULL,
+	                         c->depth_height, overlays != NULL ? overlays->layers : NULL,
+	                         overlays != NULL ? overlays->count : 0, active_size);
+}
+
+/*!
+ * Like @ref record_color_convert, but a recording kept by the conversion that
+ * the same views and rects as an earlier frame get back without recording.
+ */
+static VkCommandBuffer
+get_color_convert_recording(struct ems_compositor *c,
+                            struct xrt_frame *frame,
+                            const struct xrt_layer_projection_view_data *lvd,
+                            const struct xrt_layer_projection_view_data *rvd,
+                            struct comp_swapchain *lsc,
+                            struct comp_swapchain *rsc,
+                            const struct xrt_layer_depth_data *ldd,
+                            const struct xrt_layer_depth_data *rdd,
+                            struct comp_swapchain *ldsc,
+                            struct comp_swapchain *rdsc,
+                            const struct ems_overlay_layers *overlays,
+                            const struct xrt_size *active_size)
+{
+	struct vk_bundle *vk = get_vk(c);
+	struct ems_color_convert_view views[2] = {};
+	get_color_convert_views(lvd, rvd, lsc, rsc, ldd, rdd, ldsc, rdsc, views);
+
+	return ems_color_convert_get_recording(vk, c->color_convert, frame, views, c->foveate ? &c->foveation : NULL,
+	                                       c->depth_height, overlays != NULL ? overlays->layers : NULL,
+	                                       overlays != NULL ? overlays->count : 0, active_size,
+	                                       c->swapchain_generation.load());
+}
+
+/*!
+ * Follows the encode times and the bitrate with the scale of the views, see @ref ems_dynamic_resolution_update.
+ */
+static void
+update_dynamic_resolution(struct ems_compositor *c, uint64_t now_ns)
+{
+	struct ems_telemetry_percentiles encode = {};
+	uint64_t encode_p95_ns = 0;
+	if (ems_telemetry_get_stage(c->instance->telemetry, EMS_TELEMETRY_STAGE_ENCODE_OUT, &encode)) {
+		encode_p95_ns = (uint64_t)(encode.p95_ms * U_TIME_1MS_IN_NS);
+	}
+
+	ems_dynamic_resolution_update(&c->resolution, now_ns, c->settings.frame_interval_ns, encode_p95_ns,
+	                              ems_gstreamer_pipeline_get_bitrate(c->gstreamer_pipeline),
+	                              ems_arguments_get()->bitrate);
+}
+
+/*!
+ * Pixels each view is shrunk to at the current scale, even so the chroma of the edge is its own.
+ */
+static struct xrt_size
+get_active_size(const struct ems_compositor *c)
+{
+	uint32_t half_width = c->stream_extent.width / 2;
+	uint32_t color_height = c->stream_extent.height - c->depth_height;
+
+	struct xrt_size size;
+	size.w = (int)MAX((uint32_t)((float)half_width * c->resolution.scale) & ~1u, 2u);
+	size.h = (int)MAX((uint32_t)((float)color_height * c->resolution.scale) & ~1u, 2u);
+
+	return size;
+}
+
+//! Where source coordinate @p s of a view ends up in the frame on one axis of the foveation warp.
+static float
+foveate_axis(float s, float source_min, float source_max, float encoded_min, float encoded_max)
+{
+	if (s < source_min) {
+		return s * encoded_min / source_min;
+	}
+	if (s > source_max) {
+		return encoded_max + (s - source_max) * (1.0f - encoded_max) / (1.0f - source_max);
+	}
+	return encoded_min + (s - source_min) * (encoded_max - encoded_min) / (source_max - source_min);
+}
+
+/*!
+ * Rectangles around where the optical axis of each view lands in the frame,
+ * through the foveation warp and the scale of the views. The fovs are off
+ * centre on most headsets, towards the nose, so this follows the lenses of
+ * whichever headset the client has.
+ */
+static uint32_t
+get_lens_rois(const struct ems_compositor *c,
+              const struct xrt_layer_projection_view_data *lvd,
+              const struct xrt_layer_projection_view_data *rvd,
+              const struct xrt_size *active_size,
+              struct ems_gstreamer_src_roi rois[2])
+{
+	const struct ems_arguments *args = ems_arguments_get();
+
+	uint32_t half_width = c->stream_extent.width / 2;
+	uint32_t color_height = c->stream_extent.height - c->depth_height;
+	float view_w = active_size != NULL ? (float)active_size->w : (float)half_width;
+	float view_h = active_size != NULL ? (float)active_size->h : (float)color_height;
+	float half_size = args->roi_size * 0.5f;
+
+	for (uint32_t view = 0; view < 2; view++) {
+		const struct xrt_fov *fov = view == 0 ? &lvd->fov : &rvd->fov;
+		float tan_left = tanf(fov->angle_left);
+		float tan_right = tanf(fov->angle_right);
+		float tan_up = tanf(fov->angle_up);
+		float tan_down = tanf(fov->angle_down);
+
+		// Normalized with y down, as the views are sampled.
+		float cx = -tan_left / (tan_right - tan_left);
+		float cy = tan_up / (tan_up - tan_down);
+
+		float x0 = CLAMP(cx - half_size, 0.0f, 1.0f);
+		float x1 = CLAMP(cx + half_size, 0.0f, 1.0f);
+		float y0 = CLAMP(cy - half_size, 0.0f, 1.0f);
+		float y1 = CLAMP(cy + half_size, 0.0f, 1.0f);
+
+		if (c->foveate) {
+			const struct ems_color_convert_foveation *f = &c->foveation;
+			x0 = foveate_axis(x0, f->source_min.x, f->source_max.x, f->encoded_min.x, f->encoded_max.x);
+			x1 = foveate_axis(x1, f->source_min.x, f->source_max.x, f->encoded_min.x, f->encoded_max.x);
+			y0 = foveate_axis(y0, f->source_min.y, f->source_max.y, f->encoded_min.y, f->encoded_max.y);
+			y1 = foveate_axis(y1, f->source_min.y, f->source_max.y, f->encoded_min.y, f->encoded_max.y);
+		}
+
+		rois[view].x = view * half_width + (uint32_t)(x0 * view_w);
+		rois[view].y = (uint32_t)(y0 * view_h);
+		rois[view].w = (uint32_t)((x1 - x0) * view_w);
+		rois[view].h = (uint32_t)((y1 - y0) * view_h);
+		rois[view].qp_delta = args->roi_qp_delta;
+	}
+
+	return 2;
+}
+
+/*!
+ * How far the rotation of each view since the last frame packed moved its
+ * content, as a fraction of the view through the foveation warp. Follows where
+ * the optical axis of the previous view is seen from the current one.
+ */
+static void
+get_head_motion(struct ems_compositor *c,
+                const struct xrt_layer_projection_view_data *lvd,
+                const struct xrt_layer_projection_view_data *rvd,
+                struct xrt_vec2 out_motion[2])
+{
+	bool have_previous = c->have_motion_orientations;
+	c->have_motion_orientations = true;
+
+	for (uint32_t view = 0; view < 2; view++) {
+		const struct xrt_layer_projection_view_data *vd = view == 0 ? lvd : rvd;
+		out_motion[view] = {0.0f, 0.0f};
+
+		struct xrt_vec3 forward = {0.0f, 0.0f, -1.0f};
+		struct xrt_vec3 previous_axis;
+		struct xrt_quat inverse;
+		struct xrt_vec3 axis;
+		math_quat_rotate_vec3(&c->motion_orientations[view], &forward, &previous_axis);
+		math_quat_invert(&vd->pose.orientation, &inverse);
+		math_quat_rotate_vec3(&inverse, &previous_axis, &axis);
+		c->motion_orientations[view] = vd->pose.orientation;
+
+		// Turned away by most of the fov, nothing left to compare.
+		if (!have_previous || axis.z > -0.1f) {
+			continue;
+		}
+
+		float tan_left = tanf(vd->fov.angle_left);
+		float tan_right = tanf(vd->fov.angle_right);
+		float tan_up = tanf(vd->fov.angle_up);
+		float tan_down = tanf(vd->fov.angle_down);
+
+		// Normalized with y down, as the views are sampled.
+		float x0 = -tan_left / (tan_right - tan_left);
+		float y0 = tan_up / (tan_up - tan_down);
+		float x1 = (axis.x / -axis.z - tan_left) / (tan_right - tan_left);
+		float y1 = (tan_up - axis.y / -axis.z) / (tan_up - tan_down);
+
+		if (c->foveate) {
+			const struct ems_color_convert_foveation *f = &c->foveation;
+			x0 = foveate_axis(x0, f->source_min.x, f->source_max.x, f->encoded_min.x, f->encoded_max.x);
+			x1 = foveate_axis(x1, f->source_min.x, f->source_max.x, f->encoded_min.x, f->encoded_max.x);
+			y0 = foveate_axis(y0, f->source_min.y, f->source_max.y, f->encoded_min.y, f->encoded_max.y);
+			y1 = foveate_axis(y1, f->source_min.y, f->source_max.y, f->encoded_min.y, f->encoded_max.y);
+		}
+
+		out_motion[view] = {x1 - x0, y1 - y0};
+	}
+}
+
+/*!
+ * Packs both views, and their depth if the layer has it, into one frame and
+ * hands it to the encoder. The depth arguments are null for layers without.
+ * The @p overlays, if any, are blended over the views in the same pass.
+ */
+void
+pack_blit_and_encode(struct ems_compositor *c,
+                     const struct xrt_layer_projection_view_data *lvd,
+                     const struct xrt_layer_projection_view_data *rvd,
+                     struct comp_swapchain *lsc,
+                     struct comp_swapchain *rsc,
+                     const struct xrt_layer_depth_data *ldd,
+                     const struct xrt_layer_depth_data *rdd,
+                     struct comp_swapchain *ldsc,
+                     struct comp_swapchain *rdsc,
+                     const struct ems_overlay_layers *overlays)
+{
+	COMP_TRACE_MARKER();
+
+	uint64_t commit_ns = os_monotonic_get_ns();
+
+	if (c->offset_ns == 0) {
+		uint64_t now = os_monotonic_get_ns();
+		c->offset_ns = now;
+		c->gstreamer_src->offset_ns = now;
+	}
+	VkResult ret;
+
+	struct vk_image_readback_to_xf *wrap = NULL;
+	struct vk_bundle *vk = &c->base.vk;
+
+	// Usefull.
+	xrt_frame *frame = NULL;
+
+	// Getting frame
+	if (c->pooled_frames) {
+		// Drop the frame before any GPU work if the pipeline still holds every buffer or is over its budget.
+		if (!ems_gstreamer_src_acquire_frame(c->gstreamer_src, &frame)) {
+			uint64_t skipped = c->gstreamer_src->skipped_frames;
+			if (skipped % 90 == 1) {
+				EMS_COMP_WARN(c, "Pipeline is behind, skipped %" PRIu64 " frames so far.", skipped);
+			}
+			return;
+		}
+	} else if (c->color_convert != NULL) {
+		if (!ems_color_convert_get_unused_frame(c->color_convert, &frame)) {
+			EMS_COMP_ERROR(c, "ems_color_convert_get_unused_frame: Failed!");
+			return;
+		}
+	} else {
+		if (!vk_image_readback_to_xf_pool_get_unused_frame(vk, c->pool, &wrap)) {
+			EMS_COMP_ERROR(c, "vk_image_readback_to_xf_pool_get_unused_frame: Failed!");
+			return;
+		}
+		frame = &wrap->base_frame;
+	}
+
+	struct xrt_size active_size = {};
+	if (c->dynamic_resolution) {
+		update_dynamic_resolution(c, commit_ns);
+		active_size = get_active_size(c);
+	}
+
+	// The app cycles through a few swapchain images, so the asynchronous GPU path mostly submits a kept recording.
+	bool recorded = c->color_convert != NULL && c->readback.max_in_flight > 1;
+
+	const VkCommandBufferUsageFlags flags = 0;
+	VkCommandBuffer cmd = {};
+
+	if (c->readback.max_in_flight > 1) {
+		readback_wait_for_slot(c);
+	}
+
+	if (recorded) {
+		cmd = get_color_convert_recording(c, frame, lvd, rvd, lsc, rsc, ldd, rdd, ldsc, rdsc, overlays,
+		                                  c->dynamic_resolution ? &active_size : NULL);
+		if (cmd == VK_NULL_HANDLE) {
+			EMS_COMP_ERROR(c, "ems_color_convert_get_recording: Failed!");
+			release_frame(c, &frame);
+			return;
+		}
+
+		// For submitting commands.
+		vk_cmd_pool_lock(&c->cmd_pool);
+	} else {
+		// For submitting commands.
+		vk_cmd_pool_lock(&c->cmd_pool);
+
+		ret = vk_cmd_pool_create_and_begin_cmd_buffer_locked(vk, &c->cmd_pool, flags, &cmd);
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vk_cmd_pool_create_and_begin_cmd_buffer_locked: %s", vk_result_string(ret));
+			vk_cmd_pool_unlock(&c->cmd_pool);
+			release_frame(c, &frame);
+			return;
+		}
+
+		if (c->color_convert != NULL) {
+			record_color_convert(c, cmd, frame, lvd, rvd, lsc, rsc, ldd, rdd, ldsc, rdsc, overlays,
+			                     c->dynamic_resolution ? &active_size : NULL);
+		} else {
+			record_blit_and_copy(c, cmd, wrap, lvd, rvd, lsc, rsc);
+		}
+	}
 
 	// Done submitting commands.
 
+	uint32_t sequence = c->image_sequence++;
+	ems_telemetry_stamp(c->instance->telemetry, sequence, EMS_TELEMETRY_STAGE_LAYER_COMMIT, commit_ns);
+	EMS_TRACE_FRAME_FLOW("layer_commit", sequence);
+
+	// set the latest Downstream mesg before pushing the frame
+	em_proto_DownMessage msg = em_proto_DownMessage_init_default;
+	msg.has_frame_data = true;
+	msg.frame_data.frame_sequence_id = sequence;
+	msg.frame_data.has_P_localSpace_view0 = true;
+	msg.frame_data.P_localSpace_view0 = to_proto(lvd->pose);
+	msg.frame_data.has_P_localSpace_view1 = true;
+	msg.frame_data.P_localSpace_view1 = to_proto(rvd->pose);
+	if (c->foveate) {
+		msg.frame_data.has_foveation = true;
+		msg.frame_data.foveation = to_proto(c->foveation);
+	}
+	if (c->dynamic_resolution) {
+		msg.frame_data.has_active_size = true;
+		msg.frame_data.active_size.x = (float)active_size.w / (float)(c->stream_extent.width / 2);
+		msg.frame_data.active_size.y =
+		    (float)active_size.h / (float)(c->stream_extent.height - c->depth_height);
+	}
+	if (c->depth_height > 0) {
+		msg.frame_data.has_depth = true;
+		msg.frame_data.depth.color_fraction =
+		    (float)(c->stream_extent.height - c->depth_height) / (float)c->stream_extent.height;
+
+		// The client has one depth range for both views.
+		if (ldd != NULL && ldsc != NULL && rdsc != NULL) {
+			msg.frame_data.depth.valid = true;
+			msg.frame_data.depth.min_depth = ldd->min_depth;
+			msg.frame_data.depth.max_depth = ldd->max_depth;
+			msg.frame_data.depth.near_z = ldd->near_z;
+			msg.frame_data.depth.far_z = ldd->far_z;
+		}
+	}
+
+	struct ems_gstreamer_src_roi rois[EMS_GSTREAMER_SRC_MAX_ROIS];
+	uint32_t roi_count = c->roi ? get_lens_rois(c, lvd, rvd, c->dynamic_resolution ? &active_size : NULL, rois) : 0;
+
+	struct xrt_vec2 head_motion[2] = {};
+	if (c->motion_vectors) {
+		get_head_motion(c, lvd, rvd, head_motion);
+	}
+
+	frame->source_sequence = sequence;
+	frame->source_id = 0;
+	wrap = NULL; // important to keep this line after setting "msg.frame_sequence_id" above.
+
+	if (c->readback.max_in_flight > 1) {
+		// Hands over the command buffer and our frame reference, unlocks the pool.
+		readback_submit_locked(c, cmd, recorded, lsc, rsc, ldsc, rdsc, overlays, &frame, &msg, rois, roi_count,
+		                       head_motion);
+		return;
+	}
+
 	// Waits for command to finish.
 	ret = vk_cmd_pool_end_submit_wait_and_free_cmd_buffer_locked(vk, &c->cmd_pool, cmd);
 
@@ -513,43 +1422,121 @@ pack_blit_and_encode(struct ems_compositor *c,
 	// Do checking here.
 	if (ret != VK_SUCCESS) {
 		EMS_COMP_ERROR(c, "vk_cmd_pool_end_submit_wait_and_free_cmd_buffer_locked: %s", vk_result_string(ret));
-		xrt_frame_reference(&frame, NULL);
+		release_frame(c, &frame);
 		return;
 	}
 
-	// HACK
-	wrap->base_frame.timestamp = os_monotonic_get_ns();
-	wrap->base_frame.source_timestamp = wrap->base_frame.timestamp;
-	wrap->base_frame.source_sequence = c->image_sequence++;
-	wrap->base_frame.source_id = 0;
+	push_readback_frame(c, frame, &msg, rois, roi_count, head_motion);
 
-	// set the latest Downstream mesg before pushing the frame
-	em_proto_DownMessage msg = em_proto_DownMessage_init_default;
-	msg.has_frame_data = true;
-	msg.frame_data.frame_sequence_id = wrap->base_frame.source_sequence;
-	msg.frame_data.display_time = wrap->base_frame.timestamp;
-	msg.frame_data.has_P_localSpace_view0 = true;
-	msg.frame_data.P_localSpace_view0 = to_proto(lvd->pose);
-	msg.frame_data.has_P_localSpace_view1 = true;
-	msg.frame_data.P_localSpace_view1 = to_proto(rvd->pose);
+	// Dereference this frame - by now we should have pushed it.
+	release_frame(c, &frame);
+}
 
-	wrap = NULL; // important to keep this line after setting "msg.frame_sequence_id" above.
+/*!
+ * The views of the projection layer, both in the space its poses are in.
+ */
+static void
+get_projection_views(const struct comp_layer *projection,
+                     const struct xrt_layer_projection_view_data **out_lvd,
+                     const struct xrt_layer_projection_view_data **out_rvd)
+{
+	if (projection->data.type == XRT_LAYER_STEREO_PROJECTION_DEPTH) {
+		*out_lvd = &projection->data.stereo_depth.l;
+		*out_rvd = &projection->data.stereo_depth.r;
+	} else {
+		*out_lvd = &projection->data.stereo.l;
+		*out_rvd = &projection->data.stereo.r;
+	}
+}
 
+/*!
+ * Adds a quad or cylinder layer to be blended over @p projection, does
+ * nothing if the GPU does not convert or there are too many already.
+ */
+static void
+add_overlay_layer(struct ems_compositor *c,
+                  struct ems_overlay_layers *overlays,
+                  const struct comp_layer *layer,
+                  const struct comp_layer *projection)
+{
+	if (c->color_convert == NULL) {
+		EMS_COMP_DEBUG(c, "Quad and cylinder layers need the GPU color conversion, skipping.");
+		return;
+	}
+	if (overlays->count >= EMS_COLOR_CONVERT_MAX_LAYERS) {
+		EMS_COMP_DEBUG(c, "More than %u quad and cylinder layers, skipping.", EMS_COLOR_CONVERT_MAX_LAYERS);
+		return;
+	}
 
-	if (!c->pipeline_playing) {
-		ems_gstreamer_pipeline_play(c->gstreamer_pipeline);
-		c->pipeline_playing = true;
+	struct ems_color_convert_layer *out = &overlays->layers[overlays->count];
+	*out = {};
+
+	const struct xrt_sub_image *sub;
+	struct xrt_pose pose;
+	uint32_t visibility;
+	if (layer->data.type == XRT_LAYER_QUAD) {
+		const struct xrt_layer_quad_data *quad = &layer->data.quad;
+		if (quad->size.x <= 0.0f || quad->size.y <= 0.0f) {
+			return;
+		}
+		out->type = EMS_COLOR_CONVERT_LAYER_QUAD;
+		out->size = quad->size;
+		sub = &quad->sub;
+		pose = quad->pose;
+		visibility = quad->visibility;
+	} else {
+		const struct xrt_layer_cylinder_data *cylinder = &layer->data.cylinder;
+		if (cylinder->radius <= 0.0f || cylinder->central_angle <= 0.0f || cylinder->aspect_ratio <= 0.0f) {
+			return;
+		}
+		out->type = EMS_COLOR_CONVERT_LAYER_CYLINDER;
+		out->radius = cylinder->radius;
+		out->central_angle = cylinder->central_angle;
+		out->aspect_ratio = cylinder->aspect_ratio;
+		sub = &cylinder->sub;
+		pose = cylinder->pose;
+		visibility = cylinder->visibility;
 	}
 
-	u_sink_debug_push_frame(&c->debug_sink, frame);
+	struct comp_swapchain *sc = layer->sc_array[0];
+	struct comp_swapchain_image *image = &sc->images[sub->image_index];
 
-	GBytes *downMsg_bytes = ems_gstreamer_pipeline_encode_down_msg(&msg);
-	ems_gstreamer_src_push_frame(c->gstreamer_src, frame, downMsg_bytes);
+	out->image_view = image->views.alpha[sub->array_index];
+	out->sampler = image->sampler;
+	out->rect = to_normalized_rect(sub, sc);
+	out->srgb = ems_color_convert_format_is_srgb((VkFormat)sc->vkic.info.format);
+	out->blend_alpha = (layer->data.flags & XRT_LAYER_COMPOSITION_BLEND_TEXTURE_SOURCE_ALPHA_BIT) != 0;
+	out->unpremultiplied = (layer->data.flags & XRT_LAYER_COMPOSITION_UNPREMULTIPLIED_ALPHA_BIT) != 0;
+	out->view_mask = visibility & 3;
 
-	// TODO send data channel message with pose and fov here?
+	const struct xrt_layer_projection_view_data *views[2];
+	get_projection_views(projection, &views[0], &views[1]);
 
-	// Dereference this frame - by now we should have pushed it.
-	xrt_frame_reference(&frame, NULL);
+	/*
+	 * A view space layer moves with the head. There is no head pose in the
+	 * layers, so take the one between the eyes, oriented like the left one.
+	 */
+	struct xrt_pose head = XRT_POSE_IDENTITY;
+	if ((layer->data.flags & XRT_LAYER_COMPOSITION_VIEW_SPACE_BIT) != 0) {
+		head.orientation = views[0]->pose.orientation;
+		head.position.x = (views[0]->pose.position.x + views[1]->pose.position.x) * 0.5f;
+		head.position.y = (views[0]->pose.position.y + views[1]->pose.position.y) * 0.5f;
+		head.position.z = (views[0]->pose.position.z + views[1]->pose.position.z) * 0.5f;
+	}
+
+	struct xrt_pose head_inv;
+	math_pose_invert(&head, &head_inv);
+	struct xrt_pose layer_inv;
+	math_pose_invert(&pose, &layer_inv);
+
+	for (uint32_t view = 0; view < 2; view++) {
+		struct xrt_pose view_in_head;
+		math_pose_transform(&head_inv, &views[view]->pose, &view_in_head);
+		math_pose_transform(&layer_inv, &view_in_head, &out->from_view[view]);
+	}
+
+	overlays->scs[overlays->count] = sc;
+	overlays->count++;
 }
 
 
@@ -595,6 +1582,8 @@ ems_compositor_predict_frame(struct xrt_compositor *xc,
 	uint64_t null_present_slop_ns = 0;
 	uint64_t null_min_display_period_ns = 0;
 
+	compositor_update_framerate(c);
+
 	u_pc_predict(                        //
 	    c->upc,                          // upc
 	    now_ns,                          // now_ns
@@ -606,6 +1595,9 @@ ems_compositor_predict_frame(struct xrt_compositor *xc,
 	    out_predicted_display_period_ns, // out_predicted_display_period_ns
 	    &null_min_display_period_ns);    // out_min_display_period_ns
 
+	// The frame is displayed on the client, well after we push it. Apps render for that time.
+	*out_predicted_display_time_ns += ems_latency_get_display_latency_ns(c->instance->latency, 0);
+
 	return XRT_SUCCESS;
 }
 
@@ -663,6 +1655,15 @@ ems_compositor_layer_commit(struct xrt_compositor *xc, xrt_graphics_sync_handle_
 
 	u_graphics_sync_unref(&sync_handle);
 
+	// The frames are committed from the IPC server's thread, which we do not create.
+	if (!c->render_thread_scheduled) {
+		c->render_thread_scheduled = true;
+		int sched_ret = em_thread_sched_apply(EM_THREAD_ROLE_RENDER);
+		if (sched_ret != 0) {
+			EMS_COMP_WARN(c, "Could not schedule the compositor thread: %s", strerror(sched_ret));
+		}
+	}
+
 	/*
 	 * Time keeping needed to keep the pacer happy.
 	 */
@@ -674,34 +1675,45 @@ ems_compositor_layer_commit(struct xrt_compositor *xc, xrt_graphics_sync_handle_
 	}
 
 	// We want to render here. comp_base filled c->base.slot.layers for us.
+	const struct comp_layer *projection = NULL;
+	struct ems_overlay_layers overlays = {};
+
 	for (uint32_t i = 0; i < c->base.slot.layer_count; i++) {
-		comp_layer &layer = c->base.slot.layers[i];
+		const comp_layer &layer = c->base.slot.layers[i];
 
 		switch (layer.data.type) {
-		case XRT_LAYER_STEREO_PROJECTION_DEPTH: {
-			const struct xrt_layer_stereo_projection_depth_data *stereo = &layer.data.stereo_depth;
-			const struct xrt_layer_projection_view_data *lvd = &stereo->l;
-			const struct xrt_layer_projection_view_data *rvd = &stereo->r;
-
-			struct comp_swapchain *left = layer.sc_array[0];
-			struct comp_swapchain *right = layer.sc_array[1];
-
-			pack_blit_and_encode(c, lvd, rvd, left, right);
-		} break;
-		case XRT_LAYER_STEREO_PROJECTION: {
-			const struct xrt_layer_stereo_projection_data *stereo = &layer.data.stereo;
-			const struct xrt_layer_projection_view_data *lvd = &stereo->l;
-			const struct xrt_layer_projection_view_data *rvd = &stereo->r;
-
-			struct comp_swapchain *left = layer.sc_array[0];
-			struct comp_swapchain *right = layer.sc_array[1];
-
-			pack_blit_and_encode(c, lvd, rvd, left, right);
-		} break;
+		case XRT_LAYER_STEREO_PROJECTION_DEPTH:
+		case XRT_LAYER_STEREO_PROJECTION:
+			if (projection == NULL) {
+				projection = &layer;
+			} else {
+				EMS_COMP_DEBUG(c, "Only the first projection layer is streamed.");
+			}
+			break;
+		case XRT_LAYER_QUAD:
+		case XRT_LAYER_CYLINDER:
+			// Anything under the projection layer is covered by it.
+			if (projection != NULL) {
+				add_overlay_layer(c, &overlays, &layer, projection);
+			}
+			break;
 		default: U_LOG_E("Unhandled layer type %d", layer.data.type); break;
 		}
 	}
 
+	if (projection != NULL && projection->data.type == XRT_LAYER_STEREO_PROJECTION_DEPTH) {
+		const struct xrt_layer_stereo_projection_depth_data *stereo = &projection->data.stereo_depth;
+
+		pack_blit_and_encode(c, &stereo->l, &stereo->r, projection->sc_array[0], projection->sc_array[1],
+		                     &stereo->l_d, &stereo->r_d, projection->sc_array[2], projection->sc_array[3],
+		                     &overlays);
+	} else if (projection != NULL) {
+		const struct xrt_layer_stereo_projection_data *stereo = &projection->data.stereo;
+
+		pack_blit_and_encode(c, &stereo->l, &stereo->r, projection->sc_array[0], projection->sc_array[1], NULL,
+		                     NULL, NULL, NULL, &overlays);
+	}
+
 	// When we are submitting to the GPU.
 	{
 		uint64_t now_ns = os_monotonic_get_ns();
@@ -770,6 +1782,37 @@ ems_compositor_get_swapchain_create_properties(struct xrt_compositor *xc,
 	return XRT_SUCCESS;
 }
 
+/*!
+ * Views of a new swapchain may get the handles of destroyed ones, keep the conversion from reusing their recordings.
+ */
+static xrt_result_t
+ems_compositor_create_swapchain(struct xrt_compositor *xc,
+                                const struct xrt_swapchain_create_info *info,
+                                struct xrt_swapchain **out_xsc)
+{
+	struct ems_compositor *c = ems_compositor(xc);
+
+	xrt_result_t xret = c->base_create_swapchain(xc, info, out_xsc);
+	c->swapchain_generation++;
+
+	return xret;
+}
+
+static xrt_result_t
+ems_compositor_import_swapchain(struct xrt_compositor *xc,
+                                const struct xrt_swapchain_create_info *info,
+                                struct xrt_image_native *native_images,
+                                uint32_t image_count,
+                                struct xrt_swapchain **out_xsc)
+{
+	struct ems_compositor *c = ems_compositor(xc);
+
+	xrt_result_t xret = c->base_import_swapchain(xc, info, native_images, image_count, out_xsc);
+	c->swapchain_generation++;
+
+	return xret;
+}
+
 static void
 ems_compositor_destroy(struct xrt_compositor *xc)
 {
@@ -780,13 +1823,26 @@ ems_compositor_destroy(struct xrt_compositor *xc)
 
 	EMS_COMP_DEBUG(c, "EMS_COMP_COMP_DESTROY");
 
+	// Flush in flight readbacks before stopping the pipeline.
+	compositor_fini_readback(c);
+
+	ems_vk_video_encoder_destroy(&c->vk_encoder);
+
 	ems_gstreamer_pipeline_stop_if_playing(c->gstreamer_pipeline);
 
+	// The pooled frames belong to color_convert, let go of them first.
+	ems_gstreamer_src_clear_frame_pool(c->gstreamer_src);
+	c->pooled_frames = false;
+
 	// Make sure we don't have anything to destroy.
 	comp_swapchain_shared_garbage_collect(&c->base.cscs);
 	comp_swapchain_shared_destroy(&c->base.cscs, vk);
 
-	vk_image_readback_to_xf_pool_destroy(vk, &c->pool);
+	if (c->pool != NULL) {
+		vk_image_readback_to_xf_pool_destroy(vk, &c->pool);
+	}
+
+	ems_color_convert_destroy(vk, &c->color_convert);
 
 	vk_cmd_pool_destroy(vk, &c->cmd_pool);
 
@@ -833,7 +1889,12 @@ ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **
 	// Needs to be done before functions are set as override function(s).
 	comp_base_init(&c->base);
 
+	c->base_create_swapchain = c->base.base.base.create_swapchain;
+	c->base_import_swapchain = c->base.base.base.import_swapchain;
+
 	c->base.base.base.get_swapchain_create_properties = ems_compositor_get_swapchain_create_properties;
+	c->base.base.base.create_swapchain = ems_compositor_create_swapchain;
+	c->base.base.base.import_swapchain = ems_compositor_import_swapchain;
 	c->base.base.base.begin_session = ems_compositor_begin_session;
 	c->base.base.base.end_session = ems_compositor_end_session;
 	c->base.base.base.predict_frame = ems_compositor_predict_frame;
@@ -853,7 +1914,9 @@ ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **
 	xrt_device *xdev = emsi.xsysd_base.roles.head;
 
 	c->settings.frame_interval_ns = xdev->hmd->screens[0].nominal_frame_interval_ns;
+	c->settings.framerate = ems_arguments_get()->framerate;
 	c->xdev = xdev;
+	c->instance = &emsi;
 
 	EMS_COMP_INFO(c, "Starting Electric Maple Server remote compositor!");
 
@@ -865,50 +1928,160 @@ ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **
 	if (!compositor_init_pacing(c) ||         //
 	    !compositor_init_vulkan(c) ||         //
 	    !compositor_init_sys_info(c, xdev) || //
-	    !compositor_init_info(c)) {           //
+	    !compositor_init_info(c) ||           //
+	    !compositor_init_readback(c)) {       //
 		EMS_COMP_DEBUG(c, "Failed to init compositor %p", (void *)c);
 		c->base.base.base.destroy(&c->base.base.base);
 
 		return XRT_ERROR_VULKAN;
 	}
 
-	VkExtent2D readback_extent = {};
-	readback_extent.height = READBACK_H;
-	readback_extent.width = READBACK_W;
+	struct ems_arguments *args = ems_arguments_get();
+
+	c->stream_extent = get_stream_extent(args);
+
+	// A quarter of the color rows is plenty for reprojection, depth is smooth.
+	if (args->depth) {
+		c->depth_height = MAX((c->stream_extent.height / 4) & ~1u, 2u);
+		c->stream_extent.height += c->depth_height;
+	}
+	EMS_COMP_INFO(c, "Streaming at %ux%u", c->stream_extent.width, c->stream_extent.height);
+
+	// Zero-copy only if asked for and the device can export dmabuf.
+	bool dmabuf = args->dmabuf;
+	if (dmabuf && !ems_color_convert_can_export_dmabuf(&c->base.vk)) {
+		EMS_COMP_WARN(c, "Device can not export dmabuf, falling back to host readback.");
+		dmabuf = false;
+	}
+
+	// Vulkan Video imports the NV12 frames into its own device, so they need to be exported.
+	bool vk_video = args->encoder_type == EMS_ENCODER_TYPE_VULKAN_H264;
+	if (vk_video && !ems_color_convert_can_export_dmabuf(&c->base.vk)) {
+		EMS_COMP_WARN(c, "Device can not export dmabuf, no Vulkan Video encoding.");
+		vk_video = false;
+	}
+
+	// Convert to NV12 on the GPU, fall back to CPU conversion if that fails.
+	enum xrt_format src_format = EMS_XRT_FORMAT_NV12;
+	bool export_frames = dmabuf || vk_video;
+	if (args->cpu_color_convert ||
+	    !ems_color_convert_create(&c->base.vk, c->stream_extent.width, c->stream_extent.height, export_frames,
+	                              &c->color_convert)) {
+		src_format = XRT_FORMAT_R8G8B8X8;
+		dmabuf = false;
+		vk_video = false;
+	}
+
+	if (vk_video && ems_vk_video_encoder_create(&c->base.vk, c->stream_extent.width, c->stream_extent.height,
+	                                            args->bitrate, c->settings.framerate, !args->intra_refresh,
+	                                            args->slices, &c->vk_encoder)) {
+		// The appsrc carries access units, not raw frames.
+		src_format = EMS_XRT_FORMAT_H264;
+	} else if (args->encoder_type == EMS_ENCODER_TYPE_VULKAN_H264) {
+		// Pipeline is not built yet, so we can still swap in a GStreamer encoder.
+		EMS_COMP_WARN(c, "Vulkan Video encoder not available, falling back to x264.");
+		args->encoder_type = EMS_ENCODER_TYPE_X264;
+		if (c->color_convert != NULL && export_frames) {
+			// Exported frames have no CPU mapping, recreate them host visible for x264.
+			ems_color_convert_destroy(&c->base.vk, &c->color_convert);
+			if (!ems_color_convert_create(&c->base.vk, c->stream_extent.width, c->stream_extent.height, false,
+			                              &c->color_convert)) {
+				src_format = XRT_FORMAT_R8G8B8X8;
+			}
+		}
+	}
+
+	if (args->foveation && c->color_convert != NULL) {
+		ems_color_convert_foveation_init(args->foveation_size, args->foveation_edge_ratio, &c->foveation);
+		c->foveate = true;
+	} else if (args->foveation) {
+		EMS_COMP_WARN(c, "Foveation needs GPU color conversion, streaming without it.");
+	}
+
+	// Checked against the encoder with the arguments, the regions work with either conversion.
+	c->roi = args->roi;
+
+	if (args->dynamic_resolution && c->color_convert != NULL) {
+		ems_dynamic_resolution_init(&c->resolution, args->dynamic_resolution_min);
+		c->dynamic_resolution = true;
+	} else if (args->dynamic_resolution) {
+		EMS_COMP_WARN(c, "Dynamic resolution needs GPU color conversion, streaming at a fixed one.");
+	}
+
+	// Matched on the CPU, so the frames need a mapping.
+	if (args->motion_vectors && c->color_convert != NULL && !dmabuf && c->vk_encoder == NULL) {
+		ems_motion_field_reset(&c->motion);
+		c->motion_vectors = true;
+	} else if (args->motion_vectors) {
+		EMS_COMP_WARN(c, "Motion vectors need GPU color conversion into host memory, streaming without them.");
+	}
+
+	if (c->depth_height > 0 && c->color_convert == NULL) {
+		EMS_COMP_WARN(c, "Depth needs GPU color conversion, streaming without it.");
+		c->stream_extent.height -= c->depth_height;
+		c->depth_height = 0;
+	}
 
-	vk_image_readback_to_xf_pool_create( //
-	    &c->base.vk,                     // vk_bundle
-	    readback_extent,                 // extent
-	    &c->pool,                        // out_pool
-	    XRT_FORMAT_R8G8B8X8,             // xrt_format
-	    VK_FORMAT_R8G8B8A8_UNORM);       // vk_format
+	if (c->color_convert == NULL) {
+		vk_image_readback_to_xf_pool_create( //
+		    &c->base.vk,                     // vk_bundle
+		    c->stream_extent,                // extent
+		    &c->pool,                        // out_pool
+		    XRT_FORMAT_R8G8B8X8,             // xrt_format
+		    VK_FORMAT_R8G8B8A8_UNORM);       // vk_format
+	}
 
 	u_var_add_root(c, "Electric Maple Server compositor", 0);
 	u_var_add_sink_debug(c, &c->debug_sink, "Debug Sink");
 
 #define EMS_APPSRC_NAME "EMS_source"
 
-	ems_gstreamer_pipeline_create(&c->xfctx, EMS_APPSRC_NAME, emsi.callbacks, &c->gstreamer_pipeline);
+	ems_gstreamer_pipeline_create(&c->xfctx, EMS_APPSRC_NAME, emsi.callbacks, emsi.telemetry,
+	                              &c->gstreamer_pipeline);
 	ems_gstreamer_src_create_with_pipeline( //
 	    c->gstreamer_pipeline,              //
-	    READBACK_W,                         //
-	    READBACK_H,                         //
-	    XRT_FORMAT_R8G8B8X8,                //
+	    c->stream_extent.width,             //
+	    c->stream_extent.height,            //
+	    c->settings.framerate,              //
+	    src_format,                         //
+	    dmabuf,                             //
 	    EMS_APPSRC_NAME,                    //
 	    &c->gstreamer_src,                  //
 	    &c->frame_sink);                    //
+	ems_gstreamer_src_set_latency_budget(c->gstreamer_src, ems_arguments_get()->latency_budget_ns);
+	ems_gstreamer_pipeline_prewarm(c->gstreamer_pipeline);
+
+	// Raw frames are wrapped in buffers once, Vulkan Video pushes access units instead.
+	if (c->color_convert != NULL && c->vk_encoder == NULL) {
+		struct xrt_frame *frames[EMS_COLOR_CONVERT_FRAME_COUNT] = {};
+		int dmabuf_fds[EMS_COLOR_CONVERT_FRAME_COUNT] = {};
+		uint32_t count = 0;
+		while (count < EMS_COLOR_CONVERT_FRAME_COUNT &&
+		       ems_color_convert_get_unused_frame(c->color_convert, &frames[count])) {
+			dmabuf_fds[count] = ems_color_convert_get_dmabuf_fd(c->color_convert, frames[count]);
+			count++;
+		}
 
+		// The source keeps its own references, the frames stay out of the color convert pool.
+		bool pool_dmabuf = dmabuf && count > 0 && dmabuf_fds[0] >= 0;
+		c->pooled_frames =
+		    ems_gstreamer_src_use_frame_pool(c->gstreamer_src, frames, pool_dmabuf ? dmabuf_fds : NULL, count);
+		for (uint32_t i = 0; i < count; i++) {
+			xrt_frame_reference(&frames[i], NULL);
+		}
+	}
+	u_var_add_ro_u64(c, &c->gstreamer_src->skipped_frames, "Frames skipped before the pipeline");
 
-	// Bounce image for scaling.
-	{
+
+	// Bounce image for scaling, not needed when converting on the GPU.
+	if (c->color_convert == NULL) {
 		VkFormat format = VK_FORMAT_R8G8B8A8_SRGB;
 		VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-		VkExtent2D extent = {READBACK_W, READBACK_H};
 		VkResult ret;
 
 		ret = vk_create_image_simple( //
 		    &c->base.vk,              // vk_bundle
-		    extent,                   // extent
+		    c->stream_extent,         // extent
 		    format,                   // format
 		    usage,                    // usage
 		    &c->bounce.device_memory, // out_mem
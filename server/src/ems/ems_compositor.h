@@ -21,6 +21,7 @@
 #include "xrt/xrt_instance.h"
 
 #include "os/os_time.h"
+#include "os/os_threading.h"
 
 #include "util/u_threading.h"
 #include "util/u_logging.h"
@@ -35,6 +36,13 @@
 
 
 #include "ems_server_internal.h"
+#include "ems_color_convert.h"
+#include "ems_dynamic_resolution.h"
+#include "ems_motion_field.h"
+
+#include "electricmaple.pb.h"
+
+#include <atomic>
 
 #ifdef __cplusplus
 extern "C" {
@@ -80,6 +88,47 @@ struct ems_comp_frame
 	uint64_t present_slop_ns;
 };
 
+/*!
+ * Upper bound on how many readbacks can be in flight on the GPU at once.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_READBACK_MAX_IN_FLIGHT (4)
+
+/*!
+ * A readback that has been submitted to the GPU but not yet pushed into the
+ * GStreamer pipeline.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_readback_in_flight
+{
+	//! Signalled by the GPU when the blit and copy are done.
+	VkFence fence;
+
+	//! Command buffer to free once the fence is signalled.
+	VkCommandBuffer cmd;
+
+	//! @ref cmd is a recording kept by ems_compositor::color_convert, not ours to free.
+	bool recorded;
+
+	//! The readback frame, owns a reference.
+	struct xrt_frame *frame;
+
+	//! Swapchains the GPU is reading from, color, depth then the other layers, owns references.
+	struct xrt_swapchain *xscs[4 + EMS_COLOR_CONVERT_MAX_LAYERS];
+
+	//! DownMessage for this frame, poses are filled in at submit time.
+	em_proto_DownMessage msg;
+
+	//! Regions around the lens centres of this frame, see @ref ems_arguments::roi.
+	struct ems_gstreamer_src_roi rois[EMS_GSTREAMER_SRC_MAX_ROIS];
+	uint32_t roi_count;
+
+	//! How far the head's rotation alone moved each view since the last frame, see @ref ems_motion_field.
+	struct xrt_vec2 head_motion[2];
+};
+
 /*!
  * Main compositor struct tying everything in the compositor together.
  *
@@ -105,6 +154,9 @@ struct ems_compositor
 
 		//! Frame interval that we are using.
 		uint64_t frame_interval_ns;
+
+		//! The stream's frame rate, follows ems_gstreamer_pipeline_get_framerate.
+		uint32_t framerate;
 	} settings;
 
 	// Kept here for convenience.
@@ -126,16 +178,83 @@ struct ems_compositor
 
 	struct vk_cmd_pool cmd_pool = {};
 
+	//! Readback images for CPU color conversion, null when converting on the GPU.
 	struct vk_image_readback_to_xf_pool *pool = nullptr;
+
+	//! GPU NV12 conversion, null when converting on the CPU.
+	struct ems_color_convert *color_convert = nullptr;
+
+	//! Bumped with every new swapchain, recordings of @ref color_convert from before are not reused.
+	std::atomic<uint64_t> swapchain_generation{0};
+
+	//! Of comp_base, wrapped to bump @ref swapchain_generation.
+	decltype(xrt_compositor::create_swapchain) base_create_swapchain = nullptr;
+	decltype(xrt_compositor::import_swapchain) base_import_swapchain = nullptr;
+
+	//! Vulkan Video encoder fed from @ref color_convert, null when GStreamer encodes.
+	struct ems_vk_video_encoder *vk_encoder = nullptr;
+
+	//! The frames of @ref color_convert were handed to the source, acquire them from there.
+	bool pooled_frames = false;
+
+	//! Warp applied by @ref color_convert and sent along with each frame, see @ref ems_arguments::foveation.
+	bool foveate = false;
+	struct ems_color_convert_foveation foveation = {};
+
+	//! Rows below the views holding their depth, 0 without, see @ref ems_arguments::depth.
+	uint32_t depth_height = 0;
+
+	//! Lower the QP around the lens centres of each frame, see @ref ems_arguments::roi.
+	bool roi = false;
+
+	//! Views shrunk within the stream by @ref color_convert, see @ref ems_arguments::dynamic_resolution.
+	bool dynamic_resolution = false;
+	struct ems_dynamic_resolution resolution = {};
+
+	//! Send the motion of the content between frames, see @ref ems_arguments::motion_vectors.
+	bool motion_vectors = false;
+	//! Only used where the frames are pushed, on the completion thread with asynchronous readback.
+	struct ems_motion_field motion = {};
+	//! Of the views of the last frame packed, to take the head's rotation out of the motion.
+	struct xrt_quat motion_orientations[2] = {};
+	bool have_motion_orientations = false;
+
+	//! The thread committing layers got the render thread policy, done on the first commit.
+	bool render_thread_scheduled = false;
+
 	int image_sequence;
 	struct u_sink_debug debug_sink;
 
+	//! Size of the stream with both views side by side, see @ref ems_arguments::readback_scale.
+	VkExtent2D stream_extent;
+
 	struct
 	{
 		VkDeviceMemory device_memory;
 		VkImage image;
 	} bounce;
 
+	/*!
+	 * Asynchronous readback state, only used when more than one frame is
+	 * allowed to be in flight, see @ref ems_arguments::readback_frames_in_flight.
+	 */
+	struct
+	{
+		//! Completion thread, its mutex also protects the counters below.
+		struct os_thread_helper oth;
+
+		struct ems_readback_in_flight slots[EMS_READBACK_MAX_IN_FLIGHT];
+
+		//! Number of slots we allow to be in use, 1 means synchronous readback.
+		uint32_t max_in_flight;
+
+		//! Total number of readbacks submitted, protected by oth.
+		uint64_t submitted;
+
+		//! Total number of readbacks completed, protected by oth.
+		uint64_t completed;
+	} readback;
+
 	bool pipeline_playing = false;
 	struct gstreamer_pipeline *gstreamer_pipeline;
 	struct ems_gstreamer_src *gstreamer_src;
@@ -0,0 +1,113 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Steps the resolution of the views in the stream down and back up under encoder or network pressure.
+ * @ingroup comp_ems
+ */
+
+#include "ems_dynamic_resolution.h"
+
+#include "util/u_logging.h"
+#include "util/u_time.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+/*
+ *
+ * Structs and defines.
+ *
+ */
+
+//! Scales are multiples of this, so noise in the estimates does not move it every frame.
+static constexpr float kStep = 0.05f;
+
+//! The telemetry window, a change shows in the encode times only after that long.
+static constexpr uint64_t kHoldDownNs = 5 * U_TIME_1S_IN_NS;
+
+//! Going back up is slower, a scene that was too heavy likely still is.
+static constexpr uint64_t kHoldUpNs = 10 * U_TIME_1S_IN_NS;
+
+//! Encoding longer than this fraction of a frame interval is an overrun.
+static constexpr double kOverrunFraction = 0.8;
+
+//! Encoding shorter than this fraction of a frame interval leaves room to go up.
+static constexpr double kHeadroomFraction = 0.5;
+
+
+/*
+ *
+ * Helper functions.
+ *
+ */
+
+static float
+quantize(float scale, float min_scale)
+{
+	return std::clamp(std::floor(scale / kStep + 0.5f) * kStep, min_scale, 1.0f);
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+void
+ems_dynamic_resolution_init(struct ems_dynamic_resolution *dr, float min_scale)
+{
+	dr->min_scale = std::clamp(min_scale, kStep, 1.0f);
+	dr->scale = 1.0f;
+	dr->last_change_ns = 0;
+}
+
+bool
+ems_dynamic_resolution_update(struct ems_dynamic_resolution *dr,
+                              uint64_t now_ns,
+                              uint64_t frame_interval_ns,
+                              uint64_t encode_p95_ns,
+                              uint32_t bitrate_kbps,
+                              uint32_t full_bitrate_kbps)
+{
+	// Same bits per pixel, the pixel count goes with the square of the scale.
+	float target = 1.0f;
+	if (full_bitrate_kbps > 0 && bitrate_kbps < full_bitrate_kbps) {
+		target = std::sqrt((float)bitrate_kbps / (float)full_bitrate_kbps);
+	}
+
+	double encode_fraction = frame_interval_ns > 0 ? (double)encode_p95_ns / (double)frame_interval_ns : 0.0;
+	if (encode_fraction > kOverrunFraction) {
+		target = std::min(target, dr->scale - kStep);
+	} else if (encode_fraction > kHeadroomFraction) {
+		// Not overrunning, but no room for more pixels either.
+		target = std::min(target, dr->scale);
+	}
+
+	target = quantize(target, dr->min_scale);
+	if (target == dr->scale) {
+		return false;
+	}
+
+	uint64_t hold_ns = target < dr->scale ? kHoldDownNs : kHoldUpNs;
+	if (dr->last_change_ns != 0 && now_ns - dr->last_change_ns < hold_ns) {
+		return false;
+	}
+
+	// One step at a time going up, so an overrun shows before we are back at the top.
+	if (target > dr->scale) {
+		target = std::min(target, quantize(dr->scale + kStep, dr->min_scale));
+	}
+
+	U_LOG_I("Views scaled %.2f -> %.2f, encode p95 %.2f ms, %u of %u kbit/s", dr->scale, target,
+	        time_ns_to_ms_f((int64_t)encode_p95_ns), bitrate_kbps, full_bitrate_kbps);
+
+	dr->scale = target;
+	dr->last_change_ns = now_ns;
+
+	return true;
+}
@@ -0,0 +1,72 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Steps the resolution of the views in the stream down and back up under encoder or network pressure.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * Scale of the views within the stream, which itself keeps its size. The views
+ * shrink into the top left of their half of the frame, so neither the caps nor
+ * the decoder change and the client only samples a smaller rect.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_dynamic_resolution
+{
+	//! Per axis, 1 is the whole color area of a view.
+	float scale;
+	float min_scale;
+
+	//! When the scale last changed, in server monotonic time.
+	uint64_t last_change_ns;
+};
+
+/*!
+ * Start at the full resolution, never going below @p min_scale.
+ *
+ * @ingroup comp_ems
+ */
+void
+ems_dynamic_resolution_init(struct ems_dynamic_resolution *dr, float min_scale);
+
+/*!
+ * Pick the scale for the next frames.
+ *
+ * Encoding that takes most of a frame interval steps the scale down, as does a
+ * bitrate below @p full_bitrate_kbps, which keeps the bits per pixel. Steps up
+ * only after the scale held for a while without either.
+ *
+ * @param now_ns Server monotonic time.
+ * @param frame_interval_ns Of the stream.
+ * @param encode_p95_ns How long the encoder took recently, 0 if unknown.
+ * @param bitrate_kbps What the stream is encoded at now.
+ * @param full_bitrate_kbps What the full resolution is encoded at.
+ *
+ * @return true if the scale changed.
+ * @ingroup comp_ems
+ */
+bool
+ems_dynamic_resolution_update(struct ems_dynamic_resolution *dr,
+                              uint64_t now_ns,
+                              uint64_t frame_interval_ns,
+                              uint64_t encode_p95_ns,
+                              uint32_t bitrate_kbps,
+                              uint32_t full_bitrate_kbps);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -15,6 +15,7 @@
  */
 
 #include "ems_callbacks.h"
+#include "ems_latency.h"
 #include "xrt/xrt_defines.h"
 #undef CLAMP
 
@@ -24,7 +25,9 @@
 
 #include "math/m_api.h"
 #include "math/m_mathinclude.h"
+#include "math/m_predict.h"
 #include "math/m_relation_history.h"
+#include "math/m_space.h"
 
 #include "util/u_var.h"
 #include "util/u_misc.h"
@@ -40,7 +43,9 @@
 #include "pb_decode.h"
 
 #include "ems_server_internal.h"
+#include "gst/ems_pipeline_args.h"
 
+#include <cinttypes>
 #include <cstdint>
 #include <glib.h>
 #include <memory>
@@ -63,6 +68,9 @@
 
 static constexpr uint64_t kFixedAssumedLatencyUs = 50 * U_TIME_1MS_IN_NS;
 
+//! A sequence index this far behind the newest one is a new client starting over, not a late pose.
+static constexpr int64_t kSequenceRestartThreshold = 1000;
+
 
 /// Casting helper function
 static inline struct ems_hmd *
@@ -111,22 +119,50 @@ ems_hmd_get_tracked_pose(struct xrt_device *xdev,
 		return;
 	}
 
-	if (eh->received->updated) {
-		xrt_space_relation rel;
-		uint64_t timestamp;
-		std::lock_guard<std::mutex> lock(eh->received->mutex);
-		rel = eh->received->rel;
-		timestamp = eh->received->timestamp;
-		eh->received->rel.relation_flags = XRT_SPACE_RELATION_BITMASK_NONE;
-		eh->received->updated = false;
-		if (0 == (rel.relation_flags & XRT_SPACE_RELATION_ANGULAR_VELOCITY_VALID_BIT)) {
-			// guess our velocities if not reported.
-			m_relation_history_estimate_motion(eh->pose_history, &rel, timestamp, &rel);
-		}
-		m_relation_history_push(eh->pose_history, &rel, timestamp);
+	// Lock-free, this is called by the compositor and every xrLocateViews of the app.
+	ems_hmd_latest_poses latest = eh->received->latest.load();
+
+	if (at_timestamp_ns >= latest.newest_timestamp) {
+		double delta_s = time_ns_to_s((int64_t)(at_timestamp_ns - latest.newest_timestamp));
+		m_predict_relation(&latest.newest, delta_s, out_relation);
+	} else if (latest.previous_timestamp != 0 && at_timestamp_ns >= latest.previous_timestamp) {
+		float t = (float)(at_timestamp_ns - latest.previous_timestamp) /
+		          (float)(latest.newest_timestamp - latest.previous_timestamp);
+		enum xrt_space_relation_flags flags =
+		    (enum xrt_space_relation_flags)(latest.previous.relation_flags & latest.newest.relation_flags);
+		m_space_relation_interpolate(&latest.previous, &latest.newest, t, flags, out_relation);
+	} else {
+		// Further back than the two newest poses, only the history has it.
+		m_relation_history_get(eh->pose_history, at_timestamp_ns, out_relation);
 	}
+}
 
-	m_relation_history_get(eh->pose_history, at_timestamp_ns, out_relation);
+/*!
+ * Add a pose to the history and publish it to the readers. Needs the recvbuf mutex.
+ */
+static void
+push_pose(struct ems_hmd *eh, xrt_space_relation rel, uint64_t timestamp)
+{
+	ems_hmd_latest_poses &written = eh->received->written;
+
+	// The history would drop it too.
+	if (timestamp <= written.newest_timestamp) {
+		EMS_TRACE(eh, "Dropping pose at %" PRIu64 ", not newer than %" PRIu64, timestamp,
+		          written.newest_timestamp);
+		return;
+	}
+
+	if (0 == (rel.relation_flags & XRT_SPACE_RELATION_ANGULAR_VELOCITY_VALID_BIT)) {
+		// guess our velocities if not reported.
+		m_relation_history_estimate_motion(eh->pose_history, &rel, timestamp, &rel);
+	}
+	m_relation_history_push(eh->pose_history, &rel, timestamp);
+
+	written.previous = written.newest;
+	written.previous_timestamp = written.newest_timestamp;
+	written.newest = rel;
+	written.newest_timestamp = timestamp;
+	eh->received->latest.store(written);
 }
 
 static void
@@ -163,8 +199,11 @@ ems_hmd_handle_data(enum ems_callbacks_event event, const em_proto_UpMessage *me
 	pose.orientation.x = message->tracking.P_localSpace_viewSpace.orientation.x;
 	pose.orientation.y = message->tracking.P_localSpace_viewSpace.orientation.y;
 	pose.orientation.z = message->tracking.P_localSpace_viewSpace.orientation.z;
-	uint64_t now = os_monotonic_get_ns();
-	// TODO handle timestamp, etc
+	// The client predicts the pose to its display time, place it there once we know the clock offset.
+	uint64_t timestamp = os_monotonic_get_ns() - kFixedAssumedLatencyUs;
+	if (message->tracking.timestamp != 0) {
+		ems_latency_client_to_server_time(eh->instance->latency, message->tracking.timestamp, &timestamp);
+	}
 
 	xrt_space_relation rel = XRT_SPACE_RELATION_ZERO;
 	rel.pose = pose;
@@ -184,9 +223,17 @@ ems_hmd_handle_data(enum ems_callbacks_event event, const em_proto_UpMessage *me
 	}
 	{
 		std::lock_guard<std::mutex> lock(eh->received->mutex);
-		eh->received->rel = rel;
-		eh->received->timestamp = now - kFixedAssumedLatencyUs;
-		eh->received->updated = true;
+
+		// Tracking comes on an unordered channel, don't go back in time. Zero is unset.
+		int64_t sequence_idx = message->tracking.sequence_idx;
+		int64_t newest = eh->received->sequence_idx;
+		if (sequence_idx != 0 && sequence_idx <= newest && newest - sequence_idx < kSequenceRestartThreshold) {
+			EMS_TRACE(eh, "Dropping pose %" PRId64 ", already applied %" PRId64, sequence_idx, newest);
+			return;
+		}
+		eh->received->sequence_idx = sequence_idx;
+
+		push_pose(eh, rel, timestamp);
 	}
 }
 
@@ -231,8 +278,8 @@ ems_hmd_create(ems_instance &emsi)
 	eh->base.hmd->blend_modes[idx++] = XRT_BLEND_MODE_OPAQUE;
 	eh->base.hmd->blend_mode_count = idx;
 
-	// TODO: Find out the framerate that the remote device runs at
-	eh->base.hmd->screens[0].nominal_frame_interval_ns = time_s_to_ns(1.0f / 90.0f);
+	// The preferred rate, the compositor switches to the rate the client display runs at once it connects.
+	eh->base.hmd->screens[0].nominal_frame_interval_ns = U_TIME_1S_IN_NS / ems_arguments_get()->framerate;
 
 	// TODO: Find out the remote device's actual FOV. Or maybe remove this because I think get_view_poses lets us
 	// set the FOV dynamically.
@@ -283,8 +330,10 @@ ems_hmd_create(ems_instance &emsi)
 	    XRT_SPACE_RELATION_ORIENTATION_TRACKED_BIT | XRT_SPACE_RELATION_ORIENTATION_VALID_BIT |
 	    XRT_SPACE_RELATION_POSITION_VALID_BIT | XRT_SPACE_RELATION_POSITION_TRACKED_BIT);
 	identity.pose = (struct xrt_pose){XRT_QUAT_IDENTITY, {0.0f, 1.6f, 0.0f}};
-	uint64_t now = os_monotonic_get_ns();
-	m_relation_history_push(eh->pose_history, &identity, now);
+	{
+		std::lock_guard<std::mutex> lock(eh->received->mutex);
+		push_pose(eh, identity, os_monotonic_get_ns());
+	}
 
 	// TODO: Are we going to have any actual useful info to show here?
 	// Setup variable tracker: Optional but useful for debugging
@@ -10,6 +10,8 @@
  */
 
 #include "ems_callbacks.h"
+#include "ems_latency.h"
+#include "ems_telemetry.h"
 #include "xrt/xrt_system.h"
 #include "xrt/xrt_instance.h"
 #include "xrt/xrt_config_drivers.h"
@@ -120,6 +122,8 @@ ems_instance_destroy(struct xrt_instance *xinst)
 	ems_callbacks_reset(emsi->callbacks);
 
 	ems_callbacks_destroy(&emsi->callbacks);
+	ems_telemetry_destroy(&emsi->telemetry);
+	ems_latency_destroy(&emsi->latency);
 
 	delete emsi;
 }
@@ -136,6 +140,8 @@ ems_instance_system_devices_init(struct ems_instance *emsi)
 {
 	// needed before creating devices
 	emsi->callbacks = ems_callbacks_create();
+	emsi->latency = ems_latency_create(emsi->callbacks);
+	emsi->telemetry = ems_telemetry_create(emsi->callbacks, emsi->latency);
 
 	emsi->xsysd_base.destroy = ems_instance_system_devices_destroy;
 
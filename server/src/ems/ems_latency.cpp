@@ -0,0 +1,185 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Estimates when the client displays the frames we send, from its frame reports.
+ * @ingroup aux_util
+ */
+
+#include "ems_latency.h"
+#include "ems_callbacks.h"
+
+#include "os/os_time.h"
+
+#include "util/u_logging.h"
+
+#include "electricmaple.pb.h"
+
+#include <array>
+#include <memory>
+#include <mutex>
+
+//! Reports for frames older than this many are dropped.
+static constexpr size_t kPushHistorySize = 256;
+
+//! Weight of a new sample in the moving averages.
+static constexpr double kSmoothing = 0.1;
+
+//! Anything above this is a stale report or a hiccup, not latency.
+static constexpr int64_t kMaxPlausibleLatencyNs = 1000 * 1000 * 1000;
+
+struct ems_latency_push
+{
+	int64_t frame_sequence_id = -1;
+	uint64_t when_ns = 0;
+};
+
+struct ems_latency
+{
+	std::mutex mutex;
+	std::array<ems_latency_push, kPushHistorySize> pushes;
+
+	bool valid = false;
+	//! Push to client display.
+	double latency_ns = 0;
+	//! Client OpenXR time minus server monotonic time.
+	double offset_ns = 0;
+
+	//! Decode to begin frame on the client, summed up until taken.
+	int64_t slack_sum_ns = 0;
+	uint32_t slack_count = 0;
+};
+
+static void
+ems_latency_handle_data(enum ems_callbacks_event event, const em_proto_UpMessage *message, void *userdata)
+{
+	struct ems_latency *latency = (struct ems_latency *)userdata;
+
+	if (!message->has_frame) {
+		return;
+	}
+
+	ems_latency_frame_report(latency, &message->frame, os_monotonic_get_ns());
+}
+
+struct ems_latency *
+ems_latency_create(struct ems_callbacks *callbacks)
+{
+	auto latency = std::make_unique<ems_latency>();
+
+	ems_callbacks_add(callbacks, EMS_CALLBACKS_EVENT_FRAME, ems_latency_handle_data, latency.get());
+
+	return latency.release();
+}
+
+void
+ems_latency_destroy(struct ems_latency **ptr_latency)
+{
+	if (!ptr_latency) {
+		return;
+	}
+	std::unique_ptr<ems_latency> latency(*ptr_latency);
+	*ptr_latency = nullptr;
+}
+
+void
+ems_latency_frame_pushed(struct ems_latency *latency, int64_t frame_sequence_id, uint64_t when_ns)
+{
+	std::lock_guard<std::mutex> lock(latency->mutex);
+	ems_latency_push &push = latency->pushes[(size_t)frame_sequence_id % kPushHistorySize];
+	push.frame_sequence_id = frame_sequence_id;
+	push.when_ns = when_ns;
+}
+
+void
+ems_latency_frame_report(struct ems_latency *latency, const em_proto_UpFrameMessage *report, uint64_t now_ns)
+{
+	if (report->display_time == 0 || report->begin_frame_time == 0 || report->decode_complete_time == 0) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(latency->mutex);
+
+	// Same clock on the client, needs no push time.
+	int64_t slack_ns = report->begin_frame_time - report->decode_complete_time;
+	if (slack_ns >= 0 && slack_ns < kMaxPlausibleLatencyNs) {
+		latency->slack_sum_ns += slack_ns;
+		latency->slack_count++;
+	}
+
+	const ems_latency_push &push = latency->pushes[(size_t)report->frame_sequence_id % kPushHistorySize];
+	if (push.frame_sequence_id != report->frame_sequence_id) {
+		return;
+	}
+
+	// The report goes out right after the frame got rendered, display_time is still ahead of it.
+	// The time the client held the decoded frame is left out, it waits for the display_time we
+	// derive from this estimate and would otherwise feed it back.
+	int64_t round_trip_ns = (int64_t)(now_ns - push.when_ns);
+	int64_t display_ahead_ns = report->display_time - report->begin_frame_time;
+	int64_t sample_ns = round_trip_ns - slack_ns + display_ahead_ns;
+	if (slack_ns < 0 || sample_ns <= 0 || sample_ns > kMaxPlausibleLatencyNs) {
+		return;
+	}
+
+	// The report arrives about when the client began the frame.
+	double offset_ns = (double)report->begin_frame_time - (double)now_ns;
+
+	if (!latency->valid) {
+		latency->latency_ns = (double)sample_ns;
+		latency->offset_ns = offset_ns;
+		latency->valid = true;
+		U_LOG_I("First frame report, display latency %.2f ms.", (double)sample_ns / 1e6);
+		return;
+	}
+
+	latency->latency_ns += ((double)sample_ns - latency->latency_ns) * kSmoothing;
+	latency->offset_ns += (offset_ns - latency->offset_ns) * kSmoothing;
+}
+
+uint64_t
+ems_latency_get_display_latency_ns(struct ems_latency *latency, uint64_t fallback_ns)
+{
+	std::lock_guard<std::mutex> lock(latency->mutex);
+	return latency->valid ? (uint64_t)latency->latency_ns : fallback_ns;
+}
+
+bool
+ems_latency_take_client_slack(struct ems_latency *latency, int64_t *out_slack_ns)
+{
+	std::lock_guard<std::mutex> lock(latency->mutex);
+	if (latency->slack_count == 0) {
+		return false;
+	}
+
+	*out_slack_ns = latency->slack_sum_ns / latency->slack_count;
+	latency->slack_sum_ns = 0;
+	latency->slack_count = 0;
+	return true;
+}
+
+bool
+ems_latency_client_to_server_time(struct ems_latency *latency, int64_t client_time_ns, uint64_t *out_server_ns)
+{
+	std::lock_guard<std::mutex> lock(latency->mutex);
+	if (!latency->valid) {
+		return false;
+	}
+
+	*out_server_ns = (uint64_t)((double)client_time_ns - latency->offset_ns);
+	return true;
+}
+
+bool
+ems_latency_server_to_client_time(struct ems_latency *latency, uint64_t server_time_ns, int64_t *out_client_ns)
+{
+	std::lock_guard<std::mutex> lock(latency->mutex);
+	if (!latency->valid) {
+		return false;
+	}
+
+	*out_client_ns = (int64_t)((double)server_time_ns + latency->offset_ns);
+	return true;
+}
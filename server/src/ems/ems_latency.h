@@ -0,0 +1,73 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Estimates when the client displays the frames we send, from its frame reports.
+ * @ingroup aux_util
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct _em_proto_UpFrameMessage em_proto_UpFrameMessage;
+
+struct ems_callbacks;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Smoothed push-to-display latency and client clock offset.
+///
+/// Without synchronized clocks the uplink of the frame report counts as
+/// latency too, a few milliseconds on a LAN, so predictions err on the late side.
+struct ems_latency;
+
+/// Allocate an estimator fed by the frame reports arriving on @p callbacks.
+/// @public @memberof ems_latency
+struct ems_latency *
+ems_latency_create(struct ems_callbacks *callbacks);
+
+/// Destroy the estimator and clear the pointer, the callbacks must have been reset.
+/// @public @memberof ems_latency
+void
+ems_latency_destroy(struct ems_latency **ptr_latency);
+
+/// Remember when a frame went out, in server monotonic time.
+/// @public @memberof ems_latency
+void
+ems_latency_frame_pushed(struct ems_latency *latency, int64_t frame_sequence_id, uint64_t when_ns);
+
+/// Feed the client's report for a frame, received at @p now_ns.
+/// @public @memberof ems_latency
+void
+ems_latency_frame_report(struct ems_latency *latency, const em_proto_UpFrameMessage *report, uint64_t now_ns);
+
+/// How soon after being pushed a frame can be displayed, @p fallback_ns until the first report.
+/// @public @memberof ems_latency
+uint64_t
+ems_latency_get_display_latency_ns(struct ems_latency *latency, uint64_t fallback_ns);
+
+/// Mean time between a frame finishing decoding and the client beginning the frame that
+/// uses it, over the reports since the last call. False if there were none.
+/// @public @memberof ems_latency
+bool
+ems_latency_take_client_slack(struct ems_latency *latency, int64_t *out_slack_ns);
+
+/// Convert a client OpenXR time to server monotonic time, false until the first report.
+/// @public @memberof ems_latency
+bool
+ems_latency_client_to_server_time(struct ems_latency *latency, int64_t client_time_ns, uint64_t *out_server_ns);
+
+/// Convert a server monotonic time to client OpenXR time, false until the first report.
+/// @public @memberof ems_latency
+bool
+ems_latency_server_to_client_time(struct ems_latency *latency, uint64_t server_time_ns, int64_t *out_client_ns);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -13,12 +13,16 @@
  * @ingroup drv_ems
  */
 
+#include "ems_callbacks.h"
+#include "ems_latency.h"
+
 #include "xrt/xrt_device.h"
 
 #include "os/os_time.h"
 
 #include "math/m_api.h"
 #include "math/m_mathinclude.h"
+#include "math/m_relation_history.h"
 
 #include "util/u_var.h"
 #include "util/u_misc.h"
@@ -35,6 +39,7 @@
 
 #include "ems_server_internal.h"
 
+#include <mutex>
 #include <thread>
 
 #include <cstdio>
@@ -49,6 +54,13 @@
  */
 
 
+//! Past the newest sample the controller is held in place instead of predicted, it is likely lost.
+static constexpr uint64_t kMaxPredictionNs = 100 * U_TIME_1MS_IN_NS;
+
+//! Placed this far back when the client clock is not known yet, like the HMD does.
+static constexpr uint64_t kFixedAssumedLatencyNs = 50 * U_TIME_1MS_IN_NS;
+
+
 /// Casting helper function
 static inline struct ems_motion_controller *
 ems_motion_controller(struct xrt_device *xdev)
@@ -70,13 +82,33 @@ controller_destroy(struct xrt_device *xdev)
 	// Remove the variable tracking.
 	u_var_remove_root(emc);
 
+	emc->received = nullptr;
+
+	m_relation_history_destroy(&emc->grip_history);
+	m_relation_history_destroy(&emc->aim_history);
+
 	u_device_free(&emc->base);
 }
 
 static void
 controller_update_inputs(struct xrt_device *xdev)
 {
-	// Empty, you should put code to update the attached input fields (if any)
+	struct ems_motion_controller *emc = ems_motion_controller(xdev);
+
+	std::lock_guard<std::mutex> lock(emc->received->mutex);
+	if (emc->received->timestamp == 0) {
+		return;
+	}
+
+	for (uint32_t i = 0; i < EMS_TOUCH_INPUT_COUNT; i++) {
+		if (i == EMS_TOUCH_GRIP_POSE || i == EMS_TOUCH_AIM_POSE) {
+			emc->base.inputs[i].active = emc->received->tracked;
+			continue;
+		}
+		emc->base.inputs[i].active = true;
+		emc->base.inputs[i].value = emc->received->inputs[i];
+		emc->base.inputs[i].timestamp = (int64_t)emc->received->timestamp;
+	}
 }
 
 static void
@@ -93,13 +125,32 @@ controller_get_tracked_pose(struct xrt_device *xdev,
 {
 	struct ems_motion_controller *emc = ems_motion_controller(xdev);
 
+	struct m_relation_history *history = nullptr;
 	switch (name) {
-	case XRT_INPUT_TOUCH_GRIP_POSE:
-	case XRT_INPUT_TOUCH_AIM_POSE: break;
+	case XRT_INPUT_TOUCH_GRIP_POSE: history = emc->grip_history; break;
+	case XRT_INPUT_TOUCH_AIM_POSE: history = emc->aim_history; break;
 	default: EMS_ERROR(emc, "unknown input name"); return;
 	}
 
-	// Estimate pose at timestamp at_timestamp_ns!
+	uint64_t latest_ns = 0;
+	struct xrt_space_relation latest = XRT_SPACE_RELATION_ZERO;
+	if (m_relation_history_get_latest(history, &latest_ns, &latest)) {
+		if (at_timestamp_ns <= latest_ns + kMaxPredictionNs) {
+			m_relation_history_get(history, at_timestamp_ns, out_relation);
+			return;
+		}
+
+		// No samples for a while, keep it where it was last seen rather than fling it along.
+		out_relation->pose = latest.pose;
+		out_relation->linear_velocity = XRT_VEC3_ZERO;
+		out_relation->angular_velocity = XRT_VEC3_ZERO;
+		out_relation->relation_flags = (enum xrt_space_relation_flags)( //
+		    XRT_SPACE_RELATION_ORIENTATION_VALID_BIT |                  //
+		    XRT_SPACE_RELATION_POSITION_VALID_BIT);                     //
+		return;
+	}
+
+	// Nothing from the client yet.
 	math_quat_normalize(&emc->pose.orientation);
 	out_relation->pose = emc->pose;
 	out_relation->relation_flags = (enum xrt_space_relation_flags)( //
@@ -121,6 +172,137 @@ controller_get_view_poses(struct xrt_device *xdev,
 	assert(false);
 }
 
+static struct xrt_vec3
+vec3_from_proto(const em_proto_Vec3 &v)
+{
+	return {v.x, v.y, v.z};
+}
+
+static struct xrt_pose
+pose_from_proto(const em_proto_Pose &p)
+{
+	struct xrt_pose pose = {};
+	pose.position = vec3_from_proto(p.position);
+	pose.orientation.w = p.orientation.w;
+	pose.orientation.x = p.orientation.x;
+	pose.orientation.y = p.orientation.y;
+	pose.orientation.z = p.orientation.z;
+	math_quat_normalize(&pose.orientation);
+	return pose;
+}
+
+static uint64_t
+to_server_time(struct ems_motion_controller *emc, int64_t client_time_ns)
+{
+	uint64_t timestamp = os_monotonic_get_ns() - kFixedAssumedLatencyNs;
+	if (client_time_ns != 0) {
+		ems_latency_client_to_server_time(emc->instance->latency, client_time_ns, &timestamp);
+	}
+	return timestamp;
+}
+
+/*!
+ * Pushes one sample into the histories, they ignore samples older than their
+ * newest one, which the overlap between messages sends more than once.
+ */
+static void
+push_sample(struct ems_motion_controller *emc, const em_proto_ControllerSample &sample)
+{
+	if (!sample.has_grip || !sample.has_aim) {
+		return;
+	}
+
+	uint64_t timestamp = to_server_time(emc, sample.timestamp);
+
+	xrt_space_relation grip = XRT_SPACE_RELATION_ZERO;
+	grip.pose = pose_from_proto(sample.grip);
+	grip.relation_flags = (enum xrt_space_relation_flags)(
+	    XRT_SPACE_RELATION_POSITION_VALID_BIT | XRT_SPACE_RELATION_POSITION_TRACKED_BIT |
+	    XRT_SPACE_RELATION_ORIENTATION_VALID_BIT | XRT_SPACE_RELATION_ORIENTATION_TRACKED_BIT);
+
+	// Both poses are on the same rigid body, the aim shares the grip's angular velocity.
+	xrt_space_relation aim = grip;
+	aim.pose = pose_from_proto(sample.aim);
+
+	if (sample.has_linear_velocity && sample.has_angular_velocity) {
+		grip.linear_velocity = vec3_from_proto(sample.linear_velocity);
+		grip.angular_velocity = vec3_from_proto(sample.angular_velocity);
+		grip.relation_flags = (enum xrt_space_relation_flags)(grip.relation_flags |
+		                                                      XRT_SPACE_RELATION_LINEAR_VELOCITY_VALID_BIT |
+		                                                      XRT_SPACE_RELATION_ANGULAR_VELOCITY_VALID_BIT);
+	} else {
+		m_relation_history_estimate_motion(emc->grip_history, &grip, timestamp, &grip);
+	}
+	m_relation_history_estimate_motion(emc->aim_history, &aim, timestamp, &aim);
+
+	m_relation_history_push(emc->grip_history, &grip, timestamp);
+	m_relation_history_push(emc->aim_history, &aim, timestamp);
+}
+
+static void
+store_inputs(struct ems_motion_controller *emc,
+             uint64_t timestamp,
+             const em_proto_InputClickTouch &lower,
+             const em_proto_InputClickTouch &upper,
+             const em_proto_InputClickTouch &menu,
+             const em_proto_TouchControllerCommon &common)
+{
+	std::lock_guard<std::mutex> lock(emc->received->mutex);
+
+	union xrt_input_value *v = emc->received->inputs;
+	v[EMS_TOUCH_SQUEEZE_VALUE].vec1.x = common.squeeze.value;
+	v[EMS_TOUCH_TRIGGER_TOUCH].boolean = common.trigger.touch;
+	v[EMS_TOUCH_TRIGGER_VALUE].vec1.x = common.trigger.value;
+	v[EMS_TOUCH_THUMBSTICK_CLICK].boolean = common.thumbstick.click;
+	v[EMS_TOUCH_THUMBSTICK_TOUCH].boolean = common.thumbstick.touch;
+	v[EMS_TOUCH_THUMBSTICK].vec2.x = common.thumbstick.xy.x;
+	v[EMS_TOUCH_THUMBSTICK].vec2.y = common.thumbstick.xy.y;
+	v[EMS_TOUCH_THUMBREST_TOUCH].boolean = common.thumbrest_touch;
+	v[EMS_TOUCH_LOWER_CLICK].boolean = lower.click;
+	v[EMS_TOUCH_LOWER_TOUCH].boolean = lower.touch;
+	v[EMS_TOUCH_UPPER_CLICK].boolean = upper.click;
+	v[EMS_TOUCH_UPPER_TOUCH].boolean = upper.touch;
+	v[EMS_TOUCH_MENU_CLICK].boolean = menu.click;
+
+	// Inputs come unordered too, don't go back in time.
+	if (timestamp > emc->received->timestamp) {
+		emc->received->timestamp = timestamp;
+	}
+}
+
+static void
+controller_handle_data(enum ems_callbacks_event event, const em_proto_UpMessage *message, void *userdata)
+{
+	struct ems_motion_controller *emc = (struct ems_motion_controller *)userdata;
+
+	if (!message->has_controllers) {
+		return;
+	}
+
+	const em_proto_ControllerMessage &cm = message->controllers;
+	bool left = emc->base.device_type == XRT_DEVICE_TYPE_LEFT_HAND_CONTROLLER;
+
+	const em_proto_ControllerSample *samples = left ? cm.left : cm.right;
+	pb_size_t sample_count = left ? cm.left_count : cm.right_count;
+	for (pb_size_t i = 0; i < sample_count; i++) {
+		push_sample(emc, samples[i]);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(emc->received->mutex);
+		emc->received->tracked = sample_count > 0;
+	}
+
+	uint64_t input_timestamp = to_server_time(emc, cm.input_time);
+	if (left && cm.has_left_input) {
+		const em_proto_TouchControllerLeft &in = cm.left_input;
+		store_inputs(emc, input_timestamp, in.x, in.y, in.menu, in.common);
+	} else if (!left && cm.has_right_input) {
+		const em_proto_TouchControllerRight &in = cm.right_input;
+		store_inputs(emc, input_timestamp, in.a, in.b, in.system, in.common);
+	}
+}
+
 
 /*
  *
@@ -163,7 +345,7 @@ ems_motion_controller_create(ems_instance &emsi, enum xrt_device_name device_nam
 	uint32_t output_count = 0;
 	switch (device_name) {
 	case XRT_DEVICE_TOUCH_CONTROLLER:
-		input_count = 14;
+		input_count = EMS_TOUCH_INPUT_COUNT;
 		output_count = 1;
 		break;
 	default: U_LOG_E("Device name not supported!"); return nullptr;
@@ -207,6 +389,9 @@ ems_motion_controller_create(ems_instance &emsi, enum xrt_device_name device_nam
 	// Private fields.
 	emc->instance = &emsi;
 	emc->pose = default_pose;
+	emc->received = std::make_unique<ems_motion_controller_recvbuf>();
+	m_relation_history_create(&emc->grip_history);
+	m_relation_history_create(&emc->aim_history);
 	emc->log_level = debug_get_log_option_sample_log();
 
 	// Print name.
@@ -217,28 +402,28 @@ ems_motion_controller_create(ems_instance &emsi, enum xrt_device_name device_nam
 	// Setup input.
 	switch (device_name) {
 	case XRT_DEVICE_TOUCH_CONTROLLER:
-		emc->base.inputs[0].name = XRT_INPUT_TOUCH_SQUEEZE_VALUE;
-		emc->base.inputs[1].name = XRT_INPUT_TOUCH_TRIGGER_TOUCH;
-		emc->base.inputs[2].name = XRT_INPUT_TOUCH_TRIGGER_VALUE;
-		emc->base.inputs[3].name = XRT_INPUT_TOUCH_THUMBSTICK_CLICK;
-		emc->base.inputs[4].name = XRT_INPUT_TOUCH_THUMBSTICK_TOUCH;
-		emc->base.inputs[5].name = XRT_INPUT_TOUCH_THUMBSTICK;
-		emc->base.inputs[6].name = XRT_INPUT_TOUCH_THUMBREST_TOUCH;
-		emc->base.inputs[7].name = XRT_INPUT_TOUCH_GRIP_POSE;
-		emc->base.inputs[8].name = XRT_INPUT_TOUCH_AIM_POSE;
+		emc->base.inputs[EMS_TOUCH_SQUEEZE_VALUE].name = XRT_INPUT_TOUCH_SQUEEZE_VALUE;
+		emc->base.inputs[EMS_TOUCH_TRIGGER_TOUCH].name = XRT_INPUT_TOUCH_TRIGGER_TOUCH;
+		emc->base.inputs[EMS_TOUCH_TRIGGER_VALUE].name = XRT_INPUT_TOUCH_TRIGGER_VALUE;
+		emc->base.inputs[EMS_TOUCH_THUMBSTICK_CLICK].name = XRT_INPUT_TOUCH_THUMBSTICK_CLICK;
+		emc->base.inputs[EMS_TOUCH_THUMBSTICK_TOUCH].name = XRT_INPUT_TOUCH_THUMBSTICK_TOUCH;
+		emc->base.inputs[EMS_TOUCH_THUMBSTICK].name = XRT_INPUT_TOUCH_THUMBSTICK;
+		emc->base.inputs[EMS_TOUCH_THUMBREST_TOUCH].name = XRT_INPUT_TOUCH_THUMBREST_TOUCH;
+		emc->base.inputs[EMS_TOUCH_GRIP_POSE].name = XRT_INPUT_TOUCH_GRIP_POSE;
+		emc->base.inputs[EMS_TOUCH_AIM_POSE].name = XRT_INPUT_TOUCH_AIM_POSE;
 
 		if (device_type == XRT_DEVICE_TYPE_LEFT_HAND_CONTROLLER) {
-			emc->base.inputs[9].name = XRT_INPUT_TOUCH_X_CLICK;
-			emc->base.inputs[10].name = XRT_INPUT_TOUCH_X_TOUCH;
-			emc->base.inputs[11].name = XRT_INPUT_TOUCH_Y_CLICK;
-			emc->base.inputs[12].name = XRT_INPUT_TOUCH_Y_TOUCH;
-			emc->base.inputs[13].name = XRT_INPUT_TOUCH_MENU_CLICK;
+			emc->base.inputs[EMS_TOUCH_LOWER_CLICK].name = XRT_INPUT_TOUCH_X_CLICK;
+			emc->base.inputs[EMS_TOUCH_LOWER_TOUCH].name = XRT_INPUT_TOUCH_X_TOUCH;
+			emc->base.inputs[EMS_TOUCH_UPPER_CLICK].name = XRT_INPUT_TOUCH_Y_CLICK;
+			emc->base.inputs[EMS_TOUCH_UPPER_TOUCH].name = XRT_INPUT_TOUCH_Y_TOUCH;
+			emc->base.inputs[EMS_TOUCH_MENU_CLICK].name = XRT_INPUT_TOUCH_MENU_CLICK;
 		} else {
-			emc->base.inputs[9].name = XRT_INPUT_TOUCH_A_CLICK;
-			emc->base.inputs[10].name = XRT_INPUT_TOUCH_A_TOUCH;
-			emc->base.inputs[11].name = XRT_INPUT_TOUCH_B_CLICK;
-			emc->base.inputs[12].name = XRT_INPUT_TOUCH_B_TOUCH;
-			emc->base.inputs[13].name = XRT_INPUT_TOUCH_SYSTEM_CLICK;
+			emc->base.inputs[EMS_TOUCH_LOWER_CLICK].name = XRT_INPUT_TOUCH_A_CLICK;
+			emc->base.inputs[EMS_TOUCH_LOWER_TOUCH].name = XRT_INPUT_TOUCH_A_TOUCH;
+			emc->base.inputs[EMS_TOUCH_UPPER_CLICK].name = XRT_INPUT_TOUCH_B_CLICK;
+			emc->base.inputs[EMS_TOUCH_UPPER_TOUCH].name = XRT_INPUT_TOUCH_B_TOUCH;
+			emc->base.inputs[EMS_TOUCH_MENU_CLICK].name = XRT_INPUT_TOUCH_SYSTEM_CLICK;
 		}
 
 		emc->base.outputs[0].name = XRT_OUTPUT_NAME_TOUCH_HAPTIC;
@@ -246,6 +431,8 @@ ems_motion_controller_create(ems_instance &emsi, enum xrt_device_name device_nam
 	default: assert(false);
 	}
 
+	ems_callbacks_add(emsi.callbacks, EMS_CALLBACKS_EVENT_CONTROLLER, controller_handle_data, emc);
+
 	// Lastly setup variable tracking.
 	u_var_add_root(emc, emc->base.str, true);
 	u_var_add_pose(emc, &emc->pose, "pose");
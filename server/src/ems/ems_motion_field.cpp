@@ -0,0 +1,204 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Coarse motion of the content between frames, for the client to extrapolate late frames with.
+ * @ingroup comp_ems
+ */
+
+#include "ems_motion_field.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+
+
+/*
+ *
+ * Structs and defines.
+ *
+ */
+
+static constexpr int kThumbWidth = EMS_MOTION_FIELD_THUMB_WIDTH;
+static constexpr int kThumbHeight = EMS_MOTION_FIELD_THUMB_HEIGHT;
+static constexpr int kBlock = EMS_MOTION_FIELD_BLOCK;
+
+//! Luma samples per thumbnail pixel on each axis.
+static constexpr int kSamples = 4;
+
+//! Thumbnail pixels searched in each direction, a view width in about 16 frames.
+static constexpr int kSearchRange = 4;
+
+//! A match has to beat standing still by this much per pixel, flat blocks match anywhere.
+static constexpr int kMinGainPerPixel = 2;
+
+
+/*
+ *
+ * Helper functions.
+ *
+ */
+
+static void
+take_thumbnail(const uint8_t *luma, size_t stride, uint32_t width, uint32_t height, uint8_t *out)
+{
+	for (int ty = 0; ty < kThumbHeight; ty++) {
+		for (int tx = 0; tx < kThumbWidth; tx++) {
+			uint32_t sum = 0;
+			for (int sy = 0; sy < kSamples; sy++) {
+				// At the centres of a grid within the thumbnail pixel.
+				uint32_t y = (uint32_t)(((ty * kSamples + sy) * 2 + 1) * (uint64_t)height /
+				                        (kThumbHeight * kSamples * 2));
+				const uint8_t *row = luma + y * stride;
+				for (int sx = 0; sx < kSamples; sx++) {
+					uint32_t x = (uint32_t)(((tx * kSamples + sx) * 2 + 1) * (uint64_t)width /
+					                        (kThumbWidth * kSamples * 2));
+					sum += row[x];
+				}
+			}
+			out[ty * kThumbWidth + tx] = (uint8_t)(sum / (kSamples * kSamples));
+		}
+	}
+}
+
+static int
+block_sad(const uint8_t *current, const uint8_t *previous, int x0, int y0, int dx, int dy)
+{
+	int sad = 0;
+	for (int y = y0; y < y0 + kBlock; y++) {
+		int py = std::clamp(y + dy, 0, kThumbHeight - 1);
+		for (int x = x0; x < x0 + kBlock; x++) {
+			int px = std::clamp(x + dx, 0, kThumbWidth - 1);
+			sad += abs((int)current[y * kThumbWidth + x] - (int)previous[py * kThumbWidth + px]);
+		}
+	}
+	return sad;
+}
+
+//! Offset of the minimum of a parabola through the costs left of, at and right of it.
+static float
+subpel_offset(int minus, int at, int plus)
+{
+	int curvature = minus - 2 * at + plus;
+	if (curvature <= 0) {
+		return 0.0f;
+	}
+	return std::clamp((float)(minus - plus) / (float)(2 * curvature), -0.5f, 0.5f);
+}
+
+static int8_t
+to_units(float thumb_pixels)
+{
+	return (int8_t)std::clamp((int)std::lround(thumb_pixels * EMS_MOTION_FIELD_SUBPEL), -127, 127);
+}
+
+static void
+match_view(const uint8_t *current, const uint8_t *previous, const struct xrt_vec2 *head_motion, int8_t *out)
+{
+	for (int by = 0; by < EMS_MOTION_FIELD_HEIGHT; by++) {
+		for (int bx = 0; bx < EMS_MOTION_FIELD_WIDTH; bx++) {
+			int x0 = bx * kBlock;
+			int y0 = by * kBlock;
+
+			int costs[2 * kSearchRange + 1][2 * kSearchRange + 1];
+			int best_dx = 0;
+			int best_dy = 0;
+			int best = INT_MAX;
+			for (int dy = -kSearchRange; dy <= kSearchRange; dy++) {
+				for (int dx = -kSearchRange; dx <= kSearchRange; dx++) {
+					int sad = block_sad(current, previous, x0, y0, dx, dy);
+					costs[dy + kSearchRange][dx + kSearchRange] = sad;
+					if (sad < best) {
+						best = sad;
+						best_dx = dx;
+						best_dy = dy;
+					}
+				}
+			}
+
+			// The content of the block came from where it matches best in the previous frame.
+			float vx = 0.0f;
+			float vy = 0.0f;
+			int still = costs[kSearchRange][kSearchRange];
+			if (best + kMinGainPerPixel * kBlock * kBlock < still) {
+				int cx = best_dx + kSearchRange;
+				int cy = best_dy + kSearchRange;
+				float fx = 0.0f;
+				float fy = 0.0f;
+				if (cx > 0 && cx < 2 * kSearchRange) {
+					fx = subpel_offset(costs[cy][cx - 1], best, costs[cy][cx + 1]);
+				}
+				if (cy > 0 && cy < 2 * kSearchRange) {
+					fy = subpel_offset(costs[cy - 1][cx], best, costs[cy + 1][cx]);
+				}
+				vx = -((float)best_dx + fx);
+				vy = -((float)best_dy + fy);
+			}
+
+			int8_t *v = out + (by * EMS_MOTION_FIELD_WIDTH + bx) * 2;
+			v[0] = to_units(vx - head_motion->x * kThumbWidth);
+			v[1] = to_units(vy - head_motion->y * kThumbHeight);
+		}
+	}
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+void
+ems_motion_field_reset(struct ems_motion_field *mf)
+{
+	mf->have_previous = false;
+	mf->previous_sequence = 0;
+	mf->view_width = 0;
+	mf->view_height = 0;
+}
+
+bool
+ems_motion_field_add_frame(struct ems_motion_field *mf,
+                           uint32_t sequence,
+                           const uint8_t *luma,
+                           size_t stride,
+                           uint32_t view_offset,
+                           uint32_t view_width,
+                           uint32_t view_height,
+                           const struct xrt_vec2 head_motion[2],
+                           int8_t out_vectors[EMS_MOTION_FIELD_SIZE])
+{
+	if (view_width < kThumbWidth * kSamples || view_height < kThumbHeight * kSamples) {
+		ems_motion_field_reset(mf);
+		return false;
+	}
+
+	bool comparable = mf->have_previous && sequence == mf->previous_sequence + 1 &&
+	                  view_width == mf->view_width && view_height == mf->view_height;
+
+	mf->current ^= 1;
+	for (uint32_t view = 0; view < 2; view++) {
+		take_thumbnail(luma + view * view_offset, stride, view_width, view_height,
+		               mf->thumbnails[mf->current][view]);
+	}
+
+	mf->have_previous = true;
+	mf->previous_sequence = sequence;
+	mf->view_width = view_width;
+	mf->view_height = view_height;
+
+	if (!comparable) {
+		return false;
+	}
+
+	const uint32_t per_view = EMS_MOTION_FIELD_SIZE / 2;
+	for (uint32_t view = 0; view < 2; view++) {
+		match_view(mf->thumbnails[mf->current][view], mf->thumbnails[mf->current ^ 1][view], &head_motion[view],
+		           out_vectors + view * per_view);
+	}
+	return true;
+}
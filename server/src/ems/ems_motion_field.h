@@ -0,0 +1,108 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Coarse motion of the content between frames, for the client to extrapolate late frames with.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include "xrt/xrt_defines.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Blocks per view on each axis, each has one vector.
+#define EMS_MOTION_FIELD_WIDTH 16
+#define EMS_MOTION_FIELD_HEIGHT 8
+
+//! Thumbnail pixels per block on each axis.
+#define EMS_MOTION_FIELD_BLOCK 4
+
+//! Vector units per thumbnail pixel.
+#define EMS_MOTION_FIELD_SUBPEL 4
+
+#define EMS_MOTION_FIELD_THUMB_WIDTH (EMS_MOTION_FIELD_WIDTH * EMS_MOTION_FIELD_BLOCK)
+#define EMS_MOTION_FIELD_THUMB_HEIGHT (EMS_MOTION_FIELD_HEIGHT * EMS_MOTION_FIELD_BLOCK)
+
+//! An x and a y byte per block, the rows of the left view then those of the right.
+#define EMS_MOTION_FIELD_SIZE (2 * 2 * EMS_MOTION_FIELD_WIDTH * EMS_MOTION_FIELD_HEIGHT)
+
+/*!
+ * Block matching on luma thumbnails of consecutive frames.
+ *
+ * The vectors are in the coordinates of the frame, through the foveation warp,
+ * and in units of 1 / (@ref EMS_MOTION_FIELD_THUMB_WIDTH * @ref
+ * EMS_MOTION_FIELD_SUBPEL) of a view's width, likewise for the height. They
+ * point where the content of the block moves in one frame.
+ *
+ * A frame is a few hundred microseconds on the CPU, touching only a sparse grid
+ * of its luma. Not thread safe, feed it from where the frames are pushed.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_motion_field
+{
+	//! Luma averages per view, of the last frame and the one before it.
+	uint8_t thumbnails[2][2][EMS_MOTION_FIELD_THUMB_WIDTH * EMS_MOTION_FIELD_THUMB_HEIGHT];
+
+	//! Index of the last frame in @ref thumbnails.
+	uint32_t current;
+
+	bool have_previous;
+	uint32_t previous_sequence;
+
+	//! Of the area the last thumbnails were taken from, the views are not compared across a change.
+	uint32_t view_width;
+	uint32_t view_height;
+};
+
+/*!
+ * Forget the previous frame, the next one gives no vectors.
+ *
+ * @ingroup comp_ems
+ */
+void
+ems_motion_field_reset(struct ems_motion_field *mf);
+
+/*!
+ * Take the thumbnails of a frame and match them against those of the one
+ * before.
+ *
+ * @param sequence Of the frame, a gap forgets the previous one.
+ * @param luma First row of the luma plane.
+ * @param stride Of the luma plane.
+ * @param view_offset Columns from the left view to the right view.
+ * @param view_width Columns of each view holding content, from its left.
+ * @param view_height Rows holding content, from the top.
+ * @param head_motion Per view, how far the head's rotation alone moved the
+ *        content since the previous frame, as a fraction of the view. Taken out
+ *        of the vectors, the client's reprojection already accounts for it.
+ * @param out_vectors Filled in if this returns true.
+ *
+ * @return false if there is no previous frame to compare with.
+ * @ingroup comp_ems
+ */
+bool
+ems_motion_field_add_frame(struct ems_motion_field *mf,
+                           uint32_t sequence,
+                           const uint8_t *luma,
+                           size_t stride,
+                           uint32_t view_offset,
+                           uint32_t view_width,
+                           uint32_t view_height,
+                           const struct xrt_vec2 head_motion[2],
+                           int8_t out_vectors[EMS_MOTION_FIELD_SIZE]);
+
+
+#ifdef __cplusplus
+}
+#endif
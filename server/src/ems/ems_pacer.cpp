@@ -0,0 +1,225 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Frame pacer locked to the client's display phase.
+ * @ingroup comp_ems
+ */
+
+#include "ems_pacer.h"
+#include "ems_latency.h"
+
+#include "util/u_misc.h"
+#include "util/u_pacing.h"
+#include "util/u_logging.h"
+#include "util/u_time.h"
+
+#include <algorithm>
+
+
+/*
+ *
+ * Structs and defines.
+ *
+ */
+
+//! Fraction of the phase error corrected per prediction, low so one late frame does not throw us off.
+static constexpr double kPhaseGain = 0.1;
+
+//! Largest phase step per prediction, as a fraction of the period.
+static constexpr double kMaxPhaseStep = 0.05;
+
+struct ems_pacer
+{
+	struct u_pacing_compositor base;
+
+	struct ems_latency *latency;
+
+	uint64_t period_ns;
+	uint64_t margin_ns;
+
+	//! Server time of one wake-up, all others are a whole number of periods away.
+	uint64_t phase_ns;
+
+	int64_t frame_id_generator;
+	uint64_t last_wake_up_ns;
+};
+
+static inline struct ems_pacer *
+ems_pacer(struct u_pacing_compositor *upc)
+{
+	return (struct ems_pacer *)upc;
+}
+
+
+/*
+ *
+ * Helper functions.
+ *
+ */
+
+static void
+update_phase(struct ems_pacer *p)
+{
+	int64_t slack_ns = 0;
+	if (!ems_latency_take_client_slack(p->latency, &slack_ns)) {
+		return;
+	}
+
+	int64_t period = (int64_t)p->period_ns;
+
+	// Slack close to a period is a frame that only just missed, take the short way round.
+	int64_t error_ns = slack_ns - (int64_t)p->margin_ns;
+	error_ns %= period;
+	if (error_ns > period / 2) {
+		error_ns -= period;
+	} else if (error_ns < -period / 2) {
+		error_ns += period;
+	}
+
+	// Early frames can wake up later, late ones earlier.
+	int64_t max_step = (int64_t)((double)period * kMaxPhaseStep);
+	int64_t step = std::clamp((int64_t)((double)error_ns * kPhaseGain), -max_step, max_step);
+
+	p->phase_ns = (uint64_t)((int64_t)p->phase_ns + step);
+
+	U_LOG_T("Client slack %.2f ms, moving phase by %.3f ms", time_ns_to_ms_f(slack_ns), time_ns_to_ms_f(step));
+}
+
+static uint64_t
+next_wake_up(struct ems_pacer *p, uint64_t now_ns)
+{
+	uint64_t wake_up_ns = p->phase_ns;
+	if (now_ns > wake_up_ns) {
+		uint64_t periods = (now_ns - wake_up_ns + p->period_ns - 1) / p->period_ns;
+		wake_up_ns += periods * p->period_ns;
+	} else {
+		// The phase moved ahead of us, keep the wake-ups one period apart.
+		wake_up_ns -= ((wake_up_ns - now_ns) / p->period_ns) * p->period_ns;
+	}
+
+	// Never wake twice for one slot when the phase moves back.
+	if (wake_up_ns < p->last_wake_up_ns + p->period_ns / 2) {
+		wake_up_ns += p->period_ns;
+	}
+
+	return wake_up_ns;
+}
+
+
+/*
+ *
+ * Member functions.
+ *
+ */
+
+static void
+pc_predict(struct u_pacing_compositor *upc,
+           uint64_t now_ns,
+           int64_t *out_frame_id,
+           uint64_t *out_wake_up_time_ns,
+           uint64_t *out_desired_present_time_ns,
+           uint64_t *out_present_slop_ns,
+           uint64_t *out_predicted_display_time_ns,
+           uint64_t *out_predicted_display_period_ns,
+           uint64_t *out_min_display_period_ns)
+{
+	struct ems_pacer *p = ems_pacer(upc);
+
+	update_phase(p);
+
+	uint64_t wake_up_ns = next_wake_up(p, now_ns);
+	p->last_wake_up_ns = wake_up_ns;
+
+	// Rendering and encoding get one period, the latency to the client is added by the compositor.
+	uint64_t present_ns = wake_up_ns + p->period_ns;
+
+	*out_frame_id = ++p->frame_id_generator;
+	*out_wake_up_time_ns = wake_up_ns;
+	*out_desired_present_time_ns = present_ns;
+	*out_present_slop_ns = U_TIME_HALF_MS_IN_NS;
+	*out_predicted_display_time_ns = present_ns;
+	*out_predicted_display_period_ns = p->period_ns;
+	*out_min_display_period_ns = p->period_ns;
+}
+
+static void
+pc_mark_point(struct u_pacing_compositor *upc, enum u_timing_point point, int64_t frame_id, uint64_t when_ns)
+{
+	// The client's reports are all we go by.
+}
+
+static void
+pc_info(struct u_pacing_compositor *upc,
+        int64_t frame_id,
+        uint64_t desired_present_time_ns,
+        uint64_t actual_present_time_ns,
+        uint64_t earliest_present_time_ns,
+        uint64_t present_margin_ns,
+        uint64_t when_ns)
+{
+	// Nothing is presented locally.
+}
+
+static void
+pc_info_gpu(
+    struct u_pacing_compositor *upc, int64_t frame_id, uint64_t gpu_start_ns, uint64_t gpu_end_ns, uint64_t when_ns)
+{
+	// Not used.
+}
+
+static void
+pc_update_vblank_from_display_control(struct u_pacing_compositor *upc, uint64_t last_vblank_ns)
+{
+	// No local display.
+}
+
+static void
+pc_update_present_offset(struct u_pacing_compositor *upc, int64_t frame_id, uint64_t present_to_display_offset_ns)
+{
+	// Not used.
+}
+
+static void
+pc_destroy(struct u_pacing_compositor *upc)
+{
+	free(ems_pacer(upc));
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+xrt_result_t
+ems_pacer_create(uint64_t frame_interval_ns,
+                 uint64_t margin_ns,
+                 uint64_t now_ns,
+                 struct ems_latency *latency,
+                 struct u_pacing_compositor **out_upc)
+{
+	struct ems_pacer *p = U_TYPED_CALLOC(struct ems_pacer);
+	p->base.predict = pc_predict;
+	p->base.mark_point = pc_mark_point;
+	p->base.info = pc_info;
+	p->base.info_gpu = pc_info_gpu;
+	p->base.update_vblank_from_display_control = pc_update_vblank_from_display_control;
+	p->base.update_present_offset = pc_update_present_offset;
+	p->base.destroy = pc_destroy;
+	p->latency = latency;
+	p->period_ns = frame_interval_ns;
+	p->margin_ns = std::min(margin_ns, frame_interval_ns / 2);
+	p->phase_ns = now_ns + frame_interval_ns;
+	p->frame_id_generator = 5;
+
+	U_LOG_I("Pacing to the client display, period %.2f ms, margin %.2f ms", time_ns_to_ms_f(p->period_ns),
+	        time_ns_to_ms_f(p->margin_ns));
+
+	*out_upc = &p->base;
+
+	return XRT_SUCCESS;
+}
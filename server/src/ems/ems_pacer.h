@@ -0,0 +1,44 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Frame pacer locked to the client's display phase.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include "xrt/xrt_results.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct u_pacing_compositor;
+struct ems_latency;
+
+/*!
+ * Creates a pacer that wakes up at @p frame_interval_ns like the fake one,
+ * but shifts the phase of the wake-ups until frames finish decoding on the
+ * client @p margin_ns before it begins the frame that uses them.
+ *
+ * Frames arriving at a random phase get either reused or dropped, this is
+ * what makes the stream judder.
+ *
+ * @ingroup comp_ems
+ */
+xrt_result_t
+ems_pacer_create(uint64_t frame_interval_ns,
+                 uint64_t margin_ns,
+                 uint64_t now_ns,
+                 struct ems_latency *latency,
+                 struct u_pacing_compositor **out_upc);
+
+
+#ifdef __cplusplus
+}
+#endif
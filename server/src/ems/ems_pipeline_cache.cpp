@@ -0,0 +1,140 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Vulkan pipeline caches kept on disk, so a restart does not compile the shaders again.
+ * @ingroup comp_ems
+ */
+
+#include "ems_pipeline_cache.h"
+
+#include "util/u_logging.h"
+
+#include <glib.h>
+
+#include <string.h>
+
+
+/*
+ *
+ * Helper functions.
+ *
+ */
+
+//! Under the user's cache directory, $XDG_CACHE_HOME or ~/.cache.
+static gchar *
+get_cache_path(const char *name)
+{
+	gchar *file_name = g_strdup_printf("%s.vkpipelinecache", name);
+	gchar *path = g_build_filename(g_get_user_cache_dir(), "electric-maple", file_name, NULL);
+	g_free(file_name);
+	return path;
+}
+
+/*!
+ * Drivers are meant to ignore the data of another device or driver version themselves, not all of them do. The
+ * header layout is fixed by the spec.
+ */
+static bool
+matches_device(struct vk_bundle *vk, const uint8_t *data, size_t size)
+{
+	VkPipelineCacheHeaderVersionOne header;
+	if (size < sizeof(header)) {
+		return false;
+	}
+	memcpy(&header, data, sizeof(header));
+
+	VkPhysicalDeviceProperties properties = {};
+	vk->vkGetPhysicalDeviceProperties(vk->physical_device, &properties);
+
+	return header.headerSize >= sizeof(header) && header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+	       header.vendorID == properties.vendorID && header.deviceID == properties.deviceID &&
+	       memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+VkPipelineCache
+ems_pipeline_cache_load(struct vk_bundle *vk, const char *name)
+{
+	gchar *path = get_cache_path(name);
+	gchar *data = NULL;
+	gsize size = 0;
+
+	VkPipelineCacheCreateInfo info = {};
+	info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	if (g_file_get_contents(path, &data, &size, NULL)) {
+		if (matches_device(vk, (const uint8_t *)data, size)) {
+			info.initialDataSize = size;
+			info.pInitialData = data;
+		} else {
+			U_LOG_I("Pipeline cache %s is from another device or driver, starting over.", path);
+		}
+	}
+
+	VkPipelineCache cache = VK_NULL_HANDLE;
+	VkResult ret = vk->vkCreatePipelineCache(vk->device, &info, NULL, &cache);
+	if (ret != VK_SUCCESS && info.initialDataSize > 0) {
+		// Corrupt on disk, the driver may refuse what it does not understand.
+		info.initialDataSize = 0;
+		info.pInitialData = NULL;
+		ret = vk->vkCreatePipelineCache(vk->device, &info, NULL, &cache);
+	}
+	if (ret != VK_SUCCESS) {
+		VK_WARN(vk, "vkCreatePipelineCache: %s", vk_result_string(ret));
+		cache = VK_NULL_HANDLE;
+	} else if (info.initialDataSize > 0) {
+		U_LOG_D("Loaded %zu bytes of pipeline cache from %s", (size_t)size, path);
+	}
+
+	g_free(data);
+	g_free(path);
+	return cache;
+}
+
+void
+ems_pipeline_cache_save_and_destroy(struct vk_bundle *vk, const char *name, VkPipelineCache *cache)
+{
+	if (*cache == VK_NULL_HANDLE) {
+		return;
+	}
+
+	size_t size = 0;
+	void *data = NULL;
+	VkResult ret = vk->vkGetPipelineCacheData(vk->device, *cache, &size, NULL);
+	if (ret == VK_SUCCESS && size > 0) {
+		data = g_malloc(size);
+		ret = vk->vkGetPipelineCacheData(vk->device, *cache, &size, data);
+	}
+
+	vk->vkDestroyPipelineCache(vk->device, *cache, NULL);
+	*cache = VK_NULL_HANDLE;
+
+	if (ret != VK_SUCCESS || data == NULL) {
+		g_free(data);
+		return;
+	}
+
+	gchar *path = get_cache_path(name);
+	gchar *dir = g_path_get_dirname(path);
+	GError *error = NULL;
+
+	// Written to a temporary file and renamed over, a crash leaves the old cache or none.
+	if (g_mkdir_with_parents(dir, 0755) != 0) {
+		U_LOG_W("Could not create %s for the pipeline cache.", dir);
+	} else if (!g_file_set_contents(path, (const gchar *)data, (gssize)size, &error)) {
+		U_LOG_W("Could not save the pipeline cache: %s", error->message);
+		g_clear_error(&error);
+	}
+
+	g_free(dir);
+	g_free(path);
+	g_free(data);
+}
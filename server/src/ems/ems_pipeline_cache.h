@@ -0,0 +1,43 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Vulkan pipeline caches kept on disk, so a restart does not compile the shaders again.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include "vk/vk_helpers.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * Create a pipeline cache with what was saved under @p name by an earlier
+ * run, if it was saved on this device and driver. Starts empty otherwise.
+ *
+ * @return VK_NULL_HANDLE if even an empty cache could not be created, the
+ *         pipelines are then created without one.
+ * @ingroup comp_ems
+ */
+VkPipelineCache
+ems_pipeline_cache_load(struct vk_bundle *vk, const char *name);
+
+/*!
+ * Write @p cache to disk under @p name, after the pipelines were created
+ * with it, and destroy it. Nothing is lost if the write fails, only time on
+ * the next start.
+ *
+ * @ingroup comp_ems
+ */
+void
+ems_pipeline_cache_save_and_destroy(struct vk_bundle *vk, const char *name, VkPipelineCache *cache);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,79 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Sequence lock holding the latest value of one writer for any number of readers.
+ * @ingroup drv_ems
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/*!
+ * The latest @p T, stored without locks: the writer never waits and readers
+ * retry until they copied it out between two writes.
+ *
+ * Stored as atomic words so torn reads are detected instead of being data races.
+ * There must only be one writer at a time, readers need no coordination.
+ */
+template <typename T> class EmsSeqlock
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Copied as words");
+
+public:
+	explicit EmsSeqlock(const T &initial)
+	{
+		store(initial);
+	}
+
+	void
+	store(const T &value)
+	{
+		uint64_t words[kWords] = {};
+		std::memcpy(words, &value, sizeof(T));
+
+		uint32_t seq = sequence.load(std::memory_order_relaxed);
+		// Odd while writing.
+		sequence.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		for (size_t i = 0; i < kWords; i++) {
+			data[i].store(words[i], std::memory_order_relaxed);
+		}
+
+		sequence.store(seq + 2, std::memory_order_release);
+	}
+
+	T
+	load() const
+	{
+		uint64_t words[kWords];
+		uint32_t before;
+		uint32_t after;
+
+		do {
+			before = sequence.load(std::memory_order_acquire);
+			for (size_t i = 0; i < kWords; i++) {
+				words[i] = data[i].load(std::memory_order_relaxed);
+			}
+			std::atomic_thread_fence(std::memory_order_acquire);
+			after = sequence.load(std::memory_order_relaxed);
+		} while ((before & 1) != 0 || before != after);
+
+		T value;
+		std::memcpy(&value, words, sizeof(T));
+		return value;
+	}
+
+private:
+	static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+	std::atomic<uint32_t> sequence{0};
+	std::atomic<uint64_t> data[kWords];
+};
@@ -20,6 +20,8 @@
 #include "util/u_pacing.h"
 #include "util/u_logging.h"
 
+#include "ems_seqlock.h"
+
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -35,15 +37,31 @@
 
 
 struct ems_callbacks;
+struct ems_latency;
+struct ems_telemetry;
 struct ems_instance;
 struct ems_hmd;
 
+//! The two newest HMD poses, to interpolate between or predict from.
+struct ems_hmd_latest_poses
+{
+	//! Zero timestamp while there is only one pose.
+	uint64_t previous_timestamp;
+	xrt_space_relation previous;
+	uint64_t newest_timestamp;
+	xrt_space_relation newest;
+};
+
 struct ems_hmd_recvbuf
 {
-	std::atomic_bool updated;
+	//! Serializes the writers, readers of @ref latest never take it.
 	std::mutex mutex;
-	uint64_t timestamp;
-	xrt_space_relation rel = XRT_SPACE_RELATION_ZERO;
+	//! TrackingMessage::sequence_idx of the newest pose, poses come unordered.
+	int64_t sequence_idx = 0;
+	//! What was last stored to @ref latest, only touched by the writers.
+	ems_hmd_latest_poses written = {};
+
+	EmsSeqlock<ems_hmd_latest_poses> latest{ems_hmd_latest_poses{}};
 };
 
 struct ems_hmd
@@ -60,13 +78,53 @@ struct ems_hmd
 	enum u_logging_level log_level;
 };
 
+//! Inputs of a Touch controller, by their index in @ref xrt_device::inputs.
+enum ems_touch_input
+{
+	EMS_TOUCH_SQUEEZE_VALUE,
+	EMS_TOUCH_TRIGGER_TOUCH,
+	EMS_TOUCH_TRIGGER_VALUE,
+	EMS_TOUCH_THUMBSTICK_CLICK,
+	EMS_TOUCH_THUMBSTICK_TOUCH,
+	EMS_TOUCH_THUMBSTICK,
+	EMS_TOUCH_THUMBREST_TOUCH,
+	EMS_TOUCH_GRIP_POSE,
+	EMS_TOUCH_AIM_POSE,
+	//! X or A.
+	EMS_TOUCH_LOWER_CLICK,
+	EMS_TOUCH_LOWER_TOUCH,
+	//! Y or B.
+	EMS_TOUCH_UPPER_CLICK,
+	EMS_TOUCH_UPPER_TOUCH,
+	//! Menu or system.
+	EMS_TOUCH_MENU_CLICK,
+	EMS_TOUCH_INPUT_COUNT,
+};
+
+struct ems_motion_controller_recvbuf
+{
+	std::mutex mutex;
+	//! Server time the client synced the inputs at, 0 until it sent any.
+	uint64_t timestamp = 0;
+	union xrt_input_value inputs[EMS_TOUCH_INPUT_COUNT] = {};
+	//! The last message had pose samples.
+	bool tracked = false;
+};
+
 struct ems_motion_controller
 {
 	//! Has to come first.
 	struct xrt_device base;
 
+	//! Reported until the client sends a sample.
 	struct xrt_pose pose;
 
+	//! Fed with the client's samples, they predict to the time asked for.
+	struct m_relation_history *grip_history;
+	struct m_relation_history *aim_history;
+
+	std::unique_ptr<ems_motion_controller_recvbuf> received;
+
 	// Should outlive us
 	struct ems_instance *instance;
 
@@ -94,6 +152,12 @@ struct ems_instance
 
 	//! Callbacks collection
 	struct ems_callbacks *callbacks;
+
+	//! When the client displays our frames, fed by its frame reports.
+	struct ems_latency *latency;
+
+	//! Per stage latency of the frames, also fed by the frame reports.
+	struct ems_telemetry *telemetry;
 };
 
 
@@ -23,6 +23,8 @@
 
 #include "gst/ems_pipeline_args.h"
 
+#include "em_thread_sched.h"
+
 // #include "target_lists.h"
 
 
@@ -30,6 +32,37 @@
 U_TRACE_TARGET_SETUP(U_TRACE_WHICH_SERVICE)
 
 
+/*!
+ * Tracking and rendering outrank encoding, which outranks the network, a late pose or frame costs more than a
+ * late packet.
+ */
+static int
+fifo_priority_of(enum em_thread_role role)
+{
+	switch (role) {
+	case EM_THREAD_ROLE_RENDER: return 20;
+	case EM_THREAD_ROLE_CODEC: return 15;
+	case EM_THREAD_ROLE_TRACKING: return 20;
+	case EM_THREAD_ROLE_NETWORK: return 10;
+	default: return 0;
+	}
+}
+
+//! The scheduling of each thread role, the threads apply it themselves when they start.
+static void
+setup_thread_policies(const struct ems_arguments *args)
+{
+	for (int i = 0; i < EM_THREAD_ROLE_COUNT; i++) {
+		enum em_thread_role role = (enum em_thread_role)i;
+		struct em_thread_policy policy = {};
+		policy.cpu_mask = args->cpu_affinity;
+		policy.fifo_priority = args->realtime ? fifo_priority_of(role) : 0;
+		policy.nice = args->thread_nice;
+		em_thread_sched_set_policy(role, &policy);
+	}
+}
+
+
 // TODO(chesterton's fence) Shouldn't we just include ipc_server.h here?
 extern "C" int
 ipc_server_main(int argc, char *argv[]);
@@ -43,6 +76,7 @@ main(int argc, char *argv[])
 		return -1;
 	}
 
+	setup_thread_policies(ems_arguments_get());
 
 #ifdef XRT_OS_WINDOWS
 	u_win_try_privilege_or_priority_from_args(U_LOGGING_INFO, argc, argv);
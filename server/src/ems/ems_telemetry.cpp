@@ -0,0 +1,267 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Per stage latency of the frames, from layer commit to display on the client.
+ * @ingroup aux_util
+ */
+
+#include "ems_telemetry.h"
+#include "ems_callbacks.h"
+#include "ems_latency.h"
+
+#include "os/os_time.h"
+
+#include "util/u_logging.h"
+#include "util/u_time.h"
+
+#include "electricmaple.pb.h"
+
+#include <array>
+#include <memory>
+#include <mutex>
+
+//! Frames whose report comes later than this many frames are dropped.
+static constexpr size_t kFrameHistorySize = 256;
+
+//! Histogram resolution and range, anything slower lands in the last bucket.
+static constexpr int64_t kBucketNs = U_TIME_1MS_IN_NS / 10;
+static constexpr size_t kBucketCount = 1000;
+
+//! Percentiles are logged and handed out per window.
+static constexpr uint64_t kWindowNs = 5 * U_TIME_1S_IN_NS;
+
+struct ems_telemetry_frame
+{
+	int64_t frame_sequence_id = -1;
+	std::array<uint64_t, EMS_TELEMETRY_STAGE_COUNT> stamps_ns = {};
+};
+
+struct ems_telemetry_histogram
+{
+	std::array<uint32_t, kBucketCount> buckets = {};
+	uint32_t count = 0;
+
+	void
+	add(int64_t ns)
+	{
+		size_t bucket = ns <= 0 ? 0 : (size_t)(ns / kBucketNs);
+		buckets[bucket < kBucketCount ? bucket : kBucketCount - 1]++;
+		count++;
+	}
+
+	double
+	percentile_ms(double fraction) const
+	{
+		uint32_t target = (uint32_t)((double)count * fraction);
+		uint32_t seen = 0;
+		for (size_t i = 0; i < kBucketCount; i++) {
+			seen += buckets[i];
+			if (seen > target) {
+				// Middle of the bucket.
+				return ((double)i + 0.5) * (double)kBucketNs / (double)U_TIME_1MS_IN_NS;
+			}
+		}
+		return (double)(kBucketCount * kBucketNs) / (double)U_TIME_1MS_IN_NS;
+	}
+
+	ems_telemetry_percentiles
+	percentiles() const
+	{
+		return {count, percentile_ms(0.50), percentile_ms(0.95), percentile_ms(0.99)};
+	}
+};
+
+struct ems_telemetry
+{
+	struct ems_latency *latency = nullptr;
+
+	std::mutex mutex;
+	std::array<ems_telemetry_frame, kFrameHistorySize> frames;
+
+	//! Index 0 is layer commit to display, the others the stage before into that stage.
+	std::array<ems_telemetry_histogram, EMS_TELEMETRY_STAGE_COUNT> window;
+	std::array<ems_telemetry_percentiles, EMS_TELEMETRY_STAGE_COUNT> last_window = {};
+	uint64_t window_start_ns = 0;
+};
+
+static const char *stage_names[EMS_TELEMETRY_STAGE_COUNT] = {
+    "layer_commit",       //
+    "readback_complete",  //
+    "encode_in",          //
+    "encode_out",         //
+    "payload",            //
+    "client_depay",       //
+    "client_decode_end",  //
+    "client_begin_frame", //
+    "client_display",     //
+};
+
+static ems_telemetry_frame &
+get_frame_locked(struct ems_telemetry *telemetry, int64_t frame_sequence_id)
+{
+	ems_telemetry_frame &frame = telemetry->frames[(size_t)frame_sequence_id % kFrameHistorySize];
+	if (frame.frame_sequence_id != frame_sequence_id) {
+		frame = {};
+		frame.frame_sequence_id = frame_sequence_id;
+	}
+	return frame;
+}
+
+static void
+stamp_client_time_locked(struct ems_telemetry *telemetry,
+                         ems_telemetry_frame &frame,
+                         enum ems_telemetry_stage stage,
+                         int64_t client_time_ns)
+{
+	uint64_t server_ns = 0;
+	if (client_time_ns != 0 && ems_latency_client_to_server_time(telemetry->latency, client_time_ns, &server_ns)) {
+		frame.stamps_ns[stage] = server_ns;
+	}
+}
+
+static void
+close_window_locked(struct ems_telemetry *telemetry, uint64_t now_ns)
+{
+	for (size_t i = 0; i < EMS_TELEMETRY_STAGE_COUNT; i++) {
+		telemetry->last_window[i] = telemetry->window[i].percentiles();
+		telemetry->window[i] = {};
+	}
+	telemetry->window_start_ns = now_ns;
+
+	const ems_telemetry_percentiles &total = telemetry->last_window[0];
+	if (total.count == 0) {
+		return;
+	}
+
+	U_LOG_I("Frame latency over %u frames: p50 %.1f ms, p95 %.1f ms, p99 %.1f ms", total.count, total.p50_ms,
+	        total.p95_ms, total.p99_ms);
+	for (size_t i = 1; i < EMS_TELEMETRY_STAGE_COUNT; i++) {
+		const ems_telemetry_percentiles &p = telemetry->last_window[i];
+		if (p.count == 0) {
+			continue;
+		}
+		U_LOG_I("  %-18s p50 %5.1f ms, p95 %5.1f ms, p99 %5.1f ms", stage_names[i], p.p50_ms, p.p95_ms,
+		        p.p99_ms);
+	}
+}
+
+static void
+ems_telemetry_handle_data(enum ems_callbacks_event event, const em_proto_UpMessage *message, void *userdata)
+{
+	struct ems_telemetry *telemetry = (struct ems_telemetry *)userdata;
+
+	if (!message->has_frame) {
+		return;
+	}
+	const em_proto_UpFrameMessage &report = message->frame;
+
+	uint64_t now_ns = os_monotonic_get_ns();
+
+	std::lock_guard<std::mutex> lock(telemetry->mutex);
+
+	// Only frames we stamped ourselves, a stale report would start a new record otherwise.
+	ems_telemetry_frame &frame = telemetry->frames[(size_t)report.frame_sequence_id % kFrameHistorySize];
+	if (frame.frame_sequence_id != report.frame_sequence_id) {
+		return;
+	}
+
+	stamp_client_time_locked(telemetry, frame, EMS_TELEMETRY_STAGE_CLIENT_DEPAY, report.depay_time);
+	stamp_client_time_locked(telemetry, frame, EMS_TELEMETRY_STAGE_CLIENT_DECODE_END, report.decode_complete_time);
+	stamp_client_time_locked(telemetry, frame, EMS_TELEMETRY_STAGE_CLIENT_BEGIN_FRAME, report.begin_frame_time);
+	stamp_client_time_locked(telemetry, frame, EMS_TELEMETRY_STAGE_CLIENT_DISPLAY, report.display_time);
+
+	// A stage missing on this path, like encode for a compositor encoder, just has no sample.
+	for (size_t i = 1; i < EMS_TELEMETRY_STAGE_COUNT; i++) {
+		if (frame.stamps_ns[i] != 0 && frame.stamps_ns[i - 1] != 0) {
+			telemetry->window[i].add((int64_t)(frame.stamps_ns[i] - frame.stamps_ns[i - 1]));
+		}
+	}
+
+	uint64_t commit_ns = frame.stamps_ns[EMS_TELEMETRY_STAGE_LAYER_COMMIT];
+	uint64_t display_ns = frame.stamps_ns[EMS_TELEMETRY_STAGE_CLIENT_DISPLAY];
+	if (commit_ns != 0 && display_ns != 0) {
+		telemetry->window[0].add((int64_t)(display_ns - commit_ns));
+	}
+
+	// Each report completes its frame.
+	frame = {};
+
+	if (telemetry->window_start_ns == 0) {
+		telemetry->window_start_ns = now_ns;
+	} else if (now_ns - telemetry->window_start_ns >= kWindowNs) {
+		close_window_locked(telemetry, now_ns);
+	}
+}
+
+
+/*
+ *
+ * Exported functions.
+ *
+ */
+
+struct ems_telemetry *
+ems_telemetry_create(struct ems_callbacks *callbacks, struct ems_latency *latency)
+{
+	auto telemetry = std::make_unique<ems_telemetry>();
+	telemetry->latency = latency;
+
+	ems_callbacks_add(callbacks, EMS_CALLBACKS_EVENT_FRAME, ems_telemetry_handle_data, telemetry.get());
+
+	return telemetry.release();
+}
+
+void
+ems_telemetry_destroy(struct ems_telemetry **ptr_telemetry)
+{
+	if (!ptr_telemetry) {
+		return;
+	}
+	std::unique_ptr<ems_telemetry> telemetry(*ptr_telemetry);
+	*ptr_telemetry = nullptr;
+}
+
+void
+ems_telemetry_stamp(struct ems_telemetry *telemetry,
+                    int64_t frame_sequence_id,
+                    enum ems_telemetry_stage stage,
+                    uint64_t when_ns)
+{
+	if (telemetry == nullptr || frame_sequence_id < 0) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(telemetry->mutex);
+	get_frame_locked(telemetry, frame_sequence_id).stamps_ns[stage] = when_ns;
+}
+
+const char *
+ems_telemetry_stage_name(enum ems_telemetry_stage stage)
+{
+	return stage < EMS_TELEMETRY_STAGE_COUNT ? stage_names[stage] : "unknown";
+}
+
+bool
+ems_telemetry_get_stage(struct ems_telemetry *telemetry,
+                        enum ems_telemetry_stage stage,
+                        struct ems_telemetry_percentiles *out_percentiles)
+{
+	if (stage == EMS_TELEMETRY_STAGE_LAYER_COMMIT || stage >= EMS_TELEMETRY_STAGE_COUNT) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(telemetry->mutex);
+	*out_percentiles = telemetry->last_window[stage];
+	return out_percentiles->count > 0;
+}
+
+bool
+ems_telemetry_get_total(struct ems_telemetry *telemetry, struct ems_telemetry_percentiles *out_percentiles)
+{
+	std::lock_guard<std::mutex> lock(telemetry->mutex);
+	*out_percentiles = telemetry->last_window[0];
+	return out_percentiles->count > 0;
+}
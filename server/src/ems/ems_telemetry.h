@@ -0,0 +1,93 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Per stage latency of the frames, from layer commit to display on the client.
+ * @ingroup aux_util
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct ems_callbacks;
+struct ems_latency;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Where a frame was seen, in pipeline order.
+enum ems_telemetry_stage
+{
+	EMS_TELEMETRY_STAGE_LAYER_COMMIT,
+	EMS_TELEMETRY_STAGE_READBACK_COMPLETE,
+	EMS_TELEMETRY_STAGE_ENCODE_IN,
+	EMS_TELEMETRY_STAGE_ENCODE_OUT,
+	EMS_TELEMETRY_STAGE_PAYLOAD,
+	EMS_TELEMETRY_STAGE_CLIENT_DEPAY,
+	EMS_TELEMETRY_STAGE_CLIENT_DECODE_END,
+	EMS_TELEMETRY_STAGE_CLIENT_BEGIN_FRAME,
+	EMS_TELEMETRY_STAGE_CLIENT_DISPLAY,
+	EMS_TELEMETRY_STAGE_COUNT,
+};
+
+/// Latency percentiles over the last window, in milliseconds.
+struct ems_telemetry_percentiles
+{
+	uint32_t count;
+	double p50_ms;
+	double p95_ms;
+	double p99_ms;
+};
+
+/// Collects the stage timestamps of each frame by its frame_sequence_id.
+///
+/// The server stamps are taken as they happen, the client ones arrive with its
+/// frame report and are moved to server time with the offset @ref ems_latency
+/// estimates. That offset includes the uplink delay, which makes the network
+/// stage, payload to client depay, look shorter by about that much.
+struct ems_telemetry;
+
+/// Allocate telemetry fed by the frame reports arriving on @p callbacks.
+/// Must be created after @p latency, so it sees each report after it.
+/// @public @memberof ems_telemetry
+struct ems_telemetry *
+ems_telemetry_create(struct ems_callbacks *callbacks, struct ems_latency *latency);
+
+/// Destroy the telemetry and clear the pointer, the callbacks must have been reset.
+/// @public @memberof ems_telemetry
+void
+ems_telemetry_destroy(struct ems_telemetry **ptr_telemetry);
+
+/// Record that a frame reached a server stage at @p when_ns, in server monotonic time.
+/// @public @memberof ems_telemetry
+void
+ems_telemetry_stamp(struct ems_telemetry *telemetry,
+                    int64_t frame_sequence_id,
+                    enum ems_telemetry_stage stage,
+                    uint64_t when_ns);
+
+/// Short name of a stage, for logs and metrics.
+/// @public @memberof ems_telemetry
+const char *
+ems_telemetry_stage_name(enum ems_telemetry_stage stage);
+
+/// Time from the stage before @p stage into it, over the last window. False if the window had none.
+/// @public @memberof ems_telemetry
+bool
+ems_telemetry_get_stage(struct ems_telemetry *telemetry,
+                        enum ems_telemetry_stage stage,
+                        struct ems_telemetry_percentiles *out_percentiles);
+
+/// Time from layer commit to display, over the last window. False if the window had none.
+/// @public @memberof ems_telemetry
+bool
+ems_telemetry_get_total(struct ems_telemetry *telemetry, struct ems_telemetry_percentiles *out_percentiles);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,28 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Trace events that follow a single frame through the server.
+ * @ingroup aux_util
+ */
+#pragma once
+
+#include "xrt/xrt_config_build.h"
+#include "xrt/xrt_config_have.h"
+
+#include "util/u_trace_marker.h"
+
+#include <stdint.h>
+
+/*!
+ * Ties the enclosing trace event to the frame with @p FRAME_ID as a Perfetto flow, so a capture connects the events of
+ * one frame from layer commit to payloader. @p NAME must be a string literal or otherwise static.
+ */
+#if defined(XRT_FEATURE_TRACING) && defined(XRT_HAVE_PERCETTO)
+// Flow ID 0 means none, frame 0 is a frame.
+#define EMS_TRACE_FRAME_FLOW(NAME, FRAME_ID) TRACE_FLOW(sink, NAME, (uint64_t)(FRAME_ID) + 1)
+#else
+#define EMS_TRACE_FRAME_FLOW(NAME, FRAME_ID) (void)(FRAME_ID)
+#endif
@@ -0,0 +1,1646 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  H.264 encoding with Vulkan Video for the remote rendering compositor.
+ *
+ * Monado creates the compositor device with a single graphics queue, so the
+ * encoder creates a second device on the same physical device with a video
+ * encode queue. The NV12 frames from @ref ems_color_convert are imported as
+ * dmabuf, copied into the encode source image and encoded as IDR and P frames
+ * with a single reference, no B frames and POC type 2.
+ *
+ * @ingroup comp_ems
+ */
+
+#include "ems_vk_video_encoder.h"
+
+#include "util/u_misc.h"
+#include "util/u_logging.h"
+
+#include <atomic>
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(VK_KHR_video_encode_h264) && defined(VK_KHR_video_encode_queue) && VK_HEADER_VERSION >= 274
+#define EMS_HAVE_VK_VIDEO_ENCODE
+#endif
+
+
+#ifdef EMS_HAVE_VK_VIDEO_ENCODE
+
+//! Bitstream buffer size, enough for an IDR at the bitrates we stream at.
+#define EMS_VK_VIDEO_BITSTREAM_SIZE (4 * 1024 * 1024)
+
+//! Alternating between two DPB slots is all a single reference needs.
+#define EMS_VK_VIDEO_DPB_SLOTS (2)
+
+//! frame_num wraps at 16 with log2_max_frame_num_minus4 = 0.
+#define EMS_VK_VIDEO_MAX_FRAME_NUM (16)
+
+//! Periodic IDR so a client that lost a packet recovers without asking.
+#define EMS_VK_VIDEO_IDR_PERIOD_SECONDS (3)
+
+//! Same bound as --slices.
+#define EMS_VK_VIDEO_MAX_SLICES (32)
+
+#define EMS_VK_VIDEO_DEVICE_FUNCTIONS(X)                                                                               \
+	X(vkDestroyDevice)                                                                                             \
+	X(vkDeviceWaitIdle)                                                                                            \
+	X(vkGetDeviceQueue)                                                                                            \
+	X(vkQueueSubmit)                                                                                               \
+	X(vkCreateCommandPool)                                                                                         \
+	X(vkDestroyCommandPool)                                                                                        \
+	X(vkAllocateCommandBuffers)                                                                                    \
+	X(vkBeginCommandBuffer)                                                                                        \
+	X(vkEndCommandBuffer)                                                                                          \
+	X(vkResetCommandBuffer)                                                                                        \
+	X(vkCreateFence)                                                                                               \
+	X(vkDestroyFence)                                                                                              \
+	X(vkWaitForFences)                                                                                             \
+	X(vkResetFences)                                                                                               \
+	X(vkCreateSemaphore)                                                                                           \
+	X(vkDestroySemaphore)                                                                                          \
+	X(vkCreateBuffer)                                                                                              \
+	X(vkDestroyBuffer)                                                                                             \
+	X(vkCreateImage)                                                                                               \
+	X(vkDestroyImage)                                                                                              \
+	X(vkCreateImageView)                                                                                           \
+	X(vkDestroyImageView)                                                                                          \
+	X(vkGetBufferMemoryRequirements)                                                                               \
+	X(vkGetImageMemoryRequirements)                                                                                \
+	X(vkAllocateMemory)                                                                                            \
+	X(vkFreeMemory)                                                                                                \
+	X(vkBindBufferMemory)                                                                                          \
+	X(vkBindImageMemory)                                                                                           \
+	X(vkMapMemory)                                                                                                 \
+	X(vkGetMemoryFdPropertiesKHR)                                                                                  \
+	X(vkCreateQueryPool)                                                                                           \
+	X(vkDestroyQueryPool)                                                                                          \
+	X(vkGetQueryPoolResults)                                                                                       \
+	X(vkCmdResetQueryPool)                                                                                         \
+	X(vkCmdBeginQuery)                                                                                             \
+	X(vkCmdEndQuery)                                                                                               \
+	X(vkCmdPipelineBarrier2)                                                                                       \
+	X(vkCmdCopyBufferToImage)                                                                                      \
+	X(vkCreateVideoSessionKHR)                                                                                     \
+	X(vkDestroyVideoSessionKHR)                                                                                    \
+	X(vkGetVideoSessionMemoryRequirementsKHR)                                                                      \
+	X(vkBindVideoSessionMemoryKHR)                                                                                 \
+	X(vkCreateVideoSessionParametersKHR)                                                                           \
+	X(vkDestroyVideoSessionParametersKHR)                                                                          \
+	X(vkGetEncodedVideoSessionParametersKHR)                                                                       \
+	X(vkCmdBeginVideoCodingKHR)                                                                                    \
+	X(vkCmdEndVideoCodingKHR)                                                                                      \
+	X(vkCmdControlVideoCodingKHR)                                                                                  \
+	X(vkCmdEncodeVideoKHR)
+
+
+/*
+ *
+ * Structs.
+ *
+ */
+
+struct ems_vk_video_functions
+{
+#define EMS_DECLARE(name) PFN_##name name;
+	EMS_VK_VIDEO_DEVICE_FUNCTIONS(EMS_DECLARE)
+#undef EMS_DECLARE
+};
+
+/*!
+ * A frame of the color convert pool imported into the encoder device.
+ */
+struct ems_vk_video_import
+{
+	//! Only used as a key, no reference is held.
+	struct xrt_frame *frame;
+
+	VkBuffer buffer;
+	VkDeviceMemory memory;
+};
+
+struct ems_vk_video_encoder
+{
+	//! The compositor's bundle, for the instance and physical device.
+	struct vk_bundle *vk;
+
+	VkDevice device;
+	struct ems_vk_video_functions fn;
+
+	uint32_t encode_family;
+	uint32_t transfer_family;
+	VkQueue encode_queue;
+	VkQueue transfer_queue;
+
+	VkCommandPool encode_pool;
+	VkCommandPool transfer_pool;
+	VkCommandBuffer encode_cmd;
+	VkCommandBuffer transfer_cmd;
+
+	//! Only used when the encode family can't do transfers.
+	VkSemaphore copy_done;
+	VkFence fence;
+
+	VkVideoEncodeUsageInfoKHR usage_info;
+	VkVideoEncodeH264ProfileInfoKHR h264_profile;
+	VkVideoProfileInfoKHR profile;
+	VkVideoProfileListInfoKHR profile_list;
+
+	VkVideoSessionKHR session;
+	VkDeviceMemory session_memory[16];
+	uint32_t session_memory_count;
+	VkVideoSessionParametersKHR params;
+
+	VkImage src_image;
+	VkDeviceMemory src_memory;
+	VkImageView src_view;
+
+	//! One layer per DPB slot.
+	VkImage dpb_image;
+	VkDeviceMemory dpb_memory;
+	VkImageView dpb_views[EMS_VK_VIDEO_DPB_SLOTS];
+
+	VkBuffer bitstream;
+	VkDeviceMemory bitstream_memory;
+	const uint8_t *bitstream_mapped;
+	VkDeviceSize bitstream_size;
+
+	VkQueryPool query_pool;
+
+	struct ems_vk_video_import imports[16];
+	uint32_t import_count;
+
+	//! Visible size.
+	uint32_t width;
+	uint32_t height;
+
+	//! Macroblock aligned size.
+	VkExtent2D coded_extent;
+
+	VkVideoEncodeRateControlModeFlagBitsKHR rate_control_mode;
+	VkVideoEncodeH264RateControlInfoKHR h264_rate_control;
+	VkVideoEncodeRateControlLayerInfoKHR rate_control_layer;
+	VkVideoEncodeRateControlInfoKHR rate_control;
+
+	//! SPS and PPS in byte-stream format, prepended to every IDR.
+	uint8_t *headers;
+	size_t headers_size;
+
+	//! In frames, 0 makes IDRs only on request.
+	uint32_t idr_period;
+
+	//! Slices per picture, the implementation splits the macroblocks between them.
+	uint32_t slice_count;
+
+	/*
+	 * Encoding state, only touched by the encoding thread.
+	 */
+
+	bool session_initialized;
+	uint32_t frames_since_idr;
+	uint32_t frame_num;
+	uint16_t idr_pic_id;
+	uint32_t setup_slot;
+	int32_t ref_slot;
+	StdVideoEncodeH264ReferenceInfo ref_info;
+
+	std::atomic<bool> force_keyframe;
+
+	//! Bitrate asked for from outside, applied with the next encode.
+	std::atomic<uint32_t> target_bitrate_kbps;
+
+	//! Frame rate asked for from outside, applied with the next encode.
+	std::atomic<uint32_t> target_framerate;
+};
+
+
+/*
+ *
+ * Helpers.
+ *
+ */
+
+static bool
+load_device_functions(struct ems_vk_video_encoder *enc)
+{
+	struct vk_bundle *vk = enc->vk;
+
+#define EMS_LOAD(name)                                                                                                 \
+	enc->fn.name = (PFN_##name)vk->vkGetDeviceProcAddr(enc->device, #name);                                        \
+	if (enc->fn.name == NULL) {                                                                                    \
+		U_LOG_E("Failed to load " #name);                                                                      \
+		return false;                                                                                          \
+	}
+	EMS_VK_VIDEO_DEVICE_FUNCTIONS(EMS_LOAD)
+#undef EMS_LOAD
+
+	return true;
+}
+
+static bool
+find_queue_families(struct ems_vk_video_encoder *enc)
+{
+	struct vk_bundle *vk = enc->vk;
+
+	PFN_vkGetPhysicalDeviceQueueFamilyProperties2 get_props = (PFN_vkGetPhysicalDeviceQueueFamilyProperties2)
+	    vk->vkGetInstanceProcAddr(vk->instance, "vkGetPhysicalDeviceQueueFamilyProperties2");
+	if (get_props == NULL) {
+		U_LOG_E("vkGetPhysicalDeviceQueueFamilyProperties2 not available");
+		return false;
+	}
+
+	uint32_t count = 0;
+	get_props(vk->physical_device, &count, NULL);
+
+	VkQueueFamilyProperties2 *props = U_TYPED_ARRAY_CALLOC(VkQueueFamilyProperties2, count);
+	VkQueueFamilyVideoPropertiesKHR *video_props = U_TYPED_ARRAY_CALLOC(VkQueueFamilyVideoPropertiesKHR, count);
+	for (uint32_t i = 0; i < count; i++) {
+		video_props[i].sType = VK_STRUCTURE_TYPE_QUEUE_FAMILY_VIDEO_PROPERTIES_KHR;
+		props[i].sType = VK_STRUCTURE_TYPE_QUEUE_FAMILY_PROPERTIES_2;
+		props[i].pNext = &video_props[i];
+	}
+	get_props(vk->physical_device, &count, props);
+
+	const VkQueueFlags transfer_flags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT;
+
+	bool found_encode = false;
+	for (uint32_t i = 0; i < count; i++) {
+		if ((props[i].queueFamilyProperties.queueFlags & VK_QUEUE_VIDEO_ENCODE_BIT_KHR) != 0 &&
+		    (video_props[i].videoCodecOperations & VK_VIDEO_CODEC_OPERATION_ENCODE_H264_BIT_KHR) != 0) {
+			enc->encode_family = i;
+			found_encode = true;
+			break;
+		}
+	}
+
+	// Prefer doing the copy on the encode queue, saves a semaphore.
+	bool found_transfer = false;
+	if (found_encode && (props[enc->encode_family].queueFamilyProperties.queueFlags & transfer_flags) != 0) {
+		enc->transfer_family = enc->encode_family;
+		found_transfer = true;
+	}
+	for (uint32_t i = 0; !found_transfer && i < count; i++) {
+		if ((props[i].queueFamilyProperties.queueFlags & transfer_flags) != 0) {
+			enc->transfer_family = i;
+			found_transfer = true;
+		}
+	}
+
+	free(props);
+	free(video_props);
+
+	if (!found_encode) {
+		U_LOG_E("No queue family with H.264 video encode");
+		return false;
+	}
+
+	return found_transfer;
+}
+
+static VkResult
+create_device(struct ems_vk_video_encoder *enc)
+{
+	struct vk_bundle *vk = enc->vk;
+
+	const char *extensions[] = {
+	    VK_KHR_VIDEO_QUEUE_EXTENSION_NAME,             //
+	    VK_KHR_VIDEO_ENCODE_QUEUE_EXTENSION_NAME,      //
+	    VK_KHR_VIDEO_ENCODE_H264_EXTENSION_NAME,       //
+	    VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME,      //
+	    VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME, //
+	};
+
+	float priority = 1.0f;
+	VkDeviceQueueCreateInfo queue_infos[2] = {};
+	queue_infos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+	queue_infos[0].queueFamilyIndex = enc->encode_family;
+	queue_infos[0].queueCount = 1;
+	queue_infos[0].pQueuePriorities = &priority;
+	queue_infos[1] = queue_infos[0];
+	queue_infos[1].queueFamilyIndex = enc->transfer_family;
+
+	VkPhysicalDeviceVulkan13Features features_13 = {};
+	features_13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+	features_13.synchronization2 = VK_TRUE;
+
+	VkDeviceCreateInfo device_info = {};
+	device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	device_info.pNext = &features_13;
+	device_info.queueCreateInfoCount = enc->transfer_family == enc->encode_family ? 1 : 2;
+	device_info.pQueueCreateInfos = queue_infos;
+	device_info.enabledExtensionCount = ARRAY_SIZE(extensions);
+	device_info.ppEnabledExtensionNames = extensions;
+
+	PFN_vkCreateDevice create_device =
+	    (PFN_vkCreateDevice)vk->vkGetInstanceProcAddr(vk->instance, "vkCreateDevice");
+
+	VkResult ret = create_device(vk->physical_device, &device_info, NULL, &enc->device);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkCreateDevice: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	if (!load_device_functions(enc)) {
+		return VK_ERROR_INITIALIZATION_FAILED;
+	}
+
+	enc->fn.vkGetDeviceQueue(enc->device, enc->encode_family, 0, &enc->encode_queue);
+	enc->fn.vkGetDeviceQueue(enc->device, enc->transfer_family, 0, &enc->transfer_queue);
+
+	return VK_SUCCESS;
+}
+
+static VkResult
+create_command_buffer(struct ems_vk_video_encoder *enc,
+                      uint32_t family,
+                      VkCommandPool *out_pool,
+                      VkCommandBuffer *out_cmd)
+{
+	VkCommandPoolCreateInfo pool_info = {};
+	pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	pool_info.queueFamilyIndex = family;
+
+	VkResult ret = enc->fn.vkCreateCommandPool(enc->device, &pool_info, NULL, out_pool);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkCreateCommandPool: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkCommandBufferAllocateInfo cmd_info = {};
+	cmd_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	cmd_info.commandPool = *out_pool;
+	cmd_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	cmd_info.commandBufferCount = 1;
+
+	ret = enc->fn.vkAllocateCommandBuffers(enc->device, &cmd_info, out_cmd);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkAllocateCommandBuffers: %s", vk_result_string(ret));
+	}
+
+	return ret;
+}
+
+static bool
+get_memory_type(struct ems_vk_video_encoder *enc,
+                uint32_t type_bits,
+                VkMemoryPropertyFlags preferred,
+                VkMemoryPropertyFlags required,
+                uint32_t *out_index)
+{
+	// Same physical device, so the compositor's memory properties apply.
+	return vk_get_memory_type(enc->vk, type_bits, preferred, out_index) ||
+	       vk_get_memory_type(enc->vk, type_bits, required, out_index);
+}
+
+static VkResult
+setup_profile_and_caps(struct ems_vk_video_encoder *enc,
+                       VkVideoCapabilitiesKHR *caps,
+                       VkVideoEncodeCapabilitiesKHR *encode_caps,
+                       VkVideoEncodeH264CapabilitiesKHR *h264_caps)
+{
+	struct vk_bundle *vk = enc->vk;
+
+	enc->usage_info.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_USAGE_INFO_KHR;
+	enc->usage_info.videoUsageHints = VK_VIDEO_ENCODE_USAGE_STREAMING_BIT_KHR;
+	enc->usage_info.videoContentHints = VK_VIDEO_ENCODE_CONTENT_RENDERED_BIT_KHR;
+	enc->usage_info.tuningMode = VK_VIDEO_ENCODE_TUNING_MODE_ULTRA_LOW_LATENCY_KHR;
+
+	// Main profile, the pipeline and client caps ask for it.
+	enc->h264_profile.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_PROFILE_INFO_KHR;
+	enc->h264_profile.pNext = &enc->usage_info;
+	enc->h264_profile.stdProfileIdc = STD_VIDEO_H264_PROFILE_IDC_MAIN;
+
+	enc->profile.sType = VK_STRUCTURE_TYPE_VIDEO_PROFILE_INFO_KHR;
+	enc->profile.pNext = &enc->h264_profile;
+	enc->profile.videoCodecOperation = VK_VIDEO_CODEC_OPERATION_ENCODE_H264_BIT_KHR;
+	enc->profile.chromaSubsampling = VK_VIDEO_CHROMA_SUBSAMPLING_420_BIT_KHR;
+	enc->profile.lumaBitDepth = VK_VIDEO_COMPONENT_BIT_DEPTH_8_BIT_KHR;
+	enc->profile.chromaBitDepth = VK_VIDEO_COMPONENT_BIT_DEPTH_8_BIT_KHR;
+
+	enc->profile_list.sType = VK_STRUCTURE_TYPE_VIDEO_PROFILE_LIST_INFO_KHR;
+	enc->profile_list.profileCount = 1;
+	enc->profile_list.pProfiles = &enc->profile;
+
+	h264_caps->sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_CAPABILITIES_KHR;
+	encode_caps->sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_CAPABILITIES_KHR;
+	encode_caps->pNext = h264_caps;
+	caps->sType = VK_STRUCTURE_TYPE_VIDEO_CAPABILITIES_KHR;
+	caps->pNext = encode_caps;
+
+	PFN_vkGetPhysicalDeviceVideoCapabilitiesKHR get_caps = (PFN_vkGetPhysicalDeviceVideoCapabilitiesKHR)
+	    vk->vkGetInstanceProcAddr(vk->instance, "vkGetPhysicalDeviceVideoCapabilitiesKHR");
+	if (get_caps == NULL) {
+		U_LOG_E("vkGetPhysicalDeviceVideoCapabilitiesKHR not available");
+		return VK_ERROR_EXTENSION_NOT_PRESENT;
+	}
+
+	VkResult ret = get_caps(vk->physical_device, &enc->profile, caps);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkGetPhysicalDeviceVideoCapabilitiesKHR: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	uint32_t align_w = MAX(caps->pictureAccessGranularity.width, 16);
+	uint32_t align_h = MAX(caps->pictureAccessGranularity.height, 16);
+	enc->coded_extent.width = (enc->width + align_w - 1) / align_w * align_w;
+	enc->coded_extent.height = (enc->height + align_h - 1) / align_h * align_h;
+
+	if (enc->coded_extent.width > caps->maxCodedExtent.width ||
+	    enc->coded_extent.height > caps->maxCodedExtent.height ||
+	    enc->coded_extent.width < caps->minCodedExtent.width ||
+	    enc->coded_extent.height < caps->minCodedExtent.height) {
+		U_LOG_E("Coded extent %ux%u not supported, range is %ux%u to %ux%u", enc->coded_extent.width,
+		        enc->coded_extent.height, caps->minCodedExtent.width, caps->minCodedExtent.height,
+		        caps->maxCodedExtent.width, caps->maxCodedExtent.height);
+		return VK_ERROR_FORMAT_NOT_SUPPORTED;
+	}
+
+	if (caps->maxDpbSlots < EMS_VK_VIDEO_DPB_SLOTS || caps->maxActiveReferencePictures < 1 ||
+	    h264_caps->maxPPictureL0ReferenceCount < 1) {
+		U_LOG_E("Encoder can't do P frames with one reference");
+		return VK_ERROR_FEATURE_NOT_PRESENT;
+	}
+
+	// Without row unaligned slices every slice needs at least one macroblock row.
+	uint32_t max_slices = MIN(MAX(h264_caps->maxSliceCount, 1), EMS_VK_VIDEO_MAX_SLICES);
+	if ((h264_caps->flags & VK_VIDEO_ENCODE_H264_CAPABILITY_ROW_UNALIGNED_SLICE_BIT_KHR) == 0) {
+		max_slices = MIN(max_slices, enc->coded_extent.height / 16);
+	}
+	if (enc->slice_count > max_slices) {
+		U_LOG_W("Encoder can only make %u slices per frame, asked for %u", max_slices, enc->slice_count);
+		enc->slice_count = max_slices;
+	}
+
+	// CBR keeps the per-frame size flat, which is what a low latency stream wants.
+	if ((encode_caps->rateControlModes & VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR) != 0) {
+		enc->rate_control_mode = VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR;
+	} else if ((encode_caps->rateControlModes & VK_VIDEO_ENCODE_RATE_CONTROL_MODE_VBR_BIT_KHR) != 0) {
+		enc->rate_control_mode = VK_VIDEO_ENCODE_RATE_CONTROL_MODE_VBR_BIT_KHR;
+	} else {
+		enc->rate_control_mode = VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DEFAULT_KHR;
+	}
+
+	return VK_SUCCESS;
+}
+
+static VkResult
+create_session(struct ems_vk_video_encoder *enc, const VkVideoCapabilitiesKHR *caps)
+{
+	VkResult ret;
+
+	VkVideoSessionCreateInfoKHR session_info = {};
+	session_info.sType = VK_STRUCTURE_TYPE_VIDEO_SESSION_CREATE_INFO_KHR;
+	session_info.queueFamilyIndex = enc->encode_family;
+	session_info.pVideoProfile = &enc->profile;
+	session_info.pictureFormat = VK_FORMAT_G8_B8R8_2PLANE_420_UNORM;
+	session_info.maxCodedExtent = enc->coded_extent;
+	session_info.referencePictureFormat = VK_FORMAT_G8_B8R8_2PLANE_420_UNORM;
+	session_info.maxDpbSlots = EMS_VK_VIDEO_DPB_SLOTS;
+	session_info.maxActiveReferencePictures = 1;
+	session_info.pStdHeaderVersion = &caps->stdHeaderVersion;
+
+	ret = enc->fn.vkCreateVideoSessionKHR(enc->device, &session_info, NULL, &enc->session);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkCreateVideoSessionKHR: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	uint32_t count = 0;
+	enc->fn.vkGetVideoSessionMemoryRequirementsKHR(enc->device, enc->session, &count, NULL);
+	if (count > ARRAY_SIZE(enc->session_memory)) {
+		U_LOG_E("Too many video session memory bindings: %u", count);
+		return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+
+	VkVideoSessionMemoryRequirementsKHR requirements[ARRAY_SIZE(enc->session_memory)] = {};
+	for (uint32_t i = 0; i < count; i++) {
+		requirements[i].sType = VK_STRUCTURE_TYPE_VIDEO_SESSION_MEMORY_REQUIREMENTS_KHR;
+	}
+	enc->fn.vkGetVideoSessionMemoryRequirementsKHR(enc->device, enc->session, &count, requirements);
+
+	VkBindVideoSessionMemoryInfoKHR binds[ARRAY_SIZE(enc->session_memory)] = {};
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t memory_type_index = 0;
+		if (!get_memory_type(enc, requirements[i].memoryRequirements.memoryTypeBits,
+		                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &memory_type_index)) {
+			U_LOG_E("No memory type for video session binding %u", i);
+			return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+		}
+
+		VkMemoryAllocateInfo alloc_info = {};
+		alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		alloc_info.allocationSize = requirements[i].memoryRequirements.size;
+		alloc_info.memoryTypeIndex = memory_type_index;
+
+		ret = enc->fn.vkAllocateMemory(enc->device, &alloc_info, NULL, &enc->session_memory[i]);
+		if (ret != VK_SUCCESS) {
+			U_LOG_E("vkAllocateMemory: %s", vk_result_string(ret));
+			return ret;
+		}
+		enc->session_memory_count++;
+
+		binds[i].sType = VK_STRUCTURE_TYPE_BIND_VIDEO_SESSION_MEMORY_INFO_KHR;
+		binds[i].memoryBindIndex = requirements[i].memoryBindIndex;
+		binds[i].memory = enc->session_memory[i];
+		binds[i].memoryOffset = 0;
+		binds[i].memorySize = requirements[i].memoryRequirements.size;
+	}
+
+	ret = enc->fn.vkBindVideoSessionMemoryKHR(enc->device, enc->session, count, binds);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkBindVideoSessionMemoryKHR: %s", vk_result_string(ret));
+	}
+
+	return ret;
+}
+
+/*!
+ * Fetches one encoded parameter set and appends it to the headers, adding a
+ * start code if the implementation did not write one.
+ */
+static VkResult
+append_parameter_set(struct ems_vk_video_encoder *enc, bool sps)
+{
+	VkVideoEncodeH264SessionParametersGetInfoKHR h264_get_info = {};
+	h264_get_info.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_GET_INFO_KHR;
+	h264_get_info.writeStdSPS = sps ? VK_TRUE : VK_FALSE;
+	h264_get_info.writeStdPPS = sps ? VK_FALSE : VK_TRUE;
+	h264_get_info.stdSPSId = 0;
+	h264_get_info.stdPPSId = 0;
+
+	VkVideoEncodeSessionParametersGetInfoKHR get_info = {};
+	get_info.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_SESSION_PARAMETERS_GET_INFO_KHR;
+	get_info.pNext = &h264_get_info;
+	get_info.videoSessionParameters = enc->params;
+
+	size_t size = 0;
+	VkResult ret = enc->fn.vkGetEncodedVideoSessionParametersKHR(enc->device, &get_info, NULL, &size, NULL);
+	if (ret != VK_SUCCESS || size == 0) {
+		U_LOG_E("vkGetEncodedVideoSessionParametersKHR: %s", vk_result_string(ret));
+		return ret != VK_SUCCESS ? ret : VK_ERROR_UNKNOWN;
+	}
+
+	static const uint8_t start_code[4] = {0, 0, 0, 1};
+
+	uint8_t *data = U_TYPED_ARRAY_CALLOC(uint8_t, size);
+	ret = enc->fn.vkGetEncodedVideoSessionParametersKHR(enc->device, &get_info, NULL, &size, data);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkGetEncodedVideoSessionParametersKHR: %s", vk_result_string(ret));
+		free(data);
+		return ret;
+	}
+
+	bool has_start_code = (size >= 3 && data[0] == 0 && data[1] == 0 && data[2] == 1) ||
+	                      (size >= 4 && memcmp(data, start_code, 4) == 0);
+
+	size_t new_size = enc->headers_size + (has_start_code ? 0 : sizeof(start_code)) + size;
+	enc->headers = (uint8_t *)realloc(enc->headers, new_size);
+	if (!has_start_code) {
+		memcpy(enc->headers + enc->headers_size, start_code, sizeof(start_code));
+		enc->headers_size += sizeof(start_code);
+	}
+	memcpy(enc->headers + enc->headers_size, data, size);
+	enc->headers_size += size;
+
+	free(data);
+
+	return VK_SUCCESS;
+}
+
+static VkResult
+create_session_parameters(struct ems_vk_video_encoder *enc, const VkVideoEncodeH264CapabilitiesKHR *h264_caps)
+{
+	StdVideoH264SequenceParameterSet sps = {};
+	sps.flags.direct_8x8_inference_flag = 1;
+	sps.flags.frame_mbs_only_flag = 1;
+	sps.profile_idc = STD_VIDEO_H264_PROFILE_IDC_MAIN;
+	sps.level_idc = MIN(STD_VIDEO_H264_LEVEL_IDC_5_1, h264_caps->maxLevelIdc);
+	sps.chroma_format_idc = STD_VIDEO_H264_CHROMA_FORMAT_IDC_420;
+	sps.seq_parameter_set_id = 0;
+	sps.bit_depth_luma_minus8 = 0;
+	sps.bit_depth_chroma_minus8 = 0;
+	sps.log2_max_frame_num_minus4 = 0;
+	// No B frames, so the picture order follows frame_num.
+	sps.pic_order_cnt_type = STD_VIDEO_H264_POC_TYPE_2;
+	sps.max_num_ref_frames = 1;
+	sps.pic_width_in_mbs_minus1 = enc->coded_extent.width / 16 - 1;
+	sps.pic_height_in_map_units_minus1 = enc->coded_extent.height / 16 - 1;
+
+	// Crop units are two pixels for 4:2:0.
+	if (enc->coded_extent.width != enc->width || enc->coded_extent.height != enc->height) {
+		sps.flags.frame_cropping_flag = 1;
+		sps.frame_crop_right_offset = (enc->coded_extent.width - enc->width) / 2;
+		sps.frame_crop_bottom_offset = (enc->coded_extent.height - enc->height) / 2;
+	}
+
+	StdVideoH264PictureParameterSet pps = {};
+	pps.flags.deblocking_filter_control_present_flag = 1;
+	pps.flags.entropy_coding_mode_flag =
+	    (h264_caps->stdSyntaxFlags & VK_VIDEO_ENCODE_H264_STD_ENTROPY_CODING_MODE_FLAG_SET_BIT_KHR) != 0;
+	pps.seq_parameter_set_id = 0;
+	pps.pic_parameter_set_id = 0;
+	pps.num_ref_idx_l0_default_active_minus1 = 0;
+	pps.weighted_bipred_idc = STD_VIDEO_H264_WEIGHTED_BIPRED_IDC_DEFAULT;
+
+	VkVideoEncodeH264SessionParametersAddInfoKHR add_info = {};
+	add_info.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_ADD_INFO_KHR;
+	add_info.stdSPSCount = 1;
+	add_info.pStdSPSs = &sps;
+	add_info.stdPPSCount = 1;
+	add_info.pStdPPSs = &pps;
+
+	VkVideoEncodeH264SessionParametersCreateInfoKHR h264_info = {};
+	h264_info.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_CREATE_INFO_KHR;
+	h264_info.maxStdSPSCount = 1;
+	h264_info.maxStdPPSCount = 1;
+	h264_info.pParametersAddInfo = &add_info;
+
+	VkVideoSessionParametersCreateInfoKHR params_info = {};
+	params_info.sType = VK_STRUCTURE_TYPE_VIDEO_SESSION_PARAMETERS_CREATE_INFO_KHR;
+	params_info.pNext = &h264_info;
+	params_info.videoSession = enc->session;
+
+	VkResult ret = enc->fn.vkCreateVideoSessionParametersKHR(enc->device, &params_info, NULL, &enc->params);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkCreateVideoSessionParametersKHR: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	ret = append_parameter_set(enc, true);
+	if (ret != VK_SUCCESS) {
+		return ret;
+	}
+
+	return append_parameter_set(enc, false);
+}
+
+static VkResult
+create_image(struct ems_vk_video_encoder *enc,
+             VkImageUsageFlags usage,
+             uint32_t layers,
+             VkImage *out_image,
+             VkDeviceMemory *out_memory)
+{
+	uint32_t families[2] = {enc->encode_family, enc->transfer_family};
+	bool concurrent = (usage & VK_IMAGE_USAGE_TRANSFER_DST_BIT) != 0 && enc->encode_family != enc->transfer_family;
+
+	VkImageCreateInfo image_info = {};
+	image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	image_info.pNext = &enc->profile_list;
+	image_info.imageType = VK_IMAGE_TYPE_2D;
+	image_info.format = VK_FORMAT_G8_B8R8_2PLANE_420_UNORM;
+	image_info.extent = {enc->coded_extent.width, enc->coded_extent.height, 1};
+	image_info.mipLevels = 1;
+	image_info.arrayLayers = layers;
+	image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+	image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+	image_info.usage = usage;
+	// Copied on one queue and encoded on another, skip the ownership transfers.
+	image_info.sharingMode = concurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE;
+	image_info.queueFamilyIndexCount = concurrent ? 2 : 0;
+	image_info.pQueueFamilyIndices = concurrent ? families : NULL;
+	image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	VkResult ret = enc->fn.vkCreateImage(enc->device, &image_info, NULL, out_image);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkCreateImage: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkMemoryRequirements requirements;
+	enc->fn.vkGetImageMemoryRequirements(enc->device, *out_image, &requirements);
+
+	uint32_t memory_type_index = 0;
+	if (!get_memory_type(enc, requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+	                     &memory_type_index)) {
+		U_LOG_E("No memory type for video image");
+		return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+
+	VkMemoryAllocateInfo alloc_info = {};
+	alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	alloc_info.allocationSize = requirements.size;
+	alloc_info.memoryTypeIndex = memory_type_index;
+
+	ret = enc->fn.vkAllocateMemory(enc->device, &alloc_info, NULL, out_memory);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkAllocateMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	ret = enc->fn.vkBindImageMemory(enc->device, *out_image, *out_memory, 0);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkBindImageMemory: %s", vk_result_string(ret));
+	}
+
+	return ret;
+}
+
+static VkResult
+create_image_view(struct ems_vk_video_encoder *enc, VkImage image, uint32_t layer, VkImageView *out_view)
+{
+	VkImageViewCreateInfo view_info = {};
+	view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	view_info.image = image;
+	view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	view_info.format = VK_FORMAT_G8_B8R8_2PLANE_420_UNORM;
+	view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	view_info.subresourceRange.baseMipLevel = 0;
+	view_info.subresourceRange.levelCount = 1;
+	view_info.subresourceRange.baseArrayLayer = layer;
+	view_info.subresourceRange.layerCount = 1;
+
+	VkResult ret = enc->fn.vkCreateImageView(enc->device, &view_info, NULL, out_view);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkCreateImageView: %s", vk_result_string(ret));
+	}
+
+	return ret;
+}
+
+static VkResult
+create_resources(struct ems_vk_video_encoder *enc, const VkVideoCapabilitiesKHR *caps)
+{
+	VkResult ret;
+
+	ret = create_image(enc, VK_IMAGE_USAGE_VIDEO_ENCODE_SRC_BIT_KHR | VK_IMAGE_USAGE_TRANSFER_DST_BIT, 1,
+	                   &enc->src_image, &enc->src_memory);
+	if (ret != VK_SUCCESS) {
+		return ret;
+	}
+
+	ret = create_image_view(enc, enc->src_image, 0, &enc->src_view);
+	if (ret != VK_SUCCESS) {
+		return ret;
+	}
+
+	ret = create_image(enc, VK_IMAGE_USAGE_VIDEO_ENCODE_DPB_BIT_KHR, EMS_VK_VIDEO_DPB_SLOTS, &enc->dpb_image,
+	                   &enc->dpb_memory);
+	if (ret != VK_SUCCESS) {
+		return ret;
+	}
+
+	for (uint32_t i = 0; i < EMS_VK_VIDEO_DPB_SLOTS; i++) {
+		ret = create_image_view(enc, enc->dpb_image, i, &enc->dpb_views[i]);
+		if (ret != VK_SUCCESS) {
+			return ret;
+		}
+	}
+
+	// Bitstream buffer, read back on the CPU.
+	VkDeviceSize alignment = MAX(caps->minBitstreamBufferSizeAlignment, 1);
+	enc->bitstream_size = (EMS_VK_VIDEO_BITSTREAM_SIZE + alignment - 1) / alignment * alignment;
+
+	VkBufferCreateInfo buffer_info = {};
+	buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	buffer_info.pNext = &enc->profile_list;
+	buffer_info.size = enc->bitstream_size;
+	buffer_info.usage = VK_BUFFER_USAGE_VIDEO_ENCODE_DST_BIT_KHR;
+	buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	ret = enc->fn.vkCreateBuffer(enc->device, &buffer_info, NULL, &enc->bitstream);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkCreateBuffer: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkMemoryRequirements requirements;
+	enc->fn.vkGetBufferMemoryRequirements(enc->device, enc->bitstream, &requirements);
+
+	uint32_t memory_type_index = 0;
+	if (!get_memory_type(enc, requirements.memoryTypeBits,
+	                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+	                         VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+	                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	                     &memory_type_index)) {
+		U_LOG_E("No host visible memory type for bitstream buffer");
+		return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+
+	VkMemoryAllocateInfo alloc_info = {};
+	alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	alloc_info.allocationSize = requirements.size;
+	alloc_info.memoryTypeIndex = memory_type_index;
+
+	ret = enc->fn.vkAllocateMemory(enc->device, &alloc_info, NULL, &enc->bitstream_memory);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkAllocateMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	ret = enc->fn.vkBindBufferMemory(enc->device, enc->bitstream, enc->bitstream_memory, 0);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkBindBufferMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	void *mapped = NULL;
+	ret = enc->fn.vkMapMemory(enc->device, enc->bitstream_memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkMapMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+	enc->bitstream_mapped = (const uint8_t *)mapped;
+
+	// Where and how much the encoder wrote.
+	VkQueryPoolVideoEncodeFeedbackCreateInfoKHR feedback_info = {};
+	feedback_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_VIDEO_ENCODE_FEEDBACK_CREATE_INFO_KHR;
+	feedback_info.pNext = &enc->profile;
+	feedback_info.encodeFeedbackFlags = VK_VIDEO_ENCODE_FEEDBACK_BITSTREAM_BUFFER_OFFSET_BIT_KHR |
+	                                    VK_VIDEO_ENCODE_FEEDBACK_BITSTREAM_BYTES_WRITTEN_BIT_KHR;
+
+	VkQueryPoolCreateInfo query_info = {};
+	query_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	query_info.pNext = &feedback_info;
+	query_info.queryType = VK_QUERY_TYPE_VIDEO_ENCODE_FEEDBACK_KHR;
+	query_info.queryCount = 1;
+
+	ret = enc->fn.vkCreateQueryPool(enc->device, &query_info, NULL, &enc->query_pool);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkCreateQueryPool: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkFenceCreateInfo fence_info = {};
+	fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+	ret = enc->fn.vkCreateFence(enc->device, &fence_info, NULL, &enc->fence);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkCreateFence: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	if (enc->transfer_family != enc->encode_family) {
+		VkSemaphoreCreateInfo semaphore_info = {};
+		semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+		ret = enc->fn.vkCreateSemaphore(enc->device, &semaphore_info, NULL, &enc->copy_done);
+		if (ret != VK_SUCCESS) {
+			U_LOG_E("vkCreateSemaphore: %s", vk_result_string(ret));
+			return ret;
+		}
+
+		ret = create_command_buffer(enc, enc->transfer_family, &enc->transfer_pool, &enc->transfer_cmd);
+		if (ret != VK_SUCCESS) {
+			return ret;
+		}
+	}
+
+	return create_command_buffer(enc, enc->encode_family, &enc->encode_pool, &enc->encode_cmd);
+}
+
+static void
+setup_rate_control(struct ems_vk_video_encoder *enc, uint32_t bitrate_kbps, uint32_t framerate)
+{
+	enc->h264_rate_control.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_RATE_CONTROL_INFO_KHR;
+	// UINT32_MAX tells the rate control the GOP never ends.
+	enc->h264_rate_control.gopFrameCount = enc->idr_period > 0 ? enc->idr_period : UINT32_MAX;
+	enc->h264_rate_control.idrPeriod = enc->idr_period > 0 ? enc->idr_period : UINT32_MAX;
+	enc->h264_rate_control.consecutiveBFrameCount = 0;
+	enc->h264_rate_control.temporalLayerCount = 1;
+
+	enc->rate_control_layer.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_RATE_CONTROL_LAYER_INFO_KHR;
+	enc->rate_control_layer.averageBitrate = (uint64_t)bitrate_kbps * 1000;
+	enc->rate_control_layer.maxBitrate = (uint64_t)bitrate_kbps * 1000;
+	enc->rate_control_layer.frameRateNumerator = framerate;
+	enc->rate_control_layer.frameRateDenominator = 1;
+
+	bool has_layers = enc->rate_control_mode != VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DEFAULT_KHR;
+
+	enc->rate_control.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_RATE_CONTROL_INFO_KHR;
+	enc->rate_control.pNext = &enc->h264_rate_control;
+	enc->rate_control.rateControlMode = enc->rate_control_mode;
+	enc->rate_control.layerCount = has_layers ? 1 : 0;
+	enc->rate_control.pLayers = has_layers ? &enc->rate_control_layer : NULL;
+	// A small virtual buffer keeps every frame close to the average size.
+	enc->rate_control.virtualBufferSizeInMs = has_layers ? 100 : 0;
+	enc->rate_control.initialVirtualBufferSizeInMs = has_layers ? 50 : 0;
+}
+
+static struct ems_vk_video_import *
+get_import(struct ems_vk_video_encoder *enc, struct xrt_frame *frame, int dmabuf_fd)
+{
+	for (uint32_t i = 0; i < enc->import_count; i++) {
+		if (enc->imports[i].frame == frame) {
+			return &enc->imports[i];
+		}
+	}
+
+	if (enc->import_count >= ARRAY_SIZE(enc->imports)) {
+		U_LOG_E("Too many imported frames");
+		return NULL;
+	}
+
+	struct ems_vk_video_import *import = &enc->imports[enc->import_count];
+	VkResult ret;
+
+	VkExternalMemoryBufferCreateInfo external_buffer_info = {};
+	external_buffer_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+	external_buffer_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+	VkBufferCreateInfo buffer_info = {};
+	buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	buffer_info.pNext = &external_buffer_info;
+	buffer_info.size = frame->size;
+	buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	ret = enc->fn.vkCreateBuffer(enc->device, &buffer_info, NULL, &import->buffer);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkCreateBuffer: %s", vk_result_string(ret));
+		return NULL;
+	}
+
+	VkMemoryRequirements requirements;
+	enc->fn.vkGetBufferMemoryRequirements(enc->device, import->buffer, &requirements);
+
+	VkMemoryFdPropertiesKHR fd_props = {};
+	fd_props.sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR;
+	ret = enc->fn.vkGetMemoryFdPropertiesKHR(enc->device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT, dmabuf_fd,
+	                                         &fd_props);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkGetMemoryFdPropertiesKHR: %s", vk_result_string(ret));
+		enc->fn.vkDestroyBuffer(enc->device, import->buffer, NULL);
+		return NULL;
+	}
+
+	uint32_t memory_type_index = 0;
+	if (!get_memory_type(enc, requirements.memoryTypeBits & fd_props.memoryTypeBits, 0, 0, &memory_type_index)) {
+		U_LOG_E("No memory type to import dmabuf into");
+		enc->fn.vkDestroyBuffer(enc->device, import->buffer, NULL);
+		return NULL;
+	}
+
+	// The import consumes the fd on success, the pool keeps its own.
+	int fd = dup(dmabuf_fd);
+	if (fd < 0) {
+		U_LOG_E("Failed to dup dmabuf fd");
+		enc->fn.vkDestroyBuffer(enc->device, import->buffer, NULL);
+		return NULL;
+	}
+
+	// Exported as a dedicated allocation, so imported as one too.
+	VkMemoryDedicatedAllocateInfo dedicated_info = {};
+	dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+	dedicated_info.buffer = import->buffer;
+
+	VkImportMemoryFdInfoKHR import_info = {};
+	import_info.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR;
+	import_info.pNext = &dedicated_info;
+	import_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+	import_info.fd = fd;
+
+	VkMemoryAllocateInfo alloc_info = {};
+	alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	alloc_info.pNext = &import_info;
+	alloc_info.allocationSize = requirements.size;
+	alloc_info.memoryTypeIndex = memory_type_index;
+
+	ret = enc->fn.vkAllocateMemory(enc->device, &alloc_info, NULL, &import->memory);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkAllocateMemory: %s", vk_result_string(ret));
+		close(fd);
+		enc->fn.vkDestroyBuffer(enc->device, import->buffer, NULL);
+		return NULL;
+	}
+
+	ret = enc->fn.vkBindBufferMemory(enc->device, import->buffer, import->memory, 0);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkBindBufferMemory: %s", vk_result_string(ret));
+		enc->fn.vkFreeMemory(enc->device, import->memory, NULL);
+		enc->fn.vkDestroyBuffer(enc->device, import->buffer, NULL);
+		return NULL;
+	}
+
+	import->frame = frame;
+	enc->import_count++;
+
+	return import;
+}
+
+static void
+record_copy(struct ems_vk_video_encoder *enc, VkCommandBuffer cmd, VkBuffer buffer)
+{
+	VkImageMemoryBarrier2 to_transfer = {};
+	to_transfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+	to_transfer.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+	to_transfer.srcAccessMask = VK_ACCESS_2_NONE;
+	to_transfer.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+	to_transfer.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+	to_transfer.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	to_transfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	to_transfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	to_transfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	to_transfer.image = enc->src_image;
+	to_transfer.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+
+	VkDependencyInfo dependency_info = {};
+	dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+	dependency_info.imageMemoryBarrierCount = 1;
+	dependency_info.pImageMemoryBarriers = &to_transfer;
+
+	enc->fn.vkCmdPipelineBarrier2(cmd, &dependency_info);
+
+	// Y plane then the interleaved UV plane, laid out like the GStreamer NV12 meta.
+	VkBufferImageCopy regions[2] = {};
+	regions[0].bufferOffset = 0;
+	regions[0].bufferRowLength = enc->width;
+	regions[0].bufferImageHeight = enc->height;
+	regions[0].imageSubresource = {VK_IMAGE_ASPECT_PLANE_0_BIT, 0, 0, 1};
+	regions[0].imageExtent = {enc->width, enc->height, 1};
+
+	regions[1].bufferOffset = (VkDeviceSize)enc->width * enc->height;
+	regions[1].bufferRowLength = enc->width / 2;
+	regions[1].bufferImageHeight = enc->height / 2;
+	regions[1].imageSubresource = {VK_IMAGE_ASPECT_PLANE_1_BIT, 0, 0, 1};
+	regions[1].imageExtent = {enc->width / 2, enc->height / 2, 1};
+
+	enc->fn.vkCmdCopyBufferToImage(cmd, buffer, enc->src_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+	                               ARRAY_SIZE(regions), regions);
+}
+
+static void
+record_encode(struct ems_vk_video_encoder *enc, VkCommandBuffer cmd, bool idr)
+{
+	uint32_t poc = enc->frames_since_idr * 2;
+	StdVideoH264PictureType picture_type = idr ? STD_VIDEO_H264_PICTURE_TYPE_IDR : STD_VIDEO_H264_PICTURE_TYPE_P;
+
+	// Source to encode layout, and the DPB out of undefined the first time around.
+	VkImageMemoryBarrier2 barriers[2] = {};
+	barriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+	barriers[0].srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+	barriers[0].srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+	barriers[0].dstStageMask = VK_PIPELINE_STAGE_2_VIDEO_ENCODE_BIT_KHR;
+	barriers[0].dstAccessMask = VK_ACCESS_2_VIDEO_ENCODE_READ_BIT_KHR;
+	barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barriers[0].newLayout = VK_IMAGE_LAYOUT_VIDEO_ENCODE_SRC_KHR;
+	barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[0].image = enc->src_image;
+	barriers[0].subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+
+	barriers[1] = barriers[0];
+	barriers[1].srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+	barriers[1].srcAccessMask = VK_ACCESS_2_NONE;
+	barriers[1].dstAccessMask = VK_ACCESS_2_VIDEO_ENCODE_READ_BIT_KHR | VK_ACCESS_2_VIDEO_ENCODE_WRITE_BIT_KHR;
+	barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barriers[1].newLayout = VK_IMAGE_LAYOUT_VIDEO_ENCODE_DPB_KHR;
+	barriers[1].image = enc->dpb_image;
+	barriers[1].subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, EMS_VK_VIDEO_DPB_SLOTS};
+
+	VkDependencyInfo dependency_info = {};
+	dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+	dependency_info.imageMemoryBarrierCount = enc->session_initialized ? 1 : 2;
+	dependency_info.pImageMemoryBarriers = barriers;
+
+	enc->fn.vkCmdPipelineBarrier2(cmd, &dependency_info);
+
+	enc->fn.vkCmdResetQueryPool(cmd, enc->query_pool, 0, 1);
+
+	/*
+	 * Reconstructed picture of this frame and the reference picture.
+	 */
+
+	VkVideoPictureResourceInfoKHR setup_resource = {};
+	setup_resource.sType = VK_STRUCTURE_TYPE_VIDEO_PICTURE_RESOURCE_INFO_KHR;
+	setup_resource.codedExtent = enc->coded_extent;
+	setup_resource.baseArrayLayer = 0;
+	setup_resource.imageViewBinding = enc->dpb_views[enc->setup_slot];
+
+	VkVideoPictureResourceInfoKHR ref_resource = setup_resource;
+	bool has_ref = !idr && enc->ref_slot >= 0;
+	if (has_ref) {
+		ref_resource.imageViewBinding = enc->dpb_views[enc->ref_slot];
+	}
+
+	StdVideoEncodeH264ReferenceInfo setup_info = {};
+	setup_info.primary_pic_type = picture_type;
+	setup_info.FrameNum = enc->frame_num;
+	setup_info.PicOrderCnt = (int32_t)poc;
+
+	VkVideoEncodeH264DpbSlotInfoKHR setup_dpb_info = {};
+	setup_dpb_info.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_DPB_SLOT_INFO_KHR;
+	setup_dpb_info.pStdReferenceInfo = &setup_info;
+
+	VkVideoEncodeH264DpbSlotInfoKHR ref_dpb_info = {};
+	ref_dpb_info.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_DPB_SLOT_INFO_KHR;
+	ref_dpb_info.pStdReferenceInfo = &enc->ref_info;
+
+	VkVideoReferenceSlotInfoKHR setup_slot = {};
+	setup_slot.sType = VK_STRUCTURE_TYPE_VIDEO_REFERENCE_SLOT_INFO_KHR;
+	setup_slot.pNext = &setup_dpb_info;
+	setup_slot.slotIndex = (int32_t)enc->setup_slot;
+	setup_slot.pPictureResource = &setup_resource;
+
+	VkVideoReferenceSlotInfoKHR ref_slot = {};
+	ref_slot.sType = VK_STRUCTURE_TYPE_VIDEO_REFERENCE_SLOT_INFO_KHR;
+	ref_slot.pNext = &ref_dpb_info;
+	ref_slot.slotIndex = enc->ref_slot;
+	ref_slot.pPictureResource = &ref_resource;
+
+	// The setup slot gets (re)activated by this encode, so it is bound without an index.
+	VkVideoReferenceSlotInfoKHR begin_slots[2] = {setup_slot, ref_slot};
+	begin_slots[0].pNext = NULL;
+	begin_slots[0].slotIndex = -1;
+	begin_slots[1].pNext = NULL;
+
+	VkVideoBeginCodingInfoKHR begin_info = {};
+	begin_info.sType = VK_STRUCTURE_TYPE_VIDEO_BEGIN_CODING_INFO_KHR;
+	// Must match the rate control state of the session once it has been set.
+	begin_info.pNext = enc->session_initialized ? &enc->rate_control : NULL;
+	begin_info.videoSession = enc->session;
+	begin_info.videoSessionParameters = enc->params;
+	begin_info.referenceSlotCount = has_ref ? 2 : 1;
+	begin_info.pReferenceSlots = begin_slots;
+
+	enc->fn.vkCmdBeginVideoCodingKHR(cmd, &begin_info);
+
+	if (!enc->session_initialized) {
+		VkVideoCodingControlInfoKHR control_info = {};
+		control_info.sType = VK_STRUCTURE_TYPE_VIDEO_CODING_CONTROL_INFO_KHR;
+		control_info.pNext = &enc->rate_control;
+		control_info.flags =
+		    VK_VIDEO_CODING_CONTROL_RESET_BIT_KHR | VK_VIDEO_CODING_CONTROL_ENCODE_RATE_CONTROL_BIT_KHR;
+
+		enc->fn.vkCmdControlVideoCodingKHR(cmd, &control_info);
+	} else if (enc->rate_control.layerCount > 0 &&
+	           (enc->rate_control_layer.averageBitrate != (uint64_t)enc->target_bitrate_kbps * 1000 ||
+	            enc->rate_control_layer.frameRateNumerator != enc->target_framerate)) {
+		// Begin took the old state, the new one is set by the control command.
+		enc->rate_control_layer.averageBitrate = (uint64_t)enc->target_bitrate_kbps * 1000;
+		enc->rate_control_layer.maxBitrate = enc->rate_control_layer.averageBitrate;
+		enc->rate_control_layer.frameRateNumerator = enc->target_framerate;
+		enc->h264_rate_control.gopFrameCount = enc->idr_period > 0 ? enc->idr_period : UINT32_MAX;
+		enc->h264_rate_control.idrPeriod = enc->idr_period > 0 ? enc->idr_period : UINT32_MAX;
+
+		VkVideoCodingControlInfoKHR control_info = {};
+		control_info.sType = VK_STRUCTURE_TYPE_VIDEO_CODING_CONTROL_INFO_KHR;
+		control_info.pNext = &enc->rate_control;
+		control_info.flags = VK_VIDEO_CODING_CONTROL_ENCODE_RATE_CONTROL_BIT_KHR;
+
+		enc->fn.vkCmdControlVideoCodingKHR(cmd, &control_info);
+	}
+
+	/*
+	 * H.264 picture and slice.
+	 */
+
+	StdVideoEncodeH264SliceHeader slice_header = {};
+	slice_header.slice_type = idr ? STD_VIDEO_H264_SLICE_TYPE_I : STD_VIDEO_H264_SLICE_TYPE_P;
+	slice_header.cabac_init_idc = STD_VIDEO_H264_CABAC_INIT_IDC_0;
+	// The enum is named after the syntax element, "disabled" means deblocking is on.
+	slice_header.disable_deblocking_filter_idc = STD_VIDEO_H264_DISABLE_DEBLOCKING_FILTER_IDC_DISABLED;
+
+	// All slices are alike, where one ends and the next begins is up to the implementation.
+	VkVideoEncodeH264NaluSliceInfoKHR slice_infos[EMS_VK_VIDEO_MAX_SLICES] = {};
+	for (uint32_t i = 0; i < enc->slice_count; i++) {
+		slice_infos[i].sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_NALU_SLICE_INFO_KHR;
+		slice_infos[i].constantQp = 0;
+		slice_infos[i].pStdSliceHeader = &slice_header;
+	}
+
+	StdVideoEncodeH264ReferenceListsInfo ref_lists = {};
+	ref_lists.num_ref_idx_l0_active_minus1 = 0;
+	ref_lists.num_ref_idx_l1_active_minus1 = 0;
+	memset(ref_lists.RefPicList0, STD_VIDEO_H264_NO_REFERENCE_PICTURE, sizeof(ref_lists.RefPicList0));
+	memset(ref_lists.RefPicList1, STD_VIDEO_H264_NO_REFERENCE_PICTURE, sizeof(ref_lists.RefPicList1));
+	if (has_ref) {
+		ref_lists.RefPicList0[0] = (uint8_t)enc->ref_slot;
+	}
+
+	StdVideoEncodeH264PictureInfo picture_info = {};
+	picture_info.flags.IdrPicFlag = idr ? 1 : 0;
+	picture_info.flags.is_reference = 1;
+	picture_info.seq_parameter_set_id = 0;
+	picture_info.pic_parameter_set_id = 0;
+	picture_info.idr_pic_id = enc->idr_pic_id;
+	picture_info.primary_pic_type = picture_type;
+	picture_info.frame_num = enc->frame_num;
+	picture_info.PicOrderCnt = (int32_t)poc;
+	picture_info.pRefLists = &ref_lists;
+
+	VkVideoEncodeH264PictureInfoKHR h264_picture_info = {};
+	h264_picture_info.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_PICTURE_INFO_KHR;
+	h264_picture_info.naluSliceEntryCount = enc->slice_count;
+	h264_picture_info.pNaluSliceEntries = slice_infos;
+	h264_picture_info.pStdPictureInfo = &picture_info;
+	h264_picture_info.generatePrefixNalu = VK_FALSE;
+
+	VkVideoEncodeInfoKHR encode_info = {};
+	encode_info.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_INFO_KHR;
+	encode_info.pNext = &h264_picture_info;
+	encode_info.dstBuffer = enc->bitstream;
+	encode_info.dstBufferOffset = 0;
+	encode_info.dstBufferRange = enc->bitstream_size;
+	encode_info.srcPictureResource.sType = VK_STRUCTURE_TYPE_VIDEO_PICTURE_RESOURCE_INFO_KHR;
+	encode_info.srcPictureResource.codedExtent = enc->coded_extent;
+	encode_info.srcPictureResource.baseArrayLayer = 0;
+	encode_info.srcPictureResource.imageViewBinding = enc->src_view;
+	encode_info.pSetupReferenceSlot = &setup_slot;
+	encode_info.referenceSlotCount = has_ref ? 1 : 0;
+	encode_info.pReferenceSlots = has_ref ? &ref_slot : NULL;
+
+	enc->fn.vkCmdBeginQuery(cmd, enc->query_pool, 0, 0);
+	enc->fn.vkCmdEncodeVideoKHR(cmd, &encode_info);
+	enc->fn.vkCmdEndQuery(cmd, enc->query_pool, 0);
+
+	VkVideoEndCodingInfoKHR end_info = {};
+	end_info.sType = VK_STRUCTURE_TYPE_VIDEO_END_CODING_INFO_KHR;
+
+	enc->fn.vkCmdEndVideoCodingKHR(cmd, &end_info);
+
+	// Make the bitstream visible to the host.
+	VkBufferMemoryBarrier2 bitstream_barrier = {};
+	bitstream_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+	bitstream_barrier.srcStageMask = VK_PIPELINE_STAGE_2_VIDEO_ENCODE_BIT_KHR;
+	bitstream_barrier.srcAccessMask = VK_ACCESS_2_VIDEO_ENCODE_WRITE_BIT_KHR;
+	bitstream_barrier.dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT;
+	bitstream_barrier.dstAccessMask = VK_ACCESS_2_HOST_READ_BIT;
+	bitstream_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	bitstream_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	bitstream_barrier.buffer = enc->bitstream;
+	bitstream_barrier.offset = 0;
+	bitstream_barrier.size = VK_WHOLE_SIZE;
+
+	VkDependencyInfo host_dependency_info = {};
+	host_dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+	host_dependency_info.bufferMemoryBarrierCount = 1;
+	host_dependency_info.pBufferMemoryBarriers = &bitstream_barrier;
+
+	enc->fn.vkCmdPipelineBarrier2(cmd, &host_dependency_info);
+
+	// This picture is the reference for the next one.
+	enc->ref_info = setup_info;
+}
+
+static VkResult
+begin_cmd(struct ems_vk_video_encoder *enc, VkCommandBuffer cmd)
+{
+	VkResult ret = enc->fn.vkResetCommandBuffer(cmd, 0);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkResetCommandBuffer: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkCommandBufferBeginInfo begin_info = {};
+	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+	ret = enc->fn.vkBeginCommandBuffer(cmd, &begin_info);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkBeginCommandBuffer: %s", vk_result_string(ret));
+	}
+
+	return ret;
+}
+
+static VkResult
+submit_and_wait(struct ems_vk_video_encoder *enc, struct ems_vk_video_import *import, bool idr)
+{
+	VkResult ret;
+	bool separate_copy = enc->transfer_family != enc->encode_family;
+
+	if (separate_copy) {
+		ret = begin_cmd(enc, enc->transfer_cmd);
+		if (ret != VK_SUCCESS) {
+			return ret;
+		}
+
+		record_copy(enc, enc->transfer_cmd, import->buffer);
+
+		ret = enc->fn.vkEndCommandBuffer(enc->transfer_cmd);
+		if (ret != VK_SUCCESS) {
+			U_LOG_E("vkEndCommandBuffer: %s", vk_result_string(ret));
+			return ret;
+		}
+
+		VkSubmitInfo submit_info = {};
+		submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submit_info.commandBufferCount = 1;
+		submit_info.pCommandBuffers = &enc->transfer_cmd;
+		submit_info.signalSemaphoreCount = 1;
+		submit_info.pSignalSemaphores = &enc->copy_done;
+
+		ret = enc->fn.vkQueueSubmit(enc->transfer_queue, 1, &submit_info, VK_NULL_HANDLE);
+		if (ret != VK_SUCCESS) {
+			U_LOG_E("vkQueueSubmit: %s", vk_result_string(ret));
+			return ret;
+		}
+	}
+
+	ret = begin_cmd(enc, enc->encode_cmd);
+	if (ret != VK_SUCCESS) {
+		return ret;
+	}
+
+	if (!separate_copy) {
+		record_copy(enc, enc->encode_cmd, import->buffer);
+	}
+
+	record_encode(enc, enc->encode_cmd, idr);
+
+	ret = enc->fn.vkEndCommandBuffer(enc->encode_cmd);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkEndCommandBuffer: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+	VkSubmitInfo submit_info = {};
+	submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit_info.waitSemaphoreCount = separate_copy ? 1 : 0;
+	submit_info.pWaitSemaphores = separate_copy ? &enc->copy_done : NULL;
+	submit_info.pWaitDstStageMask = separate_copy ? &wait_stage : NULL;
+	submit_info.commandBufferCount = 1;
+	submit_info.pCommandBuffers = &enc->encode_cmd;
+
+	ret = enc->fn.vkResetFences(enc->device, 1, &enc->fence);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkResetFences: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	ret = enc->fn.vkQueueSubmit(enc->encode_queue, 1, &submit_info, enc->fence);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkQueueSubmit: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	ret = enc->fn.vkWaitForFences(enc->device, 1, &enc->fence, VK_TRUE, UINT64_MAX);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkWaitForFences: %s", vk_result_string(ret));
+	}
+
+	return ret;
+}
+
+#endif // EMS_HAVE_VK_VIDEO_ENCODE
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+bool
+ems_vk_video_encoder_create(struct vk_bundle *vk,
+                            uint32_t width,
+                            uint32_t height,
+                            uint32_t bitrate_kbps,
+                            uint32_t framerate,
+                            bool periodic_idr,
+                            uint32_t slices,
+                            struct ems_vk_video_encoder **out_enc)
+{
+#ifdef EMS_HAVE_VK_VIDEO_ENCODE
+	if (width % 2 != 0 || height % 2 != 0) {
+		U_LOG_E("Vulkan Video encoding needs an even size, got %ux%u", width, height);
+		return false;
+	}
+
+	struct ems_vk_video_encoder *enc = new ems_vk_video_encoder();
+	enc->vk = vk;
+	enc->width = width;
+	enc->height = height;
+	enc->idr_period = periodic_idr ? framerate * EMS_VK_VIDEO_IDR_PERIOD_SECONDS : 0;
+	enc->ref_slot = -1;
+	enc->force_keyframe = true;
+	enc->target_bitrate_kbps = bitrate_kbps;
+	enc->target_framerate = framerate;
+	enc->slice_count = CLAMP(slices, 1, EMS_VK_VIDEO_MAX_SLICES);
+
+	VkVideoCapabilitiesKHR caps = {};
+	VkVideoEncodeCapabilitiesKHR encode_caps = {};
+	VkVideoEncodeH264CapabilitiesKHR h264_caps = {};
+
+	if (!find_queue_families(enc) ||                                                   //
+	    create_device(enc) != VK_SUCCESS ||                                            //
+	    setup_profile_and_caps(enc, &caps, &encode_caps, &h264_caps) != VK_SUCCESS || //
+	    create_session(enc, &caps) != VK_SUCCESS ||                                    //
+	    create_session_parameters(enc, &h264_caps) != VK_SUCCESS ||                    //
+	    create_resources(enc, &caps) != VK_SUCCESS) {                                  //
+		ems_vk_video_encoder_destroy(&enc);
+		return false;
+	}
+
+	setup_rate_control(enc, bitrate_kbps, framerate);
+
+	U_LOG_I("Vulkan Video H.264 encoder: %ux%u coded as %ux%u, %u kbit/s, %u slices, %s, %s queue for the copy",
+	        width, height, enc->coded_extent.width, enc->coded_extent.height, bitrate_kbps, enc->slice_count,
+	        enc->rate_control_mode == VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR   ? "CBR"
+	        : enc->rate_control_mode == VK_VIDEO_ENCODE_RATE_CONTROL_MODE_VBR_BIT_KHR ? "VBR"
+	                                                                                  : "default rate control",
+	        enc->transfer_family == enc->encode_family ? "encode" : "separate");
+
+	*out_enc = enc;
+
+	return true;
+#else
+	U_LOG_E("Built against Vulkan headers without VK_KHR_video_encode_h264.");
+	return false;
+#endif
+}
+
+void
+ems_vk_video_encoder_destroy(struct ems_vk_video_encoder **enc_ptr)
+{
+#ifdef EMS_HAVE_VK_VIDEO_ENCODE
+	struct ems_vk_video_encoder *enc = *enc_ptr;
+	if (enc == NULL) {
+		return;
+	}
+
+	// Function loading may have failed part way, the first two are all we need if so.
+	if (enc->device != VK_NULL_HANDLE && enc->fn.vkDestroyDevice != NULL && enc->fn.vkDeviceWaitIdle != NULL) {
+		enc->fn.vkDeviceWaitIdle(enc->device);
+
+		for (uint32_t i = 0; i < enc->import_count; i++) {
+			enc->fn.vkDestroyBuffer(enc->device, enc->imports[i].buffer, NULL);
+			enc->fn.vkFreeMemory(enc->device, enc->imports[i].memory, NULL);
+		}
+
+		// Frees the command buffers too.
+		if (enc->encode_pool != VK_NULL_HANDLE) {
+			enc->fn.vkDestroyCommandPool(enc->device, enc->encode_pool, NULL);
+		}
+		if (enc->transfer_pool != VK_NULL_HANDLE) {
+			enc->fn.vkDestroyCommandPool(enc->device, enc->transfer_pool, NULL);
+		}
+		if (enc->copy_done != VK_NULL_HANDLE) {
+			enc->fn.vkDestroySemaphore(enc->device, enc->copy_done, NULL);
+		}
+		if (enc->fence != VK_NULL_HANDLE) {
+			enc->fn.vkDestroyFence(enc->device, enc->fence, NULL);
+		}
+		if (enc->query_pool != VK_NULL_HANDLE) {
+			enc->fn.vkDestroyQueryPool(enc->device, enc->query_pool, NULL);
+		}
+		if (enc->bitstream != VK_NULL_HANDLE) {
+			enc->fn.vkDestroyBuffer(enc->device, enc->bitstream, NULL);
+		}
+		if (enc->bitstream_memory != VK_NULL_HANDLE) {
+			enc->fn.vkFreeMemory(enc->device, enc->bitstream_memory, NULL);
+		}
+		for (uint32_t i = 0; i < EMS_VK_VIDEO_DPB_SLOTS; i++) {
+			if (enc->dpb_views[i] != VK_NULL_HANDLE) {
+				enc->fn.vkDestroyImageView(enc->device, enc->dpb_views[i], NULL);
+			}
+		}
+		if (enc->dpb_image != VK_NULL_HANDLE) {
+			enc->fn.vkDestroyImage(enc->device, enc->dpb_image, NULL);
+		}
+		if (enc->dpb_memory != VK_NULL_HANDLE) {
+			enc->fn.vkFreeMemory(enc->device, enc->dpb_memory, NULL);
+		}
+		if (enc->src_view != VK_NULL_HANDLE) {
+			enc->fn.vkDestroyImageView(enc->device, enc->src_view, NULL);
+		}
+		if (enc->src_image != VK_NULL_HANDLE) {
+			enc->fn.vkDestroyImage(enc->device, enc->src_image, NULL);
+		}
+		if (enc->src_memory != VK_NULL_HANDLE) {
+			enc->fn.vkFreeMemory(enc->device, enc->src_memory, NULL);
+		}
+		if (enc->params != VK_NULL_HANDLE) {
+			enc->fn.vkDestroyVideoSessionParametersKHR(enc->device, enc->params, NULL);
+		}
+		if (enc->session != VK_NULL_HANDLE) {
+			enc->fn.vkDestroyVideoSessionKHR(enc->device, enc->session, NULL);
+		}
+		for (uint32_t i = 0; i < enc->session_memory_count; i++) {
+			enc->fn.vkFreeMemory(enc->device, enc->session_memory[i], NULL);
+		}
+
+		enc->fn.vkDestroyDevice(enc->device, NULL);
+	}
+
+	free(enc->headers);
+
+	delete enc;
+	*enc_ptr = NULL;
+#else
+	(void)enc_ptr;
+#endif
+}
+
+bool
+ems_vk_video_encoder_encode(struct ems_vk_video_encoder *enc,
+                            struct xrt_frame *frame,
+                            int dmabuf_fd,
+                            GBytes **out_au,
+                            bool *out_keyframe)
+{
+#ifdef EMS_HAVE_VK_VIDEO_ENCODE
+	if (frame->width != enc->width || frame->height != enc->height) {
+		U_LOG_E("Frame is %ux%u, encoder is %ux%u", frame->width, frame->height, enc->width, enc->height);
+		return false;
+	}
+
+	struct ems_vk_video_import *import = get_import(enc, frame, dmabuf_fd);
+	if (import == NULL) {
+		return false;
+	}
+
+	// Keeps the IDR interval in seconds when the frame rate changes.
+	if (enc->idr_period > 0) {
+		enc->idr_period = enc->target_framerate * EMS_VK_VIDEO_IDR_PERIOD_SECONDS;
+	}
+
+	bool idr = enc->force_keyframe.exchange(false) || !enc->session_initialized ||
+	           (enc->idr_period > 0 && enc->frames_since_idr >= enc->idr_period);
+	if (idr) {
+		enc->frames_since_idr = 0;
+		enc->frame_num = 0;
+		enc->ref_slot = -1;
+	}
+
+	VkResult ret = submit_and_wait(enc, import, idr);
+	if (ret != VK_SUCCESS) {
+		// The DPB state is unknown now, start over.
+		enc->force_keyframe = true;
+		return false;
+	}
+
+	// With the default rate control this is the first state change, after that it never changes.
+	enc->session_initialized = true;
+
+	struct
+	{
+		uint32_t offset;
+		uint32_t bytes_written;
+		VkQueryResultStatusKHR status;
+	} feedback = {};
+
+	ret = enc->fn.vkGetQueryPoolResults(enc->device, enc->query_pool, 0, 1, sizeof(feedback), &feedback,
+	                                    sizeof(feedback), VK_QUERY_RESULT_WITH_STATUS_BIT_KHR);
+	if (ret != VK_SUCCESS || feedback.status != VK_QUERY_RESULT_STATUS_COMPLETE_KHR) {
+		U_LOG_E("Encode failed: %s, status %i", vk_result_string(ret), (int)feedback.status);
+		enc->force_keyframe = true;
+		return false;
+	}
+
+	if ((VkDeviceSize)feedback.offset + feedback.bytes_written > enc->bitstream_size) {
+		U_LOG_E("Encoded frame does not fit the bitstream buffer");
+		enc->force_keyframe = true;
+		return false;
+	}
+
+	// Parameter sets in front of every IDR, a joining client can start from any of them.
+	size_t header_size = idr ? enc->headers_size : 0;
+	size_t au_size = header_size + feedback.bytes_written;
+	uint8_t *au = (uint8_t *)g_malloc(au_size);
+	if (header_size > 0) {
+		memcpy(au, enc->headers, header_size);
+	}
+	memcpy(au + header_size, enc->bitstream_mapped + feedback.offset, feedback.bytes_written);
+
+	// Advance to the next picture.
+	enc->ref_slot = (int32_t)enc->setup_slot;
+	enc->setup_slot = (enc->setup_slot + 1) % EMS_VK_VIDEO_DPB_SLOTS;
+	enc->frame_num = (enc->frame_num + 1) % EMS_VK_VIDEO_MAX_FRAME_NUM;
+	enc->frames_since_idr++;
+	if (idr) {
+		enc->idr_pic_id++;
+	}
+
+	*out_au = g_bytes_new_take(au, au_size);
+	*out_keyframe = idr;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void
+ems_vk_video_encoder_force_keyframe(struct ems_vk_video_encoder *enc)
+{
+#ifdef EMS_HAVE_VK_VIDEO_ENCODE
+	enc->force_keyframe = true;
+#endif
+}
+
+void
+ems_vk_video_encoder_set_bitrate(struct ems_vk_video_encoder *enc, uint32_t bitrate_kbps)
+{
+#ifdef EMS_HAVE_VK_VIDEO_ENCODE
+	enc->target_bitrate_kbps = bitrate_kbps;
+#endif
+}
+
+void
+ems_vk_video_encoder_set_framerate(struct ems_vk_video_encoder *enc, uint32_t framerate)
+{
+#ifdef EMS_HAVE_VK_VIDEO_ENCODE
+	enc->target_framerate = framerate;
+#endif
+}
@@ -0,0 +1,100 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  H.264 encoding with Vulkan Video for the remote rendering compositor.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include "xrt/xrt_defines.h"
+#include "xrt/xrt_frame.h"
+
+#include "vk/vk_helpers.h"
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+struct ems_vk_video_encoder;
+
+/*!
+ * Creates an encoder for NV12 frames of the given size on the physical device
+ * of @p vk. The compositor device has no video encode queue, so the encoder
+ * creates its own device next to it and imports the frames as dmabuf. Without
+ * @p periodic_idr IDRs are only made on ems_vk_video_encoder_force_keyframe.
+ * Each picture is split into @p slices slices, at most as many as the
+ * implementation supports, 0 is one.
+ *
+ * @ingroup comp_ems
+ */
+bool
+ems_vk_video_encoder_create(struct vk_bundle *vk,
+                            uint32_t width,
+                            uint32_t height,
+                            uint32_t bitrate_kbps,
+                            uint32_t framerate,
+                            bool periodic_idr,
+                            uint32_t slices,
+                            struct ems_vk_video_encoder **out_enc);
+
+/*!
+ * Waits for the encoder to go idle and destroys it.
+ *
+ * @ingroup comp_ems
+ */
+void
+ems_vk_video_encoder_destroy(struct ems_vk_video_encoder **enc_ptr);
+
+/*!
+ * Encodes one NV12 frame held in the dmabuf @p dmabuf_fd, blocks until the
+ * access unit is ready. The import is cached per frame, so frames must come
+ * from a fixed pool. Returns a byte-stream access unit, keyframes are prefixed
+ * with SPS and PPS.
+ *
+ * @ingroup comp_ems
+ */
+bool
+ems_vk_video_encoder_encode(struct ems_vk_video_encoder *enc,
+                            struct xrt_frame *frame,
+                            int dmabuf_fd,
+                            GBytes **out_au,
+                            bool *out_keyframe);
+
+/*!
+ * Makes the next encoded frame an IDR, safe to call from any thread.
+ *
+ * @ingroup comp_ems
+ */
+void
+ems_vk_video_encoder_force_keyframe(struct ems_vk_video_encoder *enc);
+
+/*!
+ * Retargets the bitrate, applied with the next frame. Does nothing with the
+ * default rate control of the driver. Safe to call from any thread.
+ *
+ * @ingroup comp_ems
+ */
+void
+ems_vk_video_encoder_set_bitrate(struct ems_vk_video_encoder *enc, uint32_t bitrate_kbps);
+
+/*!
+ * Retargets the frame rate the rate control spends the bitrate over, applied
+ * with the next frame. Periodic IDRs keep their interval in seconds. Safe to
+ * call from any thread.
+ *
+ * @ingroup comp_ems
+ */
+void
+ems_vk_video_encoder_set_framerate(struct ems_vk_video_encoder *enc, uint32_t framerate);
+
+
+#ifdef __cplusplus
+}
+#endif
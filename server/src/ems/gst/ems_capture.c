@@ -0,0 +1,192 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Append-only capture of the messages of a session, and reading it back for a replay.
+ */
+
+#include "ems_capture.h"
+
+#include "os/os_time.h"
+#include "util/u_logging.h"
+
+#include <pb_encode.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+//! Written out in large chunks, the threads that add to it only wait for a copy.
+#define CAPTURE_BUFFER_SIZE (1024 * 1024)
+
+#define RECORD_ALIGNMENT 8
+#define ALIGNED_SIZE(size) (((size) + RECORD_ALIGNMENT - 1) & ~(size_t)(RECORD_ALIGNMENT - 1))
+
+struct ems_capture
+{
+	//! Protects the file, the data channel threads and the payloader add to it.
+	GMutex mutex;
+	FILE *file;
+	char *buffer;
+	int64_t start_ns;
+	//! Stop at the first failed write, the rest would not line up.
+	bool failed;
+};
+
+static void
+write_record(struct ems_capture *capture, enum ems_capture_record_type type, const uint8_t *data, uint32_t size)
+{
+	static const uint8_t padding[RECORD_ALIGNMENT] = {0};
+
+	struct ems_capture_record record = {
+	    .type = type,
+	    .size = size,
+	    .time_ns = (int64_t)os_monotonic_get_ns() - capture->start_ns,
+	};
+	size_t padding_size = ALIGNED_SIZE(size) - size;
+
+	g_mutex_lock(&capture->mutex);
+	if (!capture->failed) {
+		if (fwrite(&record, sizeof(record), 1, capture->file) != 1 ||
+		    (size > 0 && fwrite(data, size, 1, capture->file) != 1) ||
+		    (padding_size > 0 && fwrite(padding, padding_size, 1, capture->file) != 1)) {
+			U_LOG_E("Failed to write the capture: %s, not capturing any more.", strerror(errno));
+			capture->failed = true;
+		}
+	}
+	g_mutex_unlock(&capture->mutex);
+}
+
+struct ems_capture *
+ems_capture_create(const char *path)
+{
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		U_LOG_E("Failed to create the capture %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	struct ems_capture *capture = g_new0(struct ems_capture, 1);
+	g_mutex_init(&capture->mutex);
+	capture->file = file;
+	capture->buffer = g_malloc(CAPTURE_BUFFER_SIZE);
+	setvbuf(file, capture->buffer, _IOFBF, CAPTURE_BUFFER_SIZE);
+	capture->start_ns = (int64_t)os_monotonic_get_ns();
+
+	struct ems_capture_header header = {
+	    .magic = EMS_CAPTURE_MAGIC,
+	    .version = EMS_CAPTURE_VERSION,
+	    .start_ns = capture->start_ns,
+	};
+	if (fwrite(&header, sizeof(header), 1, file) != 1) {
+		U_LOG_E("Failed to write the capture %s: %s", path, strerror(errno));
+		capture->failed = true;
+	}
+
+	U_LOG_I("Capturing the session to %s", path);
+	return capture;
+}
+
+void
+ems_capture_destroy(struct ems_capture **ptr_capture)
+{
+	struct ems_capture *capture = *ptr_capture;
+	if (capture == NULL) {
+		return;
+	}
+	*ptr_capture = NULL;
+
+	if (fclose(capture->file) != 0) {
+		U_LOG_E("Failed to finish the capture: %s", strerror(errno));
+	}
+	g_free(capture->buffer);
+	g_mutex_clear(&capture->mutex);
+	g_free(capture);
+}
+
+void
+ems_capture_add_up_message(struct ems_capture *capture, const em_proto_UpMessage *message)
+{
+	// Compact messages only decode with the epoch of their session, so everything is stored as protobuf.
+	uint8_t buf[em_proto_UpMessage_size];
+	pb_ostream_t os = pb_ostream_from_buffer(buf, sizeof(buf));
+	if (!pb_encode(&os, em_proto_UpMessage_fields, message)) {
+		U_LOG_E("Failed to encode the UpMessage for the capture: %s", PB_GET_ERROR(&os));
+		return;
+	}
+
+	write_record(capture, EMS_CAPTURE_RECORD_UP_MESSAGE, buf, (uint32_t)os.bytes_written);
+}
+
+void
+ems_capture_add_down_message(struct ems_capture *capture, const uint8_t *data, uint32_t size)
+{
+	write_record(capture, EMS_CAPTURE_RECORD_DOWN_MESSAGE, data, size);
+}
+
+bool
+ems_capture_reader_open(struct ems_capture_reader *reader, const char *path, GError **error)
+{
+	memset(reader, 0, sizeof(*reader));
+
+	reader->file = g_mapped_file_new(path, FALSE, error);
+	if (reader->file == NULL) {
+		return false;
+	}
+	reader->data = (const uint8_t *)g_mapped_file_get_contents(reader->file);
+	reader->size = g_mapped_file_get_length(reader->file);
+
+	struct ems_capture_header header;
+	if (reader->size < sizeof(header)) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is too short for a capture", path);
+		ems_capture_reader_close(reader);
+		return false;
+	}
+	memcpy(&header, reader->data, sizeof(header));
+	if (memcmp(header.magic, EMS_CAPTURE_MAGIC, sizeof(header.magic)) != 0) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is not a capture", path);
+		ems_capture_reader_close(reader);
+		return false;
+	}
+	if (header.version != EMS_CAPTURE_VERSION) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s has capture version %u, we read %u", path,
+		            header.version, EMS_CAPTURE_VERSION);
+		ems_capture_reader_close(reader);
+		return false;
+	}
+
+	reader->offset = sizeof(header);
+	return true;
+}
+
+void
+ems_capture_reader_close(struct ems_capture_reader *reader)
+{
+	g_clear_pointer(&reader->file, g_mapped_file_unref);
+	reader->data = NULL;
+	reader->size = 0;
+	reader->offset = 0;
+}
+
+bool
+ems_capture_reader_next(struct ems_capture_reader *reader,
+                        struct ems_capture_record *out_record,
+                        const uint8_t **out_data)
+{
+	// A server that did not shut down cleanly leaves the last record cut off.
+	if (reader->size - reader->offset < sizeof(*out_record)) {
+		return false;
+	}
+	memcpy(out_record, reader->data + reader->offset, sizeof(*out_record));
+
+	size_t data_offset = reader->offset + sizeof(*out_record);
+	if (reader->size - data_offset < out_record->size) {
+		return false;
+	}
+
+	*out_data = reader->data + data_offset;
+	reader->offset = MIN(data_offset + ALIGNED_SIZE((size_t)out_record->size), reader->size);
+	return true;
+}
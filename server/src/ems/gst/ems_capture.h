@@ -0,0 +1,113 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Append-only capture of the messages of a session, and reading it back for a replay.
+ */
+
+#pragma once
+
+#include "electricmaple.pb.h"
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+G_BEGIN_DECLS
+
+#define EMS_CAPTURE_MAGIC "EMSCAPT"
+#define EMS_CAPTURE_VERSION 1
+
+/*!
+ * Start of the file. All fields are little endian, like the machines that write and read them.
+ */
+struct ems_capture_header
+{
+	//! @ref EMS_CAPTURE_MAGIC with its terminator.
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	//! Monotonic time the capture began, records are relative to it.
+	int64_t start_ns;
+};
+
+enum ems_capture_record_type
+{
+	//! An UpMessage of the tracking client as decoded, in protobuf.
+	EMS_CAPTURE_RECORD_UP_MESSAGE = 1,
+	//! A DownMessage as it went out with the last packet of its frame, in protobuf.
+	EMS_CAPTURE_RECORD_DOWN_MESSAGE = 2,
+};
+
+/*!
+ * Precedes each message, which is padded to 8 bytes so the next record is aligned in a mapping of the file.
+ */
+struct ems_capture_record
+{
+	uint32_t type;
+	uint32_t size;
+	//! Since @ref ems_capture_header::start_ns.
+	int64_t time_ns;
+};
+
+struct ems_capture;
+
+/*!
+ * Create the file at @p path, replacing one that is there.
+ *
+ * @return NULL if it can't be written
+ */
+struct ems_capture *
+ems_capture_create(const char *path);
+
+/*!
+ * Flush and close the file, and clear the pointer.
+ */
+void
+ems_capture_destroy(struct ems_capture **ptr_capture);
+
+/*!
+ * Append an UpMessage received now. Safe to call from any thread.
+ */
+void
+ems_capture_add_up_message(struct ems_capture *capture, const em_proto_UpMessage *message);
+
+/*!
+ * Append a DownMessage already encoded, sent now. Safe to call from any thread.
+ */
+void
+ems_capture_add_down_message(struct ems_capture *capture, const uint8_t *data, uint32_t size);
+
+/*!
+ * A capture mapped into memory, walked from the start.
+ */
+struct ems_capture_reader
+{
+	GMappedFile *file;
+	const uint8_t *data;
+	size_t size;
+	size_t offset;
+};
+
+/*!
+ * Map the capture at @p path and check its header.
+ */
+bool
+ems_capture_reader_open(struct ems_capture_reader *reader, const char *path, GError **error);
+
+void
+ems_capture_reader_close(struct ems_capture_reader *reader);
+
+/*!
+ * The next record, its message stays valid until the reader is closed.
+ *
+ * @return false at the end of the capture, or where it was cut off
+ */
+bool
+ems_capture_reader_next(struct ems_capture_reader *reader,
+                        struct ems_capture_record *out_record,
+                        const uint8_t **out_data);
+
+G_END_DECLS
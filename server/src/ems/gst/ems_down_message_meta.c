@@ -0,0 +1,119 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  GstMeta carrying the encoded DownMessage of a frame from the appsrc to the payloader.
+ */
+
+#include "ems_down_message_meta.h"
+
+#include "util/u_logging.h"
+
+#include <pb_encode.h>
+
+#include <string.h>
+
+
+static gboolean
+down_message_meta_init(GstMeta *meta, gpointer params, GstBuffer *buffer)
+{
+	(void)params;
+	(void)buffer;
+
+	struct ems_down_message_meta *dmm = (struct ems_down_message_meta *)meta;
+	dmm->frame_sequence_id = -1;
+	dmm->size = 0;
+	return TRUE;
+}
+
+static gboolean
+down_message_meta_transform(GstBuffer *dest, GstMeta *meta, GstBuffer *buffer, GQuark type, gpointer data)
+{
+	(void)buffer;
+	(void)data;
+
+	// Whole or part of the frame, the message belongs to all of it.
+	if (!GST_META_TRANSFORM_IS_COPY(type)) {
+		return FALSE;
+	}
+
+	const struct ems_down_message_meta *src = (const struct ems_down_message_meta *)meta;
+	struct ems_down_message_meta *dmm =
+	    (struct ems_down_message_meta *)gst_buffer_add_meta(dest, EMS_DOWN_MESSAGE_META_INFO, NULL);
+	if (dmm == NULL) {
+		return FALSE;
+	}
+
+	dmm->frame_sequence_id = src->frame_sequence_id;
+	dmm->size = src->size;
+	memcpy(dmm->data, src->data, src->size);
+	return TRUE;
+}
+
+
+/*
+ *
+ * Exported functions.
+ *
+ */
+
+GType
+ems_down_message_meta_api_get_type(void)
+{
+	static GType type = 0;
+	static const gchar *tags[] = {NULL};
+
+	if (g_once_init_enter(&type)) {
+		GType _type = gst_meta_api_type_register("EmsDownMessageMetaAPI", tags);
+		g_once_init_leave(&type, _type);
+	}
+	return type;
+}
+
+const GstMetaInfo *
+ems_down_message_meta_get_info(void)
+{
+	static const GstMetaInfo *info = NULL;
+
+	if (g_once_init_enter((GstMetaInfo **)&info)) {
+		const GstMetaInfo *meta = gst_meta_register(
+		    EMS_DOWN_MESSAGE_META_API_TYPE, "EmsDownMessageMeta", sizeof(struct ems_down_message_meta),
+		    down_message_meta_init, NULL, down_message_meta_transform);
+		g_once_init_leave((GstMetaInfo **)&info, (GstMetaInfo *)meta);
+	}
+	return info;
+}
+
+bool
+ems_down_message_meta_set(struct ems_down_message_meta *dmm, const em_proto_DownMessage *msg)
+{
+	pb_ostream_t os = pb_ostream_from_buffer(dmm->data, sizeof(dmm->data));
+	if (!pb_encode(&os, em_proto_DownMessage_fields, msg)) {
+		U_LOG_E("Failed to encode protobuf: %s", PB_GET_ERROR(&os));
+		return false;
+	}
+
+	dmm->size = (guint)os.bytes_written;
+	dmm->frame_sequence_id = msg->has_frame_data ? msg->frame_data.frame_sequence_id : -1;
+	return true;
+}
+
+struct ems_down_message_meta *
+ems_buffer_add_down_message_meta(GstBuffer *buffer, const em_proto_DownMessage *msg)
+{
+	struct ems_down_message_meta *dmm =
+	    (struct ems_down_message_meta *)gst_buffer_add_meta(buffer, EMS_DOWN_MESSAGE_META_INFO, NULL);
+	if (dmm == NULL) {
+		U_LOG_E("Failed to add the DownMessage meta.");
+		return NULL;
+	}
+
+	if (!ems_down_message_meta_set(dmm, msg)) {
+		gst_buffer_remove_meta(buffer, &dmm->meta);
+		return NULL;
+	}
+
+	return dmm;
+}
@@ -0,0 +1,70 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  GstMeta carrying the encoded DownMessage of a frame from the appsrc to the payloader.
+ */
+
+#pragma once
+
+#include "electricmaple.pb.h"
+
+#include <gst/gst.h>
+#include <stdbool.h>
+
+G_BEGIN_DECLS
+
+#define EMS_DOWN_MESSAGE_META_API_TYPE (ems_down_message_meta_api_get_type())
+#define EMS_DOWN_MESSAGE_META_INFO (ems_down_message_meta_get_info())
+
+/*!
+ * The DownMessage of a frame, encoded once when the frame is pushed and kept inline, so attaching, copying and
+ * reading it never allocates past the meta itself.
+ *
+ * Has no tags, so the encoders and payloaders copy it with the frame.
+ */
+struct ems_down_message_meta
+{
+	GstMeta meta;
+
+	//! Of the message, so the probes don't need to decode it.
+	int64_t frame_sequence_id;
+
+	guint size;
+	guint8 data[em_proto_DownMessage_size];
+};
+
+GType
+ems_down_message_meta_api_get_type(void);
+
+const GstMetaInfo *
+ems_down_message_meta_get_info(void);
+
+/*!
+ * Encode @p msg into @p dmm, replacing what it held, for metas that stay on pooled buffers.
+ *
+ * @return false if it failed to encode
+ */
+bool
+ems_down_message_meta_set(struct ems_down_message_meta *dmm, const em_proto_DownMessage *msg);
+
+/*!
+ * Encode @p msg into a new meta on @p buffer.
+ *
+ * @return NULL if it failed to encode
+ */
+struct ems_down_message_meta *
+ems_buffer_add_down_message_meta(GstBuffer *buffer, const em_proto_DownMessage *msg);
+
+/*!
+ * The DownMessage meta of @p buffer, or NULL.
+ */
+static inline struct ems_down_message_meta *
+ems_buffer_get_down_message_meta(GstBuffer *buffer)
+{
+	return (struct ems_down_message_meta *)gst_buffer_get_meta(buffer, EMS_DOWN_MESSAGE_META_API_TYPE);
+}
+
+G_END_DECLS
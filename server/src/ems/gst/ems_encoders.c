@@ -0,0 +1,344 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Table of the encoders and codecs the streaming pipeline can use.
+ */
+
+#include "ems_encoders.h"
+
+#include "util/u_misc.h"
+#include "util/u_logging.h"
+
+#include <gst/gst.h>
+
+
+static const struct ems_codec_descriptor codecs[] = {
+    [EMS_CODEC_H264] =
+        {
+            .codec = EMS_CODEC_H264,
+            .name = "H264",
+            .encoded_caps = "video/x-h264,profile=main",
+            .parser = "h264parse",
+            .payloader = "rtph264pay config-interval=1",
+            .rtp_caps = "application/x-rtp,payload=96,encoding-name=H264,clock-rate=90000,media=video,"
+                        "packetization-mode=(string)1,profile-level-id=(string)42e01f",
+        },
+    [EMS_CODEC_H265] =
+        {
+            .codec = EMS_CODEC_H265,
+            .name = "H265",
+            .encoded_caps = "video/x-h265,profile=main",
+            .parser = "h265parse",
+            .payloader = "rtph265pay config-interval=1",
+            .rtp_caps = "application/x-rtp,payload=96,encoding-name=H265,clock-rate=90000,media=video",
+        },
+    [EMS_CODEC_AV1] =
+        {
+            .codec = EMS_CODEC_AV1,
+            .name = "AV1",
+            .encoded_caps = "video/x-av1",
+            .parser = "av1parse",
+            .payloader = "rtpav1pay",
+            .rtp_caps = "application/x-rtp,payload=96,encoding-name=AV1,clock-rate=90000,media=video",
+        },
+};
+
+static const struct ems_encoder_descriptor encoders[] = {
+    {
+        .type = EMS_ENCODER_TYPE_X264,
+        .name = "x264",
+        .element = "x264enc",
+        .codec = EMS_CODEC_H264,
+        .properties = "tune=zerolatency sliced-threads=true speed-preset=veryfast bframes=2",
+        .bitrate_property = "bitrate",
+        .intra_refresh_properties = "intra-refresh=true key-int-max=60",
+        .slices_property = "threads",
+    },
+    {
+        .type = EMS_ENCODER_TYPE_NVH264,
+        .name = "nvh264",
+        .element = "nvh264enc",
+        .codec = EMS_CODEC_H264,
+        .properties = "zerolatency=true rc-mode=cbr preset=low-latency",
+        .bitrate_property = "bitrate",
+        .intra_refresh_properties = "gop-size=-1",
+    },
+    {
+        .type = EMS_ENCODER_TYPE_VAH264,
+        .name = "vah264",
+        .element = "vah264enc",
+        .codec = EMS_CODEC_H264,
+        .properties = "b-frames=0 rate-control=cbr target-usage=7",
+        .bitrate_property = "bitrate",
+        .imports_dmabuf = TRUE,
+        .intra_refresh_properties = "key-int-max=1024",
+        .slices_property = "num-slices",
+        .reads_roi = TRUE,
+    },
+    {
+        .type = EMS_ENCODER_TYPE_VULKAN_H264,
+        .name = "vulkanh264",
+        // No element, the compositor encodes.
+        .codec = EMS_CODEC_H264,
+    },
+    {
+        .type = EMS_ENCODER_TYPE_QSVH264,
+        .name = "qsvh264",
+        .element = "qsvh264enc",
+        .codec = EMS_CODEC_H264,
+        .properties = "b-frames=0 rate-control=cbr target-usage=7",
+        .bitrate_property = "bitrate",
+        .intra_refresh_properties = "gop-size=1000",
+    },
+    {
+        .type = EMS_ENCODER_TYPE_AMFH264,
+        .name = "amfh264",
+        .element = "amfh264enc",
+        .codec = EMS_CODEC_H264,
+        .properties = "usage=ultra-low-latency rate-control=cbr preset=speed",
+        .bitrate_property = "bitrate",
+        .intra_refresh_properties = "gop-size=1000",
+    },
+    {
+        .type = EMS_ENCODER_TYPE_NVH265,
+        .name = "nvh265",
+        .element = "nvh265enc",
+        .codec = EMS_CODEC_H265,
+        .properties = "zerolatency=true rc-mode=cbr preset=low-latency",
+        .bitrate_property = "bitrate",
+        .intra_refresh_properties = "gop-size=-1",
+    },
+    {
+        .type = EMS_ENCODER_TYPE_VAH265,
+        .name = "vah265",
+        .element = "vah265enc",
+        .codec = EMS_CODEC_H265,
+        .properties = "b-frames=0 rate-control=cbr target-usage=7",
+        .bitrate_property = "bitrate",
+        .imports_dmabuf = TRUE,
+        .intra_refresh_properties = "key-int-max=1024",
+        .slices_property = "num-slices",
+        .reads_roi = TRUE,
+    },
+    {
+        .type = EMS_ENCODER_TYPE_QSVH265,
+        .name = "qsvh265",
+        .element = "qsvh265enc",
+        .codec = EMS_CODEC_H265,
+        .properties = "b-frames=0 rate-control=cbr target-usage=7",
+        .bitrate_property = "bitrate",
+        .intra_refresh_properties = "gop-size=1000",
+    },
+    {
+        .type = EMS_ENCODER_TYPE_AMFH265,
+        .name = "amfh265",
+        .element = "amfh265enc",
+        .codec = EMS_CODEC_H265,
+        .properties = "usage=ultra-low-latency rate-control=cbr preset=speed",
+        .bitrate_property = "bitrate",
+        .intra_refresh_properties = "gop-size=1000",
+    },
+    {
+        .type = EMS_ENCODER_TYPE_NVAV1,
+        .name = "nvav1",
+        .element = "nvav1enc",
+        .codec = EMS_CODEC_AV1,
+        .properties = "rate-control=cbr preset=p1 tune=ultra-low-latency",
+        .bitrate_property = "bitrate",
+        .intra_refresh_properties = "gop-size=-1",
+    },
+    {
+        .type = EMS_ENCODER_TYPE_VAAV1,
+        .name = "vaav1",
+        .element = "vaav1enc",
+        .codec = EMS_CODEC_AV1,
+        .properties = "rate-control=cbr target-usage=7",
+        .bitrate_property = "bitrate",
+        .imports_dmabuf = TRUE,
+        .intra_refresh_properties = "key-int-max=1024",
+        .reads_roi = TRUE,
+    },
+    {
+        .type = EMS_ENCODER_TYPE_QSVAV1,
+        .name = "qsvav1",
+        .element = "qsvav1enc",
+        .codec = EMS_CODEC_AV1,
+        .properties = "rate-control=cbr target-usage=7",
+        .bitrate_property = "bitrate",
+        .intra_refresh_properties = "gop-size=1000",
+    },
+    {
+        .type = EMS_ENCODER_TYPE_AMFAV1,
+        .name = "amfav1",
+        .element = "amfav1enc",
+        .codec = EMS_CODEC_AV1,
+        .properties = "usage=low-latency rate-control=cbr preset=speed",
+        .bitrate_property = "bitrate",
+        .intra_refresh_properties = "gop-size=1000",
+    },
+    {
+        .type = EMS_ENCODER_TYPE_SVTAV1,
+        .name = "svtav1",
+        .element = "svtav1enc",
+        .codec = EMS_CODEC_AV1,
+        .properties = "preset=12",
+        .bitrate_property = "target-bitrate",
+        .intra_refresh_properties = "intra-period-length=-1",
+    },
+};
+
+
+/*
+ *
+ * Exported functions.
+ *
+ */
+
+const struct ems_encoder_descriptor *
+ems_encoder_get(EmsEncoderType type)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(encoders); i++) {
+		if (encoders[i].type == type) {
+			return &encoders[i];
+		}
+	}
+
+	return NULL;
+}
+
+const struct ems_encoder_descriptor *
+ems_encoder_find_by_name(const char *name)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(encoders); i++) {
+		if (g_strcmp0(encoders[i].name, name) == 0) {
+			return &encoders[i];
+		}
+	}
+
+	return NULL;
+}
+
+const struct ems_codec_descriptor *
+ems_encoder_get_codec(const struct ems_encoder_descriptor *desc)
+{
+	return &codecs[desc->codec];
+}
+
+const char *
+ems_encoder_list_names(void)
+{
+	static gchar *names = NULL;
+
+	if (names == NULL) {
+		GString *str = g_string_new(NULL);
+		for (size_t i = 0; i < ARRAY_SIZE(encoders); i++) {
+			g_string_append_printf(str, i == 0 ? "%s" : ", %s", encoders[i].name);
+		}
+		names = g_string_free(str, FALSE);
+	}
+
+	return names;
+}
+
+gboolean
+ems_encoder_probe(const struct ems_encoder_descriptor *desc)
+{
+	if (desc->element == NULL) {
+		return TRUE;
+	}
+
+	GstElementFactory *factory = gst_element_factory_find(desc->element);
+	if (factory == NULL) {
+		return FALSE;
+	}
+
+	GstElement *element = gst_element_factory_create(factory, NULL);
+	gst_object_unref(factory);
+	if (element == NULL) {
+		return FALSE;
+	}
+
+	gboolean ret = gst_element_set_state(element, GST_STATE_READY) != GST_STATE_CHANGE_FAILURE;
+
+	gst_element_set_state(element, GST_STATE_NULL);
+	gst_object_unref(element);
+
+	return ret;
+}
+
+EmsEncoderType
+ems_encoder_select(EmsEncoderType preferred)
+{
+	gboolean available[ARRAY_SIZE(encoders)];
+	GString *list = g_string_new(NULL);
+
+	for (size_t i = 0; i < ARRAY_SIZE(encoders); i++) {
+		available[i] = ems_encoder_probe(&encoders[i]);
+		if (available[i]) {
+			g_string_append_printf(list, list->len == 0 ? "%s" : ", %s", encoders[i].name);
+		}
+	}
+
+	U_LOG_I("Available encoders: %s", list->str);
+	g_string_free(list, TRUE);
+
+	const struct ems_encoder_descriptor *desc = ems_encoder_get(preferred);
+	for (size_t i = 0; i < ARRAY_SIZE(encoders); i++) {
+		if (&encoders[i] == desc && available[i]) {
+			return preferred;
+		}
+	}
+
+	// Same codec first, so the client keeps working.
+	const struct ems_encoder_descriptor *fallback = NULL;
+	for (size_t i = 0; i < ARRAY_SIZE(encoders) && fallback == NULL; i++) {
+		if (available[i] && desc != NULL && encoders[i].codec == desc->codec) {
+			fallback = &encoders[i];
+		}
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(encoders) && fallback == NULL; i++) {
+		if (available[i]) {
+			fallback = &encoders[i];
+		}
+	}
+
+	if (fallback == NULL) {
+		U_LOG_E("No encoder available, keeping %s.", desc != NULL ? desc->name : "unknown");
+		return preferred;
+	}
+
+	U_LOG_W("Encoder %s not available, using %s.", desc != NULL ? desc->name : "unknown", fallback->name);
+
+	return fallback->type;
+}
+
+gchar *
+ems_encoder_create_launch_string(const struct ems_encoder_descriptor *desc,
+                                 uint32_t bitrate,
+                                 bool intra_refresh,
+                                 uint32_t slices)
+{
+	// The compositor pushes access units, only the parser is needed.
+	if (desc->element == NULL) {
+		return g_strdup(ems_encoder_get_codec(desc)->parser);
+	}
+
+	const char *intra_refresh_str =
+	    intra_refresh && desc->intra_refresh_properties != NULL ? desc->intra_refresh_properties : "";
+
+	if (slices > 0 && desc->slices_property == NULL) {
+		U_LOG_W("Encoder %s can't be told how many slices to make, ignoring --slices.", desc->name);
+	}
+	gchar *slices_str = slices > 0 && desc->slices_property != NULL
+	                        ? g_strdup_printf("%s=%u", desc->slices_property, slices)
+	                        : g_strdup("");
+
+	gchar *ret = g_strdup_printf("%s name=%s %s %s=%u %s %s", desc->element, EMS_ENCODER_ELEMENT_NAME,
+	                             desc->properties, desc->bitrate_property, bitrate, intra_refresh_str, slices_str);
+	g_free(slices_str);
+
+	return ret;
+}
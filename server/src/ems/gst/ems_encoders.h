@@ -0,0 +1,124 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Table of the encoders and codecs the streaming pipeline can use.
+ */
+
+#pragma once
+
+#include "ems_pipeline_args.h"
+
+#include <glib.h>
+#include <stdbool.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+	EMS_CODEC_H264,
+	EMS_CODEC_H265,
+	EMS_CODEC_AV1,
+} EmsCodec;
+
+/*!
+ * Everything downstream of the encoder that depends on the codec.
+ */
+struct ems_codec_descriptor
+{
+	EmsCodec codec;
+
+	//! Human readable name, also the SDP encoding name.
+	const char *name;
+
+	//! Caps right after the encoder.
+	const char *encoded_caps;
+
+	//! Parser, used on its own when the compositor already encoded.
+	const char *parser;
+
+	//! Payloader element and its properties, gets named rtppay.
+	const char *payloader;
+
+	//! RTP caps for the transceiver, end up in the SDP offer.
+	const char *rtp_caps;
+};
+
+struct ems_encoder_descriptor
+{
+	EmsEncoderType type;
+
+	//! Name for --encoder.
+	const char *name;
+
+	//! Element factory name, NULL if the compositor encodes.
+	const char *element;
+
+	EmsCodec codec;
+
+	//! Low latency property set.
+	const char *properties;
+
+	//! Property taking the bitrate in kbit/s.
+	const char *bitrate_property;
+
+	//! Takes memory:DMABuf NV12 on its sink.
+	gboolean imports_dmabuf;
+
+	//! Properties for --intra-refresh: rolling intra refresh where the encoder has it, otherwise the longest GOP.
+	const char *intra_refresh_properties;
+
+	//! Property taking the number of slices per frame for --slices. With sliced-threads x264 makes one per thread.
+	const char *slices_property;
+
+	//! Takes the QP offsets of GstVideoRegionOfInterestMeta with a roi/va parameter, for --roi.
+	gboolean reads_roi;
+};
+
+/*!
+ * Name of the encoder element in the pipeline, for retargeting it at runtime.
+ */
+#define EMS_ENCODER_ELEMENT_NAME "encoder"
+
+const struct ems_encoder_descriptor *
+ems_encoder_get(EmsEncoderType type);
+
+const struct ems_encoder_descriptor *
+ems_encoder_find_by_name(const char *name);
+
+const struct ems_codec_descriptor *
+ems_encoder_get_codec(const struct ems_encoder_descriptor *desc);
+
+/*!
+ * Comma separated list of all encoder names, for the help text.
+ */
+const char *
+ems_encoder_list_names(void);
+
+/*!
+ * Checks that the element exists and can go to READY, hardware encoders fail
+ * there when there is no device. Compositor encoders always pass, they check
+ * for themselves. Needs gst_init.
+ */
+gboolean
+ems_encoder_probe(const struct ems_encoder_descriptor *desc);
+
+/*!
+ * Probes all encoders and logs which are available, picks a fallback if
+ * @p preferred is not: first one with the same codec, then any.
+ */
+EmsEncoderType
+ems_encoder_select(EmsEncoderType preferred);
+
+/*!
+ * The gst-launch fragment for the encoder, to be freed with g_free. @p slices of 0 keeps the encoder's default.
+ */
+gchar *
+ems_encoder_create_launch_string(const struct ems_encoder_descriptor *desc,
+                                 uint32_t bitrate,
+                                 bool intra_refresh,
+                                 uint32_t slices);
+
+G_END_DECLS
@@ -11,13 +11,24 @@
 
 #include "xrt/xrt_frame.h"
 
+#include "ems_gstreamer_src.h"
+
 typedef struct _GstElement GstElement;
+typedef struct _GstAllocator GstAllocator;
+typedef struct _GstBuffer GstBuffer;
+typedef struct _GstBufferPool GstBufferPool;
+typedef struct _GstPad GstPad;
 
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+//! Most frames a source can pool, see @ref ems_gstreamer_src_use_frame_pool.
+#define EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES (8)
+
+//! Most frames tracked between the appsrc and the encoder output, more are over any sane latency budget.
+#define EMS_GSTREAMER_SRC_MAX_PENDING_FRAMES (32)
 
 /*
  *
@@ -71,6 +82,45 @@ struct ems_gstreamer_src
 
 	//! Cached appsrc element.
 	GstElement *appsrc;
+
+	//! Allocator for dmabuf frames, null if the source pushes system memory.
+	GstAllocator *dmabuf_allocator;
+
+	//! Buffers wrapping the frames given to @ref ems_gstreamer_src_use_frame_pool, null if not pooling.
+	GstBufferPool *frame_pool;
+
+	//! Acquired from @ref frame_pool and not yet pushed, by index of their frame.
+	GstBuffer *acquired[EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES];
+
+	//! Frames not acquired or not pushed, because the pipeline held every pooled buffer or was over its budget.
+	uint64_t skipped_frames;
+
+	/*!
+	 * Raw frames are dropped before the pipeline while the oldest one not out of the encoder yet is older than
+	 * this, see @ref ems_gstreamer_src_set_latency_budget. 0 for no budget.
+	 */
+	uint64_t latency_budget_ns;
+
+	//! Protects @ref pending, the encoder's streaming thread takes the frames out.
+	GMutex pending_mutex;
+	//! Sequence ids and push times of the raw frames pushed and not out of the encoder, oldest first.
+	struct
+	{
+		int64_t frame_sequence_id;
+		uint64_t push_ns;
+	} pending[EMS_GSTREAMER_SRC_MAX_PENDING_FRAMES];
+	uint32_t pending_first;
+	uint32_t pending_count;
+	//! Newest frame out of the encoder, those before it that never came out were dropped by it.
+	int64_t last_encoded_sequence_id;
+
+	//! Where we watch the frames leave the encoder, null without a budget.
+	GstPad *encoder_src_pad;
+	gulong encoder_probe_id;
+
+	//! Attached to every raw frame pushed, see @ref ems_gstreamer_src_set_regions_of_interest.
+	struct ems_gstreamer_src_roi rois[EMS_GSTREAMER_SRC_MAX_ROIS];
+	uint32_t roi_count;
 };
 
 
@@ -18,15 +18,24 @@
 #include "ems_gstreamer_pipeline.h"
 
 #include "ems_callbacks.h"
+#include "ems_capture.h"
+#include "ems_telemetry.h"
+#include "em_sequence_tracker.h"
+#include "em_thread_sched.h"
+#include "em_compact.h"
+#include "ems_down_message_meta.h"
+#include "ems_trace.h"
+#include "ems_up_message_queue.h"
 
 #include "os/os_threading.h"
+#include "os/os_time.h"
 #include "util/u_misc.h"
 #include "util/u_debug.h"
+#include "util/u_time.h"
 
 #include "electricmaple.pb.h"
 
 #include <pb_decode.h>
-#include <pb_encode.h>
 
 #include "ems_signaling_server.h"
 
@@ -34,19 +43,30 @@
 #include <gst/gst.h>
 #include <gst/gststructure.h>
 #include <gst/rtp/gstrtpbuffer.h>
+#include <gst/rtp/gstrtphdrext.h>
+#include <gst/video/video.h>
 
 #define GST_USE_UNSTABLE_API
 #include <gst/webrtc/datachannel.h>
 #include <gst/webrtc/rtcsessiondescription.h>
+#include <gst/webrtc/webrtc.h>
 #undef GST_USE_UNSTABLE_API
 
+#include <stdatomic.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <math.h>
 
 #include "ems_pipeline_args.h"
+#include "ems_encoders.h"
+#include "ems_loss_protection.h"
 
 #define WEBRTC_TEE_NAME "webrtctee"
 
+//! Of the queue feeding the recording, see @ref ems_arguments::stream_debug_file.
+#define SAVE_QUEUE_NAME "savequeue"
+
 #ifdef __aarch64__
 #define DEFAULT_VIDEOSINK " queue max-size-bytes=0 ! kmssink bus-id=a0070000.v_mix"
 #else
@@ -55,25 +75,224 @@
 
 // TODO: Can we define the below at a higher level so it can also be
 //       picked-up by em_stream_client ?
-#define RTP_TWOBYTES_HDR_EXT_ID 1 // Must be in the [1,15] range
-#define RTP_TWOBYTES_HDR_EXT_MAX_SIZE 255
+#define RTP_DOWN_MESSAGE_HDR_EXT_ID 1 // Must be in the [1,14] range
+//! A DownMessage is split over one-byte header extension elements of at most this size.
+#define RTP_ONEBYTE_HDR_EXT_MAX_SIZE 16
+//! What the elements of a DownMessage of @p size add to a packet at most: their id bytes, padding and the header.
+#define RTP_DOWN_MESSAGE_EXT_SIZE(size)                                                                                \
+	((size) + ((size) + RTP_ONEBYTE_HDR_EXT_MAX_SIZE - 1) / RTP_ONEBYTE_HDR_EXT_MAX_SIZE + 3 + 4)
+
+//! Largest RTP packet we send, what is left of a 1500 byte link MTU after IPv6, UDP and the SRTP tag.
+#define RTP_MAX_PACKET_SIZE 1442
+
+//! Must match EM_TRACKING_DATA_CHANNEL_LABEL in the client.
+#define TRACKING_DATA_CHANNEL_LABEL "tracking"
+
+#define RTP_TWCC_HDR_EXT_ID 2
+#define RTP_TWCC_URI "http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01"
+
+//! Keyframe requests closer together than this are answered by the keyframe already on its way.
+#define KEY_UNIT_MIN_INTERVAL_MS 500
+
+//! How long the session of a client that left is kept for it to reconnect.
+#define SESSION_CACHE_TTL_S 60
+
+//! How often the adaptive bitrate moves towards the estimate.
+#define BITRATE_UPDATE_INTERVAL_MS 100
+#define STATS_INTERVAL_S 5
+
+//! How often the loss protection looks at the receiver reports, which come about once a second.
+#define LOSS_PROTECTION_INTERVAL_MS 1000
+
+//! Longest the replay sleeps at once, how long it may take to stop.
+#define REPLAY_MAX_SLEEP_MS 100
+
+//! A direct client that sent nothing for this long, not even a keepalive, is gone.
+#define DIRECT_CLIENT_TIMEOUT_S 5
+//! What a direct client starts with and keeps sending as keepalive. Must match DIRECT_HELLO in the client.
+#define DIRECT_HELLO "EMHELLO1"
+//! Largest UpMessage datagram we take from a direct client.
+#define DIRECT_MAX_DATAGRAM_SIZE 65536
 
 
 EmsSignalingServer *signaling_server;
 
+struct ems_gstreamer_pipeline;
 
-struct ems_gstreamer_pipeline
+/*!
+ * State of one connected headset, in the registry from ws-client-connected
+ * until ws-client-disconnected.
+ */
+struct ems_client
 {
-	struct gstreamer_pipeline base;
+	//! The registry and each signal handler hold one, a handler may still run on a streaming thread after it left.
+	gint refcount;
+
+	EmsClientId id;
+	struct ems_gstreamer_pipeline *egp;
+
+	//! Owned by the pipeline bin, NULL for the direct client.
+	GstElement *webrtcbin;
 
 	GstWebRTCDataChannel *data_channel;
 	guint timeout_src_id;
 
+	//! Unordered and without retransmits, carries the tracking UpMessages.
+	GstWebRTCDataChannel *tracking_channel;
+
+	//! Estimator on this client's transport, NULL without TWCC.
+	GstElement *bwe;
+	//! Latest estimate in kbit/s, 0 before the first feedback.
+	gint bitrate_estimate;
+
+	//! Order of connection, the oldest client drives the tracking.
+	guint64 serial;
+
+	//! UpMessages received from this client, tracking or not.
+	gint up_messages;
+
+	//! The loss of frames the client saw, from its last report. Locked by the registry.
+	em_proto_StreamStats stream_stats;
+	bool have_stream_stats;
+
+	//! Compact encoding the client answered with, 0 for protobuf only. Locked by the registry.
+	guint compact_version;
+	//! Time base of its compact messages, in client OpenXR time.
+	int64_t compact_epoch;
+
+	//! Who the client says it is, the same across reconnects, NULL if it did not say. Locked by the registry.
+	gchar *identity;
+
+	//! Carries the stream, only kept with --loss-protection.
+	GstWebRTCRTPTransceiver *transceiver;
+	//! Locked by the registry.
+	struct ems_loss_protection loss_protection;
+};
+
+/*!
+ * What a client that left had negotiated, so it picks up where it was if it comes back soon.
+ */
+struct ems_session
+{
+	//! Last estimate in kbit/s, seeds the estimator instead of ramping up from the shared bitrate.
+	gint bitrate_estimate;
+	gint64 left_us;
+};
+
+/*!
+ * Counters behind /metrics, bumped from the streaming threads.
+ */
+struct ems_pipeline_metrics
+{
+	guint64 frames;
+
+	//! DownMessages at the payloader by frame_sequence_id, a gap is a frame that lost its DownMessage.
+	struct em_sequence_tracker down_msgs;
+	gint64 last_down_msg_log_us;
+
+	//! Tracking UpMessages by sequence_idx, on the unordered and unreliable channel.
+	struct em_sequence_tracker poses;
+
+	guint64 tracking_msgs;
+	guint64 frame_msgs;
+	uint64_t last_tracking_ns;
+};
+
+struct ems_gstreamer_pipeline
+{
+	struct gstreamer_pipeline base;
+
+	//! EmsClientId to struct ems_client, locked by @ref clients_mutex.
+	GHashTable *clients;
+	GMutex clients_mutex;
+	guint64 next_client_serial;
+	//! The client whose poses reach the callbacks, the others only watch.
+	EmsClientId tracking_client;
+	//! Client identity to struct ems_session of the clients that left, locked by @ref clients_mutex.
+	GHashTable *sessions;
+
 	struct ems_callbacks *callbacks;
 
-	bool have_ever_sent_a_down_msg;
-	struct timespec last_print_time;
-	GSList *sent_down_msg_list;
+	//! Gets the encoder and payloader stages of each frame.
+	struct ems_telemetry *telemetry;
+
+	//! Encoder element, NULL if the compositor encodes.
+	GstElement *encoder;
+	const struct ems_encoder_descriptor *encoder_desc;
+
+	//! Packets carry TWCC sequence numbers and clients get a bandwidth estimator.
+	bool twcc;
+	//! The bitrate the shared encoder runs at in kbit/s, follows the lowest client estimate.
+	gint bitrate;
+	gint64 last_bitrate_update_us;
+	guint bitrate_src_id;
+	guint stats_src_id;
+	guint loss_src_id;
+
+	//! The frame rate the stream runs at, picked from the display rates of the clients.
+	gint framerate;
+
+	//! The payloader's own MTU, and the one it has for the frame going through it.
+	guint rtppay_mtu;
+	guint rtppay_frame_mtu;
+
+	//! Last forwarded keyframe request, the RTCP threads of all clients race for it.
+	atomic_int_least64_t last_key_unit_us;
+	//! Keyframe request for the compositor encoder, see ems_gstreamer_pipeline_take_keyframe_request.
+	gint key_unit_requested;
+
+	//! Served on the signaling server's /metrics, locked by @ref metrics_mutex.
+	struct ems_pipeline_metrics metrics;
+	GMutex metrics_mutex;
+	//! Counted for each packet, so kept out of @ref metrics and its lock.
+	atomic_uint_least64_t rtp_packets;
+	atomic_uint_least64_t rtp_bytes;
+
+	/*!
+	 * Decodes and dispatches the UpMessages off the data channel threads, NULL
+	 * if they do it themselves. Fed through @ref up_queue.
+	 */
+	GThread *up_thread;
+	gint up_thread_running;
+	struct os_semaphore up_sem;
+	struct ems_up_message_queue up_queue;
+	//! The data channels of all clients are producers, they take turns on this. The thread never takes it.
+	GMutex up_push_mutex;
+	guint64 up_dropped;
+
+	//! Records the session with --capture, NULL otherwise.
+	struct ems_capture *capture;
+
+	/*!
+	 * Plays the poses of a capture into the callbacks with --replay. The tracking client's poses and controllers
+	 * are dropped until it is done.
+	 */
+	struct
+	{
+		GThread *thread;
+		gint running;
+	} replay;
+
+	/*!
+	 * Plain RTP or SRT to one client without signaling, see --direct. It finds us by sending its UpMessages to
+	 * the socket and gets the stream back from it.
+	 */
+	struct
+	{
+		GSocket *socket;
+		//! Sends the RTP, multiudpsink or srtsink on its own branch of the tee.
+		GstElement *sink;
+		bool srt;
+
+		//! Receives the UpMessages, only it touches the fields below.
+		GThread *thread;
+		gint running;
+
+		//! Where the current client sends from, NULL without one.
+		GSocketAddress *peer;
+		struct ems_client *client;
+		gint64 last_seen_us;
+	} direct;
 };
 
 static gboolean
@@ -126,6 +345,49 @@ gst_bus_cb(GstBus *bus, GstMessage *message, gpointer user_data)
 	return TRUE;
 }
 
+static bool
+is_inside_webrtcbin(GstObject *object)
+{
+	for (GstObject *o = object; o != NULL; o = GST_OBJECT_PARENT(o)) {
+		if (g_str_has_prefix(GST_OBJECT_NAME(o), "webrtcbin_")) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*!
+ * Runs on each streaming thread as it starts, the threads of webrtcbin carry
+ * the network, every other one encodes and payloads.
+ */
+static GstBusSyncReply
+gst_bus_sync_cb(GstBus *bus, GstMessage *message, gpointer user_data)
+{
+	if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_STREAM_STATUS) {
+		return GST_BUS_PASS;
+	}
+
+	GstStreamStatusType type;
+	GstElement *owner;
+	gst_message_parse_stream_status(message, &type, &owner);
+	if (type != GST_STREAM_STATUS_TYPE_ENTER) {
+		return GST_BUS_PASS;
+	}
+
+	// Left on the normal scheduler, the recording must not compete with the stream.
+	if (g_strcmp0(GST_OBJECT_NAME(owner), SAVE_QUEUE_NAME) == 0) {
+		return GST_BUS_PASS;
+	}
+
+	bool network = is_inside_webrtcbin(GST_OBJECT(owner));
+	int ret = em_thread_sched_apply(network ? EM_THREAD_ROLE_NETWORK : EM_THREAD_ROLE_CODEC);
+	if (ret != 0) {
+		U_LOG_W("Could not schedule the streaming thread of %s: %s", GST_OBJECT_NAME(owner), strerror(ret));
+	}
+
+	return GST_BUS_PASS;
+}
+
 static GstElement *
 get_webrtcbin_for_client(GstBin *pipeline, EmsClientId client_id)
 {
@@ -202,9 +464,9 @@ webrtc_on_ice_candidate_cb(GstElement *webrtcbin, guint mlineindex, gchar *candi
 
 
 static void
-data_channel_error_cb(GstWebRTCDataChannel *datachannel, struct ems_gstreamer_pipeline *egp)
+data_channel_error_cb(GstWebRTCDataChannel *datachannel, struct ems_client *client)
 {
-	U_LOG_E("error");
+	U_LOG_E("Data channel error on client %p", client->id);
 }
 
 gboolean
@@ -220,111 +482,309 @@ datachannel_send_message(GstWebRTCDataChannel *datachannel)
 }
 
 static void
-data_channel_open_cb(GstWebRTCDataChannel *datachannel, struct ems_gstreamer_pipeline *egp)
+data_channel_open_cb(GstWebRTCDataChannel *datachannel, struct ems_client *client)
 {
-	U_LOG_I("data channel opened");
+	U_LOG_I("Data channel of client %p opened", client->id);
 
-	egp->timeout_src_id = g_timeout_add_seconds(3, G_SOURCE_FUNC(datachannel_send_message), datachannel);
+	client->timeout_src_id = g_timeout_add_seconds(3, G_SOURCE_FUNC(datachannel_send_message), datachannel);
 }
 
 static void
-data_channel_close_cb(GstWebRTCDataChannel *datachannel, struct ems_gstreamer_pipeline *egp)
+data_channel_close_cb(GstWebRTCDataChannel *datachannel, struct ems_client *client)
 {
-	U_LOG_I("data channel closed");
+	U_LOG_I("Data channel of client %p closed", client->id);
 
-	g_clear_handle_id(&egp->timeout_src_id, g_source_remove);
-	g_clear_object(&egp->data_channel);
+	g_clear_handle_id(&client->timeout_src_id, g_source_remove);
 }
 
-static void
-data_channel_message_data_cb(GstWebRTCDataChannel *datachannel, GBytes *data, struct ems_gstreamer_pipeline *egp)
+static bool
+decode_up_message(const unsigned char *buf, size_t n, guint version, int64_t epoch, em_proto_UpMessage *out_message)
 {
-	em_proto_UpMessage message = em_proto_UpMessage_init_default;
-	size_t n = 0;
+	if (em_compact_is_compact(buf, n)) {
+		if (version == 0 || !em_compact_decode_up_message(buf, n, epoch, out_message)) {
+			U_LOG_E("Error! Bad compact UpMessage of %" G_GSIZE_FORMAT " bytes, negotiated version %u.", n,
+			        version);
+			return false;
+		}
+		return true;
+	}
 
-	const unsigned char *buf = (const unsigned char *)g_bytes_get_data(data, &n);
 	pb_istream_t our_istream = pb_istream_from_buffer(buf, n);
 
-	bool result = pb_decode_ex(&our_istream, &em_proto_UpMessage_msg, &message, PB_DECODE_NULLTERMINATED);
+	bool result = pb_decode_ex(&our_istream, &em_proto_UpMessage_msg, out_message, PB_DECODE_NULLTERMINATED);
 
 	if (!result) {
 		U_LOG_E("Error! %s", PB_GET_ERROR(&our_istream));
+		return false;
+	}
+	return true;
+}
+
+/*!
+ * Takes in a decoded message of @p client_id, on its data channel's thread or the UpMessage thread.
+ */
+static void
+handle_up_message(struct ems_gstreamer_pipeline *egp, EmsClientId client_id, const em_proto_UpMessage *message)
+{
+	// Every client has a stream of its own to report on.
+	g_mutex_lock(&egp->clients_mutex);
+	struct ems_client *client = g_hash_table_lookup(egp->clients, client_id);
+	if (client != NULL && message->has_stream_stats) {
+		client->stream_stats = message->stream_stats;
+		client->have_stream_stats = true;
+	}
+	bool tracking = client != NULL && egp->tracking_client == client_id;
+	g_mutex_unlock(&egp->clients_mutex);
+
+	// There is one HMD, spectators' poses would fight over it.
+	if (!tracking) {
 		return;
 	}
-	ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_TRACKING, &message);
+
+	if (egp->capture != NULL) {
+		ems_capture_add_up_message(egp->capture, message);
+	}
+
+	g_mutex_lock(&egp->metrics_mutex);
+	if (message->has_tracking) {
+		egp->metrics.tracking_msgs++;
+		egp->metrics.last_tracking_ns = os_monotonic_get_ns();
+		em_sequence_tracker_add(&egp->metrics.poses, message->tracking.sequence_idx);
+	}
+	if (message->has_frame) {
+		egp->metrics.frame_msgs++;
+	}
+	g_mutex_unlock(&egp->metrics_mutex);
+
+	// The frame reports are of the frames streamed now, so they still count during a replay.
+	bool replaying = g_atomic_int_get(&egp->replay.running);
+	if (message->has_tracking && !replaying) {
+		ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_TRACKING, message);
+	}
+	if (message->has_frame) {
+		ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_FRAME, message);
+	}
+	if (message->has_controllers && !replaying) {
+		ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_CONTROLLER, message);
+	}
 }
 
+/*!
+ * The client times of a replayed message are in the clock of the client back then. Without them everything is
+ * placed at the time it is handed over, so of the samples of each controller only the newest is kept: they would
+ * all land on the same time otherwise.
+ */
 static void
-data_channel_message_string_cb(GstWebRTCDataChannel *datachannel, gchar *str, struct ems_gstreamer_pipeline *egp)
+replay_clear_client_times(em_proto_UpMessage *message)
 {
-	U_LOG_I("Received data channel message: %s", str);
+	message->tracking.timestamp = 0;
+
+	em_proto_ControllerMessage *cm = &message->controllers;
+	cm->input_time = 0;
+
+	// Oldest first.
+	if (cm->left_count > 0) {
+		cm->left[0] = cm->left[cm->left_count - 1];
+		cm->left[0].timestamp = 0;
+		cm->left_count = 1;
+	}
+	if (cm->right_count > 0) {
+		cm->right[0] = cm->right[cm->right_count - 1];
+		cm->right[0].timestamp = 0;
+		cm->right_count = 1;
+	}
 }
 
-static int
-compare_int_ascending(gconstpointer a, gconstpointer b)
+/*!
+ * Feeds the tracking and controllers of the UpMessages in a capture to the callbacks, spaced as they were received.
+ */
+static gpointer
+replay_thread(gpointer user_data)
 {
-	return GPOINTER_TO_INT(a) - GPOINTER_TO_INT(b);
+	struct ems_gstreamer_pipeline *egp = user_data;
+	const gchar *path = ems_arguments_get()->replay_file;
+
+	GError *error = NULL;
+	struct ems_capture_reader reader;
+	if (!ems_capture_reader_open(&reader, path, &error)) {
+		U_LOG_E("Can't replay %s: %s", path, error->message);
+		g_error_free(error);
+		g_atomic_int_set(&egp->replay.running, 0);
+		return NULL;
+	}
+
+	U_LOG_I("Replaying the poses of %s", path);
+
+	// The capture starts with the server, the first message is where the client connected.
+	bool started = false;
+	int64_t offset_ns = 0;
+	guint64 messages = 0;
+
+	struct ems_capture_record record;
+	const uint8_t *data;
+	while (g_atomic_int_get(&egp->replay.running) && ems_capture_reader_next(&reader, &record, &data)) {
+		if (record.type != EMS_CAPTURE_RECORD_UP_MESSAGE) {
+			continue;
+		}
+
+		em_proto_UpMessage message = em_proto_UpMessage_init_default;
+		pb_istream_t istream = pb_istream_from_buffer(data, record.size);
+		if (!pb_decode(&istream, em_proto_UpMessage_fields, &message)) {
+			U_LOG_W("Skipping a bad UpMessage in the capture: %s", PB_GET_ERROR(&istream));
+			continue;
+		}
+		if (!message.has_tracking && !message.has_controllers) {
+			continue;
+		}
+
+		if (!started) {
+			offset_ns = (int64_t)os_monotonic_get_ns() - record.time_ns;
+			started = true;
+		}
+
+		// In short sleeps, so stopping does not wait out a pause in the capture.
+		int64_t due_ns = offset_ns + record.time_ns;
+		int64_t now_ns;
+		while (g_atomic_int_get(&egp->replay.running) && (now_ns = (int64_t)os_monotonic_get_ns()) < due_ns) {
+			os_nanosleep(MIN(due_ns - now_ns, REPLAY_MAX_SLEEP_MS * U_TIME_1MS_IN_NS));
+		}
+
+		replay_clear_client_times(&message);
+
+		if (message.has_tracking) {
+			ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_TRACKING, &message);
+		}
+		if (message.has_controllers) {
+			ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_CONTROLLER, &message);
+		}
+		messages++;
+	}
+
+	U_LOG_I("Replayed %" G_GUINT64_FORMAT " UpMessages, the client's poses take over.", messages);
+	ems_capture_reader_close(&reader);
+	g_atomic_int_set(&egp->replay.running, 0);
+	return NULL;
 }
 
-static void
-benchmark_down_msg_loss(struct ems_gstreamer_pipeline *self, GstMapInfo *map_info)
+static gpointer
+up_message_thread(gpointer user_data)
 {
-	// DownMessages are not in order here!
-	pb_istream_t our_istream = pb_istream_from_buffer(map_info->data, map_info->size);
-	em_proto_DownMessage msg;
-	bool result = pb_decode_ex(&our_istream, em_proto_DownMessage_fields, &msg, PB_DECODE_NULLTERMINATED);
-	if (!result) {
-		U_LOG_E("Decoding protobuf failed: %s downMsg_bytes size: %ld", PB_GET_ERROR(&our_istream),
-		        map_info->size);
-	} else {
+	struct ems_gstreamer_pipeline *egp = user_data;
 
-		if (!self->have_ever_sent_a_down_msg) {
-			clock_gettime(CLOCK_MONOTONIC, &self->last_print_time);
-			self->sent_down_msg_list = NULL;
-			self->have_ever_sent_a_down_msg = true;
-		}
-
-		self->sent_down_msg_list =
-		    g_slist_prepend(self->sent_down_msg_list, GINT_TO_POINTER((gint)msg.frame_data.frame_sequence_id));
-
-		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
-
-		double duration_since_last_print_secs;
-		duration_since_last_print_secs = (double)(now.tv_sec - self->last_print_time.tv_sec);
-		duration_since_last_print_secs += (double)(now.tv_nsec - self->last_print_time.tv_nsec) / (double)1e9;
-
-		if (duration_since_last_print_secs >= 5.0) {
-
-			self->sent_down_msg_list = g_slist_sort(self->sent_down_msg_list, compare_int_ascending);
-
-			GSList *l = self->sent_down_msg_list;
-			gint last = -1;
-			gint down_msg_loss_accumulator = 0;
-			while (l != NULL) {
-				int current = GPOINTER_TO_INT(l->data);
-				if (last != -1) {
-					gint num_skipped = (current - last) - 1;
-					if (num_skipped > 0) {
-						// U_LOG_D("Skipped payloading %d DownMsgs (%d - %d)", num_skipped, last
-						// + 1, current - 1);
-						down_msg_loss_accumulator += num_skipped;
-					}
-				}
-				last = current;
-				l = l->next;
+	int sched_ret = em_thread_sched_apply(EM_THREAD_ROLE_TRACKING);
+	if (sched_ret != 0) {
+		U_LOG_W("Could not schedule the UpMessage thread: %s", strerror(sched_ret));
+	}
+
+	// Woken once per message pushed, and once more to stop.
+	while (true) {
+		os_semaphore_wait(&egp->up_sem, 0);
+		if (!g_atomic_int_get(&egp->up_thread_running)) {
+			break;
+		}
+
+		const struct ems_up_message_slot *slot;
+		while ((slot = ems_up_message_queue_peek(&egp->up_queue)) != NULL) {
+			em_proto_UpMessage message = em_proto_UpMessage_init_default;
+			bool decoded = decode_up_message(slot->data, slot->size, slot->compact_version,
+			                                 slot->compact_epoch, &message);
+			EmsClientId client_id = slot->client_id;
+			ems_up_message_queue_pop(&egp->up_queue);
+
+			if (decoded) {
+				handle_up_message(egp, client_id, &message);
 			}
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * Decodes and dispatches an UpMessage of @p client, or queues it for the UpMessage thread to.
+ */
+static void
+receive_up_message(struct ems_client *client, const unsigned char *buf, size_t n)
+{
+	struct ems_gstreamer_pipeline *egp = client->egp;
+
+	g_atomic_int_inc(&client->up_messages);
 
-			double skip_per_second = (double)down_msg_loss_accumulator / duration_since_last_print_secs;
-			U_LOG_D("Skipping DownMsgs at rate %.2f/second", skip_per_second);
-			clock_gettime(CLOCK_MONOTONIC, &self->last_print_time);
+	g_mutex_lock(&egp->clients_mutex);
+	guint version = client->compact_version;
+	int64_t epoch = client->compact_epoch;
+	g_mutex_unlock(&egp->clients_mutex);
 
-			g_slist_free(self->sent_down_msg_list);
-			self->sent_down_msg_list = NULL;
+	if (egp->up_thread != NULL) {
+		g_mutex_lock(&egp->up_push_mutex);
+		bool pushed = ems_up_message_queue_push(&egp->up_queue, client->id, version, epoch, buf, n);
+		guint64 dropped = pushed ? egp->up_dropped : ++egp->up_dropped;
+		g_mutex_unlock(&egp->up_push_mutex);
+
+		if (pushed) {
+			os_semaphore_release(&egp->up_sem);
+		} else if (dropped % 100 == 1) {
+			U_LOG_W("UpMessage thread is behind, dropped %" G_GUINT64_FORMAT " messages so far.", dropped);
 		}
+		return;
+	}
+
+	em_proto_UpMessage message = em_proto_UpMessage_init_default;
+	if (decode_up_message(buf, n, version, epoch, &message)) {
+		handle_up_message(egp, client->id, &message);
+	}
+}
+
+static void
+data_channel_message_data_cb(GstWebRTCDataChannel *datachannel, GBytes *data, struct ems_client *client)
+{
+	size_t n = 0;
+	const unsigned char *buf = (const unsigned char *)g_bytes_get_data(data, &n);
+
+	receive_up_message(client, buf, n);
+}
+
+static void
+data_channel_message_string_cb(GstWebRTCDataChannel *datachannel, gchar *str, struct ems_client *client)
+{
+	U_LOG_I("Received data channel message: %s", str);
+}
 
-		// U_LOG_I("Adding DownMsg for Frame #%ld to RTP buffer.", msg.frame_data.frame_sequence_id);
+/*!
+ * Stamps a telemetry stage for the frame of the DownMessage the buffer carries.
+ */
+static void
+stamp_buffer(struct ems_gstreamer_pipeline *self, GstBuffer *buffer, enum ems_telemetry_stage stage)
+{
+	struct ems_down_message_meta *dmm = ems_buffer_get_down_message_meta(buffer);
+	if (dmm == NULL || dmm->frame_sequence_id < 0) {
+		return;
 	}
+
+	ems_telemetry_stamp(self->telemetry, dmm->frame_sequence_id, stage, os_monotonic_get_ns());
+	EMS_TRACE_FRAME_FLOW(ems_telemetry_stage_name(stage), dmm->frame_sequence_id);
+}
+
+static GstPadProbeReturn
+encoder_sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	(void)pad;
+
+	SINK_TRACE_IDENT(encode_in);
+
+	stamp_buffer(user_data, gst_pad_probe_info_get_buffer(info), EMS_TELEMETRY_STAGE_ENCODE_IN);
+	return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+encoder_src_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	(void)pad;
+
+	SINK_TRACE_IDENT(encode_out);
+
+	stamp_buffer(user_data, gst_pad_probe_info_get_buffer(info), EMS_TELEMETRY_STAGE_ENCODE_OUT);
+	return GST_PAD_PROBE_OK;
 }
 
 GstPadProbeReturn
@@ -332,6 +792,8 @@ rtppay_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 {
 	(void)pad;
 
+	SINK_TRACE_MARKER();
+
 	GstBuffer *buffer;
 	GstRTPBuffer rtp_buffer = GST_RTP_BUFFER_INIT;
 	struct ems_gstreamer_pipeline *self = user_data;
@@ -339,6 +801,10 @@ rtppay_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 	buffer = gst_pad_probe_info_get_buffer(info);
 
 	buffer = gst_buffer_make_writable(buffer);
+	GST_PAD_PROBE_INFO_DATA(info) = buffer;
+
+	atomic_fetch_add_explicit(&self->rtp_packets, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&self->rtp_bytes, gst_buffer_get_size(buffer), memory_order_relaxed);
 
 	if (!gst_rtp_buffer_map(buffer, GST_MAP_WRITE, &rtp_buffer)) {
 		U_LOG_E("Failed to map GstBuffer");
@@ -346,58 +812,145 @@ rtppay_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 		return GST_PAD_PROBE_OK;
 	}
 
+	// The DownMessage only goes on the last packet of a frame, which is also when the client has all of it.
+	if (!gst_rtp_buffer_get_marker(&rtp_buffer)) {
+		gst_rtp_buffer_unmap(&rtp_buffer);
+		return GST_PAD_PROBE_OK;
+	}
+
 	// Inject extension data
-	GstCustomMeta *custom_meta = gst_buffer_get_custom_meta(buffer, "down-message");
-	if (!custom_meta) {
+	const struct ems_down_message_meta *dmm = ems_buffer_get_down_message_meta(buffer);
+	if (dmm == NULL) {
 		gst_rtp_buffer_unmap(&rtp_buffer);
-		// U_LOG_W("Failed to get custom meta from GstBuffer!");
 		return GST_PAD_PROBE_OK;
 	}
 
-	GstStructure *custom_structure = gst_custom_meta_get_structure(custom_meta);
+	// Split over elements with the same id, the client appends them in order. They go in the one-byte form next
+	// to the TWCC sequence number the payloader wrote, rtpsession only finds that one in this form, on both ends.
+	for (guint offset = 0; offset < dmm->size; offset += RTP_ONEBYTE_HDR_EXT_MAX_SIZE) {
+		guint element_size = MIN(dmm->size - offset, RTP_ONEBYTE_HDR_EXT_MAX_SIZE);
+		if (!gst_rtp_buffer_add_extension_onebyte_header(&rtp_buffer, RTP_DOWN_MESSAGE_HDR_EXT_ID,
+		                                                 dmm->data + offset, element_size)) {
+			U_LOG_E("Failed to add extension data !");
+			goto out;
+		}
+	}
+
+	// The bit should be written by gst_rtp_buffer_add_extension_onebyte_header
+	if (!gst_rtp_buffer_get_extension(&rtp_buffer)) {
+		U_LOG_E("The RTP extension bit was not set.");
+	}
 
-	GstBuffer *struct_buf;
-	if (!gst_structure_get(custom_structure, "protobuf", GST_TYPE_BUFFER, &struct_buf, NULL)) {
-		U_LOG_E("Could not read protobuf from struct");
-		return GST_PAD_PROBE_OK;
+	int64_t frame_sequence_id = dmm->frame_sequence_id;
+	if (frame_sequence_id >= 0) {
+		if (self->capture != NULL) {
+			ems_capture_add_down_message(self->capture, dmm->data, dmm->size);
+		}
+
+		ems_telemetry_stamp(self->telemetry, frame_sequence_id, EMS_TELEMETRY_STAGE_PAYLOAD,
+		                    os_monotonic_get_ns());
+		EMS_TRACE_FRAME_FLOW("payload", frame_sequence_id);
+
+		g_mutex_lock(&self->metrics_mutex);
+		struct ems_pipeline_metrics *m = &self->metrics;
+		m->frames++;
+		em_sequence_tracker_add(&m->down_msgs, frame_sequence_id);
+
+		gint64 now_us = g_get_monotonic_time();
+		if (ems_arguments_get()->benchmark_down_msg && now_us - m->last_down_msg_log_us >= 5 * G_USEC_PER_SEC) {
+			struct em_sequence_stats stats;
+			em_sequence_tracker_get_stats(&m->down_msgs, &stats);
+			U_LOG_D("DownMessages: %" G_GUINT64_FORMAT " sent, %" G_GUINT64_FORMAT " lost, %" G_GUINT64_FORMAT
+			        " late, longest gap %u.",
+			        stats.received, stats.lost, stats.late, stats.max_loss_burst);
+			m->last_down_msg_log_us = now_us;
+		}
+		g_mutex_unlock(&self->metrics_mutex);
 	}
 
-	GstMapInfo map_info;
-	if (!gst_buffer_map(struct_buf, &map_info, GST_MAP_READ)) {
-		U_LOG_E("Failed to map custom meta buffer.");
-		return GST_PAD_PROBE_OK;
+out:
+	gst_rtp_buffer_unmap(&rtp_buffer);
+
+	return GST_PAD_PROBE_OK;
+}
+
+/*!
+ * The DownMessage goes on top of the payload of the last packet of a frame. When that could take the packet past
+ * @ref RTP_MAX_PACKET_SIZE, the payloader packs this frame smaller by what the message adds.
+ */
+static GstPadProbeReturn
+rtppay_sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_pipeline *self = user_data;
+
+	const struct ems_down_message_meta *dmm = ems_buffer_get_down_message_meta(gst_pad_probe_info_get_buffer(info));
+
+	guint mtu = self->rtppay_mtu;
+	if (dmm != NULL && mtu + RTP_DOWN_MESSAGE_EXT_SIZE(dmm->size) > RTP_MAX_PACKET_SIZE) {
+		mtu = RTP_MAX_PACKET_SIZE - RTP_DOWN_MESSAGE_EXT_SIZE(dmm->size);
 	}
 
-	if (map_info.size > RTP_TWOBYTES_HDR_EXT_MAX_SIZE) {
-		U_LOG_E("Data in too large for RTP header (%ld > %d bytes). Implement multi-extension-element support.",
-		        map_info.size, RTP_TWOBYTES_HDR_EXT_MAX_SIZE);
-		gst_rtp_buffer_unmap(&rtp_buffer);
-		return GST_PAD_PROBE_OK;
+	// Same thread as the payloader, which reads it for each packet of the buffer.
+	if (mtu != self->rtppay_frame_mtu) {
+		g_object_set(GST_PAD_PARENT(pad), "mtu", mtu, NULL);
+		self->rtppay_frame_mtu = mtu;
 	}
 
-	if (!gst_rtp_buffer_add_extension_twobytes_header(&rtp_buffer, 0 /* appbits */, RTP_TWOBYTES_HDR_EXT_ID,
-	                                                  map_info.data, (guint)map_info.size)) {
-		U_LOG_E("Failed to add extension data !");
+	return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+force_key_unit_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	(void)pad;
+
+	struct ems_gstreamer_pipeline *egp = user_data;
+	GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+
+	if (!gst_video_event_is_force_key_unit(event)) {
 		return GST_PAD_PROBE_OK;
 	}
 
-	// The bit should be written by gst_rtp_buffer_add_extension_twobytes_header
-	if (!gst_rtp_buffer_get_extension(&rtp_buffer)) {
-		U_LOG_E("The RTP extension bit was not set.");
+	// A lost packet makes every client ask, often more than once.
+	gint64 now_us = g_get_monotonic_time();
+	int_least64_t last_us = atomic_load(&egp->last_key_unit_us);
+	if (now_us - last_us < KEY_UNIT_MIN_INTERVAL_MS * 1000 ||
+	    !atomic_compare_exchange_strong(&egp->last_key_unit_us, &last_us, now_us)) {
+		U_LOG_D("Dropping keyframe request, one was just sent.");
+		return GST_PAD_PROBE_DROP;
 	}
 
-	if (ems_arguments_get()->benchmark_down_msg) {
-		benchmark_down_msg_loss(self, &map_info);
-	}
+	U_LOG_I("Client requested a keyframe.");
 
-	gst_rtp_buffer_unmap(&rtp_buffer);
-	gst_buffer_unmap(struct_buf, &map_info);
+	// Nothing upstream encodes, the compositor does.
+	if (egp->encoder == NULL) {
+		g_atomic_int_set(&egp->key_unit_requested, 1);
+		return GST_PAD_PROBE_DROP;
+	}
 
 	return GST_PAD_PROBE_OK;
 }
 
+/*!
+ * Ask for a keyframe with its parameter sets now, past the rate limit of the client requests: a client that
+ * just connected has nothing to decode until it gets one.
+ */
+static void
+request_join_keyframe(struct ems_gstreamer_pipeline *egp)
+{
+	if (egp->encoder == NULL) {
+		g_atomic_int_set(&egp->key_unit_requested, 1);
+		return;
+	}
+
+	// Straight into the encoder, the probe on the payloader only sees what comes from the clients.
+	GstPad *encoder_src = gst_element_get_static_pad(egp->encoder, "src");
+	gst_pad_send_event(encoder_src, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+	gst_object_unref(encoder_src);
+}
+
 static bool
-ems_gstreamer_pipeline_add_payload_pad_probe(struct ems_gstreamer_pipeline *self, GstElement *webrtcbin)
+ems_gstreamer_pipeline_add_payload_pad_probe(struct ems_gstreamer_pipeline *self)
 {
 	GstPipeline *pipeline = GST_PIPELINE(self->base.pipeline);
 
@@ -408,13 +961,12 @@ ems_gstreamer_pipeline_add_payload_pad_probe(struct ems_gstreamer_pipeline *self
 	}
 
 	GstPad *pad = gst_element_get_static_pad(rtppay, "src");
+	gst_object_unref(rtppay);
 	if (pad == NULL) {
 		U_LOG_E("Could not find static src pad in rtppay.");
 		return false;
 	}
 
-	self->have_ever_sent_a_down_msg = false;
-
 	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, rtppay_probe, self, NULL);
 	gst_object_unref(pad);
 
@@ -423,21 +975,247 @@ ems_gstreamer_pipeline_add_payload_pad_probe(struct ems_gstreamer_pipeline *self
 
 
 static void
-webrtc_client_connected_cb(EmsSignalingServer *server, EmsClientId client_id, struct ems_gstreamer_pipeline *egp)
+bwe_estimated_bitrate_cb(GstElement *bwe, GParamSpec *pspec, struct ems_client *client)
 {
-	GstBin *pipeline = GST_BIN(egp->base.pipeline);
-	gchar *name;
-	GstElement *webrtcbin;
-	GstCaps *caps;
-	GstStateChangeReturn ret;
-	GstWebRTCRTPTransceiver *transceiver;
+	(void)pspec;
 
-	name = g_strdup_printf("webrtcbin_%p", client_id);
+	guint estimate = 0;
+	g_object_get(bwe, "estimated-bitrate", &estimate, NULL);
+	g_atomic_int_set(&client->bitrate_estimate, (gint)(estimate / 1000));
+}
 
-	webrtcbin = gst_element_factory_make("webrtcbin", name);
-	g_object_set(webrtcbin, "bundle-policy", GST_WEBRTC_BUNDLE_POLICY_MAX_BUNDLE, NULL);
-	g_object_set_data(G_OBJECT(webrtcbin), "client_id", client_id);
-	gst_bin_add(pipeline, webrtcbin);
+static GstElement *
+webrtc_request_aux_sender_cb(GstElement *webrtcbin, GObject *dtls_transport, struct ems_client *client)
+{
+	(void)webrtcbin;
+	(void)dtls_transport;
+
+	struct ems_gstreamer_pipeline *egp = client->egp;
+	struct ems_arguments *args = ems_arguments_get();
+
+	GstElement *bwe = gst_element_factory_make("rtpgccbwe", NULL);
+	if (bwe == NULL) {
+		U_LOG_W("Could not create rtpgccbwe, streaming at a fixed bitrate.");
+		return NULL;
+	}
+
+	g_object_set(bwe,                                                                //
+	             "min-bitrate", args->bitrate_min * 1000,                            //
+	             "max-bitrate", args->bitrate_max * 1000,                            //
+	             "estimated-bitrate", (guint)g_atomic_int_get(&egp->bitrate) * 1000, //
+	             NULL);
+	ems_client_connect(bwe, "notify::estimated-bitrate", G_CALLBACK(bwe_estimated_bitrate_cb), client);
+
+	gst_object_replace((GstObject **)&client->bwe, GST_OBJECT(bwe));
+	g_atomic_int_set(&client->bitrate_estimate, 0);
+
+	return bwe;
+}
+
+static struct ems_client *
+ems_client_new(EmsClientId id, struct ems_gstreamer_pipeline *egp)
+{
+	struct ems_client *client = g_new0(struct ems_client, 1);
+	client->refcount = 1;
+	client->id = id;
+	client->egp = egp;
+	return client;
+}
+
+static struct ems_client *
+ems_client_ref(struct ems_client *client)
+{
+	g_atomic_int_inc(&client->refcount);
+	return client;
+}
+
+static void
+ems_client_unref(struct ems_client *client)
+{
+	if (!g_atomic_int_dec_and_test(&client->refcount)) {
+		return;
+	}
+
+	gst_clear_object(&client->bwe);
+	g_clear_object(&client->data_channel);
+	g_clear_object(&client->tracking_channel);
+	gst_clear_object(&client->transceiver);
+	g_free(client->identity);
+	g_free(client);
+}
+
+static void
+ems_client_closure_notify(gpointer data, GClosure *closure)
+{
+	(void)closure;
+
+	ems_client_unref(data);
+}
+
+/*!
+ * Connect a handler taking @p client as its user data. GLib drops the handler's reference once it is disconnected
+ * and no emission is running it any more.
+ */
+static void
+ems_client_connect(gpointer instance, const gchar *signal, GCallback handler, struct ems_client *client)
+{
+	g_signal_connect_data(instance, signal, handler, ems_client_ref(client), ems_client_closure_notify, 0);
+}
+
+/*!
+ * Drops the client's signal handlers and the registry's reference, the
+ * webrtcbin is removed from the pipeline separately. Called with the registry
+ * locked.
+ */
+static void
+ems_client_release(struct ems_client *client)
+{
+	if (client->bwe != NULL) {
+		g_signal_handlers_disconnect_by_data(client->bwe, client);
+	}
+
+	if (client->data_channel != NULL) {
+		g_signal_handlers_disconnect_by_data(client->data_channel, client);
+	}
+
+	if (client->tracking_channel != NULL) {
+		g_signal_handlers_disconnect_by_data(client->tracking_channel, client);
+	}
+
+	if (client->webrtcbin != NULL) {
+		g_signal_handlers_disconnect_by_data(client->webrtcbin, client);
+	}
+	g_clear_handle_id(&client->timeout_src_id, g_source_remove);
+
+	ems_client_unref(client);
+}
+
+//! The oldest remaining client, NULL if there is none. Called with the registry locked.
+static EmsClientId
+find_oldest_client(struct ems_gstreamer_pipeline *egp)
+{
+	GHashTableIter iter;
+	gpointer value;
+	struct ems_client *oldest = NULL;
+
+	g_hash_table_iter_init(&iter, egp->clients);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct ems_client *client = value;
+		if (oldest == NULL || client->serial < oldest->serial) {
+			oldest = client;
+		}
+	}
+
+	return oldest != NULL ? oldest->id : NULL;
+}
+
+static void
+webrtc_connection_state_cb(GstElement *webrtcbin, GParamSpec *pspec, struct ems_client *client)
+{
+	(void)pspec;
+
+	GstWebRTCPeerConnectionState state;
+	g_object_get(webrtcbin, "connection-state", &state, NULL);
+	if (state != GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED) {
+		return;
+	}
+
+	// Anything sent before this was lost on the way to the client.
+	U_LOG_I("Client %p is connected, sending a keyframe.", client->id);
+	request_join_keyframe(client->egp);
+}
+
+//! Forget the sessions of the clients that stayed away too long. Called with the registry locked.
+static void
+prune_sessions(struct ems_gstreamer_pipeline *egp, gint64 now_us)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init(&iter, egp->sessions);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct ems_session *session = value;
+		if (now_us - session->left_us > SESSION_CACHE_TTL_S * G_USEC_PER_SEC) {
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+}
+
+//! Keep what @p client negotiated for when it comes back. Called with the registry locked.
+static void
+save_session(struct ems_gstreamer_pipeline *egp, struct ems_client *client)
+{
+	gint64 now_us = g_get_monotonic_time();
+	prune_sessions(egp, now_us);
+
+	if (client->identity == NULL) {
+		return;
+	}
+
+	struct ems_session *session = g_new0(struct ems_session, 1);
+	session->bitrate_estimate = g_atomic_int_get(&client->bitrate_estimate);
+	session->left_us = now_us;
+	g_hash_table_replace(egp->sessions, g_strdup(client->identity), session);
+}
+
+//! Add @p client to the registry, it tracks if nobody else does.
+static void
+register_client(struct ems_gstreamer_pipeline *egp, struct ems_client *client)
+{
+	g_mutex_lock(&egp->clients_mutex);
+	client->serial = egp->next_client_serial++;
+	g_hash_table_insert(egp->clients, client->id, client);
+	if (egp->tracking_client == NULL) {
+		egp->tracking_client = client->id;
+	}
+	U_LOG_I("Client %p connected, %u connected, %p is tracking.", client->id, g_hash_table_size(egp->clients),
+	        egp->tracking_client);
+	g_mutex_unlock(&egp->clients_mutex);
+}
+
+//! Remove and free the client of @p client_id, keeping its session, the oldest one left takes over the tracking.
+static void
+unregister_client(struct ems_gstreamer_pipeline *egp, EmsClientId client_id)
+{
+	g_mutex_lock(&egp->clients_mutex);
+	struct ems_client *client = g_hash_table_lookup(egp->clients, client_id);
+	if (client != NULL) {
+		save_session(egp, client);
+	}
+	g_hash_table_remove(egp->clients, client_id);
+	if (egp->tracking_client == client_id) {
+		egp->tracking_client = find_oldest_client(egp);
+		if (egp->tracking_client != NULL) {
+			U_LOG_I("Tracking client left, %p takes over.", egp->tracking_client);
+		}
+	}
+	U_LOG_I("Client %p disconnected, %u connected.", client_id, g_hash_table_size(egp->clients));
+	g_mutex_unlock(&egp->clients_mutex);
+}
+
+static void
+webrtc_client_connected_cb(EmsSignalingServer *server, EmsClientId client_id, struct ems_gstreamer_pipeline *egp)
+{
+	GstBin *pipeline = GST_BIN(egp->base.pipeline);
+	gchar *name;
+	GstElement *webrtcbin;
+	GstCaps *caps;
+	GstStateChangeReturn ret;
+	GstWebRTCRTPTransceiver *transceiver;
+
+	name = g_strdup_printf("webrtcbin_%p", client_id);
+
+	webrtcbin = gst_element_factory_make("webrtcbin", name);
+	g_object_set(webrtcbin, "bundle-policy", GST_WEBRTC_BUNDLE_POLICY_MAX_BUNDLE, NULL);
+	g_object_set_data(G_OBJECT(webrtcbin), "client_id", client_id);
+
+	struct ems_client *client = ems_client_new(client_id, egp);
+	client->webrtcbin = webrtcbin;
+
+	if (egp->twcc) {
+		ems_client_connect(webrtcbin, "request-aux-sender", G_CALLBACK(webrtc_request_aux_sender_cb), client);
+	}
+	gst_bin_add(pipeline, webrtcbin);
 
 	ret = gst_element_set_state(webrtcbin, GST_STATE_READY);
 	g_assert(ret != GST_STATE_CHANGE_FAILURE);
@@ -448,36 +1226,79 @@ webrtc_client_connected_cb(EmsSignalingServer *server, EmsClientId client_id, st
 
 	// TODO add priority
 	GstStructure *data_channel_options = gst_structure_new_from_string("data-channel-options, ordered=true");
-	g_signal_emit_by_name(webrtcbin, "create-data-channel", "channel", data_channel_options, &egp->data_channel);
+	g_signal_emit_by_name(webrtcbin, "create-data-channel", "channel", data_channel_options, &client->data_channel);
 	gst_clear_structure(&data_channel_options);
 
-	if (!egp->data_channel) {
+	if (!client->data_channel) {
 		U_LOG_E("Couldn't make datachannel!");
 		assert(false);
 	} else {
 		U_LOG_I("Successfully created datachannel!");
 
-		g_signal_connect(egp->data_channel, "on-open", G_CALLBACK(data_channel_open_cb), egp);
-		g_signal_connect(egp->data_channel, "on-close", G_CALLBACK(data_channel_close_cb), egp);
-		g_signal_connect(egp->data_channel, "on-error", G_CALLBACK(data_channel_error_cb), egp);
-		g_signal_connect(egp->data_channel, "on-message-data", G_CALLBACK(data_channel_message_data_cb), egp);
-		// g_signal_connect(egp->data_channel, "on-message-string", G_CALLBACK(data_channel_message_string_cb),
-		//                  egp);
+		ems_client_connect(client->data_channel, "on-open", G_CALLBACK(data_channel_open_cb), client);
+		ems_client_connect(client->data_channel, "on-close", G_CALLBACK(data_channel_close_cb), client);
+		ems_client_connect(client->data_channel, "on-error", G_CALLBACK(data_channel_error_cb), client);
+		ems_client_connect(client->data_channel, "on-message-data", G_CALLBACK(data_channel_message_data_cb),
+		                   client);
+		// g_signal_connect(client->data_channel, "on-message-string",
+		//                  G_CALLBACK(data_channel_message_string_cb), client);
+	}
+
+	// A lost pose should not hold back the newer ones, the HMD drops the ones arriving late.
+	GstStructure *tracking_channel_options =
+	    gst_structure_new_from_string("data-channel-options, ordered=false, max-retransmits=0");
+	g_signal_emit_by_name(webrtcbin, "create-data-channel", TRACKING_DATA_CHANNEL_LABEL, tracking_channel_options,
+	                      &client->tracking_channel);
+	gst_clear_structure(&tracking_channel_options);
+
+	if (!client->tracking_channel) {
+		U_LOG_W("Couldn't make the tracking datachannel, tracking goes over the reliable one.");
+	} else {
+		ems_client_connect(client->tracking_channel, "on-error", G_CALLBACK(data_channel_error_cb), client);
+		ems_client_connect(client->tracking_channel, "on-message-data",
+		                   G_CALLBACK(data_channel_message_data_cb), client);
 	}
 
+	register_client(egp, client);
+
 	ret = gst_element_set_state(webrtcbin, GST_STATE_PLAYING);
 	g_assert(ret != GST_STATE_CHANGE_FAILURE);
 
 	g_signal_connect(webrtcbin, "on-ice-candidate", G_CALLBACK(webrtc_on_ice_candidate_cb), NULL);
-
-	caps = gst_caps_from_string(
-	    "application/x-rtp, "
-	    "payload=96,encoding-name=H264,clock-rate=90000,media=video,packetization-mode=(string)1,profile-level-id=("
-	    "string)42e01f");
+	ems_client_connect(webrtcbin, "notify::connection-state", G_CALLBACK(webrtc_connection_state_cb), client);
+
+	caps = gst_caps_from_string(ems_encoder_get_codec(egp->encoder_desc)->rtp_caps);
+
+	// Clients ask for keyframes with PLI or FIR, they arrive as upstream GstForceKeyUnit.
+	gst_caps_set_simple(caps,                                     //
+	                    "rtcp-fb-nack-pli", G_TYPE_BOOLEAN, TRUE, //
+	                    "rtcp-fb-ccm-fir", G_TYPE_BOOLEAN, TRUE,  //
+	                    NULL);
+	if (egp->twcc) {
+		gchar *extmap = g_strdup_printf("extmap-%d", RTP_TWCC_HDR_EXT_ID);
+		gst_caps_set_simple(caps,                                         //
+		                    "rtcp-fb-transport-cc", G_TYPE_BOOLEAN, TRUE, //
+		                    extmap, G_TYPE_STRING, RTP_TWCC_URI,          //
+		                    NULL);
+		g_free(extmap);
+	}
 	g_signal_emit_by_name(webrtcbin, "add-transceiver", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDONLY, caps,
 	                      &transceiver);
 
 	gst_caps_unref(caps);
+
+	// Both have to be in the offer, the FEC starts at nothing until the reports show loss.
+	if (ems_arguments_get()->loss_protection && transceiver != NULL) {
+		g_object_set(transceiver,                             //
+		             "do-nack", TRUE,                         //
+		             "fec-type", GST_WEBRTC_FEC_TYPE_ULP_RED, //
+		             "fec-percentage", 0,                     //
+		             NULL);
+		g_mutex_lock(&egp->clients_mutex);
+		client->transceiver = gst_object_ref(transceiver);
+		ems_loss_protection_init(&client->loss_protection);
+		g_mutex_unlock(&egp->clients_mutex);
+	}
 	gst_clear_object(&transceiver);
 
 	g_signal_emit_by_name(
@@ -486,10 +1307,6 @@ webrtc_client_connected_cb(EmsSignalingServer *server, EmsClientId client_id, st
 
 	GST_DEBUG_BIN_TO_DOT_FILE(pipeline, GST_DEBUG_GRAPH_SHOW_ALL, "pipeline-client-connected");
 
-	if (!ems_gstreamer_pipeline_add_payload_pad_probe(egp, webrtcbin)) {
-		U_LOG_E("Failed to add payload pad probe.");
-	}
-
 	g_free(name);
 }
 
@@ -533,6 +1350,127 @@ out:
 	g_clear_pointer(&desc, gst_webrtc_session_description_free);
 }
 
+static void
+webrtc_compact_format_cb(EmsSignalingServer *server,
+                         EmsClientId client_id,
+                         guint version,
+                         gint64 epoch,
+                         struct ems_gstreamer_pipeline *egp)
+{
+	if (version == 0 || version > EM_COMPACT_VERSION) {
+		U_LOG_W("Client %p answered with compact version %u, we read up to %d.", client_id, version,
+		        EM_COMPACT_VERSION);
+		return;
+	}
+
+	g_mutex_lock(&egp->clients_mutex);
+	struct ems_client *client = g_hash_table_lookup(egp->clients, client_id);
+	if (client != NULL) {
+		client->compact_version = version;
+		client->compact_epoch = epoch;
+		U_LOG_I("Client %p sends compact UpMessages, version %u.", client_id, version);
+	}
+	g_mutex_unlock(&egp->clients_mutex);
+}
+
+static void
+webrtc_refresh_rates_cb(EmsSignalingServer *server,
+                        EmsClientId client_id,
+                        GArray *rates,
+                        struct ems_gstreamer_pipeline *egp)
+{
+	if (rates->len == 0) {
+		return;
+	}
+
+	g_mutex_lock(&egp->clients_mutex);
+	if (g_hash_table_lookup(egp->clients, client_id) == NULL) {
+		g_mutex_unlock(&egp->clients_mutex);
+		return;
+	}
+
+	// All clients watch the same stream. While others do, a newcomer gets the rate they already run at.
+	gint current = g_atomic_int_get(&egp->framerate);
+	gfloat best = (gfloat)current;
+	if (g_hash_table_size(egp->clients) == 1) {
+		gfloat wanted = (gfloat)ems_arguments_get()->framerate;
+		best = g_array_index(rates, gfloat, 0);
+		for (guint i = 1; i < rates->len; i++) {
+			gfloat rate = g_array_index(rates, gfloat, i);
+			if (fabsf(rate - wanted) < fabsf(best - wanted)) {
+				best = rate;
+			}
+		}
+	}
+
+	// The compositor picks it up from ems_gstreamer_pipeline_get_framerate.
+	GList *recipients = g_list_prepend(NULL, client_id);
+	gint framerate = MAX((gint)roundf(best), 1);
+	if (framerate != current) {
+		U_LOG_I("Client %p displays at %.2f Hz, streaming at %d fps instead of %d.", client_id, best, framerate,
+		        current);
+		g_atomic_int_set(&egp->framerate, framerate);
+
+		// Everybody else gets told too, the direct clients have no signaling to tell them through.
+		GHashTableIter iter;
+		gpointer key;
+		gpointer value;
+		g_hash_table_iter_init(&iter, egp->clients);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			struct ems_client *client = value;
+			if (key != client_id && client->transceiver != NULL) {
+				recipients = g_list_prepend(recipients, key);
+			}
+		}
+	}
+	g_mutex_unlock(&egp->clients_mutex);
+
+	for (GList *l = recipients; l != NULL; l = l->next) {
+		ems_signaling_server_send_refresh_rate(server, l->data, best);
+	}
+	g_list_free(recipients);
+}
+
+static void
+webrtc_client_identity_cb(EmsSignalingServer *server,
+                          EmsClientId client_id,
+                          const gchar *identity,
+                          struct ems_gstreamer_pipeline *egp)
+{
+	if (identity == NULL || identity[0] == '\0') {
+		return;
+	}
+
+	GstElement *bwe = NULL;
+	gint bitrate_estimate = 0;
+
+	g_mutex_lock(&egp->clients_mutex);
+	struct ems_client *client = g_hash_table_lookup(egp->clients, client_id);
+	if (client != NULL) {
+		g_free(client->identity);
+		client->identity = g_strdup(identity);
+
+		struct ems_session *session = g_hash_table_lookup(egp->sessions, identity);
+		if (session != NULL) {
+			U_LOG_I("Client %p resumes the session of %s, estimated at %d kbit/s.", client_id, identity,
+			        session->bitrate_estimate);
+			bitrate_estimate = session->bitrate_estimate;
+			g_hash_table_remove(egp->sessions, identity);
+		}
+		if (bitrate_estimate > 0 && client->bwe != NULL) {
+			bwe = gst_object_ref(client->bwe);
+			g_atomic_int_set(&client->bitrate_estimate, bitrate_estimate);
+		}
+	}
+	g_mutex_unlock(&egp->clients_mutex);
+
+	// Comes with the answer, before the first feedback reaches the estimator.
+	if (bwe != NULL) {
+		g_object_set(bwe, "estimated-bitrate", (guint)bitrate_estimate * 1000, NULL);
+		gst_object_unref(bwe);
+	}
+}
+
 static void
 webrtc_candidate_cb(EmsSignalingServer *server,
                     EmsClientId client_id,
@@ -574,6 +1512,8 @@ webrtc_client_disconnected_cb(EmsSignalingServer *server, EmsClientId client_id,
 
 	webrtcbin = get_webrtcbin_for_client(pipeline, client_id);
 
+	unregister_client(egp, client_id);
+
 	if (webrtcbin) {
 		GstPad *sinkpad;
 
@@ -647,23 +1587,731 @@ src_event_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 	return GST_PAD_PROBE_DROP;
 }
 
+static gboolean
+update_bitrate(gpointer user_data)
+{
+	struct ems_gstreamer_pipeline *egp = user_data;
+	struct ems_arguments *args = ems_arguments_get();
+
+	gint64 now_us = g_get_monotonic_time();
+	double dt_s = (double)(now_us - egp->last_bitrate_update_us) / G_USEC_PER_SEC;
+	egp->last_bitrate_update_us = now_us;
+
+	// All clients share the encoder, the slowest one sets the pace.
+	gint estimate = 0;
+	GHashTableIter iter;
+	gpointer value;
+	g_mutex_lock(&egp->clients_mutex);
+	g_hash_table_iter_init(&iter, egp->clients);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		gint client_estimate = g_atomic_int_get(&((struct ems_client *)value)->bitrate_estimate);
+		if (client_estimate > 0 && (estimate == 0 || client_estimate < estimate)) {
+			estimate = client_estimate;
+		}
+	}
+	g_mutex_unlock(&egp->clients_mutex);
+
+	// No feedback yet, stay where we are.
+	if (estimate <= 0) {
+		return G_SOURCE_CONTINUE;
+	}
+
+	gint current = g_atomic_int_get(&egp->bitrate);
+	gint target = CLAMP(estimate, (gint)args->bitrate_min, (gint)args->bitrate_max);
+	gint max_up = MAX((gint)(args->bitrate_ramp_up * dt_s), 1);
+	gint max_down = MAX((gint)(args->bitrate_ramp_down * dt_s), 1);
+	gint next = CLAMP(target, current - max_down, current + max_up);
+
+	if (next == current) {
+		return G_SOURCE_CONTINUE;
+	}
+
+	g_atomic_int_set(&egp->bitrate, next);
+
+	// The compositor encoder picks it up from ems_gstreamer_pipeline_get_bitrate.
+	if (egp->encoder != NULL) {
+		g_object_set(egp->encoder, egp->encoder_desc->bitrate_property, (guint)next, NULL);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
 static gboolean
 print_stats(gpointer user_data)
 {
-	GstElement *src = user_data;
-	GstStructure *s;
-	char *str;
+	struct ems_gstreamer_pipeline *egp = user_data;
+
+	gint current = g_atomic_int_get(&egp->bitrate);
+	GHashTableIter iter;
+	gpointer value;
+
+	g_mutex_lock(&egp->clients_mutex);
+
+	if (g_hash_table_size(egp->clients) == 0) {
+		U_LOG_I("Bitrate: %d kbit/s, no clients.", current);
+	}
+
+	g_hash_table_iter_init(&iter, egp->clients);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct ems_client *client = value;
+
+		if (client->bwe == NULL) {
+			U_LOG_I("Bitrate: %d kbit/s, client %p has no estimator.", current, client->id);
+			continue;
+		}
+
+		guint estimate = 0;
+		guint min = 0;
+		guint max = 0;
+		g_object_get(client->bwe,                   //
+		             "estimated-bitrate", &estimate, //
+		             "min-bitrate", &min,            //
+		             "max-bitrate", &max,            //
+		             NULL);
+
+		gint target = (gint)(estimate / 1000);
+		const char *state = target > current ? "ramping up" : target < current ? "ramping down" : "steady";
+
+		U_LOG_I("Bitrate: %d kbit/s, client %p estimate %d kbit/s (%u - %u), %s.", current, client->id, target,
+		        min / 1000, max / 1000, state);
+	}
+
+	g_mutex_unlock(&egp->clients_mutex);
+
+	return G_SOURCE_CONTINUE;
+}
+
+/*!
+ * The receiver report of one client, from the promise of its get-stats to the main loop.
+ */
+struct loss_report
+{
+	struct ems_gstreamer_pipeline *egp;
+	EmsClientId client_id;
+
+	bool found;
+	double fraction_lost;
+	double rtt_ms;
+};
+
+static gboolean
+find_remote_inbound_stats(GQuark field_id, const GValue *value, gpointer user_data)
+{
+	struct loss_report *report = user_data;
+	(void)field_id;
+
+	if (!GST_VALUE_HOLDS_STRUCTURE(value)) {
+		return TRUE;
+	}
+
+	const GstStructure *stats = gst_value_get_structure(value);
+	GstWebRTCStatsType type;
+	if (!gst_structure_get(stats, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL) ||
+	    type != GST_WEBRTC_STATS_REMOTE_INBOUND_RTP) {
+		return TRUE;
+	}
+
+	// The retransmission stream gets a report of its own, the worse one counts.
+	gdouble fraction_lost = 0.0;
+	if (gst_structure_get_double(stats, "fraction-lost", &fraction_lost)) {
+		report->fraction_lost = report->found ? MAX(report->fraction_lost, fraction_lost) : fraction_lost;
+		report->found = true;
+	}
+	gdouble rtt_s = 0.0;
+	if (gst_structure_get_double(stats, "round-trip-time", &rtt_s)) {
+		report->rtt_ms = MAX(report->rtt_ms, rtt_s * 1000.0);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+apply_loss_report(gpointer user_data)
+{
+	struct loss_report *report = user_data;
+	struct ems_gstreamer_pipeline *egp = report->egp;
+
+	double frame_interval_ms = 1000.0 / MAX(g_atomic_int_get(&egp->framerate), 1);
+
+	bool changed = false;
+	uint32_t latency_ms = 0;
+
+	g_mutex_lock(&egp->clients_mutex);
+	struct ems_client *client = g_hash_table_lookup(egp->clients, report->client_id);
+	if (client != NULL && client->transceiver != NULL) {
+		struct ems_loss_protection *lp = &client->loss_protection;
+		changed = ems_loss_protection_update(lp, report->fraction_lost, report->rtt_ms, frame_interval_ms);
+		if (changed) {
+			g_object_set(client->transceiver, "fec-percentage", lp->fec_percentage, NULL);
+		}
+		latency_ms = lp->latency_ms;
+	}
+	g_mutex_unlock(&egp->clients_mutex);
+
+	// Holding packets back is up to the client, it waits long enough for what we send to recover them.
+	if (changed) {
+		ems_signaling_server_send_loss_protection(signaling_server, report->client_id, latency_ms);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+on_loss_stats(GstPromise *promise, gpointer user_data)
+{
+	struct loss_report *report = user_data;
+
+	if (gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED) {
+		const GstStructure *reply = gst_promise_get_reply(promise);
+		if (reply != NULL) {
+			gst_structure_foreach(reply, find_remote_inbound_stats, report);
+		}
+	}
+	gst_promise_unref(promise);
+
+	if (!report->found) {
+		g_free(report);
+		return;
+	}
+
+	// This is webrtcbin's thread, the transceiver is better changed from ours.
+	g_idle_add_full(G_PRIORITY_DEFAULT, apply_loss_report, report, g_free);
+}
+
+static gboolean
+update_loss_protection(gpointer user_data)
+{
+	struct ems_gstreamer_pipeline *egp = user_data;
+
+	GPtrArray *webrtcbins = g_ptr_array_new_with_free_func(gst_object_unref);
+	GHashTableIter iter;
+	gpointer value;
+	g_mutex_lock(&egp->clients_mutex);
+	g_hash_table_iter_init(&iter, egp->clients);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct ems_client *client = value;
+		if (client->webrtcbin != NULL && client->transceiver != NULL) {
+			g_ptr_array_add(webrtcbins, gst_object_ref(client->webrtcbin));
+		}
+	}
+	g_mutex_unlock(&egp->clients_mutex);
+
+	for (guint i = 0; i < webrtcbins->len; i++) {
+		GstElement *webrtcbin = g_ptr_array_index(webrtcbins, i);
 
-	g_object_get(src, "stats", &s, NULL);
-	str = gst_structure_to_string(s);
-	// g_debug ("%s", str);
-	g_free(str);
-	gst_structure_free(s);
+		struct loss_report *report = g_new0(struct loss_report, 1);
+		report->egp = egp;
+		report->client_id = g_object_get_data(G_OBJECT(webrtcbin), "client_id");
+
+		GstPromise *promise = gst_promise_new_with_change_func(on_loss_stats, report, NULL);
+		g_signal_emit_by_name(webrtcbin, "get-stats", NULL, promise);
+	}
+
+	g_ptr_array_unref(webrtcbins);
 
 	return G_SOURCE_CONTINUE;
 }
 
 
+/*
+ *
+ * Metrics functions.
+ *
+ */
+
+static void
+metrics_describe(GString *out, const char *name, const char *type, const char *help)
+{
+	g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+//! Families of the queue levels, in the order of @ref level_families.
+enum metrics_level
+{
+	METRICS_LEVEL_BUFFERS,
+	METRICS_LEVEL_BYTES,
+	METRICS_LEVEL_SECONDS,
+};
+
+static const struct
+{
+	const char *name;
+	const char *help;
+} level_families[] = {
+    [METRICS_LEVEL_BUFFERS] = {"ems_element_level_buffers", "Buffers queued in the element."},
+    [METRICS_LEVEL_BYTES] = {"ems_element_level_bytes", "Bytes queued in the element."},
+    [METRICS_LEVEL_SECONDS] = {"ems_element_level_seconds", "Time queued in the element."},
+};
+
+struct metrics_level_context
+{
+	GString *out;
+	enum metrics_level level;
+};
+
+static void
+metrics_append_element_level(const GValue *item, gpointer user_data)
+{
+	struct metrics_level_context *ctx = user_data;
+	GstElement *element = g_value_get_object(item);
+	GstElementFactory *factory = gst_element_get_factory(element);
+	if (factory == NULL) {
+		return;
+	}
+
+	const gchar *factory_name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory));
+	const char *family = level_families[ctx->level].name;
+	gchar *name = gst_element_get_name(element);
+
+	if (g_strcmp0(factory_name, "queue") == 0) {
+		guint buffers = 0;
+		guint bytes = 0;
+		guint64 time_ns = 0;
+		g_object_get(element,                           //
+		             "current-level-buffers", &buffers, //
+		             "current-level-bytes", &bytes,     //
+		             "current-level-time", &time_ns,    //
+		             NULL);
+		switch (ctx->level) {
+		case METRICS_LEVEL_BUFFERS:
+			g_string_append_printf(ctx->out, "%s{element=\"%s\"} %u\n", family, name, buffers);
+			break;
+		case METRICS_LEVEL_BYTES:
+			g_string_append_printf(ctx->out, "%s{element=\"%s\"} %u\n", family, name, bytes);
+			break;
+		case METRICS_LEVEL_SECONDS:
+			g_string_append_printf(ctx->out, "%s{element=\"%s\"} %f\n", family, name,
+			                       (double)time_ns / GST_SECOND);
+			break;
+		}
+	} else if (g_strcmp0(factory_name, "appsrc") == 0 && ctx->level == METRICS_LEVEL_BYTES) {
+		guint64 bytes = 0;
+		g_object_get(element, "current-level-bytes", &bytes, NULL);
+		g_string_append_printf(ctx->out, "%s{element=\"%s\"} %" G_GUINT64_FORMAT "\n", family, name, bytes);
+	}
+
+	g_free(name);
+}
+
+//! Series of a sequence tracked stream, all but pending, which only the local trackers know.
+static const struct
+{
+	const char *suffix;
+	const char *type;
+	const char *help;
+} sequence_series[] = {
+    {"_total", "counter", "received"},
+    {"_lost_total", "counter", "never received"},
+    {"_late_total", "counter", "received after newer ones"},
+    {"_duplicates_total", "counter", "received again"},
+    {"_max_reorder_depth", "gauge", "most newer ones before a late one"},
+    {"_max_loss_burst", "gauge", "most lost in a row"},
+};
+
+static void
+metrics_describe_sequence(GString *out, const char *name, const char *what, size_t series)
+{
+	g_autofree gchar *full_name = g_strconcat(name, sequence_series[series].suffix, NULL);
+	g_autofree gchar *help = g_strdup_printf("%s %s.", what, sequence_series[series].help);
+	metrics_describe(out, full_name, sequence_series[series].type, help);
+}
+
+//! @p labels is empty or a label set in braces.
+static void
+metrics_append_sequence(GString *out,
+                        const char *name,
+                        size_t series,
+                        const char *labels,
+                        const struct em_sequence_stats *stats)
+{
+	const guint64 values[G_N_ELEMENTS(sequence_series)] = {
+	    stats->received,          //
+	    stats->lost,              //
+	    stats->late,              //
+	    stats->duplicates,        //
+	    stats->max_reorder_depth, //
+	    stats->max_loss_burst,    //
+	};
+	g_string_append_printf(out, "%s%s%s %" G_GUINT64_FORMAT "\n", name, sequence_series[series].suffix, labels,
+	                       values[series]);
+}
+
+static void
+metrics_append_local_sequence(GString *out,
+                              const char *name,
+                              const char *what,
+                              const struct em_sequence_tracker *tracker)
+{
+	struct em_sequence_stats stats;
+	em_sequence_tracker_get_stats(tracker, &stats);
+
+	for (size_t i = 0; i < G_N_ELEMENTS(sequence_series); i++) {
+		metrics_describe_sequence(out, name, what, i);
+		metrics_append_sequence(out, name, i, "", &stats);
+	}
+
+	g_autofree gchar *pending_name = g_strconcat(name, "_pending", NULL);
+	g_autofree gchar *help = g_strdup_printf("%s missing, that may still arrive.", what);
+	metrics_describe(out, pending_name, "gauge", help);
+	g_string_append_printf(out, "%s %" G_GUINT64_FORMAT "\n", pending_name, stats.pending);
+}
+
+static void
+metrics_append_latency(GString *out, const char *stage, const struct ems_telemetry_percentiles *p)
+{
+	g_string_append_printf(out, "ems_frame_latency_seconds{stage=\"%s\",quantile=\"0.5\"} %f\n", stage,
+	                       p->p50_ms / 1000.0);
+	g_string_append_printf(out, "ems_frame_latency_seconds{stage=\"%s\",quantile=\"0.95\"} %f\n", stage,
+	                       p->p95_ms / 1000.0);
+	g_string_append_printf(out, "ems_frame_latency_seconds{stage=\"%s\",quantile=\"0.99\"} %f\n", stage,
+	                       p->p99_ms / 1000.0);
+}
+
+/*!
+ * Answers a scrape of the signaling server's /metrics, on the main loop.
+ *
+ * Rates, like the encoded frame rate and the actual bitrate, are left to the
+ * scraper, from the counters. Each family has its samples right after its HELP
+ * and TYPE.
+ */
+static void
+webrtc_metrics_cb(EmsSignalingServer *server, GString *out, struct ems_gstreamer_pipeline *egp)
+{
+	g_mutex_lock(&egp->metrics_mutex);
+	struct ems_pipeline_metrics m = egp->metrics;
+	g_mutex_unlock(&egp->metrics_mutex);
+
+	metrics_describe(out, "ems_frames_total", "counter", "Frames handed to the payloader.");
+	g_string_append_printf(out, "ems_frames_total %" G_GUINT64_FORMAT "\n", m.frames);
+
+	metrics_describe(out, "ems_rtp_packets_total", "counter", "RTP packets out of the payloader.");
+	g_string_append_printf(out, "ems_rtp_packets_total %" G_GUINT64_FORMAT "\n",
+	                       (guint64)atomic_load(&egp->rtp_packets));
+
+	metrics_describe(out, "ems_rtp_bytes_total", "counter", "RTP bytes out of the payloader, sent to each client.");
+	g_string_append_printf(out, "ems_rtp_bytes_total %" G_GUINT64_FORMAT "\n",
+	                       (guint64)atomic_load(&egp->rtp_bytes));
+
+	metrics_describe(out, "ems_target_bitrate_bits_per_second", "gauge", "Bitrate the encoder is asked for.");
+	g_string_append_printf(out, "ems_target_bitrate_bits_per_second %d\n", g_atomic_int_get(&egp->bitrate) * 1000);
+
+	metrics_append_local_sequence(out, "ems_down_messages", "DownMessages at the payloader", &m.down_msgs);
+	metrics_append_local_sequence(out, "ems_poses", "Tracking UpMessages", &m.poses);
+
+	metrics_describe(out, "ems_up_messages_total", "counter", "UpMessages from the tracking client, by content.");
+	g_string_append_printf(out, "ems_up_messages_total{type=\"tracking\"} %" G_GUINT64_FORMAT "\n",
+	                       m.tracking_msgs);
+	g_string_append_printf(out, "ems_up_messages_total{type=\"frame\"} %" G_GUINT64_FORMAT "\n", m.frame_msgs);
+
+	if (m.last_tracking_ns != 0) {
+		metrics_describe(out, "ems_pose_age_seconds", "gauge", "Time since the last tracking UpMessage.");
+		g_string_append_printf(out, "ems_pose_age_seconds %f\n",
+		                       (double)(os_monotonic_get_ns() - m.last_tracking_ns) / U_TIME_1S_IN_NS);
+	}
+
+	for (size_t i = 0; i < G_N_ELEMENTS(level_families); i++) {
+		struct metrics_level_context ctx = {.out = out, .level = (enum metrics_level)i};
+		metrics_describe(out, level_families[i].name, "gauge", level_families[i].help);
+		GstIterator *it = gst_bin_iterate_elements(GST_BIN(egp->base.pipeline));
+		gst_iterator_foreach(it, metrics_append_element_level, &ctx);
+		gst_iterator_free(it);
+	}
+
+	// Per session, each family goes over all of them.
+	g_mutex_lock(&egp->clients_mutex);
+	GList *clients = g_hash_table_get_values(egp->clients);
+
+	metrics_describe(out, "ems_clients", "gauge", "Connected clients.");
+	g_string_append_printf(out, "ems_clients %u\n", g_hash_table_size(egp->clients));
+
+	metrics_describe(out, "ems_client_tracking", "gauge", "1 for the client whose poses drive the tracking.");
+	for (GList *l = clients; l != NULL; l = l->next) {
+		struct ems_client *client = l->data;
+		g_string_append_printf(out, "ems_client_tracking{client=\"%" G_GUINT64_FORMAT "\"} %d\n",
+		                       client->serial, egp->tracking_client == client->id);
+	}
+
+	metrics_describe(out, "ems_client_up_messages_total", "counter", "UpMessages received from the client.");
+	for (GList *l = clients; l != NULL; l = l->next) {
+		struct ems_client *client = l->data;
+		g_string_append_printf(out, "ems_client_up_messages_total{client=\"%" G_GUINT64_FORMAT "\"} %d\n",
+		                       client->serial, g_atomic_int_get(&client->up_messages));
+	}
+
+	metrics_describe(out, "ems_client_bitrate_estimate_bits_per_second", "gauge",
+	                 "Bandwidth estimate for the client, without TWCC there is none.");
+	for (GList *l = clients; l != NULL; l = l->next) {
+		struct ems_client *client = l->data;
+		if (client->bwe != NULL) {
+			g_string_append_printf(
+			    out, "ems_client_bitrate_estimate_bits_per_second{client=\"%" G_GUINT64_FORMAT "\"} %d\n",
+			    client->serial, g_atomic_int_get(&client->bitrate_estimate) * 1000);
+		}
+	}
+
+	for (size_t i = 0; i < G_N_ELEMENTS(sequence_series); i++) {
+		metrics_describe_sequence(out, "ems_client_frames", "Frames the client", i);
+		for (GList *l = clients; l != NULL; l = l->next) {
+			struct ems_client *client = l->data;
+			if (!client->have_stream_stats) {
+				continue;
+			}
+			struct em_sequence_stats stats = {
+			    .received = client->stream_stats.frames_received,
+			    .lost = client->stream_stats.frames_lost,
+			    .late = client->stream_stats.frames_late,
+			    .duplicates = client->stream_stats.frames_duplicated,
+			    .max_reorder_depth = client->stream_stats.max_reorder_depth,
+			    .max_loss_burst = client->stream_stats.max_loss_burst,
+			};
+			g_autofree gchar *labels =
+			    g_strdup_printf("{client=\"%" G_GUINT64_FORMAT "\"}", client->serial);
+			metrics_append_sequence(out, "ems_client_frames", i, labels, &stats);
+		}
+	}
+
+	g_list_free(clients);
+	g_mutex_unlock(&egp->clients_mutex);
+
+	// The total, then each stage from the one before.
+	const char *stages[EMS_TELEMETRY_STAGE_COUNT];
+	struct ems_telemetry_percentiles latencies[EMS_TELEMETRY_STAGE_COUNT];
+	size_t stage_count = 0;
+	if (ems_telemetry_get_total(egp->telemetry, &latencies[stage_count])) {
+		stages[stage_count++] = "total";
+	}
+	for (int i = EMS_TELEMETRY_STAGE_LAYER_COMMIT + 1; i < EMS_TELEMETRY_STAGE_COUNT; i++) {
+		enum ems_telemetry_stage stage = (enum ems_telemetry_stage)i;
+		if (ems_telemetry_get_stage(egp->telemetry, stage, &latencies[stage_count])) {
+			stages[stage_count++] = ems_telemetry_stage_name(stage);
+		}
+	}
+
+	metrics_describe(out, "ems_frame_latency_seconds", "summary",
+	                 "Frame latency percentiles over the last window, from the stage before into the stage.");
+	for (size_t i = 0; i < stage_count; i++) {
+		metrics_append_latency(out, stages[i], &latencies[i]);
+	}
+
+	metrics_describe(out, "ems_frame_latency_window_frames", "gauge", "Frames in the last latency window.");
+	for (size_t i = 0; i < stage_count; i++) {
+		g_string_append_printf(out, "ems_frame_latency_window_frames{stage=\"%s\"} %u\n", stages[i],
+		                       latencies[i].count);
+	}
+}
+
+
+/*
+ *
+ * Direct transport functions.
+ *
+ */
+
+//! Stop streaming to the direct client, if there is one. Only called from the direct thread, or once it is gone.
+static void
+direct_drop_client(struct ems_gstreamer_pipeline *egp)
+{
+	if (egp->direct.client == NULL) {
+		return;
+	}
+
+	if (!egp->direct.srt) {
+		g_signal_emit_by_name(egp->direct.sink, "clear");
+	}
+	unregister_client(egp, egp->direct.client->id);
+	egp->direct.client = NULL;
+	g_clear_object(&egp->direct.peer);
+}
+
+//! @p peer said hello while there was no direct client, it becomes the direct client.
+static void
+direct_add_client(struct ems_gstreamer_pipeline *egp, GSocketAddress *peer)
+{
+	// Nobody hands out ids without signaling, the client makes a unique one.
+	struct ems_client *client = ems_client_new(NULL, egp);
+	client->id = client;
+	register_client(egp, client);
+
+	egp->direct.client = client;
+	egp->direct.peer = g_object_ref(peer);
+
+	GInetSocketAddress *inet_peer = G_INET_SOCKET_ADDRESS(peer);
+	g_autofree gchar *host = g_inet_address_to_string(g_inet_socket_address_get_address(inet_peer));
+	guint16 port = g_inet_socket_address_get_port(inet_peer);
+	U_LOG_I("Direct client %p at %s:%u.", client->id, host, port);
+
+	// Over SRT the stream goes to whoever called the listener, and the keyframe when they do.
+	if (!egp->direct.srt) {
+		g_signal_emit_by_name(egp->direct.sink, "add", host, (gint)port);
+		request_join_keyframe(egp);
+	}
+}
+
+static bool
+direct_is_peer(struct ems_gstreamer_pipeline *egp, GSocketAddress *address)
+{
+	if (egp->direct.peer == NULL) {
+		return false;
+	}
+
+	GInetSocketAddress *a = G_INET_SOCKET_ADDRESS(address);
+	GInetSocketAddress *b = G_INET_SOCKET_ADDRESS(egp->direct.peer);
+	return g_inet_socket_address_get_port(a) == g_inet_socket_address_get_port(b) &&
+	       g_inet_address_equal(g_inet_socket_address_get_address(a), g_inet_socket_address_get_address(b));
+}
+
+static gpointer
+direct_thread(gpointer user_data)
+{
+	struct ems_gstreamer_pipeline *egp = user_data;
+	unsigned char *buf = g_malloc(DIRECT_MAX_DATAGRAM_SIZE);
+
+	// The socket times out every second to check if we should stop.
+	while (g_atomic_int_get(&egp->direct.running)) {
+		GSocketAddress *peer = NULL;
+		GError *error = NULL;
+		gssize n = g_socket_receive_from(egp->direct.socket, &peer, (gchar *)buf, DIRECT_MAX_DATAGRAM_SIZE,
+		                                 NULL, &error);
+		gint64 now_us = g_get_monotonic_time();
+
+		if (egp->direct.client != NULL &&
+		    now_us - egp->direct.last_seen_us > DIRECT_CLIENT_TIMEOUT_S * G_USEC_PER_SEC) {
+			U_LOG_I("Direct client %p timed out.", egp->direct.client->id);
+			direct_drop_client(egp);
+		}
+
+		if (n < 0) {
+			if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)) {
+				U_LOG_W("Direct transport: %s", error->message);
+			}
+			g_clear_error(&error);
+			continue;
+		}
+
+		// The hello keeps us streaming to a client that has nothing to say.
+		bool hello = (size_t)n == strlen(DIRECT_HELLO) && memcmp(buf, DIRECT_HELLO, (size_t)n) == 0;
+
+		// Anybody can send us a datagram. Only a hello takes the stream, and only once the client has gone.
+		if (!direct_is_peer(egp, peer)) {
+			if (!hello || egp->direct.client != NULL) {
+				g_object_unref(peer);
+				continue;
+			}
+			direct_add_client(egp, peer);
+		}
+		g_object_unref(peer);
+		egp->direct.last_seen_us = now_us;
+
+		if (!hello) {
+			receive_up_message(egp->direct.client, buf, (size_t)n);
+		}
+	}
+
+	g_free(buf);
+	return NULL;
+}
+
+static void
+direct_srt_caller_added_cb(GstElement *srtsink, gint unused, GSocketAddress *addr, struct ems_gstreamer_pipeline *egp)
+{
+	(void)srtsink;
+	(void)unused;
+	(void)addr;
+
+	U_LOG_I("Direct SRT caller connected, sending a keyframe.");
+	request_join_keyframe(egp);
+}
+
+/*!
+ * Bind the direct port and add the branch sending the stream to the direct client, see --direct.
+ */
+static bool
+direct_init(struct ems_gstreamer_pipeline *egp, GstElement *pipeline)
+{
+	struct ems_arguments *args = ems_arguments_get();
+	GError *error = NULL;
+
+	egp->direct.socket = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, &error);
+	if (egp->direct.socket == NULL) {
+		U_LOG_E("Direct transport: %s", error->message);
+		g_clear_error(&error);
+		return false;
+	}
+
+	GInetAddress *any = g_inet_address_new_any(G_SOCKET_FAMILY_IPV4);
+	GSocketAddress *address = g_inet_socket_address_new(any, args->direct_port);
+	bool bound = g_socket_bind(egp->direct.socket, address, TRUE, &error);
+	g_object_unref(address);
+	g_object_unref(any);
+	if (!bound) {
+		U_LOG_E("Direct transport: Could not bind port %u: %s", args->direct_port, error->message);
+		g_clear_error(&error);
+		g_clear_object(&egp->direct.socket);
+		return false;
+	}
+	g_socket_set_timeout(egp->direct.socket, 1);
+
+	egp->direct.srt = args->direct_transport == EMS_DIRECT_TRANSPORT_SRT;
+
+	// Late packets are no use to the client, and must not hold back the WebRTC clients on the other branches.
+	gchar *branch_str;
+	if (egp->direct.srt) {
+		branch_str = g_strdup_printf(
+		    "queue leaky=downstream max-size-buffers=0 max-size-bytes=0 max-size-time=100000000 ! "
+		    "srtsink name=directsink uri=srt://:%u?mode=listener wait-for-connection=false latency=20 "
+		    "sync=false async=false",
+		    args->direct_port + 1);
+	} else {
+		// Out of the socket we receive on, so the RTP makes it through the client's NAT and firewall.
+		branch_str = g_strdup(
+		    "queue leaky=downstream max-size-buffers=0 max-size-bytes=0 max-size-time=100000000 ! "
+		    "multiudpsink name=directsink sync=false async=false");
+	}
+
+	GstElement *branch = gst_parse_bin_from_description(branch_str, TRUE, &error);
+	g_free(branch_str);
+	if (branch == NULL) {
+		U_LOG_E("Direct transport: %s", error->message);
+		g_clear_error(&error);
+		g_clear_object(&egp->direct.socket);
+		return false;
+	}
+
+	egp->direct.sink = gst_bin_get_by_name(GST_BIN(branch), "directsink");
+	if (egp->direct.srt) {
+		g_signal_connect(egp->direct.sink, "caller-added", G_CALLBACK(direct_srt_caller_added_cb), egp);
+	} else {
+		g_object_set(egp->direct.sink, "socket", egp->direct.socket, "close-socket", FALSE, NULL);
+	}
+
+	gst_bin_add(GST_BIN(pipeline), branch);
+	GstElement *tee = gst_bin_get_by_name(GST_BIN(pipeline), WEBRTC_TEE_NAME);
+	gst_element_link(tee, branch);
+	gst_object_unref(tee);
+
+	g_atomic_int_set(&egp->direct.running, 1);
+	egp->direct.thread = g_thread_new("ems-direct", direct_thread, egp);
+	return true;
+}
+
+static void
+direct_destroy(struct ems_gstreamer_pipeline *egp)
+{
+	if (egp->direct.thread != NULL) {
+		g_atomic_int_set(&egp->direct.running, 0);
+		g_thread_join(egp->direct.thread);
+		egp->direct.thread = NULL;
+	}
+	direct_drop_client(egp);
+
+	gst_clear_object(&egp->direct.sink);
+	if (egp->direct.socket != NULL) {
+		g_socket_close(egp->direct.socket, NULL);
+		g_clear_object(&egp->direct.socket);
+	}
+}
+
+
 /*
  *
  * Internal pipeline functions.
@@ -698,6 +2346,31 @@ destroy(struct xrt_frame_node *node)
 
 	U_LOG_I("Shutting down em pipeline.");
 
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
+	if (egp->up_thread != NULL) {
+		g_atomic_int_set(&egp->up_thread_running, 0);
+		os_semaphore_release(&egp->up_sem);
+		g_thread_join(egp->up_thread);
+		egp->up_thread = NULL;
+	}
+	os_semaphore_destroy(&egp->up_sem);
+	g_mutex_clear(&egp->up_push_mutex);
+
+	if (egp->replay.thread != NULL) {
+		g_atomic_int_set(&egp->replay.running, 0);
+		g_thread_join(egp->replay.thread);
+		egp->replay.thread = NULL;
+	}
+	ems_capture_destroy(&egp->capture);
+
+	direct_destroy(egp);
+
+	gst_clear_object(&egp->encoder);
+	g_clear_pointer(&egp->clients, g_hash_table_destroy);
+	g_clear_pointer(&egp->sessions, g_hash_table_destroy);
+	g_mutex_clear(&egp->clients_mutex);
+	g_mutex_clear(&egp->metrics_mutex);
+
 	free(gp);
 }
 
@@ -706,29 +2379,86 @@ GMainLoop *main_loop;
 void *
 loop_thread(void *data)
 {
+	// Signaling and the data channel callbacks run here.
+	int sched_ret = em_thread_sched_apply(EM_THREAD_ROLE_NETWORK);
+	if (sched_ret != 0) {
+		U_LOG_W("Could not schedule the main loop thread: %s", strerror(sched_ret));
+	}
+
 	g_main_loop_run(main_loop);
 	return NULL;
 }
 
+static bool
+add_twcc_extension(GstElement *pipeline)
+{
+	GstElement *rtppay = gst_bin_get_by_name(GST_BIN(pipeline), "rtppay");
+	if (rtppay == NULL) {
+		U_LOG_E("Could not find rtppay element.");
+		return false;
+	}
+
+	GstRTPHeaderExtension *twcc = gst_rtp_header_extension_create_from_uri(RTP_TWCC_URI);
+	if (twcc == NULL) {
+		U_LOG_W("No TWCC header extension, streaming at a fixed bitrate.");
+		gst_object_unref(rtppay);
+		return false;
+	}
+
+	gst_rtp_header_extension_set_id(twcc, RTP_TWCC_HDR_EXT_ID);
+	g_signal_emit_by_name(rtppay, "add-extension", twcc);
+
+	gst_object_unref(twcc);
+	gst_object_unref(rtppay);
+
+	return true;
+}
+
 
 /*
  *
  * Exported functions.
  *
  */
-GBytes *
-ems_gstreamer_pipeline_encode_down_msg(em_proto_DownMessage *msg)
+uint32_t
+ems_gstreamer_pipeline_get_bitrate(struct gstreamer_pipeline *gp)
 {
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
+
+	return (uint32_t)g_atomic_int_get(&egp->bitrate);
+}
 
-	uint8_t buf[em_proto_DownMessage_size];
-	pb_ostream_t os = pb_ostream_from_buffer(buf, sizeof(buf));
+uint32_t
+ems_gstreamer_pipeline_get_framerate(struct gstreamer_pipeline *gp)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
 
-	if (!pb_encode(&os, em_proto_DownMessage_fields, msg)) {
-		U_LOG_E("Failed to encode protobuf.");
-		return NULL;
+	return (uint32_t)g_atomic_int_get(&egp->framerate);
+}
+
+bool
+ems_gstreamer_pipeline_take_keyframe_request(struct gstreamer_pipeline *gp)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
+
+	return g_atomic_int_compare_and_exchange(&egp->key_unit_requested, 1, 0);
+}
+
+void
+ems_gstreamer_pipeline_prewarm(struct gstreamer_pipeline *gp)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
+
+	uint64_t start_ns = os_monotonic_get_ns();
+	GstStateChangeReturn ret = gst_element_set_state(egp->base.pipeline, GST_STATE_PAUSED);
+	if (ret == GST_STATE_CHANGE_FAILURE) {
+		U_LOG_W("Could not prewarm the pipeline, it starts with the first frame.");
+		return;
 	}
 
-	return g_bytes_new(buf, os.bytes_written);
+	// Live, so there is no preroll to wait for, only the elements starting.
+	gst_element_get_state(egp->base.pipeline, NULL, NULL, 3 * GST_SECOND);
+	U_LOG_I("Pipeline prewarmed in %.1f ms", (double)(os_monotonic_get_ns() - start_ns) / 1e6);
 }
 
 void
@@ -746,6 +2476,22 @@ ems_gstreamer_pipeline_play(struct gstreamer_pipeline *gp)
 
 	g_signal_connect(signaling_server, "ws-client-connected", G_CALLBACK(webrtc_client_connected_cb), egp);
 
+	if (egp->twcc) {
+		egp->last_bitrate_update_us = g_get_monotonic_time();
+		egp->bitrate_src_id = g_timeout_add(BITRATE_UPDATE_INTERVAL_MS, update_bitrate, egp);
+		egp->stats_src_id = g_timeout_add_seconds(STATS_INTERVAL_S, print_stats, egp);
+	}
+
+	if (ems_arguments_get()->loss_protection) {
+		egp->loss_src_id = g_timeout_add(LOSS_PROTECTION_INTERVAL_MS, update_loss_protection, egp);
+	}
+
+	// The app pushed its first frame, so it is there to take the poses.
+	if (ems_arguments_get()->replay_file != NULL && egp->replay.thread == NULL) {
+		g_atomic_int_set(&egp->replay.running, 1);
+		egp->replay.thread = g_thread_new("ems-replay", replay_thread, egp);
+	}
+
 	pthread_t thread;
 	pthread_create(&thread, NULL, loop_thread, NULL);
 }
@@ -766,6 +2512,9 @@ ems_gstreamer_pipeline_stop_if_playing(struct gstreamer_pipeline *gp)
 
 	if (state == GST_STATE_PLAYING) {
 		ems_gstreamer_pipeline_stop(gp);
+	} else if (state == GST_STATE_PAUSED) {
+		// Prewarmed and never played, nothing in it to settle.
+		gst_element_set_state(egp->base.pipeline, GST_STATE_NULL);
 	}
 }
 
@@ -775,6 +2524,10 @@ ems_gstreamer_pipeline_stop(struct gstreamer_pipeline *gp)
 	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
 	U_LOG_I("Stopping pipeline");
 
+	g_clear_handle_id(&egp->bitrate_src_id, g_source_remove);
+	g_clear_handle_id(&egp->stats_src_id, g_source_remove);
+	g_clear_handle_id(&egp->loss_src_id, g_source_remove);
+
 	// Settle the pipeline.
 	U_LOG_T("Sending EOS");
 	gst_element_send_event(egp->base.pipeline, gst_event_new_eos());
@@ -798,6 +2551,7 @@ void
 ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
                               const char *appsrc_name,
                               struct ems_callbacks *callbacks_collection,
+                              struct ems_telemetry *telemetry,
                               struct gstreamer_pipeline **out_gp)
 {
 	gchar *pipeline_str;
@@ -814,43 +2568,58 @@ ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
 		debug_file_path = g_file_get_path(args->stream_debug_file);
 	}
 
+	// Recorded off the live stream, a slow disk loses frames of the recording rather than holding the stream.
 	gchar *save_tee_str = NULL;
 	if (debug_file_path) {
 		save_tee_str = g_strdup_printf(
 		    "tee name=savetee "
-		    "savetee. ! queue ! matroskamux ! filesink location=%s "
+		    "savetee. ! queue name=%s leaky=downstream max-size-buffers=0 max-size-bytes=0 "
+		    "max-size-time=1000000000 ! matroskamux ! filesink location=%s async=false "
 		    "savetee. ! ",
-		    debug_file_path);
+		    SAVE_QUEUE_NAME, debug_file_path);
 	} else {
 		save_tee_str = g_strdup("");
 	}
 
-	gchar *encoder_str = NULL;
-	if (args->encoder_type == EMS_ENCODER_TYPE_X264) {
-		encoder_str = g_strdup_printf(
-		    "x264enc tune=zerolatency sliced-threads=true speed-preset=veryfast bframes=2 bitrate=%d",
-		    args->bitrate);
-	} else if (args->encoder_type == EMS_ENCODER_TYPE_NVH264) {
-		encoder_str = g_strdup_printf("nvh264enc zerolatency=true bitrate=%d rc-mode=cbr preset=low-latency",
-		                              args->bitrate);
-	} else {
+	const struct ems_encoder_descriptor *encoder = ems_encoder_get(args->encoder_type);
+	if (encoder == NULL) {
 		U_LOG_E("Unexpected encoder type.");
 		abort();
 	}
+	const struct ems_codec_descriptor *codec = ems_encoder_get_codec(encoder);
+	gchar *encoder_str =
+	    ems_encoder_create_launch_string(encoder, args->bitrate, args->intra_refresh, args->slices);
+
+	// The compositor hands us NV12 unless asked to convert on the CPU.
+	const gchar *convert_str = args->cpu_color_convert ? "videoconvert ! video/x-raw,format=NV12 ! " : "";
+
+	/*
+	 * Both queues hold up to the latency budget. Raw frames past it are dropped, the source also stops taking
+	 * new ones then. An encoded frame is never dropped, the client could not decode the ones after it, so the
+	 * queue after the encoder blocks it instead.
+	 */
+	guint64 budget_ns = args->latency_budget_ns;
+	gchar *limits_str = budget_ns > 0 ? g_strdup_printf("max-size-buffers=0 max-size-bytes=0 "
+	                                                    "max-size-time=%" G_GUINT64_FORMAT,
+	                                                    budget_ns)
+	                                  : g_strdup("");
+	const gchar *raw_leaky_str = budget_ns > 0 ? "leaky=downstream" : "";
 
 	pipeline_str = g_strdup_printf(
-	    "appsrc name=%s ! "            //
-	    "videoconvert ! "              //
-	    "video/x-raw,format=NV12 ! "   //
-	    "queue ! "                     //
-	    "%s ! "                        //
-	    "video/x-h264,profile=main ! " //
+	    "appsrc name=%s ! " //
+	    "%s"                //
+	    "queue %s %s ! "    //
+	    "%s ! "             //
+	    "%s ! "             //
 	    "%s"
-	    "queue ! "                                    //
-	    "rtph264pay name=rtppay config-interval=1 ! " //
-	    "application/x-rtp,payload=96 ! "             //
+	    "queue %s ! "                     //
+	    "%s name=rtppay ! "               //
+	    "application/x-rtp,payload=96 ! " //
 	    "tee name=%s allow-not-linked=true",
-	    appsrc_name, encoder_str, save_tee_str, WEBRTC_TEE_NAME);
+	    appsrc_name, convert_str, raw_leaky_str, limits_str, encoder_str, codec->encoded_caps, save_tee_str,
+	    limits_str, codec->payloader, WEBRTC_TEE_NAME);
+
+	g_free(limits_str);
 
 	g_free(debug_file_path);
 	g_free(save_tee_str);
@@ -865,6 +2634,24 @@ ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
 	egp->base.node.destroy = destroy;
 	egp->base.xfctx = xfctx;
 	egp->callbacks = callbacks_collection;
+	egp->telemetry = telemetry;
+	egp->clients = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)ems_client_release);
+	egp->sessions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	g_mutex_init(&egp->clients_mutex);
+	g_mutex_init(&egp->metrics_mutex);
+	em_sequence_tracker_reset(&egp->metrics.down_msgs);
+	em_sequence_tracker_reset(&egp->metrics.poses);
+
+	g_mutex_init(&egp->up_push_mutex);
+	os_semaphore_init(&egp->up_sem, 0);
+	if (args->up_message_thread) {
+		g_atomic_int_set(&egp->up_thread_running, 1);
+		egp->up_thread = g_thread_new("ems-up-messages", up_message_thread, egp);
+	}
+
+	if (args->capture_file != NULL) {
+		egp->capture = ems_capture_create(args->capture_file);
+	}
 
 	gst_init(NULL, NULL);
 
@@ -872,23 +2659,67 @@ ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
 	g_assert_no_error(error);
 	g_free(pipeline_str);
 
+	egp->encoder_desc = encoder;
+	egp->encoder = gst_bin_get_by_name(GST_BIN(pipeline), EMS_ENCODER_ELEMENT_NAME);
+	egp->bitrate = (gint)args->bitrate;
+	egp->framerate = (gint)args->framerate;
+	egp->twcc = args->adaptive_bitrate && add_twcc_extension(pipeline);
+
+	GstElement *rtppay = gst_bin_get_by_name(GST_BIN(pipeline), "rtppay");
+	g_object_get(rtppay, "mtu", &egp->rtppay_mtu, NULL);
+	egp->rtppay_frame_mtu = egp->rtppay_mtu;
+
+	// Keyframe requests from the clients' RTCP travel up through the payloader.
+	GstPad *rtppay_sink = gst_element_get_static_pad(rtppay, "sink");
+	gst_pad_add_probe(rtppay_sink, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, force_key_unit_probe, egp, NULL);
+	gst_pad_add_probe(rtppay_sink, GST_PAD_PROBE_TYPE_BUFFER, rtppay_sink_probe, egp, NULL);
+	gst_object_unref(rtppay_sink);
+	gst_object_unref(rtppay);
+
+	// Frames carry their DownMessage through the encoder, which tells the stages apart.
+	if (egp->encoder != NULL) {
+		GstPad *encoder_sink = gst_element_get_static_pad(egp->encoder, "sink");
+		GstPad *encoder_src = gst_element_get_static_pad(egp->encoder, "src");
+		gst_pad_add_probe(encoder_sink, GST_PAD_PROBE_TYPE_BUFFER, encoder_sink_probe, egp, NULL);
+		gst_pad_add_probe(encoder_src, GST_PAD_PROBE_TYPE_BUFFER, encoder_src_probe, egp, NULL);
+		gst_object_unref(encoder_sink);
+		gst_object_unref(encoder_src);
+	}
+
+	bool direct = args->direct_transport != EMS_DIRECT_TRANSPORT_NONE && direct_init(egp, pipeline);
+
 	bus = gst_element_get_bus(pipeline);
 	gst_bus_add_watch(bus, gst_bus_cb, egp);
+	gst_bus_set_sync_handler(bus, gst_bus_sync_cb, egp, NULL);
 	gst_object_unref(bus);
 
 	g_signal_connect(signaling_server, "ws-client-disconnected", G_CALLBACK(webrtc_client_disconnected_cb), egp);
 	g_signal_connect(signaling_server, "sdp-answer", G_CALLBACK(webrtc_sdp_answer_cb), egp);
 	g_signal_connect(signaling_server, "candidate", G_CALLBACK(webrtc_candidate_cb), egp);
+	g_signal_connect(signaling_server, "compact-format", G_CALLBACK(webrtc_compact_format_cb), egp);
+	g_signal_connect(signaling_server, "client-identity", G_CALLBACK(webrtc_client_identity_cb), egp);
+	g_signal_connect(signaling_server, "refresh-rates", G_CALLBACK(webrtc_refresh_rates_cb), egp);
+	g_signal_connect(signaling_server, "metrics", G_CALLBACK(webrtc_metrics_cb), egp);
 
 	// loop = g_main_loop_new (NULL, FALSE);
 	// g_unix_signal_add (SIGINT, sigint_handler, loop);
 
 	g_print(
 	    "Output streams:\n"
-	    "\tWebRTC: http://127.0.0.1:8080\n");
+	    "\tWebRTC: http://127.0.0.1:8080\n"
+	    "\tMetrics: http://127.0.0.1:8080/metrics\n");
+	if (direct) {
+		g_print("\tDirect: %s on port %u\n", egp->direct.srt ? "SRT" : "RTP",
+		        egp->direct.srt ? args->direct_port + 1 : args->direct_port);
+	}
 
 	// Setup pipeline.
 	egp->base.pipeline = pipeline;
+
+	// On the shared payloader, once for all clients.
+	if (!ems_gstreamer_pipeline_add_payload_pad_probe(egp)) {
+		U_LOG_E("Failed to add payload pad probe.");
+	}
 	// GstElement *appsrc = gst_element_factory_make("appsrc", appsrc_name);
 	// GstElement *conv = gst_element_factory_make("videoconvert", "conv");
 	// GstElement *scale = gst_element_factory_make("videoscale", "scale");
@@ -23,11 +23,38 @@ extern "C" {
 
 struct gstreamer_pipeline;
 struct ems_callbacks;
+struct ems_telemetry;
 
-typedef struct _em_proto_DownMessage em_proto_DownMessage;
+/*!
+ * Bitrate the stream should be encoded at in kbit/s, follows the congestion
+ * control estimate unless --fixed-bitrate is given. Safe to call from any thread.
+ */
+uint32_t
+ems_gstreamer_pipeline_get_bitrate(struct gstreamer_pipeline *gp);
+
+/*!
+ * Frame rate the stream should run at, one of the display refresh rates of the
+ * clients, closest to --framerate. Safe to call from any thread.
+ */
+uint32_t
+ems_gstreamer_pipeline_get_framerate(struct gstreamer_pipeline *gp);
 
-GBytes *
-ems_gstreamer_pipeline_encode_down_msg(em_proto_DownMessage *msg);
+/*!
+ * True once after a client asked for a keyframe that the pipeline can't make
+ * itself, because the compositor encodes. Safe to call from any thread.
+ */
+bool
+ems_gstreamer_pipeline_take_keyframe_request(struct gstreamer_pipeline *gp);
+
+/*!
+ * Take the pipeline to PAUSED, so its plugins are loaded and its elements,
+ * the encoder among them, opened and started before the first frame. The
+ * encoder still sets up the stream with the caps of that frame. Call once
+ * after creating the source, the first @ref ems_gstreamer_pipeline_play goes
+ * on from there.
+ */
+void
+ems_gstreamer_pipeline_prewarm(struct gstreamer_pipeline *gp);
 
 void
 ems_gstreamer_pipeline_play(struct gstreamer_pipeline *gp);
@@ -42,6 +69,7 @@ void
 ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
                               const char *appsrc_name,
                               struct ems_callbacks *callbacks_collection,
+                              struct ems_telemetry *telemetry,
                               struct gstreamer_pipeline **out_gp);
 
 #ifdef __cplusplus
@@ -15,14 +15,29 @@
 #include "util/u_debug.h"
 #include "util/u_format.h"
 
+#include "os/os_time.h"
+
 #include "ems_gstreamer_src.h"
 #include "ems_gstreamer.h"
+#include "ems_down_message_meta.h"
+#include "ems_encoders.h"
 #include "gst/video/video-format.h"
 #include "gst/video/gstvideometa.h"
 #include "gst/app/gstappsink.h"
 #include "gst/app/gstappsrc.h"
+#include "gst/allocators/gstdmabuf.h"
+
+#if GST_CHECK_VERSION(1, 24, 0)
+#include "gst/video/video-info-dma.h"
+
+#ifndef DRM_FORMAT_MOD_LINEAR
+#define DRM_FORMAT_MOD_LINEAR 0ULL
+#endif
+#endif
 
 #include <assert.h>
+#include <inttypes.h>
+#include <unistd.h>
 
 
 /*
@@ -50,6 +65,7 @@ gst_fmt_from_xf_format(enum xrt_format format_in)
 	case XRT_FORMAT_R8G8B8X8: return GST_VIDEO_FORMAT_RGBx;
 	case XRT_FORMAT_YUYV422: return GST_VIDEO_FORMAT_YUY2;
 	case XRT_FORMAT_L8: return GST_VIDEO_FORMAT_GRAY8;
+	case EMS_XRT_FORMAT_NV12: return GST_VIDEO_FORMAT_NV12;
 	default: assert(false); return GST_VIDEO_FORMAT_UNKNOWN;
 	}
 }
@@ -68,15 +84,191 @@ complain_if_wrong_image_size(struct xrt_frame *xf)
 	}
 }
 
+static GstVideoMeta *
+add_video_meta(GstBuffer *buffer, struct xrt_frame *xf)
+{
+	int stride = xf->stride;
+
+	gsize offsets[4] = {0, 0, 0, 0};
+	gint strides[4] = {stride, 0, 0, 0};
+	guint n_planes = 1;
+	if (xf->format == EMS_XRT_FORMAT_NV12) {
+		offsets[1] = (gsize)stride * xf->height;
+		strides[1] = stride;
+		n_planes = 2;
+	}
+	return gst_buffer_add_video_meta_full(buffer, GST_VIDEO_FRAME_FLAG_NONE, gst_fmt_from_xf_format(xf->format),
+	                                      xf->width, xf->height, n_planes, offsets, strides);
+}
+
+static void
+add_roi_metas(struct ems_gstreamer_src *gs, GstBuffer *buffer)
+{
+	for (uint32_t i = 0; i < gs->roi_count; i++) {
+		const struct ems_gstreamer_src_roi *roi = &gs->rois[i];
+
+		GstVideoRegionOfInterestMeta *meta =
+		    gst_buffer_add_video_region_of_interest_meta(buffer, "lens-centre", roi->x, roi->y, roi->w, roi->h);
+		gst_video_region_of_interest_meta_add_param(
+		    meta, gst_structure_new("roi/va", "delta-qp", G_TYPE_INT, roi->qp_delta, NULL));
+	}
+}
+
+//! A frame pending this long was lost in a stalled or flushed pipeline, not held up by it.
+#define PENDING_STALE_NS (1000 * 1000 * 1000)
+
+/*!
+ * Forget the frames the encoder is done with, or that encoding skipped, and those lost. True if the oldest one
+ * left has been in the pipeline for longer than the budget.
+ */
+static bool
+over_budget_locked(struct ems_gstreamer_src *gs, uint64_t now_ns)
+{
+	while (gs->pending_count > 0) {
+		uint32_t first = gs->pending_first;
+		bool done = gs->pending[first].frame_sequence_id <= gs->last_encoded_sequence_id;
+		bool stale = now_ns - gs->pending[first].push_ns > PENDING_STALE_NS;
+		if (!done && !stale) {
+			break;
+		}
+		gs->pending_first = (first + 1) % EMS_GSTREAMER_SRC_MAX_PENDING_FRAMES;
+		gs->pending_count--;
+	}
+
+	if (gs->pending_count == EMS_GSTREAMER_SRC_MAX_PENDING_FRAMES) {
+		return true;
+	}
+	return gs->pending_count > 0 && now_ns - gs->pending[gs->pending_first].push_ns > gs->latency_budget_ns;
+}
+
+static bool
+over_budget(struct ems_gstreamer_src *gs)
+{
+	if (gs->encoder_src_pad == NULL) {
+		return false;
+	}
+
+	g_mutex_lock(&gs->pending_mutex);
+	bool over = over_budget_locked(gs, os_monotonic_get_ns());
+	g_mutex_unlock(&gs->pending_mutex);
+	return over;
+}
+
+//! Checked before a raw frame is wrapped, the frames the pipeline holds up would only add to the wait.
+static bool
+drop_for_budget(struct ems_gstreamer_src *gs)
+{
+	if (!over_budget(gs)) {
+		return false;
+	}
+
+	gs->skipped_frames++;
+	if (gs->skipped_frames % 90 == 1) {
+		U_LOG_W("Pipeline is over its latency budget, skipped %" PRIu64 " frames so far.", gs->skipped_frames);
+	}
+	return true;
+}
+
+static void
+add_pending(struct ems_gstreamer_src *gs, int64_t frame_sequence_id, uint64_t push_ns)
+{
+	g_mutex_lock(&gs->pending_mutex);
+	if (gs->pending_count < EMS_GSTREAMER_SRC_MAX_PENDING_FRAMES) {
+		uint32_t index = (gs->pending_first + gs->pending_count) % EMS_GSTREAMER_SRC_MAX_PENDING_FRAMES;
+		gs->pending[index].frame_sequence_id = frame_sequence_id;
+		gs->pending[index].push_ns = push_ns;
+		gs->pending_count++;
+	}
+	g_mutex_unlock(&gs->pending_mutex);
+}
+
+static GstPadProbeReturn
+encoder_src_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	(void)pad;
+
+	struct ems_gstreamer_src *gs = user_data;
+	struct ems_down_message_meta *dmm = ems_buffer_get_down_message_meta(gst_pad_probe_info_get_buffer(info));
+	if (dmm == NULL || dmm->frame_sequence_id < 0) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	g_mutex_lock(&gs->pending_mutex);
+	gs->last_encoded_sequence_id = MAX(gs->last_encoded_sequence_id, dmm->frame_sequence_id);
+	g_mutex_unlock(&gs->pending_mutex);
+
+	return GST_PAD_PROBE_OK;
+}
+
+/*!
+ * Timestamps the buffer, attaches the DownMessage and regions of interest and pushes it, takes ownership of the
+ * buffer.
+ */
+static void
+push_buffer(struct ems_gstreamer_src *gs,
+            GstBuffer *buffer,
+            uint64_t xtimestamp_ns,
+            const em_proto_DownMessage *down_msg)
+{
+	GstFlowReturn ret;
+
+	// Use the first frame as offset.
+	if (gs->offset_ns == 0) {
+		gs->offset_ns = xtimestamp_ns;
+	}
+
+	// Need to be offset or gstreamer becomes sad.
+	GST_BUFFER_PTS(buffer) = xtimestamp_ns - gs->offset_ns;
+
+	// Duration is measured from last time stamp.
+	GST_BUFFER_DURATION(buffer) = xtimestamp_ns - gs->timestamp_ns;
+	gs->timestamp_ns = xtimestamp_ns;
+
+
+	// Encoded straight into the meta, which the encoder and payloader copy along. Pooled buffers already have one.
+	struct ems_down_message_meta *dmm = ems_buffer_get_down_message_meta(buffer);
+	bool encoded;
+	if (dmm != NULL) {
+		encoded = ems_down_message_meta_set(dmm, down_msg);
+	} else {
+		dmm = ems_buffer_add_down_message_meta(buffer, down_msg);
+		encoded = dmm != NULL;
+	}
+	if (!encoded) {
+		gst_buffer_unref(buffer);
+		return;
+	}
+
+	// Not pooled, the pool strips them when the buffer comes back.
+	add_roi_metas(gs, buffer);
+
+	// The buffer is not ours once pushed.
+	int64_t frame_sequence_id = dmm->frame_sequence_id;
+	uint64_t push_ns = os_monotonic_get_ns();
+
+	// All done, send it to the gstreamer pipeline.
+	ret = gst_app_src_push_buffer((GstAppSrc *)gs->appsrc, buffer);
+	if (ret != GST_FLOW_OK) {
+		U_LOG_E("Got GST error '%i'", ret);
+	} else if (gs->encoder_src_pad != NULL && frame_sequence_id >= 0) {
+		add_pending(gs, frame_sequence_id, push_ns);
+	}
+}
+
 void
-ems_gstreamer_src_push_frame(struct ems_gstreamer_src *gs, struct xrt_frame *xf, GBytes *downMsg_bytes)
+ems_gstreamer_src_push_frame(struct ems_gstreamer_src *gs,
+                             struct xrt_frame *xf,
+                             const em_proto_DownMessage *down_msg)
 {
 	SINK_TRACE_MARKER();
 
 	complain_if_wrong_image_size(xf);
 
+	if (drop_for_budget(gs)) {
+		return;
+	}
+
 	GstBuffer *buffer;
-	GstFlowReturn ret;
 
 	U_LOG_T(
 	    "Called"
@@ -99,57 +291,71 @@ ems_gstreamer_src_push_frame(struct ems_gstreamer_src *gs, struct xrt_frame *xf,
 	    taken,                            // gpointer user_data
 	    wrapped_buffer_destroy);          // GDestroyNotify notify
 
-	int stride = xf->stride;
+	add_video_meta(buffer, xf);
+	push_buffer(gs, buffer, xf->timestamp, down_msg);
+}
 
-	gsize offsets[4] = {0, 0, 0, 0};
-	gint strides[4] = {stride, 0, 0, 0};
-	gst_buffer_add_video_meta_full(buffer, GST_VIDEO_FRAME_FLAG_NONE, gst_fmt_from_xf_format(xf->format), xf->width,
-	                               xf->height, 1, offsets, strides);
+void
+ems_gstreamer_src_push_frame_dmabuf(struct ems_gstreamer_src *gs,
+                                    struct xrt_frame *xf,
+                                    int dmabuf_fd,
+                                    const em_proto_DownMessage *down_msg)
+{
+	SINK_TRACE_MARKER();
 
-	//! Get the timestampe from the frame.
-	uint64_t xtimestamp_ns = xf->timestamp;
+	complain_if_wrong_image_size(xf);
 
-	// Use the first frame as offset.
-	if (gs->offset_ns == 0) {
-		gs->offset_ns = xtimestamp_ns;
+	if (gs->dmabuf_allocator == NULL) {
+		U_LOG_E("Source was not created for dmabuf.");
+		return;
 	}
 
-	// Need to be offset or gstreamer becomes sad.
-	GST_BUFFER_PTS(buffer) = xtimestamp_ns - gs->offset_ns;
-
-	// Duration is measured from last time stamp.
-	GST_BUFFER_DURATION(buffer) = xtimestamp_ns - gs->timestamp_ns;
-	gs->timestamp_ns = xtimestamp_ns;
-
-
-	size_t payload_size;
-	gconstpointer payload_ptr = g_bytes_get_data(downMsg_bytes, &payload_size);
+	if (drop_for_budget(gs)) {
+		return;
+	}
 
-	// Repack the protobuf into a GstBuffer
-	GstBuffer *struct_buf = gst_buffer_new_memdup(payload_ptr, payload_size);
-	if (!struct_buf) {
-		U_LOG_E("Failed to allocate GstBuffer with payload.");
+	// The memory closes its fd when freed, the frame keeps the original.
+	int fd = dup(dmabuf_fd);
+	if (fd < 0) {
+		U_LOG_E("Failed to dup dmabuf fd.");
 		return;
 	}
 
-	// Add it to a custom meta
-	GstCustomMeta *custom_meta = gst_buffer_add_custom_meta(buffer, "down-message");
-	if (custom_meta == NULL) {
-		U_LOG_E("Failed to add GstCustomMeta");
-		gst_buffer_unref(struct_buf);
+	GstMemory *mem = gst_dmabuf_allocator_alloc(gs->dmabuf_allocator, fd, xf->size);
+	if (mem == NULL) {
+		U_LOG_E("gst_dmabuf_allocator_alloc failed.");
+		close(fd);
 		return;
 	}
-	GstStructure *custom_structure = gst_custom_meta_get_structure(custom_meta);
-	gst_structure_set(custom_structure, "protobuf", GST_TYPE_BUFFER, struct_buf, NULL);
 
-	gst_buffer_unref(struct_buf);
+	/* Keep the frame alive for as long as the memory is, encoders may hold on to imported memory. */
+	struct xrt_frame *taken = NULL;
+	xrt_frame_reference(&taken, xf);
+	gst_mini_object_set_qdata(GST_MINI_OBJECT(mem), g_quark_from_static_string("ems-xrt-frame"), taken,
+	                          wrapped_buffer_destroy);
 
+	GstBuffer *buffer = gst_buffer_new();
+	gst_buffer_append_memory(buffer, mem);
 
-	// All done, send it to the gstreamer pipeline.
-	ret = gst_app_src_push_buffer((GstAppSrc *)gs->appsrc, buffer);
-	if (ret != GST_FLOW_OK) {
-		U_LOG_E("Got GST error '%i'", ret);
+	add_video_meta(buffer, xf);
+	push_buffer(gs, buffer, xf->timestamp, down_msg);
+}
+
+void
+ems_gstreamer_src_push_encoded(struct ems_gstreamer_src *gs,
+                               uint64_t timestamp_ns,
+                               GBytes *au,
+                               bool keyframe,
+                               const em_proto_DownMessage *down_msg)
+{
+	SINK_TRACE_MARKER();
+
+	GstBuffer *buffer = gst_buffer_new_wrapped_bytes(au);
+	if (!keyframe) {
+		GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
 	}
+
+	push_buffer(gs, buffer, timestamp_ns, down_msg);
 }
 
 static void
@@ -185,21 +391,262 @@ destroy(struct xrt_frame_node *node)
 	 * be called, it's now safe to destroy and free ourselves.
 	 */
 
+	ems_gstreamer_src_clear_frame_pool(gs);
+	gst_clear_object(&gs->dmabuf_allocator);
+
+	if (gs->encoder_src_pad != NULL) {
+		gst_pad_remove_probe(gs->encoder_src_pad, gs->encoder_probe_id);
+		gst_clear_object(&gs->encoder_src_pad);
+	}
+	g_mutex_clear(&gs->pending_mutex);
+
 	free(gs);
 }
 
 
+/*
+ *
+ * Frame pool.
+ *
+ */
+
+#define EMS_TYPE_FRAME_POOL (ems_frame_pool_get_type())
+G_DECLARE_FINAL_TYPE(EmsFramePool, ems_frame_pool, EMS, FRAME_POOL, GstBufferPool)
+
+/*!
+ * One buffer per frame of a fixed set, each made once with its video and
+ * DownMessage metas attached. Pushing a pooled frame allocates nothing.
+ */
+struct _EmsFramePool
+{
+	GstBufferPool parent;
+
+	//! Referenced for as long as the pool lives.
+	struct xrt_frame *frames[EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES];
+
+	//! Owned by the frames, -1 when wrapping host memory.
+	int dmabuf_fds[EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES];
+
+	guint frame_count;
+
+	//! Null when wrapping host memory.
+	GstAllocator *dmabuf_allocator;
+
+	//! Protects @ref wrapped.
+	GMutex mutex;
+
+	//! Some memory still wraps the frame, encoders may hold it past the buffer.
+	bool wrapped[EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES];
+};
+
+G_DEFINE_TYPE(EmsFramePool, ems_frame_pool, GST_TYPE_BUFFER_POOL)
+
+/*!
+ * Set on the memory of pooled buffers, keeps the frame alive with the memory
+ * and lets the pool wrap the frame again once the memory is gone.
+ */
+struct frame_pool_memory
+{
+	GWeakRef pool;
+	guint index;
+	struct xrt_frame *frame;
+};
+
+static GQuark
+frame_pool_memory_quark(void)
+{
+	return g_quark_from_static_string("ems-frame-pool-memory");
+}
+
+static void
+frame_pool_memory_destroy(gpointer data)
+{
+	struct frame_pool_memory *fpm = (struct frame_pool_memory *)data;
+
+	EmsFramePool *pool = g_weak_ref_get(&fpm->pool);
+	if (pool != NULL) {
+		g_mutex_lock(&pool->mutex);
+		pool->wrapped[fpm->index] = false;
+		g_mutex_unlock(&pool->mutex);
+		gst_object_unref(pool);
+	}
+
+	g_weak_ref_clear(&fpm->pool);
+	xrt_frame_reference(&fpm->frame, NULL);
+	g_free(fpm);
+}
+
+//! Which frame of the pool @p buffer wraps.
+static guint
+frame_pool_buffer_index(GstBuffer *buffer)
+{
+	struct frame_pool_memory *fpm = (struct frame_pool_memory *)gst_mini_object_get_qdata(
+	    GST_MINI_OBJECT(gst_buffer_peek_memory(buffer, 0)), frame_pool_memory_quark());
+	return fpm->index;
+}
+
+static GstFlowReturn
+ems_frame_pool_alloc_buffer(GstBufferPool *bpool, GstBuffer **out_buffer, GstBufferPoolAcquireParams *params)
+{
+	EmsFramePool *pool = EMS_FRAME_POOL(bpool);
+	(void)params;
+
+	// Buffers are only made again after the pool dropped one with shared memory, take a frame nobody wraps.
+	int index = -1;
+	g_mutex_lock(&pool->mutex);
+	for (guint i = 0; i < pool->frame_count; i++) {
+		if (!pool->wrapped[i]) {
+			pool->wrapped[i] = true;
+			index = (int)i;
+			break;
+		}
+	}
+	g_mutex_unlock(&pool->mutex);
+
+	if (index < 0) {
+		return GST_FLOW_EOS;
+	}
+
+	struct xrt_frame *xf = pool->frames[index];
+	GstMemory *mem = NULL;
+
+	if (pool->dmabuf_allocator != NULL) {
+		// The memory closes its fd when freed, the frame keeps the original.
+		int fd = dup(pool->dmabuf_fds[index]);
+		if (fd >= 0) {
+			mem = gst_dmabuf_allocator_alloc(pool->dmabuf_allocator, fd, xf->size);
+			if (mem == NULL) {
+				close(fd);
+			}
+		}
+	} else {
+		mem = gst_memory_new_wrapped(0, xf->data, xf->size, 0, xf->size, NULL, NULL);
+	}
+
+	if (mem == NULL) {
+		U_LOG_E("Failed to wrap frame %i of the pool.", index);
+		g_mutex_lock(&pool->mutex);
+		pool->wrapped[index] = false;
+		g_mutex_unlock(&pool->mutex);
+		return GST_FLOW_ERROR;
+	}
+
+	struct frame_pool_memory *fpm = g_new0(struct frame_pool_memory, 1);
+	g_weak_ref_init(&fpm->pool, pool);
+	fpm->index = (guint)index;
+	xrt_frame_reference(&fpm->frame, xf);
+	gst_mini_object_set_qdata(GST_MINI_OBJECT(mem), frame_pool_memory_quark(), fpm, frame_pool_memory_destroy);
+
+	GstBuffer *buffer = gst_buffer_new();
+	gst_buffer_append_memory(buffer, mem);
+
+	// Pooled metas survive the reset when the buffer comes back, the DownMessage is encoded over on each push.
+	GstVideoMeta *vmeta = add_video_meta(buffer, xf);
+	GST_META_FLAG_SET(&vmeta->meta, GST_META_FLAG_POOLED);
+	GstMeta *dmm = gst_buffer_add_meta(buffer, EMS_DOWN_MESSAGE_META_INFO, NULL);
+	GST_META_FLAG_SET(dmm, GST_META_FLAG_POOLED);
+
+	*out_buffer = buffer;
+	return GST_FLOW_OK;
+}
+
+static void
+ems_frame_pool_finalize(GObject *object)
+{
+	EmsFramePool *pool = EMS_FRAME_POOL(object);
+
+	for (guint i = 0; i < pool->frame_count; i++) {
+		xrt_frame_reference(&pool->frames[i], NULL);
+	}
+	gst_clear_object(&pool->dmabuf_allocator);
+	g_mutex_clear(&pool->mutex);
+
+	G_OBJECT_CLASS(ems_frame_pool_parent_class)->finalize(object);
+}
+
+static void
+ems_frame_pool_class_init(EmsFramePoolClass *klass)
+{
+	G_OBJECT_CLASS(klass)->finalize = ems_frame_pool_finalize;
+	GST_BUFFER_POOL_CLASS(klass)->alloc_buffer = ems_frame_pool_alloc_buffer;
+}
+
+static void
+ems_frame_pool_init(EmsFramePool *pool)
+{
+	g_mutex_init(&pool->mutex);
+}
+
+/*!
+ * Takes the buffer acquired for @p xf back from the source, or NULL.
+ */
+static GstBuffer *
+take_acquired_buffer(struct ems_gstreamer_src *gs, struct xrt_frame *xf)
+{
+	if (gs->frame_pool == NULL) {
+		return NULL;
+	}
+
+	EmsFramePool *pool = EMS_FRAME_POOL(gs->frame_pool);
+	for (guint i = 0; i < pool->frame_count; i++) {
+		if (pool->frames[i] == xf) {
+			GstBuffer *buffer = gs->acquired[i];
+			gs->acquired[i] = NULL;
+			return buffer;
+		}
+	}
+
+	return NULL;
+}
+
+
+
 /*
  *
  * Exported functions.
  *
  */
 
+/*!
+ * Turn raw caps into caps for the same frames in linear dmabufs. Since 1.24
+ * encoders negotiate those as DMA_DRM with a drm-format, before that as the
+ * plain format with the memory:DMABuf feature.
+ */
+static void
+set_dmabuf_caps(GstCaps **caps)
+{
+#if GST_CHECK_VERSION(1, 24, 0)
+	GstVideoInfo vinfo;
+	GstVideoInfoDmaDrm drm_info;
+	if (gst_video_info_from_caps(&vinfo, *caps) &&
+	    gst_video_info_dma_drm_from_video_info(&drm_info, &vinfo, DRM_FORMAT_MOD_LINEAR)) {
+		gst_caps_unref(*caps);
+		*caps = gst_video_info_dma_drm_to_caps(&drm_info);
+		return;
+	}
+	U_LOG_W("No DMA_DRM caps for the stream format, using memory:DMABuf with the plain format.");
+#endif
+	gst_caps_set_features(*caps, 0, gst_caps_features_new(GST_CAPS_FEATURE_MEMORY_DMABUF, NULL));
+}
+
+void
+ems_gstreamer_src_set_regions_of_interest(struct ems_gstreamer_src *gs,
+                                          const struct ems_gstreamer_src_roi *rois,
+                                          uint32_t count)
+{
+	gs->roi_count = MIN(count, EMS_GSTREAMER_SRC_MAX_ROIS);
+	for (uint32_t i = 0; i < gs->roi_count; i++) {
+		gs->rois[i] = rois[i];
+	}
+}
+
 void
 ems_gstreamer_src_create_with_pipeline(struct gstreamer_pipeline *gp,
                                        uint32_t width,
                                        uint32_t height,
+                                       uint32_t framerate,
                                        enum xrt_format format,
+                                       gboolean dmabuf,
                                        const char *appsrc_name,
                                        struct ems_gstreamer_src **out_gs,
                                        struct xrt_frame_sink **out_xfs)
@@ -211,14 +658,13 @@ ems_gstreamer_src_create_with_pipeline(struct gstreamer_pipeline *gp,
 	case XRT_FORMAT_R8G8B8X8: format_str = "RGBx"; break;
 	case XRT_FORMAT_YUYV422: format_str = "YUY2"; break;
 	case XRT_FORMAT_L8: format_str = "GRAY8"; break;
+	case EMS_XRT_FORMAT_NV12: format_str = "NV12"; break;
+	case EMS_XRT_FORMAT_H264: break;
 	default: assert(false); break;
 	}
 
-	const gchar *tags[] = {NULL};
-	const GstMetaInfo *info = gst_meta_register_custom("down-message", tags, NULL, NULL, NULL);
-	if (info == NULL) {
-		U_LOG_E("Failed to register custom meta 'down-message'.");
-	}
+	// Register before streaming starts rather than on the first frame.
+	ems_down_message_meta_get_info();
 
 	struct ems_gstreamer_src *gs = U_TYPED_CALLOC(struct ems_gstreamer_src);
 	// gs->base.push_frame = push_frame;
@@ -226,15 +672,42 @@ ems_gstreamer_src_create_with_pipeline(struct gstreamer_pipeline *gp,
 	gs->node.destroy = destroy;
 	gs->gp = gp;
 	gs->appsrc = gst_bin_get_by_name(GST_BIN(gp->pipeline), appsrc_name);
+	g_mutex_init(&gs->pending_mutex);
+	gs->last_encoded_sequence_id = -1;
+
+
+	GstCaps *caps = NULL;
+	if (format == EMS_XRT_FORMAT_H264) {
+		// Already encoded in the compositor, h264parse takes it from here.
+		caps = gst_caps_new_simple(                        //
+		    "video/x-h264",                                //
+		    "stream-format", G_TYPE_STRING, "byte-stream", //
+		    "alignment", G_TYPE_STRING, "au",              //
+		    "profile", G_TYPE_STRING, "main",              //
+		    "width", G_TYPE_INT, width,                    //
+		    "height", G_TYPE_INT, height,                  //
+		    "framerate", GST_TYPE_FRACTION, framerate, 1,  //
+		    NULL);
+	} else {
+		caps = gst_caps_new_simple(                       //
+		    "video/x-raw",                                //
+		    "format", G_TYPE_STRING, format_str,          //
+		    "width", G_TYPE_INT, width,                   //
+		    "height", G_TYPE_INT, height,                 //
+		    "framerate", GST_TYPE_FRACTION, framerate, 1, //
+		    NULL);
+	}
 
+	// Matches the conversion done by the compositor's compute shader.
+	if (format == EMS_XRT_FORMAT_NV12) {
+		gst_caps_set_simple(caps, "colorimetry", G_TYPE_STRING, "bt709", NULL);
+	}
 
-	GstCaps *caps = gst_caps_new_simple(       //
-	    "video/x-raw",                         //
-	    "format", G_TYPE_STRING, format_str,   //
-	    "width", G_TYPE_INT, width,            //
-	    "height", G_TYPE_INT, height,          //
-	    "framerate", GST_TYPE_FRACTION, 90, 1, //
-	    NULL);
+	// Linear NV12 in exported Vulkan memory, the encoder imports it directly.
+	if (dmabuf) {
+		set_dmabuf_caps(&caps);
+		gs->dmabuf_allocator = gst_dmabuf_allocator_new();
+	}
 
 	g_object_set(G_OBJECT(gs->appsrc),                      //
 	             "caps", caps,                              //
@@ -254,3 +727,154 @@ ems_gstreamer_src_create_with_pipeline(struct gstreamer_pipeline *gp,
 	*out_gs = gs;
 	*out_xfs = &gs->base;
 }
+
+bool
+ems_gstreamer_src_use_frame_pool(struct ems_gstreamer_src *gs,
+                                 struct xrt_frame *const *frames,
+                                 const int *dmabuf_fds,
+                                 uint32_t count)
+{
+	if (count == 0 || count > EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES) {
+		U_LOG_E("Can not pool %u frames, at most %d.", count, EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES);
+		return false;
+	}
+
+	if (dmabuf_fds != NULL && gs->dmabuf_allocator == NULL) {
+		U_LOG_E("Source was not created for dmabuf.");
+		return false;
+	}
+
+	EmsFramePool *pool = (EmsFramePool *)g_object_new(EMS_TYPE_FRAME_POOL, NULL);
+	gst_object_ref_sink(pool);
+
+	for (uint32_t i = 0; i < count; i++) {
+		xrt_frame_reference(&pool->frames[i], frames[i]);
+		pool->dmabuf_fds[i] = dmabuf_fds != NULL ? dmabuf_fds[i] : -1;
+	}
+	pool->frame_count = count;
+	if (dmabuf_fds != NULL) {
+		pool->dmabuf_allocator = (GstAllocator *)gst_object_ref(gs->dmabuf_allocator);
+	}
+
+	// Exactly one buffer per frame, all made when activating.
+	GstBufferPool *bpool = GST_BUFFER_POOL(pool);
+	GstStructure *config = gst_buffer_pool_get_config(bpool);
+	gst_buffer_pool_config_set_params(config, NULL, frames[0]->size, count, count);
+	if (!gst_buffer_pool_set_config(bpool, config) || !gst_buffer_pool_set_active(bpool, TRUE)) {
+		U_LOG_E("Failed to activate the frame pool.");
+		gst_object_unref(pool);
+		return false;
+	}
+
+	gs->frame_pool = bpool;
+
+	return true;
+}
+
+bool
+ems_gstreamer_src_acquire_frame(struct ems_gstreamer_src *gs, struct xrt_frame **out_frame)
+{
+	SINK_TRACE_MARKER();
+
+	GstBufferPoolAcquireParams params = {0};
+	params.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT;
+
+	// Before the readback too, the frame would only be dropped further down.
+	GstBuffer *buffer = NULL;
+	if (gs->frame_pool == NULL || over_budget(gs) ||
+	    gst_buffer_pool_acquire_buffer(gs->frame_pool, &buffer, &params) != GST_FLOW_OK) {
+		gs->skipped_frames++;
+		return false;
+	}
+
+	// Each buffer is held by one frame at a time, so no lock is needed for its slot.
+	guint index = frame_pool_buffer_index(buffer);
+	assert(gs->acquired[index] == NULL);
+	gs->acquired[index] = buffer;
+
+	xrt_frame_reference(out_frame, EMS_FRAME_POOL(gs->frame_pool)->frames[index]);
+
+	return true;
+}
+
+void
+ems_gstreamer_src_push_pooled_frame(struct ems_gstreamer_src *gs,
+                                    struct xrt_frame *xf,
+                                    const em_proto_DownMessage *down_msg)
+{
+	SINK_TRACE_MARKER();
+
+	GstBuffer *buffer = take_acquired_buffer(gs, xf);
+	if (buffer == NULL) {
+		U_LOG_E("Frame was not acquired from the pool.");
+		return;
+	}
+
+	complain_if_wrong_image_size(xf);
+
+	push_buffer(gs, buffer, xf->timestamp, down_msg);
+}
+
+void
+ems_gstreamer_src_release_frame(struct ems_gstreamer_src *gs, struct xrt_frame *xf)
+{
+	GstBuffer *buffer = take_acquired_buffer(gs, xf);
+	if (buffer != NULL) {
+		gst_buffer_unref(buffer);
+	}
+}
+
+void
+ems_gstreamer_src_clear_frame_pool(struct ems_gstreamer_src *gs)
+{
+	if (gs->frame_pool == NULL) {
+		return;
+	}
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(gs->acquired); i++) {
+		gst_clear_buffer(&gs->acquired[i]);
+	}
+
+	gst_buffer_pool_set_active(gs->frame_pool, FALSE);
+	gst_clear_object(&gs->frame_pool);
+}
+
+void
+ems_gstreamer_src_set_latency_budget(struct ems_gstreamer_src *gs, uint64_t budget_ns)
+{
+	if (budget_ns == 0 || gs->encoder_src_pad != NULL) {
+		return;
+	}
+
+	// Frames pushed already encoded have nothing before them to save.
+	GstElement *encoder = gst_bin_get_by_name(GST_BIN(gs->gp->pipeline), EMS_ENCODER_ELEMENT_NAME);
+	if (encoder == NULL) {
+		return;
+	}
+
+	gs->latency_budget_ns = budget_ns;
+	gs->encoder_src_pad = gst_element_get_static_pad(encoder, "src");
+	gs->encoder_probe_id =
+	    gst_pad_add_probe(gs->encoder_src_pad, GST_PAD_PROBE_TYPE_BUFFER, encoder_src_probe, gs, NULL);
+	gst_object_unref(encoder);
+
+	U_LOG_I("Dropping frames before encoding past %.1f ms in the pipeline", (double)budget_ns / 1e6);
+}
+
+void
+ems_gstreamer_src_set_framerate(struct ems_gstreamer_src *gs, uint32_t framerate)
+{
+	GstCaps *caps = NULL;
+	g_object_get(G_OBJECT(gs->appsrc), "caps", &caps, NULL);
+	if (caps == NULL) {
+		return;
+	}
+
+	// The appsrc sends the new caps in order with the buffers that follow.
+	caps = gst_caps_make_writable(caps);
+	gst_caps_set_simple(caps, "framerate", GST_TYPE_FRACTION, (gint)framerate, 1, NULL);
+	g_object_set(G_OBJECT(gs->appsrc), "caps", caps, NULL);
+	gst_caps_unref(caps);
+
+	U_LOG_I("Streaming at %u fps", framerate);
+}
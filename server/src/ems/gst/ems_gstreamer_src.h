@@ -21,14 +21,145 @@ extern "C" {
 struct ems_gstreamer_src;
 struct gstreamer_pipeline;
 
+/*!
+ * Monado has no NV12 format, frames with this format carry a full size Y plane
+ * followed by the interleaved half size UV plane, both with the frame's stride.
+ */
+#define EMS_XRT_FORMAT_NV12 ((enum xrt_format)0x10000)
+
+/*!
+ * Not a pixel format, the source carries H.264 byte-stream access units
+ * encoded in the compositor, see @ref ems_gstreamer_src_push_encoded.
+ */
+#define EMS_XRT_FORMAT_H264 ((enum xrt_format)0x10001)
+
+typedef struct _em_proto_DownMessage em_proto_DownMessage;
+
+//! Most regions of interest on a frame, see @ref ems_gstreamer_src_set_regions_of_interest.
+#define EMS_GSTREAMER_SRC_MAX_ROIS (2)
+
+/*!
+ * A rectangle of the frame in pixels the encoder should spend more or fewer bits on.
+ */
+struct ems_gstreamer_src_roi
+{
+	uint32_t x;
+	uint32_t y;
+	uint32_t w;
+	uint32_t h;
+
+	//! Added to the QP within, negative for more bits.
+	int32_t qp_delta;
+};
+
+/*!
+ * Push a frame, @p down_msg goes with it to the payloader.
+ */
+void
+ems_gstreamer_src_push_frame(struct ems_gstreamer_src *gs,
+                             struct xrt_frame *xf,
+                             const em_proto_DownMessage *down_msg);
+
+/*!
+ * Push a frame whose pixels live in a dmabuf instead of @ref xrt_frame::data,
+ * the fd is dup'ed so ownership stays with the caller. The source must have
+ * been created with dmabuf enabled.
+ */
+void
+ems_gstreamer_src_push_frame_dmabuf(struct ems_gstreamer_src *gs,
+                                    struct xrt_frame *xf,
+                                    int dmabuf_fd,
+                                    const em_proto_DownMessage *down_msg);
+
+/*!
+ * Push an H.264 access unit, takes a reference on @p au. The source must have
+ * been created with @ref EMS_XRT_FORMAT_H264.
+ */
+void
+ems_gstreamer_src_push_encoded(struct ems_gstreamer_src *gs,
+                               uint64_t timestamp_ns,
+                               GBytes *au,
+                               bool keyframe,
+                               const em_proto_DownMessage *down_msg);
+
+/*!
+ * Wrap each of @p frames in a buffer once, with its metas attached, and push
+ * them from that pool from now on, see @ref ems_gstreamer_src_acquire_frame.
+ * Takes a reference on the frames for as long as the pool lives. @p dmabuf_fds
+ * are the frames' fds if the source was created with dmabuf, NULL otherwise.
+ */
+bool
+ems_gstreamer_src_use_frame_pool(struct ems_gstreamer_src *gs,
+                                 struct xrt_frame *const *frames,
+                                 const int *dmabuf_fds,
+                                 uint32_t count);
+
+/*!
+ * Take a frame whose buffer the pipeline is done with, never waits. Fails and
+ * counts a skipped frame when the pipeline still holds all of them or is over
+ * its latency budget, so the caller can drop the frame before spending any GPU
+ * time on it.
+ */
+bool
+ems_gstreamer_src_acquire_frame(struct ems_gstreamer_src *gs, struct xrt_frame **out_frame);
+
+/*!
+ * Push a frame from @ref ems_gstreamer_src_acquire_frame, its pooled buffer
+ * gets the timestamp and @p down_msg.
+ */
+void
+ems_gstreamer_src_push_pooled_frame(struct ems_gstreamer_src *gs,
+                                    struct xrt_frame *xf,
+                                    const em_proto_DownMessage *down_msg);
+
+/*!
+ * Give the buffer of an acquired frame back to the pool without pushing it,
+ * does nothing if the frame was pushed or is not pooled.
+ */
+void
+ems_gstreamer_src_release_frame(struct ems_gstreamer_src *gs, struct xrt_frame *xf);
+
+/*!
+ * Stop pooling and drop the frames once the pipeline has let go of them,
+ * call after stopping the pipeline and before destroying the frames' owner.
+ */
+void
+ems_gstreamer_src_clear_frame_pool(struct ems_gstreamer_src *gs);
+
+/*!
+ * Change the frame rate in the caps of the source, the frames that follow are
+ * pushed at it. Renegotiates downstream, only call it from the pushing thread.
+ */
+void
+ems_gstreamer_src_set_framerate(struct ems_gstreamer_src *gs, uint32_t framerate);
+
+/*!
+ * Attach the @p count regions, at most @ref EMS_GSTREAMER_SRC_MAX_ROIS, to the
+ * raw frames that follow as GstVideoRegionOfInterestMeta, 0 for none. Only
+ * encoders that read the meta's roi/va parameter act on them, the others pass
+ * them by. Only call it from the pushing thread.
+ */
+void
+ems_gstreamer_src_set_regions_of_interest(struct ems_gstreamer_src *gs,
+                                          const struct ems_gstreamer_src_roi *rois,
+                                          uint32_t count);
+
+/*!
+ * Drop raw frames before any conversion or encoding once the oldest frame
+ * in the pipeline has taken @p budget_ns without coming out of the encoder,
+ * 0 for never. Encoded frames are never dropped, the client cannot decode past
+ * a missing one. Call it once, before streaming.
+ */
 void
-ems_gstreamer_src_push_frame(struct ems_gstreamer_src *gs, struct xrt_frame *xf, GBytes *downMsg_bytes);
+ems_gstreamer_src_set_latency_budget(struct ems_gstreamer_src *gs, uint64_t budget_ns);
 
 void
 ems_gstreamer_src_create_with_pipeline(struct gstreamer_pipeline *gp,
                                        uint32_t width,
                                        uint32_t height,
+                                       uint32_t framerate,
                                        enum xrt_format format,
+                                       gboolean dmabuf,
                                        const char *appsrc_name,
                                        struct ems_gstreamer_src **out_gs,
                                        struct xrt_frame_sink **out_xfs);
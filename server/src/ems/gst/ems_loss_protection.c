@@ -0,0 +1,97 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Picks the FEC and retransmission of a client's stream from the loss and round trip it reports.
+ */
+
+#include "ems_loss_protection.h"
+
+#include "util/u_logging.h"
+
+#include <math.h>
+
+//! Below this loss the stream goes unprotected.
+#define LOSS_THRESHOLD 0.005
+
+//! Loss goes up quickly and comes down slowly, a burst tends to come back.
+#define LOSS_SMOOTHING_UP 0.5
+#define LOSS_SMOOTHING_DOWN 0.1
+
+//! XOR FEC recovers one packet per FEC packet, so it needs a few times the loss to catch random losses.
+#define FEC_PER_LOSS 3.0
+//! With retransmissions behind it FEC only needs to catch what they won't in time.
+#define FEC_PER_LOSS_WITH_NACK 1.5
+#define FEC_STEP 5
+#define FEC_MAX 50
+
+//! The FEC packets follow the last packet of a frame, the client waits this long for them.
+#define FEC_LATENCY_MS 2
+//! Time for the client to notice a gap and the retransmission to be sent, on top of the round trip.
+#define NACK_MARGIN_MS 2
+//! A latency change smaller than this is noise in the round trip.
+#define LATENCY_HYSTERESIS_MS 2
+
+void
+ems_loss_protection_init(struct ems_loss_protection *lp)
+{
+	lp->loss = 0.0;
+	lp->have_loss = false;
+	lp->fec_percentage = 0;
+	lp->nack = false;
+	lp->latency_ms = 0;
+}
+
+bool
+ems_loss_protection_update(struct ems_loss_protection *lp,
+                           double fraction_lost,
+                           double rtt_ms,
+                           double frame_interval_ms)
+{
+	fraction_lost = CLAMP(fraction_lost, 0.0, 1.0);
+	if (!lp->have_loss) {
+		lp->loss = fraction_lost;
+		lp->have_loss = true;
+	} else {
+		double alpha = fraction_lost > lp->loss ? LOSS_SMOOTHING_UP : LOSS_SMOOTHING_DOWN;
+		lp->loss += alpha * (fraction_lost - lp->loss);
+	}
+
+	bool lossy = lp->loss >= LOSS_THRESHOLD;
+	bool nack = lossy && rtt_ms > 0.0 && rtt_ms + NACK_MARGIN_MS < frame_interval_ms;
+
+	uint32_t fec = 0;
+	if (lossy) {
+		double percentage = lp->loss * 100.0 * (nack ? FEC_PER_LOSS_WITH_NACK : FEC_PER_LOSS);
+		fec = (uint32_t)ceil(percentage / FEC_STEP) * FEC_STEP;
+		fec = MIN(fec, FEC_MAX);
+	}
+
+	uint32_t latency_ms = 0;
+	if (nack) {
+		latency_ms = (uint32_t)ceil(rtt_ms) + NACK_MARGIN_MS;
+	} else if (fec > 0) {
+		latency_ms = FEC_LATENCY_MS;
+	}
+
+	// Keep the current latency while the round trip only wobbles.
+	if (nack == lp->nack && latency_ms != 0 && lp->latency_ms != 0 &&
+	    ABS((int32_t)latency_ms - (int32_t)lp->latency_ms) < LATENCY_HYSTERESIS_MS) {
+		latency_ms = lp->latency_ms;
+	}
+
+	if (fec == lp->fec_percentage && nack == lp->nack && latency_ms == lp->latency_ms) {
+		return false;
+	}
+
+	U_LOG_I("Loss %.1f%%, round trip %.1f ms: FEC %u%%, %s, client latency %u ms", lp->loss * 100.0, rtt_ms, fec,
+	        nack ? "retransmitting" : "no retransmissions", latency_ms);
+
+	lp->fec_percentage = fec;
+	lp->nack = nack;
+	lp->latency_ms = latency_ms;
+
+	return true;
+}
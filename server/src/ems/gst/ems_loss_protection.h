@@ -0,0 +1,56 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Picks the FEC and retransmission of a client's stream from the loss and round trip it reports.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+G_BEGIN_DECLS
+
+/*!
+ * Loss protection of one client. Nothing is spent while the link is clean,
+ * the client only holds packets back once there is something to recover.
+ */
+struct ems_loss_protection
+{
+	//! Smoothed fraction of the packets lost, from the RTCP receiver reports.
+	double loss;
+	bool have_loss;
+
+	//! FEC packets per 100 media packets.
+	uint32_t fec_percentage;
+
+	//! Retransmissions can arrive within a frame interval.
+	bool nack;
+
+	//! How long the client's jitterbuffer waits for a missing packet.
+	uint32_t latency_ms;
+};
+
+void
+ems_loss_protection_init(struct ems_loss_protection *lp);
+
+/*!
+ * Take in the latest receiver report.
+ *
+ * @param fraction_lost Of the packets since the last report.
+ * @param rtt_ms Round trip time, 0 if unknown.
+ * @param frame_interval_ms Of the stream, a packet recovered later than that is no use.
+ *
+ * @return true if the FEC, retransmission or latency changed.
+ */
+bool
+ems_loss_protection_update(struct ems_loss_protection *lp,
+                           double fraction_lost,
+                           double rtt_ms,
+                           double frame_interval_ms);
+
+G_END_DECLS
@@ -9,6 +9,10 @@
  */
 
 #include "ems_pipeline_args.h"
+#include "ems_encoders.h"
+#include "em_thread_sched.h"
+
+#include <gst/gst.h>
 
 static struct ems_arguments arguments_instance;
 
@@ -19,11 +23,47 @@ ems_arguments_get()
 }
 
 gchar *output_file_name = NULL;
+gchar *capture_file_name = NULL;
+gchar *replay_file_name = NULL;
 gchar *encoder_name = NULL;
+gchar *direct_name = NULL;
+gchar *cpu_affinity_list = NULL;
 gboolean benchmark_down_msg = FALSE;
+gboolean cpu_color_convert = FALSE;
+gboolean dmabuf = FALSE;
+gboolean fixed_bitrate = FALSE;
+gboolean intra_refresh = FALSE;
+gboolean foveation = FALSE;
+gboolean dynamic_resolution = FALSE;
+gboolean fixed_pacing = FALSE;
+gboolean depth = FALSE;
+gboolean up_message_thread = FALSE;
+gboolean loss_protection = FALSE;
+gboolean roi = FALSE;
+gboolean motion_vectors = FALSE;
+gboolean realtime = FALSE;
 
 // defaults
 static gint bitrate = 16384;
+static gint framerate = 90;
+static gint slices = 0;
+static gint readback_frames_in_flight = 2;
+static gint stream_width = 0;
+static gint stream_height = 0;
+static gint readback_scale = 2;
+static gint direct_port = 61990;
+static gint bitrate_min = 2048;
+static gint bitrate_max = 32768;
+static gint bitrate_ramp_up = 4096;
+static gint bitrate_ramp_down = 32768;
+static gdouble foveation_size = 0.5;
+static gdouble foveation_edge_ratio = 0.4;
+static gdouble dynamic_resolution_min = 0.5;
+static gdouble roi_size = 0.4;
+static gint roi_qp_delta = -8;
+static gdouble pacing_margin = 2.0;
+static gdouble latency_budget = 40.0;
+static gint thread_nice = 0;
 static EmsEncoderType default_encoder_type = EMS_ENCODER_TYPE_X264;
 
 gboolean
@@ -36,13 +76,56 @@ ems_arguments_parse(int argc, char *argv[])
 	// clang-format off
 	static GOptionEntry entries[] = {
 		{"stream-output-file-path", 'o', 0, G_OPTION_ARG_FILENAME, &output_file_name, "Path to store the stream in a MKV file.", "path"},
+		{"capture", 0, 0, G_OPTION_ARG_FILENAME, &capture_file_name, "Record the UpMessages and DownMessages of the session to a file", "path"},
+		{"replay", 0, 0, G_OPTION_ARG_FILENAME, &replay_file_name, "Feed the poses of a capture to the app instead of the client's", "path"},
 		{"bitrate", 'b', 0, G_OPTION_ARG_INT, &bitrate, "Stream bitrate", "N"},
-		{"encoder", 'e', 0, G_OPTION_ARG_STRING, &encoder_name, "Encoder (x264, nvh264)", "str"},
-		{"benchmark-down-msg", 0, 0, G_OPTION_ARG_NONE, &benchmark_down_msg, "Benchmark DownMessage Loss", NULL},
+		{"fixed-bitrate", 0, 0, G_OPTION_ARG_NONE, &fixed_bitrate, "Keep the bitrate, don't adapt it to congestion", NULL},
+		{"bitrate-min", 0, 0, G_OPTION_ARG_INT, &bitrate_min, "Lowest adaptive bitrate in kbit/s", "N"},
+		{"bitrate-max", 0, 0, G_OPTION_ARG_INT, &bitrate_max, "Highest adaptive bitrate in kbit/s", "N"},
+		{"bitrate-ramp-up", 0, 0, G_OPTION_ARG_INT, &bitrate_ramp_up, "Adaptive bitrate increase in kbit/s per second", "N"},
+		{"bitrate-ramp-down", 0, 0, G_OPTION_ARG_INT, &bitrate_ramp_down, "Adaptive bitrate decrease in kbit/s per second", "N"},
+		{"encoder", 'e', 0, G_OPTION_ARG_STRING, &encoder_name, NULL, "str"},
+		{"intra-refresh", 0, 0, G_OPTION_ARG_NONE, &intra_refresh, "Intra refresh instead of periodic IDR frames", NULL},
+		{"loss-protection", 0, 0, G_OPTION_ARG_NONE, &loss_protection, "FEC and retransmissions following the loss the clients report", NULL},
+		{"slices", 0, 0, G_OPTION_ARG_INT, &slices, "Slices per frame, the client decodes them as they arrive, 0 for the encoder default", "N"},
+		{"benchmark-down-msg", 0, 0, G_OPTION_ARG_NONE, &benchmark_down_msg, "Log DownMessage loss every 5 seconds", NULL},
+		{"cpu-color-convert", 0, 0, G_OPTION_ARG_NONE, &cpu_color_convert, "Convert to NV12 on the CPU with videoconvert", NULL},
+		{"dmabuf", 0, 0, G_OPTION_ARG_NONE, &dmabuf, "Zero-copy dmabuf frames to the encoder, needs a VA encoder", NULL},
+		{"width", 0, 0, G_OPTION_ARG_INT, &stream_width, "Stream width with both views side by side, 0 to derive it", "N"},
+		{"height", 0, 0, G_OPTION_ARG_INT, &stream_height, "Stream height, 0 to derive it", "N"},
+		{"readback-scale", 0, 0, G_OPTION_ARG_INT, &readback_scale, "Divide the view size by this for the stream", "N"},
+		{"foveation", 0, 0, G_OPTION_ARG_NONE, &foveation, "Spend more of the stream on the center of the views", NULL},
+		{"foveation-size", 0, 0, G_OPTION_ARG_DOUBLE, &foveation_size, "Fraction of each axis kept at full resolution", "F"},
+		{"foveation-edge-ratio", 0, 0, G_OPTION_ARG_DOUBLE, &foveation_edge_ratio, "Resolution of the edges relative to the center", "F"},
+		{"roi", 0, 0, G_OPTION_ARG_NONE, &roi, "Lower the QP around the lens centres, for encoders that read region of interest metas", NULL},
+		{"roi-size", 0, 0, G_OPTION_ARG_DOUBLE, &roi_size, "Fraction of each axis of the views around the lens centres with --roi", "F"},
+		{"roi-qp-delta", 0, 0, G_OPTION_ARG_INT, &roi_qp_delta, "QP offset around the lens centres with --roi, negative for more bits", "N"},
+		{"motion-vectors", 0, 0, G_OPTION_ARG_NONE, &motion_vectors, "Send the motion of the content with each frame, for the client to extrapolate late frames", NULL},
+		{"dynamic-resolution", 0, 0, G_OPTION_ARG_NONE, &dynamic_resolution, "Scale the views down while encoding overruns or the bitrate drops", NULL},
+		{"dynamic-resolution-min", 0, 0, G_OPTION_ARG_DOUBLE, &dynamic_resolution_min, "Smallest scale of the views with --dynamic-resolution", "F"},
+		{"depth", 0, 0, G_OPTION_ARG_NONE, &depth, "Stream the depth of projection layers that have it, for positional reprojection", NULL},
+		{"framerate", 0, 0, G_OPTION_ARG_INT, &framerate, "Preferred frame rate, the closest one the client display has is used", "N"},
+		{"fixed-pacing", 0, 0, G_OPTION_ARG_NONE, &fixed_pacing, "Render at the nominal rate, don't lock to the client display", NULL},
+		{"pacing-margin", 0, 0, G_OPTION_ARG_DOUBLE, &pacing_margin, "Milliseconds a frame should be decoded before the client needs it", "MS"},
+		{"latency-budget", 0, 0, G_OPTION_ARG_DOUBLE, &latency_budget, "Milliseconds a frame may take to the encoder output before new ones are dropped, 0 for no limit", "MS"},
+		{"up-message-thread", 0, 0, G_OPTION_ARG_NONE, &up_message_thread, "Decode and dispatch UpMessages on a thread of their own", NULL},
+		{"direct", 0, 0, G_OPTION_ARG_STRING, &direct_name, "Also stream plain RTP or SRT without WebRTC (rtp, srt)", "str"},
+		{"direct-port", 0, 0, G_OPTION_ARG_INT, &direct_port, "UDP port of the direct transport, SRT listens one above", "N"},
+		{"realtime", 0, 0, G_OPTION_ARG_NONE, &realtime, "Run the compositor, encoding and network threads with SCHED_FIFO, needs CAP_SYS_NICE", NULL},
+		{"thread-nice", 0, 0, G_OPTION_ARG_INT, &thread_nice, "Nice level of those threads without --realtime, or if it is refused", "N"},
+		{"cpu-affinity", 0, 0, G_OPTION_ARG_STRING, &cpu_affinity_list, "CPUs those threads may run on, for example 2-5", "list"},
+		{"readback-frames-in-flight", 0, 0, G_OPTION_ARG_INT, &readback_frames_in_flight, "Readbacks queued on the GPU, 1 is synchronous", "N"},
 		G_OPTION_ENTRY_NULL,
 	};
 	// clang-format on
 
+	gchar *encoder_help = g_strdup_printf("Encoder (%s)", ems_encoder_list_names());
+	for (GOptionEntry *entry = entries; entry->long_name != NULL; entry++) {
+		if (g_strcmp0(entry->long_name, "encoder") == 0) {
+			entry->description = encoder_help;
+		}
+	}
+
 	context = g_option_context_new("- Elecric Maple streaming server");
 	g_option_context_add_main_entries(context, entries, NULL);
 	if (!g_option_context_parse(context, &argc, &argv, &error)) {
@@ -54,22 +137,126 @@ ems_arguments_parse(int argc, char *argv[])
 		arguments_instance.stream_debug_file = g_file_new_for_path(output_file_name);
 	}
 
-	arguments_instance.bitrate = bitrate;
+	arguments_instance.capture_file = capture_file_name;
+	arguments_instance.replay_file = replay_file_name;
+
+	arguments_instance.bitrate = (uint32_t)MAX(bitrate, 1);
+	arguments_instance.adaptive_bitrate = !fixed_bitrate;
+	arguments_instance.bitrate_min = (uint32_t)MAX(bitrate_min, 1);
+	arguments_instance.bitrate_max = (uint32_t)MAX(bitrate_max, bitrate_min);
+	arguments_instance.bitrate_ramp_up = (uint32_t)MAX(bitrate_ramp_up, 1);
+	arguments_instance.bitrate_ramp_down = (uint32_t)MAX(bitrate_ramp_down, 1);
+	if (arguments_instance.adaptive_bitrate && (arguments_instance.bitrate < arguments_instance.bitrate_min ||
+	                                            arguments_instance.bitrate > arguments_instance.bitrate_max)) {
+		// Starting outside of the bounds would jump on the first estimate, so they take the bitrate in.
+		arguments_instance.bitrate_min = MIN(arguments_instance.bitrate_min, arguments_instance.bitrate);
+		arguments_instance.bitrate_max = MAX(arguments_instance.bitrate_max, arguments_instance.bitrate);
+		g_print("--bitrate %u is outside of the adaptive bounds, adapting between %u and %u kbit/s.\n",
+		        arguments_instance.bitrate, arguments_instance.bitrate_min, arguments_instance.bitrate_max);
+	}
 	arguments_instance.benchmark_down_msg = benchmark_down_msg;
+	arguments_instance.cpu_color_convert = cpu_color_convert;
+	arguments_instance.intra_refresh = intra_refresh;
+	arguments_instance.slices = (uint32_t)CLAMP(slices, 0, 32);
+	arguments_instance.loss_protection = loss_protection;
+	arguments_instance.readback_frames_in_flight = (uint32_t)MAX(readback_frames_in_flight, 1);
+	arguments_instance.stream_width = (uint32_t)MAX(stream_width, 0);
+	arguments_instance.stream_height = (uint32_t)MAX(stream_height, 0);
+	arguments_instance.readback_scale = (uint32_t)MAX(readback_scale, 1);
+	arguments_instance.framerate = (uint32_t)CLAMP(framerate, 1, 240);
+	arguments_instance.fixed_pacing = fixed_pacing;
+	arguments_instance.pacing_margin_ns = (uint64_t)(MAX(pacing_margin, 0.0) * 1000.0 * 1000.0);
+	arguments_instance.latency_budget_ns = (uint64_t)(CLAMP(latency_budget, 0.0, 1000.0) * 1000.0 * 1000.0);
+	arguments_instance.foveation = foveation;
+	arguments_instance.depth = depth;
+	arguments_instance.up_message_thread = up_message_thread;
+	arguments_instance.foveation_size = (float)CLAMP(foveation_size, 0.01, 1.0);
+	arguments_instance.foveation_edge_ratio = (float)CLAMP(foveation_edge_ratio, 0.01, 1.0);
+	arguments_instance.dynamic_resolution = dynamic_resolution;
+	arguments_instance.dynamic_resolution_min = (float)CLAMP(dynamic_resolution_min, 0.05, 1.0);
+	arguments_instance.roi = roi;
+	arguments_instance.roi_size = (float)CLAMP(roi_size, 0.01, 1.0);
+	arguments_instance.roi_qp_delta = CLAMP(roi_qp_delta, -51, 51);
+	arguments_instance.motion_vectors = motion_vectors;
+	arguments_instance.realtime = realtime;
+	arguments_instance.thread_nice = CLAMP(thread_nice, -20, 19);
 
+	arguments_instance.cpu_affinity = 0;
+	if (cpu_affinity_list != NULL &&
+	    !em_thread_sched_parse_cpus(cpu_affinity_list, &arguments_instance.cpu_affinity)) {
+		g_print("Malformed --cpu-affinity %s, ignoring it.\n", cpu_affinity_list);
+	}
+
+	arguments_instance.direct_port = (uint16_t)CLAMP(direct_port, 1, G_MAXUINT16 - 1);
+	arguments_instance.direct_transport = EMS_DIRECT_TRANSPORT_NONE;
+	if (g_strcmp0(direct_name, "rtp") == 0) {
+		arguments_instance.direct_transport = EMS_DIRECT_TRANSPORT_RTP;
+	} else if (g_strcmp0(direct_name, "srt") == 0) {
+		arguments_instance.direct_transport = EMS_DIRECT_TRANSPORT_SRT;
+	} else if (direct_name != NULL) {
+		g_print("Unknown direct transport %s, streaming over WebRTC only.\n", direct_name);
+	}
+
+	arguments_instance.encoder_type = default_encoder_type;
 	if (encoder_name) {
-		if (g_strcmp0(encoder_name, "nvh264") == 0) {
-			arguments_instance.encoder_type = EMS_ENCODER_TYPE_NVH264;
-		} else if (g_strcmp0(encoder_name, "x264") == 0) {
-			arguments_instance.encoder_type = EMS_ENCODER_TYPE_X264;
+		const struct ems_encoder_descriptor *desc = ems_encoder_find_by_name(encoder_name);
+		if (desc != NULL) {
+			arguments_instance.encoder_type = desc->type;
 		} else {
-			arguments_instance.encoder_type = default_encoder_type;
+			g_print("Unknown encoder %s, using the default.\n", encoder_name);
 		}
-	} else {
-		arguments_instance.encoder_type = default_encoder_type;
+	}
+
+	// Probing needs the registry, a second gst_init in the pipeline is a no-op.
+	gst_init(NULL, NULL);
+	arguments_instance.encoder_type = ems_encoder_select(arguments_instance.encoder_type);
+
+	// Vulkan Video encodes the compositor's NV12 frames, there is nothing for videoconvert to do.
+	if (cpu_color_convert && arguments_instance.encoder_type == EMS_ENCODER_TYPE_VULKAN_H264) {
+		g_print("--cpu-color-convert does not work with --encoder=vulkanh264, ignoring it.\n");
+		arguments_instance.cpu_color_convert = FALSE;
+		cpu_color_convert = FALSE;
+	}
+
+	// The warp is done by the conversion shader.
+	if (foveation && cpu_color_convert) {
+		g_print("--foveation does not work with --cpu-color-convert, ignoring it.\n");
+		arguments_instance.foveation = FALSE;
+	}
+
+	// So is the depth band.
+	if (depth && cpu_color_convert) {
+		g_print("--depth does not work with --cpu-color-convert, ignoring it.\n");
+		arguments_instance.depth = FALSE;
+	}
+
+	// And the scaling of the views.
+	if (dynamic_resolution && cpu_color_convert) {
+		g_print("--dynamic-resolution does not work with --cpu-color-convert, ignoring it.\n");
+		arguments_instance.dynamic_resolution = FALSE;
+	}
+
+	// The motion is matched on the compositor's NV12 frames.
+	if (motion_vectors && cpu_color_convert) {
+		g_print("--motion-vectors does not work with --cpu-color-convert, ignoring it.\n");
+		arguments_instance.motion_vectors = FALSE;
+	}
+
+	// Only the VA encoders import dmabuf, and only GPU conversion produces it.
+	arguments_instance.dmabuf = dmabuf && !cpu_color_convert;
+	if (dmabuf && !ems_encoder_get(arguments_instance.encoder_type)->imports_dmabuf) {
+		g_print("--dmabuf needs an encoder that imports dmabuf, ignoring it.\n");
+		arguments_instance.dmabuf = FALSE;
+	}
+
+	// The metas go on the raw frames, which only a GStreamer encoder sees.
+	if (roi && !ems_encoder_get(arguments_instance.encoder_type)->reads_roi) {
+		g_print("--roi needs an encoder that reads region of interest metas, ignoring it.\n");
+		arguments_instance.roi = FALSE;
 	}
 
 	g_option_context_free(context);
+	g_free(encoder_help);
 
 	return TRUE;
 }
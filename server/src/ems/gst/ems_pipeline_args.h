@@ -19,14 +19,110 @@ typedef enum
 {
 	EMS_ENCODER_TYPE_X264,
 	EMS_ENCODER_TYPE_NVH264,
+	EMS_ENCODER_TYPE_VAH264,
+	//! Encoded with Vulkan Video in the compositor, the pipeline only parses and payloads.
+	EMS_ENCODER_TYPE_VULKAN_H264,
+	EMS_ENCODER_TYPE_QSVH264,
+	EMS_ENCODER_TYPE_AMFH264,
+	EMS_ENCODER_TYPE_NVH265,
+	EMS_ENCODER_TYPE_VAH265,
+	EMS_ENCODER_TYPE_QSVH265,
+	EMS_ENCODER_TYPE_AMFH265,
+	EMS_ENCODER_TYPE_NVAV1,
+	EMS_ENCODER_TYPE_VAAV1,
+	EMS_ENCODER_TYPE_QSVAV1,
+	EMS_ENCODER_TYPE_AMFAV1,
+	EMS_ENCODER_TYPE_SVTAV1,
 } EmsEncoderType;
 
+typedef enum
+{
+	//! WebRTC only.
+	EMS_DIRECT_TRANSPORT_NONE,
+	//! RTP over UDP to whoever sends UpMessages to the direct port.
+	EMS_DIRECT_TRANSPORT_RTP,
+	//! RTP in SRT, from a listener one above the direct port.
+	EMS_DIRECT_TRANSPORT_SRT,
+} EmsDirectTransport;
+
 struct ems_arguments
 {
 	GFile *stream_debug_file;
+	//! Where to capture the messages of the session, NULL to not capture, see ems_capture.h.
+	const gchar *capture_file;
+	//! Capture whose poses drive the app in place of the tracking client's, NULL to use the client's.
+	const gchar *replay_file;
 	uint32_t bitrate;
 	EmsEncoderType encoder_type;
 	gboolean benchmark_down_msg;
+	//! Stream size, 0 derives it from the view size and @ref readback_scale.
+	uint32_t stream_width;
+	uint32_t stream_height;
+	//! Divides the view size when no stream size is given, 1 has been seen to make the readback fail.
+	uint32_t readback_scale;
+	//! How many readbacks may be queued on the GPU, 1 waits for each readback synchronously.
+	uint32_t readback_frames_in_flight;
+	//! Convert to NV12 with videoconvert on the CPU instead of in the compositor.
+	gboolean cpu_color_convert;
+	//! Hand frames to the encoder as dmabuf, needs GPU color conversion and an encoder that imports dmabuf.
+	gboolean dmabuf;
+	//! Refresh with rolling intra columns or a long GOP, IDRs only when a client asks for one.
+	gboolean intra_refresh;
+	//! Slices each frame is split into, so the client can start decoding before all of it arrived. 0 leaves it to
+	//! the encoder.
+	uint32_t slices;
+	//! Offer FEC and retransmissions, their amount and the client's jitterbuffer latency follow the measured loss.
+	gboolean loss_protection;
+	//! Follow the congestion control estimate instead of streaming at a fixed bitrate.
+	gboolean adaptive_bitrate;
+	//! Bounds of the adaptive bitrate in kbit/s.
+	uint32_t bitrate_min;
+	uint32_t bitrate_max;
+	//! How fast the adaptive bitrate may move, in kbit/s per second.
+	uint32_t bitrate_ramp_up;
+	uint32_t bitrate_ramp_down;
+	//! Preferred frame rate, the client offers the rates its display can do and the closest one is streamed.
+	uint32_t framerate;
+	//! Free running at the nominal frame rate instead of locking to the client's display.
+	gboolean fixed_pacing;
+	//! How long before the client begins a frame the stream's frame should be decoded.
+	uint64_t pacing_margin_ns;
+	//! How long a raw frame may take from the appsrc out of the encoder, the queues before it hold this much. 0
+	//! for no limit.
+	uint64_t latency_budget_ns;
+	//! Warp the center of the views to more pixels in the conversion shader, the client unwarps.
+	gboolean foveation;
+	//! Fraction of each axis kept at full resolution.
+	float foveation_size;
+	//! Resolution of the edges relative to the center.
+	float foveation_edge_ratio;
+	//! Shrink the views within the stream under encoder or network pressure, the client samples the smaller rect.
+	gboolean dynamic_resolution;
+	//! Smallest scale of each axis of the views.
+	float dynamic_resolution_min;
+	//! Attach region of interest metas lowering the QP around the lens centres, for encoders that read them.
+	gboolean roi;
+	//! Fraction of each axis of the views in the region, before the foveation warp.
+	float roi_size;
+	//! QP offset of the regions, rate control takes the bits from the rest of the frame.
+	int32_t roi_qp_delta;
+	//! Match the luma of consecutive frames and send the motion of their content, the client extrapolates with it
+	//! when a frame is late. Needs GPU color conversion into host memory.
+	gboolean motion_vectors;
+	//! Schedule the threads on the path of a frame with SCHED_FIFO, falling back to @ref thread_nice.
+	gboolean realtime;
+	//! Nice level of those threads on the normal scheduler, 0 leaves them.
+	int32_t thread_nice;
+	//! Bit n lets those threads run on CPU n, 0 for any.
+	uint64_t cpu_affinity;
+	//! Add a band below the views holding their depth, the conversion shader writes it.
+	gboolean depth;
+	//! Decode and dispatch UpMessages on a thread of their own instead of the data channel threads.
+	gboolean up_message_thread;
+	//! Also stream without WebRTC, to a client that knows where to find us.
+	EmsDirectTransport direct_transport;
+	//! UDP port the direct clients send UpMessages to and get RTP from.
+	uint16_t direct_port;
 };
 
 struct ems_arguments *
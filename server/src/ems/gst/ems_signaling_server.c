@@ -12,6 +12,7 @@
  */
 
 #include "ems_signaling_server.h"
+#include "em_compact.h"
 
 #include <glib/gstdio.h>
 
@@ -27,6 +28,10 @@
 
 #include "util/u_logging.h"
 
+//! Scraped by Prometheus.
+#define METRICS_PATH "/metrics"
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
 struct _EmsSignalingServer
 {
 	GObject parent;
@@ -44,6 +49,10 @@ enum
 	SIGNAL_WS_CLIENT_DISCONNECTED,
 	SIGNAL_SDP_ANSWER,
 	SIGNAL_CANDIDATE,
+	SIGNAL_COMPACT_FORMAT,
+	SIGNAL_CLIENT_IDENTITY,
+	SIGNAL_REFRESH_RATES,
+	SIGNAL_METRICS,
 	N_SIGNALS
 };
 
@@ -55,6 +64,18 @@ ems_signaling_server_new()
 	return EMS_SIGNALING_SERVER(g_object_new(EMS_TYPE_SIGNALING_SERVER, NULL));
 }
 
+/*!
+ * Collects the Prometheus text exposition from the "metrics" handlers.
+ */
+static gchar *
+ems_signaling_server_collect_metrics(EmsSignalingServer *server, gsize *out_length)
+{
+	GString *out = g_string_new(NULL);
+	g_signal_emit(server, signals[SIGNAL_METRICS], 0, out);
+	*out_length = out->len;
+	return g_string_free(out, FALSE);
+}
+
 #if !SOUP_CHECK_VERSION(3, 0, 0)
 static void
 http_cb(SoupServer *server,
@@ -64,8 +85,16 @@ http_cb(SoupServer *server,
         SoupClientContext *client,
         gpointer user_data)
 {
-	// We're not serving any HTTP traffic - if somebody (erroneously) submits an HTTP request, tell them to get
-	// lost.
+	if (g_strcmp0(path, METRICS_PATH) == 0 && msg->method == SOUP_METHOD_GET) {
+		gsize length = 0;
+		gchar *body = ems_signaling_server_collect_metrics(EMS_SIGNALING_SERVER(user_data), &length);
+		soup_message_set_response(msg, METRICS_CONTENT_TYPE, SOUP_MEMORY_TAKE, body, length);
+		soup_message_set_status(msg, SOUP_STATUS_OK);
+		return;
+	}
+
+	// We're not serving any other HTTP traffic - if somebody (erroneously) submits an HTTP request, tell them to
+	// get lost.
 	U_LOG_E("Got an erroneous HTTP request from %s", soup_client_context_get_host(client));
 	soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
 }
@@ -77,8 +106,16 @@ http_cb(SoupServer *server,     //
         GHashTable *query,      //
         gpointer user_data)
 {
-	// We're not serving any HTTP traffic - if somebody (erroneously) submits an HTTP request, tell them to get
-	// lost.
+	if (g_strcmp0(path, METRICS_PATH) == 0 && soup_server_message_get_method(msg) == SOUP_METHOD_GET) {
+		gsize length = 0;
+		gchar *body = ems_signaling_server_collect_metrics(EMS_SIGNALING_SERVER(user_data), &length);
+		soup_server_message_set_response(msg, METRICS_CONTENT_TYPE, SOUP_MEMORY_TAKE, body, length);
+		soup_server_message_set_status(msg, SOUP_STATUS_OK, NULL);
+		return;
+	}
+
+	// We're not serving any other HTTP traffic - if somebody (erroneously) submits an HTTP request, tell them to
+	// get lost.
 	U_LOG_E("Got an erroneous HTTP request from %s", soup_server_message_get_remote_host(msg));
 	soup_server_message_set_status(msg, SOUP_STATUS_NOT_FOUND, NULL);
 }
@@ -106,6 +143,28 @@ ems_signaling_server_handle_message(EmsSignalingServer *server, SoupWebsocketCon
 			const gchar *answer_sdp = json_object_get_string_member(msg, "sdp");
 			g_debug("Received answer:\n %s", answer_sdp);
 
+			// Before the answer, the data channels and transport come up after it.
+			if (json_object_has_member(msg, "client-identity")) {
+				g_signal_emit(server, signals[SIGNAL_CLIENT_IDENTITY], 0, connection,
+				              json_object_get_string_member(msg, "client-identity"));
+			}
+			if (json_object_has_member(msg, "compact-version")) {
+				g_signal_emit(server, signals[SIGNAL_COMPACT_FORMAT], 0, connection,
+				              (guint)json_object_get_int_member(msg, "compact-version"),
+				              json_object_get_int_member(msg, "compact-epoch"));
+			}
+			if (json_object_has_member(msg, "refresh-rates")) {
+				JsonArray *rates = json_object_get_array_member(msg, "refresh-rates");
+				guint count = rates != NULL ? json_array_get_length(rates) : 0;
+				GArray *array = g_array_sized_new(FALSE, FALSE, sizeof(gfloat), count);
+				for (guint i = 0; i < count; i++) {
+					gfloat rate = (gfloat)json_array_get_double_element(rates, i);
+					g_array_append_val(array, rate);
+				}
+				g_signal_emit(server, signals[SIGNAL_REFRESH_RATES], 0, connection, array);
+				g_array_unref(array);
+			}
+
 			g_signal_emit(server, signals[SIGNAL_SDP_ANSWER], 0, connection, answer_sdp);
 		} else if (g_str_equal(msg_type, "candidate")) {
 			JsonObject *candidate;
@@ -250,6 +309,10 @@ ems_signaling_server_send_sdp_offer(EmsSignalingServer *server, EmsClientId clie
 
 	json_builder_set_member_name(builder, "sdp");
 	json_builder_add_string_value(builder, sdp);
+
+	// The newest compact encoding we read, the client may answer to use it instead of protobuf.
+	json_builder_set_member_name(builder, "compact-version");
+	json_builder_add_int_value(builder, EM_COMPACT_VERSION);
 	json_builder_end_object(builder);
 
 	root = json_builder_get_root(builder);
@@ -293,6 +356,57 @@ ems_signaling_server_send_candidate(EmsSignalingServer *server,
 	g_object_unref(builder);
 }
 
+void
+ems_signaling_server_send_refresh_rate(EmsSignalingServer *server, EmsClientId client_id, gfloat refresh_rate)
+{
+	JsonBuilder *builder;
+	JsonNode *root;
+
+	g_debug("Send refresh rate: %.2f", refresh_rate);
+
+	builder = json_builder_new();
+	json_builder_begin_object(builder);
+	json_builder_set_member_name(builder, "msg");
+	json_builder_add_string_value(builder, "refresh-rate");
+
+	// One of the rates the client answered with, the stream runs at it.
+	json_builder_set_member_name(builder, "refresh-rate");
+	json_builder_add_double_value(builder, refresh_rate);
+	json_builder_end_object(builder);
+
+	root = json_builder_get_root(builder);
+
+	ems_signaling_server_send_to_websocket_client(server, client_id, root);
+
+	json_node_unref(root);
+	g_object_unref(builder);
+}
+
+void
+ems_signaling_server_send_loss_protection(EmsSignalingServer *server, EmsClientId client_id, guint latency_ms)
+{
+	JsonBuilder *builder;
+	JsonNode *root;
+
+	g_debug("Send loss protection latency: %u ms", latency_ms);
+
+	builder = json_builder_new();
+	json_builder_begin_object(builder);
+	json_builder_set_member_name(builder, "msg");
+	json_builder_add_string_value(builder, "loss-protection");
+
+	json_builder_set_member_name(builder, "latency");
+	json_builder_add_int_value(builder, latency_ms);
+	json_builder_end_object(builder);
+
+	root = json_builder_get_root(builder);
+
+	ems_signaling_server_send_to_websocket_client(server, client_id, root);
+
+	json_node_unref(root);
+	g_object_unref(builder);
+}
+
 static void
 ems_signaling_server_dispose(GObject *object)
 {
@@ -324,4 +438,23 @@ ems_signaling_server_class_init(EmsSignalingServerClass *klass)
 	signals[SIGNAL_CANDIDATE] =
 	    g_signal_new("candidate", G_OBJECT_CLASS_TYPE(klass), G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL, G_TYPE_NONE,
 	                 3, G_TYPE_POINTER, G_TYPE_UINT, G_TYPE_STRING);
+
+	// The compact version and epoch the client answered with, see em_compact.h.
+	signals[SIGNAL_COMPACT_FORMAT] =
+	    g_signal_new("compact-format", G_OBJECT_CLASS_TYPE(klass), G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
+	                 G_TYPE_NONE, 3, G_TYPE_POINTER, G_TYPE_UINT, G_TYPE_INT64);
+
+	// What the client calls itself, the same across its reconnects.
+	signals[SIGNAL_CLIENT_IDENTITY] =
+	    g_signal_new("client-identity", G_OBJECT_CLASS_TYPE(klass), G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
+	                 G_TYPE_NONE, 2, G_TYPE_POINTER, G_TYPE_STRING);
+
+	// The display refresh rates the client can switch to, a GArray of gfloat.
+	signals[SIGNAL_REFRESH_RATES] =
+	    g_signal_new("refresh-rates", G_OBJECT_CLASS_TYPE(klass), G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
+	                 G_TYPE_NONE, 2, G_TYPE_POINTER, G_TYPE_POINTER);
+
+	// Handlers append their metrics in the Prometheus text format to the GString.
+	signals[SIGNAL_METRICS] = g_signal_new("metrics", G_OBJECT_CLASS_TYPE(klass), G_SIGNAL_RUN_LAST, 0, NULL,
+	                                       NULL, NULL, G_TYPE_NONE, 1, G_TYPE_POINTER);
 }
@@ -27,6 +27,18 @@ ems_signaling_server_new();
 void
 ems_signaling_server_send_sdp_offer(EmsSignalingServer *server, EmsClientId client_id, const gchar *msg);
 
+/*!
+ * Tell the client which of its display refresh rates the stream runs at.
+ */
+void
+ems_signaling_server_send_refresh_rate(EmsSignalingServer *server, EmsClientId client_id, gfloat refresh_rate);
+
+/*!
+ * Tell the client how long its jitterbuffer should wait for FEC or retransmissions to fill a gap, 0 for not at all.
+ */
+void
+ems_signaling_server_send_loss_protection(EmsSignalingServer *server, EmsClientId client_id, guint latency_ms);
+
 void
 ems_signaling_server_send_candidate(EmsSignalingServer *server,
                                     EmsClientId client_id,
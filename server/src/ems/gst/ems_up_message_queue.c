@@ -0,0 +1,60 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Single producer, single consumer queue of received UpMessages, still encoded.
+ */
+
+#include "ems_up_message_queue.h"
+
+#include <string.h>
+
+G_STATIC_ASSERT((EMS_UP_MESSAGE_QUEUE_SIZE & (EMS_UP_MESSAGE_QUEUE_SIZE - 1)) == 0);
+
+bool
+ems_up_message_queue_push(struct ems_up_message_queue *q,
+                          EmsClientId client_id,
+                          guint compact_version,
+                          int64_t compact_epoch,
+                          const uint8_t *data,
+                          size_t size)
+{
+	if (size > EMS_UP_MESSAGE_MAX_SIZE) {
+		return false;
+	}
+
+	guint head = q->head;
+	if (head - (guint)g_atomic_int_get(&q->tail) >= EMS_UP_MESSAGE_QUEUE_SIZE) {
+		return false;
+	}
+
+	struct ems_up_message_slot *slot = &q->slots[head & (EMS_UP_MESSAGE_QUEUE_SIZE - 1)];
+	slot->client_id = client_id;
+	slot->compact_version = compact_version;
+	slot->compact_epoch = compact_epoch;
+	slot->size = size;
+	memcpy(slot->data, data, size);
+
+	// Full barrier, the slot is written before the consumer sees it.
+	g_atomic_int_set(&q->head, head + 1);
+	return true;
+}
+
+const struct ems_up_message_slot *
+ems_up_message_queue_peek(struct ems_up_message_queue *q)
+{
+	guint tail = q->tail;
+	if ((guint)g_atomic_int_get(&q->head) == tail) {
+		return NULL;
+	}
+	return &q->slots[tail & (EMS_UP_MESSAGE_QUEUE_SIZE - 1)];
+}
+
+void
+ems_up_message_queue_pop(struct ems_up_message_queue *q)
+{
+	// Done reading the slot before the producer may reuse it.
+	g_atomic_int_set(&q->tail, q->tail + 1);
+}
@@ -0,0 +1,86 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Single producer, single consumer queue of received UpMessages, still encoded.
+ */
+
+#pragma once
+
+#include "ems_signaling_server.h"
+
+#include "em_compact.h"
+#include "electricmaple.pb.h"
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+G_BEGIN_DECLS
+
+//! Messages that can wait for the consumer, must be a power of two.
+#define EMS_UP_MESSAGE_QUEUE_SIZE (32)
+
+//! Larger messages do not decode anyway.
+#define EMS_UP_MESSAGE_MAX_SIZE MAX(em_proto_UpMessage_size, EM_COMPACT_UP_MESSAGE_MAX_SIZE)
+
+/*!
+ * A message as it came from the data channel, with what it takes to decode it.
+ */
+struct ems_up_message_slot
+{
+	EmsClientId client_id;
+
+	//! Of the client when the message came in, see em_compact_decode_up_message.
+	guint compact_version;
+	int64_t compact_epoch;
+
+	size_t size;
+	uint8_t data[EMS_UP_MESSAGE_MAX_SIZE];
+};
+
+/*!
+ * Ring of slots the producer writes at the head and the consumer reads at the
+ * tail, without locking: each index is only written by one side.
+ */
+struct ems_up_message_queue
+{
+	struct ems_up_message_slot slots[EMS_UP_MESSAGE_QUEUE_SIZE];
+
+	//! Count of pushed messages, only written by the producer.
+	guint head;
+	//! Count of popped messages, only written by the consumer.
+	guint tail;
+};
+
+/*!
+ * Copy a message in, from the producer.
+ *
+ * @return false if the queue is full or the message too large
+ */
+bool
+ems_up_message_queue_push(struct ems_up_message_queue *q,
+                          EmsClientId client_id,
+                          guint compact_version,
+                          int64_t compact_epoch,
+                          const uint8_t *data,
+                          size_t size);
+
+/*!
+ * The oldest message, from the consumer, valid until @ref ems_up_message_queue_pop.
+ *
+ * @return NULL if the queue is empty
+ */
+const struct ems_up_message_slot *
+ems_up_message_queue_peek(struct ems_up_message_queue *q);
+
+/*!
+ * Hand the oldest message's slot back to the producer.
+ */
+void
+ems_up_message_queue_pop(struct ems_up_message_queue *q);
+
+G_END_DECLS
@@ -0,0 +1,486 @@
+// Copyright 2024, Collabora, Ltd.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Benchmark of the server encode path: generated NV12 frames through the appsrc, encoder and payloader.
+ *
+ * Takes the place of the compositor from readback on, so encoders can be compared per GPU and regressions caught
+ * without an OpenXR app or a headset. Frames are pushed from a pool like the compositor's GPU color conversion
+ * does, and their stages are timed from the DownMessage meta each buffer carries.
+ *
+ * The pipeline options of the server apply, like --encoder, --bitrate, --width, --height and --intra-refresh.
+ *
+ */
+
+#include "ems_callbacks.h"
+#include "ems_down_message_meta.h"
+#include "ems_encoders.h"
+#include "ems_gstreamer.h"
+#include "ems_gstreamer_pipeline.h"
+#include "ems_gstreamer_src.h"
+#include "ems_pipeline_args.h"
+
+#include "os/os_time.h"
+#include "util/u_logging.h"
+#include "util/u_misc.h"
+#include "util/u_time.h"
+
+#include "electricmaple.pb.h"
+
+#include <gst/gst.h>
+#include <gst/rtp/gstrtpbuffer.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_APPSRC_NAME "EMS_source"
+
+static gint fps = 90;
+static gint frame_count = 900;
+static gint warmup_frames = 30;
+static gchar *csv_path = NULL;
+static gchar *json_path = NULL;
+
+static GOptionEntry bench_entries[] = {
+    {"fps", 0, 0, G_OPTION_ARG_INT, &fps, "Frames per second to push, 0 as fast as the pool allows", "N"},
+    {"frames", 0, 0, G_OPTION_ARG_INT, &frame_count, "Frames to push", "N"},
+    {"warmup", 0, 0, G_OPTION_ARG_INT, &warmup_frames, "Frames left out of the summary while the encoder warms up",
+     "N"},
+    {"csv", 0, 0, G_OPTION_ARG_FILENAME, &csv_path, "Write the stage times of each frame to this CSV file", "path"},
+    {"json", 0, 0, G_OPTION_ARG_FILENAME, &json_path, "Write the summary to this JSON file", "path"},
+    G_OPTION_ENTRY_NULL,
+};
+
+//! Where a frame was seen, each after the one before.
+enum bench_stage
+{
+	BENCH_STAGE_PUSH,
+	BENCH_STAGE_ENCODE_IN,
+	BENCH_STAGE_ENCODE_OUT,
+	BENCH_STAGE_PAYLOAD,
+	BENCH_STAGE_COUNT,
+};
+
+//! Named for the stage they end in, like the server telemetry.
+static const char *stage_names[BENCH_STAGE_COUNT] = {"push", "encode_in", "encode_out", "payload"};
+
+struct bench_record
+{
+	uint64_t stamps_ns[BENCH_STAGE_COUNT];
+	//! Of the encoded frame.
+	gsize bytes;
+	bool keyframe;
+};
+
+struct bench
+{
+	//! By frame_sequence_id, written from the streaming threads, one thread per stage.
+	struct bench_record *records;
+	uint32_t count;
+
+	uint64_t skipped;
+};
+
+struct bench_frame
+{
+	struct xrt_frame base;
+};
+
+
+/*
+ *
+ * Frames.
+ *
+ */
+
+static void
+bench_frame_destroy(struct xrt_frame *xf)
+{
+	free(xf->data);
+	free(xf);
+}
+
+/*!
+ * An NV12 frame with a pattern moved by @p phase, so consecutive frames differ like rendered ones do and the
+ * encoder has motion to find.
+ */
+static struct xrt_frame *
+bench_frame_create(uint32_t width, uint32_t height, uint32_t phase)
+{
+	struct bench_frame *bf = U_TYPED_CALLOC(struct bench_frame);
+	struct xrt_frame *xf = &bf->base;
+
+	xf->reference.count = 1;
+	xf->destroy = bench_frame_destroy;
+	xf->width = width;
+	xf->height = height;
+	xf->stride = width;
+	xf->size = (size_t)width * height * 3 / 2;
+	xf->format = EMS_XRT_FORMAT_NV12;
+	xf->data = malloc(xf->size);
+
+	uint8_t *y_plane = xf->data;
+	for (uint32_t y = 0; y < height; y++) {
+		for (uint32_t x = 0; x < width; x++) {
+			// Diagonal bands with some detail in them, plus a block sliding across.
+			uint8_t luma = (uint8_t)((x + y + phase * 8) ^ ((x * y) >> 6));
+			bool block = ((x + phase * 16) % width) < width / 8 && (y % (height / 4)) < height / 8;
+			y_plane[(size_t)y * xf->stride + x] = block ? 235 : luma;
+		}
+	}
+
+	uint8_t *uv_plane = y_plane + (size_t)xf->stride * height;
+	for (uint32_t y = 0; y < height / 2; y++) {
+		for (uint32_t x = 0; x < width / 2; x++) {
+			uv_plane[(size_t)y * xf->stride + x * 2 + 0] = (uint8_t)(128 + ((x + phase) & 31));
+			uv_plane[(size_t)y * xf->stride + x * 2 + 1] = (uint8_t)(128 - ((y + phase) & 31));
+		}
+	}
+
+	return xf;
+}
+
+
+/*
+ *
+ * Stage probes.
+ *
+ */
+
+static struct bench_record *
+record_for_buffer(struct bench *b, GstBuffer *buffer)
+{
+	const struct ems_down_message_meta *dmm = ems_buffer_get_down_message_meta(buffer);
+	if (dmm == NULL || dmm->frame_sequence_id < 0 || dmm->frame_sequence_id >= b->count) {
+		return NULL;
+	}
+	return &b->records[dmm->frame_sequence_id];
+}
+
+static GstPadProbeReturn
+encode_in_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct bench_record *record = record_for_buffer(user_data, gst_pad_probe_info_get_buffer(info));
+	if (record != NULL) {
+		record->stamps_ns[BENCH_STAGE_ENCODE_IN] = os_monotonic_get_ns();
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+encode_out_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	GstBuffer *buffer = gst_pad_probe_info_get_buffer(info);
+	struct bench_record *record = record_for_buffer(user_data, buffer);
+	if (record != NULL) {
+		record->stamps_ns[BENCH_STAGE_ENCODE_OUT] = os_monotonic_get_ns();
+		record->bytes = gst_buffer_get_size(buffer);
+		record->keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+//! On the last packet of the frame, like the payload stamp of the server.
+static GstPadProbeReturn
+payload_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	GstBuffer *buffer = gst_pad_probe_info_get_buffer(info);
+
+	GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+	if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp)) {
+		return GST_PAD_PROBE_OK;
+	}
+	bool marker = gst_rtp_buffer_get_marker(&rtp);
+	gst_rtp_buffer_unmap(&rtp);
+
+	struct bench_record *record = marker ? record_for_buffer(user_data, buffer) : NULL;
+	if (record != NULL) {
+		record->stamps_ns[BENCH_STAGE_PAYLOAD] = os_monotonic_get_ns();
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+static bool
+add_probe(GstElement *pipeline,
+          const char *element_name,
+          const char *pad_name,
+          GstPadProbeCallback cb,
+          struct bench *b)
+{
+	GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), element_name);
+	if (element == NULL) {
+		return false;
+	}
+	GstPad *pad = gst_element_get_static_pad(element, pad_name);
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, cb, b, NULL);
+	gst_object_unref(pad);
+	gst_object_unref(element);
+	return true;
+}
+
+
+/*
+ *
+ * Results.
+ *
+ */
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile_ms(const uint64_t *sorted, uint32_t n, double fraction)
+{
+	if (n == 0) {
+		return 0.0;
+	}
+	uint32_t i = (uint32_t)((double)(n - 1) * fraction);
+	return (double)sorted[i] / (double)U_TIME_1MS_IN_NS;
+}
+
+static void
+write_csv(struct bench *b, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		U_LOG_E("Could not open %s", path);
+		return;
+	}
+
+	fprintf(f, "frame,push_ns,encode_in_ns,encode_out_ns,payload_ns,bytes,keyframe\n");
+	for (uint32_t i = 0; i < b->count; i++) {
+		const struct bench_record *r = &b->records[i];
+		fprintf(f, "%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%zu,%d\n", i, r->stamps_ns[0],
+		        r->stamps_ns[1], r->stamps_ns[2], r->stamps_ns[3], (size_t)r->bytes, r->keyframe ? 1 : 0);
+	}
+	fclose(f);
+}
+
+/*!
+ * Prints, and writes to @p json_file if given, the stage latencies and throughput of the frames after the warmup.
+ */
+static void
+summarize(struct bench *b,
+          const struct ems_encoder_descriptor *encoder,
+          uint32_t width,
+          uint32_t height,
+          FILE *json_file)
+{
+	uint32_t first = MIN((uint32_t)MAX(warmup_frames, 0), b->count);
+	uint64_t *samples = U_TYPED_ARRAY_CALLOC(uint64_t, b->count);
+
+	uint32_t completed = 0;
+	uint64_t bytes = 0;
+	uint64_t first_push_ns = 0;
+	uint64_t last_payload_ns = 0;
+	for (uint32_t i = first; i < b->count; i++) {
+		const struct bench_record *r = &b->records[i];
+		if (r->stamps_ns[BENCH_STAGE_PAYLOAD] == 0) {
+			continue;
+		}
+		completed++;
+		bytes += r->bytes;
+		if (first_push_ns == 0) {
+			first_push_ns = r->stamps_ns[BENCH_STAGE_PUSH];
+		}
+		last_payload_ns = MAX(last_payload_ns, r->stamps_ns[BENCH_STAGE_PAYLOAD]);
+	}
+
+	double seconds = last_payload_ns > first_push_ns ? (double)(last_payload_ns - first_push_ns) / 1e9 : 0.0;
+	double out_fps = seconds > 0.0 ? (double)completed / seconds : 0.0;
+	double kbps = seconds > 0.0 ? (double)bytes * 8.0 / 1000.0 / seconds : 0.0;
+
+	g_print("%s %ux%u: %u of %u frames payloaded, %.1f fps, %.0f kbit/s, %" PRIu64 " skipped.\n", encoder->name,
+	        width, height, completed, b->count - first, out_fps, kbps, b->skipped);
+
+	if (json_file != NULL) {
+		fprintf(json_file,
+		        "{\n  \"encoder\": \"%s\",\n  \"width\": %u,\n  \"height\": %u,\n  \"target_fps\": %d,\n"
+		        "  \"bitrate_kbps\": %u,\n  \"frames\": %u,\n  \"completed\": %u,\n  \"skipped\": %" PRIu64 ",\n"
+		        "  \"fps\": %.2f,\n  \"encoded_kbps\": %.1f,\n  \"stages\": {",
+		        encoder->name, width, height, fps, ems_arguments_get()->bitrate, b->count - first, completed,
+		        b->skipped, out_fps, kbps);
+	}
+
+	// Each stage from the one before, and all of them together.
+	for (int stage = BENCH_STAGE_ENCODE_IN; stage <= BENCH_STAGE_COUNT; stage++) {
+		int from = stage == BENCH_STAGE_COUNT ? BENCH_STAGE_PUSH : stage - 1;
+		int to = stage == BENCH_STAGE_COUNT ? BENCH_STAGE_PAYLOAD : stage;
+		const char *name = stage == BENCH_STAGE_COUNT ? "total" : stage_names[stage];
+
+		uint32_t n = 0;
+		for (uint32_t i = first; i < b->count; i++) {
+			const struct bench_record *r = &b->records[i];
+			if (r->stamps_ns[from] != 0 && r->stamps_ns[to] >= r->stamps_ns[from]) {
+				samples[n++] = r->stamps_ns[to] - r->stamps_ns[from];
+			}
+		}
+		qsort(samples, n, sizeof(*samples), compare_u64);
+
+		double p50 = percentile_ms(samples, n, 0.50);
+		double p95 = percentile_ms(samples, n, 0.95);
+		double p99 = percentile_ms(samples, n, 0.99);
+		double max = percentile_ms(samples, n, 1.0);
+		g_print("  %-10s p50 %6.2f ms, p95 %6.2f ms, p99 %6.2f ms, max %6.2f ms\n", name, p50, p95, p99, max);
+
+		if (json_file != NULL) {
+			fprintf(json_file,
+			        "%s\n    \"%s\": {\"count\": %u, \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f, "
+			        "\"max_ms\": %.3f}",
+			        stage == BENCH_STAGE_ENCODE_IN ? "" : ",", name, n, p50, p95, p99, max);
+		}
+	}
+
+	if (json_file != NULL) {
+		fprintf(json_file, "\n  }\n}\n");
+	}
+	free(samples);
+}
+
+
+/*
+ *
+ * Main.
+ *
+ */
+
+int
+main(int argc, char *argv[])
+{
+	GError *error = NULL;
+
+	// Ours first, the rest are the server's pipeline options.
+	GOptionContext *context = g_option_context_new("- Electric Maple encode path benchmark");
+	g_option_context_add_main_entries(context, bench_entries, NULL);
+	g_option_context_set_ignore_unknown_options(context, TRUE);
+	g_option_context_set_help_enabled(context, FALSE);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		g_print("option parsing failed: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(context);
+
+	if (!ems_arguments_parse(argc, argv)) {
+		return EXIT_FAILURE;
+	}
+	struct ems_arguments *args = ems_arguments_get();
+
+	const struct ems_encoder_descriptor *encoder = ems_encoder_get(args->encoder_type);
+	if (args->encoder_type == EMS_ENCODER_TYPE_VULKAN_H264) {
+		g_print("The Vulkan Video encoder runs in the compositor, pick a GStreamer one.\n");
+		return EXIT_FAILURE;
+	}
+
+	// Even, NV12 halves both.
+	uint32_t width = (args->stream_width > 0 ? args->stream_width : 3840) & ~1u;
+	uint32_t height = (args->stream_height > 0 ? args->stream_height : 1920) & ~1u;
+
+	struct bench b = {0};
+	b.count = (uint32_t)MAX(frame_count, 1);
+	b.records = U_TYPED_ARRAY_CALLOC(struct bench_record, b.count);
+
+	struct ems_callbacks *callbacks = ems_callbacks_create();
+	struct xrt_frame_context xfctx = {0};
+	struct gstreamer_pipeline *gp = NULL;
+	struct ems_gstreamer_src *gs = NULL;
+	struct xrt_frame_sink *xfs = NULL;
+
+	// No telemetry, the stages are timed here per frame rather than summarized per window.
+	ems_gstreamer_pipeline_create(&xfctx, BENCH_APPSRC_NAME, callbacks, NULL, &gp);
+	ems_gstreamer_src_create_with_pipeline(gp, width, height, fps > 0 ? (uint32_t)fps : 90, EMS_XRT_FORMAT_NV12,
+	                                       FALSE, BENCH_APPSRC_NAME, &gs, &xfs);
+
+	if (!add_probe(gp->pipeline, EMS_ENCODER_ELEMENT_NAME, "sink", encode_in_probe, &b) ||
+	    !add_probe(gp->pipeline, EMS_ENCODER_ELEMENT_NAME, "src", encode_out_probe, &b) ||
+	    !add_probe(gp->pipeline, "rtppay", "src", payload_probe, &b)) {
+		U_LOG_E("Could not find the encoder or the payloader.");
+		return EXIT_FAILURE;
+	}
+
+	g_print("Generating %u frames of %ux%u.\n", EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES, width, height);
+	struct xrt_frame *frames[EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES] = {0};
+	for (uint32_t i = 0; i < EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES; i++) {
+		frames[i] = bench_frame_create(width, height, i);
+	}
+	bool pooled = ems_gstreamer_src_use_frame_pool(gs, frames, NULL, EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES);
+	for (uint32_t i = 0; i < EMS_GSTREAMER_SRC_MAX_POOLED_FRAMES; i++) {
+		xrt_frame_reference(&frames[i], NULL);
+	}
+	if (!pooled) {
+		U_LOG_E("Could not pool the frames.");
+		return EXIT_FAILURE;
+	}
+
+	ems_gstreamer_pipeline_play(gp);
+
+	uint64_t interval_ns = fps > 0 ? U_TIME_1S_IN_NS / (uint64_t)fps : 0;
+	uint64_t next_ns = os_monotonic_get_ns();
+	for (uint32_t i = 0; i < b.count;) {
+		if (interval_ns > 0) {
+			uint64_t now_ns = os_monotonic_get_ns();
+			if (next_ns > now_ns) {
+				os_nanosleep((int64_t)(next_ns - now_ns));
+			}
+			next_ns += interval_ns;
+		}
+
+		// Like the compositor, a frame the pipeline has no buffer for is dropped, not waited for.
+		struct xrt_frame *xf = NULL;
+		if (!ems_gstreamer_src_acquire_frame(gs, &xf)) {
+			if (interval_ns > 0) {
+				b.skipped++;
+				i++;
+			} else {
+				os_nanosleep(100 * U_TIME_1US_IN_NS);
+			}
+			continue;
+		}
+
+		em_proto_DownMessage msg = em_proto_DownMessage_init_default;
+		msg.has_frame_data = true;
+		msg.frame_data.frame_sequence_id = i;
+
+		xf->timestamp = os_monotonic_get_ns();
+		xf->source_timestamp = xf->timestamp;
+		b.records[i].stamps_ns[BENCH_STAGE_PUSH] = xf->timestamp;
+		ems_gstreamer_src_push_pooled_frame(gs, xf, &msg);
+		i++;
+	}
+
+	// Flushes the frames still in the encoder.
+	ems_gstreamer_pipeline_stop(gp);
+	ems_gstreamer_src_clear_frame_pool(gs);
+
+	if (csv_path != NULL) {
+		write_csv(&b, csv_path);
+	}
+
+	FILE *json_file = NULL;
+	if (json_path != NULL) {
+		json_file = fopen(json_path, "w");
+		if (json_file == NULL) {
+			U_LOG_E("Could not open %s", json_path);
+		}
+	}
+	summarize(&b, encoder, width, height, json_file);
+	if (json_file != NULL) {
+		fclose(json_file);
+	}
+
+	xrt_frame_context_destroy_nodes(&xfctx);
+	ems_callbacks_destroy(&callbacks);
+	free(b.records);
+	g_free(csv_path);
+	g_free(json_path);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,101 @@
+// Copyright 2024, Collabora, Ltd.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ */
+
+#include "catch2/catch_test_macros.hpp"
+
+#include "ems_callbacks.h"
+#include "ems_latency.h"
+
+#include "electricmaple.pb.h"
+
+#include <cstdint>
+
+namespace {
+
+constexpr int64_t kIntervalNs = 11111111;
+constexpr int64_t kClientOffsetNs = 5000000000;
+constexpr int64_t kVsyncPhaseNs = 3000000;
+constexpr int64_t kDisplayAheadNs = 2 * kIntervalNs;
+constexpr int64_t kUplinkNs = 2000000;
+constexpr int64_t kDownlinkNs = 15000000;
+constexpr int64_t kLateFrameNs = 20000000;
+
+// Decodes the frame, then holds it like the client does until the display it was asked for.
+em_proto_UpFrameMessage
+client_display(int64_t frame, int64_t push_ns, int64_t display_time, uint64_t *out_report_ns)
+{
+	// Every tenth frame is late, the first one too.
+	int64_t downlink_ns = kDownlinkNs + (frame % 10 == 0 ? kLateFrameNs : 0);
+	int64_t decoded = push_ns + downlink_ns + kClientOffsetNs;
+
+	int64_t vsync = (decoded + kDisplayAheadNs - kClientOffsetNs - kVsyncPhaseNs + kIntervalNs - 1) / kIntervalNs;
+	int64_t shown = vsync * kIntervalNs + kClientOffsetNs + kVsyncPhaseNs;
+	while (display_time != 0 && display_time > shown + kIntervalNs / 2) {
+		shown += kIntervalNs;
+	}
+
+	em_proto_UpFrameMessage report = em_proto_UpFrameMessage_init_default;
+	report.frame_sequence_id = frame;
+	report.decode_complete_time = decoded;
+	report.begin_frame_time = shown - kDisplayAheadNs;
+	report.display_time = shown;
+	*out_report_ns = (uint64_t)(report.begin_frame_time - kClientOffsetNs + kUplinkNs);
+	return report;
+}
+
+} // namespace
+
+TEST_CASE("Latency")
+{
+	struct ems_callbacks *callbacks = ems_callbacks_create();
+	struct ems_latency *latency = ems_latency_create(callbacks);
+
+	SECTION("steady stream converges to the mean instead of drifting up")
+	{
+		// The uplink counts as latency, and the late frames add a tenth of theirs on average.
+		const int64_t expected_ns = kDownlinkNs + kLateFrameNs / 10 + kUplinkNs + kDisplayAheadNs;
+
+		for (int64_t frame = 0; frame < 2000; frame++) {
+			int64_t push_ns = frame * kIntervalNs + 1000000;
+			ems_latency_frame_pushed(latency, frame, (uint64_t)push_ns);
+
+			int64_t display_time = 0;
+			uint64_t display_latency_ns = ems_latency_get_display_latency_ns(latency, 0);
+			ems_latency_server_to_client_time(latency, push_ns + display_latency_ns, &display_time);
+
+			uint64_t report_ns = 0;
+			em_proto_UpFrameMessage report = client_display(frame, push_ns, display_time, &report_ns);
+			ems_latency_frame_report(latency, &report, report_ns);
+
+			if (frame >= 1000) {
+				int64_t estimate_ns = (int64_t)ems_latency_get_display_latency_ns(latency, 0);
+				CHECK(estimate_ns > expected_ns - 2000000);
+				CHECK(estimate_ns < expected_ns + 2000000);
+			}
+		}
+	}
+
+	SECTION("held frames do not count as latency")
+	{
+		// Ask for a display far later than the frames could be shown.
+		for (int64_t frame = 1; frame < 500; frame++) {
+			int64_t push_ns = frame * kIntervalNs + 1000000;
+			ems_latency_frame_pushed(latency, frame, (uint64_t)push_ns);
+
+			int64_t display_time = push_ns + kClientOffsetNs + 100000000;
+			uint64_t report_ns = 0;
+			em_proto_UpFrameMessage report = client_display(frame, push_ns, display_time, &report_ns);
+			ems_latency_frame_report(latency, &report, report_ns);
+		}
+
+		int64_t estimate_ns = (int64_t)ems_latency_get_display_latency_ns(latency, 0);
+		CHECK(estimate_ns < kDownlinkNs + kLateFrameNs + kUplinkNs + kDisplayAheadNs);
+	}
+
+	ems_callbacks_reset(callbacks);
+	ems_latency_destroy(&latency);
+	ems_callbacks_destroy(&callbacks);
+}
@@ -2,8 +2,19 @@
 //
 // SPDX-License-Identifier: BSL-1.0
 
+/*!
+ * @file
+ * @brief  Headless load generator: N synthetic headsets in one process, each with a WebRTC session of its own.
+ *
+ * Every client depayloads and parses, optionally decodes, and sends tracking and frame UpMessages at headset rates.
+ * Per client it reports the frame rate, frame loss by frame_sequence_id, how long keyframe requests take to be
+ * answered and the time to the first frame.
+ */
+
 #include <glib-unix.h>
 #include <gst/gst.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include <gst/video/video.h>
 
 #define GST_USE_UNSTABLE_API
 #include <gst/webrtc/webrtc.h>
@@ -15,87 +26,453 @@
 #include "stdio.h"
 #include "util/u_logging.h"
 
-static gchar *websocket_uri = NULL;
+#include "em_sequence_tracker.h"
+#include "electricmaple.pb.h"
 
-static GOptionEntry options[] = {{
-                                     "websocket-uri",
-                                     'u',
-                                     0,
-                                     G_OPTION_ARG_STRING,
-                                     &websocket_uri,
-                                     "Websocket URI of webrtc signaling connection",
-                                     "URI",
-                                 },
-                                 {NULL}};
+#include <pb_decode.h>
+#include <pb_encode.h>
+
+#include <math.h>
+#include <string.h>
+
+//! Must match the server.
+#define RTP_DOWN_MESSAGE_HDR_EXT_ID 1
+#define TRACKING_DATA_CHANNEL_LABEL "tracking"
+
+static gchar *websocket_uri = NULL;
+static gint client_count = 1;
+static gint tracking_rate = 90;
+static gint keyframe_interval = 5;
+static gint report_interval = 5;
+static gint ramp_ms = 200;
+static gint duration = 0;
+static gboolean decode = FALSE;
+
+static GOptionEntry options[] = {
+    {"websocket-uri", 'u', 0, G_OPTION_ARG_STRING, &websocket_uri, "Websocket URI of webrtc signaling connection",
+     "URI"},
+    {"clients", 'n', 0, G_OPTION_ARG_INT, &client_count, "Synthetic headsets to connect", "N"},
+    {"decode", 'd', 0, G_OPTION_ARG_NONE, &decode, "Decode the stream instead of only depayloading it", NULL},
+    {"tracking-rate", 0, 0, G_OPTION_ARG_INT, &tracking_rate, "Tracking UpMessages per second and client", "HZ"},
+    {"keyframe-interval", 0, 0, G_OPTION_ARG_INT, &keyframe_interval,
+     "Seconds between keyframe requests of each client, 0 to not ask", "S"},
+    {"report-interval", 0, 0, G_OPTION_ARG_INT, &report_interval, "Seconds between reports", "S"},
+    {"ramp", 0, 0, G_OPTION_ARG_INT, &ramp_ms, "Milliseconds between connecting one client and the next", "MS"},
+    {"duration", 0, 0, G_OPTION_ARG_INT, &duration, "Seconds to run for, 0 until interrupted", "S"},
+    {NULL}};
 
 #define WEBSOCKET_URI_DEFAULT "ws://127.0.0.1:8080/ws"
 
-//!@todo Don't use global state
-static SoupWebsocketConnection *ws = NULL;
-static GstElement *pipeline = NULL;
-static GstElement *webrtcbin = NULL;
-static GstWebRTCDataChannel *datachannel = NULL;
+/*!
+ * One synthetic headset. The main loop owns the connection, the stats are fed from the streaming threads.
+ */
+struct load_client
+{
+	guint index;
+
+	SoupWebsocketConnection *ws;
+	GstElement *pipeline;
+	GstElement *webrtcbin;
+	GstWebRTCDataChannel *datachannel;
+	//! Unordered and without retransmits, NULL if the server has none.
+	GstWebRTCDataChannel *tracking_channel;
+	//! The depayloader, keyframe requests go upstream from it.
+	GstElement *depay;
+
+	guint tracking_src_id;
+	guint keyframe_src_id;
+
+	int64_t up_message_id;
+	int64_t tracking_sequence;
+	//! Newest frame already acknowledged with an UpFrameMessage.
+	int64_t acked_frame_id;
+	gint64 last_stats_us;
+
+	//! Locks everything below, written by the streaming threads.
+	GMutex mutex;
+
+	gint64 connect_start_us;
+	//! 0 until the first frame came out of the parser.
+	gint64 first_frame_us;
+
+	guint64 frames;
+	guint64 frames_reported;
+	guint64 bytes;
+	guint64 keyframes;
+
+	//! By frame_sequence_id from the DownMessages.
+	struct em_sequence_tracker tracker;
+	int64_t newest_frame_id;
+	gint64 newest_frame_depay_us;
+
+	//! When the keyframe asked for was, 0 if none is outstanding.
+	gint64 keyframe_request_us;
+	guint keyframe_latency_count;
+	gint64 keyframe_latency_sum_us;
+	gint64 keyframe_latency_max_us;
+};
+
+static SoupSession *soup_session = NULL;
+static struct load_client *clients = NULL;
+static gint64 start_us = 0;
 
 
 /*
  *
- * Data channel functions.
+ * Helper functions.
  *
  */
 
 static void
-data_channel_error_cb(GstWebRTCDataChannel *datachannel, void *data)
+send_json(struct load_client *client, JsonBuilder *builder)
+{
+	JsonNode *root = json_builder_get_root(builder);
+	gchar *msg_str = json_to_string(root, TRUE);
+	soup_websocket_connection_send_text(client->ws, msg_str);
+	g_free(msg_str);
+	json_node_unref(root);
+}
+
+//! Our clock for all the times in UpMessages, like the OpenXR time domain on a headset it is monotonic.
+static int64_t
+now_ns(void)
 {
-	U_LOG_E("Error");
-	abort();
+	return g_get_monotonic_time() * 1000;
 }
 
 static void
-data_channel_close_cb(GstWebRTCDataChannel *datachannel, gpointer timeout_src_id)
+send_up_message(struct load_client *client, GstWebRTCDataChannel *channel, em_proto_UpMessage *msg)
 {
-	U_LOG_I("Data channel closed");
+	uint8_t buffer[em_proto_UpMessage_size + 10];
 
-	g_source_remove(GPOINTER_TO_UINT(timeout_src_id));
-	g_clear_object(&datachannel);
+	msg->up_message_id = client->up_message_id++;
+
+	pb_ostream_t os = pb_ostream_from_buffer(buffer, sizeof(buffer));
+	if (!pb_encode(&os, em_proto_UpMessage_fields, msg)) {
+		U_LOG_E("Client %u: Failed to encode protobuf: %s", client->index, PB_GET_ERROR(&os));
+		return;
+	}
+
+	GBytes *bytes = g_bytes_new(buffer, os.bytes_written);
+	gst_webrtc_data_channel_send_data(channel, bytes);
+	g_bytes_unref(bytes);
 }
 
 static void
-data_channel_message_data_cb(GstWebRTCDataChannel *datachannel, GBytes *data, void *user_data)
+set_pose(em_proto_Pose *pose, float x, float y, float z)
 {
-	U_LOG_I("Received data channel message data: %u", (uint32_t)g_bytes_get_size(data));
+	pose->has_position = true;
+	pose->position.x = x;
+	pose->position.y = y;
+	pose->position.z = z;
+	pose->has_orientation = true;
+	pose->orientation.w = 1.0f;
 }
 
-static void
-data_channel_message_string_cb(GstWebRTCDataChannel *datachannel, gchar *str, void *user_data)
+
+/*
+ *
+ * Synthetic headset traffic.
+ *
+ */
+
+//! Ticks at the tracking rate, like the pose loop of a headset, and acknowledges the frames that arrived since.
+static gboolean
+tracking_tick_cb(gpointer user_data)
 {
-	U_LOG_I("Received data channel message string: %s", str);
+	struct load_client *client = user_data;
+	if (client->datachannel == NULL) {
+		return G_SOURCE_CONTINUE;
+	}
+
+	int64_t now = now_ns();
+
+	// A slow sway, so the server has some motion to render.
+	double t = (double)now / 1e9;
+	float sway = (float)(0.05 * sin(t + client->index));
+
+	em_proto_UpMessage msg = em_proto_UpMessage_init_default;
+	msg.has_tracking = true;
+	msg.tracking.has_P_localSpace_viewSpace = true;
+	set_pose(&msg.tracking.P_localSpace_viewSpace, sway, 1.6f, 0.0f);
+	msg.tracking.has_P_viewSpace_view0 = true;
+	set_pose(&msg.tracking.P_viewSpace_view0, -0.032f, 0.0f, 0.0f);
+	msg.tracking.has_P_viewSpace_view1 = true;
+	set_pose(&msg.tracking.P_viewSpace_view1, 0.032f, 0.0f, 0.0f);
+	msg.tracking.timestamp = now;
+	msg.tracking.sequence_idx = client->tracking_sequence++;
+
+	GstWebRTCDataChannel *tracking =
+	    client->tracking_channel != NULL ? client->tracking_channel : client->datachannel;
+	send_up_message(client, tracking, &msg);
+
+	g_mutex_lock(&client->mutex);
+	int64_t frame_id = client->newest_frame_id;
+	gint64 depay_us = client->newest_frame_depay_us;
+	struct em_sequence_stats stats = client->tracker.stats;
+	g_mutex_unlock(&client->mutex);
+
+	// What a headset sends once it displayed the frame, the server measures its latency from these.
+	if (frame_id > client->acked_frame_id) {
+		client->acked_frame_id = frame_id;
+
+		em_proto_UpMessage frame = em_proto_UpMessage_init_default;
+		frame.has_frame = true;
+		frame.frame.frame_sequence_id = frame_id;
+		frame.frame.depay_time = depay_us * 1000;
+		frame.frame.decode_complete_time = depay_us * 1000;
+		frame.frame.begin_frame_time = now;
+		frame.frame.display_time = now;
+		send_up_message(client, client->datachannel, &frame);
+	}
+
+	gint64 now_us = g_get_monotonic_time();
+	if (now_us - client->last_stats_us >= G_USEC_PER_SEC) {
+		client->last_stats_us = now_us;
+
+		em_proto_UpMessage report = em_proto_UpMessage_init_default;
+		report.has_stream_stats = true;
+		report.stream_stats.frames_received = stats.received;
+		report.stream_stats.frames_lost = stats.lost;
+		report.stream_stats.frames_late = stats.late;
+		report.stream_stats.frames_duplicated = stats.duplicates;
+		report.stream_stats.max_reorder_depth = stats.max_reorder_depth;
+		report.stream_stats.max_loss_burst = stats.max_loss_burst;
+		send_up_message(client, client->datachannel, &report);
+	}
+
+	return G_SOURCE_CONTINUE;
 }
 
+//! Asks for a keyframe the way a decoder that lost its reference does, webrtcbin turns it into a PLI.
 static gboolean
-datachannel_send_message(gpointer unused)
+keyframe_tick_cb(gpointer user_data)
 {
-	g_signal_emit_by_name(datachannel, "send-string", "Hi! from EMS test client");
+	struct load_client *client = user_data;
+	if (client->depay == NULL) {
+		return G_SOURCE_CONTINUE;
+	}
+
+	g_mutex_lock(&client->mutex);
+	bool outstanding = client->keyframe_request_us != 0;
+	if (!outstanding) {
+		client->keyframe_request_us = g_get_monotonic_time();
+	}
+	g_mutex_unlock(&client->mutex);
+
+	// Still waiting for the last one, that latency is what we want to see.
+	if (!outstanding) {
+		gst_element_send_event(client->depay,
+		                       gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+	}
 
 	return G_SOURCE_CONTINUE;
 }
 
+
+/*
+ *
+ * Stream functions.
+ *
+ */
+
+static GstPadProbeReturn
+depay_sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct load_client *client = user_data;
+	GstBuffer *buffer = gst_pad_probe_info_get_buffer(info);
+
+	GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+	if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp)) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	// The DownMessage is split over the one-byte header extensions of the last packet of a frame.
+	guint8 data[em_proto_DownMessage_size];
+	gsize total = 0;
+	gpointer ext;
+	guint size;
+	for (guint i = 0;
+	     gst_rtp_buffer_get_extension_onebyte_header(&rtp, RTP_DOWN_MESSAGE_HDR_EXT_ID, i, &ext, &size); i++) {
+		if (total + size > sizeof(data)) {
+			total = 0;
+			break;
+		}
+		memcpy(data + total, ext, size);
+		total += size;
+	}
+	gst_rtp_buffer_unmap(&rtp);
+
+	em_proto_DownMessage msg = em_proto_DownMessage_init_default;
+	bool have_frame = false;
+	if (total > 0) {
+		pb_istream_t is = pb_istream_from_buffer(data, total);
+		have_frame = pb_decode_ex(&is, em_proto_DownMessage_fields, &msg, PB_DECODE_NULLTERMINATED) &&
+		             msg.has_frame_data;
+	}
+
+	g_mutex_lock(&client->mutex);
+	client->bytes += gst_buffer_get_size(buffer);
+	if (have_frame) {
+		em_sequence_tracker_add(&client->tracker, msg.frame_data.frame_sequence_id);
+		if (msg.frame_data.frame_sequence_id > client->newest_frame_id) {
+			client->newest_frame_id = msg.frame_data.frame_sequence_id;
+			client->newest_frame_depay_us = g_get_monotonic_time();
+		}
+	}
+	g_mutex_unlock(&client->mutex);
+
+	return GST_PAD_PROBE_OK;
+}
+
+//! Sees whole frames, keyframes without the delta unit flag.
+static GstPadProbeReturn
+parse_src_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct load_client *client = user_data;
+	GstBuffer *buffer = gst_pad_probe_info_get_buffer(info);
+	bool keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+	gint64 now_us = g_get_monotonic_time();
+
+	g_mutex_lock(&client->mutex);
+	client->frames++;
+	if (client->first_frame_us == 0) {
+		client->first_frame_us = now_us;
+	}
+	if (keyframe) {
+		client->keyframes++;
+
+		// The periodic ones answer requests too, a client waiting for one does not care.
+		if (client->keyframe_request_us != 0) {
+			gint64 latency_us = now_us - client->keyframe_request_us;
+			client->keyframe_latency_count++;
+			client->keyframe_latency_sum_us += latency_us;
+			client->keyframe_latency_max_us = MAX(client->keyframe_latency_max_us, latency_us);
+			client->keyframe_request_us = 0;
+		}
+	}
+	g_mutex_unlock(&client->mutex);
+
+	return GST_PAD_PROBE_OK;
+}
+
+static void
+webrtc_pad_added_cb(GstElement *webrtcbin, GstPad *pad, struct load_client *client)
+{
+	if (GST_PAD_DIRECTION(pad) != GST_PAD_SRC) {
+		return;
+	}
+
+	GstCaps *caps = gst_pad_query_caps(pad, NULL);
+	const gchar *encoding_name = NULL;
+	if (!gst_caps_is_empty(caps)) {
+		encoding_name = gst_structure_get_string(gst_caps_get_structure(caps, 0), "encoding-name");
+	}
+
+	const gchar *depay = NULL;
+	const gchar *parse = NULL;
+	const gchar *decoder = NULL;
+	if (g_strcmp0(encoding_name, "H264") == 0) {
+		depay = "rtph264depay";
+		parse = "h264parse";
+		decoder = "avdec_h264";
+	} else if (g_strcmp0(encoding_name, "H265") == 0) {
+		depay = "rtph265depay";
+		parse = "h265parse";
+		decoder = "avdec_h265";
+	} else if (g_strcmp0(encoding_name, "AV1") == 0) {
+		depay = "rtpav1depay";
+		parse = "av1parse";
+		decoder = "dav1ddec";
+	}
+	if (depay == NULL) {
+		U_LOG_E("Client %u: Can't handle %s", client->index, encoding_name != NULL ? encoding_name : "(none)");
+		gst_caps_unref(caps);
+		return;
+	}
+	gst_caps_unref(caps);
+
+	gchar *description = g_strdup_printf("%s name=depay ! %s name=parse ! %s%s fakesink sync=false async=false",
+	                                     depay, parse, decode ? decoder : "", decode ? " !" : "");
+
+	GError *error = NULL;
+	GstElement *bin = gst_parse_bin_from_description(description, TRUE, &error);
+	g_free(description);
+	if (bin == NULL) {
+		U_LOG_E("Client %u: %s", client->index, error->message);
+		g_clear_error(&error);
+		return;
+	}
+	gst_bin_add(GST_BIN(client->pipeline), bin);
+
+	client->depay = gst_bin_get_by_name(GST_BIN(bin), "depay");
+	GstPad *depay_sink = gst_element_get_static_pad(client->depay, "sink");
+	gst_pad_add_probe(depay_sink, GST_PAD_PROBE_TYPE_BUFFER, depay_sink_probe, client, NULL);
+	gst_object_unref(depay_sink);
+
+	GstElement *parser = gst_bin_get_by_name(GST_BIN(bin), "parse");
+	GstPad *parse_src = gst_element_get_static_pad(parser, "src");
+	gst_pad_add_probe(parse_src, GST_PAD_PROBE_TYPE_BUFFER, parse_src_probe, client, NULL);
+	gst_object_unref(parse_src);
+	gst_object_unref(parser);
+
+	gst_element_sync_state_with_parent(bin);
+
+	GstPad *bin_sink = gst_element_get_static_pad(bin, "sink");
+	if (gst_pad_link(pad, bin_sink) != GST_PAD_LINK_OK) {
+		U_LOG_E("Client %u: Failed to link webrtcbin", client->index);
+	}
+	gst_object_unref(bin_sink);
+}
+
+
+/*
+ *
+ * Data channel functions.
+ *
+ */
+
+static void
+data_channel_error_cb(GstWebRTCDataChannel *datachannel, struct load_client *client)
+{
+	U_LOG_E("Client %u: Data channel error", client->index);
+}
+
 static void
-webrtc_on_data_channel_cb(GstElement *webrtcbin, GstWebRTCDataChannel *data_channel, void *user_data)
+data_channel_close_cb(GstWebRTCDataChannel *datachannel, struct load_client *client)
 {
-	guint timeout_src_id;
+	U_LOG_I("Client %u: Data channel closed", client->index);
 
-	U_LOG_I("Successfully created datachannel");
+	g_clear_handle_id(&client->tracking_src_id, g_source_remove);
+	g_clear_handle_id(&client->keyframe_src_id, g_source_remove);
+}
+
+static void
+webrtc_on_data_channel_cb(GstElement *webrtcbin, GstWebRTCDataChannel *data_channel, struct load_client *client)
+{
+	gchar *label = NULL;
+	g_object_get(data_channel, "label", &label, NULL);
+	bool tracking = g_strcmp0(label, TRACKING_DATA_CHANNEL_LABEL) == 0;
+	g_free(label);
+
+	if (tracking) {
+		g_assert_null(client->tracking_channel);
+		client->tracking_channel = g_object_ref(data_channel);
+		return;
+	}
 
-	g_assert_null(datachannel);
+	U_LOG_I("Client %u: Data channel open", client->index);
 
-	datachannel = GST_WEBRTC_DATA_CHANNEL(data_channel);
+	g_assert_null(client->datachannel);
+	client->datachannel = g_object_ref(data_channel);
 
-	timeout_src_id = g_timeout_add_seconds(3, datachannel_send_message, NULL);
+	g_signal_connect(client->datachannel, "on-close", G_CALLBACK(data_channel_close_cb), client);
+	g_signal_connect(client->datachannel, "on-error", G_CALLBACK(data_channel_error_cb), client);
 
-	g_signal_connect(datachannel, "on-close", G_CALLBACK(data_channel_close_cb), GUINT_TO_POINTER(timeout_src_id));
-	g_signal_connect(datachannel, "on-error", G_CALLBACK(data_channel_error_cb), GUINT_TO_POINTER(timeout_src_id));
-	g_signal_connect(datachannel, "on-message-data", G_CALLBACK(data_channel_message_data_cb), NULL);
-	g_signal_connect(datachannel, "on-message-string", G_CALLBACK(data_channel_message_string_cb), NULL);
+	client->tracking_src_id = g_timeout_add(1000 / MAX(tracking_rate, 1), tracking_tick_cb, client);
+	if (keyframe_interval > 0) {
+		client->keyframe_src_id = g_timeout_add_seconds(keyframe_interval, keyframe_tick_cb, client);
+	}
 }
 
 
@@ -115,7 +492,8 @@ sigint_handler(gpointer user_data)
 static gboolean
 gst_bus_cb(GstBus *bus, GstMessage *message, gpointer data)
 {
-	GstBin *pipeline = GST_BIN(data);
+	struct load_client *client = data;
+	GstBin *pipeline = GST_BIN(client->pipeline);
 
 	switch (GST_MESSAGE_TYPE(message)) {
 	case GST_MESSAGE_ERROR: {
@@ -123,7 +501,8 @@ gst_bus_cb(GstBus *bus, GstMessage *message, gpointer data)
 		gchar *debug_msg;
 		gst_message_parse_error(message, &gerr, &debug_msg);
 		GST_DEBUG_BIN_TO_DOT_FILE(pipeline, GST_DEBUG_GRAPH_SHOW_ALL, "mss-pipeline-ERROR");
-		g_error("Error: %s (%s)", gerr->message, debug_msg);
+		// One broken client should not take down the measurement of the others.
+		U_LOG_E("Client %u: Error: %s (%s)", client->index, gerr->message, debug_msg);
 		g_error_free(gerr);
 		g_free(debug_msg);
 	} break;
@@ -132,28 +511,22 @@ gst_bus_cb(GstBus *bus, GstMessage *message, gpointer data)
 		gchar *debug_msg;
 		gst_message_parse_warning(message, &gerr, &debug_msg);
 		GST_DEBUG_BIN_TO_DOT_FILE(pipeline, GST_DEBUG_GRAPH_SHOW_ALL, "mss-pipeline-WARNING");
-		g_warning("Warning: %s (%s)", gerr->message, debug_msg);
+		U_LOG_W("Client %u: Warning: %s (%s)", client->index, gerr->message, debug_msg);
 		g_error_free(gerr);
 		g_free(debug_msg);
 	} break;
 	case GST_MESSAGE_EOS: {
-		g_error("Got EOS!!");
+		U_LOG_W("Client %u: Got EOS", client->index);
 	} break;
 	default: break;
 	}
 	return TRUE;
 }
 
-void
-send_sdp_answer(const gchar *sdp)
+static void
+send_sdp_answer(struct load_client *client, const gchar *sdp)
 {
-	JsonBuilder *builder;
-	JsonNode *root;
-	gchar *msg_str;
-
-	g_print("Send answer: %s\n", sdp);
-
-	builder = json_builder_new();
+	JsonBuilder *builder = json_builder_new();
 	json_builder_begin_object(builder);
 	json_builder_set_member_name(builder, "msg");
 	json_builder_add_string_value(builder, "answer");
@@ -162,26 +535,14 @@ send_sdp_answer(const gchar *sdp)
 	json_builder_add_string_value(builder, sdp);
 	json_builder_end_object(builder);
 
-	root = json_builder_get_root(builder);
-
-	msg_str = json_to_string(root, TRUE);
-	soup_websocket_connection_send_text(ws, msg_str);
-	g_clear_pointer(&msg_str, g_free);
-
-	json_node_unref(root);
+	send_json(client, builder);
 	g_object_unref(builder);
 }
 
 static void
-webrtc_on_ice_candidate_cb(GstElement *webrtcbin, guint mlineindex, gchar *candidate)
+webrtc_on_ice_candidate_cb(GstElement *webrtcbin, guint mlineindex, gchar *candidate, struct load_client *client)
 {
-	JsonBuilder *builder;
-	JsonNode *root;
-	gchar *msg_str;
-
-	g_print("Send candidate: %u %s\n", mlineindex, candidate);
-
-	builder = json_builder_new();
+	JsonBuilder *builder = json_builder_new();
 	json_builder_begin_object(builder);
 	json_builder_set_member_name(builder, "msg");
 	json_builder_add_string_value(builder, "candidate");
@@ -195,42 +556,35 @@ webrtc_on_ice_candidate_cb(GstElement *webrtcbin, guint mlineindex, gchar *candi
 	json_builder_end_object(builder);
 	json_builder_end_object(builder);
 
-	root = json_builder_get_root(builder);
-
-	msg_str = json_to_string(root, TRUE);
-	soup_websocket_connection_send_text(ws, msg_str);
-	g_clear_pointer(&msg_str, g_free);
-
-	json_node_unref(root);
+	send_json(client, builder);
 	g_object_unref(builder);
 }
 
 static void
 on_answer_created(GstPromise *promise, gpointer user_data)
 {
+	struct load_client *client = user_data;
 	GstWebRTCSessionDescription *answer = NULL;
 	gchar *sdp;
 
 	gst_structure_get(gst_promise_get_reply(promise), "answer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &answer, NULL);
 	gst_promise_unref(promise);
 
-	g_signal_emit_by_name(webrtcbin, "set-local-description", answer, NULL);
+	g_signal_emit_by_name(client->webrtcbin, "set-local-description", answer, NULL);
 
 	sdp = gst_sdp_message_as_text(answer->sdp);
-	send_sdp_answer(sdp);
+	send_sdp_answer(client, sdp);
 	g_free(sdp);
 
 	gst_webrtc_session_description_free(answer);
 }
 
 static void
-process_sdp_offer(const gchar *sdp)
+process_sdp_offer(struct load_client *client, const gchar *sdp)
 {
 	GstSDPMessage *sdp_msg = NULL;
 	GstWebRTCSessionDescription *desc = NULL;
 
-	g_print("Received offer: %s\n", sdp);
-
 	if (gst_sdp_message_new_from_text(sdp, &sdp_msg) != GST_SDP_OK) {
 		g_debug("Error parsing SDP description");
 		goto out;
@@ -242,14 +596,14 @@ process_sdp_offer(const gchar *sdp)
 
 		promise = gst_promise_new();
 
-		g_signal_emit_by_name(webrtcbin, "set-remote-description", desc, promise);
+		g_signal_emit_by_name(client->webrtcbin, "set-remote-description", desc, promise);
 
 		gst_promise_wait(promise);
 		gst_promise_unref(promise);
 
 		g_signal_emit_by_name(
-		    webrtcbin, "create-answer", NULL,
-		    gst_promise_new_with_change_func((GstPromiseChangeFunc)on_answer_created, NULL, NULL));
+		    client->webrtcbin, "create-answer", NULL,
+		    gst_promise_new_with_change_func((GstPromiseChangeFunc)on_answer_created, client, NULL));
 	} else {
 		gst_sdp_message_free(sdp_msg);
 	}
@@ -258,17 +612,10 @@ out:
 	g_clear_pointer(&desc, gst_webrtc_session_description_free);
 }
 
-static void
-process_candidate(guint mlineindex, const gchar *candidate)
-{
-	g_print("Received candidate: %d %s\n", mlineindex, candidate);
-
-	g_signal_emit_by_name(webrtcbin, "add-ice-candidate", mlineindex, candidate);
-}
-
 static void
 message_cb(SoupWebsocketConnection *connection, gint type, GBytes *message, gpointer user_data)
 {
+	struct load_client *client = user_data;
 	gsize length = 0;
 	const gchar *msg_data = g_bytes_get_data(message, &length);
 	JsonParser *parser = json_parser_new();
@@ -284,18 +631,18 @@ message_cb(SoupWebsocketConnection *connection, gint type, GBytes *message, gpoi
 		}
 
 		msg_type = json_object_get_string_member(msg, "msg");
-		g_print("Websocket message received: %s\n", msg_type);
 
 		if (g_str_equal(msg_type, "offer")) {
 			const gchar *offer_sdp = json_object_get_string_member(msg, "sdp");
-			process_sdp_offer(offer_sdp);
+			process_sdp_offer(client, offer_sdp);
 		} else if (g_str_equal(msg_type, "candidate")) {
 			JsonObject *candidate;
 
 			candidate = json_object_get_object_member(msg, "candidate");
 
-			process_candidate(json_object_get_int_member(candidate, "sdpMLineIndex"),
-			                  json_object_get_string_member(candidate, "candidate"));
+			g_signal_emit_by_name(client->webrtcbin, "add-ice-candidate",
+			                      (guint)json_object_get_int_member(candidate, "sdpMLineIndex"),
+			                      json_object_get_string_member(candidate, "candidate"));
 		}
 	} else {
 		g_debug("Error parsing message: %s", error->message);
@@ -306,44 +653,161 @@ out:
 	g_object_unref(parser);
 }
 
+static void
+client_teardown(struct load_client *client)
+{
+	g_clear_handle_id(&client->tracking_src_id, g_source_remove);
+	g_clear_handle_id(&client->keyframe_src_id, g_source_remove);
+
+	if (client->pipeline != NULL) {
+		gst_element_set_state(client->pipeline, GST_STATE_NULL);
+	}
+	gst_clear_object(&client->depay);
+	gst_clear_object(&client->webrtcbin);
+	gst_clear_object(&client->pipeline);
+	g_clear_object(&client->datachannel);
+	g_clear_object(&client->tracking_channel);
+	g_clear_object(&client->ws);
+}
+
+static void
+websocket_closed_cb(SoupWebsocketConnection *connection, gpointer user_data)
+{
+	struct load_client *client = user_data;
+	U_LOG_W("Client %u: Websocket closed", client->index);
+	client_teardown(client);
+}
+
 static void
 websocket_connected_cb(GObject *session, GAsyncResult *res, gpointer user_data)
 {
+	struct load_client *client = user_data;
 	GError *error = NULL;
 
-	g_assert(!ws);
+	g_assert(!client->ws);
 
-	ws = soup_session_websocket_connect_finish(SOUP_SESSION(session), res, &error);
+	client->ws = soup_session_websocket_connect_finish(SOUP_SESSION(session), res, &error);
 	if (error) {
-		g_print("Error creating websocket: %s\n", error->message);
+		U_LOG_E("Client %u: Error creating websocket: %s", client->index, error->message);
 		g_clear_error(&error);
-	} else {
-		GstBus *bus;
+		return;
+	}
 
-		g_print("Websocket connected\n");
-		g_signal_connect(ws, "message", G_CALLBACK(message_cb), NULL);
+	U_LOG_I("Client %u: Websocket connected", client->index);
+	g_signal_connect(client->ws, "message", G_CALLBACK(message_cb), client);
+	g_signal_connect(client->ws, "closed", G_CALLBACK(websocket_closed_cb), client);
 
-		pipeline = gst_parse_launch(
-		    "webrtcbin name=webrtc bundle-policy=max-bundle ! "
-		    "rtph264depay ! "
-		    "h264parse ! "
-		    "avdec_h264 ! "
-		    "autovideosink",
-		    &error);
-		g_assert_no_error(error);
+	// The rest is added once webrtcbin knows the codec.
+	client->pipeline = gst_parse_launch("webrtcbin name=webrtc bundle-policy=max-bundle", &error);
+	g_assert_no_error(error);
 
-		// Connect callbacks on sinks.
-		webrtcbin = gst_bin_get_by_name(GST_BIN(pipeline), "webrtc");
+	client->webrtcbin = gst_bin_get_by_name(GST_BIN(client->pipeline), "webrtc");
 
-		g_signal_connect(webrtcbin, "on-data-channel", G_CALLBACK(webrtc_on_data_channel_cb), NULL);
-		g_signal_connect(webrtcbin, "on-ice-candidate", G_CALLBACK(webrtc_on_ice_candidate_cb), NULL);
+	g_signal_connect(client->webrtcbin, "on-data-channel", G_CALLBACK(webrtc_on_data_channel_cb), client);
+	g_signal_connect(client->webrtcbin, "on-ice-candidate", G_CALLBACK(webrtc_on_ice_candidate_cb), client);
+	g_signal_connect(client->webrtcbin, "pad-added", G_CALLBACK(webrtc_pad_added_cb), client);
 
-		bus = gst_element_get_bus(pipeline);
-		gst_bus_add_watch(bus, gst_bus_cb, pipeline);
-		gst_clear_object(&bus);
+	GstBus *bus = gst_element_get_bus(client->pipeline);
+	gst_bus_add_watch(bus, gst_bus_cb, client);
+	gst_clear_object(&bus);
 
-		g_assert(gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+	g_assert(gst_element_set_state(client->pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+}
+
+static gboolean
+connect_next_client_cb(gpointer user_data)
+{
+	static gint next = 0;
+
+	struct load_client *client = &clients[next++];
+	client->connect_start_us = g_get_monotonic_time();
+
+#if !SOUP_CHECK_VERSION(3, 0, 0)
+	soup_session_websocket_connect_async(soup_session,                                     // session
+	                                     soup_message_new(SOUP_METHOD_GET, websocket_uri), // message
+	                                     NULL,                                             // origin
+	                                     NULL,                                             // protocols
+	                                     NULL,                                             // cancellable
+	                                     websocket_connected_cb,                           // callback
+	                                     client);                                          // user_data
+
+#else
+	soup_session_websocket_connect_async(soup_session,                                     // session
+	                                     soup_message_new(SOUP_METHOD_GET, websocket_uri), // message
+	                                     NULL,                                             // origin
+	                                     NULL,                                             // protocols
+	                                     0,                                                // io_prority
+	                                     NULL,                                             // cancellable
+	                                     websocket_connected_cb,                           // callback
+	                                     client);                                          // user_data
+
+#endif
+
+	return next < client_count ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+
+/*
+ *
+ * Reporting.
+ *
+ */
+
+static void
+print_report(gdouble interval_s, bool final)
+{
+	guint64 total_frames = 0;
+	gdouble total_fps = 0.0;
+	guint streaming = 0;
+
+	g_print("%s after %.0f s:\n", final ? "Summary" : "Report", (gdouble)(g_get_monotonic_time() - start_us) / 1e6);
+
+	for (gint i = 0; i < client_count; i++) {
+		struct load_client *client = &clients[i];
+
+		g_mutex_lock(&client->mutex);
+		guint64 frames = client->frames;
+		guint64 new_frames = frames - client->frames_reported;
+		client->frames_reported = frames;
+		guint64 bytes = client->bytes;
+		guint64 keyframes = client->keyframes;
+		struct em_sequence_stats stats = client->tracker.stats;
+		gint64 ttff_us = client->first_frame_us != 0 ? client->first_frame_us - client->connect_start_us : -1;
+		guint kf_count = client->keyframe_latency_count;
+		gint64 kf_avg_us = kf_count > 0 ? client->keyframe_latency_sum_us / kf_count : 0;
+		gint64 kf_max_us = client->keyframe_latency_max_us;
+		g_mutex_unlock(&client->mutex);
+
+		// The summary averages over the whole run.
+		gdouble fps = final ? (gdouble)frames / interval_s : (gdouble)new_frames / interval_s;
+		total_frames += frames;
+		total_fps += fps;
+		if (frames > 0) {
+			streaming++;
+		}
+
+		gchar ttff[32] = "-";
+		if (ttff_us >= 0) {
+			g_snprintf(ttff, sizeof(ttff), "%.0f ms", (gdouble)ttff_us / 1000.0);
+		}
+
+		g_print("\tclient %2u: %6.1f fps, %" G_GUINT64_FORMAT " frames (%" G_GUINT64_FORMAT " key), %.1f MB, "
+		        "lost %" G_GUINT64_FORMAT " late %" G_GUINT64_FORMAT ", "
+		        "keyframe latency avg %.0f max %.0f ms (%u), first frame %s\n",
+		        client->index, fps, frames, keyframes, (gdouble)bytes / (1024.0 * 1024.0), stats.lost, stats.late,
+		        (gdouble)kf_avg_us / 1000.0, (gdouble)kf_max_us / 1000.0, kf_count, ttff);
 	}
+
+	g_print("\t%u of %d clients streaming, %.1f fps in total, %" G_GUINT64_FORMAT " frames.\n", streaming,
+	        client_count, total_fps, total_frames);
+}
+
+static gboolean
+report_cb(gpointer user_data)
+{
+	(void)user_data;
+	print_report(report_interval, false);
+	return G_SOURCE_CONTINUE;
 }
 
 int
@@ -351,12 +815,11 @@ main(int argc, char *argv[])
 {
 	GOptionContext *option_context;
 	GMainLoop *loop;
-	SoupSession *soup_session;
 	GError *error = NULL;
 
 	gst_init(&argc, &argv);
 
-	option_context = g_option_context_new(NULL);
+	option_context = g_option_context_new("- Synthetic headsets for loading an Electric Maple server");
 	g_option_context_add_main_entries(option_context, options, NULL);
 
 	if (!g_option_context_parse(option_context, &argc, &argv, &error)) {
@@ -367,34 +830,46 @@ main(int argc, char *argv[])
 	if (!websocket_uri) {
 		websocket_uri = g_strdup(WEBSOCKET_URI_DEFAULT);
 	}
+	client_count = MAX(client_count, 1);
+	report_interval = MAX(report_interval, 1);
+
+	clients = g_new0(struct load_client, client_count);
+	for (gint i = 0; i < client_count; i++) {
+		clients[i].index = (guint)i;
+		clients[i].acked_frame_id = -1;
+		clients[i].newest_frame_id = -1;
+		g_mutex_init(&clients[i].mutex);
+		em_sequence_tracker_reset(&clients[i].tracker);
+	}
 
 	soup_session = soup_session_new();
+	loop = g_main_loop_new(NULL, FALSE);
+	start_us = g_get_monotonic_time();
 
-#if !SOUP_CHECK_VERSION(3, 0, 0)
-	soup_session_websocket_connect_async(soup_session,                                     // session
-	                                     soup_message_new(SOUP_METHOD_GET, websocket_uri), // message
-	                                     NULL,                                             // origin
-	                                     NULL,                                             // protocols
-	                                     NULL,                                             // cancellable
-	                                     websocket_connected_cb,                           // callback
-	                                     NULL);                                            // user_data
-
-#else
-	soup_session_websocket_connect_async(soup_session,                                     // session
-	                                     soup_message_new(SOUP_METHOD_GET, websocket_uri), // message
-	                                     NULL,                                             // origin
-	                                     NULL,                                             // protocols
-	                                     0,                                                // io_prority
-	                                     NULL,                                             // cancellable
-	                                     websocket_connected_cb,                           // callback
-	                                     NULL);                                            // user_data
-
-#endif
+	// Staggered, all at once would measure the signaling rather than the streaming.
+	connect_next_client_cb(NULL);
+	if (client_count > 1) {
+		g_timeout_add(MAX(ramp_ms, 1), connect_next_client_cb, NULL);
+	}
+	g_timeout_add_seconds(report_interval, report_cb, NULL);
 
-	loop = g_main_loop_new(NULL, FALSE);
 	g_unix_signal_add(SIGINT, sigint_handler, loop);
+	if (duration > 0) {
+		g_timeout_add_seconds(duration, sigint_handler, loop);
+	}
 
 	g_main_loop_run(loop);
+
+	print_report((gdouble)(g_get_monotonic_time() - start_us) / 1e6, true);
+
+	for (gint i = 0; i < client_count; i++) {
+		client_teardown(&clients[i]);
+		g_mutex_clear(&clients[i].mutex);
+	}
+	g_free(clients);
+
 	g_main_loop_unref(loop);
+	g_object_unref(soup_session);
+	g_option_context_free(option_context);
 	g_clear_pointer(&websocket_uri, g_free);
 }